@@ -0,0 +1,233 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench/bench.h"
+#include "util/debug.h"
+#include "util/shims.h"
+#include "util/time_utils.h"
+
+
+#define BENCH_DEFAULT_WARMUP_NS ((int64_t)200000000)
+#define BENCH_DEFAULT_MIN_SAMPLE_NS ((int64_t)10000000)
+#define BENCH_DEFAULT_SAMPLES (15)
+
+/* never grow a warm up batch more than this much in one step. */
+#define BENCH_MAX_GROWTH (10)
+
+
+volatile uint64_t bench_sink = 0;
+
+
+/* time spent paused in the current batch. */
+static int64_t pause_start_ns = 0;
+static uint64_t pause_start_cycles = 0;
+static int64_t paused_ns = 0;
+static uint64_t paused_cycles = 0;
+
+
+
+void bench_options_init(struct bench_options_t *options)
+{
+    if(!options) {
+        return;
+    }
+
+    options->warmup_ns = BENCH_DEFAULT_WARMUP_NS;
+    options->min_sample_ns = BENCH_DEFAULT_MIN_SAMPLE_NS;
+    options->num_samples = BENCH_DEFAULT_SAMPLES;
+}
+
+
+void bench_pause(void)
+{
+    pause_start_cycles = CPU_CYCLES();
+    pause_start_ns = util_time_mono_ns();
+}
+
+
+void bench_resume(void)
+{
+    paused_ns += util_time_mono_ns() - pause_start_ns;
+    paused_cycles += CPU_CYCLES() - pause_start_cycles;
+}
+
+
+static void run_batch(const struct bench_t *bench, void *ctx, uint64_t iters, int64_t *ns, uint64_t *cycles)
+{
+    int64_t start_ns = 0;
+    uint64_t start_cycles = 0;
+
+    paused_ns = 0;
+    paused_cycles = 0;
+
+    start_ns = util_time_mono_ns();
+    start_cycles = CPU_CYCLES();
+
+    bench->run(ctx, iters);
+
+    *cycles = CPU_CYCLES() - start_cycles - paused_cycles;
+    *ns = util_time_mono_ns() - start_ns - paused_ns;
+
+    if(*ns <= 0) {
+        *ns = 1;
+    }
+}
+
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+
+    return (da < db ? -1 : (da > db ? 1 : 0));
+}
+
+
+status_t bench_run(const struct bench_t *bench, const struct bench_options_t *options, struct bench_result_t *result)
+{
+    status_t rc = STATUS_OK;
+    void *ctx = NULL;
+    uint64_t iters = 1;
+    int64_t warmup_start_ns = 0;
+    double ns_per_op[BENCH_MAX_SAMPLES];
+    double cycles_per_op[BENCH_MAX_SAMPLES];
+
+    if(!bench || !options || !result) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(options->num_samples == 0 || options->num_samples > BENCH_MAX_SAMPLES) {
+        warn("Need between 1 and %d samples!", BENCH_MAX_SAMPLES);
+        return STATUS_BAD_INPUT;
+    }
+
+    memset(result, 0, sizeof(*result));
+    result->name = bench->name;
+
+    if(bench->setup && (rc = bench->setup(&ctx)) != STATUS_OK) {
+        warn("Setup of benchmark %s failed with error %s!", bench->name, status_to_str(rc));
+        return rc;
+    }
+
+    /*
+     * Warm up caches, branch predictors and the CPU clock while finding a
+     * batch size that is long enough to time well.
+     */
+    warmup_start_ns = util_time_mono_ns();
+
+    while(true) {
+        int64_t ns = 0;
+        uint64_t cycles = 0;
+
+        run_batch(bench, ctx, iters, &ns, &cycles);
+
+        if(ns < options->min_sample_ns) {
+            uint64_t growth = (uint64_t)(options->min_sample_ns / ns) + 1;
+
+            iters *= (growth > BENCH_MAX_GROWTH ? BENCH_MAX_GROWTH : growth);
+        } else if(util_time_mono_ns() - warmup_start_ns >= options->warmup_ns) {
+            break;
+        }
+    }
+
+    for(uint32_t i = 0; i < options->num_samples; i++) {
+        int64_t ns = 0;
+        uint64_t cycles = 0;
+
+        run_batch(bench, ctx, iters, &ns, &cycles);
+
+        ns_per_op[i] = (double)ns / (double)iters;
+        cycles_per_op[i] = (double)cycles / (double)iters;
+    }
+
+    if(bench->teardown) {
+        bench->teardown(ctx);
+    }
+
+    qsort(ns_per_op, options->num_samples, sizeof(ns_per_op[0]), compare_doubles);
+    qsort(cycles_per_op, options->num_samples, sizeof(cycles_per_op[0]), compare_doubles);
+
+    result->iters_per_sample = iters;
+    result->num_samples = options->num_samples;
+    result->ns_per_op = ns_per_op[options->num_samples / 2];
+    result->ns_per_op_min = ns_per_op[0];
+    result->ns_per_op_max = ns_per_op[options->num_samples - 1];
+    result->cycles_per_op = cycles_per_op[options->num_samples / 2];
+
+    return STATUS_OK;
+}
+
+
+
+void bench_report_header(FILE *out, bench_format_t format)
+{
+    switch(format) {
+        case BENCH_FORMAT_CSV:
+            fprintf(out, "name,iters_per_sample,samples,ns_per_op,ns_per_op_min,ns_per_op_max,cycles_per_op\n");
+            break;
+
+        case BENCH_FORMAT_JSON:
+            fprintf(out, "{\n  \"has_cycles\": %s,\n  \"benchmarks\": [\n", (HAVE_CPU_CYCLES ? "true" : "false"));
+            break;
+
+        case BENCH_FORMAT_TEXT:
+        default:
+            fprintf(out, "%-24s %12s %12s %12s %12s %12s %10s\n", "benchmark", "ns/op", "min", "max", "cycles/op", "iters", "change");
+            break;
+    }
+}
+
+
+void bench_report_result(FILE *out, bench_format_t format, const struct bench_result_t *result, bool first)
+{
+    switch(format) {
+        case BENCH_FORMAT_CSV:
+            fprintf(out, "%s,%llu,%u,%.3f,%.3f,%.3f,%.3f\n", result->name, (unsigned long long)result->iters_per_sample, result->num_samples,
+                    result->ns_per_op, result->ns_per_op_min, result->ns_per_op_max, result->cycles_per_op);
+            break;
+
+        case BENCH_FORMAT_JSON:
+            fprintf(out, "%s    { \"name\": \"%s\", \"iters_per_sample\": %llu, \"samples\": %u, \"ns_per_op\": %.3f, \"ns_per_op_min\": %.3f, \"ns_per_op_max\": %.3f, \"cycles_per_op\": %.3f }",
+                    (first ? "" : ",\n"), result->name, (unsigned long long)result->iters_per_sample, result->num_samples,
+                    result->ns_per_op, result->ns_per_op_min, result->ns_per_op_max, result->cycles_per_op);
+            break;
+
+        case BENCH_FORMAT_TEXT:
+        default:
+            fprintf(out, "%-24s %12.2f %12.2f %12.2f %12.1f %12llu", result->name, result->ns_per_op, result->ns_per_op_min, result->ns_per_op_max,
+                    result->cycles_per_op, (unsigned long long)result->iters_per_sample);
+
+            if(result->baseline_ns_per_op > 0.0) {
+                fprintf(out, " %+9.1f%%\n", 100.0 * (result->ns_per_op - result->baseline_ns_per_op) / result->baseline_ns_per_op);
+            } else {
+                fprintf(out, " %10s\n", "-");
+            }
+
+            break;
+    }
+}
+
+
+void bench_report_footer(FILE *out, bench_format_t format)
+{
+    if(format == BENCH_FORMAT_JSON) {
+        fprintf(out, "\n  ]\n}\n");
+    }
+}
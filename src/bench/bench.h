@@ -0,0 +1,108 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util/status.h"
+
+
+/*
+ * A small microbenchmark harness.
+ *
+ * Each benchmark runs its operation in batches.  Batches double in size
+ * during warm up until one takes at least the minimum sample time, then a
+ * fixed number of samples is taken at that size and the median reported.
+ */
+
+#define BENCH_MAX_SAMPLES (101)
+
+typedef enum {
+    BENCH_FORMAT_TEXT,
+    BENCH_FORMAT_CSV,
+    BENCH_FORMAT_JSON,
+} bench_format_t;
+
+
+/* set up the benchmark state, run iters operations, tear the state down. */
+typedef status_t (*bench_setup_func_t)(void **ctx);
+typedef void (*bench_run_func_t)(void *ctx, uint64_t iters);
+typedef void (*bench_teardown_func_t)(void *ctx);
+
+struct bench_t {
+    const char *name;
+    const char *description;
+
+    bench_setup_func_t setup;
+    bench_run_func_t run;
+    bench_teardown_func_t teardown;
+};
+
+
+struct bench_options_t {
+    int64_t warmup_ns;
+    int64_t min_sample_ns;
+    uint32_t num_samples;
+};
+
+
+struct bench_result_t {
+    const char *name;
+    uint64_t iters_per_sample;
+    uint32_t num_samples;
+
+    double ns_per_op;
+    double ns_per_op_min;
+    double ns_per_op_max;
+
+    /* zero if the platform has no cycle counter. */
+    double cycles_per_op;
+
+    /* ns/op from an earlier run to compare against, zero if there is none. */
+    double baseline_ns_per_op;
+};
+
+
+/* results of benchmark operations go here so the compiler cannot drop the work. */
+extern volatile uint64_t bench_sink;
+
+/* make the compiler assume the memory at ptr was read and changed. */
+#ifdef IS_WINDOWS
+    #include <intrin.h>
+    #define BENCH_CLOBBER(ptr) do { (void)(ptr); _ReadWriteBarrier(); } while(0)
+#else
+    #define BENCH_CLOBBER(ptr) __asm__ volatile("" : : "r"(ptr) : "memory")
+#endif
+
+extern void bench_options_init(struct bench_options_t *options);
+
+/* leave setup work done inside a run out of the timing. */
+extern void bench_pause(void);
+extern void bench_resume(void);
+
+extern status_t bench_run(const struct bench_t *bench, const struct bench_options_t *options, struct bench_result_t *result);
+
+extern void bench_report_header(FILE *out, bench_format_t format);
+extern void bench_report_result(FILE *out, bench_format_t format, const struct bench_result_t *result, bool first);
+extern void bench_report_footer(FILE *out, bench_format_t format);
+
+
+/* the benchmarks themselves. */
+extern const struct bench_t bench_cases[];
+extern const size_t bench_num_cases;
@@ -0,0 +1,683 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <sys/socket.h>
+#endif
+
+#include "bench/bench.h"
+#include "cip/cip.h"
+#include "device/device.h"
+#include "eip/eip.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/pool.h"
+#include "util/proactor_net.h"
+#include "util/time_utils.h"
+
+
+/* enough tags that lookups miss in L1 like a real controller's would. */
+#define BENCH_NUM_TAGS (10000)
+#define BENCH_TAG_NAME_MAX (16)
+
+#define BENCH_POOL_BLOCKS (64)
+#define BENCH_POOL_BLOCK_SIZE (512)
+
+#define BENCH_ECHO_ADDRESS "127.0.0.1"
+#define BENCH_ECHO_PORT (47818)
+#define BENCH_ECHO_SIZE (64)
+
+/* long enough that no tick timeout lands inside a timed batch. */
+#define BENCH_PROACTOR_TICK_MS (1000)
+
+
+
+/*
+ * buf.h encode and decode, one full encapsulation header worth of fields.
+ */
+
+static void run_buf_codec(void *ctx, uint64_t iters)
+{
+    uint8_t buf[EIP_ENCAP_HEADER_SIZE];
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        encode_uint16_le(buf + 0, (uint16_t)i);
+        encode_uint16_le(buf + 2, 24);
+        encode_uint32_le(buf + 4, (uint32_t)i);
+        encode_uint32_le(buf + 8, 0);
+        encode_uint64_le(buf + 12, i);
+        encode_uint32_le(buf + 20, 0);
+
+        sum += decode_uint16_le(buf + 0) + decode_uint16_le(buf + 2) + decode_uint32_le(buf + 4) + decode_uint32_le(buf + 8) + decode_uint64_le(buf + 12) + decode_uint32_le(buf + 20);
+
+        /* keep the compiler from folding the round trip away. */
+        BENCH_CLOBBER(buf);
+    }
+
+    bench_sink += sum;
+}
+
+
+
+/*
+ * EIP encapsulation header parse, as done for every received frame.
+ */
+
+static void run_eip_header(void *ctx, uint64_t iters)
+{
+    uint8_t frame[EIP_ENCAP_HEADER_SIZE + 16] = {0};
+    struct eip_header header;
+    uint64_t sum = 0;
+
+    encode_uint16_le(frame, EIP_CMD_SEND_RR_DATA);
+    encode_uint16_le(frame + 2, 16);
+    encode_uint32_le(frame + 4, 0x12345678);
+
+    for(uint64_t i = 0; i < iters; i++) {
+        BENCH_CLOBBER(frame);
+
+        if(eip_decode_header(frame, sizeof(frame), &header) == STATUS_OK) {
+            sum += header.encap_command + header.encap_length + header.encap_session_handle;
+        }
+
+        sum += eip_frame_length(frame, sizeof(frame));
+    }
+
+    bench_sink += sum;
+}
+
+
+
+/*
+ * Clock reads: the system monotonic clock, the calibrated TSC and the time
+ * cached per loop iteration.
+ */
+
+static void run_clock_monotonic(void *ctx, uint64_t iters)
+{
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        sum += (uint64_t)util_time_mono_ns();
+    }
+
+    bench_sink += sum;
+}
+
+
+static status_t setup_clock_tsc(void **ctx)
+{
+    return util_clock_use_tsc(true);
+}
+
+
+static void teardown_clock_tsc(void *ctx)
+{
+    util_clock_use_tsc(false);
+}
+
+
+static void run_clock(void *ctx, uint64_t iters)
+{
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        sum += (uint64_t)util_clock_ns();
+    }
+
+    bench_sink += sum;
+}
+
+
+static void run_clock_cached(void *ctx, uint64_t iters)
+{
+    uint64_t sum = 0;
+
+    util_clock_update();
+
+    for(uint64_t i = 0; i < iters; i++) {
+        sum += (uint64_t)util_clock_now_ns();
+        BENCH_CLOBBER(&util_clock_cached_ns);
+    }
+
+    bench_sink += sum;
+}
+
+
+
+/*
+ * Tag name hashing and lookup.
+ */
+
+struct tag_bench_t {
+    struct tag_db_t *db;
+    struct device_t *device;
+    struct cip_path_cache_t cache;
+
+    char names[BENCH_NUM_TAGS][BENCH_TAG_NAME_MAX];
+    size_t name_lens[BENCH_NUM_TAGS];
+
+    /* a Read Tag request for one DINT and room for its reply. */
+    uint8_t read_req[32];
+    size_t read_req_len;
+    uint8_t resp[64];
+};
+
+
+static status_t setup_tags(void **ctx)
+{
+    struct tag_bench_t *bench = NULL;
+
+    if(!(bench = calloc(1, sizeof(*bench)))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(!(bench->db = tag_db_create(BENCH_NUM_TAGS))) {
+        free(bench);
+        return STATUS_NO_RESOURCE;
+    }
+
+    for(uint32_t i = 0; i < BENCH_NUM_TAGS; i++) {
+        snprintf(bench->names[i], sizeof(bench->names[i]), "Tag_%05u", i);
+        bench->name_lens[i] = strlen(bench->names[i]);
+
+        if(tag_db_add(bench->db, tag_create(bench->names[i], TAG_TYPE_DINT, 1)) != STATUS_OK) {
+            tag_db_dispose(bench->db);
+            free(bench);
+            return STATUS_NO_RESOURCE;
+        }
+    }
+
+    tag_db_freeze(bench->db);
+
+    if(!(bench->device = device_create(1, NULL, bench->db, NULL))) {
+        tag_db_dispose(bench->db);
+        free(bench);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    /* 4C, path size, symbolic segment "Tag_01234" padded, one element. */
+    bench->read_req[0] = CIP_SRV_READ_TAG;
+    bench->read_req[2] = 0x91;
+    bench->read_req[3] = (uint8_t)bench->name_lens[1234];
+    memcpy(bench->read_req + 4, bench->names[1234], bench->name_lens[1234]);
+    bench->read_req_len = 4 + bench->name_lens[1234];
+
+    if(bench->read_req_len & 1) {
+        bench->read_req[bench->read_req_len++] = 0;
+    }
+
+    bench->read_req[1] = (uint8_t)((bench->read_req_len - 2) / 2);
+    encode_uint16_le(bench->read_req + bench->read_req_len, 1);
+    bench->read_req_len += 2;
+
+    *ctx = bench;
+
+    return STATUS_OK;
+}
+
+
+static void teardown_tags(void *ctx)
+{
+    struct tag_bench_t *bench = (struct tag_bench_t *)ctx;
+
+    device_dispose(bench->device);
+    tag_db_dispose(bench->db);
+    free(bench);
+}
+
+
+static void run_tag_hash(void *ctx, uint64_t iters)
+{
+    struct tag_bench_t *bench = (struct tag_bench_t *)ctx;
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        uint32_t index = (uint32_t)(i % BENCH_NUM_TAGS);
+
+        sum += tag_db_name_hash(bench->names[index], bench->name_lens[index]);
+    }
+
+    bench_sink += sum;
+}
+
+
+static void run_tag_find(void *ctx, uint64_t iters)
+{
+    struct tag_bench_t *bench = (struct tag_bench_t *)ctx;
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        /* stride through the names so consecutive lookups do not share cache lines. */
+        uint32_t index = (uint32_t)((i * 7919) % BENCH_NUM_TAGS);
+        struct tag_t *tag = tag_db_find(bench->db, bench->names[index], bench->name_lens[index]);
+
+        sum += (tag ? tag->instance_id : 0);
+    }
+
+    bench_sink += sum;
+}
+
+
+
+/*
+ * CIP Read Tag, through the connection path cache and without it.
+ */
+
+static void run_cip_read_uncached(void *ctx, uint64_t iters)
+{
+    struct tag_bench_t *bench = (struct tag_bench_t *)ctx;
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        size_t resp_len = 0;
+
+        cip_process_request(bench->device, bench->read_req, bench->read_req_len, bench->resp, sizeof(bench->resp), &resp_len);
+        sum += resp_len;
+    }
+
+    bench_sink += sum;
+}
+
+
+static void run_cip_read_cached(void *ctx, uint64_t iters)
+{
+    struct tag_bench_t *bench = (struct tag_bench_t *)ctx;
+    uint64_t sum = 0;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        size_t resp_len = 0;
+
+        cip_process_connected_request(bench->device, &(bench->cache), bench->read_req, bench->read_req_len, bench->resp, sizeof(bench->resp), &resp_len);
+        sum += resp_len;
+    }
+
+    bench_sink += sum;
+}
+
+
+
+/*
+ * The block pool against the system allocator, with a few blocks live at
+ * once like a loop juggling several connections.
+ */
+
+struct pool_bench_t {
+    struct pool_t *pool;
+    void *blocks[BENCH_POOL_BLOCKS];
+};
+
+
+static status_t setup_pool(void **ctx)
+{
+    struct pool_bench_t *bench = NULL;
+
+    if(!(bench = calloc(1, sizeof(*bench)))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(!(bench->pool = pool_create(BENCH_POOL_BLOCK_SIZE, BENCH_POOL_BLOCKS))) {
+        free(bench);
+        return STATUS_NO_RESOURCE;
+    }
+
+    *ctx = bench;
+
+    return STATUS_OK;
+}
+
+
+static void teardown_pool(void *ctx)
+{
+    struct pool_bench_t *bench = (struct pool_bench_t *)ctx;
+
+    pool_dispose(bench->pool);
+    free(bench);
+}
+
+
+static void run_pool(void *ctx, uint64_t iters)
+{
+    struct pool_bench_t *bench = (struct pool_bench_t *)ctx;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        uint32_t slot = (uint32_t)(i % BENCH_POOL_BLOCKS);
+
+        if(bench->blocks[slot]) {
+            pool_free(bench->pool, bench->blocks[slot]);
+        }
+
+        bench->blocks[slot] = pool_alloc(bench->pool);
+    }
+
+    for(uint32_t slot = 0; slot < BENCH_POOL_BLOCKS; slot++) {
+        if(bench->blocks[slot]) {
+            pool_free(bench->pool, bench->blocks[slot]);
+            bench->blocks[slot] = NULL;
+        }
+    }
+}
+
+
+static void run_malloc(void *ctx, uint64_t iters)
+{
+    struct pool_bench_t *bench = (struct pool_bench_t *)ctx;
+
+    for(uint64_t i = 0; i < iters; i++) {
+        uint32_t slot = (uint32_t)(i % BENCH_POOL_BLOCKS);
+
+        free(bench->blocks[slot]);
+        bench->blocks[slot] = malloc(BENCH_POOL_BLOCK_SIZE);
+    }
+
+    for(uint32_t slot = 0; slot < BENCH_POOL_BLOCKS; slot++) {
+        free(bench->blocks[slot]);
+        bench->blocks[slot] = NULL;
+    }
+}
+
+
+
+/*
+ * Proactor overhead.  A stopped proactor cannot be run again, so each batch
+ * builds a fresh one with the timer paused.
+ */
+
+struct proactor_bench_t {
+    struct proactor_t *proactor;
+    uint64_t remaining;
+
+    struct proactor_socket_t *listener;
+    struct proactor_socket_t *client;
+    struct proactor_socket_t *server;
+
+    size_t client_rx_len;
+    proactor_buf_t client_rx_buf;
+    proactor_buf_t client_tx_buf;
+    proactor_buf_t server_buf;
+
+    uint8_t client_rx[BENCH_ECHO_SIZE];
+    uint8_t client_tx[BENCH_ECHO_SIZE];
+    uint8_t server_data[BENCH_ECHO_SIZE];
+};
+
+
+/* every loop iteration wakes the loop again, so each one costs a wake and a wait. */
+static status_t on_wake_event(struct proactor_t *proactor, proactor_event_t event, status_t status, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(event != PROACTOR_EVENT_TICK) {
+        return STATUS_OK;
+    }
+
+    if(bench->remaining == 0 || --bench->remaining == 0) {
+        proactor_net_stop(proactor);
+    } else {
+        proactor_net_wake(proactor);
+    }
+
+    return STATUS_OK;
+}
+
+
+static void run_proactor_wake(void *ctx, uint64_t iters)
+{
+    struct proactor_bench_t bench;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.remaining = iters;
+
+    bench_pause();
+    bench.proactor = proactor_net_create(on_wake_event, NULL, &bench, BENCH_PROACTOR_TICK_MS);
+    bench_resume();
+
+    if(!bench.proactor) {
+        warn("Unable to create proactor!");
+        return;
+    }
+
+    proactor_net_wake(bench.proactor);
+    proactor_net_run(bench.proactor);
+
+    bench_pause();
+    proactor_net_dispose(bench.proactor);
+    bench_resume();
+}
+
+
+static status_t on_echo_server_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(status != STATUS_OK) {
+        return status;
+    }
+
+    /* send back exactly what came in, receiving again once it has gone. */
+    bench->server_buf.data = bench->server_data;
+    bench->server_buf.data_length = buffer->data_length;
+
+    return proactor_net_start_send(socket, &(bench->server_buf));
+}
+
+
+static status_t on_echo_server_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(status != STATUS_OK) {
+        return status;
+    }
+
+    bench->server_buf.data = bench->server_data;
+    bench->server_buf.data_length = sizeof(bench->server_data);
+
+    return proactor_net_start_receive(socket, &(bench->server_buf));
+}
+
+
+static status_t on_echo_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(status != STATUS_OK) {
+        return status;
+    }
+
+    bench->server = client_socket;
+
+    proactor_net_socket_set_receive_callback(client_socket, on_echo_server_receive);
+    proactor_net_socket_set_sent_callback(client_socket, on_echo_server_sent);
+
+    bench->server_buf.data = bench->server_data;
+    bench->server_buf.data_length = sizeof(bench->server_data);
+
+    return proactor_net_start_receive(client_socket, &(bench->server_buf));
+}
+
+
+static status_t start_client_round_trip(struct proactor_bench_t *bench)
+{
+    bench->client_rx_len = 0;
+    bench->client_rx_buf.data = bench->client_rx;
+    bench->client_rx_buf.data_length = sizeof(bench->client_rx);
+    bench->client_tx_buf.data = bench->client_tx;
+    bench->client_tx_buf.data_length = sizeof(bench->client_tx);
+
+    if(proactor_net_start_receive(bench->client, &(bench->client_rx_buf)) != STATUS_OK) {
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    return proactor_net_start_send(bench->client, &(bench->client_tx_buf));
+}
+
+
+static status_t on_echo_client_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(status != STATUS_OK) {
+        proactor_net_stop(bench->proactor);
+        return status;
+    }
+
+    bench->client_rx_len += buffer->data_length;
+
+    if(bench->client_rx_len < BENCH_ECHO_SIZE) {
+        bench->client_rx_buf.data = bench->client_rx + bench->client_rx_len;
+        bench->client_rx_buf.data_length = sizeof(bench->client_rx) - bench->client_rx_len;
+
+        return proactor_net_start_receive(socket, &(bench->client_rx_buf));
+    }
+
+    if(--bench->remaining == 0) {
+        proactor_net_stop(bench->proactor);
+        return STATUS_OK;
+    }
+
+    return start_client_round_trip(bench);
+}
+
+
+static status_t on_echo_client_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)app_data;
+
+    if(status != STATUS_OK) {
+        proactor_net_stop(bench->proactor);
+    }
+
+    return status;
+}
+
+
+static status_t open_echo(struct proactor_bench_t *bench)
+{
+    status_t rc = STATUS_OK;
+
+    do {
+        if(!(bench->proactor = proactor_net_create(NULL, NULL, bench, BENCH_PROACTOR_TICK_MS))) {
+            rc = STATUS_SETUP_FAILURE;
+            break;
+        }
+
+        rc = proactor_net_socket_open(bench->proactor, &(bench->listener), PROACTOR_SOCK_TCP_LISTENER, BENCH_ECHO_ADDRESS, BENCH_ECHO_PORT, bench, bench);
+        if(rc != STATUS_OK) {
+            warn("Unable to listen on %s:%d, error %s!", BENCH_ECHO_ADDRESS, BENCH_ECHO_PORT, status_to_str(rc));
+            break;
+        }
+
+        proactor_net_socket_set_accept_callback(bench->listener, on_echo_accept);
+
+        if((rc = proactor_net_start_accept(bench->listener)) != STATUS_OK) {
+            break;
+        }
+
+        rc = proactor_net_socket_open(bench->proactor, &(bench->client), PROACTOR_SOCK_TCP_CLIENT, BENCH_ECHO_ADDRESS, BENCH_ECHO_PORT, bench, bench);
+        if(rc != STATUS_OK) {
+            warn("Unable to connect to %s:%d, error %s!", BENCH_ECHO_ADDRESS, BENCH_ECHO_PORT, status_to_str(rc));
+            break;
+        }
+
+        proactor_net_socket_set_receive_callback(bench->client, on_echo_client_receive);
+        proactor_net_socket_set_sent_callback(bench->client, on_echo_client_sent);
+    } while(0);
+
+    return rc;
+}
+
+
+static void close_echo(struct proactor_bench_t *bench)
+{
+    if(bench->client) {
+        proactor_net_socket_close(bench->client);
+    }
+
+    if(bench->server) {
+        proactor_net_socket_close(bench->server);
+    }
+
+    if(bench->listener) {
+        proactor_net_socket_close(bench->listener);
+    }
+
+    if(bench->proactor) {
+        proactor_net_dispose(bench->proactor);
+    }
+}
+
+
+/* one op is a full round trip of a small frame through the proactor on both ends. */
+static void run_proactor_echo(void *ctx, uint64_t iters)
+{
+    struct proactor_bench_t *bench = (struct proactor_bench_t *)ctx;
+    status_t rc = STATUS_OK;
+
+    memset(bench, 0, sizeof(*bench));
+    bench->remaining = iters;
+
+    bench_pause();
+    rc = open_echo(bench);
+    bench_resume();
+
+    if(rc == STATUS_OK && start_client_round_trip(bench) == STATUS_OK) {
+        proactor_net_run(bench->proactor);
+    }
+
+    bench_pause();
+    close_echo(bench);
+    bench_resume();
+}
+
+
+static status_t setup_proactor_echo(void **ctx)
+{
+    return ((*ctx = calloc(1, sizeof(struct proactor_bench_t))) ? STATUS_OK : STATUS_NO_RESOURCE);
+}
+
+
+static void teardown_proactor_echo(void *ctx)
+{
+    free(ctx);
+}
+
+
+
+const struct bench_t bench_cases[] = {
+    { "buf_codec", "encode and decode one encapsulation header of fields", NULL, run_buf_codec, NULL },
+    { "eip_header_parse", "decode an encapsulation header and frame length", NULL, run_eip_header, NULL },
+    { "clock_monotonic", "read CLOCK_MONOTONIC", NULL, run_clock_monotonic, NULL },
+    { "clock_tsc", "read the calibrated TSC clock", setup_clock_tsc, run_clock, teardown_clock_tsc },
+    { "clock_cached", "read the time cached for this loop iteration", NULL, run_clock_cached, NULL },
+    { "tag_hash", "hash a tag name", setup_tags, run_tag_hash, teardown_tags },
+    { "tag_find", "find a tag by name among 10000", setup_tags, run_tag_find, teardown_tags },
+    { "cip_read_uncached", "Read Tag of one DINT, path decoded and looked up", setup_tags, run_cip_read_uncached, teardown_tags },
+    { "cip_read_cached", "Read Tag of one DINT through the path cache", setup_tags, run_cip_read_cached, teardown_tags },
+    { "pool_alloc_free", "pool block alloc and free, 64 live", setup_pool, run_pool, teardown_pool },
+    { "malloc_free", "malloc and free of the same size, 64 live", setup_pool, run_malloc, teardown_pool },
+    { "proactor_wake", "one proactor loop iteration woken by itself", NULL, run_proactor_wake, NULL },
+    { "proactor_echo", "64 byte round trip over loopback TCP", setup_proactor_echo, run_proactor_echo, teardown_proactor_echo },
+};
+
+const size_t bench_num_cases = sizeof(bench_cases) / sizeof(bench_cases[0]);
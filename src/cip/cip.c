@@ -0,0 +1,872 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_CIP)
+
+
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip/cip.h"
+#include "cip/cip_pccc.h"
+#include "cip/cip_symbol.h"
+#include "cip/cip_template.h"
+#include "device/device.h"
+#include "metrics/metrics.h"
+#include "tags/tag.h"
+#include "tags/tag_bits.h"
+#include "tags/tag_db.h"
+#include "tags/udt.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+/* segment type bytes */
+#define SEG_CLASS_8 (0x20)
+#define SEG_CLASS_16 (0x21)
+#define SEG_INSTANCE_8 (0x24)
+#define SEG_INSTANCE_16 (0x25)
+#define SEG_INSTANCE_32 (0x26)
+#define SEG_ELEMENT_8 (0x28)
+#define SEG_ELEMENT_16 (0x29)
+#define SEG_ELEMENT_32 (0x2A)
+#define SEG_ATTRIBUTE_8 (0x30)
+#define SEG_ATTRIBUTE_16 (0x31)
+#define SEG_SYMBOLIC (0x91)
+
+
+
+status_t cip_decode_path(const uint8_t *path, size_t path_len, struct cip_path_t *decoded)
+{
+    const uint8_t *p = path;
+    const uint8_t *end = path + path_len;
+
+    if(!path || !decoded) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    memset(decoded, 0, sizeof(*decoded));
+
+    while(p < end) {
+        uint8_t seg = *p;
+        uint32_t value = 0;
+        size_t seg_len = 0;
+
+        switch(seg) {
+            case SEG_CLASS_8:
+            case SEG_INSTANCE_8:
+            case SEG_ELEMENT_8:
+            case SEG_ATTRIBUTE_8:
+                seg_len = 2;
+                if(p + seg_len > end) { return STATUS_PARTIAL; }
+                value = p[1];
+                break;
+
+            case SEG_CLASS_16:
+            case SEG_INSTANCE_16:
+            case SEG_ELEMENT_16:
+            case SEG_ATTRIBUTE_16:
+                /* one pad byte after the segment type. */
+                seg_len = 4;
+                if(p + seg_len > end) { return STATUS_PARTIAL; }
+                value = decode_uint16_le(p + 2);
+                break;
+
+            case SEG_INSTANCE_32:
+            case SEG_ELEMENT_32:
+                seg_len = 6;
+                if(p + seg_len > end) { return STATUS_PARTIAL; }
+                value = decode_uint32_le(p + 2);
+                break;
+
+            case SEG_SYMBOLIC:
+                if(p + 2 > end) { return STATUS_PARTIAL; }
+
+                /* symbol bytes are padded to an even length. */
+                seg_len = 2 + (size_t)p[1] + (p[1] & 0x01);
+                if(p + seg_len > end) { return STATUS_PARTIAL; }
+
+                if(decoded->num_elems >= CIP_PATH_MAX_ELEMS) {
+                    return STATUS_OUT_OF_BOUNDS;
+                }
+
+                decoded->elems[decoded->num_elems].kind = CIP_PATH_ELEM_SYMBOL;
+                decoded->elems[decoded->num_elems].symbol_len = p[1];
+                decoded->elems[decoded->num_elems].symbol = p + 2;
+                decoded->num_elems++;
+                break;
+
+            default:
+                detail("Unsupported path segment type %02x.", seg);
+                return STATUS_NOT_SUPPORTED;
+        }
+
+        switch(seg) {
+            case SEG_CLASS_8:
+            case SEG_CLASS_16:
+                decoded->has_class = true;
+                decoded->class_id = value;
+                break;
+
+            case SEG_INSTANCE_8:
+            case SEG_INSTANCE_16:
+            case SEG_INSTANCE_32:
+                decoded->has_instance = true;
+                decoded->instance_id = value;
+                break;
+
+            case SEG_ATTRIBUTE_8:
+            case SEG_ATTRIBUTE_16:
+                decoded->has_attribute = true;
+                decoded->attribute_id = value;
+                break;
+
+            case SEG_ELEMENT_8:
+            case SEG_ELEMENT_16:
+            case SEG_ELEMENT_32:
+                if(decoded->num_elems >= CIP_PATH_MAX_ELEMS) {
+                    return STATUS_OUT_OF_BOUNDS;
+                }
+
+                decoded->elems[decoded->num_elems].kind = CIP_PATH_ELEM_INDEX;
+                decoded->elems[decoded->num_elems].index = value;
+                decoded->num_elems++;
+                break;
+
+            default:
+                break;
+        }
+
+        p += seg_len;
+    }
+
+    return STATUS_OK;
+}
+
+
+
+
+/*
+ * Identity object, class 0x01 instance 1.
+ */
+
+static void encode_identity(const struct device_identity_t *identity, uint32_t attribute_id, struct cip_response_t *resp)
+{
+    uint8_t *d = resp->data;
+    size_t name_len = strlen(identity->product_name);
+
+    /* everything fits in the smallest response buffer we use. */
+    switch(attribute_id) {
+        case 0: /* all */
+            encode_uint16_le(d, identity->vendor_id);
+            encode_uint16_le(d + 2, identity->device_type);
+            encode_uint16_le(d + 4, identity->product_code);
+            d[6] = identity->revision_major;
+            d[7] = identity->revision_minor;
+            encode_uint16_le(d + 8, identity->status);
+            encode_uint32_le(d + 10, identity->serial_number);
+            d[14] = (uint8_t)name_len;
+            memcpy(d + 15, identity->product_name, name_len);
+            resp->data_len = 15 + name_len;
+            break;
+
+        case 1: encode_uint16_le(d, identity->vendor_id); resp->data_len = 2; break;
+        case 2: encode_uint16_le(d, identity->device_type); resp->data_len = 2; break;
+        case 3: encode_uint16_le(d, identity->product_code); resp->data_len = 2; break;
+        case 4: d[0] = identity->revision_major; d[1] = identity->revision_minor; resp->data_len = 2; break;
+        case 5: encode_uint16_le(d, identity->status); resp->data_len = 2; break;
+        case 6: encode_uint32_le(d, identity->serial_number); resp->data_len = 4; break;
+        case 7:
+            d[0] = (uint8_t)name_len;
+            memcpy(d + 1, identity->product_name, name_len);
+            resp->data_len = 1 + name_len;
+            break;
+
+        default:
+            resp->general_status = CIP_STATUS_ATTRIBUTE_NOT_SUPPORTED;
+            break;
+    }
+}
+
+
+static void handle_identity(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    if(req->path.has_instance && req->path.instance_id != 1) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    if(resp->capacity < 15 + DEVICE_PRODUCT_NAME_MAX) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    switch(req->service) {
+        case CIP_SRV_GET_ATTRIBUTES_ALL:
+            encode_identity(&(device->identity), 0, resp);
+            break;
+
+        case CIP_SRV_GET_ATTRIBUTE_SINGLE:
+            if(!req->path.has_attribute || req->path.attribute_id == 0) {
+                resp->general_status = CIP_STATUS_PATH_SEGMENT_ERROR;
+                break;
+            }
+
+            encode_identity(&(device->identity), req->path.attribute_id, resp);
+            break;
+
+        default:
+            resp->general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED;
+            break;
+    }
+}
+
+
+
+
+/*
+ * Multiple Service Packet on the Message Router.  Each embedded request is
+ * processed in turn straight into the response buffer.
+ */
+
+static status_t process_request(struct device_t *device, struct cip_path_cache_t *cache, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+
+static void handle_multiple_service(struct device_t *device, struct cip_path_cache_t *cache, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    uint16_t count = 0;
+    size_t out_offset = 0;
+
+    if(req->data_len < 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    count = decode_uint16_le(req->data);
+
+    if(req->data_len < 2 + (2 * (size_t)count)) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    out_offset = 2 + (2 * (size_t)count);
+
+    if(resp->capacity < out_offset) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    encode_uint16_le(resp->data, count);
+
+    for(uint16_t i = 0; i < count; i++) {
+        uint16_t start = decode_uint16_le(req->data + 2 + (2 * i));
+        uint16_t stop = (i + 1 < count ? decode_uint16_le(req->data + 2 + (2 * (i + 1))) : (uint16_t)req->data_len);
+        size_t sub_resp_len = 0;
+
+        if(start >= stop || stop > req->data_len) {
+            resp->general_status = CIP_STATUS_INVALID_PARAMETER;
+            resp->data_len = 0;
+            return;
+        }
+
+        encode_uint16_le(resp->data + 2 + (2 * i), (uint16_t)out_offset);
+
+        if(process_request(device, cache, req->data + start, stop - start, resp->data + out_offset, resp->capacity - out_offset, &sub_resp_len) != STATUS_OK) {
+            /* no room left for this reply.  Say so in its place, or fail the whole packet if even that does not fit. */
+            if(resp->capacity - out_offset < CIP_RESPONSE_HEADER_SIZE) {
+                resp->general_status = CIP_STATUS_NO_RESOURCE;
+                resp->data_len = 0;
+                return;
+            }
+
+            resp->data[out_offset] = req->data[start] | CIP_SRV_RESPONSE;
+            resp->data[out_offset + 1] = 0;
+            resp->data[out_offset + 2] = CIP_STATUS_NO_RESOURCE;
+            resp->data[out_offset + 3] = 0;
+
+            sub_resp_len = CIP_RESPONSE_HEADER_SIZE;
+        }
+
+        out_offset += sub_resp_len;
+    }
+
+    resp->data_len = out_offset;
+}
+
+
+
+
+/*
+ * Read and Write Tag services against symbolic paths.
+ */
+
+static bool symbol_is_number(const struct cip_path_elem_t *elem, uint32_t *value)
+{
+    uint32_t v = 0;
+
+    if(elem->kind != CIP_PATH_ELEM_SYMBOL || elem->symbol_len == 0 || elem->symbol_len > 2) {
+        return false;
+    }
+
+    for(uint8_t i = 0; i < elem->symbol_len; i++) {
+        if(elem->symbol[i] < '0' || elem->symbol[i] > '9') {
+            return false;
+        }
+
+        v = (v * 10) + (uint32_t)(elem->symbol[i] - '0');
+    }
+
+    *value = v;
+
+    return true;
+}
+
+
+static status_t resolve_tag(struct device_t *device, const struct cip_path_t *path, struct cip_tag_ref_t *ref)
+{
+    const struct cip_path_elem_t *elem = &(path->elems[0]);
+    struct tag_t *tag = NULL;
+    uint32_t next = 1;
+    uint32_t bit = 0;
+
+    if(path->num_elems == 0 || elem->kind != CIP_PATH_ELEM_SYMBOL) {
+        return STATUS_BAD_INPUT;
+    }
+
+    if(!(tag = tag_db_find(device->tag_db, (const char *)elem->symbol, elem->symbol_len))) {
+        return STATUS_NOT_FOUND;
+    }
+
+    ref->tag = tag;
+    ref->elem_index = 0;
+    ref->bit = -1;
+
+    if(next < path->num_elems && path->elems[next].kind == CIP_PATH_ELEM_INDEX) {
+        uint32_t index = path->elems[next].index;
+
+        if(tag->bit_count) {
+            /* BoolArray[1234] is bit 1234, not word 1234. */
+            if(index >= tag->bit_count) {
+                return STATUS_OUT_OF_BOUNDS;
+            }
+
+            ref->elem_index = index / 32;
+            ref->bit = (int32_t)index;
+        } else {
+            ref->elem_index = index;
+        }
+
+        next++;
+    }
+
+    if(next < path->num_elems && ref->bit < 0 && !tag->udt && symbol_is_number(&(path->elems[next]), &bit)) {
+        if(bit >= (uint32_t)tag->elem_size * 8 || tag->type == TAG_TYPE_REAL || tag->type == TAG_TYPE_LREAL) {
+            return STATUS_OUT_OF_BOUNDS;
+        }
+
+        ref->bit = (int32_t)bit;
+        next++;
+    }
+
+    if(next < path->num_elems) {
+        /* members and multi-dimensional indexes are not supported yet. */
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if(ref->elem_index >= tag->elem_count) {
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* use the connection's cached resolution of this path if it has one. */
+static status_t resolve_request(struct device_t *device, const struct cip_request_t *req, struct cip_tag_ref_t *ref)
+{
+    status_t rc = STATUS_OK;
+
+    if(req->cached && req->cached->resolved) {
+        *ref = req->cached->ref;
+        return STATUS_OK;
+    }
+
+    if((rc = resolve_tag(device, &(req->path), ref)) == STATUS_OK && req->cached) {
+        req->cached->ref = *ref;
+        req->cached->resolved = true;
+    }
+
+    return rc;
+}
+
+
+static uint8_t resolve_status_to_cip(status_t rc)
+{
+    switch(rc) {
+        case STATUS_NOT_FOUND: return CIP_STATUS_PATH_DEST_UNKNOWN; break;
+        case STATUS_OUT_OF_BOUNDS: return CIP_STATUS_PATH_DEST_UNKNOWN; break;
+        case STATUS_NOT_ALLOWED: return CIP_STATUS_PRIVILEGE_VIOLATION; break;
+        default: return CIP_STATUS_PATH_SEGMENT_ERROR; break;
+    }
+}
+
+
+static void type_mismatch(struct cip_response_t *resp)
+{
+    resp->general_status = CIP_STATUS_EXTENDED;
+    resp->has_ext_status = true;
+    resp->ext_status = 0x2107;
+}
+
+
+/* a single bit reads back as a BOOL. */
+static void read_bit(struct device_t *device, const struct cip_tag_ref_t *ref, uint16_t elem_count, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    bool value = false;
+
+    if(elem_count != 1) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    if(resp->capacity < 3) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    if((rc = tag_bits_read(ref->tag, device->tag_image, ref->elem_index, (uint32_t)ref->bit, &value)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+
+    encode_uint16_le(resp->data, TAG_TYPE_BOOL);
+    resp->data[2] = (value ? 1 : 0);
+    resp->data_len = 3;
+}
+
+
+static void handle_read_tag(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    struct cip_tag_ref_t ref = {0};
+    struct tag_t *tag = NULL;
+    uint16_t elem_count = 1;
+    size_t type_len = 0;
+    size_t length = 0;
+
+    if((rc = resolve_request(device, req, &ref)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+
+    tag = ref.tag;
+
+    if(req->data_len >= 2) {
+        elem_count = decode_uint16_le(req->data);
+    }
+
+    if(ref.bit >= 0) {
+        read_bit(device, &ref, elem_count, resp);
+        return;
+    }
+
+    /* structures are sent as 0x02A0 and the template handle, then the raw instances. */
+    type_len = (tag->udt ? 4 : 2);
+
+    if(elem_count == 0 || ref.elem_index + elem_count > tag->elem_count) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    length = (size_t)elem_count * tag->elem_size;
+
+    if(resp->capacity < type_len) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    /* return what fits, the client should use fragmented reads for the rest. */
+    if(length > resp->capacity - type_len) {
+        length = resp->capacity - type_len;
+        resp->general_status = CIP_STATUS_PARTIAL_DATA;
+    }
+
+    encode_uint16_le(resp->data, tag->type);
+
+    if(tag->udt) {
+        encode_uint16_le(resp->data + 2, tag->udt->handle);
+    }
+
+    if((rc = tag_read(tag, device->tag_image, ref.elem_index * tag->elem_size, resp->data + type_len, (uint32_t)length)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+
+    resp->data_len = type_len + length;
+}
+
+
+/* a bit is written as a single BOOL and lands as one atomic word update. */
+static void write_bit(struct device_t *device, const struct cip_tag_ref_t *ref, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+
+    if(req->data_len < 4) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    if(decode_uint16_le(req->data) != TAG_TYPE_BOOL) {
+        type_mismatch(resp);
+        return;
+    }
+
+    if(decode_uint16_le(req->data + 2) != 1) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    if(req->data_len < 5) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    if(req->data_len > 5) {
+        resp->general_status = CIP_STATUS_TOO_MUCH_DATA;
+        return;
+    }
+
+    if((rc = tag_bits_write(ref->tag, device->tag_image, ref->elem_index, (uint32_t)ref->bit, req->data[4] != 0)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+}
+
+
+static void handle_write_tag(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    struct cip_tag_ref_t ref = {0};
+    struct tag_t *tag = NULL;
+    uint16_t type = 0;
+    uint16_t elem_count = 0;
+    size_t type_len = 0;
+    size_t length = 0;
+
+    if((rc = resolve_request(device, req, &ref)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+
+    if(ref.bit >= 0) {
+        write_bit(device, &ref, req, resp);
+        return;
+    }
+
+    tag = ref.tag;
+    type_len = (tag->udt ? 4 : 2);
+
+    if(req->data_len < type_len + 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    type = decode_uint16_le(req->data);
+    elem_count = decode_uint16_le(req->data + type_len);
+
+    if(type != tag->type || (tag->udt && decode_uint16_le(req->data + 2) != tag->udt->handle)) {
+        type_mismatch(resp);
+        return;
+    }
+
+    if(elem_count == 0 || ref.elem_index + elem_count > tag->elem_count) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    length = (size_t)elem_count * tag->elem_size;
+
+    if(req->data_len - (type_len + 2) < length) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    if(req->data_len - (type_len + 2) > length) {
+        resp->general_status = CIP_STATUS_TOO_MUCH_DATA;
+        return;
+    }
+
+    if((rc = tag_write(tag, device->tag_image, ref.elem_index * tag->elem_size, req->data + type_len + 2, (uint32_t)length)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+}
+
+
+/*
+ * Read-Modify-Write.  The data is the mask size, then that many bytes of OR
+ * mask and that many of AND mask, applied to the addressed element.  Every
+ * word is changed with one atomic operation so concurrent bit writers never
+ * lose each other's updates.
+ */
+static void handle_read_modify_write(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    struct cip_tag_ref_t ref = {0};
+    uint16_t mask_len = 0;
+    uint32_t offset = 0;
+
+    if((rc = resolve_request(device, req, &ref)) != STATUS_OK) {
+        resp->general_status = resolve_status_to_cip(rc);
+        return;
+    }
+
+    /* masks cover whole elements, Tag.5 has no element of its own. */
+    if(ref.bit >= 0 && !ref.tag->bit_count) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    if(ref.tag->udt) {
+        type_mismatch(resp);
+        return;
+    }
+
+    if(req->data_len < 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    mask_len = decode_uint16_le(req->data);
+
+    if(mask_len == 0) {
+        resp->general_status = CIP_STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    if(req->data_len - 2 < (size_t)mask_len * 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    if(req->data_len - 2 > (size_t)mask_len * 2) {
+        resp->general_status = CIP_STATUS_TOO_MUCH_DATA;
+        return;
+    }
+
+    offset = ref.elem_index * ref.tag->elem_size;
+
+    if((rc = tag_bits_modify(ref.tag, device->tag_image, offset, req->data + 2, req->data + 2 + mask_len, mask_len)) != STATUS_OK) {
+        resp->general_status = (rc == STATUS_OUT_OF_BOUNDS ? CIP_STATUS_INVALID_PARAMETER : resolve_status_to_cip(rc));
+        return;
+    }
+}
+
+
+
+
+/*
+ * Connected path cache.  Entries are matched on the raw path bytes and
+ * replaced round robin.  The decoded path points into the entry's own copy
+ * of the bytes, not into the request buffer.
+ */
+
+static struct cip_path_cache_entry_t *path_cache_find(struct cip_path_cache_t *cache, const uint8_t *path, size_t path_len)
+{
+    for(int i = 0; i < CIP_PATH_CACHE_SIZE; i++) {
+        struct cip_path_cache_entry_t *entry = &(cache->entries[i]);
+
+        if(entry->path_len == path_len && path_len && memcmp(entry->path, path, path_len) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+
+static struct cip_path_cache_entry_t *path_cache_add(struct cip_path_cache_t *cache, const uint8_t *path, size_t path_len)
+{
+    struct cip_path_cache_entry_t *entry = &(cache->entries[cache->next_victim]);
+
+    cache->next_victim = (cache->next_victim + 1) % CIP_PATH_CACHE_SIZE;
+
+    memcpy(entry->path, path, path_len);
+    entry->path_len = (uint8_t)path_len;
+    entry->resolved = false;
+
+    if(cip_decode_path(entry->path, path_len, &(entry->decoded)) != STATUS_OK) {
+        entry->path_len = 0;
+        return NULL;
+    }
+
+    return entry;
+}
+
+
+/* only copy the path elements that are in use. */
+static void copy_path(struct cip_path_t *dest, const struct cip_path_t *src)
+{
+    size_t len = offsetof(struct cip_path_t, elems) + (src->num_elems * sizeof(src->elems[0]));
+
+    memcpy(dest, src, len);
+}
+
+
+
+
+static status_t process_request(struct device_t *device, struct cip_path_cache_t *cache, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    status_t rc = STATUS_OK;
+    struct cip_request_t request = {0};
+    struct cip_response_t response = {0};
+    size_t path_len = 0;
+    size_t header_len = CIP_RESPONSE_HEADER_SIZE;
+
+    if(!device || !req || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    *resp_len = 0;
+
+    if(resp_capacity < CIP_RESPONSE_HEADER_SIZE + 2) {
+        warn("Response buffer too small!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    response.data = resp + CIP_RESPONSE_HEADER_SIZE;
+    response.capacity = resp_capacity - CIP_RESPONSE_HEADER_SIZE;
+
+    do {
+        if(req_len < 2) {
+            response.general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+            break;
+        }
+
+        request.service = req[0];
+        path_len = (size_t)req[1] * 2;
+
+        if(2 + path_len > req_len) {
+            response.general_status = CIP_STATUS_PATH_SEGMENT_ERROR;
+            break;
+        }
+
+        if(cache && path_len <= CIP_PATH_CACHE_MAX_PATH) {
+            if(!(request.cached = path_cache_find(cache, req + 2, path_len))) {
+                request.cached = path_cache_add(cache, req + 2, path_len);
+            }
+        }
+
+        if(request.cached) {
+            copy_path(&(request.path), &(request.cached->decoded));
+        } else if((rc = cip_decode_path(req + 2, path_len, &(request.path))) != STATUS_OK) {
+            detail("Error %s decoding request path.", status_to_str(rc));
+            response.general_status = CIP_STATUS_PATH_SEGMENT_ERROR;
+            break;
+        }
+
+        request.data = req + 2 + path_len;
+        request.data_len = req_len - (2 + path_len);
+
+        flood("Processing CIP service %02x.", request.service);
+
+        if(request.path.num_elems > 0) {
+            switch(request.service) {
+                case CIP_SRV_READ_TAG: handle_read_tag(device, &request, &response); break;
+                case CIP_SRV_WRITE_TAG: handle_write_tag(device, &request, &response); break;
+                case CIP_SRV_READ_MODIFY_WRITE: handle_read_modify_write(device, &request, &response); break;
+                default: response.general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED; break;
+            }
+
+            break;
+        }
+
+        if(!request.path.has_class) {
+            response.general_status = CIP_STATUS_PATH_SEGMENT_ERROR;
+            break;
+        }
+
+        switch(request.path.class_id) {
+            case CIP_CLASS_IDENTITY:
+                handle_identity(device, &request, &response);
+                break;
+
+            case CIP_CLASS_SYMBOL:
+                cip_symbol_handle(device, &request, &response);
+                break;
+
+            case CIP_CLASS_TEMPLATE:
+                cip_template_handle(device, &request, &response);
+                break;
+
+            case CIP_CLASS_PCCC:
+                cip_pccc_handle(device, &request, &response);
+                break;
+
+            case CIP_CLASS_MESSAGE_ROUTER:
+                if(request.service == CIP_SRV_MULTIPLE_SERVICE) {
+                    handle_multiple_service(device, cache, &request, &response);
+                } else {
+                    response.general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED;
+                }
+                break;
+
+            default:
+                detail("Unsupported CIP class %x.", request.path.class_id);
+                response.general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+                break;
+        }
+    } while(0);
+
+    /* errors with extended status carry no data. */
+    if(response.has_ext_status) {
+        header_len += 2;
+        response.data_len = 0;
+        encode_uint16_le(resp + CIP_RESPONSE_HEADER_SIZE, response.ext_status);
+    }
+
+    metrics_count_request(device->metrics, metrics_cip_service(request.service));
+
+    resp[0] = request.service | CIP_SRV_RESPONSE;
+    resp[1] = 0;
+    resp[2] = response.general_status;
+    resp[3] = (response.has_ext_status ? 1 : 0);
+
+    *resp_len = header_len + response.data_len;
+
+    return STATUS_OK;
+}
+
+
+
+status_t cip_process_request(struct device_t *device, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    return process_request(device, NULL, req, req_len, resp, resp_capacity, resp_len);
+}
+
+
+/* the same, for requests on a connection that keeps a path cache. */
+status_t cip_process_connected_request(struct device_t *device, struct cip_path_cache_t *cache, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    if(!cache) {
+        warn("Called with a NULL cache pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    return process_request(device, cache, req, req_len, resp, resp_capacity, resp_len);
+}
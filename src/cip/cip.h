@@ -0,0 +1,166 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+typedef enum {
+    CIP_SRV_GET_ATTRIBUTES_ALL = 0x01,
+    CIP_SRV_GET_ATTRIBUTE_LIST = 0x03,
+    CIP_SRV_MULTIPLE_SERVICE = 0x0A,
+    CIP_SRV_GET_ATTRIBUTE_SINGLE = 0x0E,
+    CIP_SRV_EXECUTE_PCCC = 0x4B,
+    CIP_SRV_READ_TAG = 0x4C,
+    CIP_SRV_READ_TEMPLATE = 0x4C,
+    CIP_SRV_WRITE_TAG = 0x4D,
+    CIP_SRV_READ_MODIFY_WRITE = 0x4E,
+    CIP_SRV_GET_INSTANCE_ATTRIBUTE_LIST = 0x55,
+
+    CIP_SRV_RESPONSE = 0x80,
+} cip_service_t;
+
+
+typedef enum {
+    CIP_STATUS_OK = 0x00,
+    CIP_STATUS_CONNECTION_FAILURE = 0x01,
+    CIP_STATUS_NO_RESOURCE = 0x02,
+    CIP_STATUS_PATH_SEGMENT_ERROR = 0x04,
+    CIP_STATUS_PATH_DEST_UNKNOWN = 0x05,
+    CIP_STATUS_PARTIAL_DATA = 0x06,
+    CIP_STATUS_SERVICE_NOT_SUPPORTED = 0x08,
+    CIP_STATUS_INVALID_ATTRIBUTE_VALUE = 0x09,
+    CIP_STATUS_OBJECT_STATE_CONFLICT = 0x0C,
+    CIP_STATUS_PRIVILEGE_VIOLATION = 0x0F,
+    CIP_STATUS_NOT_ENOUGH_DATA = 0x13,
+    CIP_STATUS_ATTRIBUTE_NOT_SUPPORTED = 0x14,
+    CIP_STATUS_TOO_MUCH_DATA = 0x15,
+    CIP_STATUS_INVALID_PARAMETER = 0x20,
+    CIP_STATUS_EXTENDED = 0xFF,
+} cip_status_t;
+
+
+typedef enum {
+    CIP_CLASS_IDENTITY = 0x01,
+    CIP_CLASS_MESSAGE_ROUTER = 0x02,
+    CIP_CLASS_CONNECTION_MANAGER = 0x06,
+    CIP_CLASS_PCCC = 0x67,
+    CIP_CLASS_SYMBOL = 0x6B,
+    CIP_CLASS_TEMPLATE = 0x6C,
+} cip_class_t;
+
+
+#define CIP_RESPONSE_HEADER_SIZE (4)
+#define CIP_PATH_MAX_ELEMS (16)
+
+
+typedef enum {
+    CIP_PATH_ELEM_SYMBOL,
+    CIP_PATH_ELEM_INDEX,
+} cip_path_elem_kind_t;
+
+
+/* one symbolic name or array index from an ANSI extended symbolic path. */
+struct cip_path_elem_t {
+    uint8_t kind;
+    uint8_t symbol_len;
+    const uint8_t *symbol;
+    uint32_t index;
+};
+
+
+struct cip_path_t {
+    bool has_class;
+    bool has_instance;
+    bool has_attribute;
+
+    uint32_t class_id;
+    uint32_t instance_id;
+    uint32_t attribute_id;
+
+    uint32_t num_elems;
+    struct cip_path_elem_t elems[CIP_PATH_MAX_ELEMS];
+};
+
+
+/*
+ * What a symbolic path points at.  bit is -1 unless the path picks out a
+ * single bit, either an index into a packed BOOL array (bit counts across
+ * the whole array) or a numeric member of an integer like Tag.5 or Tag[3].7.
+ */
+struct cip_tag_ref_t {
+    struct tag_t *tag;
+    uint32_t elem_index;
+    int32_t bit;
+};
+
+
+/*
+ * The last few request paths seen on a connection, decoded and, for tag
+ * paths, resolved.  Connected clients repeat the same paths constantly, so
+ * a hit skips both the decode and the tag lookup.  Tags are never removed,
+ * so a resolved tag stays valid for the life of the connection.
+ */
+#define CIP_PATH_CACHE_SIZE (8)
+#define CIP_PATH_CACHE_MAX_PATH (64)
+
+struct cip_path_cache_entry_t {
+    uint8_t path_len;
+    bool resolved;
+    uint8_t path[CIP_PATH_CACHE_MAX_PATH];
+    struct cip_path_t decoded;
+    struct cip_tag_ref_t ref;
+};
+
+struct cip_path_cache_t {
+    uint32_t next_victim;
+    struct cip_path_cache_entry_t entries[CIP_PATH_CACHE_SIZE];
+};
+
+
+struct cip_request_t {
+    uint8_t service;
+    struct cip_path_t path;
+    const uint8_t *data;
+    size_t data_len;
+
+    /* the connection's cache entry for this path, if there is one. */
+    struct cip_path_cache_entry_t *cached;
+};
+
+
+struct cip_response_t {
+    uint8_t general_status;
+    bool has_ext_status;
+    uint16_t ext_status;
+
+    uint8_t *data;
+    size_t capacity;
+    size_t data_len;
+};
+
+
+struct device_t;
+struct tag_t;
+
+extern status_t cip_decode_path(const uint8_t *path, size_t path_len, struct cip_path_t *decoded);
+
+extern status_t cip_process_request(struct device_t *device, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+extern status_t cip_process_connected_request(struct device_t *device, struct cip_path_cache_t *cache, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
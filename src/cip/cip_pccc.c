@@ -0,0 +1,237 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_CIP)
+
+
+
+#include <string.h>
+
+#include "cip/cip.h"
+#include "cip/cip_pccc.h"
+#include "device/device.h"
+#include "tags/data_files.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+/* the requestor ID is a length byte, vendor ID and serial number, then anything else. */
+#define REQUESTOR_ID_MIN_SIZE (7)
+
+/* command, status and transaction number, then the function code in requests. */
+#define PCCC_HEADER_SIZE (4)
+
+#define PCCC_CMD_TYPED (0x0F)
+#define PCCC_REPLY (0x40)
+
+#define PCCC_FNC_READ_2_ADDR (0xA1)
+#define PCCC_FNC_READ_3_ADDR (0xA2)
+#define PCCC_FNC_WRITE_2_ADDR (0xA9)
+#define PCCC_FNC_WRITE_3_ADDR (0xAA)
+
+/* PCCC status, and the extended status that follows 0xF0. */
+#define PCCC_STS_OK (0x00)
+#define PCCC_STS_ILLEGAL_COMMAND (0x10)
+#define PCCC_STS_EXTENDED (0xF0)
+
+#define PCCC_EXT_BAD_ADDRESS (0x06)
+#define PCCC_EXT_BAD_SIZE (0x07)
+#define PCCC_EXT_NOT_ALLOWED (0x0B)
+
+
+
+/* address fields are one byte, or 0xFF followed by a 16-bit value. */
+static bool decode_field(const uint8_t **p, const uint8_t *end, uint32_t *val)
+{
+    if(*p >= end) {
+        return false;
+    }
+
+    if(**p != 0xFF) {
+        *val = *(*p)++;
+        return true;
+    }
+
+    if(*p + 3 > end) {
+        return false;
+    }
+
+    *val = decode_uint16_le(*p + 1);
+    *p += 3;
+
+    return true;
+}
+
+
+static uint8_t pccc_error(uint8_t *out, uint8_t ext_status)
+{
+    out[0] = ext_status;
+
+    return PCCC_STS_EXTENDED;
+}
+
+
+/*
+ * Typed read and write.  The address is the byte count, file number, file
+ * type, element and, for the three address forms, a sub-element counted in
+ * words.  Returns the PCCC status and sets how much data was written to out.
+ */
+static uint8_t typed_access(struct device_t *device, uint8_t fnc, const uint8_t *data, size_t data_len, uint8_t *out, size_t out_capacity, size_t *out_len)
+{
+    const uint8_t *p = data;
+    const uint8_t *end = data + data_len;
+    bool is_write = (fnc == PCCC_FNC_WRITE_2_ADDR || fnc == PCCC_FNC_WRITE_3_ADDR);
+    bool has_sub_elem = (fnc == PCCC_FNC_READ_3_ADDR || fnc == PCCC_FNC_WRITE_3_ADDR);
+    uint32_t size = 0;
+    uint32_t file_num = 0;
+    uint32_t elem = 0;
+    uint32_t sub_elem = 0;
+    uint32_t offset = 0;
+    uint8_t file_type = 0;
+    uint16_t elem_size = 0;
+    struct tag_t *tag = NULL;
+
+    *out_len = 0;
+
+    if(p >= end) {
+        return PCCC_STS_ILLEGAL_COMMAND;
+    }
+
+    size = *p++;
+
+    if(!decode_field(&p, end, &file_num) || p >= end) {
+        return PCCC_STS_ILLEGAL_COMMAND;
+    }
+
+    file_type = *p++;
+
+    if(!decode_field(&p, end, &elem) || (has_sub_elem && !decode_field(&p, end, &sub_elem))) {
+        return PCCC_STS_ILLEGAL_COMMAND;
+    }
+
+    if(!(tag = data_files_get(device->tag_db->files, file_type, file_num))) {
+        detail("No data file type %02x number %u.", file_type, file_num);
+        *out_len = 1;
+        return pccc_error(out, PCCC_EXT_BAD_ADDRESS);
+    }
+
+    elem_size = data_file_elem_size(file_type);
+    offset = (elem * elem_size) + (sub_elem * 2);
+
+    if(size == 0 || offset > tag->data_size || size > tag->data_size - offset) {
+        detail("Access of %u bytes at element %u is outside of file %u.", size, elem, file_num);
+        *out_len = 1;
+        return pccc_error(out, PCCC_EXT_BAD_SIZE);
+    }
+
+    if(is_write) {
+        if((size_t)(end - p) < size) {
+            return PCCC_STS_ILLEGAL_COMMAND;
+        }
+
+        if(tag_write(tag, device->tag_image, offset, p, size) != STATUS_OK) {
+            *out_len = 1;
+            return pccc_error(out, PCCC_EXT_NOT_ALLOWED);
+        }
+
+        return PCCC_STS_OK;
+    }
+
+    if(out_capacity < size) {
+        *out_len = 1;
+        return pccc_error(out, PCCC_EXT_BAD_SIZE);
+    }
+
+    if(tag_read(tag, device->tag_image, offset, out, size) != STATUS_OK) {
+        *out_len = 1;
+        return pccc_error(out, PCCC_EXT_BAD_ADDRESS);
+    }
+
+    *out_len = size;
+
+    return PCCC_STS_OK;
+}
+
+
+static void execute_pccc(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    const uint8_t *pccc = NULL;
+    size_t pccc_len = 0;
+    size_t id_len = 0;
+    size_t data_len = 0;
+    uint8_t *out = NULL;
+    uint8_t status = PCCC_STS_ILLEGAL_COMMAND;
+
+    if(req->data_len < REQUESTOR_ID_MIN_SIZE || req->data[0] < REQUESTOR_ID_MIN_SIZE || req->data_len < (size_t)req->data[0] + PCCC_HEADER_SIZE) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    id_len = req->data[0];
+    pccc = req->data + id_len;
+    pccc_len = req->data_len - id_len;
+
+    if(resp->capacity < id_len + PCCC_HEADER_SIZE + 1) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    /* the reply starts with the requestor ID and the request's header. */
+    memcpy(resp->data, req->data, id_len);
+    out = resp->data + id_len;
+
+    out[0] = pccc[0] | PCCC_REPLY;
+    out[2] = pccc[2];
+    out[3] = pccc[3];
+
+    if(pccc[0] == PCCC_CMD_TYPED && pccc_len > PCCC_HEADER_SIZE) {
+        switch(pccc[4]) {
+            case PCCC_FNC_READ_2_ADDR:
+            case PCCC_FNC_READ_3_ADDR:
+            case PCCC_FNC_WRITE_2_ADDR:
+            case PCCC_FNC_WRITE_3_ADDR:
+                status = typed_access(device, pccc[4], pccc + PCCC_HEADER_SIZE + 1, pccc_len - (PCCC_HEADER_SIZE + 1),
+                                      out + PCCC_HEADER_SIZE, resp->capacity - (id_len + PCCC_HEADER_SIZE), &data_len);
+                break;
+
+            default:
+                detail("Unsupported PCCC function %02x.", pccc[4]);
+                break;
+        }
+    } else {
+        detail("Unsupported PCCC command %02x.", pccc[0]);
+    }
+
+    out[1] = status;
+
+    resp->data_len = id_len + PCCC_HEADER_SIZE + data_len;
+}
+
+
+void cip_pccc_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    if(req->path.has_instance && req->path.instance_id != 1) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    if(req->service != CIP_SRV_EXECUTE_PCCC) {
+        resp->general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED;
+        return;
+    }
+
+    execute_pccc(device, req, resp);
+}
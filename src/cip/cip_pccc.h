@@ -0,0 +1,32 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include "cip/cip.h"
+
+
+/*
+ * PCCC encapsulated in CIP, Execute PCCC (0x4B) on the PCCC object (class
+ * 0x67).  This is what SLC and PLC-5 era clients send to a Logix controller.
+ *
+ * The typed logical reads and writes (functions 0xA1, 0xA2, 0xA9 and 0xAA)
+ * are supported against the data files in the device's tag database, see
+ * tags/data_files.h.  A read is one copy from the file's tag.
+ */
+
+struct device_t;
+
+extern void cip_pccc_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp);
@@ -0,0 +1,136 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_CIP)
+
+
+
+#include <string.h>
+
+#include "cip/cip.h"
+#include "cip/cip_symbol.h"
+#include "device/device.h"
+#include "tags/tag_browse.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+#define MAX_ATTRS (16)
+
+
+
+static bool is_common_request(const uint16_t *attrs, uint16_t num_attrs)
+{
+    if(num_attrs != TAG_BROWSE_NUM_COMMON_ATTRS) {
+        return false;
+    }
+
+    return (memcmp(attrs, tag_browse_common_attrs, sizeof(tag_browse_common_attrs)) == 0);
+}
+
+
+/* any other attribute list is encoded tag by tag. */
+static void encode_page(struct tag_db_t *db, uint32_t start_instance, const uint16_t *attrs, uint16_t num_attrs, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    size_t out = 0;
+
+    for(uint32_t id = (start_instance ? start_instance : 1); id <= db->num_tags; id++) {
+        size_t len = 0;
+
+        rc = tag_browse_encode_entry(tag_db_get_instance(db, id), attrs, num_attrs, resp->data + out, resp->capacity - out, &len);
+
+        if(rc == STATUS_OUT_OF_BOUNDS) {
+            resp->general_status = (out ? CIP_STATUS_PARTIAL_DATA : CIP_STATUS_NO_RESOURCE);
+            break;
+        }
+
+        if(rc != STATUS_OK) {
+            resp->general_status = CIP_STATUS_ATTRIBUTE_NOT_SUPPORTED;
+            out = 0;
+            break;
+        }
+
+        out += len;
+    }
+
+    resp->data_len = out;
+}
+
+
+static void get_instance_attribute_list(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    status_t rc = STATUS_OK;
+    uint16_t attrs[MAX_ATTRS];
+    uint16_t num_attrs = 0;
+    bool more = false;
+
+    if(req->data_len < 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    num_attrs = decode_uint16_le(req->data);
+
+    if(num_attrs == 0 || num_attrs > MAX_ATTRS) {
+        resp->general_status = CIP_STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    if(req->data_len < 2 + (2 * (size_t)num_attrs)) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    for(uint16_t i = 0; i < num_attrs; i++) {
+        attrs[i] = decode_uint16_le(req->data + 2 + (2 * i));
+    }
+
+    if(!is_common_request(attrs, num_attrs)) {
+        encode_page(device->tag_db, req->path.instance_id, attrs, num_attrs, resp);
+        return;
+    }
+
+    if((rc = tag_browse_page(device->tag_db, req->path.instance_id, resp->data, resp->capacity, &(resp->data_len), &more)) != STATUS_OK) {
+        warn("Error %s building browse page!", status_to_str(rc));
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    /* not even one entry fits, asking again would not help. */
+    if(more) {
+        resp->general_status = (resp->data_len ? CIP_STATUS_PARTIAL_DATA : CIP_STATUS_NO_RESOURCE);
+    }
+}
+
+
+
+void cip_symbol_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    if(!req->path.has_instance) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    switch(req->service) {
+        case CIP_SRV_GET_INSTANCE_ATTRIBUTE_LIST:
+            get_instance_attribute_list(device, req, resp);
+            break;
+
+        default:
+            resp->general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED;
+            break;
+    }
+}
@@ -0,0 +1,30 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include "cip/cip.h"
+
+
+/*
+ * The Symbol object, class 0x6B.  Instance N is the tag with instance ID N.
+ * Clients browse the tag list with Get Instance Attribute List, starting at
+ * instance zero and asking again after the last instance of each partial
+ * reply.
+ */
+
+struct device_t;
+
+extern void cip_symbol_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp);
@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_CIP)
+
+
+
+#include <string.h>
+
+#include "cip/cip.h"
+#include "cip/cip_template.h"
+#include "device/device.h"
+#include "tags/tag_db.h"
+#include "tags/udt.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+/* the attribute list every client we know of asks for, 4, 5, 2 and 1. */
+static const uint8_t common_attr_request[] = { 0x04, 0x00, 0x04, 0x00, 0x05, 0x00, 0x02, 0x00, 0x01, 0x00 };
+
+
+
+static void get_attribute_list(struct udt_t *udt, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    uint16_t count = 0;
+    size_t out = 2;
+
+    if(req->data_len == sizeof(common_attr_request) && memcmp(req->data, common_attr_request, sizeof(common_attr_request)) == 0) {
+        if(resp->capacity < UDT_ATTR_RESPONSE_SIZE) {
+            resp->general_status = CIP_STATUS_NO_RESOURCE;
+            return;
+        }
+
+        memcpy(resp->data, udt->attr_response, UDT_ATTR_RESPONSE_SIZE);
+        resp->data_len = UDT_ATTR_RESPONSE_SIZE;
+        return;
+    }
+
+    if(req->data_len < 2) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    count = decode_uint16_le(req->data);
+
+    if(req->data_len < 2 + (2 * (size_t)count)) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    /* the largest reply is 8 bytes per attribute. */
+    if(resp->capacity < 2 + (8 * (size_t)count)) {
+        resp->general_status = CIP_STATUS_NO_RESOURCE;
+        return;
+    }
+
+    encode_uint16_le(resp->data, count);
+
+    for(uint16_t i = 0; i < count; i++) {
+        uint16_t attr = decode_uint16_le(req->data + 2 + (2 * i));
+        uint8_t *d = resp->data + out;
+
+        encode_uint16_le(d, attr);
+        encode_uint16_le(d + 2, CIP_STATUS_OK);
+
+        switch(attr) {
+            case 1: encode_uint16_le(d + 4, udt->handle); out += 6; break;
+            case 2: encode_uint16_le(d + 4, (uint16_t)udt->num_members); out += 6; break;
+            case 4: encode_uint32_le(d + 4, udt->definition_words); out += 8; break;
+            case 5: encode_uint32_le(d + 4, udt->size); out += 8; break;
+
+            default:
+                encode_uint16_le(d + 2, CIP_STATUS_ATTRIBUTE_NOT_SUPPORTED);
+                out += 4;
+                break;
+        }
+    }
+
+    resp->data_len = out;
+}
+
+
+static void read_template(struct udt_t *udt, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    uint32_t offset = 0;
+    size_t length = 0;
+
+    if(req->data_len < 6) {
+        resp->general_status = CIP_STATUS_NOT_ENOUGH_DATA;
+        return;
+    }
+
+    offset = decode_uint32_le(req->data);
+    length = decode_uint16_le(req->data + 4);
+
+    if(offset >= udt->definition_len) {
+        resp->general_status = CIP_STATUS_INVALID_PARAMETER;
+        return;
+    }
+
+    if(length > udt->definition_len - offset) {
+        length = udt->definition_len - offset;
+    }
+
+    /* clients keep reading from the next offset until the status is not partial. */
+    if(length > resp->capacity) {
+        length = resp->capacity & ~(size_t)3;
+    }
+
+    memcpy(resp->data, udt->definition + offset, length);
+    resp->data_len = length;
+
+    if(offset + length < udt->definition_len) {
+        resp->general_status = CIP_STATUS_PARTIAL_DATA;
+    }
+}
+
+
+
+void cip_template_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp)
+{
+    struct udt_t *udt = NULL;
+
+    if(!req->path.has_instance || !(udt = udt_registry_get_instance(device->tag_db->udts, req->path.instance_id)) || !udt->resolved) {
+        resp->general_status = CIP_STATUS_PATH_DEST_UNKNOWN;
+        return;
+    }
+
+    switch(req->service) {
+        case CIP_SRV_GET_ATTRIBUTE_LIST:
+            get_attribute_list(udt, req, resp);
+            break;
+
+        case CIP_SRV_READ_TEMPLATE:
+            read_template(udt, req, resp);
+            break;
+
+        default:
+            resp->general_status = CIP_STATUS_SERVICE_NOT_SUPPORTED;
+            break;
+    }
+}
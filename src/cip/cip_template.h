@@ -0,0 +1,29 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include "cip/cip.h"
+
+
+/*
+ * The Template object, class 0x6C.  Instance N is the Nth structure of the
+ * device's tag database.  Everything served here was encoded when the
+ * structures were resolved, so requests are answered with copies.
+ */
+
+struct device_t;
+
+extern void cip_template_handle(struct device_t *device, const struct cip_request_t *req, struct cip_response_t *resp);
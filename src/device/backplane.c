@@ -0,0 +1,89 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+
+#include "device/backplane.h"
+#include "device/device.h"
+#include "util/debug.h"
+
+
+
+struct backplane_t *backplane_create(uint32_t num_slots)
+{
+    struct backplane_t *backplane = NULL;
+
+    if(num_slots == 0 || num_slots > BACKPLANE_MAX_SLOTS) {
+        warn("A chassis has between 1 and %d slots, not %u!", BACKPLANE_MAX_SLOTS, num_slots);
+        return NULL;
+    }
+
+    if(!(backplane = calloc(1, sizeof(*backplane)))) {
+        warn("Unable to allocate backplane!");
+        return NULL;
+    }
+
+    backplane->num_slots = num_slots;
+
+    return backplane;
+}
+
+
+/* the devices are not ours, they only point back here. */
+void backplane_dispose(struct backplane_t *backplane)
+{
+    if(backplane) {
+        free(backplane);
+    }
+}
+
+
+
+status_t backplane_insert(struct backplane_t *backplane, struct device_t *device, uint8_t slot)
+{
+    if(!backplane || !device) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(slot >= backplane->num_slots) {
+        warn("Slot %u is outside of a %u slot chassis!", slot, backplane->num_slots);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    if(backplane->slots[slot]) {
+        warn("Slot %u already holds device %u!", slot, backplane->slots[slot]->id);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    backplane->slots[slot] = device;
+
+    device->backplane = backplane;
+    device->slot = slot;
+
+    return STATUS_OK;
+}
+
+
+/* NULL for an empty slot. */
+struct device_t *backplane_get(struct backplane_t *backplane, uint8_t slot)
+{
+    if(!backplane || slot >= backplane->num_slots) {
+        return NULL;
+    }
+
+    return backplane->slots[slot];
+}
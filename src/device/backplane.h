@@ -0,0 +1,46 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/*
+ * A simulated chassis.  Devices in the same backplane reach each other
+ * through port 1 with the slot number as the link address, the way a
+ * client talks to a controller behind an ENBT.  A device that is not in a
+ * chassis answers for slot 0 on its own.
+ */
+
+#define BACKPLANE_PORT (1)
+#define BACKPLANE_MAX_SLOTS (17)
+
+
+struct device_t;
+
+struct backplane_t {
+    uint32_t num_slots;
+    struct device_t *slots[BACKPLANE_MAX_SLOTS];
+};
+
+
+extern struct backplane_t *backplane_create(uint32_t num_slots);
+extern void backplane_dispose(struct backplane_t *backplane);
+
+extern status_t backplane_insert(struct backplane_t *backplane, struct device_t *device, uint8_t slot);
+extern struct device_t *backplane_get(struct backplane_t *backplane, uint8_t slot);
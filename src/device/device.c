@@ -0,0 +1,149 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device/device.h"
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "util/debug.h"
+
+
+/* Rockwell Automation, programmable logic controller. */
+#define DEFAULT_VENDOR_ID (0x0001)
+#define DEFAULT_DEVICE_TYPE (0x000E)
+#define DEFAULT_PRODUCT_CODE (0x00A6)
+#define DEFAULT_REVISION_MAJOR (32)
+#define DEFAULT_REVISION_MINOR (11)
+#define DEFAULT_SERIAL_BASE (0x5A000000)
+
+
+
+void device_identity_init(struct device_identity_t *identity, uint32_t device_id)
+{
+    if(!identity) {
+        return;
+    }
+
+    memset(identity, 0, sizeof(*identity));
+
+    identity->vendor_id = DEFAULT_VENDOR_ID;
+    identity->device_type = DEFAULT_DEVICE_TYPE;
+    identity->product_code = DEFAULT_PRODUCT_CODE;
+    identity->revision_major = DEFAULT_REVISION_MAJOR;
+    identity->revision_minor = DEFAULT_REVISION_MINOR;
+    identity->status = 0x0060; /* run mode, configured */
+    identity->serial_number = DEFAULT_SERIAL_BASE + device_id;
+
+    snprintf(identity->product_name, sizeof(identity->product_name), "1756-L81E/B tag_sim %u", device_id);
+}
+
+
+
+/*
+ * The device takes a reference to the tag database and gets its own image of
+ * the tag values.  If a template is given the image shares it copy-on-write.
+ */
+struct device_t *device_create(uint32_t id, const struct device_identity_t *identity, struct tag_db_t *tag_db, struct tag_image_template_t *tmpl)
+{
+    struct device_t *device = NULL;
+
+    if(!tag_db) {
+        warn("Called with a NULL tag database pointer!");
+        return NULL;
+    }
+
+    if(!(device = calloc(1, sizeof(*device)))) {
+        warn("Unable to allocate device %u!", id);
+        return NULL;
+    }
+
+    if(!(device->tag_image = tag_image_create(tmpl, tag_db->data_size))) {
+        warn("Unable to create tag image for device %u!", id);
+        free(device);
+        return NULL;
+    }
+
+    device->id = id;
+    device->tag_db = tag_db_ref(tag_db);
+
+    if(identity) {
+        device->identity = *identity;
+    } else {
+        device_identity_init(&(device->identity), id);
+    }
+
+    /* session handles are per device but should not look like small integers. */
+    device->next_session_handle = (id << 16) | 1;
+
+    /* connection IDs are picked by us for the client to send to, same idea. */
+    device->next_connection_id = (id << 20) ^ 0x5A000001u;
+
+    return device;
+}
+
+
+void device_dispose(struct device_t *device)
+{
+    if(!device) {
+        return;
+    }
+
+    tag_db_dispose(device->tag_db);
+    tag_image_dispose(device->tag_image);
+
+    if(device->metrics) {
+        free(device->metrics);
+    }
+
+    free(device);
+}
+
+
+
+uint32_t device_new_session_handle(struct device_t *device)
+{
+    uint32_t handle = 0;
+
+    if(device) {
+        handle = device->next_session_handle++;
+
+        /* zero is never a valid session handle. */
+        if(handle == 0) {
+            handle = device->next_session_handle++;
+        }
+    }
+
+    return handle;
+}
+
+
+uint32_t device_new_connection_id(struct device_t *device)
+{
+    uint32_t conn_id = 0;
+
+    if(device) {
+        conn_id = device->next_connection_id++;
+
+        if(conn_id == 0) {
+            conn_id = device->next_connection_id++;
+        }
+    }
+
+    return conn_id;
+}
@@ -0,0 +1,97 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "util/status.h"
+
+
+#define DEVICE_PRODUCT_NAME_MAX (32)
+
+
+struct backplane_t;
+struct eip_discovery_t;
+struct io_sched_t;
+struct metrics_device_t;
+
+
+/* the attributes of the CIP Identity object (class 0x01, instance 1). */
+struct device_identity_t {
+    uint16_t vendor_id;
+    uint16_t device_type;
+    uint16_t product_code;
+    uint8_t revision_major;
+    uint8_t revision_minor;
+    uint16_t status;
+    uint32_t serial_number;
+    char product_name[DEVICE_PRODUCT_NAME_MAX + 1];
+};
+
+
+/*
+ * One simulated controller.
+ *
+ * This is deliberately small.  A process may host thousands of these, so
+ * anything that is only needed while a client is connected lives in the
+ * connection state and comes from a shared pool, not from here.
+ */
+struct device_t {
+    uint32_t id;
+
+    struct device_identity_t identity;
+    struct tag_db_t *tag_db;
+    struct tag_image_t *tag_image;
+
+    /* where the device listens. */
+    char address[48];
+    uint16_t port;
+
+    /* the proactor loop that services this device and its listener socket. */
+    struct proactor_t *proactor;
+    struct proactor_socket_t *listener;
+
+    /* encoded discovery replies, made when the device is added to a host. */
+    struct eip_discovery_t *discovery;
+
+    /* the counts are read by metrics scrapes on other threads, use the atomic shims. */
+    uint32_t next_session_handle;
+    uint32_t num_sessions;
+
+    uint32_t next_connection_id;
+    uint32_t num_connections;
+
+    /* the I/O scheduler shared by the host's devices, NULL if class 1 is not enabled. */
+    struct io_sched_t *io;
+
+    /* the chassis the device sits in and where, NULL for a device on its own. */
+    struct backplane_t *backplane;
+    uint8_t slot;
+
+    /* counters for scraping, NULL unless the host has metrics enabled. */
+    struct metrics_device_t *metrics;
+};
+
+
+extern void device_identity_init(struct device_identity_t *identity, uint32_t device_id);
+
+extern struct device_t *device_create(uint32_t id, const struct device_identity_t *identity, struct tag_db_t *tag_db, struct tag_image_template_t *tmpl);
+extern void device_dispose(struct device_t *device);
+
+extern uint32_t device_new_session_handle(struct device_t *device);
+extern uint32_t device_new_connection_id(struct device_t *device);
@@ -0,0 +1,816 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+#endif
+
+#include "device/backplane.h"
+#include "device/device.h"
+#include "device/device_host.h"
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "eip/eip_discovery.h"
+#include "io/io_sched.h"
+#include "metrics/metrics.h"
+#include "modbus/modbus.h"
+#include "tags/tag_image.h"
+#include "util/debug.h"
+#include "util/pool.h"
+#include "util/proactor_net.h"
+#include "util/time_utils.h"
+
+
+#define HOST_TICK_PERIOD_MS (100)
+#define HOST_MIN_DEVICE_CAPACITY (16)
+#define HOST_CONNS_PER_CHUNK (64)
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data);
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data);
+
+static void process_frames(struct device_host_t *host, struct eip_conn_t *conn);
+static void conn_close(struct device_host_t *host, struct eip_conn_t *conn);
+
+
+
+struct device_host_t *device_host_create(uint32_t num_loops)
+{
+    status_t rc = STATUS_OK;
+    struct device_host_t *host = NULL;
+
+    info("Starting.");
+
+    do {
+        if(num_loops == 0) {
+            num_loops = 1;
+        }
+
+        if(!(host = calloc(1, sizeof(*host)))) {
+            warn("Unable to allocate device host!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        host->capacity = HOST_MIN_DEVICE_CAPACITY;
+
+        if(!(host->devices = calloc(host->capacity, sizeof(*host->devices)))) {
+            warn("Unable to allocate device array!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(!(host->loops = calloc(num_loops, sizeof(*host->loops)))) {
+            warn("Unable to allocate proactor loop array!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(!(host->conn_pool = pool_create(sizeof(struct eip_conn_t), HOST_CONNS_PER_CHUNK))) {
+            warn("Unable to create connection pool!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        /* devices still answer discovery over TCP without this. */
+        if(!(host->discovery = eip_discovery_responder_create(NULL, EIP_DEFAULT_PORT))) {
+            warn("UDP discovery is not available!");
+        }
+
+        for(uint32_t i = 0; i < num_loops; i++) {
+            detail("Creating proactor loop %u.", i);
+
+            host->loops[i].proactor = proactor_net_create(NULL, NULL, host, HOST_TICK_PERIOD_MS);
+            if(!host->loops[i].proactor || proactor_net_get_status(host->loops[i].proactor) != STATUS_OK) {
+                warn("Unable to create proactor loop %u!", i);
+                rc = STATUS_SETUP_FAILURE;
+                break;
+            }
+
+            host->num_loops++;
+        }
+    } while(0);
+
+    if(rc != STATUS_OK && host) {
+        device_host_dispose(host);
+        host = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return host;
+}
+
+
+void device_host_dispose(struct device_host_t *host)
+{
+    info("Starting.");
+
+    if(!host) {
+        warn("Called with a NULL host pointer!");
+        return;
+    }
+
+    /* disposing the proactors closes all the sockets and calls the close callbacks. */
+    if(host->loops) {
+        for(uint32_t i = 0; i < host->num_loops; i++) {
+            proactor_net_dispose(host->loops[i].proactor);
+        }
+
+        free(host->loops);
+    }
+
+    /* after the proactors, closing the connections removes their I/O. */
+    io_sched_dispose(host->io);
+
+    modbus_server_dispose(host->modbus);
+
+    metrics_server_dispose(host->metrics);
+
+    eip_discovery_responder_dispose(host->discovery);
+
+    if(host->devices) {
+        for(uint32_t i = 0; i < host->num_devices; i++) {
+            eip_discovery_dispose(host->devices[i]->discovery);
+            device_dispose(host->devices[i]);
+        }
+
+        free(host->devices);
+    }
+
+    if(host->backplanes) {
+        for(uint32_t i = 0; i < host->num_backplanes; i++) {
+            backplane_dispose(host->backplanes[i]);
+        }
+
+        free(host->backplanes);
+    }
+
+    pool_dispose(host->conn_pool);
+
+    free(host);
+
+    info("Done.");
+}
+
+
+
+/* only for devices added after this, the ones already added stay on their own. */
+status_t device_host_set_chassis(struct device_host_t *host, uint32_t slots_per_chassis)
+{
+    if(!host) {
+        warn("Called with a NULL host pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(slots_per_chassis > BACKPLANE_MAX_SLOTS) {
+        warn("A chassis has at most %d slots!", BACKPLANE_MAX_SLOTS);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    host->slots_per_chassis = slots_per_chassis;
+
+    return STATUS_OK;
+}
+
+
+
+/* every loop warns about callbacks that hold it up for at least this long. */
+status_t device_host_set_slow_callback(struct device_host_t *host, int64_t threshold_ns)
+{
+    status_t rc = STATUS_OK;
+
+    if(!host) {
+        warn("Called with a NULL host pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    for(uint32_t i = 0; i < host->num_loops && rc == STATUS_OK; i++) {
+        rc = proactor_net_set_slow_callback_ns(host->loops[i].proactor, threshold_ns);
+    }
+
+    return rc;
+}
+
+
+/* the chassis the next device goes in, a new one when the last is full. */
+static struct backplane_t *next_backplane(struct device_host_t *host, uint8_t *slot)
+{
+    struct backplane_t *backplane = (host->num_backplanes ? host->backplanes[host->num_backplanes - 1] : NULL);
+    struct backplane_t **new_backplanes = NULL;
+
+    if(backplane && backplane->num_slots == host->slots_per_chassis) {
+        for(uint32_t i = 0; i < backplane->num_slots; i++) {
+            if(!backplane->slots[i]) {
+                *slot = (uint8_t)i;
+                return backplane;
+            }
+        }
+    }
+
+    if(!(new_backplanes = realloc(host->backplanes, (host->num_backplanes + 1) * sizeof(*new_backplanes)))) {
+        warn("Unable to grow backplane array!");
+        return NULL;
+    }
+
+    host->backplanes = new_backplanes;
+
+    if(!(backplane = backplane_create(host->slots_per_chassis))) {
+        return NULL;
+    }
+
+    host->backplanes[host->num_backplanes++] = backplane;
+    *slot = 0;
+
+    return backplane;
+}
+
+
+
+/* devices added before or after this produce class 1 data through one shared scheduler. */
+status_t device_host_enable_io(struct device_host_t *host, const struct io_sched_config_t *config)
+{
+    if(!host || !config) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(host->io) {
+        warn("I/O is already enabled!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(!(host->io = io_sched_create(config))) {
+        warn("Unable to create the I/O scheduler!");
+        return STATUS_SETUP_FAILURE;
+    }
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        host->devices[i]->io = host->io;
+    }
+
+    return STATUS_OK;
+}
+
+
+
+/* devices added before or after this become Modbus units in the order they were added. */
+status_t device_host_enable_modbus(struct device_host_t *host, const char *address, uint16_t port, const struct modbus_map_t *map)
+{
+    if(!host || !map) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(host->modbus) {
+        warn("Modbus is already enabled!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(!(host->modbus = modbus_server_create(host->loops[0].proactor, address, port, map))) {
+        warn("Unable to create the Modbus server!");
+        return STATUS_SETUP_FAILURE;
+    }
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        modbus_server_add_device(host->modbus, host->devices[i]);
+    }
+
+    return STATUS_OK;
+}
+
+
+
+/* devices added before or after this are counted, each labelled with its ID if there is more than one. */
+status_t device_host_enable_metrics(struct device_host_t *host, const char *address, uint16_t port, const char *unix_path)
+{
+    if(!host) {
+        warn("Called with a NULL host pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(host->metrics) {
+        warn("Metrics are already enabled!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(!(host->metrics = metrics_server_create(host, host->loops[0].proactor, address, port, unix_path))) {
+        warn("Unable to create the metrics server!");
+        return STATUS_SETUP_FAILURE;
+    }
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        host->loops[i].metrics_shard = &(host->metrics->shards[i]);
+    }
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        metrics_server_add_device(host->metrics, host->devices[i]);
+    }
+
+    return STATUS_OK;
+}
+
+
+
+status_t device_host_add_device(struct device_host_t *host, struct device_t *device, const char *address, uint16_t port)
+{
+    status_t rc = STATUS_OK;
+    struct device_host_loop_t *loop = NULL;
+    struct backplane_t *backplane = NULL;
+    uint8_t slot = 0;
+
+    info("Starting.");
+
+    do {
+        if(!host || !device) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(host->num_devices >= host->capacity) {
+            struct device_t **new_devices = realloc(host->devices, (host->capacity * 2) * sizeof(*new_devices));
+
+            if(!new_devices) {
+                warn("Unable to grow device array!");
+                rc = STATUS_NO_RESOURCE;
+                break;
+            }
+
+            host->devices = new_devices;
+            host->capacity *= 2;
+        }
+
+        if(host->slots_per_chassis && !(backplane = next_backplane(host, &slot))) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        /* put the device on the least loaded loop, or with the rest of its chassis. */
+        loop = &(host->loops[0]);
+        for(uint32_t i = 1; i < host->num_loops; i++) {
+            if(host->loops[i].num_devices < loop->num_devices) {
+                loop = &(host->loops[i]);
+            }
+        }
+
+        if(backplane && slot > 0) {
+            for(uint32_t i = 0; i < host->num_loops; i++) {
+                if(host->loops[i].proactor == backplane->slots[0]->proactor) {
+                    loop = &(host->loops[i]);
+                }
+            }
+        }
+
+        snprintf(device->address, sizeof(device->address), "%s", (address ? address : ""));
+        device->port = port;
+        device->proactor = loop->proactor;
+        device->io = host->io;
+
+        if(!(device->discovery = eip_discovery_create(device))) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        rc = proactor_net_socket_open(loop->proactor, &(device->listener), PROACTOR_SOCK_TCP_LISTENER, device->address, port, device, host);
+        if(rc != STATUS_OK) {
+            warn("Error %s opening listener on %s:%u for device %u!", status_to_str(rc), device->address, port, device->id);
+            break;
+        }
+
+        proactor_net_socket_set_accept_callback(device->listener, on_accept);
+
+        if((rc = proactor_net_start_accept(device->listener)) != STATUS_OK) {
+            warn("Error %s starting accept for device %u!", status_to_str(rc), device->id);
+            proactor_net_socket_close(device->listener);
+            device->listener = NULL;
+            break;
+        }
+
+        loop->num_devices++;
+        host->devices[host->num_devices++] = device;
+
+        if(backplane) {
+            backplane_insert(backplane, device, slot);
+        }
+
+        if(host->discovery) {
+            eip_discovery_responder_add(host->discovery, device->discovery);
+        }
+
+        if(host->modbus) {
+            modbus_server_add_device(host->modbus, device);
+        }
+
+        if(host->metrics) {
+            metrics_server_add_device(host->metrics, device);
+        }
+
+        detail("Device %u listening on %s:%u.", device->id, device->address, port);
+    } while(0);
+
+    if(rc != STATUS_OK && device && device->discovery) {
+        eip_discovery_dispose(device->discovery);
+        device->discovery = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+
+static void *loop_thread_func(void *arg)
+{
+    struct device_host_loop_t *loop = (struct device_host_loop_t *)arg;
+
+    metrics_thread_shard = loop->metrics_shard;
+
+    proactor_net_run(loop->proactor);
+
+    return NULL;
+}
+
+
+status_t device_host_run(struct device_host_t *host)
+{
+    status_t rc = STATUS_OK;
+    uint32_t started = 0;
+
+    info("Starting.");
+
+    if(!host) {
+        warn("Called with a NULL host pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    info("Running %u devices on %u proactor loops.", host->num_devices, host->num_loops);
+
+    if(host->io && (rc = io_sched_start(host->io)) != STATUS_OK) {
+        warn("Error %s starting the I/O scheduler!", status_to_str(rc));
+        return rc;
+    }
+
+    if(host->discovery && eip_discovery_responder_start(host->discovery) != STATUS_OK) {
+        warn("UDP discovery will not be answered!");
+    }
+
+    if(host->metrics && metrics_server_start(host->metrics) != STATUS_OK) {
+        warn("Metrics will only be served over HTTP!");
+    }
+
+    for(started = 0; started < host->num_loops; started++) {
+        if(!THREAD_CREATE(host->loops[started].thread, loop_thread_func, &(host->loops[started]))) {
+            warn("Unable to start thread for proactor loop %u!", started);
+            rc = STATUS_SETUP_FAILURE;
+            device_host_stop(host);
+            break;
+        }
+    }
+
+    for(uint32_t i = 0; i < started; i++) {
+        THREAD_JOIN(host->loops[i].thread);
+    }
+
+    io_sched_stop(host->io);
+    eip_discovery_responder_stop(host->discovery);
+    metrics_server_stop(host->metrics);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+void device_host_stop(struct device_host_t *host)
+{
+    if(host) {
+        for(uint32_t i = 0; i < host->num_loops; i++) {
+            proactor_net_stop(host->loops[i].proactor);
+        }
+    }
+}
+
+
+
+void device_host_get_memory(struct device_host_t *host, struct device_host_memory_t *mem)
+{
+    struct tag_image_template_t **seen = NULL;
+    uint32_t num_seen = 0;
+
+    if(!host || !mem) {
+        return;
+    }
+
+    memset(mem, 0, sizeof(*mem));
+
+    /* there are usually only a handful of distinct templates. */
+    seen = calloc(host->num_devices + 1, sizeof(*seen));
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        struct tag_image_t *image = host->devices[i]->tag_image;
+        struct tag_image_stats_t stats = {0};
+        bool counted = false;
+
+        tag_image_get_stats(image, &stats);
+
+        mem->num_devices++;
+        mem->private_bytes += stats.private_bytes + (image->num_blocks * sizeof(*image->blocks));
+        mem->unshared_bytes += image->size;
+
+        if(!image->tmpl || !image->tmpl->data) {
+            continue;
+        }
+
+        for(uint32_t j = 0; j < num_seen; j++) {
+            if(seen[j] == image->tmpl) {
+                counted = true;
+                break;
+            }
+        }
+
+        if(!counted) {
+            mem->shared_bytes += image->tmpl->size;
+
+            if(seen) {
+                seen[num_seen++] = image->tmpl;
+            }
+        }
+    }
+
+    if(seen) {
+        free(seen);
+    }
+}
+
+
+
+
+/*
+ * Connection handling.  All of these run on the loop that owns the device.
+ */
+
+static status_t start_receive(struct eip_conn_t *conn)
+{
+    conn->rx_buf.data = conn->rx_data + conn->rx_len;
+    conn->rx_buf.data_length = sizeof(conn->rx_data) - conn->rx_len;
+
+    return proactor_net_start_receive(conn->socket, &(conn->rx_buf));
+}
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data)
+{
+    struct device_host_t *host = (struct device_host_t *)app_data;
+    struct device_t *device = (struct device_t *)sock_data;
+    struct eip_conn_t *conn = NULL;
+
+    if(status != STATUS_OK) {
+        warn("Error %s accepting connection for device %u!", status_to_str(status), device->id);
+        metrics_count_error(device->metrics, status);
+        return status;
+    }
+
+    if(!(conn = pool_alloc(host->conn_pool))) {
+        warn("Unable to allocate connection state for device %u!", device->id);
+        metrics_count_error(device->metrics, STATUS_NO_RESOURCE);
+        proactor_net_socket_close(client_socket);
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(device->metrics) {
+        metrics_add(&(device->metrics->tcp_connections), 1);
+    }
+
+    conn->device = device;
+    conn->socket = client_socket;
+
+    proactor_net_socket_set_data(client_socket, conn);
+    proactor_net_socket_set_receive_callback(client_socket, on_receive);
+    proactor_net_socket_set_sent_callback(client_socket, on_sent);
+    proactor_net_socket_set_close_callback(client_socket, on_close);
+
+    detail("Accepted connection for device %u.", device->id);
+
+    return start_receive(conn);
+}
+
+
+/* the capture tuple.  A device listening on any address shows up as 0.0.0.0. */
+static void init_capture_flow(struct eip_conn_t *conn, const struct sockaddr_in *peer)
+{
+    struct eip_capture_flow_t *flow = &(conn->capture_flow);
+    struct in_addr local;
+
+    flow->client_ip = peer->sin_addr.s_addr;
+    flow->client_port = peer->sin_port;
+    flow->server_port = htons(conn->device->port);
+
+    if(inet_pton(AF_INET, conn->device->address, &local) == 1) {
+        flow->server_ip = local.s_addr;
+    }
+
+    flow->client_seq = 1;
+    flow->server_seq = 1;
+}
+
+
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct device_host_t *host = (struct device_host_t *)app_data;
+    struct eip_conn_t *conn = (struct eip_conn_t *)sock_data;
+
+    if(status != STATUS_OK) {
+        detail("Error %s receiving on connection, closing.", status_to_str(status));
+        metrics_count_error(conn->device->metrics, status);
+        conn_close(host, conn);
+        return status;
+    }
+
+    conn->rx_len += buffer->data_length;
+
+    metrics_count_bytes(conn->device->metrics, buffer->data_length, 0);
+
+    if(!conn->peer_ip && remote_addr && remote_addr->sa_family == AF_INET) {
+        conn->peer_ip = ((struct sockaddr_in *)remote_addr)->sin_addr.s_addr;
+        conn->debug_level = (uint8_t)debug_get_peer_level(conn->peer_ip);
+        init_capture_flow(conn, (struct sockaddr_in *)remote_addr);
+    }
+
+    debug_conn_begin(conn->debug_level);
+    process_frames(host, conn);
+    debug_conn_end();
+
+    return STATUS_OK;
+}
+
+
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct device_host_t *host = (struct device_host_t *)app_data;
+    struct eip_conn_t *conn = (struct eip_conn_t *)sock_data;
+
+    conn->sending = false;
+
+    if(status != STATUS_OK) {
+        metrics_count_error(conn->device->metrics, status);
+        conn_close(host, conn);
+        return status;
+    }
+
+    metrics_count_bytes(conn->device->metrics, 0, buffer->data_length);
+
+    if(conn->close_requested) {
+        conn_close(host, conn);
+        return status;
+    }
+
+    /* there may be pipelined requests already waiting. */
+    debug_conn_begin(conn->debug_level);
+    process_frames(host, conn);
+    debug_conn_end();
+
+    return STATUS_OK;
+}
+
+
+static void release_conn(struct device_host_t *host, struct eip_conn_t *conn)
+{
+    if(conn->session_handle && ATOMIC_LOAD_U32(&(conn->device->num_sessions))) {
+        ATOMIC_STORE_U32(&(conn->device->num_sessions), ATOMIC_LOAD_U32(&(conn->device->num_sessions)) - 1);
+    }
+
+    if(conn->device->metrics) {
+        metrics_sub(&(conn->device->metrics->tcp_connections), 1);
+    }
+
+    eip_cm_close_all(conn);
+
+    pool_free(host->conn_pool, conn);
+}
+
+
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data)
+{
+    struct device_host_t *host = (struct device_host_t *)app_data;
+    struct eip_conn_t *conn = (struct eip_conn_t *)sock_data;
+
+    detail("Connection closed by the client.");
+
+    proactor_net_socket_set_data(socket, NULL);
+
+    if(conn) {
+        release_conn(host, conn);
+    }
+
+    proactor_net_socket_close(socket);
+
+    return STATUS_OK;
+}
+
+
+static void conn_close(struct device_host_t *host, struct eip_conn_t *conn)
+{
+    struct proactor_socket_t *socket = conn->socket;
+
+    /* the socket must not hand the freed connection to anything after this. */
+    proactor_net_socket_set_data(socket, NULL);
+
+    release_conn(host, conn);
+
+    proactor_net_socket_close(socket);
+}
+
+
+/*
+ * Handle every complete frame in the receive buffer, one reply at a time.
+ * When a reply is in flight we stop and pick up again from the sent callback.
+ */
+static void process_frames(struct device_host_t *host, struct eip_conn_t *conn)
+{
+    while(!conn->sending) {
+        status_t rc = STATUS_OK;
+        size_t frame_len = eip_frame_length(conn->rx_data, conn->rx_len);
+        size_t resp_len = 0;
+
+        if(frame_len > sizeof(conn->rx_data)) {
+            warn("Frame of %zu bytes is too large, closing connection!", frame_len);
+            metrics_count_error(conn->device->metrics, STATUS_OUT_OF_BOUNDS);
+            conn_close(host, conn);
+            return;
+        }
+
+        if(frame_len == 0 || frame_len > conn->rx_len) {
+            /* need more data. */
+            if(start_receive(conn) != STATUS_OK) {
+                conn_close(host, conn);
+            }
+
+            return;
+        }
+
+        eip_capture_frame(conn->device->id, &(conn->capture_flow), EIP_CAPTURE_TO_SERVER, conn->rx_data, frame_len);
+
+        if(metrics_thread_shard) {
+            int64_t start_ns = util_clock_real_ns();
+
+            rc = eip_process_request(conn, conn->rx_data, frame_len, conn->tx_data, sizeof(conn->tx_data), &resp_len);
+
+            histogram_record(&(metrics_thread_shard->request_ns), (uint64_t)(util_clock_real_ns() - start_ns));
+        } else {
+            rc = eip_process_request(conn, conn->rx_data, frame_len, conn->tx_data, sizeof(conn->tx_data), &resp_len);
+        }
+
+        /* drop the frame we just handled. */
+        memmove(conn->rx_data, conn->rx_data + frame_len, conn->rx_len - frame_len);
+        conn->rx_len -= frame_len;
+
+        if(rc != STATUS_OK) {
+            warn("Error %s processing request, closing connection!", status_to_str(rc));
+            metrics_count_error(conn->device->metrics, rc);
+            conn_close(host, conn);
+            return;
+        }
+
+        if(resp_len > 0) {
+            eip_capture_frame(conn->device->id, &(conn->capture_flow), EIP_CAPTURE_TO_CLIENT, conn->tx_data, resp_len);
+
+            conn->sending = true;
+            conn->tx_buf.data = conn->tx_data;
+            conn->tx_buf.data_length = resp_len;
+
+            if(proactor_net_start_send(conn->socket, &(conn->tx_buf)) != STATUS_OK) {
+                conn_close(host, conn);
+            }
+
+            return;
+        }
+
+        if(conn->close_requested) {
+            conn_close(host, conn);
+            return;
+        }
+    }
+}
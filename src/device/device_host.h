@@ -0,0 +1,111 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "device/backplane.h"
+#include "device/device.h"
+#include "eip/eip_discovery.h"
+#include "io/io_sched.h"
+#include "metrics/metrics.h"
+#include "modbus/modbus.h"
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * A device host runs many simulated devices in one process.
+ *
+ * Each device gets its own listener, identity and tag database, but all of
+ * them share a fixed set of proactor loops, one per thread, and a single
+ * pool of connection state.  A device is bound to one loop for life so its
+ * tags are only ever touched from that loop's thread.
+ *
+ * Devices can be grouped into chassis.  Every slots_per_chassis devices
+ * share a backplane, the first in slot 0, and all of a chassis is put on
+ * one loop so requests routed across the backplane stay on that thread.
+ */
+
+struct device_host_loop_t {
+    struct proactor_t *proactor;
+    thread_t thread;
+    uint32_t num_devices;
+
+    /* this loop's metrics, NULL unless enabled. */
+    struct metrics_shard_t *metrics_shard;
+};
+
+
+struct device_host_t {
+    uint32_t num_loops;
+    struct device_host_loop_t *loops;
+
+    uint32_t num_devices;
+    uint32_t capacity;
+    struct device_t **devices;
+
+    struct pool_t *conn_pool;
+
+    /* zero when devices stand on their own. */
+    uint32_t slots_per_chassis;
+    uint32_t num_backplanes;
+    struct backplane_t **backplanes;
+
+    /* class 1 producer for all the devices, NULL unless enabled. */
+    struct io_sched_t *io;
+
+    /* answers UDP discovery for all the devices, NULL if the port was not available. */
+    struct eip_discovery_responder_t *discovery;
+
+    /* Modbus/TCP for all the devices, on the first loop.  NULL unless enabled. */
+    struct modbus_server_t *modbus;
+
+    /* Prometheus metrics, served from the first loop.  NULL unless enabled. */
+    struct metrics_server_t *metrics;
+};
+
+
+/* tag value memory across all devices. */
+struct device_host_memory_t {
+    uint32_t num_devices;
+
+    /* template bytes, counted once no matter how many devices share them. */
+    size_t shared_bytes;
+
+    /* blocks copied on write plus each device's block table. */
+    size_t private_bytes;
+
+    /* what the images would take if every device had its own copy. */
+    size_t unshared_bytes;
+};
+
+
+extern struct device_host_t *device_host_create(uint32_t num_loops);
+extern void device_host_dispose(struct device_host_t *host);
+
+extern status_t device_host_set_chassis(struct device_host_t *host, uint32_t slots_per_chassis);
+extern status_t device_host_set_slow_callback(struct device_host_t *host, int64_t threshold_ns);
+extern status_t device_host_enable_io(struct device_host_t *host, const struct io_sched_config_t *config);
+extern status_t device_host_enable_modbus(struct device_host_t *host, const char *address, uint16_t port, const struct modbus_map_t *map);
+extern status_t device_host_enable_metrics(struct device_host_t *host, const char *address, uint16_t port, const char *unix_path);
+extern status_t device_host_add_device(struct device_host_t *host, struct device_t *device, const char *address, uint16_t port);
+
+extern status_t device_host_run(struct device_host_t *host);
+extern void device_host_stop(struct device_host_t *host);
+
+extern void device_host_get_memory(struct device_host_t *host, struct device_host_memory_t *mem);
@@ -0,0 +1,287 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_EIP)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip/cip.h"
+#include "device/device.h"
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "eip/eip_discovery.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/shims.h"
+
+
+/* interface handle, timeout and item count before the CPF items. */
+#define CPF_PREFIX_SIZE (8)
+#define CPF_ITEM_HEADER_SIZE (4)
+
+
+
+status_t eip_decode_header(const uint8_t *data, size_t data_len, struct eip_header *header)
+{
+    if(!data || !header) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(data_len < EIP_ENCAP_HEADER_SIZE) {
+        return STATUS_PARTIAL;
+    }
+
+    header->encap_command = decode_uint16_le(data + 0);
+    header->encap_length = decode_uint16_le(data + 2);
+    header->encap_session_handle = decode_uint32_le(data + 4);
+    header->encap_status = decode_uint32_le(data + 8);
+    header->encap_sender_context = decode_uint64_le(data + 12);
+    header->encap_options = decode_uint32_le(data + 20);
+
+    return STATUS_OK;
+}
+
+
+void eip_encode_header(uint8_t *data, const struct eip_header *header)
+{
+    encode_uint16_le(data + 0, header->encap_command);
+    encode_uint16_le(data + 2, header->encap_length);
+    encode_uint32_le(data + 4, header->encap_session_handle);
+    encode_uint32_le(data + 8, header->encap_status);
+    encode_uint64_le(data + 12, header->encap_sender_context);
+    encode_uint32_le(data + 20, header->encap_options);
+}
+
+
+/*
+ * Return the full length of the frame at the start of the data, or zero if
+ * we do not have the whole encapsulation header yet.
+ */
+size_t eip_frame_length(const uint8_t *data, size_t data_len)
+{
+    if(!data || data_len < EIP_ENCAP_HEADER_SIZE) {
+        return 0;
+    }
+
+    return EIP_ENCAP_HEADER_SIZE + (size_t)decode_uint16_le(data + 2);
+}
+
+
+
+
+static size_t handle_register_session(struct eip_conn_t *conn, struct eip_header *header, const uint8_t *payload, uint8_t *resp)
+{
+    uint16_t version = 0;
+
+    if(header->encap_length < 4) {
+        header->encap_status = EIP_STATUS_INVALID_LENGTH;
+        return 0;
+    }
+
+    version = decode_uint16_le(payload);
+
+    if(version != EIP_PROTOCOL_VERSION) {
+        warn("Unsupported EIP protocol version %u!", version);
+        header->encap_status = EIP_STATUS_UNSUPPORTED_PROTOCOL;
+        return 0;
+    }
+
+    if(conn->session_handle) {
+        warn("Session already registered on this connection!");
+        header->encap_status = EIP_STATUS_INCORRECT_DATA;
+        return 0;
+    }
+
+    conn->session_handle = device_new_session_handle(conn->device);
+    ATOMIC_STORE_U32(&(conn->device->num_sessions), ATOMIC_LOAD_U32(&(conn->device->num_sessions)) + 1);
+
+    info("Registered session %08x on device %u.", conn->session_handle, conn->device->id);
+
+    header->encap_session_handle = conn->session_handle;
+
+    /* echo back the version and options. */
+    encode_uint16_le(resp, EIP_PROTOCOL_VERSION);
+    encode_uint16_le(resp + 2, 0);
+
+    return 4;
+}
+
+
+
+static size_t handle_send_rr_data(struct eip_conn_t *conn, struct eip_header *header, const uint8_t *payload, uint8_t *resp, size_t resp_capacity)
+{
+    status_t rc = STATUS_OK;
+    uint16_t item_count = 0;
+    const uint8_t *item = NULL;
+    const uint8_t *end = payload + header->encap_length;
+    const uint8_t *cip_req = NULL;
+    size_t cip_req_len = 0;
+    size_t cip_resp_len = 0;
+    size_t cip_offset = CPF_PREFIX_SIZE + (2 * CPF_ITEM_HEADER_SIZE);
+
+    if(!conn->session_handle || header->encap_session_handle != conn->session_handle) {
+        header->encap_status = EIP_STATUS_INVALID_SESSION;
+        return 0;
+    }
+
+    if(header->encap_length < CPF_PREFIX_SIZE) {
+        header->encap_status = EIP_STATUS_INVALID_LENGTH;
+        return 0;
+    }
+
+    item_count = decode_uint16_le(payload + 6);
+    item = payload + CPF_PREFIX_SIZE;
+
+    /* walk the items, we only care about the unconnected data item. */
+    for(uint16_t i = 0; i < item_count; i++) {
+        uint16_t item_type = 0;
+        uint16_t item_len = 0;
+
+        if(item + CPF_ITEM_HEADER_SIZE > end) {
+            header->encap_status = EIP_STATUS_INCORRECT_DATA;
+            return 0;
+        }
+
+        item_type = decode_uint16_le(item);
+        item_len = decode_uint16_le(item + 2);
+
+        if(item + CPF_ITEM_HEADER_SIZE + item_len > end) {
+            header->encap_status = EIP_STATUS_INCORRECT_DATA;
+            return 0;
+        }
+
+        if(item_type == CPF_ITEM_UNCONNECTED_DATA) {
+            cip_req = item + CPF_ITEM_HEADER_SIZE;
+            cip_req_len = item_len;
+        }
+
+        item += CPF_ITEM_HEADER_SIZE + item_len;
+    }
+
+    if(!cip_req) {
+        warn("No unconnected data item in SendRRData request!");
+        header->encap_status = EIP_STATUS_INCORRECT_DATA;
+        return 0;
+    }
+
+    if(resp_capacity < cip_offset) {
+        header->encap_status = EIP_STATUS_NO_MEMORY;
+        return 0;
+    }
+
+    /* Forward Open and Close change this connection, the rest go to the device. */
+    if(eip_cm_is_request(cip_req, cip_req_len)) {
+        rc = eip_cm_process_request(conn, cip_req, cip_req_len, resp + cip_offset, resp_capacity - cip_offset, &cip_resp_len);
+    } else {
+        rc = cip_process_request(conn->device, cip_req, cip_req_len, resp + cip_offset, resp_capacity - cip_offset, &cip_resp_len);
+    }
+
+    if(rc != STATUS_OK) {
+        warn("Error %s processing CIP request!", status_to_str(rc));
+        header->encap_status = EIP_STATUS_INCORRECT_DATA;
+        return 0;
+    }
+
+    /* interface handle and timeout are zero in the response. */
+    encode_uint32_le(resp, 0);
+    encode_uint16_le(resp + 4, 0);
+    encode_uint16_le(resp + 6, 2);
+
+    encode_uint16_le(resp + 8, CPF_ITEM_NULL_ADDRESS);
+    encode_uint16_le(resp + 10, 0);
+
+    encode_uint16_le(resp + 12, CPF_ITEM_UNCONNECTED_DATA);
+    encode_uint16_le(resp + 14, (uint16_t)cip_resp_len);
+
+    return cip_offset + cip_resp_len;
+}
+
+
+
+status_t eip_process_request(struct eip_conn_t *conn, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    status_t rc = STATUS_OK;
+    struct eip_header header = {0};
+    size_t payload_len = 0;
+    bool reply = true;
+
+    if(!conn || !req || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    *resp_len = 0;
+
+    if((rc = eip_decode_header(req, req_len, &header)) != STATUS_OK) {
+        return rc;
+    }
+
+    if(req_len < EIP_ENCAP_HEADER_SIZE + (size_t)header.encap_length || resp_capacity < EIP_ENCAP_HEADER_SIZE) {
+        warn("Request or response buffer is too small!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    flood("Processing EIP command %04x with %u bytes of payload.", header.encap_command, header.encap_length);
+
+    /* connected requests build their whole reply from the connection's prefix. */
+    if(header.encap_command == EIP_CMD_SEND_UNIT_DATA) {
+        return eip_cm_send_unit_data(conn, &header, req, resp, resp_capacity, resp_len);
+    }
+
+    /* discovery replies are copied whole from the device's encoded ones. */
+    if(header.encap_command == EIP_CMD_LIST_IDENTITY || header.encap_command == EIP_CMD_LIST_SERVICES || header.encap_command == EIP_CMD_LIST_INTERFACES) {
+        if(conn->device->discovery) {
+            return eip_discovery_reply(conn->device->discovery, header.encap_command, header.encap_sender_context, resp, resp_capacity, resp_len);
+        }
+    }
+
+    switch(header.encap_command) {
+        case EIP_CMD_NOP:
+            reply = false;
+            break;
+
+        case EIP_CMD_REGISTER_SESSION:
+            payload_len = handle_register_session(conn, &header, req + EIP_ENCAP_HEADER_SIZE, resp + EIP_ENCAP_HEADER_SIZE);
+            break;
+
+        case EIP_CMD_UNREGISTER_SESSION:
+            info("Unregistering session %08x on device %u.", conn->session_handle, conn->device->id);
+            conn->close_requested = true;
+            reply = false;
+            break;
+
+        case EIP_CMD_SEND_RR_DATA:
+            payload_len = handle_send_rr_data(conn, &header, req + EIP_ENCAP_HEADER_SIZE, resp + EIP_ENCAP_HEADER_SIZE, resp_capacity - EIP_ENCAP_HEADER_SIZE);
+            break;
+
+        default:
+            detail("Unsupported EIP command %04x.", header.encap_command);
+            header.encap_status = EIP_STATUS_INVALID_COMMAND;
+            break;
+    }
+
+    if(reply) {
+        /* the sender context and options are echoed back unchanged. */
+        header.encap_length = (uint16_t)payload_len;
+        eip_encode_header(resp, &header);
+
+        *resp_len = EIP_ENCAP_HEADER_SIZE + payload_len;
+    }
+
+    return STATUS_OK;
+}
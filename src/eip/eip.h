@@ -0,0 +1,200 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cip/cip.h"
+#include "eip/eip_capture.h"
+#include "util/buf.h"
+#include "util/status.h"
+
+
+#define EIP_ENCAP_HEADER_SIZE (24)
+#define EIP_MAX_PAYLOAD_SIZE (4096)
+#define EIP_MAX_PACKET_SIZE (EIP_ENCAP_HEADER_SIZE + EIP_MAX_PAYLOAD_SIZE)
+
+#define EIP_DEFAULT_PORT (44818)
+#define EIP_PROTOCOL_VERSION (1)
+
+
+typedef enum {
+    EIP_CMD_NOP = 0x0000,
+    EIP_CMD_LIST_SERVICES = 0x0004,
+    EIP_CMD_LIST_IDENTITY = 0x0063,
+    EIP_CMD_LIST_INTERFACES = 0x0064,
+    EIP_CMD_REGISTER_SESSION = 0x0065,
+    EIP_CMD_UNREGISTER_SESSION = 0x0066,
+    EIP_CMD_SEND_RR_DATA = 0x006F,
+    EIP_CMD_SEND_UNIT_DATA = 0x0070,
+} eip_command_t;
+
+
+typedef enum {
+    EIP_STATUS_SUCCESS = 0x0000,
+    EIP_STATUS_INVALID_COMMAND = 0x0001,
+    EIP_STATUS_NO_MEMORY = 0x0002,
+    EIP_STATUS_INCORRECT_DATA = 0x0003,
+    EIP_STATUS_INVALID_SESSION = 0x0064,
+    EIP_STATUS_INVALID_LENGTH = 0x0065,
+    EIP_STATUS_UNSUPPORTED_PROTOCOL = 0x0069,
+} eip_status_t;
+
+
+/* Common Packet Format item types. */
+typedef enum {
+    CPF_ITEM_NULL_ADDRESS = 0x0000,
+    CPF_ITEM_LIST_IDENTITY = 0x000C,
+    CPF_ITEM_CONNECTED_ADDRESS = 0x00A1,
+    CPF_ITEM_CONNECTED_DATA = 0x00B1,
+    CPF_ITEM_UNCONNECTED_DATA = 0x00B2,
+    CPF_ITEM_LIST_SERVICES = 0x0100,
+    CPF_ITEM_SOCKADDR_O_T = 0x8000,
+    CPF_ITEM_SOCKADDR_T_O = 0x8001,
+    CPF_ITEM_SEQUENCED_ADDRESS = 0x8002,
+} cpf_item_type_t;
+
+
+
+struct device_t;
+struct io_conn_t;
+struct proactor_socket_t;
+
+
+/* the most CIP connections a client may open over one TCP connection. */
+#define EIP_MAX_CIP_CONNS (4)
+
+/* encapsulation header, CPF prefix, connected address item, data item header and sequence count. */
+#define EIP_CONNECTED_REPLY_PREFIX_SIZE (EIP_ENCAP_HEADER_SIZE + 8 + 8 + 4 + 2)
+
+
+
+/*
+ * A connection opened with Forward Open.  Class 3 (explicit messaging)
+ * connections carry requests in SendUnitData.  Class 1 (implicit I/O)
+ * connections only have their producer here, the sending is done by the
+ * device's I/O scheduler.
+ *
+ * Everything that stays the same from one SendUnitData to the next is kept
+ * here, down to the front of the reply frame.  A connected request then only
+ * has to find its connection by ID, and the reply only needs its lengths,
+ * sender context and sequence count filled in.
+ *
+ * A class 3 client that repeats a sequence count is retrying a request it
+ * did not see answered.  The last CIP reply is kept so the retry gets the
+ * same answer without running the request a second time.
+ */
+struct eip_cip_conn_t {
+    bool in_use;
+
+    /* the client sends to our ID, we reply to theirs. */
+    uint32_t o_to_t_conn_id;
+    uint32_t t_to_o_conn_id;
+
+    /* the triad that identifies the connection for Forward Close. */
+    uint16_t conn_serial;
+    uint16_t vendor_id;
+    uint32_t orig_serial;
+
+    /* the largest connected payload, sequence count included. */
+    uint16_t max_payload;
+
+    bool have_last_seq;
+    uint16_t last_seq;
+    uint32_t num_requests;
+
+    struct cip_path_cache_t paths;
+
+    uint8_t reply_prefix[EIP_CONNECTED_REPLY_PREFIX_SIZE];
+
+    /* the CIP reply to last_seq, sized by the connection at Forward Open. */
+    uint16_t last_reply_len;
+    uint8_t *last_reply;
+
+    /* set for class 1 connections. */
+    struct io_conn_t *io;
+
+    /* where the connection path led, this device or another in its chassis. */
+    struct device_t *device;
+};
+
+
+/*
+ * Routes seen on a TCP connection, from the raw port segments at the front
+ * of a path to the device they reach.  Clients repeat the same route with
+ * every Unconnected Send, so a hit is one compare.  Devices outlive the
+ * connections, so the pointers stay good.
+ */
+#define EIP_ROUTE_CACHE_SIZE (4)
+#define EIP_ROUTE_MAX_PATH (8)
+
+struct eip_route_cache_entry_t {
+    struct device_t *from;
+    struct device_t *target;
+    uint8_t path_len;
+    uint8_t path[EIP_ROUTE_MAX_PATH];
+};
+
+struct eip_route_cache_t {
+    uint32_t next_victim;
+    struct eip_route_cache_entry_t entries[EIP_ROUTE_CACHE_SIZE];
+};
+
+
+/*
+ * The state of one TCP connection from a client.  These come from a pool
+ * shared by every device in the process.
+ */
+struct eip_conn_t {
+    struct device_t *device;
+    struct proactor_socket_t *socket;
+
+    /* the client's IPv4 address, network byte order.  Class 1 data goes here. */
+    uint32_t peer_ip;
+
+    /* non-zero if this peer is being traced, see debug_add_peer(). */
+    uint8_t debug_level;
+
+    /* the TCP tuple and stream positions for wire capture. */
+    struct eip_capture_flow_t capture_flow;
+
+    uint32_t session_handle;
+    bool close_requested;
+    bool sending;
+
+    /* the connection the last connected request went to, usually the next one's too. */
+    struct eip_cip_conn_t *last_cip_conn;
+    struct eip_cip_conn_t cip_conns[EIP_MAX_CIP_CONNS];
+
+    struct eip_route_cache_t routes;
+
+    size_t rx_len;
+    proactor_buf_t rx_buf;
+    proactor_buf_t tx_buf;
+
+    uint8_t rx_data[EIP_MAX_PACKET_SIZE];
+    uint8_t tx_data[EIP_MAX_PACKET_SIZE];
+};
+
+
+extern status_t eip_decode_header(const uint8_t *data, size_t data_len, struct eip_header *header);
+extern void eip_encode_header(uint8_t *data, const struct eip_header *header);
+
+extern size_t eip_frame_length(const uint8_t *data, size_t data_len);
+
+extern status_t eip_process_request(struct eip_conn_t *conn, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
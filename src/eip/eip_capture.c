@@ -0,0 +1,588 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_EIP)
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eip/eip.h"
+#include "eip/eip_capture.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/shims.h"
+#include "util/time_utils.h"
+
+
+/*
+ * Each capturing thread gets a ring of fixed size records the first time it
+ * keeps a frame.  Only that thread writes the head and only the writer
+ * thread moves the tail, like the log rings.  A full ring drops the frame
+ * and counts it.
+ *
+ * The writer merges the rings in timestamp order and writes one Enhanced
+ * Packet Block per frame.  There is no link layer, each packet is a made up
+ * IPv4 and TCP header followed by the EIP frame.
+ */
+
+#define CAPTURE_RING_SIZE (256)
+#define CAPTURE_SNAPLEN (EIP_MAX_PACKET_SIZE)
+#define CAPTURE_IDLE_WAIT_MS (10)
+
+#define CAPTURE_IP_HEADER_SIZE (20)
+#define CAPTURE_TCP_HEADER_SIZE (20)
+#define CAPTURE_PACKET_SIZE (CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE + CAPTURE_SNAPLEN)
+
+#define PCAPNG_BLOCK_SHB (0x0A0D0D0A)
+#define PCAPNG_BLOCK_IDB (0x00000001)
+#define PCAPNG_BLOCK_EPB (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+#define PCAPNG_OPT_IF_TSRESOL (9)
+#define PCAPNG_LINKTYPE_IPV4 (228)
+
+
+struct capture_record_t {
+    int64_t time_ns;
+    uint32_t client_ip;
+    uint32_t server_ip;
+    uint16_t client_port;
+    uint16_t server_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t dir;
+    uint32_t orig_len;
+    uint32_t cap_len;
+    uint8_t data[CAPTURE_SNAPLEN];
+};
+
+
+struct capture_ring_t {
+    struct capture_ring_t *next;
+
+    /* written by the owning thread. */
+    uint32_t head;
+    uint32_t dropped;
+
+    /* written by the writer thread. */
+    uint32_t tail;
+
+    struct capture_record_t records[CAPTURE_RING_SIZE];
+};
+
+
+volatile uint32_t eip_capture_running = 0;
+
+static uint32_t device_filters[EIP_CAPTURE_MAX_FILTERS];
+static uint32_t num_device_filters = 0;
+static uint32_t peer_filters[EIP_CAPTURE_MAX_FILTERS];
+static uint32_t num_peer_filters = 0;
+static uint8_t service_filters[EIP_CAPTURE_MAX_FILTERS];
+static uint32_t num_service_filters = 0;
+
+static struct capture_ring_t *rings = NULL;
+static THREAD_LOCAL struct capture_ring_t *thread_ring = NULL;
+
+static FILE *capture_file = NULL;
+static int64_t wall_offset_ns = 0;
+static volatile bool writer_stop = false;
+static thread_t writer_thread;
+
+
+
+status_t eip_capture_add_device_filter(uint32_t device_id)
+{
+    if(num_device_filters >= EIP_CAPTURE_MAX_FILTERS) {
+        warn("Only %d device filters are supported!", EIP_CAPTURE_MAX_FILTERS);
+        return STATUS_NO_RESOURCE;
+    }
+
+    device_filters[num_device_filters++] = device_id;
+
+    return STATUS_OK;
+}
+
+
+status_t eip_capture_add_peer_filter(uint32_t ip_addr)
+{
+    if(num_peer_filters >= EIP_CAPTURE_MAX_FILTERS) {
+        warn("Only %d peer filters are supported!", EIP_CAPTURE_MAX_FILTERS);
+        return STATUS_NO_RESOURCE;
+    }
+
+    peer_filters[num_peer_filters++] = ip_addr;
+
+    return STATUS_OK;
+}
+
+
+status_t eip_capture_add_service_filter(uint8_t service)
+{
+    if(num_service_filters >= EIP_CAPTURE_MAX_FILTERS) {
+        warn("Only %d service filters are supported!", EIP_CAPTURE_MAX_FILTERS);
+        return STATUS_NO_RESOURCE;
+    }
+
+    /* match requests and replies alike. */
+    service_filters[num_service_filters++] = (uint8_t)(service & 0x7F);
+
+    return STATUS_OK;
+}
+
+
+
+static bool match_u32(const uint32_t *filters, uint32_t num_filters, uint32_t value)
+{
+    for(uint32_t i = 0; i < num_filters; i++) {
+        if(filters[i] == value) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+/* the CIP service code carried by a SendRRData or SendUnitData frame, -1 if there is none. */
+static int frame_service(const uint8_t *data, size_t len)
+{
+    uint16_t command = 0;
+    uint16_t item_count = 0;
+    size_t offset = EIP_ENCAP_HEADER_SIZE + 4 + 2;
+
+    if(len < offset + 2) {
+        return -1;
+    }
+
+    command = decode_uint16_le(data);
+    if(command != EIP_CMD_SEND_RR_DATA && command != EIP_CMD_SEND_UNIT_DATA) {
+        return -1;
+    }
+
+    item_count = decode_uint16_le(data + offset);
+    offset += 2;
+
+    for(uint16_t i = 0; i < item_count && offset + 4 <= len; i++) {
+        uint16_t item_type = decode_uint16_le(data + offset);
+        uint16_t item_len = decode_uint16_le(data + offset + 2);
+
+        offset += 4;
+
+        if(item_type == CPF_ITEM_UNCONNECTED_DATA && item_len >= 1 && offset < len) {
+            return data[offset] & 0x7F;
+        }
+
+        /* connected data starts with the sequence count. */
+        if(item_type == CPF_ITEM_CONNECTED_DATA && item_len >= 3 && offset + 2 < len) {
+            return data[offset + 2] & 0x7F;
+        }
+
+        offset += item_len;
+    }
+
+    return -1;
+}
+
+
+static bool frame_wanted(uint32_t device_id, const struct eip_capture_flow_t *flow, const uint8_t *data, size_t len)
+{
+    if(num_device_filters && !match_u32(device_filters, num_device_filters, device_id)) {
+        return false;
+    }
+
+    if(num_peer_filters && !match_u32(peer_filters, num_peer_filters, flow->client_ip)) {
+        return false;
+    }
+
+    if(num_service_filters) {
+        int service = frame_service(data, len);
+
+        if(service < 0) {
+            return false;
+        }
+
+        for(uint32_t i = 0; i < num_service_filters; i++) {
+            if(service_filters[i] == (uint8_t)service) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return true;
+}
+
+
+/* the calling thread's ring, made and linked in on first use. */
+static struct capture_ring_t *get_ring(void)
+{
+    struct capture_ring_t *ring = thread_ring;
+    struct capture_ring_t *head = NULL;
+
+    if(ring) {
+        return ring;
+    }
+
+    if(!(ring = calloc(1, sizeof(*ring)))) {
+        return NULL;
+    }
+
+    do {
+        head = ATOMIC_LOAD_PTR(&rings);
+        ring->next = head;
+    } while(!ATOMIC_CAS_PTR(&rings, head, ring));
+
+    thread_ring = ring;
+
+    return ring;
+}
+
+
+void eip_capture_frame_impl(uint32_t device_id, struct eip_capture_flow_t *flow, eip_capture_dir_t dir, const uint8_t *data, size_t len)
+{
+    struct capture_ring_t *ring = NULL;
+    struct capture_record_t *rec = NULL;
+    uint32_t head = 0;
+
+    if(!flow || !data || len == 0 || !frame_wanted(device_id, flow, data, len)) {
+        return;
+    }
+
+    if(!(ring = get_ring())) {
+        return;
+    }
+
+    head = ring->head;
+
+    if(head - ATOMIC_LOAD_U32(&ring->tail) >= CAPTURE_RING_SIZE) {
+        ATOMIC_STORE_U32(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    rec = &(ring->records[head % CAPTURE_RING_SIZE]);
+
+    rec->time_ns = util_clock_ns();
+    rec->client_ip = flow->client_ip;
+    rec->server_ip = flow->server_ip;
+    rec->client_port = flow->client_port;
+    rec->server_port = flow->server_port;
+    rec->dir = (uint8_t)dir;
+    rec->orig_len = (uint32_t)len;
+    rec->cap_len = (uint32_t)(len < CAPTURE_SNAPLEN ? len : CAPTURE_SNAPLEN);
+
+    if(dir == EIP_CAPTURE_TO_SERVER) {
+        rec->seq = flow->client_seq;
+        rec->ack = flow->server_seq;
+        flow->client_seq += (uint32_t)len;
+    } else {
+        rec->seq = flow->server_seq;
+        rec->ack = flow->client_seq;
+        flow->server_seq += (uint32_t)len;
+    }
+
+    memcpy(rec->data, data, rec->cap_len);
+
+    ATOMIC_STORE_U32(&ring->head, head + 1);
+}
+
+
+uint64_t eip_capture_get_dropped(void)
+{
+    uint64_t dropped = 0;
+
+    for(struct capture_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+        dropped += ATOMIC_LOAD_U32(&ring->dropped);
+    }
+
+    return dropped;
+}
+
+
+
+/*
+ * pcapng writing.  Blocks are written in host byte order, the section
+ * header's byte order magic tells readers which one that is.
+ */
+
+static void put_u16(uint8_t *buf, uint16_t value)
+{
+    memcpy(buf, &value, sizeof(value));
+}
+
+
+static void put_u32(uint8_t *buf, uint32_t value)
+{
+    memcpy(buf, &value, sizeof(value));
+}
+
+
+static bool write_file_header(FILE *file)
+{
+    uint8_t shb[28] = {0};
+    uint8_t idb[32] = {0};
+
+    put_u32(shb, PCAPNG_BLOCK_SHB);
+    put_u32(shb + 4, sizeof(shb));
+    put_u32(shb + 8, PCAPNG_BYTE_ORDER_MAGIC);
+    put_u16(shb + 12, 1);
+    put_u16(shb + 14, 0);
+
+    /* section length unknown. */
+    memset(shb + 16, 0xFF, 8);
+    put_u32(shb + 24, sizeof(shb));
+
+    put_u32(idb, PCAPNG_BLOCK_IDB);
+    put_u32(idb + 4, sizeof(idb));
+    put_u16(idb + 8, PCAPNG_LINKTYPE_IPV4);
+    put_u32(idb + 12, CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE + CAPTURE_SNAPLEN);
+
+    /* nanosecond timestamps, then the end of options. */
+    put_u16(idb + 16, PCAPNG_OPT_IF_TSRESOL);
+    put_u16(idb + 18, 1);
+    idb[20] = 9;
+    put_u32(idb + 28, sizeof(idb));
+
+    return fwrite(shb, 1, sizeof(shb), file) == sizeof(shb) && fwrite(idb, 1, sizeof(idb), file) == sizeof(idb);
+}
+
+
+static uint16_t ip_checksum(const uint8_t *header)
+{
+    uint32_t sum = 0;
+
+    for(int i = 0; i < CAPTURE_IP_HEADER_SIZE; i += 2) {
+        sum += decode_uint16_be(header + i);
+    }
+
+    while(sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (uint16_t)~sum;
+}
+
+
+/* the IPv4 and TCP headers in front of a frame.  Returns the header size. */
+static size_t build_headers(const struct capture_record_t *rec, uint8_t *packet)
+{
+    uint8_t *ip = packet;
+    uint8_t *tcp = packet + CAPTURE_IP_HEADER_SIZE;
+    bool to_server = (rec->dir == EIP_CAPTURE_TO_SERVER);
+    uint32_t src_ip = (to_server ? rec->client_ip : rec->server_ip);
+    uint32_t dst_ip = (to_server ? rec->server_ip : rec->client_ip);
+    uint16_t src_port = (to_server ? rec->client_port : rec->server_port);
+    uint16_t dst_port = (to_server ? rec->server_port : rec->client_port);
+    uint32_t total_len = CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE + rec->orig_len;
+
+    memset(packet, 0, CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE);
+
+    /* IPv4, no options, TCP.  Addresses are already in network order. */
+    ip[0] = 0x45;
+    encode_uint16_be(ip + 2, (uint16_t)(total_len > UINT16_MAX ? UINT16_MAX : total_len));
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = 6;
+    memcpy(ip + 12, &src_ip, 4);
+    memcpy(ip + 16, &dst_ip, 4);
+    encode_uint16_be(ip + 10, ip_checksum(ip));
+
+    /* TCP, PSH and ACK.  The checksum is left zero. */
+    memcpy(tcp, &src_port, 2);
+    memcpy(tcp + 2, &dst_port, 2);
+    encode_uint16_be(tcp + 4, (uint16_t)(rec->seq >> 16));
+    encode_uint16_be(tcp + 6, (uint16_t)rec->seq);
+    encode_uint16_be(tcp + 8, (uint16_t)(rec->ack >> 16));
+    encode_uint16_be(tcp + 10, (uint16_t)rec->ack);
+    tcp[12] = 0x50;
+    tcp[13] = 0x18;
+    encode_uint16_be(tcp + 14, UINT16_MAX);
+
+    return CAPTURE_IP_HEADER_SIZE + CAPTURE_TCP_HEADER_SIZE;
+}
+
+
+static void write_record(FILE *file, const struct capture_record_t *rec, uint8_t *packet)
+{
+    uint8_t epb[28] = {0};
+    uint8_t trailer[4 + 4] = {0};
+    size_t header_len = build_headers(rec, packet);
+    size_t cap_len = header_len + rec->cap_len;
+    size_t pad = (4 - (cap_len % 4)) % 4;
+    uint32_t block_len = (uint32_t)(sizeof(epb) + cap_len + pad + 4);
+    uint64_t ts = (uint64_t)(rec->time_ns + wall_offset_ns);
+
+    memcpy(packet + header_len, rec->data, rec->cap_len);
+
+    put_u32(epb, PCAPNG_BLOCK_EPB);
+    put_u32(epb + 4, block_len);
+    put_u32(epb + 8, 0);
+    put_u32(epb + 12, (uint32_t)(ts >> 32));
+    put_u32(epb + 16, (uint32_t)ts);
+    put_u32(epb + 20, (uint32_t)cap_len);
+    put_u32(epb + 24, (uint32_t)(header_len + rec->orig_len));
+
+    /* padding then the repeated block length. */
+    put_u32(trailer + pad, block_len);
+
+    fwrite(epb, 1, sizeof(epb), file);
+    fwrite(packet, 1, cap_len, file);
+    fwrite(trailer, 1, pad + 4, file);
+}
+
+
+/* the oldest published record across all the rings. */
+static struct capture_ring_t *oldest_ring(void)
+{
+    struct capture_ring_t *oldest = NULL;
+    int64_t oldest_time = 0;
+
+    for(struct capture_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+        uint32_t tail = ring->tail;
+
+        if(ATOMIC_LOAD_U32(&ring->head) != tail) {
+            const struct capture_record_t *rec = &(ring->records[tail % CAPTURE_RING_SIZE]);
+
+            if(!oldest || rec->time_ns < oldest_time) {
+                oldest = ring;
+                oldest_time = rec->time_ns;
+            }
+        }
+    }
+
+    return oldest;
+}
+
+
+static void *writer_thread_func(void *arg)
+{
+    uint8_t *packet = (uint8_t *)arg;
+
+    for(;;) {
+        struct capture_ring_t *ring = NULL;
+        bool stopping = writer_stop;
+
+        while((ring = oldest_ring())) {
+            write_record(capture_file, &(ring->records[ring->tail % CAPTURE_RING_SIZE]), packet);
+
+            ATOMIC_STORE_U32(&ring->tail, ring->tail + 1);
+        }
+
+        fflush(capture_file);
+
+        /* everything published before the stop was seen has been written. */
+        if(stopping) {
+            break;
+        }
+
+        util_sleep_ms(CAPTURE_IDLE_WAIT_MS);
+    }
+
+    free(packet);
+
+    return NULL;
+}
+
+
+
+status_t eip_capture_start(const char *path)
+{
+    status_t rc = STATUS_OK;
+    uint8_t *packet = NULL;
+
+    info("Starting.");
+
+    do {
+        if(!path) {
+            warn("Called with a NULL path!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(eip_capture_running) {
+            warn("A capture is already running!");
+            rc = STATUS_BUSY;
+            break;
+        }
+
+        if(!(capture_file = fopen(path, "wb"))) {
+            warn("Unable to open capture file %s!", path);
+            rc = STATUS_SETUP_FAILURE;
+            break;
+        }
+
+        if(!write_file_header(capture_file)) {
+            warn("Unable to write the header of capture file %s!", path);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        if(!(packet = calloc(1, CAPTURE_PACKET_SIZE))) {
+            warn("Unable to allocate the capture packet buffer!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        /* forget anything left from an earlier capture. */
+        for(struct capture_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+            ATOMIC_STORE_U32(&ring->tail, ATOMIC_LOAD_U32(&ring->head));
+        }
+
+        wall_offset_ns = (util_time_ms() * 1000000) - util_clock_ns();
+        writer_stop = false;
+
+        if(!THREAD_CREATE(writer_thread, writer_thread_func, packet)) {
+            warn("Unable to start the capture writer thread!");
+            rc = STATUS_SETUP_FAILURE;
+            break;
+        }
+
+        ATOMIC_STORE_U32(&eip_capture_running, 1);
+    } while(0);
+
+    if(rc != STATUS_OK) {
+        free(packet);
+
+        if(capture_file) {
+            fclose(capture_file);
+            capture_file = NULL;
+        }
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+void eip_capture_stop(void)
+{
+    uint64_t dropped = 0;
+
+    if(!ATOMIC_CAS_U32(&eip_capture_running, 1, 0)) {
+        return;
+    }
+
+    writer_stop = true;
+    THREAD_JOIN(writer_thread);
+
+    fclose(capture_file);
+    capture_file = NULL;
+
+    if((dropped = eip_capture_get_dropped())) {
+        warn("%llu frames were dropped from the capture, a thread's capture ring was full!", (unsigned long long)dropped);
+    }
+}
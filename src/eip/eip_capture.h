@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/*
+ * Wire capture of EIP/TCP traffic to a pcapng file.
+ *
+ * Frames are copied into a ring owned by the capturing thread and written
+ * by a background thread as IPv4/TCP packets, so Wireshark dissects them
+ * as ENIP.  Filters are set before the capture starts.  Each kind of
+ * filter that has entries must match for a frame to be kept.
+ */
+
+#define EIP_CAPTURE_MAX_FILTERS (16)
+
+
+typedef enum {
+    EIP_CAPTURE_TO_SERVER,
+    EIP_CAPTURE_TO_CLIENT,
+} eip_capture_dir_t;
+
+
+/* one TCP connection.  Addresses and ports are in network byte order. */
+struct eip_capture_flow_t {
+    uint32_t client_ip;
+    uint32_t server_ip;
+    uint16_t client_port;
+    uint16_t server_port;
+
+    /* made up sequence numbers so the stream reassembles. */
+    uint32_t client_seq;
+    uint32_t server_seq;
+};
+
+
+/* only read through eip_capture_frame(). */
+extern volatile uint32_t eip_capture_running;
+
+extern status_t eip_capture_add_device_filter(uint32_t device_id);
+extern status_t eip_capture_add_peer_filter(uint32_t ip_addr);
+extern status_t eip_capture_add_service_filter(uint8_t service);
+
+extern status_t eip_capture_start(const char *path);
+extern void eip_capture_stop(void);
+extern uint64_t eip_capture_get_dropped(void);
+
+extern void eip_capture_frame_impl(uint32_t device_id, struct eip_capture_flow_t *flow, eip_capture_dir_t dir, const uint8_t *data, size_t len);
+
+#define eip_capture_frame(DEVICE_ID, FLOW, DIR, DATA, LEN) do { if(eip_capture_running) { eip_capture_frame_impl((DEVICE_ID), (FLOW), (DIR), (DATA), (LEN)); } } while(0)
@@ -0,0 +1,794 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_EIP)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip/cip.h"
+#include "device/backplane.h"
+#include "device/device.h"
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "io/io_sched.h"
+#include "metrics/metrics.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/shims.h"
+
+
+/* Connection Manager extended status codes. */
+#define CM_EXT_DUPLICATE_FORWARD_OPEN (0x0100)
+#define CM_EXT_TRANSPORT_NOT_SUPPORTED (0x0103)
+#define CM_EXT_CONNECTION_NOT_FOUND (0x0107)
+#define CM_EXT_INVALID_CONNECTION_SIZE (0x0109)
+#define CM_EXT_RPI_NOT_SUPPORTED (0x0111)
+#define CM_EXT_NO_MORE_CONNECTIONS (0x0113)
+#define CM_EXT_INVALID_PORT (0x0311)
+#define CM_EXT_INVALID_LINK_ADDRESS (0x0312)
+#define CM_EXT_INVALID_SEGMENT (0x0315)
+
+#define TRANSPORT_CLASS_MASK (0x0F)
+#define TRANSPORT_CLASS_1 (0x01)
+#define TRANSPORT_CLASS_3 (0x03)
+
+/* Forward Open request offsets.  Large Forward Open has 32-bit network parameters. */
+#define FO_O_TO_T_CONN_ID (2)
+#define FO_T_TO_O_CONN_ID (6)
+#define FO_CONN_SERIAL (10)
+#define FO_VENDOR_ID (12)
+#define FO_ORIG_SERIAL (14)
+#define FO_O_TO_T_RPI (22)
+#define FO_O_TO_T_PARAMS (26)
+#define FO_T_TO_O_PARAMS (32)
+#define FO_PATH_SIZE (35)
+#define FO_MIN_SIZE (36)
+#define LFO_T_TO_O_PARAMS (34)
+#define LFO_PATH_SIZE (39)
+#define LFO_MIN_SIZE (40)
+
+#define FO_REPLY_SIZE (26)
+
+/* Forward Close request offsets. */
+#define FC_CONN_SERIAL (2)
+#define FC_VENDOR_ID (4)
+#define FC_ORIG_SERIAL (6)
+#define FC_MIN_SIZE (12)
+#define FC_REPLY_SIZE (10)
+
+/* Unconnected Send request offsets, the route path follows the padded message. */
+#define US_MESSAGE_SIZE (2)
+#define US_MESSAGE (4)
+
+/* where the reply prefix needs patching. */
+#define REPLY_ENCAP_LENGTH (2)
+#define REPLY_SENDER_CONTEXT (12)
+#define REPLY_DATA_ITEM_LENGTH (EIP_ENCAP_HEADER_SIZE + 18)
+#define REPLY_SEQUENCE (EIP_ENCAP_HEADER_SIZE + 20)
+
+/* the smallest connection that can carry a useful request. */
+#define MIN_CONNECTION_SIZE (16)
+
+/* class 1 connection sizes include the 16-bit sequence count. */
+#define IO_SEQ_COUNT_SIZE (2)
+
+#define SEGMENT_ANSI_SYMBOLIC (0x91)
+
+/* port segments, the port number is in the low bits and 15 means a 16-bit one follows. */
+#define SEGMENT_TYPE_MASK (0xE0)
+#define SEGMENT_TYPE_PORT (0x00)
+#define PORT_SEG_EXT_LINK (0x10)
+#define PORT_SEG_PORT_MASK (0x0F)
+#define PORT_SEG_EXT_PORT (0x0F)
+
+/* the path to instance 1 of the Connection Manager. */
+static const uint8_t cm_path[] = { 0x20, 0x06, 0x24, 0x01 };
+
+
+
+bool eip_cm_is_request(const uint8_t *cip_req, size_t cip_req_len)
+{
+    if(!cip_req || cip_req_len < 2 + sizeof(cm_path)) {
+        return false;
+    }
+
+    if(cip_req[0] != EIP_CM_SRV_FORWARD_OPEN && cip_req[0] != EIP_CM_SRV_LARGE_FORWARD_OPEN && cip_req[0] != EIP_CM_SRV_FORWARD_CLOSE
+       && cip_req[0] != EIP_CM_SRV_UNCONNECTED_SEND) {
+        return false;
+    }
+
+    return (cip_req[1] == sizeof(cm_path) / 2 && memcmp(cip_req + 2, cm_path, sizeof(cm_path)) == 0);
+}
+
+
+
+static struct eip_cip_conn_t *find_by_triad(struct eip_conn_t *conn, uint16_t conn_serial, uint16_t vendor_id, uint32_t orig_serial)
+{
+    for(int i = 0; i < EIP_MAX_CIP_CONNS; i++) {
+        struct eip_cip_conn_t *cc = &(conn->cip_conns[i]);
+
+        if(cc->in_use && cc->conn_serial == conn_serial && cc->vendor_id == vendor_id && cc->orig_serial == orig_serial) {
+            return cc;
+        }
+    }
+
+    return NULL;
+}
+
+
+static struct eip_cip_conn_t *find_by_id(struct eip_conn_t *conn, uint32_t conn_id)
+{
+    struct eip_cip_conn_t *cc = conn->last_cip_conn;
+
+    if(cc && cc->in_use && cc->o_to_t_conn_id == conn_id) {
+        return cc;
+    }
+
+    for(int i = 0; i < EIP_MAX_CIP_CONNS; i++) {
+        cc = &(conn->cip_conns[i]);
+
+        if(cc->in_use && cc->o_to_t_conn_id == conn_id) {
+            conn->last_cip_conn = cc;
+            return cc;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* everything in a SendUnitData reply that does not change from one request to the next. */
+static void build_reply_prefix(struct eip_conn_t *conn, struct eip_cip_conn_t *cc)
+{
+    struct eip_header header = {0};
+    uint8_t *p = cc->reply_prefix;
+
+    header.encap_command = EIP_CMD_SEND_UNIT_DATA;
+    header.encap_session_handle = conn->session_handle;
+
+    eip_encode_header(p, &header);
+    p += EIP_ENCAP_HEADER_SIZE;
+
+    /* interface handle, timeout and two items. */
+    encode_uint32_le(p, 0);
+    encode_uint16_le(p + 4, 0);
+    encode_uint16_le(p + 6, 2);
+
+    encode_uint16_le(p + 8, CPF_ITEM_CONNECTED_ADDRESS);
+    encode_uint16_le(p + 10, 4);
+    encode_uint32_le(p + 12, cc->t_to_o_conn_id);
+
+    encode_uint16_le(p + 16, CPF_ITEM_CONNECTED_DATA);
+    encode_uint16_le(p + 18, 0);
+    encode_uint16_le(p + 20, 0);
+}
+
+
+
+/* the size of the port segment at the front of the path, padding included.  Zero if it is cut short. */
+static size_t port_segment_size(const uint8_t *path, size_t path_len)
+{
+    size_t size = 2;
+
+    if(path[0] & PORT_SEG_EXT_LINK) {
+        if(path_len < 2) {
+            return 0;
+        }
+
+        size = 2 + (size_t)path[1];
+    }
+
+    if((path[0] & PORT_SEG_PORT_MASK) == PORT_SEG_EXT_PORT) {
+        size += 2;
+    }
+
+    size += (size & 1);
+
+    return (size <= path_len ? size : 0);
+}
+
+
+/*
+ * Follow the port segments at the front of a path from one device to the
+ * device they lead to.  Only one hop, across the chassis backplane, is
+ * simulated.  Returns zero or the Connection Manager extended status, and
+ * sets how many bytes of the path were port segments.
+ */
+static uint16_t resolve_route(struct eip_conn_t *conn, struct device_t *from, const uint8_t *path, size_t path_len, struct device_t **target, size_t *route_len)
+{
+    struct eip_route_cache_t *cache = &(conn->routes);
+    struct eip_route_cache_entry_t *entry = NULL;
+    size_t len = 0;
+    size_t seg_len = 0;
+    uint8_t slot = 0;
+
+    *target = from;
+
+    while(len < path_len && (path[len] & SEGMENT_TYPE_MASK) == SEGMENT_TYPE_PORT) {
+        if(!(seg_len = port_segment_size(path + len, path_len - len))) {
+            return CM_EXT_INVALID_SEGMENT;
+        }
+
+        len += seg_len;
+    }
+
+    *route_len = len;
+
+    if(len == 0) {
+        return 0;
+    }
+
+    for(uint32_t i = 0; i < EIP_ROUTE_CACHE_SIZE; i++) {
+        entry = &(cache->entries[i]);
+
+        if(entry->from == from && entry->path_len == len && memcmp(entry->path, path, len) == 0) {
+            *target = entry->target;
+            return 0;
+        }
+    }
+
+    if(port_segment_size(path, len) != len) {
+        detail("Routes beyond the backplane are not simulated.");
+        return CM_EXT_INVALID_PORT;
+    }
+
+    if((path[0] & PORT_SEG_PORT_MASK) != BACKPLANE_PORT) {
+        detail("No port %u on device %u.", path[0] & PORT_SEG_PORT_MASK, from->id);
+        return CM_EXT_INVALID_PORT;
+    }
+
+    if(path[0] & PORT_SEG_EXT_LINK) {
+        if(path[1] != 1) {
+            return CM_EXT_INVALID_LINK_ADDRESS;
+        }
+
+        slot = path[2];
+    } else {
+        slot = path[1];
+    }
+
+    /* a device on its own still answers for its slot. */
+    if(slot != from->slot && !(*target = backplane_get(from->backplane, slot))) {
+        detail("Nothing in slot %u of the chassis of device %u.", slot, from->id);
+        return CM_EXT_INVALID_LINK_ADDRESS;
+    }
+
+    if(len <= EIP_ROUTE_MAX_PATH) {
+        entry = &(cache->entries[cache->next_victim]);
+        cache->next_victim = (cache->next_victim + 1) % EIP_ROUTE_CACHE_SIZE;
+
+        entry->from = from;
+        entry->target = *target;
+        entry->path_len = (uint8_t)len;
+        memcpy(entry->path, path, len);
+    }
+
+    return 0;
+}
+
+
+
+/*
+ * The tag a class 1 connection produces is named by a symbolic segment in
+ * the connection path.  Port and logical segments in front of it, and any
+ * data segment, are skipped.
+ */
+static struct tag_t *find_io_tag(struct device_t *device, const uint8_t *path, size_t path_len)
+{
+    size_t i = 0;
+
+    while(i + 2 <= path_len) {
+        uint8_t seg = path[i];
+
+        if(seg == SEGMENT_ANSI_SYMBOLIC) {
+            size_t name_len = path[i + 1];
+
+            if(i + 2 + name_len > path_len) {
+                return NULL;
+            }
+
+            return tag_db_find(device->tag_db, (const char *)(path + i + 2), name_len);
+        }
+
+        if((seg & 0xE0) == 0x00) {
+            /* port segment, no extended link address. */
+            i += 2;
+        } else if((seg & 0xE0) == 0x20) {
+            /* logical segment, 8, 16 or 32-bit value. */
+            switch(seg & 0x03) {
+                case 0: i += 2; break;
+                case 1: i += 4; break;
+                case 2: i += 6; break;
+                default: return NULL;
+            }
+        } else if(seg == 0x80) {
+            /* simple data segment, a count of words. */
+            i += 2 + ((size_t)path[i + 1] * 2);
+        } else {
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+
+static size_t cm_error(uint8_t *resp, uint8_t service, uint16_t ext_status)
+{
+    resp[0] = service | CIP_SRV_RESPONSE;
+    resp[1] = 0;
+    resp[2] = CIP_STATUS_CONNECTION_FAILURE;
+    resp[3] = 1;
+
+    encode_uint16_le(resp + 4, ext_status);
+
+    return CIP_RESPONSE_HEADER_SIZE + 2;
+}
+
+
+static size_t forward_open(struct eip_conn_t *conn, struct device_t *from, uint8_t service, const uint8_t *data, size_t data_len, uint8_t *resp)
+{
+    struct eip_cip_conn_t *cc = NULL;
+    struct device_t *target = NULL;
+    bool large = (service == EIP_CM_SRV_LARGE_FORWARD_OPEN);
+    uint16_t conn_serial = 0;
+    uint16_t vendor_id = 0;
+    uint32_t orig_serial = 0;
+    uint32_t o_to_t_rpi = 0;
+    uint32_t t_to_o_rpi = 0;
+    uint32_t conn_size = 0;
+    uint32_t t_to_o_size = 0;
+    uint8_t transport = 0;
+    size_t path_offset = 0;
+    size_t path_len = 0;
+    size_t route_len = 0;
+    uint16_t ext_status = 0;
+    struct tag_t *io_tag = NULL;
+    uint8_t *d = resp + CIP_RESPONSE_HEADER_SIZE;
+
+    if(data_len < (large ? LFO_MIN_SIZE : FO_MIN_SIZE)) {
+        resp[0] = service | CIP_SRV_RESPONSE;
+        resp[1] = resp[3] = 0;
+        resp[2] = CIP_STATUS_NOT_ENOUGH_DATA;
+        return CIP_RESPONSE_HEADER_SIZE;
+    }
+
+    conn_serial = decode_uint16_le(data + FO_CONN_SERIAL);
+    vendor_id = decode_uint16_le(data + FO_VENDOR_ID);
+    orig_serial = decode_uint32_le(data + FO_ORIG_SERIAL);
+    o_to_t_rpi = decode_uint32_le(data + FO_O_TO_T_RPI);
+
+    if(large) {
+        conn_size = decode_uint32_le(data + FO_O_TO_T_PARAMS) & 0xFFFF;
+        t_to_o_rpi = decode_uint32_le(data + FO_O_TO_T_PARAMS + 4);
+        t_to_o_size = decode_uint32_le(data + LFO_T_TO_O_PARAMS) & 0xFFFF;
+        transport = data[FO_O_TO_T_PARAMS + 12];
+        path_offset = LFO_PATH_SIZE + 1;
+        path_len = (size_t)data[LFO_PATH_SIZE] * 2;
+    } else {
+        conn_size = decode_uint16_le(data + FO_O_TO_T_PARAMS) & 0x01FF;
+        t_to_o_rpi = decode_uint32_le(data + FO_O_TO_T_PARAMS + 2);
+        t_to_o_size = decode_uint16_le(data + FO_T_TO_O_PARAMS) & 0x01FF;
+        transport = data[FO_O_TO_T_PARAMS + 8];
+        path_offset = FO_PATH_SIZE + 1;
+        path_len = (size_t)data[FO_PATH_SIZE] * 2;
+    }
+
+    if(path_len > data_len - path_offset) {
+        path_len = data_len - path_offset;
+    }
+
+    if(find_by_triad(conn, conn_serial, vendor_id, orig_serial)) {
+        warn("Duplicate Forward Open for connection serial %04x!", conn_serial);
+        return cm_error(resp, service, CM_EXT_DUPLICATE_FORWARD_OPEN);
+    }
+
+    /* a connection path through the backplane connects to the device in that slot. */
+    if((ext_status = resolve_route(conn, from, data + path_offset, path_len, &target, &route_len)) != 0) {
+        return cm_error(resp, service, ext_status);
+    }
+
+    if((transport & TRANSPORT_CLASS_MASK) == TRANSPORT_CLASS_1) {
+        /* we produce T->O, anything the scanner sends O->T is not consumed. */
+        if(!target->io || !conn->peer_ip) {
+            detail("Class 1 connections are not enabled.");
+            return cm_error(resp, service, CM_EXT_TRANSPORT_NOT_SUPPORTED);
+        }
+
+        if(t_to_o_rpi < IO_MIN_RPI_US || t_to_o_rpi > IO_MAX_RPI_US) {
+            detail("RPI of %u us is not supported.", t_to_o_rpi);
+            return cm_error(resp, service, CM_EXT_RPI_NOT_SUPPORTED);
+        }
+
+        if(!(io_tag = find_io_tag(target, data + path_offset + route_len, path_len - route_len))) {
+            detail("Class 1 connection path does not name a tag.");
+            return cm_error(resp, service, CM_EXT_INVALID_SEGMENT);
+        }
+
+        if(t_to_o_size <= IO_SEQ_COUNT_SIZE || t_to_o_size - IO_SEQ_COUNT_SIZE > IO_MAX_DATA_SIZE || t_to_o_size - IO_SEQ_COUNT_SIZE > io_tag->data_size) {
+            detail("Connection size %u does not fit tag %s.", t_to_o_size, io_tag->name);
+            return cm_error(resp, service, CM_EXT_INVALID_CONNECTION_SIZE);
+        }
+    } else if((transport & TRANSPORT_CLASS_MASK) != TRANSPORT_CLASS_3) {
+        detail("Transport class %u is not supported.", transport & TRANSPORT_CLASS_MASK);
+        return cm_error(resp, service, CM_EXT_TRANSPORT_NOT_SUPPORTED);
+    } else if(conn_size < MIN_CONNECTION_SIZE || conn_size > EIP_MAX_PAYLOAD_SIZE - (EIP_CONNECTED_REPLY_PREFIX_SIZE - EIP_ENCAP_HEADER_SIZE - 2)) {
+        detail("Connection size %u is not supported.", conn_size);
+        return cm_error(resp, service, CM_EXT_INVALID_CONNECTION_SIZE);
+    }
+
+    for(int i = 0; i < EIP_MAX_CIP_CONNS && !cc; i++) {
+        if(!conn->cip_conns[i].in_use) {
+            cc = &(conn->cip_conns[i]);
+        }
+    }
+
+    if(!cc) {
+        warn("No free connections on this session!");
+        return cm_error(resp, service, CM_EXT_NO_MORE_CONNECTIONS);
+    }
+
+    memset(cc, 0, sizeof(*cc));
+
+    cc->in_use = true;
+    cc->device = target;
+    cc->o_to_t_conn_id = device_new_connection_id(target);
+    cc->t_to_o_conn_id = decode_uint32_le(data + FO_T_TO_O_CONN_ID);
+    cc->conn_serial = conn_serial;
+    cc->vendor_id = vendor_id;
+    cc->orig_serial = orig_serial;
+    cc->max_payload = (uint16_t)conn_size;
+
+    if(io_tag) {
+        cc->io = io_sched_add_conn(target->io, cc->t_to_o_conn_id, conn->peer_ip, IO_DEFAULT_PORT, t_to_o_rpi,
+                                   target, io_tag, (uint16_t)(t_to_o_size - IO_SEQ_COUNT_SIZE));
+        if(!cc->io) {
+            cc->in_use = false;
+            return cm_error(resp, service, CM_EXT_NO_MORE_CONNECTIONS);
+        }
+    } else {
+        /* a reply never holds more than the connection does, less the sequence count. */
+        if(!(cc->last_reply = malloc((size_t)conn_size - 2))) {
+            warn("Unable to allocate the reply buffer for a connection!");
+            cc->in_use = false;
+            return cm_error(resp, service, CM_EXT_NO_MORE_CONNECTIONS);
+        }
+
+        build_reply_prefix(conn, cc);
+    }
+
+    ATOMIC_STORE_U32(&(target->num_connections), ATOMIC_LOAD_U32(&(target->num_connections)) + 1);
+
+    info("Opened class %u connection %08x/%08x of %u bytes on device %u.", transport & TRANSPORT_CLASS_MASK,
+         cc->o_to_t_conn_id, cc->t_to_o_conn_id, (io_tag ? t_to_o_size : conn_size), target->id);
+
+    resp[0] = service | CIP_SRV_RESPONSE;
+    resp[1] = resp[2] = resp[3] = 0;
+
+    encode_uint32_le(d, cc->o_to_t_conn_id);
+    encode_uint32_le(d + 4, cc->t_to_o_conn_id);
+    encode_uint16_le(d + 8, conn_serial);
+    encode_uint16_le(d + 10, vendor_id);
+    encode_uint32_le(d + 12, orig_serial);
+
+    /* the actual packet intervals are what was asked for. */
+    encode_uint32_le(d + 16, o_to_t_rpi);
+    encode_uint32_le(d + 20, t_to_o_rpi);
+    d[24] = 0;
+    d[25] = 0;
+
+    return CIP_RESPONSE_HEADER_SIZE + FO_REPLY_SIZE;
+}
+
+
+static void close_cip_conn(struct eip_conn_t *conn, struct eip_cip_conn_t *cc)
+{
+    if(conn->last_cip_conn == cc) {
+        conn->last_cip_conn = NULL;
+    }
+
+    if(ATOMIC_LOAD_U32(&(cc->device->num_connections))) {
+        ATOMIC_STORE_U32(&(cc->device->num_connections), ATOMIC_LOAD_U32(&(cc->device->num_connections)) - 1);
+    }
+
+    if(cc->io) {
+        io_sched_remove_conn(cc->device->io, cc->io);
+        cc->io = NULL;
+    }
+
+    free(cc->last_reply);
+    cc->last_reply = NULL;
+
+    cc->in_use = false;
+}
+
+
+static size_t forward_close(struct eip_conn_t *conn, const uint8_t *data, size_t data_len, uint8_t *resp)
+{
+    struct eip_cip_conn_t *cc = NULL;
+    uint16_t conn_serial = 0;
+    uint16_t vendor_id = 0;
+    uint32_t orig_serial = 0;
+    uint8_t *d = resp + CIP_RESPONSE_HEADER_SIZE;
+
+    if(data_len < FC_MIN_SIZE) {
+        resp[0] = EIP_CM_SRV_FORWARD_CLOSE | CIP_SRV_RESPONSE;
+        resp[1] = resp[3] = 0;
+        resp[2] = CIP_STATUS_NOT_ENOUGH_DATA;
+        return CIP_RESPONSE_HEADER_SIZE;
+    }
+
+    conn_serial = decode_uint16_le(data + FC_CONN_SERIAL);
+    vendor_id = decode_uint16_le(data + FC_VENDOR_ID);
+    orig_serial = decode_uint32_le(data + FC_ORIG_SERIAL);
+
+    if(!(cc = find_by_triad(conn, conn_serial, vendor_id, orig_serial))) {
+        detail("Forward Close for unknown connection serial %04x.", conn_serial);
+        return cm_error(resp, EIP_CM_SRV_FORWARD_CLOSE, CM_EXT_CONNECTION_NOT_FOUND);
+    }
+
+    info("Closed connection %08x after %u requests on device %u.", cc->o_to_t_conn_id, cc->num_requests, cc->device->id);
+
+    close_cip_conn(conn, cc);
+
+    resp[0] = EIP_CM_SRV_FORWARD_CLOSE | CIP_SRV_RESPONSE;
+    resp[1] = resp[2] = resp[3] = 0;
+
+    encode_uint16_le(d, conn_serial);
+    encode_uint16_le(d + 2, vendor_id);
+    encode_uint32_le(d + 4, orig_serial);
+    d[8] = 0;
+    d[9] = 0;
+
+    return CIP_RESPONSE_HEADER_SIZE + FC_REPLY_SIZE;
+}
+
+
+static status_t process_cm(struct eip_conn_t *conn, struct device_t *from, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+
+
+static size_t route_error(uint8_t *resp, uint8_t general_status, uint16_t ext_status, uint8_t route_words)
+{
+    resp[0] = EIP_CM_SRV_UNCONNECTED_SEND | CIP_SRV_RESPONSE;
+    resp[1] = 0;
+    resp[2] = general_status;
+    resp[3] = 0;
+
+    if(!ext_status) {
+        return CIP_RESPONSE_HEADER_SIZE;
+    }
+
+    resp[3] = 1;
+    encode_uint16_le(resp + 4, ext_status);
+
+    /* routing errors say how much of the route path was left. */
+    resp[6] = route_words;
+
+    return CIP_RESPONSE_HEADER_SIZE + 3;
+}
+
+
+/*
+ * Unconnected Send.  The route picks the device and the embedded request is
+ * handed to it where it lies in the request buffer, so the target's reply
+ * is written straight into ours and becomes the whole reply.
+ */
+static status_t unconnected_send(struct eip_conn_t *conn, struct device_t *from, const uint8_t *data, size_t data_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    struct device_t *target = NULL;
+    const uint8_t *msg = data + US_MESSAGE;
+    size_t msg_len = 0;
+    size_t route_offset = 0;
+    size_t route_len = 0;
+    size_t used = 0;
+    uint16_t ext_status = 0;
+
+    if(data_len >= US_MESSAGE) {
+        msg_len = decode_uint16_le(data + US_MESSAGE_SIZE);
+        route_offset = US_MESSAGE + msg_len + (msg_len & 1);
+    }
+
+    if(data_len < US_MESSAGE || route_offset + 2 > data_len || route_offset + 2 + ((size_t)data[route_offset] * 2) > data_len) {
+        *resp_len = route_error(resp, CIP_STATUS_NOT_ENOUGH_DATA, 0, 0);
+        return STATUS_OK;
+    }
+
+    route_len = (size_t)data[route_offset] * 2;
+
+    ext_status = resolve_route(conn, from, data + route_offset + 2, route_len, &target, &used);
+    if(ext_status == 0 && used != route_len) {
+        ext_status = CM_EXT_INVALID_SEGMENT;
+    }
+
+    if(ext_status) {
+        *resp_len = route_error(resp, CIP_STATUS_CONNECTION_FAILURE, ext_status, data[route_offset]);
+        return STATUS_OK;
+    }
+
+    flood("Unconnected Send of %zu bytes from device %u to device %u.", msg_len, from->id, target->id);
+
+    if(eip_cm_is_request(msg, msg_len)) {
+        return process_cm(conn, target, msg, msg_len, resp, resp_capacity, resp_len);
+    }
+
+    return cip_process_request(target, msg, msg_len, resp, resp_capacity, resp_len);
+}
+
+
+/* requests to the Connection Manager, with from the device whose paths they follow. */
+static status_t process_cm(struct eip_conn_t *conn, struct device_t *from, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    const uint8_t *data = req + 2 + sizeof(cm_path);
+    size_t data_len = req_len - (2 + sizeof(cm_path));
+
+    metrics_count_request(from->metrics, metrics_cm_service(req[0]));
+
+    switch(req[0]) {
+        case EIP_CM_SRV_UNCONNECTED_SEND:
+            return unconnected_send(conn, from, data, data_len, resp, resp_capacity, resp_len);
+
+        case EIP_CM_SRV_FORWARD_CLOSE:
+            *resp_len = forward_close(conn, data, data_len, resp);
+            break;
+
+        default:
+            *resp_len = forward_open(conn, from, req[0], data, data_len, resp);
+            break;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* Forward Open, Close or Unconnected Send, already matched by eip_cm_is_request(). */
+status_t eip_cm_process_request(struct eip_conn_t *conn, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    if(!conn || !req || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(resp_capacity < CIP_RESPONSE_HEADER_SIZE + FO_REPLY_SIZE) {
+        warn("Response buffer too small!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    return process_cm(conn, conn->device, req, req_len, resp, resp_capacity, resp_len);
+}
+
+
+
+static status_t unit_data_error(const struct eip_header *header, uint32_t encap_status, uint8_t *resp, size_t *resp_len)
+{
+    struct eip_header reply = *header;
+
+    reply.encap_length = 0;
+    reply.encap_status = encap_status;
+
+    eip_encode_header(resp, &reply);
+
+    *resp_len = EIP_ENCAP_HEADER_SIZE;
+
+    return STATUS_OK;
+}
+
+
+/*
+ * SendUnitData.  Clients always send a connected address item and then a
+ * connected data item, so the frame is checked against that layout in place
+ * rather than walked item by item.  The CIP reply is written straight after
+ * the connection's reply prefix.
+ */
+status_t eip_cm_send_unit_data(struct eip_conn_t *conn, const struct eip_header *header, const uint8_t *frame, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    status_t rc = STATUS_OK;
+    const uint8_t *p = frame + EIP_ENCAP_HEADER_SIZE;
+    struct eip_cip_conn_t *cc = NULL;
+    uint16_t data_len = 0;
+    uint16_t seq = 0;
+    size_t cip_capacity = 0;
+    size_t cip_resp_len = 0;
+
+    if(!conn || !header || !frame || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    *resp_len = 0;
+
+    if(!conn->session_handle || header->encap_session_handle != conn->session_handle) {
+        return unit_data_error(header, EIP_STATUS_INVALID_SESSION, resp, resp_len);
+    }
+
+    if(header->encap_length < EIP_CONNECTED_REPLY_PREFIX_SIZE - EIP_ENCAP_HEADER_SIZE
+       || decode_uint16_le(p + 6) != 2
+       || decode_uint16_le(p + 8) != CPF_ITEM_CONNECTED_ADDRESS
+       || decode_uint16_le(p + 10) != 4
+       || decode_uint16_le(p + 16) != CPF_ITEM_CONNECTED_DATA) {
+        return unit_data_error(header, EIP_STATUS_INCORRECT_DATA, resp, resp_len);
+    }
+
+    data_len = decode_uint16_le(p + 18);
+
+    if(data_len < 2 || (size_t)data_len + 20 != header->encap_length) {
+        return unit_data_error(header, EIP_STATUS_INVALID_LENGTH, resp, resp_len);
+    }
+
+    if(!(cc = find_by_id(conn, decode_uint32_le(p + 12))) || cc->io) {
+        detail("SendUnitData for unknown connection %08x.", decode_uint32_le(p + 12));
+        return unit_data_error(header, EIP_STATUS_INCORRECT_DATA, resp, resp_len);
+    }
+
+    seq = decode_uint16_le(p + 20);
+
+    /* the reply has to fit the connection as well as the buffer. */
+    cip_capacity = (size_t)cc->max_payload - 2;
+
+    if(resp_capacity < EIP_CONNECTED_REPLY_PREFIX_SIZE + cip_capacity) {
+        cip_capacity = resp_capacity - EIP_CONNECTED_REPLY_PREFIX_SIZE;
+    }
+
+    memcpy(resp, cc->reply_prefix, EIP_CONNECTED_REPLY_PREFIX_SIZE);
+
+    if(cc->have_last_seq && seq == cc->last_seq && cc->last_reply_len <= cip_capacity) {
+        /* a retry, it was already done once so just answer it again. */
+        detail("Resending the reply to duplicate sequence count %u on connection %08x.", seq, cc->o_to_t_conn_id);
+
+        cip_resp_len = cc->last_reply_len;
+        memcpy(resp + EIP_CONNECTED_REPLY_PREFIX_SIZE, cc->last_reply, cip_resp_len);
+    } else {
+        rc = cip_process_connected_request(cc->device, &(cc->paths), p + 22, (size_t)data_len - 2, resp + EIP_CONNECTED_REPLY_PREFIX_SIZE, cip_capacity, &cip_resp_len);
+        if(rc != STATUS_OK) {
+            warn("Error %s processing connected CIP request!", status_to_str(rc));
+            return unit_data_error(header, EIP_STATUS_INCORRECT_DATA, resp, resp_len);
+        }
+
+        /* cip_capacity never exceeds the connection size, so the reply always fits. */
+        cc->have_last_seq = true;
+        cc->last_seq = seq;
+        cc->num_requests++;
+        cc->last_reply_len = (uint16_t)cip_resp_len;
+        memcpy(cc->last_reply, resp + EIP_CONNECTED_REPLY_PREFIX_SIZE, cip_resp_len);
+    }
+
+    encode_uint16_le(resp + REPLY_ENCAP_LENGTH, (uint16_t)(EIP_CONNECTED_REPLY_PREFIX_SIZE - EIP_ENCAP_HEADER_SIZE + cip_resp_len));
+    memcpy(resp + REPLY_SENDER_CONTEXT, frame + REPLY_SENDER_CONTEXT, 8);
+    encode_uint16_le(resp + REPLY_DATA_ITEM_LENGTH, (uint16_t)(2 + cip_resp_len));
+    encode_uint16_le(resp + REPLY_SEQUENCE, seq);
+
+    *resp_len = EIP_CONNECTED_REPLY_PREFIX_SIZE + cip_resp_len;
+
+    return STATUS_OK;
+}
+
+
+
+/* the TCP connection is going away and its CIP connections with it. */
+void eip_cm_close_all(struct eip_conn_t *conn)
+{
+    if(!conn) {
+        return;
+    }
+
+    for(int i = 0; i < EIP_MAX_CIP_CONNS; i++) {
+        if(conn->cip_conns[i].in_use) {
+            close_cip_conn(conn, &(conn->cip_conns[i]));
+        }
+    }
+}
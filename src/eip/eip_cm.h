@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/buf.h"
+#include "util/status.h"
+
+
+/*
+ * The Connection Manager (class 0x06) and connected explicit messaging.
+ *
+ * Forward Open and Forward Close arrive as unconnected requests in
+ * SendRRData, but they change the state of the TCP connection they arrive
+ * on, so they are handled here rather than with the other CIP objects.
+ * SendUnitData then carries requests on the connections they open.
+ */
+
+typedef enum {
+    EIP_CM_SRV_FORWARD_CLOSE = 0x4E,
+    EIP_CM_SRV_UNCONNECTED_SEND = 0x52,
+    EIP_CM_SRV_FORWARD_OPEN = 0x54,
+    EIP_CM_SRV_LARGE_FORWARD_OPEN = 0x5B,
+} eip_cm_service_t;
+
+
+struct eip_conn_t;
+
+extern bool eip_cm_is_request(const uint8_t *cip_req, size_t cip_req_len);
+extern status_t eip_cm_process_request(struct eip_conn_t *conn, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+
+extern status_t eip_cm_send_unit_data(struct eip_conn_t *conn, const struct eip_header *header, const uint8_t *frame, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+
+extern void eip_cm_close_all(struct eip_conn_t *conn);
@@ -0,0 +1,422 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "cip/cip.h"
+#include "device/device.h"
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/unit_test.h"
+
+
+/*
+ * Forward Open and Close go straight to eip_cm_process_request() and
+ * connected requests to eip_cm_send_unit_data(), on a TCP connection that
+ * has no socket.  The device has one DINT tag, A.
+ */
+
+#define SESSION_HANDLE (0x00010001u)
+#define VENDOR_ID (0xF00D)
+#define ORIG_SERIAL (0x10000000u)
+#define RPI_US (2000000u)
+#define T_TO_O_CONN_ID (0x1234u)
+
+#define TRANSPORT_CLASS_3_SERVER (0xA3)
+
+static const uint8_t router_path[] = { 0x20, 0x02, 0x24, 0x01 };
+
+static struct device_t *device;
+static struct eip_conn_t *conn;
+
+static uint8_t req[256];
+static uint8_t resp[EIP_MAX_PACKET_SIZE];
+static size_t resp_len;
+
+
+
+static size_t cm_header(uint8_t *p, uint8_t service)
+{
+    p[0] = service;
+    p[1] = 2;
+    p[2] = 0x20;
+    p[3] = 0x06;
+    p[4] = 0x24;
+    p[5] = 0x01;
+
+    return 6;
+}
+
+
+/* a (Large) Forward Open with the same size and RPI both ways. */
+static size_t forward_open(uint8_t service, uint16_t serial, uint32_t conn_size, uint8_t transport, const uint8_t *path, size_t path_len)
+{
+    bool large = (service == EIP_CM_SRV_LARGE_FORWARD_OPEN);
+    size_t len = cm_header(req, service);
+    uint8_t *d = req + len;
+    size_t params_size = (large ? 4 : 2);
+    uint8_t *p = d + 26;
+
+    memset(d, 0, 40);
+
+    d[0] = 0x0A;
+    d[1] = 0x0E;
+    encode_uint32_le(d + 6, T_TO_O_CONN_ID);
+    encode_uint16_le(d + 10, serial);
+    encode_uint16_le(d + 12, VENDOR_ID);
+    encode_uint32_le(d + 14, ORIG_SERIAL);
+    d[18] = 1;
+    encode_uint32_le(d + 22, RPI_US);
+
+    /* fixed size, point to point. */
+    if(large) {
+        encode_uint32_le(p, 0x42000000u | conn_size);
+    } else {
+        encode_uint16_le(p, (uint16_t)(0x4200 | conn_size));
+    }
+
+    p += params_size;
+    encode_uint32_le(p, RPI_US);
+    p += 4;
+
+    if(large) {
+        encode_uint32_le(p, 0x42000000u | conn_size);
+    } else {
+        encode_uint16_le(p, (uint16_t)(0x4200 | conn_size));
+    }
+
+    p += params_size;
+    *p++ = transport;
+    *p++ = (uint8_t)(path_len / 2);
+    memcpy(p, path, path_len);
+    p += path_len;
+
+    return (size_t)(p - req);
+}
+
+
+static size_t forward_close(uint16_t serial)
+{
+    size_t len = cm_header(req, EIP_CM_SRV_FORWARD_CLOSE);
+    uint8_t *d = req + len;
+
+    d[0] = 0x0A;
+    d[1] = 0x0E;
+    encode_uint16_le(d + 2, serial);
+    encode_uint16_le(d + 4, VENDOR_ID);
+    encode_uint32_le(d + 6, ORIG_SERIAL);
+    d[10] = (uint8_t)(sizeof(router_path) / 2);
+    d[11] = 0;
+    memcpy(d + 12, router_path, sizeof(router_path));
+
+    return len + 12 + sizeof(router_path);
+}
+
+
+static void process(size_t req_len)
+{
+    memset(resp, 0xEE, sizeof(resp));
+    resp_len = 0;
+
+    CHECK(eip_cm_is_request(req, req_len));
+    CHECK_EQ(eip_cm_process_request(conn, req, req_len, resp, sizeof(resp), &resp_len), STATUS_OK);
+}
+
+
+/* open a class 3 connection and return the ID to send to. */
+static uint32_t open_class3(uint16_t serial, uint32_t conn_size)
+{
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, serial, conn_size, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path)));
+
+    CHECK_EQ(resp[0], EIP_CM_SRV_FORWARD_OPEN | CIP_SRV_RESPONSE);
+    CHECK_EQ(resp[2], CIP_STATUS_OK);
+
+    return decode_uint32_le(resp + CIP_RESPONSE_HEADER_SIZE);
+}
+
+
+static void check_cm_error(uint8_t service, uint16_t ext_status)
+{
+    CHECK_EQ(resp[0], service | CIP_SRV_RESPONSE);
+    CHECK_EQ(resp[2], CIP_STATUS_CONNECTION_FAILURE);
+    CHECK_EQ(resp[3], 1);
+    CHECK_EQ(decode_uint16_le(resp + 4), ext_status);
+}
+
+
+/* SendUnitData with a connected request for A, a write if value is not NULL. */
+static const uint8_t *send_unit_data(uint32_t conn_id, uint16_t seq, const int32_t *value)
+{
+    uint8_t frame[128];
+    struct eip_header header = {0};
+    uint8_t *p = frame + EIP_ENCAP_HEADER_SIZE;
+    uint8_t *cip = p + 22;
+    size_t cip_len = 0;
+
+    cip[0] = (value ? 0x4D : 0x4C);
+    cip[1] = 2;
+    cip[2] = 0x91;
+    cip[3] = 1;
+    cip[4] = 'A';
+    cip[5] = 0;
+
+    if(value) {
+        encode_uint16_le(cip + 6, TAG_TYPE_DINT);
+        encode_uint16_le(cip + 8, 1);
+        encode_uint32_le(cip + 10, (uint32_t)*value);
+        cip_len = 14;
+    } else {
+        encode_uint16_le(cip + 6, 1);
+        cip_len = 8;
+    }
+
+    encode_uint32_le(p, 0);
+    encode_uint16_le(p + 4, 0);
+    encode_uint16_le(p + 6, 2);
+    encode_uint16_le(p + 8, CPF_ITEM_CONNECTED_ADDRESS);
+    encode_uint16_le(p + 10, 4);
+    encode_uint32_le(p + 12, conn_id);
+    encode_uint16_le(p + 16, CPF_ITEM_CONNECTED_DATA);
+    encode_uint16_le(p + 18, (uint16_t)(2 + cip_len));
+    encode_uint16_le(p + 20, seq);
+
+    header.encap_command = EIP_CMD_SEND_UNIT_DATA;
+    header.encap_length = (uint16_t)(22 + cip_len);
+    header.encap_session_handle = SESSION_HANDLE;
+    header.encap_sender_context = 0x1122334455667788ull;
+    eip_encode_header(frame, &header);
+
+    memset(resp, 0xEE, sizeof(resp));
+    resp_len = 0;
+
+    CHECK_EQ(eip_cm_send_unit_data(conn, &header, frame, resp, sizeof(resp), &resp_len), STATUS_OK);
+
+    return resp + EIP_CONNECTED_REPLY_PREFIX_SIZE;
+}
+
+
+static int32_t read_a(void)
+{
+    struct tag_t *tag = tag_db_find(device->tag_db, "A", 1);
+    uint8_t data[4] = {0};
+
+    tag_read(tag, device->tag_image, 0, data, 4);
+
+    return (int32_t)decode_uint32_le(data);
+}
+
+
+
+static void test_is_request(void)
+{
+    size_t len = forward_close(1);
+
+    CHECK(eip_cm_is_request(req, len));
+
+    /* not the Connection Manager. */
+    req[3] = 0x02;
+    CHECK(!eip_cm_is_request(req, len));
+
+    /* not a Connection Manager service. */
+    len = cm_header(req, 0x4C);
+    CHECK(!eip_cm_is_request(req, len));
+}
+
+
+static void test_forward_open_close(void)
+{
+    uint32_t conn_id = 0;
+    const uint8_t *d = resp + CIP_RESPONSE_HEADER_SIZE;
+
+    conn_id = open_class3(1, 504);
+    CHECK(conn_id != 0);
+    CHECK_EQ(resp_len, CIP_RESPONSE_HEADER_SIZE + 26);
+    CHECK_EQ(decode_uint32_le(d + 4), T_TO_O_CONN_ID);
+    CHECK_EQ(decode_uint16_le(d + 8), 1);
+    CHECK_EQ(decode_uint16_le(d + 10), VENDOR_ID);
+    CHECK_EQ(decode_uint32_le(d + 12), ORIG_SERIAL);
+    CHECK_EQ(decode_uint32_le(d + 16), RPI_US);
+    CHECK_EQ(decode_uint32_le(d + 20), RPI_US);
+    CHECK_EQ(device->num_connections, 1);
+
+    /* the same triad again. */
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 1, 504, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0100);
+
+    process(forward_close(2));
+    check_cm_error(EIP_CM_SRV_FORWARD_CLOSE, 0x0107);
+
+    process(forward_close(1));
+    CHECK_EQ(resp[0], EIP_CM_SRV_FORWARD_CLOSE | CIP_SRV_RESPONSE);
+    CHECK_EQ(resp[2], CIP_STATUS_OK);
+    CHECK_EQ(resp_len, CIP_RESPONSE_HEADER_SIZE + 10);
+    CHECK_EQ(decode_uint16_le(d), 1);
+    CHECK_EQ(decode_uint16_le(d + 2), VENDOR_ID);
+    CHECK_EQ(decode_uint32_le(d + 4), ORIG_SERIAL);
+    CHECK_EQ(device->num_connections, 0);
+
+    /* closed, so the triad is free again. */
+    process(forward_close(1));
+    check_cm_error(EIP_CM_SRV_FORWARD_CLOSE, 0x0107);
+
+    process(cm_header(req, EIP_CM_SRV_FORWARD_CLOSE) + 4);
+    CHECK_EQ(resp[2], CIP_STATUS_NOT_ENOUGH_DATA);
+}
+
+
+static void test_forward_open_errors(void)
+{
+    size_t len = 0;
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 1, 10, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0109);
+
+    process(forward_open(EIP_CM_SRV_LARGE_FORWARD_OPEN, 1, EIP_MAX_PAYLOAD_SIZE, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_LARGE_FORWARD_OPEN, 0x0109);
+
+    /* class 2 is not supported, class 1 is not enabled without an I/O scheduler. */
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 1, 504, 0xA2, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0103);
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 1, 504, 0x01, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0103);
+
+    len = forward_open(EIP_CM_SRV_FORWARD_OPEN, 1, 504, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path));
+    process(len - sizeof(router_path) - 8);
+    CHECK_EQ(resp[0], EIP_CM_SRV_FORWARD_OPEN | CIP_SRV_RESPONSE);
+    CHECK_EQ(resp[2], CIP_STATUS_NOT_ENOUGH_DATA);
+
+    CHECK_EQ(device->num_connections, 0);
+}
+
+
+/* a device on its own answers for slot 0 of the backplane, nothing else. */
+static void test_routes(void)
+{
+    const uint8_t slot0[] = { 0x01, 0x00, 0x20, 0x02, 0x24, 0x01 };
+    const uint8_t slot3[] = { 0x01, 0x03, 0x20, 0x02, 0x24, 0x01 };
+    const uint8_t port2[] = { 0x02, 0x00, 0x20, 0x02, 0x24, 0x01 };
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 5, 504, TRANSPORT_CLASS_3_SERVER, slot0, sizeof(slot0)));
+    CHECK_EQ(resp[2], CIP_STATUS_OK);
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 6, 504, TRANSPORT_CLASS_3_SERVER, slot3, sizeof(slot3)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0312);
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 7, 504, TRANSPORT_CLASS_3_SERVER, port2, sizeof(port2)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0311);
+
+    process(forward_close(5));
+    CHECK_EQ(resp[2], CIP_STATUS_OK);
+}
+
+
+static void test_send_unit_data(void)
+{
+    const int32_t first = 5;
+    const int32_t second = 9;
+    uint32_t conn_id = open_class3(10, 504);
+    const uint8_t *cip = NULL;
+
+    cip = send_unit_data(conn_id, 1, &first);
+    CHECK_EQ(cip[0], 0x4D | CIP_SRV_RESPONSE);
+    CHECK_EQ(cip[2], CIP_STATUS_OK);
+    CHECK_EQ(read_a(), 5);
+
+    /* the reply goes to the client's connection ID with the request's sequence count and context. */
+    CHECK_EQ(decode_uint32_le(resp + EIP_ENCAP_HEADER_SIZE + 12), T_TO_O_CONN_ID);
+    CHECK_EQ(decode_uint16_le(resp + EIP_ENCAP_HEADER_SIZE + 20), 1);
+    CHECK_EQ(decode_uint32_le(resp + 12), 0x55667788u);
+    CHECK_EQ(decode_uint16_le(resp + 2), resp_len - EIP_ENCAP_HEADER_SIZE);
+
+    /* a repeated sequence count gets the same answer without the write being done again. */
+    cip = send_unit_data(conn_id, 1, &second);
+    CHECK_EQ(cip[0], 0x4D | CIP_SRV_RESPONSE);
+    CHECK_EQ(cip[2], CIP_STATUS_OK);
+    CHECK_EQ(read_a(), 5);
+
+    cip = send_unit_data(conn_id, 2, NULL);
+    CHECK_EQ(cip[0], 0x4C | CIP_SRV_RESPONSE);
+    CHECK_EQ(decode_uint32_le(cip + 6), 5);
+    CHECK_EQ(resp_len, EIP_CONNECTED_REPLY_PREFIX_SIZE + 10);
+
+    cip = send_unit_data(conn_id, 3, &second);
+    CHECK_EQ(read_a(), 9);
+
+    /* an unknown connection is an encapsulation error. */
+    send_unit_data(conn_id + 1, 4, NULL);
+    CHECK_EQ(resp_len, EIP_ENCAP_HEADER_SIZE);
+    CHECK_EQ(decode_uint32_le(resp + 8), EIP_STATUS_INCORRECT_DATA);
+}
+
+
+/* every slot in use, then dropping the TCP connection closes them all. */
+static void test_close_all(void)
+{
+    for(uint16_t serial = 20; serial < 20 + EIP_MAX_CIP_CONNS; serial++) {
+        CHECK(open_class3(serial, 504) != 0);
+    }
+
+    process(forward_open(EIP_CM_SRV_FORWARD_OPEN, 99, 504, TRANSPORT_CLASS_3_SERVER, router_path, sizeof(router_path)));
+    check_cm_error(EIP_CM_SRV_FORWARD_OPEN, 0x0113);
+
+    eip_cm_close_all(conn);
+
+    CHECK_EQ(device->num_connections, 0);
+
+    for(int i = 0; i < EIP_MAX_CIP_CONNS; i++) {
+        CHECK(!conn->cip_conns[i].in_use);
+        CHECK(conn->cip_conns[i].last_reply == NULL);
+    }
+}
+
+
+
+int main(void)
+{
+    struct tag_db_t *db = tag_db_create(1);
+
+    debug_set_level(DEBUG_NONE);
+
+    tag_db_add(db, tag_create("A", TAG_TYPE_DINT, 1));
+
+    device = device_create(1, NULL, db, NULL);
+    conn = calloc(1, sizeof(*conn));
+
+    CHECK(device && conn);
+
+    conn->device = device;
+    conn->session_handle = SESSION_HANDLE;
+
+    test_is_request();
+    test_forward_open_close();
+    test_forward_open_errors();
+    test_routes();
+    test_send_unit_data();
+
+    eip_cm_close_all(conn);
+
+    test_close_all();
+
+    free(conn);
+    device_dispose(device);
+    tag_db_dispose(db);
+
+    return UNIT_TEST_RESULT();
+}
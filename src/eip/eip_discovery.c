@@ -0,0 +1,632 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_EIP)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IS_WINDOWS
+    #define _WINSOCKAPI_
+    #include <windows.h>
+    #include <Winsock2.h>
+    #include <Ws2tcpip.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+#endif
+
+#include "device/device.h"
+#include "eip/eip.h"
+#include "eip/eip_discovery.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+
+
+#ifdef IS_WINDOWS
+    #define close_socket(s) closesocket((SOCKET)(s))
+    #define poll_socket(fds, n, ms) WSAPoll((fds), (n), (ms))
+#else
+    #define close_socket(s) close((int)(s))
+    #define poll_socket(fds, n, ms) poll((fds), (n), (ms))
+#endif
+
+/* where ListIdentity gets patched. */
+#define IDENTITY_SENDER_CONTEXT (12)
+#define IDENTITY_STATUS (EIP_ENCAP_HEADER_SIZE + 32)
+
+/* Identity object state attribute, operational. */
+#define IDENTITY_STATE_OPERATIONAL (0x03)
+
+/* ListServices capability flags: CIP over TCP and class 0/1 over UDP. */
+#define SERVICE_CAPABILITY_FLAGS (0x0120)
+
+/* the sender context of a ListIdentity request holds the most we may wait, in ms. */
+#define DEFAULT_MAX_DELAY_MS (2000)
+#define MIN_MAX_DELAY_MS (500)
+
+#define IDLE_WAIT_MS (100)
+#define MIN_PENDING_CAPACITY (1024)
+#define MIN_DEVICE_CAPACITY (16)
+
+
+/* ListServices: one item, the Communications service. */
+static const uint8_t list_services_reply[] = {
+    0x04, 0x00, 0x1A, 0x00,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0,
+    0x01, 0x00,
+    0x00, 0x01, 0x14, 0x00,
+    0x01, 0x00,
+    (SERVICE_CAPABILITY_FLAGS & 0xFF), (SERVICE_CAPABILITY_FLAGS >> 8),
+    'C', 'o', 'm', 'm', 'u', 'n', 'i', 'c', 'a', 't', 'i', 'o', 'n', 's', 0, 0
+};
+
+/* ListInterfaces: no items. */
+static const uint8_t list_interfaces_reply[] = {
+    0x64, 0x00, 0x02, 0x00,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0, 0, 0, 0, 0, 0, 0,  0, 0, 0, 0,
+    0x00, 0x00
+};
+
+
+
+static void put_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t)(val >> 8);
+    p[1] = (uint8_t)(val & 0xFF);
+}
+
+
+/*
+ * The identity item.  The socket address is big endian, unlike everything
+ * else in EtherNet/IP.  Devices listening on all addresses report 0.0.0.0
+ * and clients use the address the reply came from.
+ */
+struct eip_discovery_t *eip_discovery_create(struct device_t *device)
+{
+    struct eip_discovery_t *discovery = NULL;
+    const struct device_identity_t *id = NULL;
+    struct eip_header header = {0};
+    struct in_addr addr;
+    size_t name_len = 0;
+    uint8_t *p = NULL;
+
+    if(!device) {
+        warn("Called with a NULL device pointer!");
+        return NULL;
+    }
+
+    if(!(discovery = calloc(1, sizeof(*discovery)))) {
+        warn("Unable to allocate discovery replies for device %u!", device->id);
+        return NULL;
+    }
+
+    discovery->device = device;
+    id = &(device->identity);
+
+    name_len = strlen(id->product_name);
+    if(name_len > DEVICE_PRODUCT_NAME_MAX) {
+        name_len = DEVICE_PRODUCT_NAME_MAX;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if(device->address[0] && inet_pton(AF_INET, device->address, &addr) != 1) {
+        addr.s_addr = 0;
+    }
+
+    p = discovery->identity + EIP_ENCAP_HEADER_SIZE;
+
+    encode_uint16_le(p, 1);
+    encode_uint16_le(p + 2, CPF_ITEM_LIST_IDENTITY);
+    encode_uint16_le(p + 4, (uint16_t)(34 + name_len));
+    encode_uint16_le(p + 6, EIP_PROTOCOL_VERSION);
+
+    put_be16(p + 8, AF_INET);
+    put_be16(p + 10, device->port);
+    memcpy(p + 12, &(addr.s_addr), 4);
+    memset(p + 16, 0, 8);
+
+    encode_uint16_le(p + 24, id->vendor_id);
+    encode_uint16_le(p + 26, id->device_type);
+    encode_uint16_le(p + 28, id->product_code);
+    p[30] = id->revision_major;
+    p[31] = id->revision_minor;
+    encode_uint16_le(p + 32, id->status);
+    encode_uint32_le(p + 34, id->serial_number);
+    p[38] = (uint8_t)name_len;
+    memcpy(p + 39, id->product_name, name_len);
+    p[39 + name_len] = IDENTITY_STATE_OPERATIONAL;
+
+    discovery->identity_len = (uint16_t)(EIP_ENCAP_HEADER_SIZE + 40 + name_len);
+
+    header.encap_command = EIP_CMD_LIST_IDENTITY;
+    header.encap_length = (uint16_t)(discovery->identity_len - EIP_ENCAP_HEADER_SIZE);
+    eip_encode_header(discovery->identity, &header);
+
+    return discovery;
+}
+
+
+void eip_discovery_dispose(struct eip_discovery_t *discovery)
+{
+    if(discovery) {
+        free(discovery);
+    }
+}
+
+
+status_t eip_discovery_reply(struct eip_discovery_t *discovery, uint16_t command, uint64_t sender_context, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    const uint8_t *frame = NULL;
+    size_t frame_len = 0;
+
+    if(!discovery || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    switch(command) {
+        case EIP_CMD_LIST_IDENTITY:
+            frame = discovery->identity;
+            frame_len = discovery->identity_len;
+            break;
+
+        case EIP_CMD_LIST_SERVICES:
+            frame = list_services_reply;
+            frame_len = sizeof(list_services_reply);
+            break;
+
+        case EIP_CMD_LIST_INTERFACES:
+            frame = list_interfaces_reply;
+            frame_len = sizeof(list_interfaces_reply);
+            break;
+
+        default:
+            return STATUS_NOT_SUPPORTED;
+    }
+
+    if(resp_capacity < frame_len) {
+        warn("Response buffer too small!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    memcpy(resp, frame, frame_len);
+    encode_uint64_le(resp + IDENTITY_SENDER_CONTEXT, sender_context);
+
+    /* the status word can change while running. */
+    if(command == EIP_CMD_LIST_IDENTITY) {
+        encode_uint16_le(resp + IDENTITY_STATUS, discovery->device->identity.status);
+    }
+
+    *resp_len = frame_len;
+
+    return STATUS_OK;
+}
+
+
+
+static intptr_t open_socket(const char *address, uint16_t port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    intptr_t sock = (intptr_t)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(sock < 0) {
+        warn("Unable to open discovery socket!");
+        return -1;
+    }
+
+    setsockopt((int)sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+    setsockopt((int)sock, SOL_SOCKET, SO_BROADCAST, (const char *)&one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if(!address || !*address || inet_pton(AF_INET, address, &(addr.sin_addr)) != 1) {
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    }
+
+    if(bind((int)sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        warn("Unable to bind discovery socket to port %u!", port);
+        close_socket(sock);
+        return -1;
+    }
+
+#ifdef IS_WINDOWS
+    {
+        u_long non_blocking = 1;
+
+        ioctlsocket((SOCKET)sock, FIONBIO, &non_blocking);
+    }
+#else
+    fcntl((int)sock, F_SETFL, fcntl((int)sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    return sock;
+}
+
+
+struct eip_discovery_responder_t *eip_discovery_responder_create(const char *address, uint16_t port)
+{
+    struct eip_discovery_responder_t *responder = NULL;
+
+    info("Starting.");
+
+    if(!(responder = calloc(1, sizeof(*responder)))) {
+        warn("Unable to allocate discovery responder!");
+        return NULL;
+    }
+
+    if((responder->sock = open_socket(address, port)) < 0) {
+        free(responder);
+        return NULL;
+    }
+
+    /* anything non-zero will do, it only spreads the replies out. */
+    responder->rand_state = (uint64_t)util_time_mono_ns() | 1;
+
+    MUTEX_INIT(responder->mutex);
+
+    info("Done.");
+
+    return responder;
+}
+
+
+void eip_discovery_responder_dispose(struct eip_discovery_responder_t *responder)
+{
+    if(!responder) {
+        return;
+    }
+
+    eip_discovery_responder_stop(responder);
+
+    /* the discovery replies belong to the devices. */
+    close_socket(responder->sock);
+
+    if(responder->devices) {
+        free(responder->devices);
+    }
+
+    if(responder->pending) {
+        free(responder->pending);
+    }
+
+    MUTEX_DESTROY(responder->mutex);
+
+    free(responder);
+}
+
+
+status_t eip_discovery_responder_add(struct eip_discovery_responder_t *responder, struct eip_discovery_t *discovery)
+{
+    status_t rc = STATUS_OK;
+
+    if(!responder || !discovery) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    MUTEX_LOCK(responder->mutex);
+
+    do {
+        if(responder->num_devices >= responder->device_capacity) {
+            uint32_t new_capacity = (responder->device_capacity ? responder->device_capacity * 2 : MIN_DEVICE_CAPACITY);
+            struct eip_discovery_t **new_devices = realloc(responder->devices, new_capacity * sizeof(*new_devices));
+
+            if(!new_devices) {
+                warn("Unable to grow discovery device array!");
+                rc = STATUS_NO_RESOURCE;
+                break;
+            }
+
+            responder->devices = new_devices;
+            responder->device_capacity = new_capacity;
+        }
+
+        responder->devices[responder->num_devices++] = discovery;
+    } while(0);
+
+    MUTEX_UNLOCK(responder->mutex);
+
+    return rc;
+}
+
+
+
+/*
+ * The pending reply heap.  Called with the mutex held.
+ */
+
+static bool heap_push(struct eip_discovery_responder_t *responder, const struct eip_discovery_reply_t *reply)
+{
+    uint32_t i = 0;
+
+    if(responder->num_pending >= responder->pending_capacity) {
+        uint32_t new_capacity = (responder->pending_capacity ? responder->pending_capacity * 2 : MIN_PENDING_CAPACITY);
+        struct eip_discovery_reply_t *new_pending = NULL;
+
+        if(new_capacity > EIP_DISCOVERY_MAX_PENDING) {
+            return false;
+        }
+
+        if(!(new_pending = realloc(responder->pending, new_capacity * sizeof(*new_pending)))) {
+            return false;
+        }
+
+        responder->pending = new_pending;
+        responder->pending_capacity = new_capacity;
+    }
+
+    i = responder->num_pending++;
+
+    while(i > 0) {
+        uint32_t parent = (i - 1) / 2;
+
+        if(responder->pending[parent].due_ns <= reply->due_ns) {
+            break;
+        }
+
+        responder->pending[i] = responder->pending[parent];
+        i = parent;
+    }
+
+    responder->pending[i] = *reply;
+
+    return true;
+}
+
+
+static void heap_pop(struct eip_discovery_responder_t *responder)
+{
+    struct eip_discovery_reply_t last = responder->pending[--responder->num_pending];
+    uint32_t n = responder->num_pending;
+    uint32_t i = 0;
+
+    while(true) {
+        uint32_t child = (2 * i) + 1;
+
+        if(child >= n) {
+            break;
+        }
+
+        if(child + 1 < n && responder->pending[child + 1].due_ns < responder->pending[child].due_ns) {
+            child++;
+        }
+
+        if(last.due_ns <= responder->pending[child].due_ns) {
+            break;
+        }
+
+        responder->pending[i] = responder->pending[child];
+        i = child;
+    }
+
+    if(n > 0) {
+        responder->pending[i] = last;
+    }
+}
+
+
+/* xorshift64, only used to spread the replies out. */
+static uint64_t next_rand(struct eip_discovery_responder_t *responder)
+{
+    uint64_t x = responder->rand_state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+
+    responder->rand_state = x;
+
+    return x;
+}
+
+
+
+static void send_reply(struct eip_discovery_responder_t *responder, struct eip_discovery_t *discovery, uint16_t command, uint64_t sender_context, uint32_t dest_ip, uint16_t dest_port)
+{
+    uint8_t frame[EIP_DISCOVERY_MAX_IDENTITY_SIZE];
+    size_t frame_len = 0;
+    struct sockaddr_in addr;
+
+    if(eip_discovery_reply(discovery, command, sender_context, frame, sizeof(frame), &frame_len) != STATUS_OK) {
+        return;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = dest_ip;
+    addr.sin_port = dest_port;
+
+    if(sendto((int)responder->sock, (const char *)frame, (int)frame_len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        responder->num_dropped++;
+        return;
+    }
+
+    responder->num_replies++;
+}
+
+
+static void handle_request(struct eip_discovery_responder_t *responder, const uint8_t *data, size_t data_len, const struct sockaddr_in *from, int64_t now_ns)
+{
+    struct eip_header header = {0};
+    uint32_t max_delay_ms = 0;
+
+    if(eip_decode_header(data, data_len, &header) != STATUS_OK) {
+        return;
+    }
+
+    responder->num_requests++;
+
+    flood("Discovery command %04x from %08x.", header.encap_command, ntohl(from->sin_addr.s_addr));
+
+    switch(header.encap_command) {
+        case EIP_CMD_LIST_IDENTITY:
+            /* 0 means the default, small values are raised to the minimum. */
+            max_delay_ms = (uint32_t)(header.encap_sender_context & 0xFFFF);
+
+            if(max_delay_ms == 0 || max_delay_ms > DEFAULT_MAX_DELAY_MS) {
+                max_delay_ms = DEFAULT_MAX_DELAY_MS;
+            } else if(max_delay_ms < MIN_MAX_DELAY_MS) {
+                max_delay_ms = MIN_MAX_DELAY_MS;
+            }
+
+            for(uint32_t i = 0; i < responder->num_devices; i++) {
+                struct eip_discovery_reply_t reply;
+
+                reply.due_ns = now_ns + (int64_t)(next_rand(responder) % ((uint64_t)max_delay_ms * 1000000));
+                reply.discovery = responder->devices[i];
+                reply.sender_context = header.encap_sender_context;
+                reply.dest_ip = from->sin_addr.s_addr;
+                reply.dest_port = from->sin_port;
+
+                if(!heap_push(responder, &reply)) {
+                    responder->num_dropped++;
+                }
+            }
+            break;
+
+        case EIP_CMD_LIST_SERVICES:
+        case EIP_CMD_LIST_INTERFACES:
+            /* the same for every device, so one answer will do. */
+            if(responder->num_devices > 0) {
+                send_reply(responder, responder->devices[0], header.encap_command, header.encap_sender_context, from->sin_addr.s_addr, from->sin_port);
+            }
+            break;
+
+        default:
+            detail("Ignoring UDP command %04x.", header.encap_command);
+            break;
+    }
+}
+
+
+int64_t eip_discovery_responder_poll(struct eip_discovery_responder_t *responder, int64_t now_ns)
+{
+    uint8_t buf[EIP_MAX_PACKET_SIZE];
+    int64_t next_ns = now_ns + ((int64_t)IDLE_WAIT_MS * 1000000);
+
+    if(!responder) {
+        return next_ns;
+    }
+
+    MUTEX_LOCK(responder->mutex);
+
+    while(true) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int rc = (int)recvfrom((int)responder->sock, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&from, &from_len);
+
+        if(rc <= 0) {
+            break;
+        }
+
+        if(from.sin_family == AF_INET) {
+            handle_request(responder, buf, (size_t)rc, &from, now_ns);
+        }
+    }
+
+    while(responder->num_pending > 0 && responder->pending[0].due_ns <= now_ns) {
+        struct eip_discovery_reply_t reply = responder->pending[0];
+
+        heap_pop(responder);
+
+        send_reply(responder, reply.discovery, EIP_CMD_LIST_IDENTITY, reply.sender_context, reply.dest_ip, reply.dest_port);
+    }
+
+    if(responder->num_pending > 0 && responder->pending[0].due_ns < next_ns) {
+        next_ns = responder->pending[0].due_ns;
+    }
+
+    MUTEX_UNLOCK(responder->mutex);
+
+    return next_ns;
+}
+
+
+
+/*
+ * The responder thread waits on the socket until the next reply is due.
+ */
+static void *responder_thread_func(void *arg)
+{
+    struct eip_discovery_responder_t *responder = (struct eip_discovery_responder_t *)arg;
+
+    while(!ATOMIC_LOAD_U32(&(responder->stop))) {
+        int64_t now_ns = util_clock_update();
+        int64_t next_ns = eip_discovery_responder_poll(responder, now_ns);
+        struct pollfd pfd;
+        int wait_ms = (int)((next_ns - util_clock_ns() + 999999) / 1000000);
+
+        if(wait_ms < 0) {
+            wait_ms = 0;
+        }
+
+        /* virtual time can jump past the reply while we wait, so look again often. */
+        if(util_vclock_enabled() && wait_ms > VCLOCK_POLL_MS) {
+            wait_ms = VCLOCK_POLL_MS;
+        }
+
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = (int)responder->sock;
+        pfd.events = POLLIN;
+
+        poll_socket(&pfd, 1, wait_ms);
+    }
+
+    return NULL;
+}
+
+
+status_t eip_discovery_responder_start(struct eip_discovery_responder_t *responder)
+{
+    if(!responder) {
+        warn("Called with a NULL responder pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    ATOMIC_STORE_U32(&(responder->stop), 0);
+
+    if(!THREAD_CREATE(responder->thread, responder_thread_func, responder)) {
+        warn("Unable to start the discovery thread!");
+        return STATUS_SETUP_FAILURE;
+    }
+
+    responder->thread_running = true;
+
+    return STATUS_OK;
+}
+
+
+void eip_discovery_responder_stop(struct eip_discovery_responder_t *responder)
+{
+    if(responder && responder->thread_running) {
+        ATOMIC_STORE_U32(&(responder->stop), 1);
+
+        THREAD_JOIN(responder->thread);
+
+        responder->thread_running = false;
+
+        info("Answered %llu discovery requests with %llu replies, %llu dropped.", (unsigned long long)responder->num_requests,
+             (unsigned long long)responder->num_replies, (unsigned long long)responder->num_dropped);
+    }
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "device/device.h"
+#include "eip/eip.h"
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Discovery: ListIdentity, ListServices and ListInterfaces.
+ *
+ * Every device's replies are encoded once, when it is added to the host.
+ * Answering a request is a copy of that frame with the sender context,
+ * identity status and state patched in.  ListServices and ListInterfaces
+ * replies are the same for every device and are compiled in.
+ *
+ * The responder answers the UDP form on port 44818.  A ListIdentity
+ * broadcast reaches every device, and each reply is sent after a random
+ * delay up to the maximum the requester put in its sender context, like a
+ * real device does.  The delays are deadlines in a heap serviced by the
+ * responder thread, which only wakes when a reply is due or a request
+ * arrives.  Nothing sleeps per reply.
+ */
+
+/* encapsulation header, the identity item without the product name, then the name. */
+#define EIP_DISCOVERY_MAX_IDENTITY_SIZE (EIP_ENCAP_HEADER_SIZE + 40 + DEVICE_PRODUCT_NAME_MAX)
+
+/* pending UDP replies beyond this are dropped. */
+#define EIP_DISCOVERY_MAX_PENDING (65536)
+
+
+
+struct eip_discovery_t {
+    struct device_t *device;
+
+    uint16_t identity_len;
+    uint8_t identity[EIP_DISCOVERY_MAX_IDENTITY_SIZE];
+};
+
+
+struct eip_discovery_reply_t {
+    int64_t due_ns;
+    struct eip_discovery_t *discovery;
+    uint64_t sender_context;
+
+    /* IPv4 address and port of the requester, network byte order. */
+    uint32_t dest_ip;
+    uint16_t dest_port;
+};
+
+
+struct eip_discovery_responder_t {
+    mutex_t mutex;
+
+    intptr_t sock;
+
+    thread_t thread;
+    bool thread_running;
+    uint32_t stop;
+
+    uint64_t rand_state;
+
+    uint32_t num_devices;
+    uint32_t device_capacity;
+    struct eip_discovery_t **devices;
+
+    /* min-heap on due_ns. */
+    uint32_t num_pending;
+    uint32_t pending_capacity;
+    struct eip_discovery_reply_t *pending;
+
+    uint64_t num_requests;
+    uint64_t num_replies;
+    uint64_t num_dropped;
+};
+
+
+extern struct eip_discovery_t *eip_discovery_create(struct device_t *device);
+extern void eip_discovery_dispose(struct eip_discovery_t *discovery);
+
+extern status_t eip_discovery_reply(struct eip_discovery_t *discovery, uint16_t command, uint64_t sender_context, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
+
+extern struct eip_discovery_responder_t *eip_discovery_responder_create(const char *address, uint16_t port);
+extern void eip_discovery_responder_dispose(struct eip_discovery_responder_t *responder);
+
+extern status_t eip_discovery_responder_add(struct eip_discovery_responder_t *responder, struct eip_discovery_t *discovery);
+
+extern status_t eip_discovery_responder_start(struct eip_discovery_responder_t *responder);
+extern void eip_discovery_responder_stop(struct eip_discovery_responder_t *responder);
+
+/* handle waiting requests and send what is due.  Returns when the next reply is due. */
+extern int64_t eip_discovery_responder_poll(struct eip_discovery_responder_t *responder, int64_t now_ns);
@@ -0,0 +1,704 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_IO)
+
+
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    /* sendmmsg() and pthread_setaffinity_np() */
+    #define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IS_WINDOWS
+    #define _WINSOCKAPI_
+    #include <windows.h>
+    #include <Winsock2.h>
+    #include <Ws2tcpip.h>
+#else
+    #include <errno.h>
+    #include <fcntl.h>
+    #include <pthread.h>
+    #include <sched.h>
+    #include <time.h>
+    #include <unistd.h>
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+#endif
+
+#include "device/device.h"
+#include "eip/eip.h"
+#include "io/io_sched.h"
+#include "io/io_xdp.h"
+#include "tags/tag.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+
+
+#ifdef IS_WINDOWS
+    #define close_socket(s) closesocket((SOCKET)(s))
+#else
+    #define close_socket(s) close((int)(s))
+#endif
+
+/* how long the scheduler thread sleeps when there is nothing to send. */
+#define IDLE_SLEEP_NS (10000000LL)
+
+
+
+void io_sched_config_init(struct io_sched_config_t *config)
+{
+    if(config) {
+        memset(config, 0, sizeof(*config));
+
+        config->tick_ns = (int64_t)IO_DEFAULT_TICK_US * 1000;
+        config->port = IO_DEFAULT_PORT;
+        config->cpu = -1;
+    }
+}
+
+
+
+static intptr_t open_socket(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    intptr_t sock = (intptr_t)socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if(sock < 0) {
+        warn("Unable to open I/O socket!");
+        return -1;
+    }
+
+    setsockopt((int)sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+
+    if(bind((int)sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        warn("Unable to bind I/O socket to port %u!", port);
+        close_socket(sock);
+        return -1;
+    }
+
+#ifdef IS_WINDOWS
+    {
+        u_long non_blocking = 1;
+
+        ioctlsocket((SOCKET)sock, FIONBIO, &non_blocking);
+    }
+#else
+    fcntl((int)sock, F_SETFL, fcntl((int)sock, F_GETFL, 0) | O_NONBLOCK);
+#endif
+
+    return sock;
+}
+
+
+struct io_sched_t *io_sched_create(const struct io_sched_config_t *config)
+{
+    struct io_sched_t *sched = NULL;
+
+    info("Starting.");
+
+    if(!config || config->tick_ns <= 0) {
+        warn("Called with a NULL or invalid config!");
+        return NULL;
+    }
+
+    if(!(sched = calloc(1, sizeof(*sched)))) {
+        warn("Unable to allocate I/O scheduler!");
+        return NULL;
+    }
+
+    sched->config = *config;
+    sched->last_tick = util_clock_ns() / config->tick_ns;
+
+    if((sched->sock = open_socket(config->port)) < 0) {
+        free(sched);
+        return NULL;
+    }
+
+    /* without AF_XDP everything goes through the socket. */
+    if(config->xdp_ifname && !(sched->xdp = io_xdp_create(config->xdp_ifname, config->xdp_queue, config->port))) {
+        warn("AF_XDP is not available on %s, using the UDP socket.", config->xdp_ifname);
+    }
+
+    MUTEX_INIT(sched->mutex);
+
+    info("Done.");
+
+    return sched;
+}
+
+
+void io_sched_dispose(struct io_sched_t *sched)
+{
+    if(!sched) {
+        return;
+    }
+
+    io_sched_stop(sched);
+
+    /* the connections belong to the CIP connections that opened them. */
+    io_xdp_dispose(sched->xdp);
+    close_socket(sched->sock);
+
+    MUTEX_DESTROY(sched->mutex);
+
+    free(sched);
+}
+
+
+
+/*
+ * The wheel.  Called with the mutex held.  A connection goes in the slot of
+ * its deadline's tick, or the next slot to be handled if that has passed.
+ */
+
+static void wheel_insert(struct io_sched_t *sched, struct io_conn_t *conn)
+{
+    int64_t tick = conn->deadline_ns / sched->config.tick_ns;
+    struct io_conn_t **slot = NULL;
+
+    if(tick <= sched->last_tick) {
+        tick = sched->last_tick + 1;
+    }
+
+    conn->slot = (uint32_t)(tick % IO_WHEEL_SLOTS);
+    slot = &(sched->slots[conn->slot]);
+
+    conn->prev = NULL;
+    conn->next = *slot;
+
+    if(*slot) {
+        (*slot)->prev = conn;
+    }
+
+    *slot = conn;
+}
+
+
+static void wheel_remove(struct io_sched_t *sched, struct io_conn_t *conn)
+{
+    if(conn->prev) {
+        conn->prev->next = conn->next;
+    } else if(sched->slots[conn->slot] == conn) {
+        sched->slots[conn->slot] = conn->next;
+    }
+
+    if(conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    conn->prev = conn->next = NULL;
+}
+
+
+
+struct io_conn_t *io_sched_add_conn(struct io_sched_t *sched, uint32_t conn_id, uint32_t dest_ip, uint16_t dest_port, uint32_t rpi_us, struct device_t *device, struct tag_t *tag, uint16_t data_len)
+{
+    struct io_conn_t *conn = NULL;
+
+    if(!sched || !device || !tag) {
+        warn("Called with NULL pointer(s)!");
+        return NULL;
+    }
+
+    if(rpi_us < IO_MIN_RPI_US || rpi_us > IO_MAX_RPI_US) {
+        warn("RPI of %u us is outside %u to %u us!", rpi_us, IO_MIN_RPI_US, IO_MAX_RPI_US);
+        return NULL;
+    }
+
+    if(data_len > IO_MAX_DATA_SIZE || data_len > tag->data_size) {
+        warn("Cannot produce %u bytes from tag %s!", data_len, tag->name);
+        return NULL;
+    }
+
+    if(!(conn = calloc(1, sizeof(*conn)))) {
+        warn("Unable to allocate I/O connection!");
+        return NULL;
+    }
+
+    conn->conn_id = conn_id;
+    conn->dest_ip = dest_ip;
+    conn->dest_port = htons(dest_port);
+    conn->rpi_ns = (int64_t)rpi_us * 1000;
+    conn->device = device;
+    conn->tag = tag;
+    conn->data_len = data_len;
+
+    /* the first packet goes out on the next tick. */
+    conn->deadline_ns = util_clock_ns();
+
+    MUTEX_LOCK(sched->mutex);
+
+    wheel_insert(sched, conn);
+    sched->num_conns++;
+
+    MUTEX_UNLOCK(sched->mutex);
+
+    info("Producing %u bytes of %s every %u us to connection %08x.", data_len, tag->name, rpi_us, conn_id);
+
+    return conn;
+}
+
+
+static void add_stats(struct io_jitter_stats_t *total, const struct io_jitter_stats_t *stats)
+{
+    total->num_sent += stats->num_sent;
+    total->num_late += stats->num_late;
+    total->num_missed += stats->num_missed;
+    total->sum_late_ns += stats->sum_late_ns;
+    total->sum_sq_late_ns += stats->sum_sq_late_ns;
+
+    if(stats->max_late_ns > total->max_late_ns) {
+        total->max_late_ns = stats->max_late_ns;
+    }
+}
+
+
+void io_sched_remove_conn(struct io_sched_t *sched, struct io_conn_t *conn)
+{
+    if(!sched || !conn) {
+        return;
+    }
+
+    MUTEX_LOCK(sched->mutex);
+
+    wheel_remove(sched, conn);
+    sched->num_conns--;
+    add_stats(&(sched->closed_stats), &(conn->stats));
+
+    MUTEX_UNLOCK(sched->mutex);
+
+    info("Stopped connection %08x after %llu packets, %llu late, max %lld us late.", conn->conn_id,
+         (unsigned long long)conn->stats.num_sent, (unsigned long long)conn->stats.num_late, (long long)(conn->stats.max_late_ns / 1000));
+
+    free(conn);
+}
+
+
+void io_sched_get_stats(struct io_sched_t *sched, struct io_jitter_stats_t *stats)
+{
+    if(!sched || !stats) {
+        return;
+    }
+
+    MUTEX_LOCK(sched->mutex);
+
+    *stats = sched->closed_stats;
+
+    for(uint32_t i = 0; i < IO_WHEEL_SLOTS; i++) {
+        for(struct io_conn_t *conn = sched->slots[i]; conn; conn = conn->next) {
+            add_stats(stats, &(conn->stats));
+        }
+    }
+
+    MUTEX_UNLOCK(sched->mutex);
+}
+
+
+
+/*
+ * Sending.  Packets the AF_XDP path takes go on its ring.  The rest go out
+ * through the UDP socket, on Linux in one sendmmsg() call and elsewhere one
+ * sendto() per packet.  Packets that would block are dropped, the next RPI
+ * sends fresh data anyway.
+ */
+
+static void flush_batch(struct io_sched_t *sched)
+{
+    uint32_t batch_len = sched->batch_len;
+
+    if(batch_len == 0) {
+        return;
+    }
+
+    sched->batch_len = 0;
+
+#if defined(__linux__)
+    {
+        struct mmsghdr msgs[IO_BATCH_SIZE];
+        struct iovec iovs[IO_BATCH_SIZE];
+        struct sockaddr_in addrs[IO_BATCH_SIZE];
+        uint32_t count = 0;
+        uint32_t sent = 0;
+
+        for(uint32_t i = 0; i < batch_len; i++) {
+            if(sched->xdp && io_xdp_queue(sched->xdp, &(sched->batch[i]))) {
+                continue;
+            }
+
+            memset(&(msgs[count]), 0, sizeof(msgs[count]));
+            memset(&(addrs[count]), 0, sizeof(addrs[count]));
+            addrs[count].sin_family = AF_INET;
+            addrs[count].sin_addr.s_addr = sched->batch[i].dest_ip;
+            addrs[count].sin_port = sched->batch[i].dest_port;
+
+            iovs[count].iov_base = sched->batch[i].data;
+            iovs[count].iov_len = sched->batch[i].len;
+
+            msgs[count].msg_hdr.msg_name = &(addrs[count]);
+            msgs[count].msg_hdr.msg_namelen = sizeof(addrs[count]);
+            msgs[count].msg_hdr.msg_iov = &(iovs[count]);
+            msgs[count].msg_hdr.msg_iovlen = 1;
+
+            count++;
+        }
+
+        io_xdp_flush(sched->xdp);
+
+        while(sent < count) {
+            int rc = sendmmsg((int)sched->sock, msgs + sent, count - sent, 0);
+
+            if(rc <= 0) {
+                if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    /* skip the packet that failed, not the rest. */
+                    detail("Error %d sending I/O packet.", errno);
+                    sent++;
+                    continue;
+                }
+
+                break;
+            }
+
+            sent += (uint32_t)rc;
+        }
+    }
+#else
+    for(uint32_t i = 0; i < batch_len; i++) {
+        struct sockaddr_in addr;
+
+        if(sched->xdp && io_xdp_queue(sched->xdp, &(sched->batch[i]))) {
+            continue;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = sched->batch[i].dest_ip;
+        addr.sin_port = sched->batch[i].dest_port;
+
+        sendto((int)sched->sock, (const char *)sched->batch[i].data, sched->batch[i].len, 0, (struct sockaddr *)&addr, sizeof(addr));
+    }
+#endif
+}
+
+
+/* a sequenced address item then the connected data, see the CIP networks library, vol 2. */
+static void build_packet(struct io_conn_t *conn, struct io_batch_entry_t *entry)
+{
+    uint8_t *p = entry->data;
+
+    conn->seq++;
+    conn->seq_count++;
+
+    encode_uint16_le(p, 2);
+    encode_uint16_le(p + 2, CPF_ITEM_SEQUENCED_ADDRESS);
+    encode_uint16_le(p + 4, 8);
+    encode_uint32_le(p + 6, conn->conn_id);
+    encode_uint32_le(p + 10, conn->seq);
+    encode_uint16_le(p + 14, CPF_ITEM_CONNECTED_DATA);
+    encode_uint16_le(p + 16, (uint16_t)(conn->data_len + 2));
+    encode_uint16_le(p + 18, conn->seq_count);
+
+    if(tag_read(conn->tag, conn->device->tag_image, 0, p + IO_PACKET_HEADER_SIZE, conn->data_len) != STATUS_OK) {
+        memset(p + IO_PACKET_HEADER_SIZE, 0, conn->data_len);
+    }
+
+    entry->dest_ip = conn->dest_ip;
+    entry->dest_port = conn->dest_port;
+    entry->len = (uint16_t)(IO_PACKET_HEADER_SIZE + conn->data_len);
+}
+
+
+static void record_send(struct io_conn_t *conn, int64_t now_ns)
+{
+    int64_t late_ns = now_ns - conn->deadline_ns;
+
+    if(late_ns < 0) {
+        late_ns = 0;
+    }
+
+    conn->stats.num_sent++;
+    conn->stats.sum_late_ns += late_ns;
+    conn->stats.sum_sq_late_ns += (double)late_ns * (double)late_ns;
+
+    if(late_ns > conn->stats.max_late_ns) {
+        conn->stats.max_late_ns = late_ns;
+    }
+
+    if(late_ns > conn->rpi_ns / 4) {
+        conn->stats.num_late++;
+    }
+
+    /* the next deadline is one RPI after this one, skipping any we are already past. */
+    conn->deadline_ns += conn->rpi_ns;
+
+    while(conn->deadline_ns <= now_ns) {
+        conn->deadline_ns += conn->rpi_ns;
+        conn->stats.num_missed++;
+    }
+}
+
+
+/*
+ * Send everything due by now_ns.  Every tick since the last call is
+ * handled, so a late wake up catches up rather than skipping slots.  Returns
+ * when the next tick starts, or a while from now if nothing is scheduled.
+ */
+int64_t io_sched_poll(struct io_sched_t *sched, int64_t now_ns)
+{
+    int64_t now_tick = 0;
+    int64_t first_tick = 0;
+    uint32_t num_conns = 0;
+
+    if(!sched) {
+        return now_ns + IDLE_SLEEP_NS;
+    }
+
+    now_tick = now_ns / sched->config.tick_ns;
+
+    MUTEX_LOCK(sched->mutex);
+
+    /* more than a revolution behind means every slot is looked at once. */
+    first_tick = sched->last_tick + 1;
+    if(now_tick - first_tick >= IO_WHEEL_SLOTS) {
+        first_tick = now_tick - IO_WHEEL_SLOTS + 1;
+    }
+
+    for(int64_t tick = first_tick; tick <= now_tick; tick++) {
+        struct io_conn_t **slot = &(sched->slots[tick % IO_WHEEL_SLOTS]);
+        struct io_conn_t *conn = *slot;
+
+        *slot = NULL;
+        sched->last_tick = tick;
+
+        while(conn) {
+            struct io_conn_t *next = conn->next;
+
+            /* a deadline a whole revolution out goes straight back. */
+            if(conn->deadline_ns / sched->config.tick_ns <= tick) {
+                if(sched->batch_len >= IO_BATCH_SIZE) {
+                    flush_batch(sched);
+                }
+
+                build_packet(conn, &(sched->batch[sched->batch_len++]));
+                record_send(conn, now_ns);
+            }
+
+            wheel_insert(sched, conn);
+
+            conn = next;
+        }
+    }
+
+    sched->last_tick = now_tick;
+
+    flush_batch(sched);
+
+    num_conns = sched->num_conns;
+
+    MUTEX_UNLOCK(sched->mutex);
+
+    if(num_conns == 0) {
+        return now_ns + IDLE_SLEEP_NS;
+    }
+
+    return (now_tick + 1) * sched->config.tick_ns;
+}
+
+
+
+/*
+ * The scheduler thread.
+ */
+
+static void sleep_until(int64_t deadline_ns)
+{
+#if defined(__linux__)
+    struct timespec ts;
+
+    ts.tv_sec = (time_t)(deadline_ns / 1000000000LL);
+    ts.tv_nsec = (long)(deadline_ns % 1000000000LL);
+
+    /* util_clock_ns() follows CLOCK_MONOTONIC, so absolute sleeps line up with it. */
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+#elif defined(IS_WINDOWS)
+    int64_t remaining_ns = deadline_ns - util_clock_ns();
+
+    if(remaining_ns > 0) {
+        Sleep((DWORD)((remaining_ns + 999999) / 1000000));
+    }
+#else
+    int64_t remaining_ns = deadline_ns - util_clock_ns();
+
+    if(remaining_ns > 0) {
+        struct timespec ts;
+
+        ts.tv_sec = (time_t)(remaining_ns / 1000000000LL);
+        ts.tv_nsec = (long)(remaining_ns % 1000000000LL);
+
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+
+/* best effort, both need privileges we may not have. */
+static void set_realtime(int cpu)
+{
+#if defined(IS_WINDOWS)
+    if(!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)) {
+        warn("Unable to raise the I/O thread priority!");
+    }
+
+    if(!SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu)) {
+        warn("Unable to pin the I/O thread to CPU %d!", cpu);
+    }
+#else
+    struct sched_param param;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+
+    if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+        warn("Unable to raise the I/O thread to real time priority!");
+    }
+
+    #if defined(__linux__)
+    {
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            warn("Unable to pin the I/O thread to CPU %d!", cpu);
+        }
+    }
+    #else
+        warn("Pinning the I/O thread to CPU %d is not supported on this platform.", cpu);
+    #endif
+#endif
+}
+
+
+/*
+ * Under virtual time the tick by tick deadline would make the clock crawl,
+ * so the thread reports the start of the first slot with anything in it.
+ */
+static int64_t next_busy_tick_ns(struct io_sched_t *sched)
+{
+    int64_t next_ns = INT64_MAX;
+
+    MUTEX_LOCK(sched->mutex);
+
+    for(int64_t tick = sched->last_tick + 1; tick <= sched->last_tick + IO_WHEEL_SLOTS; tick++) {
+        if(sched->slots[tick % IO_WHEEL_SLOTS]) {
+            next_ns = tick * sched->config.tick_ns;
+            break;
+        }
+    }
+
+    MUTEX_UNLOCK(sched->mutex);
+
+    return next_ns;
+}
+
+
+static void run_virtual(struct io_sched_t *sched)
+{
+    int vclock_id = sched->vclock_id;
+
+    while(!ATOMIC_LOAD_U32(&(sched->stop))) {
+        int64_t activity = util_vclock_activity();
+        int64_t next_ns = 0;
+
+        io_sched_poll(sched, util_clock_update());
+
+        next_ns = next_busy_tick_ns(sched);
+
+        /* connections are added from a loop that reports itself busy, so a stale report is never acted on. */
+        if(util_vclock_idle(vclock_id, activity, next_ns)) {
+            util_vclock_wait(activity, next_ns);
+        }
+    }
+
+    util_vclock_leave(vclock_id);
+}
+
+
+static void *io_thread_func(void *arg)
+{
+    struct io_sched_t *sched = (struct io_sched_t *)arg;
+
+    if(sched->config.cpu >= 0) {
+        set_realtime(sched->config.cpu);
+    }
+
+    if(util_vclock_enabled()) {
+        run_virtual(sched);
+        return NULL;
+    }
+
+    while(!ATOMIC_LOAD_U32(&(sched->stop))) {
+        sleep_until(io_sched_poll(sched, util_clock_update()));
+    }
+
+    return NULL;
+}
+
+
+status_t io_sched_start(struct io_sched_t *sched)
+{
+    if(!sched) {
+        warn("Called with a NULL scheduler pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    ATOMIC_STORE_U32(&(sched->stop), 0);
+
+    /* joined here so virtual time cannot move before the thread is running. */
+    sched->vclock_id = util_vclock_join(NULL, NULL);
+
+    if(!THREAD_CREATE(sched->thread, io_thread_func, sched)) {
+        warn("Unable to start the I/O thread!");
+        util_vclock_leave(sched->vclock_id);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    sched->thread_running = true;
+
+    return STATUS_OK;
+}
+
+
+void io_sched_stop(struct io_sched_t *sched)
+{
+    if(sched && sched->thread_running) {
+        ATOMIC_STORE_U32(&(sched->stop), 1);
+
+        THREAD_JOIN(sched->thread);
+
+        sched->thread_running = false;
+    }
+}
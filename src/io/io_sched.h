@@ -0,0 +1,170 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Class 1 implicit I/O producer.
+ *
+ * Each connection sends its data to a scanner every RPI.  Connections sit
+ * in a timing wheel keyed by their next send deadline, one slot per tick, so
+ * a tick only looks at the connections that are due.  Everything due in a
+ * tick is built into one batch and handed to the socket in as few calls as
+ * the platform allows.
+ *
+ * Deadlines advance by exactly one RPI from the previous deadline, not from
+ * when the packet actually went out, so lateness never accumulates.  How
+ * late each packet was is kept per connection.
+ */
+
+#define IO_DEFAULT_PORT (2222)
+
+#define IO_MIN_RPI_US (1000)
+#define IO_MAX_RPI_US (1000000)
+#define IO_DEFAULT_TICK_US (250)
+
+/* 4096 slots of 250us covers the longest RPI. */
+#define IO_WHEEL_SLOTS (4096)
+
+#define IO_MAX_DATA_SIZE (1400)
+#define IO_BATCH_SIZE (64)
+
+/* sequenced address item and connected data item with its sequence count. */
+#define IO_PACKET_HEADER_SIZE (20)
+#define IO_MAX_PACKET_SIZE (IO_PACKET_HEADER_SIZE + IO_MAX_DATA_SIZE)
+
+
+struct device_t;
+struct io_xdp_t;
+struct tag_t;
+
+
+/* lateness is how long after its deadline a packet was sent. */
+struct io_jitter_stats_t {
+    uint64_t num_sent;
+
+    /* more than a quarter of an RPI late. */
+    uint64_t num_late;
+
+    /* whole intervals skipped because we fell more than an RPI behind. */
+    uint64_t num_missed;
+
+    int64_t max_late_ns;
+    int64_t sum_late_ns;
+    double sum_sq_late_ns;
+};
+
+
+struct io_conn_t {
+    struct io_conn_t *prev;
+    struct io_conn_t *next;
+    uint32_t slot;
+
+    uint32_t conn_id;
+
+    /* IPv4 address and port, network byte order. */
+    uint32_t dest_ip;
+    uint16_t dest_port;
+
+    uint32_t seq;
+    uint16_t seq_count;
+
+    int64_t rpi_ns;
+    int64_t deadline_ns;
+
+    /* the produced data is the start of this tag. */
+    struct device_t *device;
+    struct tag_t *tag;
+    uint16_t data_len;
+
+    struct io_jitter_stats_t stats;
+};
+
+
+struct io_sched_config_t {
+    int64_t tick_ns;
+
+    /* source port of the produced packets. */
+    uint16_t port;
+
+    /* run the scheduler thread at high priority pinned to this CPU, -1 to leave it alone. */
+    int cpu;
+
+    /* send through AF_XDP on this interface and queue when possible, NULL for the socket only. */
+    const char *xdp_ifname;
+    uint32_t xdp_queue;
+};
+
+
+struct io_batch_entry_t {
+    uint32_t dest_ip;
+    uint16_t dest_port;
+    uint16_t len;
+    uint8_t data[IO_MAX_PACKET_SIZE];
+};
+
+
+struct io_sched_t {
+    mutex_t mutex;
+
+    struct io_sched_config_t config;
+
+    intptr_t sock;
+    struct io_xdp_t *xdp;
+
+    thread_t thread;
+    bool thread_running;
+    uint32_t stop;
+
+    /* our place on the virtual clock, -1 unless running under virtual time. */
+    int vclock_id;
+
+    /* the last tick whose slot has been handled. */
+    int64_t last_tick;
+
+    uint32_t num_conns;
+    struct io_conn_t *slots[IO_WHEEL_SLOTS];
+
+    /* stats of connections that have been removed. */
+    struct io_jitter_stats_t closed_stats;
+
+    uint32_t batch_len;
+    struct io_batch_entry_t batch[IO_BATCH_SIZE];
+};
+
+
+extern void io_sched_config_init(struct io_sched_config_t *config);
+
+extern struct io_sched_t *io_sched_create(const struct io_sched_config_t *config);
+extern void io_sched_dispose(struct io_sched_t *sched);
+
+extern status_t io_sched_start(struct io_sched_t *sched);
+extern void io_sched_stop(struct io_sched_t *sched);
+
+extern int64_t io_sched_poll(struct io_sched_t *sched, int64_t now_ns);
+
+/* dest_ip is in network byte order, dest_port is not. */
+extern struct io_conn_t *io_sched_add_conn(struct io_sched_t *sched, uint32_t conn_id, uint32_t dest_ip, uint16_t dest_port, uint32_t rpi_us, struct device_t *device, struct tag_t *tag, uint16_t data_len);
+extern void io_sched_remove_conn(struct io_sched_t *sched, struct io_conn_t *conn);
+
+extern void io_sched_get_stats(struct io_sched_t *sched, struct io_jitter_stats_t *stats);
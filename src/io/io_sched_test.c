@@ -0,0 +1,265 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "device/device.h"
+#include "io/io_sched.h"
+#include "tags/tag.h"
+#include "tags/tag_image.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+#include "util/unit_test.h"
+
+
+/*
+ * The scheduler thread is never started, io_sched_poll() is called with
+ * made up times instead so the wheel can be stepped a tick at a time or
+ * jumped far ahead.  Packets go to the discard port on loopback.
+ */
+
+#define TICK_NS ((int64_t)IO_DEFAULT_TICK_US * 1000)
+#define DISCARD_PORT (9)
+
+static struct device_t device;
+static struct tag_t *tag;
+static uint32_t loopback_ip;
+
+
+
+static struct io_sched_t *make_sched(void)
+{
+    struct io_sched_config_t config;
+
+    io_sched_config_init(&config);
+
+    /* any free port will do for the source. */
+    config.port = 0;
+
+    return io_sched_create(&config);
+}
+
+
+static struct io_conn_t *add_conn(struct io_sched_t *sched, uint32_t conn_id, uint32_t rpi_us)
+{
+    return io_sched_add_conn(sched, conn_id, loopback_ip, DISCARD_PORT, rpi_us, &device, tag, 16);
+}
+
+
+/* where wheel_insert() should have put a connection. */
+static uint32_t expected_slot(struct io_sched_t *sched, struct io_conn_t *conn)
+{
+    int64_t tick = conn->deadline_ns / TICK_NS;
+
+    if(tick <= sched->last_tick) {
+        tick = sched->last_tick + 1;
+    }
+
+    return (uint32_t)(tick % IO_WHEEL_SLOTS);
+}
+
+
+static void test_add_conn(void)
+{
+    struct io_sched_t *sched = make_sched();
+    struct io_conn_t *conn = NULL;
+
+    CHECK(sched != NULL);
+
+    CHECK(add_conn(sched, 1, IO_MIN_RPI_US - 1) == NULL);
+    CHECK(add_conn(sched, 1, IO_MAX_RPI_US + 1) == NULL);
+    CHECK(io_sched_add_conn(sched, 1, loopback_ip, DISCARD_PORT, 1000, &device, tag, 17) == NULL);
+    CHECK_EQ(sched->num_conns, 0);
+
+    conn = add_conn(sched, 1, 1000);
+    CHECK(conn != NULL);
+    CHECK_EQ(sched->num_conns, 1);
+    CHECK_EQ(conn->slot, expected_slot(sched, conn));
+    CHECK(sched->slots[conn->slot] == conn);
+
+    io_sched_remove_conn(sched, conn);
+    CHECK_EQ(sched->num_conns, 0);
+
+    for(uint32_t i = 0; i < IO_WHEEL_SLOTS; i++) {
+        CHECK(sched->slots[i] == NULL);
+    }
+
+    io_sched_dispose(sched);
+}
+
+
+/* a second of ticks, each connection goes out once per RPI and exactly on time. */
+static void test_steady(void)
+{
+    struct io_sched_t *sched = make_sched();
+    struct io_conn_t *fast = add_conn(sched, 1, 1000);
+    struct io_conn_t *slow = add_conn(sched, 2, 2500);
+    struct io_jitter_stats_t stats = {0};
+    int64_t base_ns = (fast->deadline_ns / TICK_NS) * TICK_NS;
+    int64_t now_ns = 0;
+
+    CHECK(fast && slow);
+
+    for(int64_t i = 0; i < 4000; i++) {
+        now_ns = base_ns + (i * TICK_NS) + 7;
+
+        CHECK_EQ(io_sched_poll(sched, now_ns), (now_ns / TICK_NS + 1) * TICK_NS);
+    }
+
+    CHECK_EQ(fast->stats.num_sent, 1000);
+    CHECK_EQ(fast->seq, 1000);
+    CHECK_EQ(fast->seq_count, 1000);
+    CHECK_EQ(slow->stats.num_sent, 400);
+
+    CHECK_EQ(fast->stats.num_missed + slow->stats.num_missed, 0);
+    CHECK_EQ(fast->stats.num_late + slow->stats.num_late, 0);
+
+    /* only the first packet can wait for the tick after the one it was added in. */
+    CHECK(fast->stats.max_late_ns <= TICK_NS);
+    CHECK(slow->stats.max_late_ns <= TICK_NS);
+
+    /* each is back in the wheel at its next deadline. */
+    CHECK_EQ(fast->slot, expected_slot(sched, fast));
+    CHECK_EQ(slow->slot, expected_slot(sched, slow));
+    CHECK(fast->deadline_ns > now_ns && fast->deadline_ns <= now_ns + fast->rpi_ns);
+
+    io_sched_remove_conn(sched, fast);
+    io_sched_remove_conn(sched, slow);
+
+    /* removed connections keep counting in the totals. */
+    io_sched_get_stats(sched, &stats);
+    CHECK_EQ(stats.num_sent, 1400);
+
+    /* nothing to send, sleep longer than a tick. */
+    CHECK(io_sched_poll(sched, now_ns + TICK_NS) > now_ns + 2 * TICK_NS);
+
+    io_sched_dispose(sched);
+}
+
+
+/* a poll many RPIs late sends once and skips the intervals in between. */
+static void test_fall_behind(void)
+{
+    struct io_sched_t *sched = make_sched();
+    struct io_conn_t *conn = add_conn(sched, 1, 1000);
+    int64_t first_ns = conn->deadline_ns + TICK_NS;
+    int64_t late_ns = 0;
+    int64_t now_ns = 0;
+
+    io_sched_poll(sched, first_ns);
+    CHECK_EQ(conn->stats.num_sent, 1);
+
+    late_ns = (first_ns + (10 * conn->rpi_ns) + (conn->rpi_ns / 2)) - conn->deadline_ns;
+    now_ns = conn->deadline_ns + late_ns;
+
+    io_sched_poll(sched, now_ns);
+
+    CHECK_EQ(conn->stats.num_sent, 2);
+    CHECK_EQ(conn->stats.num_late, 1);
+    CHECK_EQ(conn->stats.max_late_ns, late_ns);
+    CHECK_EQ(conn->stats.num_missed, late_ns / conn->rpi_ns);
+    CHECK(conn->deadline_ns > now_ns && conn->deadline_ns <= now_ns + conn->rpi_ns);
+
+    /* more than a whole revolution behind, every slot is looked at once and it still goes out once. */
+    now_ns += 3 * IO_WHEEL_SLOTS * TICK_NS;
+
+    io_sched_poll(sched, now_ns);
+
+    CHECK_EQ(conn->stats.num_sent, 3);
+    CHECK_EQ(sched->last_tick, now_ns / TICK_NS);
+    CHECK_EQ(conn->slot, expected_slot(sched, conn));
+    CHECK(conn->deadline_ns > now_ns && conn->deadline_ns <= now_ns + conn->rpi_ns);
+
+    io_sched_remove_conn(sched, conn);
+    io_sched_dispose(sched);
+}
+
+
+/* the longest RPI is almost a whole revolution, it must not come round early. */
+static void test_long_rpi(void)
+{
+    struct io_sched_t *sched = make_sched();
+    struct io_conn_t *conn = add_conn(sched, 1, IO_MAX_RPI_US);
+    int64_t base_ns = (conn->deadline_ns / TICK_NS + 1) * TICK_NS;
+
+    io_sched_poll(sched, base_ns);
+    CHECK_EQ(conn->stats.num_sent, 1);
+
+    for(int64_t i = 1; i < IO_WHEEL_SLOTS * 2; i++) {
+        io_sched_poll(sched, base_ns + i * TICK_NS);
+    }
+
+    /* two revolutions of the wheel is just over two RPIs. */
+    CHECK_EQ(conn->stats.num_sent, 3);
+    CHECK_EQ(conn->stats.num_missed, 0);
+
+    io_sched_remove_conn(sched, conn);
+    io_sched_dispose(sched);
+}
+
+
+/* a deadline a whole revolution out shares its slot with this time round, it waits for the next. */
+static void test_far_deadline(void)
+{
+    struct io_sched_t *sched = make_sched();
+    struct io_conn_t *conn = add_conn(sched, 1, 1000);
+    int64_t base_ns = (conn->deadline_ns / TICK_NS + 1) * TICK_NS;
+    int64_t due_ns = 0;
+
+    io_sched_poll(sched, base_ns);
+    CHECK_EQ(conn->stats.num_sent, 1);
+
+    conn->deadline_ns += (int64_t)IO_WHEEL_SLOTS * TICK_NS;
+    due_ns = conn->deadline_ns;
+
+    for(int64_t now_ns = base_ns + TICK_NS; now_ns / TICK_NS < due_ns / TICK_NS; now_ns += TICK_NS) {
+        io_sched_poll(sched, now_ns);
+    }
+
+    CHECK_EQ(conn->stats.num_sent, 1);
+
+    io_sched_poll(sched, due_ns);
+    CHECK_EQ(conn->stats.num_sent, 2);
+    CHECK(conn->stats.max_late_ns <= TICK_NS);
+
+    io_sched_remove_conn(sched, conn);
+    io_sched_dispose(sched);
+}
+
+
+
+int main(void)
+{
+    uint8_t ip[4] = { 127, 0, 0, 1 };
+
+    debug_set_level(DEBUG_NONE);
+
+    /* already in network byte order. */
+    memcpy(&loopback_ip, ip, sizeof(loopback_ip));
+
+    tag = tag_create("Out", TAG_TYPE_DINT, 4);
+    device.tag_image = tag_image_create(NULL, tag->data_size);
+
+    test_add_conn();
+    test_steady();
+    test_fall_behind();
+    test_long_rpi();
+    test_far_deadline();
+
+    tag_image_dispose(device.tag_image);
+    tag_dispose(tag);
+
+    return UNIT_TEST_RESULT();
+}
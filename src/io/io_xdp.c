@@ -0,0 +1,675 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_IO)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__) && defined(USE_AF_XDP)
+    #include <errno.h>
+    #include <stdio.h>
+    #include <unistd.h>
+    #include <arpa/inet.h>
+    #include <linux/if_xdp.h>
+    #include <net/if.h>
+    #include <netinet/in.h>
+    #include <sys/ioctl.h>
+    #include <sys/mman.h>
+    #include <sys/socket.h>
+#endif
+
+#include "io/io_sched.h"
+#include "io/io_xdp.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+
+
+#if defined(__linux__) && defined(USE_AF_XDP)
+
+#ifndef AF_XDP
+    #define AF_XDP (44)
+#endif
+
+#ifndef SOL_XDP
+    #define SOL_XDP (283)
+#endif
+
+/* UMEM frames, each holds one outgoing frame. */
+#define XDP_NUM_FRAMES (4096)
+#define XDP_FRAME_SIZE (2048)
+
+#define XDP_TX_RING_SIZE (2048)
+#define XDP_COMPLETION_RING_SIZE (2048)
+
+/* never filled, but the kernel will not bind a UMEM without one. */
+#define XDP_FILL_RING_SIZE (64)
+
+#define XDP_MAX_NEIGHBORS (256)
+#define NEIGHBOR_RETRY_NS (1000000000LL)
+
+#define ETH_HEADER_SIZE (14)
+#define IPV4_HEADER_SIZE (20)
+#define UDP_HEADER_SIZE (8)
+#define FRAME_HEADER_SIZE (ETH_HEADER_SIZE + IPV4_HEADER_SIZE + UDP_HEADER_SIZE)
+
+
+struct xdp_ring_t {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t mask;
+
+    void *map;
+    size_t map_len;
+};
+
+
+struct xdp_neighbor_t {
+    uint32_t ip;
+    bool valid;
+    uint8_t mac[6];
+    int64_t checked_ns;
+};
+
+
+struct io_xdp_t {
+    int fd;
+    bool need_wakeup;
+
+    uint8_t *umem;
+    size_t umem_len;
+
+    struct xdp_ring_t tx;
+    struct xdp_ring_t completion;
+    struct xdp_ring_t fill;
+
+    uint32_t tx_producer;
+    uint32_t num_queued;
+
+    uint32_t num_free;
+    uint64_t free_frames[XDP_NUM_FRAMES];
+
+    char ifname[IF_NAMESIZE];
+    uint8_t src_mac[6];
+    uint32_t src_ip;
+    uint16_t src_port;
+    uint16_t ip_id;
+
+    uint32_t num_neighbors;
+    struct xdp_neighbor_t neighbors[XDP_MAX_NEIGHBORS];
+};
+
+
+
+static bool get_if_info(struct io_xdp_t *xdp, const char *ifname, int *ifindex)
+{
+    struct ifreq ifr;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    bool ok = false;
+
+    if(sock < 0) {
+        return false;
+    }
+
+    do {
+        memset(&ifr, 0, sizeof(ifr));
+        snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifname);
+
+        if(ioctl(sock, SIOCGIFINDEX, &ifr) != 0) {
+            warn("No interface %s!", ifname);
+            break;
+        }
+
+        *ifindex = ifr.ifr_ifindex;
+
+        if(ioctl(sock, SIOCGIFHWADDR, &ifr) != 0) {
+            warn("Unable to get the MAC address of %s!", ifname);
+            break;
+        }
+
+        memcpy(xdp->src_mac, ifr.ifr_hwaddr.sa_data, sizeof(xdp->src_mac));
+
+        if(ioctl(sock, SIOCGIFADDR, &ifr) != 0) {
+            warn("Interface %s has no IPv4 address!", ifname);
+            break;
+        }
+
+        xdp->src_ip = ((struct sockaddr_in *)&ifr.ifr_addr)->sin_addr.s_addr;
+
+        ok = true;
+    } while(0);
+
+    close(sock);
+
+    return ok;
+}
+
+
+static bool map_ring(int fd, struct xdp_ring_t *ring, const struct xdp_ring_offset *off, uint32_t size, size_t desc_size, off_t pgoff)
+{
+    ring->map_len = off->desc + (size * desc_size);
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+
+    if(ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return false;
+    }
+
+    ring->producer = (uint32_t *)((uint8_t *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((uint8_t *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((uint8_t *)ring->map + off->flags);
+    ring->descs = (uint8_t *)ring->map + off->desc;
+    ring->mask = size - 1;
+
+    return true;
+}
+
+
+static void unmap_ring(struct xdp_ring_t *ring)
+{
+    if(ring->map) {
+        munmap(ring->map, ring->map_len);
+        ring->map = NULL;
+    }
+}
+
+
+static bool bind_socket(struct io_xdp_t *xdp, int ifindex, uint32_t queue)
+{
+    /* zero copy if the driver can, then copy mode which works everywhere. */
+    static const uint16_t bind_flags[] = {
+        XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+        XDP_COPY | XDP_USE_NEED_WAKEUP,
+        XDP_COPY,
+    };
+
+    for(size_t i = 0; i < sizeof(bind_flags)/sizeof(bind_flags[0]); i++) {
+        struct sockaddr_xdp addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sxdp_family = AF_XDP;
+        addr.sxdp_flags = bind_flags[i];
+        addr.sxdp_ifindex = (uint32_t)ifindex;
+        addr.sxdp_queue_id = queue;
+
+        if(bind(xdp->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            xdp->need_wakeup = (bind_flags[i] & XDP_USE_NEED_WAKEUP) != 0;
+
+            info("Bound AF_XDP socket to %s queue %u in %s mode.", xdp->ifname, queue, (bind_flags[i] & XDP_ZEROCOPY) ? "zero copy" : "copy");
+
+            return true;
+        }
+
+        detail("AF_XDP bind with flags %04x failed with error %d.", bind_flags[i], errno);
+    }
+
+    return false;
+}
+
+
+static status_t setup_socket(struct io_xdp_t *xdp, int ifindex, uint32_t queue)
+{
+    struct xdp_umem_reg reg;
+    struct xdp_mmap_offsets off;
+    socklen_t off_len = sizeof(off);
+    int tx_size = XDP_TX_RING_SIZE;
+    int cq_size = XDP_COMPLETION_RING_SIZE;
+    int fq_size = XDP_FILL_RING_SIZE;
+
+    if((xdp->fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        warn("Unable to open an AF_XDP socket, error %d!", errno);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    xdp->umem_len = (size_t)XDP_NUM_FRAMES * XDP_FRAME_SIZE;
+    xdp->umem = mmap(NULL, xdp->umem_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if(xdp->umem == MAP_FAILED) {
+        xdp->umem = NULL;
+        warn("Unable to allocate UMEM!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.addr = (uint64_t)(uintptr_t)xdp->umem;
+    reg.len = xdp->umem_len;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    reg.headroom = 0;
+
+    if(setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) != 0
+       || setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fq_size, sizeof(fq_size)) != 0
+       || setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &cq_size, sizeof(cq_size)) != 0
+       || setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &tx_size, sizeof(tx_size)) != 0) {
+        warn("Unable to set up the AF_XDP rings, error %d!", errno);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    if(getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) != 0) {
+        warn("Unable to get the AF_XDP ring offsets, error %d!", errno);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    if(!map_ring(xdp->fd, &(xdp->tx), &(off.tx), XDP_TX_RING_SIZE, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING)
+       || !map_ring(xdp->fd, &(xdp->completion), &(off.cr), XDP_COMPLETION_RING_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING)
+       || !map_ring(xdp->fd, &(xdp->fill), &(off.fr), XDP_FILL_RING_SIZE, sizeof(uint64_t), XDP_UMEM_PGOFF_FILL_RING)) {
+        warn("Unable to map the AF_XDP rings, error %d!", errno);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    if(!bind_socket(xdp, ifindex, queue)) {
+        warn("Unable to bind an AF_XDP socket to %s queue %u!", xdp->ifname, queue);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    xdp->tx_producer = __atomic_load_n(xdp->tx.producer, __ATOMIC_ACQUIRE);
+
+    for(uint32_t i = 0; i < XDP_NUM_FRAMES; i++) {
+        xdp->free_frames[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+
+    xdp->num_free = XDP_NUM_FRAMES;
+
+    return STATUS_OK;
+}
+
+
+struct io_xdp_t *io_xdp_create(const char *ifname, uint32_t queue, uint16_t src_port)
+{
+    status_t rc = STATUS_OK;
+    struct io_xdp_t *xdp = NULL;
+    int ifindex = 0;
+
+    info("Starting.");
+
+    do {
+        if(!ifname || !*ifname) {
+            warn("Called with a NULL or empty interface name!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(!(xdp = calloc(1, sizeof(*xdp)))) {
+            warn("Unable to allocate AF_XDP state!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        xdp->fd = -1;
+        xdp->src_port = htons(src_port);
+        snprintf(xdp->ifname, sizeof(xdp->ifname), "%s", ifname);
+
+        if(!get_if_info(xdp, ifname, &ifindex)) {
+            rc = STATUS_NOT_FOUND;
+            break;
+        }
+
+        rc = setup_socket(xdp, ifindex, queue);
+    } while(0);
+
+    if(rc != STATUS_OK && xdp) {
+        io_xdp_dispose(xdp);
+        xdp = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return xdp;
+}
+
+
+void io_xdp_dispose(struct io_xdp_t *xdp)
+{
+    if(!xdp) {
+        return;
+    }
+
+    if(xdp->fd >= 0) {
+        close(xdp->fd);
+    }
+
+    unmap_ring(&(xdp->tx));
+    unmap_ring(&(xdp->completion));
+    unmap_ring(&(xdp->fill));
+
+    if(xdp->umem) {
+        munmap(xdp->umem, xdp->umem_len);
+    }
+
+    free(xdp);
+}
+
+
+
+/*
+ * Next hop MAC addresses come from the kernel's routing and neighbour
+ * tables.  A miss is remembered for a while so an unresolved destination
+ * does not mean reading /proc on every packet.
+ */
+
+/*
+ * The address the kernel would send to for ip: ip itself when it is on a
+ * link, otherwise the route's gateway.  The longest matching prefix wins.
+ * Zero if there is no route, or if the best route leaves through another
+ * interface.  In that case the packet has no business on this one.
+ */
+static uint32_t read_next_hop(const char *ifname, uint32_t ip)
+{
+    FILE *f = fopen("/proc/net/route", "r");
+    char line[256];
+    bool found = false;
+    bool on_ifname = false;
+    uint32_t best_mask = 0;
+    uint32_t next_hop = 0;
+
+    if(!f) {
+        return 0;
+    }
+
+    /* skip the column headings. */
+    if(!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return 0;
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        char dev[IF_NAMESIZE + 1];
+        unsigned int dest = 0, gateway = 0, flags = 0, mask = 0;
+
+        /* the addresses are printed as the raw network order words, the same as s_addr. */
+        if(sscanf(line, "%16s %x %x %x %*d %*d %*d %x", dev, &dest, &gateway, &flags, &mask) != 5) {
+            continue;
+        }
+
+        /* 0x01 is RTF_UP. */
+        if(!(flags & 0x01) || (ip & mask) != dest) {
+            continue;
+        }
+
+        if(found && ntohl(mask) <= ntohl(best_mask)) {
+            continue;
+        }
+
+        found = true;
+        best_mask = mask;
+        on_ifname = (strcmp(dev, ifname) == 0);
+
+        /* 0x02 is RTF_GATEWAY. */
+        next_hop = ((flags & 0x02) ? (uint32_t)gateway : ip);
+    }
+
+    fclose(f);
+
+    return (on_ifname ? next_hop : 0);
+}
+
+
+static bool read_arp_table(const char *ifname, uint32_t ip, uint8_t *mac)
+{
+    FILE *f = fopen("/proc/net/arp", "r");
+    char line[256];
+    bool found = false;
+
+    if(!f) {
+        return false;
+    }
+
+    /* skip the column headings. */
+    if(!fgets(line, sizeof(line), f)) {
+        fclose(f);
+        return false;
+    }
+
+    while(!found && fgets(line, sizeof(line), f)) {
+        char ip_str[64], mac_str[32], dev[IF_NAMESIZE + 1];
+        unsigned int flags = 0;
+        unsigned int m[6];
+        struct in_addr addr;
+
+        if(sscanf(line, "%63s %*s %x %31s %*s %16s", ip_str, &flags, mac_str, dev) != 4) {
+            continue;
+        }
+
+        /* 0x02 is ATF_COM, a completed entry. */
+        if(!(flags & 0x02) || strcmp(dev, ifname) != 0 || inet_pton(AF_INET, ip_str, &addr) != 1 || addr.s_addr != ip) {
+            continue;
+        }
+
+        if(sscanf(mac_str, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2], &m[3], &m[4], &m[5]) == 6) {
+            for(int i = 0; i < 6; i++) {
+                mac[i] = (uint8_t)m[i];
+            }
+
+            found = true;
+        }
+    }
+
+    fclose(f);
+
+    return found;
+}
+
+
+static struct xdp_neighbor_t *find_neighbor(struct io_xdp_t *xdp, uint32_t ip)
+{
+    struct xdp_neighbor_t *n = NULL;
+    int64_t now_ns = 0;
+    uint32_t next_hop = 0;
+
+    for(uint32_t i = 0; i < xdp->num_neighbors; i++) {
+        if(xdp->neighbors[i].ip == ip) {
+            n = &(xdp->neighbors[i]);
+            break;
+        }
+    }
+
+    if(n && n->valid) {
+        return n;
+    }
+
+    now_ns = util_clock_now_ns();
+
+    if(!n) {
+        if(xdp->num_neighbors >= XDP_MAX_NEIGHBORS) {
+            return NULL;
+        }
+
+        n = &(xdp->neighbors[xdp->num_neighbors++]);
+        n->ip = ip;
+    } else if(now_ns - n->checked_ns < NEIGHBOR_RETRY_NS) {
+        return NULL;
+    }
+
+    n->checked_ns = now_ns;
+    next_hop = read_next_hop(xdp->ifname, ip);
+    n->valid = (next_hop != 0 && read_arp_table(xdp->ifname, next_hop, n->mac));
+
+    return (n->valid ? n : NULL);
+}
+
+
+
+static void reclaim_frames(struct io_xdp_t *xdp)
+{
+    uint32_t cons = *xdp->completion.consumer;
+    uint32_t prod = __atomic_load_n(xdp->completion.producer, __ATOMIC_ACQUIRE);
+    uint64_t *addrs = (uint64_t *)xdp->completion.descs;
+
+    while(cons != prod && xdp->num_free < XDP_NUM_FRAMES) {
+        xdp->free_frames[xdp->num_free++] = addrs[cons & xdp->completion.mask];
+        cons++;
+    }
+
+    __atomic_store_n(xdp->completion.consumer, cons, __ATOMIC_RELEASE);
+}
+
+
+static uint16_t ip_checksum(const uint8_t *header)
+{
+    uint32_t sum = 0;
+
+    for(int i = 0; i < IPV4_HEADER_SIZE; i += 2) {
+        sum += ((uint32_t)header[i] << 8) | header[i + 1];
+    }
+
+    while(sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return (uint16_t)~sum;
+}
+
+
+static void put_be16(uint8_t *p, uint16_t val)
+{
+    p[0] = (uint8_t)(val >> 8);
+    p[1] = (uint8_t)(val & 0xFF);
+}
+
+
+bool io_xdp_queue(struct io_xdp_t *xdp, const struct io_batch_entry_t *entry)
+{
+    struct xdp_neighbor_t *n = NULL;
+    struct xdp_desc *desc = NULL;
+    uint32_t cons = 0;
+    uint64_t frame_addr = 0;
+    uint8_t *frame = NULL;
+    uint8_t *ip = NULL;
+    uint8_t *udp = NULL;
+
+    if(!xdp || !entry) {
+        return false;
+    }
+
+    if(!(n = find_neighbor(xdp, entry->dest_ip))) {
+        return false;
+    }
+
+    if(xdp->num_free == 0) {
+        reclaim_frames(xdp);
+
+        if(xdp->num_free == 0) {
+            return false;
+        }
+    }
+
+    cons = __atomic_load_n(xdp->tx.consumer, __ATOMIC_ACQUIRE);
+    if(xdp->tx_producer - cons >= XDP_TX_RING_SIZE) {
+        return false;
+    }
+
+    frame_addr = xdp->free_frames[--xdp->num_free];
+    frame = xdp->umem + frame_addr;
+
+    memcpy(frame, n->mac, 6);
+    memcpy(frame + 6, xdp->src_mac, 6);
+    put_be16(frame + 12, 0x0800);
+
+    ip = frame + ETH_HEADER_SIZE;
+    ip[0] = 0x45;
+    ip[1] = 0;
+    put_be16(ip + 2, (uint16_t)(IPV4_HEADER_SIZE + UDP_HEADER_SIZE + entry->len));
+    put_be16(ip + 4, xdp->ip_id++);
+    put_be16(ip + 6, 0x4000);
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    put_be16(ip + 10, 0);
+    memcpy(ip + 12, &(xdp->src_ip), 4);
+    memcpy(ip + 16, &(entry->dest_ip), 4);
+    put_be16(ip + 10, ip_checksum(ip));
+
+    /* a zero UDP checksum means none, which IPv4 allows. */
+    udp = ip + IPV4_HEADER_SIZE;
+    memcpy(udp, &(xdp->src_port), 2);
+    memcpy(udp + 2, &(entry->dest_port), 2);
+    put_be16(udp + 4, (uint16_t)(UDP_HEADER_SIZE + entry->len));
+    put_be16(udp + 6, 0);
+
+    memcpy(frame + FRAME_HEADER_SIZE, entry->data, entry->len);
+
+    desc = &(((struct xdp_desc *)xdp->tx.descs)[xdp->tx_producer & xdp->tx.mask]);
+    desc->addr = frame_addr;
+    desc->len = (uint32_t)(FRAME_HEADER_SIZE + entry->len);
+    desc->options = 0;
+
+    xdp->tx_producer++;
+    xdp->num_queued++;
+
+    return true;
+}
+
+
+void io_xdp_flush(struct io_xdp_t *xdp)
+{
+    if(!xdp) {
+        return;
+    }
+
+    if(xdp->num_queued) {
+        __atomic_store_n(xdp->tx.producer, xdp->tx_producer, __ATOMIC_RELEASE);
+        xdp->num_queued = 0;
+
+        /* copy mode always needs the kick, zero copy only when the driver asks. */
+        if(!xdp->need_wakeup || (__atomic_load_n(xdp->tx.flags, __ATOMIC_ACQUIRE) & XDP_RING_NEED_WAKEUP)) {
+            if(sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+                detail("AF_XDP kick failed with error %d.", errno);
+            }
+        }
+    }
+
+    reclaim_frames(xdp);
+}
+
+
+#else /* AF_XDP not available. */
+
+
+struct io_xdp_t *io_xdp_create(const char *ifname, uint32_t queue, uint16_t src_port)
+{
+    (void)queue;
+    (void)src_port;
+
+    (void)ifname;
+
+    detail("AF_XDP support is not built in.");
+
+    return NULL;
+}
+
+
+void io_xdp_dispose(struct io_xdp_t *xdp)
+{
+    (void)xdp;
+}
+
+
+bool io_xdp_queue(struct io_xdp_t *xdp, const struct io_batch_entry_t *entry)
+{
+    (void)xdp;
+    (void)entry;
+
+    return false;
+}
+
+
+void io_xdp_flush(struct io_xdp_t *xdp)
+{
+    (void)xdp;
+}
+
+
+#endif
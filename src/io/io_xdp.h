@@ -0,0 +1,61 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/*
+ * AF_XDP transmit path for implicit I/O.
+ *
+ * The scheduler's packets are built into complete Ethernet/IPv4/UDP frames
+ * and put straight on a TX ring shared with the driver, skipping the socket
+ * layer, routing and neighbour lookup on every send.  Only transmit is done
+ * here, so no XDP program has to be loaded.
+ *
+ * This is only built with USE_AF_XDP (the ENABLE_AF_XDP CMake option) on
+ * Linux.  Otherwise, or if the socket cannot be set up, create returns NULL
+ * and the scheduler keeps using its UDP socket.  The next hop is looked up
+ * in the kernel's routing table, so scanners behind a router are reached
+ * through its gateway.  A packet whose next hop MAC address is not in the
+ * kernel's neighbour table yet, or whose route leaves through another
+ * interface, also goes through the UDP socket.  That makes the kernel
+ * resolve the neighbour.
+ *
+ * Only the kqueue proactor is complete in this tree, so the Linux build
+ * this path needs does not exist yet and it has not been run from here.
+ *
+ * A veth pair is enough to try it:
+ *
+ *   ip link add xdp0 type veth peer name xdp1
+ *   ip addr add 10.9.0.1/24 dev xdp0 && ip link set xdp0 up
+ *   ip addr add 10.9.0.2/24 dev xdp1 && ip link set xdp1 up
+ *   tag_sim --io-xdp=xdp0 ...
+ */
+
+struct io_batch_entry_t;
+struct io_xdp_t;
+
+
+extern struct io_xdp_t *io_xdp_create(const char *ifname, uint32_t queue, uint16_t src_port);
+extern void io_xdp_dispose(struct io_xdp_t *xdp);
+
+/* false if the packet was not queued and must go out another way. */
+extern bool io_xdp_queue(struct io_xdp_t *xdp, const struct io_batch_entry_t *entry);
+
+/* tell the driver about queued packets and reclaim completed frames. */
+extern void io_xdp_flush(struct io_xdp_t *xdp);
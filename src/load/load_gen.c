@@ -0,0 +1,1133 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <sys/socket.h>
+#endif
+
+#include "cip/cip.h"
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "load/load_gen.h"
+#include "tags/tag.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/proactor_net.h"
+#include "util/time_utils.h"
+
+
+#define LOAD_TICK_MS (1)
+#define LOAD_DRAIN_NS ((int64_t)2000000000)
+
+/* the largest framed request, checked against the MSP size at setup. */
+#define LOAD_MAX_REQUEST_SIZE (1024)
+
+#define CPF_PREFIX_SIZE (EIP_ENCAP_HEADER_SIZE + 4 + 2 + 2)
+#define CONNECTION_SIZE (504)
+
+
+static const char *op_names[LOAD_NUM_OPS] = { "read", "write", "msp", "frag" };
+
+
+
+void load_config_init(struct load_config_t *config)
+{
+    if(!config) {
+        return;
+    }
+
+    memset(config, 0, sizeof(*config));
+
+    snprintf(config->address, sizeof(config->address), "127.0.0.1");
+    config->port = EIP_DEFAULT_PORT;
+    config->num_sessions = 10;
+    config->num_loops = 1;
+    config->rate = 1000.0;
+    config->duration_s = 10.0;
+    config->warmup_s = 2.0;
+    config->weights[LOAD_OP_READ] = 1;
+    snprintf(config->tag_name, sizeof(config->tag_name), "TestDINT");
+    snprintf(config->array_name, sizeof(config->array_name), "TestBigArray");
+    config->array_elems = 1000;
+    config->msp_count = 10;
+}
+
+
+/* "read:60,write:20,msp:10,frag:10", ops that are left out get no weight. */
+status_t load_config_set_mix(struct load_config_t *config, const char *spec)
+{
+    uint32_t weights[LOAD_NUM_OPS] = {0};
+    uint32_t total = 0;
+    const char *p = spec;
+
+    if(!config || !spec) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    while(*p) {
+        const char *colon = strchr(p, ':');
+        const char *comma = strchr(p, ',');
+        char *end = NULL;
+        int op = 0;
+
+        if(!colon || (comma && comma < colon)) {
+            warn("Mix entry in \"%s\" needs an op and a weight!", spec);
+            return STATUS_BAD_INPUT;
+        }
+
+        for(op = 0; op < LOAD_NUM_OPS; op++) {
+            if(strlen(op_names[op]) == (size_t)(colon - p) && strncmp(op_names[op], p, (size_t)(colon - p)) == 0) {
+                break;
+            }
+        }
+
+        if(op == LOAD_NUM_OPS) {
+            warn("Unknown op in mix \"%s\"!", spec);
+            return STATUS_BAD_INPUT;
+        }
+
+        weights[op] = (uint32_t)strtoul(colon + 1, &end, 10);
+        total += weights[op];
+
+        p = (*end == ',' ? end + 1 : end);
+
+        if(*end && *end != ',') {
+            warn("Bad weight in mix \"%s\"!", spec);
+            return STATUS_BAD_INPUT;
+        }
+    }
+
+    if(total == 0) {
+        warn("Mix \"%s\" has no weight at all!", spec);
+        return STATUS_BAD_INPUT;
+    }
+
+    memcpy(config->weights, weights, sizeof(weights));
+
+    return STATUS_OK;
+}
+
+
+
+/*
+ * Request encoding.
+ */
+
+/* an ANSI symbolic segment, padded to a whole word. */
+static size_t encode_symbol(uint8_t *buf, const char *name)
+{
+    size_t name_len = strlen(name);
+    size_t len = 0;
+
+    buf[len++] = 0x91;
+    buf[len++] = (uint8_t)name_len;
+    memcpy(buf + len, name, name_len);
+    len += name_len;
+
+    if(len & 1) {
+        buf[len++] = 0;
+    }
+
+    return len;
+}
+
+
+static size_t encode_read(uint8_t *buf, const char *name, uint16_t elem_count)
+{
+    size_t path_len = encode_symbol(buf + 2, name);
+
+    buf[0] = CIP_SRV_READ_TAG;
+    buf[1] = (uint8_t)(path_len / 2);
+    encode_uint16_le(buf + 2 + path_len, elem_count);
+
+    return 2 + path_len + 2;
+}
+
+
+static size_t encode_write(uint8_t *buf, const char *name, uint32_t value)
+{
+    size_t path_len = encode_symbol(buf + 2, name);
+    size_t len = 2 + path_len;
+
+    buf[0] = CIP_SRV_WRITE_TAG;
+    buf[1] = (uint8_t)(path_len / 2);
+    encode_uint16_le(buf + len, TAG_TYPE_DINT);
+    encode_uint16_le(buf + len + 2, 1);
+    encode_uint32_le(buf + len + 4, value);
+
+    return len + 8;
+}
+
+
+/* several reads of the same tag through the Message Router. */
+static size_t encode_msp(uint8_t *buf, const char *name, uint32_t count)
+{
+    size_t header_len = 6 + 2 + (2 * (size_t)count);
+    size_t len = header_len;
+
+    buf[0] = CIP_SRV_MULTIPLE_SERVICE;
+    buf[1] = 2;
+    buf[2] = 0x20;
+    buf[3] = 0x02;
+    buf[4] = 0x24;
+    buf[5] = 0x01;
+    encode_uint16_le(buf + 6, (uint16_t)count);
+
+    for(uint32_t i = 0; i < count; i++) {
+        /* offsets count from the service count. */
+        encode_uint16_le(buf + 8 + (2 * i), (uint16_t)(len - 6));
+        len += encode_read(buf + len, name, 1);
+    }
+
+    return len;
+}
+
+
+static uint64_t next_random(struct load_session_t *session)
+{
+    /* xorshift64 */
+    session->rng ^= session->rng << 13;
+    session->rng ^= session->rng >> 7;
+    session->rng ^= session->rng << 17;
+
+    return session->rng;
+}
+
+
+static load_op_t pick_op(struct load_session_t *session)
+{
+    const struct load_config_t *config = &(session->loop->gen->config);
+    uint32_t total = 0;
+    uint32_t pick = 0;
+
+    for(int op = 0; op < LOAD_NUM_OPS; op++) {
+        total += config->weights[op];
+    }
+
+    pick = (uint32_t)(next_random(session) % total);
+
+    for(int op = 0; op < LOAD_NUM_OPS; op++) {
+        if(pick < config->weights[op]) {
+            return (load_op_t)op;
+        }
+
+        pick -= config->weights[op];
+    }
+
+    return LOAD_OP_READ;
+}
+
+
+static void encode_encap(uint8_t *buf, uint16_t command, size_t payload_len, uint32_t session_handle)
+{
+    memset(buf, 0, EIP_ENCAP_HEADER_SIZE);
+
+    encode_uint16_le(buf, command);
+    encode_uint16_le(buf + 2, (uint16_t)payload_len);
+    encode_uint32_le(buf + 4, session_handle);
+}
+
+
+/* wrap a CIP request in SendRRData or, once connected, SendUnitData. */
+static size_t encode_frame(struct load_session_t *session, uint8_t *buf, const uint8_t *cip, size_t cip_len)
+{
+    size_t len = CPF_PREFIX_SIZE;
+
+    memset(buf + EIP_ENCAP_HEADER_SIZE, 0, CPF_PREFIX_SIZE - EIP_ENCAP_HEADER_SIZE);
+    encode_uint16_le(buf + CPF_PREFIX_SIZE - 2, 2);
+
+    if(session->state == LOAD_SESSION_RUNNING && session->loop->gen->config.connected) {
+        encode_uint16_le(buf + len, CPF_ITEM_CONNECTED_ADDRESS);
+        encode_uint16_le(buf + len + 2, 4);
+        encode_uint32_le(buf + len + 4, session->conn_id);
+        encode_uint16_le(buf + len + 8, CPF_ITEM_CONNECTED_DATA);
+        encode_uint16_le(buf + len + 10, (uint16_t)(cip_len + 2));
+        encode_uint16_le(buf + len + 12, ++session->conn_seq);
+        len += 14;
+
+        encode_encap(buf, EIP_CMD_SEND_UNIT_DATA, len + cip_len - EIP_ENCAP_HEADER_SIZE, session->session_handle);
+    } else {
+        encode_uint16_le(buf + len, CPF_ITEM_NULL_ADDRESS);
+        encode_uint16_le(buf + len + 2, 0);
+        encode_uint16_le(buf + len + 4, CPF_ITEM_UNCONNECTED_DATA);
+        encode_uint16_le(buf + len + 6, (uint16_t)cip_len);
+        len += 8;
+
+        encode_encap(buf, EIP_CMD_SEND_RR_DATA, len + cip_len - EIP_ENCAP_HEADER_SIZE, session->session_handle);
+    }
+
+    memcpy(buf + len, cip, cip_len);
+
+    return len + cip_len;
+}
+
+
+static size_t encode_op(struct load_session_t *session, load_op_t op, uint8_t *buf)
+{
+    const struct load_config_t *config = &(session->loop->gen->config);
+    uint8_t cip[LOAD_MAX_REQUEST_SIZE];
+    size_t cip_len = 0;
+
+    switch(op) {
+        case LOAD_OP_WRITE:
+            cip_len = encode_write(cip, config->tag_name, (uint32_t)next_random(session));
+            break;
+
+        case LOAD_OP_MSP:
+            cip_len = encode_msp(cip, config->tag_name, config->msp_count);
+            break;
+
+        case LOAD_OP_FRAG:
+            /* more than fits in one reply, the device answers with partial data. */
+            cip_len = encode_read(cip, config->array_name, config->array_elems);
+            break;
+
+        case LOAD_OP_READ:
+        default:
+            cip_len = encode_read(cip, config->tag_name, 1);
+            break;
+    }
+
+    return encode_frame(session, buf, cip, cip_len);
+}
+
+
+static size_t encode_forward_open(struct load_session_t *session, uint8_t *buf)
+{
+    uint8_t cip[64] = {0};
+    size_t len = 0;
+
+    cip[len++] = EIP_CM_SRV_FORWARD_OPEN;
+    cip[len++] = 2;
+    cip[len++] = 0x20;
+    cip[len++] = 0x06;
+    cip[len++] = 0x24;
+    cip[len++] = 0x01;
+
+    /* priority/tick time and timeout ticks. */
+    cip[len++] = 0x0A;
+    cip[len++] = 0x0E;
+
+    /* O->T ID is picked by the target. */
+    encode_uint32_le(cip + len, 0);
+    len += 4;
+    encode_uint32_le(cip + len, (uint32_t)next_random(session));
+    len += 4;
+
+    /* connection serial, vendor and originator serial make the connection unique. */
+    encode_uint16_le(cip + len, (uint16_t)session->index);
+    len += 2;
+    encode_uint16_le(cip + len, 0xF00D);
+    len += 2;
+    encode_uint32_le(cip + len, 0x10000000 + (session->index >> 16));
+    len += 4;
+
+    cip[len++] = 1;
+    len += 3;
+
+    encode_uint32_le(cip + len, 2000000);
+    len += 4;
+    encode_uint16_le(cip + len, 0x4200 | CONNECTION_SIZE);
+    len += 2;
+    encode_uint32_le(cip + len, 2000000);
+    len += 4;
+    encode_uint16_le(cip + len, 0x4200 | CONNECTION_SIZE);
+    len += 2;
+
+    /* class 3, application triggered, then the path to the Message Router. */
+    cip[len++] = 0xA3;
+    cip[len++] = 2;
+    cip[len++] = 0x20;
+    cip[len++] = 0x02;
+    cip[len++] = 0x24;
+    cip[len++] = 0x01;
+
+    return encode_frame(session, buf, cip, len);
+}
+
+
+
+/*
+ * Sessions.
+ */
+
+static void close_session(struct load_session_t *session)
+{
+    if(session->state == LOAD_SESSION_CLOSED) {
+        return;
+    }
+
+    session->state = LOAD_SESSION_CLOSED;
+    session->loop->num_closed++;
+
+    if(session->socket) {
+        proactor_net_socket_close(session->socket);
+        session->socket = NULL;
+    }
+}
+
+
+static void fail_session(struct load_session_t *session, const char *what, status_t rc)
+{
+    warn("Session %u failed %s with error %s!", session->index, what, status_to_str(rc));
+
+    session->loop->stats.session_failures++;
+
+    close_session(session);
+}
+
+
+static void flush_queue(struct load_session_t *session)
+{
+    uint8_t *data = NULL;
+
+    if(session->sending || session->queue_len == 0 || session->state == LOAD_SESSION_CLOSED) {
+        return;
+    }
+
+    /* swap the buffers so building can carry on while this goes out. */
+    data = session->queue_data;
+    session->queue_data = session->send_data;
+    session->send_data = data;
+
+    session->tx_buf.data = session->send_data;
+    session->tx_buf.data_length = session->queue_len;
+    session->queue_len = 0;
+    session->sending = true;
+
+    if(proactor_net_start_send(session->socket, &(session->tx_buf)) != STATUS_OK) {
+        fail_session(session, "sending", STATUS_EXTERNAL_FAILURE);
+    }
+}
+
+
+/* queue every request that has come due. */
+static void schedule_requests(struct load_session_t *session, int64_t now_ns)
+{
+    struct load_gen_t *gen = session->loop->gen;
+
+    while(session->next_due_ns <= now_ns && session->next_due_ns < gen->end_ns) {
+        struct load_pending_t *pending = NULL;
+        load_op_t op = LOAD_OP_READ;
+
+        /* out of room, these go out late and their latency shows it. */
+        if(session->pending_head - session->pending_tail >= LOAD_MAX_IN_FLIGHT) {
+            break;
+        }
+
+        if(sizeof(session->tx_data[0]) - session->queue_len < LOAD_MAX_REQUEST_SIZE) {
+            break;
+        }
+
+        op = pick_op(session);
+
+        pending = &(session->pending[session->pending_head % LOAD_MAX_IN_FLIGHT]);
+        pending->due_ns = session->next_due_ns;
+        pending->op = (uint8_t)op;
+        pending->measured = (session->next_due_ns >= gen->measure_ns);
+        session->pending_head++;
+
+        if(pending->measured) {
+            session->loop->stats.sent[op]++;
+        }
+
+        session->queue_len += encode_op(session, op, session->queue_data + session->queue_len);
+        session->next_due_ns += session->interval_ns;
+    }
+
+    flush_queue(session);
+}
+
+
+/* where the CIP reply starts in a SendRRData or SendUnitData reply, zero if it is not there. */
+static size_t cip_reply_offset(const uint8_t *frame, size_t len)
+{
+    size_t offset = CPF_PREFIX_SIZE;
+    uint16_t item_count = 0;
+
+    if(len < offset) {
+        return 0;
+    }
+
+    item_count = decode_uint16_le(frame + offset - 2);
+
+    for(uint16_t i = 0; i < item_count && offset + 4 <= len; i++) {
+        uint16_t type = decode_uint16_le(frame + offset);
+        uint16_t size = decode_uint16_le(frame + offset + 2);
+
+        offset += 4;
+
+        if(type == CPF_ITEM_UNCONNECTED_DATA && size >= 4 && offset + 4 <= len) {
+            return offset;
+        }
+
+        if(type == CPF_ITEM_CONNECTED_DATA && size >= 6 && offset + 6 <= len) {
+            return offset + 2;
+        }
+
+        offset += size;
+    }
+
+    return 0;
+}
+
+
+/* the device may answer a Multiple Service Packet with success even when embedded services failed. */
+static bool msp_reply_ok(const uint8_t *reply, size_t len)
+{
+    const uint8_t *data = reply + 4;
+    size_t data_len = len - 4;
+    uint16_t count = 0;
+
+    if(len < 6) {
+        return false;
+    }
+
+    count = decode_uint16_le(data);
+
+    if(data_len < 2 + (2 * (size_t)count)) {
+        return false;
+    }
+
+    for(uint16_t i = 0; i < count; i++) {
+        size_t offset = decode_uint16_le(data + 2 + (2 * i));
+
+        if(offset + 4 > data_len || data[offset + 2] != CIP_STATUS_OK) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static void handle_data_reply(struct load_session_t *session, const uint8_t *frame, size_t len, int64_t now_ns)
+{
+    struct load_stats_t *stats = &(session->loop->stats);
+    struct load_pending_t *pending = NULL;
+    size_t cip = 0;
+    bool ok = false;
+
+    if(session->pending_head == session->pending_tail) {
+        warn("Session %u got a reply it did not ask for!", session->index);
+        return;
+    }
+
+    pending = &(session->pending[session->pending_tail % LOAD_MAX_IN_FLIGHT]);
+    session->pending_tail++;
+
+    if(decode_uint32_le(frame + 8) == EIP_STATUS_SUCCESS && (cip = cip_reply_offset(frame, len))) {
+        uint8_t general_status = frame[cip + 2];
+
+        ok = (general_status == CIP_STATUS_OK || (pending->op == LOAD_OP_FRAG && general_status == CIP_STATUS_PARTIAL_DATA));
+
+        if(ok && pending->op == LOAD_OP_MSP) {
+            ok = msp_reply_ok(frame + cip, len - cip);
+        }
+    }
+
+    if(!pending->measured) {
+        return;
+    }
+
+    histogram_record(&(stats->latency[pending->op]), (uint64_t)(now_ns - pending->due_ns));
+    stats->completed[pending->op]++;
+
+    if(!ok) {
+        stats->errors[pending->op]++;
+    }
+}
+
+
+static void start_running(struct load_session_t *session)
+{
+    session->state = LOAD_SESSION_RUNNING;
+    schedule_requests(session, util_clock_now_ns());
+}
+
+
+static void handle_reply(struct load_session_t *session, const uint8_t *frame, size_t len, int64_t now_ns)
+{
+    uint16_t command = decode_uint16_le(frame);
+    uint32_t status = decode_uint32_le(frame + 8);
+
+    switch(session->state) {
+        case LOAD_SESSION_REGISTERING:
+            if(command != EIP_CMD_REGISTER_SESSION || status != EIP_STATUS_SUCCESS) {
+                fail_session(session, "registering", STATUS_NOT_ALLOWED);
+                return;
+            }
+
+            session->session_handle = decode_uint32_le(frame + 4);
+
+            if(session->loop->gen->config.connected) {
+                session->state = LOAD_SESSION_OPENING;
+                session->queue_len = encode_forward_open(session, session->queue_data);
+                flush_queue(session);
+            } else {
+                start_running(session);
+            }
+
+            break;
+
+        case LOAD_SESSION_OPENING: {
+                size_t cip = cip_reply_offset(frame, len);
+
+                if(status != EIP_STATUS_SUCCESS || !cip || cip + 8 > len || frame[cip] != (EIP_CM_SRV_FORWARD_OPEN | CIP_SRV_RESPONSE) || frame[cip + 2] != CIP_STATUS_OK) {
+                    fail_session(session, "opening a connection", STATUS_NOT_ALLOWED);
+                    return;
+                }
+
+                session->conn_id = decode_uint32_le(frame + cip + 4);
+                start_running(session);
+            }
+
+            break;
+
+        case LOAD_SESSION_RUNNING:
+            handle_data_reply(session, frame, len, now_ns);
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+static status_t start_receive(struct load_session_t *session)
+{
+    session->rx_buf.data = session->rx_data + session->rx_len;
+    session->rx_buf.data_length = sizeof(session->rx_data) - session->rx_len;
+
+    return proactor_net_start_receive(session->socket, &(session->rx_buf));
+}
+
+
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct load_session_t *session = (struct load_session_t *)sock_data;
+    int64_t now_ns = util_clock_now_ns();
+    size_t offset = 0;
+
+    if(status != STATUS_OK) {
+        fail_session(session, "receiving", status);
+        return status;
+    }
+
+    session->rx_len += buffer->data_length;
+
+    /* handle every whole frame, then move what is left down once. */
+    while(session->rx_len - offset >= EIP_ENCAP_HEADER_SIZE && session->state != LOAD_SESSION_CLOSED) {
+        size_t frame_len = EIP_ENCAP_HEADER_SIZE + decode_uint16_le(session->rx_data + offset + 2);
+
+        if(frame_len > EIP_MAX_PACKET_SIZE) {
+            fail_session(session, "framing", STATUS_BAD_INPUT);
+            return STATUS_OK;
+        }
+
+        if(frame_len > session->rx_len - offset) {
+            break;
+        }
+
+        handle_reply(session, session->rx_data + offset, frame_len, now_ns);
+        offset += frame_len;
+    }
+
+    if(session->state == LOAD_SESSION_CLOSED) {
+        return STATUS_OK;
+    }
+
+    memmove(session->rx_data, session->rx_data + offset, session->rx_len - offset);
+    session->rx_len -= offset;
+
+    if(start_receive(session) != STATUS_OK) {
+        fail_session(session, "receiving", STATUS_EXTERNAL_FAILURE);
+    }
+
+    return STATUS_OK;
+}
+
+
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct load_session_t *session = (struct load_session_t *)sock_data;
+
+    session->sending = false;
+
+    if(status != STATUS_OK) {
+        fail_session(session, "sending", status);
+        return status;
+    }
+
+    flush_queue(session);
+
+    return STATUS_OK;
+}
+
+
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data)
+{
+    struct load_session_t *session = (struct load_session_t *)sock_data;
+
+    proactor_net_socket_close(socket);
+    session->socket = NULL;
+
+    if(session->state != LOAD_SESSION_CLOSED) {
+        fail_session(session, "when the server closed it", status);
+    }
+
+    return STATUS_OK;
+}
+
+
+static void open_session(struct load_session_t *session)
+{
+    struct load_gen_t *gen = session->loop->gen;
+    status_t rc = STATUS_OK;
+
+    rc = proactor_net_socket_open(session->loop->proactor, &(session->socket), PROACTOR_SOCK_TCP_CLIENT, gen->config.address, gen->config.port, session, session->loop);
+    if(rc != STATUS_OK) {
+        session->socket = NULL;
+        fail_session(session, "connecting", rc);
+        return;
+    }
+
+    proactor_net_socket_set_receive_callback(session->socket, on_receive);
+    proactor_net_socket_set_sent_callback(session->socket, on_sent);
+    proactor_net_socket_set_close_callback(session->socket, on_close);
+
+    if((rc = start_receive(session)) != STATUS_OK) {
+        fail_session(session, "receiving", rc);
+        return;
+    }
+
+    session->state = LOAD_SESSION_REGISTERING;
+
+    encode_encap(session->queue_data, EIP_CMD_REGISTER_SESSION, 4, 0);
+    encode_uint16_le(session->queue_data + EIP_ENCAP_HEADER_SIZE, EIP_PROTOCOL_VERSION);
+    encode_uint16_le(session->queue_data + EIP_ENCAP_HEADER_SIZE + 2, 0);
+    session->queue_len = EIP_ENCAP_HEADER_SIZE + 4;
+
+    flush_queue(session);
+}
+
+
+/* anything still in flight at the end counts as a timeout, with the latency it has so far. */
+static void count_unanswered(struct load_session_t *session, int64_t now_ns)
+{
+    struct load_stats_t *stats = &(session->loop->stats);
+
+    while(session->pending_tail != session->pending_head) {
+        struct load_pending_t *pending = &(session->pending[session->pending_tail % LOAD_MAX_IN_FLIGHT]);
+
+        if(pending->measured) {
+            histogram_record(&(stats->latency[pending->op]), (uint64_t)(now_ns - pending->due_ns));
+            stats->timeouts[pending->op]++;
+        }
+
+        session->pending_tail++;
+    }
+
+    /* owed but never sent, just as late. */
+    while(session->next_due_ns < session->loop->gen->end_ns) {
+        if(session->next_due_ns >= session->loop->gen->measure_ns) {
+            histogram_record(&(stats->latency[LOAD_OP_READ]), (uint64_t)(now_ns - session->next_due_ns));
+            stats->timeouts[LOAD_OP_READ]++;
+        }
+
+        session->next_due_ns += session->interval_ns;
+    }
+}
+
+
+static status_t on_proactor_event(struct proactor_t *proactor, proactor_event_t event, status_t status, void *app_data)
+{
+    struct load_loop_t *loop = (struct load_loop_t *)app_data;
+    struct load_gen_t *gen = loop->gen;
+    int64_t now_ns = 0;
+    bool drained = true;
+
+    if(event != PROACTOR_EVENT_TICK && event != PROACTOR_EVENT_TIMEOUT) {
+        return STATUS_OK;
+    }
+
+    now_ns = util_clock_now_ns();
+
+    for(uint32_t i = 0; i < loop->num_sessions; i++) {
+        struct load_session_t *session = &(loop->sessions[i]);
+
+        if(session->state == LOAD_SESSION_IDLE) {
+            open_session(session);
+        } else if(session->state == LOAD_SESSION_RUNNING) {
+            schedule_requests(session, now_ns);
+        }
+
+        if(session->state != LOAD_SESSION_CLOSED && (session->pending_head != session->pending_tail || session->next_due_ns < gen->end_ns)) {
+            drained = false;
+        }
+    }
+
+    if(now_ns < gen->end_ns || (!drained && now_ns < gen->end_ns + LOAD_DRAIN_NS)) {
+        return STATUS_OK;
+    }
+
+    for(uint32_t i = 0; i < loop->num_sessions; i++) {
+        count_unanswered(&(loop->sessions[i]), now_ns);
+        close_session(&(loop->sessions[i]));
+    }
+
+    proactor_net_stop(proactor);
+
+    return STATUS_OK;
+}
+
+
+
+/*
+ * Setup and results.
+ */
+
+struct load_gen_t *load_gen_create(const struct load_config_t *config)
+{
+    status_t rc = STATUS_OK;
+    struct load_gen_t *gen = NULL;
+    uint32_t per_loop = 0;
+    uint32_t session_index = 0;
+
+    info("Starting.");
+
+    do {
+        if(!config) {
+            warn("Called with a NULL config pointer!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(config->num_sessions == 0 || config->num_loops == 0 || config->num_loops > LOAD_MAX_LOOPS || config->rate <= 0.0 || config->duration_s <= 0.0) {
+            warn("Need at least one session and loop, at most %d loops, and a positive rate and duration!", LOAD_MAX_LOOPS);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        if(config->msp_count == 0 || config->msp_count > LOAD_MAX_MSP_COUNT) {
+            warn("Multiple Service Packets need between 1 and %d reads!", LOAD_MAX_MSP_COUNT);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        if(strlen(config->tag_name) == 0 || strlen(config->array_name) == 0) {
+            warn("Tag names cannot be empty!");
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        /* each embedded read is an offset, service, path size, path and element count. */
+        if(CPF_PREFIX_SIZE + 14 + 8 + config->msp_count * (2 + 2 + 2 + strlen(config->tag_name) + 1 + 2) > LOAD_MAX_REQUEST_SIZE) {
+            warn("%u reads of %s do not fit in one Multiple Service Packet!", config->msp_count, config->tag_name);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        if(!(gen = calloc(1, sizeof(*gen)))) {
+            warn("Unable to allocate the load generator!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        gen->config = *config;
+        gen->num_loops = (config->num_loops > config->num_sessions ? config->num_sessions : config->num_loops);
+        per_loop = (config->num_sessions + gen->num_loops - 1) / gen->num_loops;
+
+        for(uint32_t l = 0; l < gen->num_loops && rc == STATUS_OK; l++) {
+            struct load_loop_t *loop = &(gen->loops[l]);
+
+            loop->gen = gen;
+            loop->num_sessions = (config->num_sessions - session_index < per_loop ? config->num_sessions - session_index : per_loop);
+
+            if(!(loop->sessions = calloc(loop->num_sessions, sizeof(*(loop->sessions))))) {
+                warn("Unable to allocate %u sessions!", loop->num_sessions);
+                rc = STATUS_NO_RESOURCE;
+                break;
+            }
+
+            if(!(loop->proactor = proactor_net_create(on_proactor_event, NULL, loop, LOAD_TICK_MS))) {
+                warn("Unable to create proactor for loop %u!", l);
+                rc = STATUS_SETUP_FAILURE;
+                break;
+            }
+
+            for(uint32_t i = 0; i < loop->num_sessions; i++) {
+                struct load_session_t *session = &(loop->sessions[i]);
+
+                session->loop = loop;
+                session->index = session_index++;
+                session->rng = 0x9E3779B97F4A7C15ULL ^ ((uint64_t)session->index * 0xBF58476D1CE4E5B9ULL);
+                session->queue_data = session->tx_data[0];
+                session->send_data = session->tx_data[1];
+                session->interval_ns = (int64_t)(1000000000.0 * (double)config->num_sessions / config->rate);
+
+                if(session->interval_ns <= 0) {
+                    session->interval_ns = 1;
+                }
+            }
+        }
+    } while(0);
+
+    if(rc != STATUS_OK) {
+        load_gen_dispose(gen);
+        gen = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return gen;
+}
+
+
+void load_gen_dispose(struct load_gen_t *gen)
+{
+    if(!gen) {
+        return;
+    }
+
+    for(uint32_t l = 0; l < gen->num_loops; l++) {
+        if(gen->loops[l].proactor) {
+            proactor_net_dispose(gen->loops[l].proactor);
+        }
+
+        free(gen->loops[l].sessions);
+    }
+
+    free(gen);
+}
+
+
+static void *loop_thread_func(void *arg)
+{
+    struct load_loop_t *loop = (struct load_loop_t *)arg;
+
+    proactor_net_run(loop->proactor);
+
+    return NULL;
+}
+
+
+static void merge_stats(struct load_stats_t *dest, const struct load_stats_t *src)
+{
+    for(int op = 0; op < LOAD_NUM_OPS; op++) {
+        dest->sent[op] += src->sent[op];
+        dest->completed[op] += src->completed[op];
+        dest->errors[op] += src->errors[op];
+        dest->timeouts[op] += src->timeouts[op];
+        histogram_merge(&(dest->latency[op]), &(src->latency[op]));
+    }
+
+    dest->session_failures += src->session_failures;
+}
+
+
+status_t load_gen_run(struct load_gen_t *gen)
+{
+    status_t rc = STATUS_OK;
+    uint32_t started = 0;
+
+    info("Starting.");
+
+    do {
+        if(!gen) {
+            warn("Called with a NULL load generator pointer!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        gen->start_ns = util_clock_ns();
+        gen->measure_ns = gen->start_ns + (int64_t)(gen->config.warmup_s * 1000000000.0);
+        gen->end_ns = gen->measure_ns + (int64_t)(gen->config.duration_s * 1000000000.0);
+
+        /* spread the first requests evenly over one interval. */
+        for(uint32_t l = 0; l < gen->num_loops; l++) {
+            for(uint32_t i = 0; i < gen->loops[l].num_sessions; i++) {
+                struct load_session_t *session = &(gen->loops[l].sessions[i]);
+
+                session->next_due_ns = gen->start_ns + (session->interval_ns * session->index) / gen->config.num_sessions;
+            }
+        }
+
+        for(started = 0; started < gen->num_loops; started++) {
+            if(!THREAD_CREATE(gen->loops[started].thread, loop_thread_func, &(gen->loops[started]))) {
+                warn("Unable to start loop thread %u!", started);
+                rc = STATUS_SETUP_FAILURE;
+                break;
+            }
+        }
+
+        if(rc != STATUS_OK) {
+            for(uint32_t l = 0; l < started; l++) {
+                proactor_net_stop(gen->loops[l].proactor);
+                proactor_net_wake(gen->loops[l].proactor);
+            }
+        }
+
+        for(uint32_t l = 0; l < started; l++) {
+            THREAD_JOIN(gen->loops[l].thread);
+            merge_stats(&(gen->totals), &(gen->loops[l].stats));
+        }
+    } while(0);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+
+struct op_summary_t {
+    const char *name;
+    uint64_t sent;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t timeouts;
+    const struct histogram_t *latency;
+};
+
+
+#define NUM_PERCENTILES (5)
+
+static const double percentiles[NUM_PERCENTILES] = { 50.0, 90.0, 99.0, 99.9, 99.99 };
+static const char *percentile_names[NUM_PERCENTILES] = { "p50", "p90", "p99", "p999", "p9999" };
+
+
+static void summarize(struct load_gen_t *gen, struct op_summary_t *rows, struct histogram_t *all)
+{
+    const struct load_stats_t *totals = &(gen->totals);
+
+    histogram_reset(all);
+
+    for(int op = 0; op < LOAD_NUM_OPS; op++) {
+        rows[op].name = op_names[op];
+        rows[op].sent = totals->sent[op];
+        rows[op].completed = totals->completed[op];
+        rows[op].errors = totals->errors[op];
+        rows[op].timeouts = totals->timeouts[op];
+        rows[op].latency = &(totals->latency[op]);
+
+        rows[LOAD_NUM_OPS].sent += totals->sent[op];
+        rows[LOAD_NUM_OPS].completed += totals->completed[op];
+        rows[LOAD_NUM_OPS].errors += totals->errors[op];
+        rows[LOAD_NUM_OPS].timeouts += totals->timeouts[op];
+
+        histogram_merge(all, &(totals->latency[op]));
+    }
+
+    rows[LOAD_NUM_OPS].name = "all";
+    rows[LOAD_NUM_OPS].latency = all;
+}
+
+
+void load_gen_report(struct load_gen_t *gen, FILE *out, load_format_t format)
+{
+    struct op_summary_t rows[LOAD_NUM_OPS + 1];
+    struct histogram_t *all = NULL;
+    double window_s = 0.0;
+
+    if(!gen || !out) {
+        return;
+    }
+
+    if(!(all = calloc(1, sizeof(*all)))) {
+        warn("Unable to allocate the summary histogram!");
+        return;
+    }
+
+    memset(rows, 0, sizeof(rows));
+    summarize(gen, rows, all);
+
+    window_s = gen->config.duration_s;
+
+    if(format == LOAD_FORMAT_JSON) {
+        fprintf(out, "{\n  \"sessions\": %u,\n  \"loops\": %u,\n  \"target_rate\": %.1f,\n  \"duration_s\": %.3f,\n  \"warmup_s\": %.3f,\n  \"connected\": %s,\n  \"session_failures\": %llu,\n  \"ops\": [\n",
+                gen->config.num_sessions, gen->num_loops, gen->config.rate, window_s, gen->config.warmup_s,
+                (gen->config.connected ? "true" : "false"), (unsigned long long)gen->totals.session_failures);
+    } else if(format == LOAD_FORMAT_CSV) {
+        fprintf(out, "op,sent,completed,errors,timeouts,throughput_per_s,mean_us");
+
+        for(int p = 0; p < NUM_PERCENTILES; p++) {
+            fprintf(out, ",%s_us", percentile_names[p]);
+        }
+
+        fprintf(out, ",max_us\n");
+    } else {
+        fprintf(out, "%u sessions on %u loops, target %.1f requests/s for %.1f s after %.1f s warm up, %s messaging.  %llu session failures.\n",
+                gen->config.num_sessions, gen->num_loops, gen->config.rate, window_s, gen->config.warmup_s,
+                (gen->config.connected ? "connected" : "unconnected"), (unsigned long long)gen->totals.session_failures);
+        fprintf(out, "%-6s %10s %10s %8s %8s %12s %10s", "op", "sent", "completed", "errors", "timeouts", "req/s", "mean_us");
+
+        for(int p = 0; p < NUM_PERCENTILES; p++) {
+            fprintf(out, " %10s", percentile_names[p]);
+        }
+
+        fprintf(out, " %10s\n", "max");
+    }
+
+    for(int r = 0; r <= LOAD_NUM_OPS; r++) {
+        struct op_summary_t *row = &(rows[r]);
+        double throughput = (window_s > 0.0 ? (double)row->completed / window_s : 0.0);
+        double mean_us = histogram_mean(row->latency) / 1000.0;
+        double max_us = (double)row->latency->max / 1000.0;
+
+        /* leave out ops that were not in the mix. */
+        if(r < LOAD_NUM_OPS && gen->config.weights[r] == 0) {
+            continue;
+        }
+
+        if(format == LOAD_FORMAT_JSON) {
+            fprintf(out, "    { \"op\": \"%s\", \"sent\": %llu, \"completed\": %llu, \"errors\": %llu, \"timeouts\": %llu, \"throughput_per_s\": %.1f, \"mean_us\": %.1f",
+                    row->name, (unsigned long long)row->sent, (unsigned long long)row->completed, (unsigned long long)row->errors, (unsigned long long)row->timeouts, throughput, mean_us);
+
+            for(int p = 0; p < NUM_PERCENTILES; p++) {
+                fprintf(out, ", \"%s_us\": %.1f", percentile_names[p], (double)histogram_percentile(row->latency, percentiles[p]) / 1000.0);
+            }
+
+            fprintf(out, ", \"max_us\": %.1f }%s\n", max_us, (r < LOAD_NUM_OPS ? "," : ""));
+        } else if(format == LOAD_FORMAT_CSV) {
+            fprintf(out, "%s,%llu,%llu,%llu,%llu,%.1f,%.1f", row->name, (unsigned long long)row->sent, (unsigned long long)row->completed, (unsigned long long)row->errors, (unsigned long long)row->timeouts, throughput, mean_us);
+
+            for(int p = 0; p < NUM_PERCENTILES; p++) {
+                fprintf(out, ",%.1f", (double)histogram_percentile(row->latency, percentiles[p]) / 1000.0);
+            }
+
+            fprintf(out, ",%.1f\n", max_us);
+        } else {
+            fprintf(out, "%-6s %10llu %10llu %8llu %8llu %12.1f %10.1f", row->name, (unsigned long long)row->sent, (unsigned long long)row->completed, (unsigned long long)row->errors, (unsigned long long)row->timeouts, throughput, mean_us);
+
+            for(int p = 0; p < NUM_PERCENTILES; p++) {
+                fprintf(out, " %10.1f", (double)histogram_percentile(row->latency, percentiles[p]) / 1000.0);
+            }
+
+            fprintf(out, " %10.1f\n", max_us);
+        }
+    }
+
+    if(format == LOAD_FORMAT_JSON) {
+        fprintf(out, "  ]\n}\n");
+    }
+
+    free(all);
+}
@@ -0,0 +1,195 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "eip/eip.h"
+#include "util/buf.h"
+#include "util/histogram.h"
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Open loop EIP/CIP load generator.
+ *
+ * Requests go out on a fixed schedule whatever the replies are doing.  A
+ * session that cannot keep up queues the requests it owes and sends them
+ * late, and latency is measured from when each request was due, not from
+ * when it finally went out.  That keeps a slow server from hiding its
+ * stalls by slowing the client down (coordinated omission).
+ *
+ * Sessions are spread over several proactor loops, each with its own
+ * statistics that are merged at the end.
+ */
+
+#define LOAD_MAX_LOOPS (64)
+#define LOAD_MAX_IN_FLIGHT (256)
+#define LOAD_MAX_MSP_COUNT (32)
+#define LOAD_TAG_NAME_MAX (64)
+
+
+typedef enum {
+    LOAD_OP_READ,
+    LOAD_OP_WRITE,
+    LOAD_OP_MSP,
+    LOAD_OP_FRAG,
+
+    LOAD_NUM_OPS
+} load_op_t;
+
+
+typedef enum {
+    LOAD_FORMAT_TEXT,
+    LOAD_FORMAT_CSV,
+    LOAD_FORMAT_JSON,
+} load_format_t;
+
+
+struct load_config_t {
+    char address[48];
+    uint16_t port;
+
+    uint32_t num_sessions;
+    uint32_t num_loops;
+
+    /* requests per second over all sessions. */
+    double rate;
+    double duration_s;
+    double warmup_s;
+
+    /* use Forward Open and connected messaging instead of SendRRData. */
+    bool connected;
+
+    uint32_t weights[LOAD_NUM_OPS];
+
+    /* a DINT for reads and writes, a large array for fragmented reads. */
+    char tag_name[LOAD_TAG_NAME_MAX];
+    char array_name[LOAD_TAG_NAME_MAX];
+    uint16_t array_elems;
+    uint32_t msp_count;
+};
+
+
+struct load_stats_t {
+    uint64_t sent[LOAD_NUM_OPS];
+    uint64_t completed[LOAD_NUM_OPS];
+    uint64_t errors[LOAD_NUM_OPS];
+
+    /* still unanswered when the run ended.  Their latency counts up to then. */
+    uint64_t timeouts[LOAD_NUM_OPS];
+    struct histogram_t latency[LOAD_NUM_OPS];
+
+    uint64_t session_failures;
+};
+
+
+typedef enum {
+    LOAD_SESSION_IDLE,
+    LOAD_SESSION_REGISTERING,
+    LOAD_SESSION_OPENING,
+    LOAD_SESSION_RUNNING,
+    LOAD_SESSION_CLOSED,
+} load_session_state_t;
+
+
+struct load_loop_t;
+struct proactor_socket_t;
+
+
+/* what a request in flight was and when it was due. */
+struct load_pending_t {
+    int64_t due_ns;
+    uint8_t op;
+    bool measured;
+};
+
+
+struct load_session_t {
+    struct load_loop_t *loop;
+    uint32_t index;
+
+    struct proactor_socket_t *socket;
+    load_session_state_t state;
+
+    uint32_t session_handle;
+    uint32_t conn_id;
+    uint16_t conn_seq;
+
+    int64_t next_due_ns;
+    int64_t interval_ns;
+    uint64_t rng;
+
+    uint32_t pending_head;
+    uint32_t pending_tail;
+    struct load_pending_t pending[LOAD_MAX_IN_FLIGHT];
+
+    /* requests build up in one buffer while the other is being sent. */
+    bool sending;
+    size_t queue_len;
+    uint8_t *queue_data;
+    uint8_t *send_data;
+    proactor_buf_t tx_buf;
+    uint8_t tx_data[2][EIP_MAX_PACKET_SIZE];
+
+    size_t rx_len;
+    proactor_buf_t rx_buf;
+    uint8_t rx_data[EIP_MAX_PACKET_SIZE * 2];
+};
+
+
+struct load_gen_t;
+
+struct load_loop_t {
+    struct load_gen_t *gen;
+    struct proactor_t *proactor;
+    thread_t thread;
+
+    uint32_t num_sessions;
+    struct load_session_t *sessions;
+    uint32_t num_closed;
+
+    struct load_stats_t stats;
+};
+
+
+struct load_gen_t {
+    struct load_config_t config;
+
+    int64_t start_ns;
+    int64_t measure_ns;
+    int64_t end_ns;
+
+    uint32_t num_loops;
+    struct load_loop_t loops[LOAD_MAX_LOOPS];
+
+    /* merged from the loops by load_gen_run(). */
+    struct load_stats_t totals;
+};
+
+
+extern void load_config_init(struct load_config_t *config);
+extern status_t load_config_set_mix(struct load_config_t *config, const char *spec);
+
+extern struct load_gen_t *load_gen_create(const struct load_config_t *config);
+extern void load_gen_dispose(struct load_gen_t *gen);
+
+extern status_t load_gen_run(struct load_gen_t *gen);
+extern void load_gen_report(struct load_gen_t *gen, FILE *out, load_format_t format);
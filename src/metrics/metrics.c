@@ -0,0 +1,378 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <sys/socket.h>
+#endif
+
+#include "device/device.h"
+#include "device/device_host.h"
+#include "metrics/metrics.h"
+#include "util/debug.h"
+#include "util/proactor_net.h"
+
+
+/* the request duration buckets run from 1 us doubling up to about a second. */
+#define DURATION_MIN_NS (1000)
+#define DURATION_NUM_BUCKETS (21)
+
+#define TEXT_MIN_CAPACITY (4096)
+
+
+THREAD_LOCAL struct metrics_shard_t *metrics_thread_shard = NULL;
+
+
+
+const char *metrics_service_name(metrics_service_t service)
+{
+    switch(service) {
+        case METRICS_SRV_GET_ATTRIBUTES_ALL: return "get_attributes_all"; break;
+        case METRICS_SRV_GET_ATTRIBUTE_LIST: return "get_attribute_list"; break;
+        case METRICS_SRV_MULTIPLE_SERVICE: return "multiple_service"; break;
+        case METRICS_SRV_GET_ATTRIBUTE_SINGLE: return "get_attribute_single"; break;
+        case METRICS_SRV_EXECUTE_PCCC: return "execute_pccc"; break;
+        case METRICS_SRV_READ_TAG: return "read_tag"; break;
+        case METRICS_SRV_WRITE_TAG: return "write_tag"; break;
+        case METRICS_SRV_READ_MODIFY_WRITE: return "read_modify_write"; break;
+        case METRICS_SRV_READ_TAG_FRAGMENTED: return "read_tag_fragmented"; break;
+        case METRICS_SRV_WRITE_TAG_FRAGMENTED: return "write_tag_fragmented"; break;
+        case METRICS_SRV_GET_INSTANCE_ATTRIBUTE_LIST: return "get_instance_attribute_list"; break;
+        case METRICS_SRV_FORWARD_OPEN: return "forward_open"; break;
+        case METRICS_SRV_LARGE_FORWARD_OPEN: return "large_forward_open"; break;
+        case METRICS_SRV_FORWARD_CLOSE: return "forward_close"; break;
+        case METRICS_SRV_UNCONNECTED_SEND: return "unconnected_send"; break;
+        default: return "other"; break;
+    }
+}
+
+
+
+/*
+ * The exposition text.  A scrape of thousands of devices runs to megabytes,
+ * so the buffer grows as needed and a failed allocation fails the scrape.
+ */
+
+struct text_t {
+    char *data;
+    size_t len;
+    size_t capacity;
+    bool failed;
+};
+
+
+static void text_printf(struct text_t *text, const char *fmt, ...)
+{
+    va_list args;
+    int needed = 0;
+
+    if(text->failed) {
+        return;
+    }
+
+    va_start(args, fmt);
+    needed = vsnprintf(text->data + text->len, text->capacity - text->len, fmt, args);
+    va_end(args);
+
+    if(needed < 0) {
+        text->failed = true;
+        return;
+    }
+
+    if((size_t)needed >= text->capacity - text->len) {
+        size_t new_capacity = text->capacity * 2;
+        char *new_data = NULL;
+
+        while(new_capacity - text->len <= (size_t)needed) {
+            new_capacity *= 2;
+        }
+
+        if(!(new_data = realloc(text->data, new_capacity))) {
+            text->failed = true;
+            return;
+        }
+
+        text->data = new_data;
+        text->capacity = new_capacity;
+
+        va_start(args, fmt);
+        vsnprintf(text->data + text->len, text->capacity - text->len, fmt, args);
+        va_end(args);
+    }
+
+    text->len += (size_t)needed;
+}
+
+
+static void put_family(struct text_t *text, const char *name, const char *type, const char *help)
+{
+    text_printf(text, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+/* one sample, with the device label when there is one and an optional second label. */
+static void put_sample(struct text_t *text, const char *name, const char *device_label, const char *label, uint64_t value)
+{
+    if(device_label[0] && label) {
+        text_printf(text, "%s{%s,%s} %llu\n", name, device_label, label, (unsigned long long)value);
+    } else if(device_label[0] || label) {
+        text_printf(text, "%s{%s} %llu\n", name, (device_label[0] ? device_label : label), (unsigned long long)value);
+    } else {
+        text_printf(text, "%s %llu\n", name, (unsigned long long)value);
+    }
+}
+
+
+/* status_to_str() leads with the bare name, up to the first period. */
+static void status_label(char *buf, size_t buf_size, status_t status)
+{
+    const char *str = status_to_str(status);
+    size_t len = strcspn(str, ".");
+
+    snprintf(buf, buf_size, "status=\"%.*s\"", (int)len, str);
+}
+
+
+static void device_label(char *buf, size_t buf_size, struct device_host_t *host, struct device_t *device)
+{
+    if(host->num_devices > 1) {
+        snprintf(buf, buf_size, "device=\"%u\"", device->id);
+    } else {
+        buf[0] = 0;
+    }
+}
+
+
+static void render_devices(struct text_t *text, struct device_host_t *host)
+{
+    char dev[32];
+    char label[64];
+
+    put_family(text, "tag_sim_cip_requests_total", "counter", "CIP requests handled, by service.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        struct device_t *device = host->devices[i];
+        struct metrics_device_t *metrics = device->metrics;
+
+        if(!metrics) {
+            continue;
+        }
+
+        device_label(dev, sizeof(dev), host, device);
+
+        /* most devices only ever see a few services, leave out the rest. */
+        for(uint32_t s = 0; s < METRICS_NUM_SERVICES; s++) {
+            uint64_t count = ATOMIC_LOAD_U64_RELAXED(&(metrics->requests[s]));
+
+            if(count) {
+                snprintf(label, sizeof(label), "service=\"%s\"", metrics_service_name((metrics_service_t)s));
+                put_sample(text, "tag_sim_cip_requests_total", dev, label, count);
+            }
+        }
+    }
+
+    put_family(text, "tag_sim_errors_total", "counter", "Requests and connections that failed, by status.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        struct device_t *device = host->devices[i];
+        struct metrics_device_t *metrics = device->metrics;
+
+        if(!metrics) {
+            continue;
+        }
+
+        device_label(dev, sizeof(dev), host, device);
+
+        for(uint32_t s = 0; s < METRICS_NUM_STATUS; s++) {
+            uint64_t count = ATOMIC_LOAD_U64_RELAXED(&(metrics->errors[s]));
+
+            if(count) {
+                status_label(label, sizeof(label), (status_t)s);
+                put_sample(text, "tag_sim_errors_total", dev, label, count);
+            }
+        }
+    }
+
+    put_family(text, "tag_sim_received_bytes_total", "counter", "EIP bytes received.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        if(host->devices[i]->metrics) {
+            device_label(dev, sizeof(dev), host, host->devices[i]);
+            put_sample(text, "tag_sim_received_bytes_total", dev, NULL, ATOMIC_LOAD_U64_RELAXED(&(host->devices[i]->metrics->bytes_in)));
+        }
+    }
+
+    put_family(text, "tag_sim_sent_bytes_total", "counter", "EIP bytes sent.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        if(host->devices[i]->metrics) {
+            device_label(dev, sizeof(dev), host, host->devices[i]);
+            put_sample(text, "tag_sim_sent_bytes_total", dev, NULL, ATOMIC_LOAD_U64_RELAXED(&(host->devices[i]->metrics->bytes_out)));
+        }
+    }
+
+    put_family(text, "tag_sim_tcp_connections", "gauge", "Open EIP TCP connections.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        if(host->devices[i]->metrics) {
+            device_label(dev, sizeof(dev), host, host->devices[i]);
+            put_sample(text, "tag_sim_tcp_connections", dev, NULL, ATOMIC_LOAD_U64_RELAXED(&(host->devices[i]->metrics->tcp_connections)));
+        }
+    }
+
+    put_family(text, "tag_sim_sessions", "gauge", "Registered EIP sessions.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        device_label(dev, sizeof(dev), host, host->devices[i]);
+        put_sample(text, "tag_sim_sessions", dev, NULL, ATOMIC_LOAD_U32(&(host->devices[i]->num_sessions)));
+    }
+
+    put_family(text, "tag_sim_cip_connections", "gauge", "Open CIP connections.");
+
+    for(uint32_t i = 0; i < host->num_devices; i++) {
+        device_label(dev, sizeof(dev), host, host->devices[i]);
+        put_sample(text, "tag_sim_cip_connections", dev, NULL, ATOMIC_LOAD_U32(&(host->devices[i]->num_connections)));
+    }
+}
+
+
+/* a duration histogram in seconds, labels is everything inside the braces but le. */
+static void put_histogram(struct text_t *text, const char *name, const char *labels, const struct histogram_t *hist)
+{
+    uint64_t bound_ns = DURATION_MIN_NS;
+
+    for(int b = 0; b < DURATION_NUM_BUCKETS; b++, bound_ns *= 2) {
+        text_printf(text, "%s_bucket{%s,le=\"%.6f\"} %llu\n", name, labels, (double)bound_ns / 1000000000.0,
+                    (unsigned long long)histogram_count_below(hist, bound_ns));
+    }
+
+    text_printf(text, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)hist->count);
+    text_printf(text, "%s_sum{%s} %.9f\n", name, labels, (double)hist->sum / 1000000000.0);
+    text_printf(text, "%s_count{%s} %llu\n", name, labels, (unsigned long long)hist->count);
+}
+
+
+static void render_loops(struct text_t *text, struct metrics_server_t *server)
+{
+    struct device_host_t *host = server->host;
+    struct proactor_stats_t *stats = NULL;
+    struct histogram_t *request_ns = NULL;
+    char label[64];
+
+    /* the loop histograms make this too big for the stack. */
+    if(!(stats = calloc(host->num_loops ? host->num_loops : 1, sizeof(*stats)))) {
+        warn("Unable to allocate loop statistics!");
+        text->failed = true;
+        return;
+    }
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        proactor_net_get_stats(host->loops[i].proactor, &(stats[i]));
+    }
+
+    put_family(text, "tag_sim_loop_iterations_total", "counter", "Proactor loop iterations.");
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        snprintf(label, sizeof(label), "loop=\"%u\"", i);
+        put_sample(text, "tag_sim_loop_iterations_total", "", label, stats[i].iterations);
+    }
+
+    put_family(text, "tag_sim_loop_slow_callbacks_total", "counter", "Callbacks that took longer than the slow callback threshold.");
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        snprintf(label, sizeof(label), "loop=\"%u\"", i);
+        put_sample(text, "tag_sim_loop_slow_callbacks_total", "", label, stats[i].slow_callbacks);
+    }
+
+    put_family(text, "tag_sim_loop_wait_seconds", "histogram", "Time spent waiting in the kernel for events.");
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        snprintf(label, sizeof(label), "loop=\"%u\"", i);
+        put_histogram(text, "tag_sim_loop_wait_seconds", label, &(stats[i].wait_ns));
+    }
+
+    put_family(text, "tag_sim_loop_callback_seconds", "histogram", "Time spent in each callback, by type.");
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        for(int c = 0; c < PROACTOR_NUM_CALLBACKS; c++) {
+            snprintf(label, sizeof(label), "loop=\"%u\",callback=\"%s\"", i, proactor_net_callback_name((proactor_callback_t)c));
+            put_histogram(text, "tag_sim_loop_callback_seconds", label, &(stats[i].callback_ns[c]));
+        }
+    }
+
+    put_family(text, "tag_sim_loop_timer_lag_seconds", "histogram", "How late the loop tick ran after its deadline.");
+
+    for(uint32_t i = 0; i < host->num_loops; i++) {
+        snprintf(label, sizeof(label), "loop=\"%u\"", i);
+        put_histogram(text, "tag_sim_loop_timer_lag_seconds", label, &(stats[i].timer_lag_ns));
+    }
+
+    free(stats);
+
+    put_family(text, "tag_sim_request_duration_seconds", "histogram", "Time to handle one EIP frame.");
+
+    if(!(request_ns = calloc(1, sizeof(*request_ns)))) {
+        warn("Unable to allocate request histogram!");
+        text->failed = true;
+        return;
+    }
+
+    for(uint32_t i = 0; i < server->num_shards; i++) {
+        histogram_snapshot(request_ns, &(server->shards[i].request_ns));
+
+        snprintf(label, sizeof(label), "loop=\"%u\"", server->shards[i].loop);
+        put_histogram(text, "tag_sim_request_duration_seconds", label, request_ns);
+    }
+
+    free(request_ns);
+}
+
+
+/* the whole exposition as one allocated string, NULL if it could not be built. */
+char *metrics_render(struct metrics_server_t *server, size_t *len)
+{
+    struct text_t text = {0};
+
+    if(!server || !len) {
+        warn("Called with NULL pointer(s)!");
+        return NULL;
+    }
+
+    if(!(text.data = malloc(TEXT_MIN_CAPACITY))) {
+        warn("Unable to allocate metrics text!");
+        return NULL;
+    }
+
+    text.capacity = TEXT_MIN_CAPACITY;
+    text.data[0] = 0;
+
+    render_devices(&text, server->host);
+    render_loops(&text, server);
+
+    if(text.failed) {
+        warn("Unable to render metrics!");
+        free(text.data);
+        return NULL;
+    }
+
+    *len = text.len;
+
+    return text.data;
+}
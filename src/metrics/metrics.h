@@ -0,0 +1,220 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/buf.h"
+#include "util/histogram.h"
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Metrics for the hosted devices, scraped in Prometheus text format.
+ *
+ * Nothing here is shared between writers.  A device is bound to one loop
+ * for life, so its counters hang off the device and only that loop's
+ * thread ever writes them.  Everything kept per loop lives in a shard owned
+ * by the loop's thread.  Counters are written and read with relaxed atomic
+ * stores and loads, so a scrape takes no lock and costs the writer nothing
+ * on the hot path.  It may see a count a moment old.
+ *
+ * The text is served over HTTP from a listener on the first loop and, where
+ * there are UNIX sockets, dumped to anything that connects to a socket
+ * path.  With more than one device every per-device series carries a
+ * device label with the device ID.
+ */
+
+#define METRICS_DEFAULT_PORT (9464)
+
+/* requests are a line or two, anything longer is not a scrape. */
+#define METRICS_MAX_REQUEST_SIZE (2048)
+
+
+/* the CIP services counted separately, everything else is "other". */
+typedef enum {
+    METRICS_SRV_OTHER,
+    METRICS_SRV_GET_ATTRIBUTES_ALL,
+    METRICS_SRV_GET_ATTRIBUTE_LIST,
+    METRICS_SRV_MULTIPLE_SERVICE,
+    METRICS_SRV_GET_ATTRIBUTE_SINGLE,
+    METRICS_SRV_EXECUTE_PCCC,
+    METRICS_SRV_READ_TAG,
+    METRICS_SRV_WRITE_TAG,
+    METRICS_SRV_READ_MODIFY_WRITE,
+    METRICS_SRV_READ_TAG_FRAGMENTED,
+    METRICS_SRV_WRITE_TAG_FRAGMENTED,
+    METRICS_SRV_GET_INSTANCE_ATTRIBUTE_LIST,
+    METRICS_SRV_FORWARD_OPEN,
+    METRICS_SRV_LARGE_FORWARD_OPEN,
+    METRICS_SRV_FORWARD_CLOSE,
+    METRICS_SRV_UNCONNECTED_SEND,
+
+    METRICS_NUM_SERVICES
+} metrics_service_t;
+
+#define METRICS_NUM_STATUS (STATUS_NOT_ALLOWED + 1)
+
+
+/* one device's counters, written only by the loop that owns the device. */
+struct metrics_device_t {
+    uint64_t requests[METRICS_NUM_SERVICES];
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t errors[METRICS_NUM_STATUS];
+    uint64_t tcp_connections;
+};
+
+
+/* one loop's share, written only by the loop's thread. */
+struct metrics_shard_t {
+    uint32_t loop;
+
+    /* time to handle one EIP frame, in ns. */
+    struct histogram_t request_ns;
+};
+
+
+struct device_host_t;
+struct device_t;
+struct proactor_t;
+struct proactor_socket_t;
+
+
+struct metrics_server_t {
+    struct device_host_t *host;
+
+    struct proactor_t *proactor;
+    struct proactor_socket_t *listener;
+
+    uint32_t num_shards;
+    struct metrics_shard_t *shards;
+
+    /* the dump socket, only while running. */
+    char *unix_path;
+    intptr_t unix_sock;
+    thread_t unix_thread;
+    bool unix_thread_running;
+    uint32_t stop;
+};
+
+
+/* an HTTP client, allocated per connection.  Scrapes are rare. */
+struct metrics_conn_t {
+    struct metrics_server_t *server;
+    struct proactor_socket_t *socket;
+
+    size_t rx_len;
+    proactor_buf_t rx_buf;
+    proactor_buf_t tx_buf;
+
+    char *tx_data;
+    uint8_t rx_data[METRICS_MAX_REQUEST_SIZE];
+};
+
+
+/* the shard of the calling loop thread, NULL on other threads or without metrics. */
+extern THREAD_LOCAL struct metrics_shard_t *metrics_thread_shard;
+
+
+/* service codes sent to the Message Router and the objects behind it. */
+static inline metrics_service_t metrics_cip_service(uint8_t service)
+{
+    switch(service & 0x7F) {
+        case 0x01: return METRICS_SRV_GET_ATTRIBUTES_ALL;
+        case 0x03: return METRICS_SRV_GET_ATTRIBUTE_LIST;
+        case 0x0A: return METRICS_SRV_MULTIPLE_SERVICE;
+        case 0x0E: return METRICS_SRV_GET_ATTRIBUTE_SINGLE;
+        case 0x4B: return METRICS_SRV_EXECUTE_PCCC;
+        case 0x4C: return METRICS_SRV_READ_TAG;
+        case 0x4D: return METRICS_SRV_WRITE_TAG;
+        case 0x4E: return METRICS_SRV_READ_MODIFY_WRITE;
+        case 0x52: return METRICS_SRV_READ_TAG_FRAGMENTED;
+        case 0x53: return METRICS_SRV_WRITE_TAG_FRAGMENTED;
+        case 0x55: return METRICS_SRV_GET_INSTANCE_ATTRIBUTE_LIST;
+        default: return METRICS_SRV_OTHER;
+    }
+}
+
+
+/* service codes sent to the Connection Manager, which reuses some of the numbers above. */
+static inline metrics_service_t metrics_cm_service(uint8_t service)
+{
+    switch(service & 0x7F) {
+        case 0x4E: return METRICS_SRV_FORWARD_CLOSE;
+        case 0x52: return METRICS_SRV_UNCONNECTED_SEND;
+        case 0x54: return METRICS_SRV_FORWARD_OPEN;
+        case 0x5B: return METRICS_SRV_LARGE_FORWARD_OPEN;
+        default: return METRICS_SRV_OTHER;
+    }
+}
+
+
+/* all of these take the device's counters, which are NULL when metrics are off. */
+/* only the owning thread writes a counter, so no read-modify-write is needed. */
+static inline void metrics_add(uint64_t *counter, uint64_t amount)
+{
+    ATOMIC_STORE_U64_RELAXED(counter, ATOMIC_LOAD_U64_RELAXED(counter) + amount);
+}
+
+
+static inline void metrics_sub(uint64_t *counter, uint64_t amount)
+{
+    uint64_t value = ATOMIC_LOAD_U64_RELAXED(counter);
+
+    ATOMIC_STORE_U64_RELAXED(counter, (value > amount ? value - amount : 0));
+}
+
+
+static inline void metrics_count_request(struct metrics_device_t *metrics, metrics_service_t service)
+{
+    if(metrics) {
+        metrics_add(&(metrics->requests[service]), 1);
+    }
+}
+
+
+static inline void metrics_count_error(struct metrics_device_t *metrics, status_t status)
+{
+    if(metrics && (unsigned)status < METRICS_NUM_STATUS) {
+        metrics_add(&(metrics->errors[status]), 1);
+    }
+}
+
+
+static inline void metrics_count_bytes(struct metrics_device_t *metrics, size_t bytes_in, size_t bytes_out)
+{
+    if(metrics) {
+        metrics_add(&(metrics->bytes_in), bytes_in);
+        metrics_add(&(metrics->bytes_out), bytes_out);
+    }
+}
+
+
+extern const char *metrics_service_name(metrics_service_t service);
+
+extern struct metrics_server_t *metrics_server_create(struct device_host_t *host, struct proactor_t *proactor, const char *address, uint16_t port, const char *unix_path);
+extern void metrics_server_dispose(struct metrics_server_t *server);
+
+extern status_t metrics_server_add_device(struct metrics_server_t *server, struct device_t *device);
+
+extern status_t metrics_server_start(struct metrics_server_t *server);
+extern void metrics_server_stop(struct metrics_server_t *server);
+
+extern char *metrics_render(struct metrics_server_t *server, size_t *len);
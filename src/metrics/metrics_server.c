@@ -0,0 +1,510 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <errno.h>
+    #include <poll.h>
+    #include <unistd.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+#endif
+
+#include "device/device.h"
+#include "device/device_host.h"
+#include "metrics/metrics.h"
+#include "util/debug.h"
+#include "util/proactor_net.h"
+
+
+/* how often the dump thread looks at the stop flag. */
+#define UNIX_POLL_MS (200)
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data);
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data);
+
+static void conn_close(struct metrics_conn_t *conn);
+
+
+
+/*
+ * The HTTP listener lives on one proactor loop and renders on that loop's
+ * thread, so a scrape briefly holds up that loop's devices.  A port of zero
+ * leaves HTTP off, a NULL path the dump socket.
+ */
+struct metrics_server_t *metrics_server_create(struct device_host_t *host, struct proactor_t *proactor, const char *address, uint16_t port, const char *unix_path)
+{
+    status_t rc = STATUS_OK;
+    struct metrics_server_t *server = NULL;
+
+    info("Starting.");
+
+    do {
+        if(!host || !proactor) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(!(server = calloc(1, sizeof(*server)))) {
+            warn("Unable to allocate metrics server!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        server->host = host;
+        server->proactor = proactor;
+        server->unix_sock = -1;
+
+        if(!(server->shards = calloc(host->num_loops, sizeof(*server->shards)))) {
+            warn("Unable to allocate metrics shards!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        server->num_shards = host->num_loops;
+
+        for(uint32_t i = 0; i < server->num_shards; i++) {
+            server->shards[i].loop = i;
+        }
+
+        if(unix_path && !(server->unix_path = strdup(unix_path))) {
+            warn("Unable to copy metrics socket path!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(port == 0) {
+            break;
+        }
+
+        rc = proactor_net_socket_open(proactor, &(server->listener), PROACTOR_SOCK_TCP_LISTENER, (address ? address : ""), port, NULL, server);
+        if(rc != STATUS_OK) {
+            warn("Error %s opening metrics listener on port %u!", status_to_str(rc), port);
+            break;
+        }
+
+        proactor_net_socket_set_accept_callback(server->listener, on_accept);
+
+        if((rc = proactor_net_start_accept(server->listener)) != STATUS_OK) {
+            warn("Error %s starting accept for metrics!", status_to_str(rc));
+            break;
+        }
+
+        detail("Metrics listening on port %u.", port);
+    } while(0);
+
+    if(rc != STATUS_OK && server) {
+        metrics_server_dispose(server);
+        server = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return server;
+}
+
+
+/* the connections must already be closed, which disposing the proactor does. */
+void metrics_server_dispose(struct metrics_server_t *server)
+{
+    if(!server) {
+        return;
+    }
+
+    metrics_server_stop(server);
+
+    if(server->unix_path) {
+        free(server->unix_path);
+    }
+
+    if(server->shards) {
+        free(server->shards);
+    }
+
+    free(server);
+}
+
+
+
+/* the device's loop is the only writer of what this allocates. */
+status_t metrics_server_add_device(struct metrics_server_t *server, struct device_t *device)
+{
+    if(!server || !device) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(device->metrics) {
+        return STATUS_OK;
+    }
+
+    if(!(device->metrics = calloc(1, sizeof(*device->metrics)))) {
+        warn("Unable to allocate metrics for device %u!", device->id);
+        return STATUS_NO_RESOURCE;
+    }
+
+    return STATUS_OK;
+}
+
+
+
+
+/*
+ * The dump socket.  Anything that connects gets the current text and the
+ * socket is closed, so "socat - UNIX-CONNECT:<path>" is a scrape.
+ */
+
+#ifdef IS_WINDOWS
+
+status_t metrics_server_start(struct metrics_server_t *server)
+{
+    if(!server) {
+        warn("Called with a NULL server pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(server->unix_path) {
+        warn("The metrics dump socket is not supported on this platform.");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return STATUS_OK;
+}
+
+
+void metrics_server_stop(struct metrics_server_t *server)
+{
+    (void)server;
+}
+
+#else
+
+static void write_all(int sock, const char *data, size_t len)
+{
+    while(len > 0) {
+        ssize_t rc = write(sock, data, len);
+
+        if(rc < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(rc <= 0) {
+            return;
+        }
+
+        data += rc;
+        len -= (size_t)rc;
+    }
+}
+
+
+static void *unix_thread_func(void *arg)
+{
+    struct metrics_server_t *server = (struct metrics_server_t *)arg;
+
+    while(!ATOMIC_LOAD_U32(&(server->stop))) {
+        struct pollfd pfd;
+        int client = -1;
+        char *text = NULL;
+        size_t len = 0;
+
+        memset(&pfd, 0, sizeof(pfd));
+        pfd.fd = (int)server->unix_sock;
+        pfd.events = POLLIN;
+
+        if(poll(&pfd, 1, UNIX_POLL_MS) <= 0) {
+            continue;
+        }
+
+        if((client = accept((int)server->unix_sock, NULL, NULL)) < 0) {
+            continue;
+        }
+
+        if((text = metrics_render(server, &len))) {
+            write_all(client, text, len);
+            free(text);
+        }
+
+        close(client);
+    }
+
+    return NULL;
+}
+
+
+/* devices must all be added first, the dump thread reads them from here on. */
+status_t metrics_server_start(struct metrics_server_t *server)
+{
+    struct sockaddr_un addr;
+    int sock = -1;
+
+    if(!server) {
+        warn("Called with a NULL server pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(!server->unix_path || server->unix_thread_running) {
+        return STATUS_OK;
+    }
+
+    if(strlen(server->unix_path) >= sizeof(addr.sun_path)) {
+        warn("Metrics socket path %s is too long!", server->unix_path);
+        return STATUS_BAD_INPUT;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", server->unix_path);
+
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        warn("Unable to open metrics socket!");
+        return STATUS_SETUP_FAILURE;
+    }
+
+    /* a socket left behind by an earlier run would fail the bind. */
+    unlink(server->unix_path);
+
+    if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+        warn("Unable to listen on metrics socket %s!", server->unix_path);
+        close(sock);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    server->unix_sock = sock;
+    ATOMIC_STORE_U32(&(server->stop), 0);
+
+    if(!THREAD_CREATE(server->unix_thread, unix_thread_func, server)) {
+        warn("Unable to start the metrics socket thread!");
+        close(sock);
+        server->unix_sock = -1;
+        unlink(server->unix_path);
+        return STATUS_SETUP_FAILURE;
+    }
+
+    server->unix_thread_running = true;
+
+    detail("Metrics dump socket at %s.", server->unix_path);
+
+    return STATUS_OK;
+}
+
+
+void metrics_server_stop(struct metrics_server_t *server)
+{
+    if(server && server->unix_thread_running) {
+        ATOMIC_STORE_U32(&(server->stop), 1);
+
+        THREAD_JOIN(server->unix_thread);
+
+        close((int)server->unix_sock);
+        server->unix_sock = -1;
+        unlink(server->unix_path);
+
+        server->unix_thread_running = false;
+    }
+}
+
+#endif
+
+
+
+
+/*
+ * HTTP.  Just enough for a Prometheus scrape: one GET per connection, the
+ * reply sent with Connection: close and the socket closed once it is out.
+ */
+
+static status_t start_receive(struct metrics_conn_t *conn)
+{
+    conn->rx_buf.data = conn->rx_data + conn->rx_len;
+    conn->rx_buf.data_length = sizeof(conn->rx_data) - conn->rx_len;
+
+    return proactor_net_start_receive(conn->socket, &(conn->rx_buf));
+}
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data)
+{
+    struct metrics_server_t *server = (struct metrics_server_t *)app_data;
+    struct metrics_conn_t *conn = NULL;
+
+    if(status != STATUS_OK) {
+        warn("Error %s accepting metrics connection!", status_to_str(status));
+        return status;
+    }
+
+    if(!(conn = calloc(1, sizeof(*conn)))) {
+        warn("Unable to allocate metrics connection state!");
+        proactor_net_socket_close(client_socket);
+        return STATUS_NO_RESOURCE;
+    }
+
+    conn->server = server;
+    conn->socket = client_socket;
+
+    proactor_net_socket_set_data(client_socket, conn);
+    proactor_net_socket_set_receive_callback(client_socket, on_receive);
+    proactor_net_socket_set_sent_callback(client_socket, on_sent);
+    proactor_net_socket_set_close_callback(client_socket, on_close);
+
+    return start_receive(conn);
+}
+
+
+/* the reply to a complete request head, NULL if it could not be built. */
+static char *build_reply(struct metrics_conn_t *conn, size_t *len)
+{
+    const char *status_line = "200 OK";
+    const char *req = (const char *)conn->rx_data;
+    char *body = NULL;
+    char *reply = NULL;
+    size_t body_len = 0;
+    char header[256];
+    int header_len = 0;
+
+    if(strncmp(req, "GET /metrics ", 13) == 0 || strncmp(req, "GET / ", 6) == 0) {
+        if(!(body = metrics_render(conn->server, &body_len))) {
+            status_line = "500 Internal Server Error";
+        }
+    } else if(strncmp(req, "GET ", 4) == 0) {
+        status_line = "404 Not Found";
+    } else {
+        status_line = "405 Method Not Allowed";
+    }
+
+    header_len = snprintf(header, sizeof(header),
+                          "HTTP/1.0 %s\r\n"
+                          "Content-Type: text/plain; version=0.0.4\r\n"
+                          "Content-Length: %zu\r\n"
+                          "Connection: close\r\n"
+                          "\r\n", status_line, body_len);
+
+    if((reply = malloc((size_t)header_len + body_len))) {
+        memcpy(reply, header, (size_t)header_len);
+
+        if(body_len) {
+            memcpy(reply + header_len, body, body_len);
+        }
+
+        *len = (size_t)header_len + body_len;
+    }
+
+    if(body) {
+        free(body);
+    }
+
+    return reply;
+}
+
+
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct metrics_conn_t *conn = (struct metrics_conn_t *)sock_data;
+    size_t reply_len = 0;
+
+    if(status != STATUS_OK) {
+        conn_close(conn);
+        return status;
+    }
+
+    conn->rx_len += buffer->data_length;
+
+    /* wait for the whole request head, headers and all. */
+    if(conn->rx_len < sizeof(conn->rx_data)) {
+        conn->rx_data[conn->rx_len] = 0;
+
+        if(!strstr((const char *)conn->rx_data, "\r\n\r\n")) {
+            if(start_receive(conn) != STATUS_OK) {
+                conn_close(conn);
+            }
+
+            return STATUS_OK;
+        }
+    } else {
+        warn("Metrics request is too large, closing connection!");
+        conn_close(conn);
+        return STATUS_OK;
+    }
+
+    if(!(conn->tx_data = build_reply(conn, &reply_len))) {
+        conn_close(conn);
+        return STATUS_NO_RESOURCE;
+    }
+
+    conn->tx_buf.data = conn->tx_data;
+    conn->tx_buf.data_length = reply_len;
+
+    if(proactor_net_start_send(conn->socket, &(conn->tx_buf)) != STATUS_OK) {
+        conn_close(conn);
+    }
+
+    return STATUS_OK;
+}
+
+
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct metrics_conn_t *conn = (struct metrics_conn_t *)sock_data;
+
+    conn_close(conn);
+
+    return status;
+}
+
+
+static void free_conn(struct metrics_conn_t *conn)
+{
+    if(conn->tx_data) {
+        free(conn->tx_data);
+    }
+
+    free(conn);
+}
+
+
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data)
+{
+    struct metrics_conn_t *conn = (struct metrics_conn_t *)sock_data;
+
+    proactor_net_socket_set_data(socket, NULL);
+
+    if(conn) {
+        free_conn(conn);
+    }
+
+    proactor_net_socket_close(socket);
+
+    return STATUS_OK;
+}
+
+
+static void conn_close(struct metrics_conn_t *conn)
+{
+    struct proactor_socket_t *socket = conn->socket;
+
+    proactor_net_socket_set_data(socket, NULL);
+
+    free_conn(conn);
+
+    proactor_net_socket_close(socket);
+}
@@ -0,0 +1,535 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device/device.h"
+#include "modbus/modbus.h"
+#include "tags/tag.h"
+#include "tags/tag_bits.h"
+#include "tags/tag_db.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+#define MODBUS_FC_READ_COILS (0x01)
+#define MODBUS_FC_READ_DISCRETE_INPUTS (0x02)
+#define MODBUS_FC_READ_HOLDING_REGISTERS (0x03)
+#define MODBUS_FC_READ_INPUT_REGISTERS (0x04)
+#define MODBUS_FC_WRITE_SINGLE_COIL (0x05)
+#define MODBUS_FC_WRITE_SINGLE_REGISTER (0x06)
+#define MODBUS_FC_WRITE_MULTIPLE_COILS (0x0F)
+#define MODBUS_FC_WRITE_MULTIPLE_REGISTERS (0x10)
+
+#define MODBUS_EXCEPTION_FLAG (0x80)
+
+#define MODBUS_EX_NONE (0x00)
+#define MODBUS_EX_ILLEGAL_FUNCTION (0x01)
+#define MODBUS_EX_ILLEGAL_ADDRESS (0x02)
+#define MODBUS_EX_ILLEGAL_VALUE (0x03)
+#define MODBUS_EX_DEVICE_FAILURE (0x04)
+#define MODBUS_EX_GATEWAY_TARGET (0x0B)
+
+/* quantity limits from the specification, they keep each reply inside one PDU. */
+#define MODBUS_MAX_READ_BITS (2000)
+#define MODBUS_MAX_READ_REGISTERS (125)
+#define MODBUS_MAX_WRITE_BITS (1968)
+#define MODBUS_MAX_WRITE_REGISTERS (123)
+
+#define MODBUS_COIL_ON (0xFF00)
+#define MODBUS_COIL_OFF (0x0000)
+
+
+
+/* "hr:100=Tag", the table, the zero based start address and the tag behind it. */
+status_t modbus_map_add(struct modbus_map_t *map, const char *spec)
+{
+    static const struct {
+        const char *name;
+        modbus_table_t table;
+    } tables[] = {
+        { "co", MODBUS_TABLE_COILS },
+        { "di", MODBUS_TABLE_DISCRETE_INPUTS },
+        { "ir", MODBUS_TABLE_INPUT_REGISTERS },
+        { "hr", MODBUS_TABLE_HOLDING_REGISTERS },
+    };
+    struct modbus_range_t *range = NULL;
+    const char *colon = NULL;
+    const char *equals = NULL;
+    char *end = NULL;
+    unsigned long start = 0;
+    size_t name_len = 0;
+    bool found = false;
+
+    if(!map || !spec) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(map->num_ranges >= MODBUS_MAX_RANGES) {
+        warn("Too many Modbus ranges, the limit is %d!", MODBUS_MAX_RANGES);
+        return STATUS_NO_RESOURCE;
+    }
+
+    range = &(map->ranges[map->num_ranges]);
+
+    if(!(colon = strchr(spec, ':')) || !(equals = strchr(colon, '='))) {
+        warn("Modbus range \"%s\" is not <table>:<start>=<tag>!", spec);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    for(size_t i = 0; i < sizeof(tables)/sizeof(tables[0]); i++) {
+        if((size_t)(colon - spec) == strlen(tables[i].name) && strncmp(spec, tables[i].name, (size_t)(colon - spec)) == 0) {
+            range->table = tables[i].table;
+            found = true;
+            break;
+        }
+    }
+
+    if(!found) {
+        warn("Unknown Modbus table in \"%s\", use co, di, ir or hr!", spec);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    start = strtoul(colon + 1, &end, 10);
+    if(end != equals || start > UINT16_MAX) {
+        warn("Bad start address in Modbus range \"%s\"!", spec);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    name_len = strlen(equals + 1);
+    if(name_len == 0 || name_len >= sizeof(range->tag_name)) {
+        warn("Bad tag name in Modbus range \"%s\"!", spec);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    range->start = (uint16_t)start;
+    memcpy(range->tag_name, equals + 1, name_len + 1);
+
+    map->num_ranges++;
+
+    return STATUS_OK;
+}
+
+
+
+/* how many registers or bits a tag offers to a table. */
+static uint32_t slice_count(modbus_table_t table, struct tag_t *tag)
+{
+    uint32_t count = 0;
+
+    if(table == MODBUS_TABLE_INPUT_REGISTERS || table == MODBUS_TABLE_HOLDING_REGISTERS) {
+        count = tag->data_size / 2;
+    } else if(tag->bit_count) {
+        count = tag->bit_count;
+    } else if(tag->type == TAG_TYPE_BOOL) {
+        count = tag->elem_count;
+    } else if(tag->type != TAG_TYPE_REAL && tag->type != TAG_TYPE_LREAL && !tag->udt) {
+        count = tag->data_size * 8;
+    }
+
+    /* addresses are 16 bits. */
+    return (count > (uint32_t)UINT16_MAX + 1 ? (uint32_t)UINT16_MAX + 1 : count);
+}
+
+
+static struct modbus_unit_t *unit_create(const struct modbus_map_t *map, struct device_t *device)
+{
+    struct modbus_unit_t *unit = NULL;
+
+    if(!(unit = calloc(1, sizeof(*unit)))) {
+        warn("Unable to allocate Modbus unit for device %u!", device->id);
+        return NULL;
+    }
+
+    unit->device = device;
+
+    for(uint32_t i = 0; i < map->num_ranges; i++) {
+        const struct modbus_range_t *range = &(map->ranges[i]);
+        struct tag_t *tag = tag_db_find(device->tag_db, range->tag_name, strlen(range->tag_name));
+
+        if(!tag) {
+            detail("Device %u has no tag %s for Modbus range %u.", device->id, range->tag_name, i);
+            continue;
+        }
+
+        if(!(unit->slices[i].count = slice_count(range->table, tag))) {
+            detail("Tag %s cannot back Modbus range %u on device %u.", range->tag_name, i, device->id);
+            continue;
+        }
+
+        unit->slices[i].tag = tag;
+    }
+
+    return unit;
+}
+
+
+/* units join in the order their devices are added. */
+status_t modbus_server_add_device(struct modbus_server_t *server, struct device_t *device)
+{
+    struct modbus_unit_t *unit = NULL;
+
+    if(!server || !device) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(server->num_units >= MODBUS_MAX_UNITS) {
+        detail("No Modbus unit ID left for device %u.", device->id);
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(!(unit = unit_create(&(server->map), device))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    server->units[++server->num_units] = unit;
+
+    detail("Device %u is Modbus unit %u.", device->id, server->num_units);
+
+    return STATUS_OK;
+}
+
+
+static struct modbus_unit_t *find_unit(struct modbus_server_t *server, uint8_t unit_id)
+{
+    if(unit_id == 0 || unit_id == 0xFF) {
+        unit_id = 1;
+    }
+
+    if(unit_id > server->num_units) {
+        return NULL;
+    }
+
+    return server->units[unit_id];
+}
+
+
+/* the slice holding all of [address, address + quantity), and where in it that starts. */
+static struct modbus_slice_t *find_slice(struct modbus_server_t *server, struct modbus_unit_t *unit, modbus_table_t table, uint16_t address, uint16_t quantity, uint32_t *first)
+{
+    for(uint32_t i = 0; i < server->map.num_ranges; i++) {
+        const struct modbus_range_t *range = &(server->map.ranges[i]);
+        struct modbus_slice_t *slice = &(unit->slices[i]);
+
+        if(range->table != table || !slice->tag || address < range->start || (uint32_t)(address - range->start) >= slice->count) {
+            continue;
+        }
+
+        *first = (uint32_t)(address - range->start);
+
+        return (*first + quantity <= slice->count ? slice : NULL);
+    }
+
+    return NULL;
+}
+
+
+
+/* one read of the slice into the reply, then swap each word to big endian in place. */
+static uint8_t read_registers(struct modbus_server_t *server, struct modbus_unit_t *unit, modbus_table_t table, const uint8_t *pdu, size_t pdu_len, uint8_t *out, size_t *out_len)
+{
+    struct modbus_slice_t *slice = NULL;
+    uint16_t address = 0;
+    uint16_t quantity = 0;
+    uint32_t first = 0;
+    uint8_t *data = out + 1;
+
+    if(pdu_len != 5) {
+        return MODBUS_EX_ILLEGAL_VALUE;
+    }
+
+    address = decode_uint16_be(pdu + 1);
+    quantity = decode_uint16_be(pdu + 3);
+
+    if(quantity == 0 || quantity > MODBUS_MAX_READ_REGISTERS) {
+        return MODBUS_EX_ILLEGAL_VALUE;
+    }
+
+    if(!(slice = find_slice(server, unit, table, address, quantity, &first))) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+
+    if(tag_read(slice->tag, unit->device->tag_image, first * 2, data, (uint32_t)quantity * 2) != STATUS_OK) {
+        return MODBUS_EX_DEVICE_FAILURE;
+    }
+
+    for(uint32_t i = 0; i < (uint32_t)quantity * 2; i += 2) {
+        uint8_t low = data[i];
+
+        data[i] = data[i + 1];
+        data[i + 1] = low;
+    }
+
+    out[0] = (uint8_t)(quantity * 2);
+    *out_len = 1 + ((size_t)quantity * 2);
+
+    return MODBUS_EX_NONE;
+}
+
+
+/* swap the big endian register values into a buffer and write them in one go. */
+static uint8_t write_registers(struct modbus_server_t *server, struct modbus_unit_t *unit, uint16_t address, uint16_t quantity, const uint8_t *values)
+{
+    struct modbus_slice_t *slice = NULL;
+    uint8_t data[MODBUS_MAX_WRITE_REGISTERS * 2];
+    uint32_t first = 0;
+
+    if(!(slice = find_slice(server, unit, MODBUS_TABLE_HOLDING_REGISTERS, address, quantity, &first))) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+
+    for(uint32_t i = 0; i < (uint32_t)quantity * 2; i += 2) {
+        data[i] = values[i + 1];
+        data[i + 1] = values[i];
+    }
+
+    if(tag_write(slice->tag, unit->device->tag_image, first * 2, data, (uint32_t)quantity * 2) != STATUS_OK) {
+        return MODBUS_EX_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EX_NONE;
+}
+
+
+/* the bytes covering the bits are read once and the run shifted down into the reply. */
+static uint8_t read_bits(struct modbus_server_t *server, struct modbus_unit_t *unit, modbus_table_t table, const uint8_t *pdu, size_t pdu_len, uint8_t *out, size_t *out_len)
+{
+    struct modbus_slice_t *slice = NULL;
+    uint8_t span[(MODBUS_MAX_READ_BITS + 14) / 8];
+    uint16_t address = 0;
+    uint16_t quantity = 0;
+    uint32_t first = 0;
+    uint32_t span_len = 0;
+
+    if(pdu_len != 5) {
+        return MODBUS_EX_ILLEGAL_VALUE;
+    }
+
+    address = decode_uint16_be(pdu + 1);
+    quantity = decode_uint16_be(pdu + 3);
+
+    if(quantity == 0 || quantity > MODBUS_MAX_READ_BITS) {
+        return MODBUS_EX_ILLEGAL_VALUE;
+    }
+
+    if(!(slice = find_slice(server, unit, table, address, quantity, &first))) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+
+    span_len = ((first % 8) + quantity + 7) / 8;
+
+    if(tag_read(slice->tag, unit->device->tag_image, first / 8, span, span_len) != STATUS_OK) {
+        return MODBUS_EX_DEVICE_FAILURE;
+    }
+
+    tag_bits_extract(span, first % 8, quantity, out + 1);
+
+    out[0] = (uint8_t)((quantity + 7) / 8);
+    *out_len = 1 + (size_t)out[0];
+
+    return MODBUS_EX_NONE;
+}
+
+
+/*
+ * Coils are set and cleared with one masked write over the bytes they span,
+ * so neighbouring bits that a CIP client may be changing are left alone.
+ */
+static uint8_t write_bits(struct modbus_server_t *server, struct modbus_unit_t *unit, uint16_t address, uint16_t quantity, const uint8_t *values)
+{
+    struct modbus_slice_t *slice = NULL;
+    uint8_t or_mask[(MODBUS_MAX_WRITE_BITS + 14) / 8];
+    uint8_t and_mask[(MODBUS_MAX_WRITE_BITS + 14) / 8];
+    uint32_t first = 0;
+    uint32_t span_len = 0;
+
+    if(!(slice = find_slice(server, unit, MODBUS_TABLE_COILS, address, quantity, &first))) {
+        return MODBUS_EX_ILLEGAL_ADDRESS;
+    }
+
+    span_len = ((first % 8) + quantity + 7) / 8;
+
+    memset(or_mask, 0, span_len);
+    memset(and_mask, 0xFF, span_len);
+
+    tag_bits_deposit(or_mask, first % 8, quantity, values);
+    tag_bits_deposit(and_mask, first % 8, quantity, values);
+
+    if(tag_bits_modify(slice->tag, unit->device->tag_image, first / 8, or_mask, and_mask, span_len) != STATUS_OK) {
+        return MODBUS_EX_DEVICE_FAILURE;
+    }
+
+    return MODBUS_EX_NONE;
+}
+
+
+static uint8_t handle_pdu(struct modbus_server_t *server, struct modbus_unit_t *unit, const uint8_t *pdu, size_t pdu_len, uint8_t *out, size_t *out_len)
+{
+    uint8_t exception = MODBUS_EX_NONE;
+
+    switch(pdu[0]) {
+        case MODBUS_FC_READ_COILS:
+            return read_bits(server, unit, MODBUS_TABLE_COILS, pdu, pdu_len, out, out_len);
+
+        case MODBUS_FC_READ_DISCRETE_INPUTS:
+            return read_bits(server, unit, MODBUS_TABLE_DISCRETE_INPUTS, pdu, pdu_len, out, out_len);
+
+        case MODBUS_FC_READ_HOLDING_REGISTERS:
+            return read_registers(server, unit, MODBUS_TABLE_HOLDING_REGISTERS, pdu, pdu_len, out, out_len);
+
+        case MODBUS_FC_READ_INPUT_REGISTERS:
+            return read_registers(server, unit, MODBUS_TABLE_INPUT_REGISTERS, pdu, pdu_len, out, out_len);
+
+        case MODBUS_FC_WRITE_SINGLE_COIL: {
+                uint16_t value = 0;
+                uint8_t bit = 0;
+
+                if(pdu_len != 5) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                value = decode_uint16_be(pdu + 3);
+                if(value != MODBUS_COIL_ON && value != MODBUS_COIL_OFF) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                bit = (value == MODBUS_COIL_ON ? 1 : 0);
+                exception = write_bits(server, unit, decode_uint16_be(pdu + 1), 1, &bit);
+            }
+            break;
+
+        case MODBUS_FC_WRITE_SINGLE_REGISTER:
+            if(pdu_len != 5) {
+                return MODBUS_EX_ILLEGAL_VALUE;
+            }
+
+            exception = write_registers(server, unit, decode_uint16_be(pdu + 1), 1, pdu + 3);
+            break;
+
+        case MODBUS_FC_WRITE_MULTIPLE_COILS: {
+                uint16_t quantity = 0;
+
+                if(pdu_len < 6) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                quantity = decode_uint16_be(pdu + 3);
+
+                if(quantity == 0 || quantity > MODBUS_MAX_WRITE_BITS || pdu[5] != (quantity + 7) / 8 || pdu_len != 6 + (size_t)pdu[5]) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                exception = write_bits(server, unit, decode_uint16_be(pdu + 1), quantity, pdu + 6);
+            }
+            break;
+
+        case MODBUS_FC_WRITE_MULTIPLE_REGISTERS: {
+                uint16_t quantity = 0;
+
+                if(pdu_len < 6) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                quantity = decode_uint16_be(pdu + 3);
+
+                if(quantity == 0 || quantity > MODBUS_MAX_WRITE_REGISTERS || pdu[5] != quantity * 2 || pdu_len != 6 + (size_t)pdu[5]) {
+                    return MODBUS_EX_ILLEGAL_VALUE;
+                }
+
+                exception = write_registers(server, unit, decode_uint16_be(pdu + 1), quantity, pdu + 6);
+            }
+            break;
+
+        default:
+            detail("Unsupported Modbus function %02x.", pdu[0]);
+            return MODBUS_EX_ILLEGAL_FUNCTION;
+    }
+
+    /* the writes all echo the address and the value or quantity. */
+    if(exception == MODBUS_EX_NONE) {
+        memcpy(out, pdu + 1, 4);
+        *out_len = 4;
+    }
+
+    return exception;
+}
+
+
+
+/* zero until the MBAP header is in, then the size of the whole frame. */
+size_t modbus_frame_length(const uint8_t *data, size_t data_len)
+{
+    if(!data || data_len < MODBUS_MBAP_HEADER_SIZE - 1) {
+        return 0;
+    }
+
+    return (MODBUS_MBAP_HEADER_SIZE - 1) + (size_t)decode_uint16_be(data + 4);
+}
+
+
+status_t modbus_process_request(struct modbus_server_t *server, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len)
+{
+    struct modbus_unit_t *unit = NULL;
+    size_t data_len = 0;
+    uint8_t exception = MODBUS_EX_NONE;
+
+    if(!server || !req || !resp || !resp_len) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    *resp_len = 0;
+
+    if(resp_capacity < MODBUS_MAX_ADU_SIZE) {
+        warn("Response buffer of %zu bytes is too small!", resp_capacity);
+        return STATUS_NO_RESOURCE;
+    }
+
+    /* the protocol ID is always zero, anything else is not Modbus. */
+    if(req_len <= MODBUS_MBAP_HEADER_SIZE || req_len > MODBUS_MAX_ADU_SIZE || decode_uint16_be(req + 2) != 0 || modbus_frame_length(req, req_len) != req_len) {
+        warn("Malformed Modbus frame of %zu bytes!", req_len);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    /* transaction, protocol and unit IDs are echoed. */
+    memcpy(resp, req, MODBUS_MBAP_HEADER_SIZE);
+    resp[MODBUS_MBAP_HEADER_SIZE] = req[MODBUS_MBAP_HEADER_SIZE];
+
+    if(!(unit = find_unit(server, req[6]))) {
+        detail("No Modbus unit %u.", req[6]);
+        exception = MODBUS_EX_GATEWAY_TARGET;
+    } else {
+        exception = handle_pdu(server, unit, req + MODBUS_MBAP_HEADER_SIZE, req_len - MODBUS_MBAP_HEADER_SIZE,
+                               resp + MODBUS_MBAP_HEADER_SIZE + 1, &data_len);
+    }
+
+    if(exception != MODBUS_EX_NONE) {
+        resp[MODBUS_MBAP_HEADER_SIZE] |= MODBUS_EXCEPTION_FLAG;
+        resp[MODBUS_MBAP_HEADER_SIZE + 1] = exception;
+        data_len = 1;
+    }
+
+    /* the length counts the unit ID, function code and data. */
+    encode_uint16_be(resp + 4, (uint16_t)(2 + data_len));
+
+    *resp_len = MODBUS_MBAP_HEADER_SIZE + 1 + data_len;
+
+    return STATUS_OK;
+}
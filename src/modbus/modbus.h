@@ -0,0 +1,136 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/buf.h"
+#include "util/status.h"
+
+
+/*
+ * A Modbus/TCP personality for the hosted devices.
+ *
+ * One listener per host answers for all of the devices.  The MBAP unit ID
+ * picks the device: unit 1 is the first device added to the host, unit 2
+ * the second and so on up to 247.  Units 0 and 255, which most clients send
+ * to a plain TCP device, go to unit 1.
+ *
+ * The four register tables are views onto the devices' tags.  A map says
+ * which tag backs which range of addresses, the same map for every device,
+ * and each range is resolved against a device's tag database when the
+ * device is registered.  Register N of a range is bytes 2N and 2N+1 of the
+ * tag's value, so a DINT is two registers, low word first, each sent big
+ * endian as Modbus wants.  Coil and discrete input N is bit N of the value,
+ * which for a BOOL array is element N.
+ *
+ * A request must fall inside one range.  A register read is then a single
+ * read of the contiguous slice of the tag straight into the reply and one
+ * pass to swap the bytes of each word.
+ */
+
+#define MODBUS_DEFAULT_PORT (502)
+
+#define MODBUS_MBAP_HEADER_SIZE (7)
+#define MODBUS_MAX_PDU_SIZE (253)
+#define MODBUS_MAX_ADU_SIZE (MODBUS_MBAP_HEADER_SIZE + MODBUS_MAX_PDU_SIZE)
+
+#define MODBUS_MAX_RANGES (32)
+#define MODBUS_MAX_UNITS (247)
+#define MODBUS_TAG_NAME_MAX (64)
+
+
+typedef enum {
+    MODBUS_TABLE_COILS,
+    MODBUS_TABLE_DISCRETE_INPUTS,
+    MODBUS_TABLE_INPUT_REGISTERS,
+    MODBUS_TABLE_HOLDING_REGISTERS,
+} modbus_table_t;
+
+
+struct modbus_range_t {
+    modbus_table_t table;
+    uint16_t start;
+    char tag_name[MODBUS_TAG_NAME_MAX];
+};
+
+
+struct modbus_map_t {
+    uint32_t num_ranges;
+    struct modbus_range_t ranges[MODBUS_MAX_RANGES];
+};
+
+
+struct device_t;
+struct pool_t;
+struct proactor_t;
+struct proactor_socket_t;
+struct tag_t;
+
+
+/* a map range resolved against one device's tags.  Count is registers or bits. */
+struct modbus_slice_t {
+    struct tag_t *tag;
+    uint32_t count;
+};
+
+
+struct modbus_unit_t {
+    struct device_t *device;
+    struct modbus_slice_t slices[MODBUS_MAX_RANGES];
+};
+
+
+struct modbus_server_t {
+    struct modbus_map_t map;
+
+    struct proactor_t *proactor;
+    struct proactor_socket_t *listener;
+    struct pool_t *conn_pool;
+
+    uint32_t num_units;
+    struct modbus_unit_t *units[MODBUS_MAX_UNITS + 1];
+};
+
+
+/* a client connection, allocated from the server's pool. */
+struct modbus_conn_t {
+    struct modbus_server_t *server;
+    struct proactor_socket_t *socket;
+
+    bool sending;
+
+    size_t rx_len;
+    proactor_buf_t rx_buf;
+    proactor_buf_t tx_buf;
+
+    /* room for a few pipelined requests. */
+    uint8_t rx_data[MODBUS_MAX_ADU_SIZE * 4];
+    uint8_t tx_data[MODBUS_MAX_ADU_SIZE];
+};
+
+
+extern status_t modbus_map_add(struct modbus_map_t *map, const char *spec);
+
+extern struct modbus_server_t *modbus_server_create(struct proactor_t *proactor, const char *address, uint16_t port, const struct modbus_map_t *map);
+extern void modbus_server_dispose(struct modbus_server_t *server);
+
+extern status_t modbus_server_add_device(struct modbus_server_t *server, struct device_t *device);
+
+extern size_t modbus_frame_length(const uint8_t *data, size_t data_len);
+extern status_t modbus_process_request(struct modbus_server_t *server, const uint8_t *req, size_t req_len, uint8_t *resp, size_t resp_capacity, size_t *resp_len);
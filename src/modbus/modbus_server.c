@@ -0,0 +1,277 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <sys/socket.h>
+#endif
+
+#include "modbus/modbus.h"
+#include "util/debug.h"
+#include "util/pool.h"
+#include "util/proactor_net.h"
+
+
+#define MODBUS_CONNS_PER_CHUNK (16)
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data);
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data);
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data);
+
+static void process_frames(struct modbus_conn_t *conn);
+static void conn_close(struct modbus_conn_t *conn);
+
+
+
+/*
+ * The listener and its connections live on one proactor loop.  The devices
+ * behind the unit IDs may belong to other loops; their tag images are
+ * locked and bit writes are atomic, as for the snapshot and I/O threads.
+ */
+struct modbus_server_t *modbus_server_create(struct proactor_t *proactor, const char *address, uint16_t port, const struct modbus_map_t *map)
+{
+    status_t rc = STATUS_OK;
+    struct modbus_server_t *server = NULL;
+
+    info("Starting.");
+
+    do {
+        if(!proactor || !map) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(!(server = calloc(1, sizeof(*server)))) {
+            warn("Unable to allocate Modbus server!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        server->map = *map;
+        server->proactor = proactor;
+
+        if(!(server->conn_pool = pool_create(sizeof(struct modbus_conn_t), MODBUS_CONNS_PER_CHUNK))) {
+            warn("Unable to create Modbus connection pool!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        rc = proactor_net_socket_open(proactor, &(server->listener), PROACTOR_SOCK_TCP_LISTENER, (address ? address : ""), port, NULL, server);
+        if(rc != STATUS_OK) {
+            warn("Error %s opening Modbus listener on port %u!", status_to_str(rc), port);
+            break;
+        }
+
+        proactor_net_socket_set_accept_callback(server->listener, on_accept);
+
+        if((rc = proactor_net_start_accept(server->listener)) != STATUS_OK) {
+            warn("Error %s starting accept for Modbus!", status_to_str(rc));
+            break;
+        }
+
+        detail("Modbus listening on port %u with %u ranges.", port, map->num_ranges);
+    } while(0);
+
+    if(rc != STATUS_OK && server) {
+        modbus_server_dispose(server);
+        server = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return server;
+}
+
+
+/* the connections must already be closed, which disposing the proactor does. */
+void modbus_server_dispose(struct modbus_server_t *server)
+{
+    if(!server) {
+        return;
+    }
+
+    for(uint32_t i = 1; i <= server->num_units; i++) {
+        free(server->units[i]);
+    }
+
+    pool_dispose(server->conn_pool);
+
+    free(server);
+}
+
+
+
+
+/*
+ * Connection handling, the same shape as the EtherNet/IP connections in
+ * the device host.
+ */
+
+static status_t start_receive(struct modbus_conn_t *conn)
+{
+    conn->rx_buf.data = conn->rx_data + conn->rx_len;
+    conn->rx_buf.data_length = sizeof(conn->rx_data) - conn->rx_len;
+
+    return proactor_net_start_receive(conn->socket, &(conn->rx_buf));
+}
+
+
+static status_t on_accept(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data)
+{
+    struct modbus_server_t *server = (struct modbus_server_t *)app_data;
+    struct modbus_conn_t *conn = NULL;
+
+    if(status != STATUS_OK) {
+        warn("Error %s accepting Modbus connection!", status_to_str(status));
+        return status;
+    }
+
+    if(!(conn = pool_alloc(server->conn_pool))) {
+        warn("Unable to allocate Modbus connection state!");
+        proactor_net_socket_close(client_socket);
+        return STATUS_NO_RESOURCE;
+    }
+
+    conn->server = server;
+    conn->socket = client_socket;
+
+    proactor_net_socket_set_data(client_socket, conn);
+    proactor_net_socket_set_receive_callback(client_socket, on_receive);
+    proactor_net_socket_set_sent_callback(client_socket, on_sent);
+    proactor_net_socket_set_close_callback(client_socket, on_close);
+
+    detail("Accepted Modbus connection.");
+
+    return start_receive(conn);
+}
+
+
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct modbus_conn_t *conn = (struct modbus_conn_t *)sock_data;
+
+    if(status != STATUS_OK) {
+        detail("Error %s receiving on Modbus connection, closing.", status_to_str(status));
+        conn_close(conn);
+        return status;
+    }
+
+    conn->rx_len += buffer->data_length;
+
+    process_frames(conn);
+
+    return STATUS_OK;
+}
+
+
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct modbus_conn_t *conn = (struct modbus_conn_t *)sock_data;
+
+    conn->sending = false;
+
+    if(status != STATUS_OK) {
+        conn_close(conn);
+        return status;
+    }
+
+    process_frames(conn);
+
+    return STATUS_OK;
+}
+
+
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data)
+{
+    struct modbus_conn_t *conn = (struct modbus_conn_t *)sock_data;
+
+    detail("Modbus connection closed by the client.");
+
+    proactor_net_socket_set_data(socket, NULL);
+
+    if(conn) {
+        pool_free(conn->server->conn_pool, conn);
+    }
+
+    proactor_net_socket_close(socket);
+
+    return STATUS_OK;
+}
+
+
+static void conn_close(struct modbus_conn_t *conn)
+{
+    struct proactor_socket_t *socket = conn->socket;
+
+    proactor_net_socket_set_data(socket, NULL);
+
+    pool_free(conn->server->conn_pool, conn);
+
+    proactor_net_socket_close(socket);
+}
+
+
+/* every request gets a reply, so at most one frame is handled per send. */
+static void process_frames(struct modbus_conn_t *conn)
+{
+    status_t rc = STATUS_OK;
+    size_t frame_len = modbus_frame_length(conn->rx_data, conn->rx_len);
+    size_t resp_len = 0;
+
+    if(conn->sending) {
+        return;
+    }
+
+    if(frame_len > MODBUS_MAX_ADU_SIZE) {
+        warn("Modbus frame of %zu bytes is too large, closing connection!", frame_len);
+        conn_close(conn);
+        return;
+    }
+
+    if(frame_len == 0 || frame_len > conn->rx_len) {
+        /* need more data. */
+        if(start_receive(conn) != STATUS_OK) {
+            conn_close(conn);
+        }
+
+        return;
+    }
+
+    rc = modbus_process_request(conn->server, conn->rx_data, frame_len, conn->tx_data, sizeof(conn->tx_data), &resp_len);
+
+    /* drop the frame we just handled. */
+    memmove(conn->rx_data, conn->rx_data + frame_len, conn->rx_len - frame_len);
+    conn->rx_len -= frame_len;
+
+    if(rc != STATUS_OK) {
+        warn("Error %s processing Modbus request, closing connection!", status_to_str(rc));
+        conn_close(conn);
+        return;
+    }
+
+    conn->sending = true;
+    conn->tx_buf.data = conn->tx_data;
+    conn->tx_buf.data_length = resp_len;
+
+    if(proactor_net_start_send(conn->socket, &(conn->tx_buf)) != STATUS_OK) {
+        conn_close(conn);
+    }
+}
@@ -0,0 +1,287 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "device/device.h"
+#include "modbus/modbus.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/unit_test.h"
+
+
+/*
+ * The server is only a map and its units here, requests go straight to
+ * modbus_process_request() without a proactor.  One device has a DINT[4]
+ * as holding registers 0-7 and input registers 100-107, and a BOOL[40] as
+ * coils 10-49.
+ */
+
+static struct modbus_server_t server;
+static struct device_t device;
+static struct tag_t *regs;
+static struct tag_t *coils;
+
+static uint8_t resp[MODBUS_MAX_ADU_SIZE];
+static size_t resp_len;
+
+
+
+static void setup(void)
+{
+    memset(&server, 0, sizeof(server));
+    memset(&device, 0, sizeof(device));
+
+    CHECK_EQ(modbus_map_add(&(server.map), "hr:0=Regs"), STATUS_OK);
+    CHECK_EQ(modbus_map_add(&(server.map), "ir:100=Regs"), STATUS_OK);
+    CHECK_EQ(modbus_map_add(&(server.map), "co:10=Coils"), STATUS_OK);
+
+    device.tag_db = tag_db_create(4);
+
+    regs = tag_create("Regs", TAG_TYPE_DINT, 4);
+    coils = tag_create("Coils", TAG_TYPE_BOOL, 40);
+
+    CHECK_EQ(tag_db_add(device.tag_db, regs), STATUS_OK);
+    CHECK_EQ(tag_db_add(device.tag_db, coils), STATUS_OK);
+
+    device.tag_image = tag_image_create(NULL, device.tag_db->data_size);
+
+    CHECK_EQ(modbus_server_add_device(&server, &device), STATUS_OK);
+}
+
+
+static void teardown(void)
+{
+    free(server.units[1]);
+    tag_image_dispose(device.tag_image);
+    tag_db_dispose(device.tag_db);
+}
+
+
+/* wrap a PDU in an MBAP header for unit 1 and run it.  Returns the reply PDU. */
+static const uint8_t *request(uint8_t unit, const uint8_t *pdu, size_t pdu_len)
+{
+    uint8_t req[MODBUS_MAX_ADU_SIZE];
+
+    encode_uint16_be(req, 0x1234);
+    encode_uint16_be(req + 2, 0);
+    encode_uint16_be(req + 4, (uint16_t)(pdu_len + 1));
+    req[6] = unit;
+    memcpy(req + MODBUS_MBAP_HEADER_SIZE, pdu, pdu_len);
+
+    memset(resp, 0xEE, sizeof(resp));
+    resp_len = 0;
+
+    CHECK_EQ(modbus_process_request(&server, req, MODBUS_MBAP_HEADER_SIZE + pdu_len, resp, sizeof(resp), &resp_len), STATUS_OK);
+
+    /* the header is echoed and its length covers the reply. */
+    CHECK_EQ(decode_uint16_be(resp), 0x1234);
+    CHECK_EQ(resp[6], unit);
+    CHECK_EQ(decode_uint16_be(resp + 4) + 6, resp_len);
+
+    return resp + MODBUS_MBAP_HEADER_SIZE;
+}
+
+
+static void test_map_parse(void)
+{
+    struct modbus_map_t map = {0};
+
+    CHECK_EQ(modbus_map_add(&map, "hr:65535=Tag"), STATUS_OK);
+    CHECK_EQ(map.ranges[0].table, MODBUS_TABLE_HOLDING_REGISTERS);
+    CHECK_EQ(map.ranges[0].start, 65535);
+    CHECK(strcmp(map.ranges[0].tag_name, "Tag") == 0);
+
+    CHECK_EQ(modbus_map_add(&map, "xx:0=Tag"), STATUS_NOT_SUPPORTED);
+    CHECK_EQ(modbus_map_add(&map, "hrr:0=Tag"), STATUS_NOT_SUPPORTED);
+    CHECK_EQ(modbus_map_add(&map, "hr:0"), STATUS_NOT_SUPPORTED);
+    CHECK_EQ(modbus_map_add(&map, "hr:65536=Tag"), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(modbus_map_add(&map, "hr:1x=Tag"), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(modbus_map_add(&map, "hr:0="), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(map.num_ranges, 1);
+}
+
+
+static void test_frame_length(void)
+{
+    uint8_t header[MODBUS_MBAP_HEADER_SIZE] = {0x00, 0x01, 0x00, 0x00, 0x00, 0x06, 0x01};
+
+    CHECK_EQ(modbus_frame_length(header, 5), 0);
+    CHECK_EQ(modbus_frame_length(header, 6), 12);
+}
+
+
+static void test_malformed(void)
+{
+    uint8_t req[12] = {0x00, 0x01, 0x00, 0x01, 0x00, 0x06, 0x01, 0x03, 0x00, 0x00, 0x00, 0x01};
+
+    /* a protocol ID that is not Modbus. */
+    CHECK_EQ(modbus_process_request(&server, req, sizeof(req), resp, sizeof(resp), &resp_len), STATUS_NOT_SUPPORTED);
+
+    /* a length that does not match the frame. */
+    req[3] = 0;
+    CHECK_EQ(modbus_process_request(&server, req, sizeof(req) - 1, resp, sizeof(resp), &resp_len), STATUS_NOT_SUPPORTED);
+
+    CHECK_EQ(modbus_process_request(&server, req, sizeof(req), resp, 16, &resp_len), STATUS_NO_RESOURCE);
+}
+
+
+static void test_registers(void)
+{
+    uint8_t value[4];
+    const uint8_t *pdu = NULL;
+
+    /* a DINT is two registers, low word first, each big endian. */
+    encode_uint32_le(value, 0x11223344);
+    CHECK_EQ(tag_write(regs, device.tag_image, 4, value, 4), STATUS_OK);
+
+    pdu = request(1, (const uint8_t[]){0x03, 0x00, 0x02, 0x00, 0x02}, 5);
+    CHECK_EQ(resp_len, MODBUS_MBAP_HEADER_SIZE + 6);
+    CHECK_EQ(pdu[0], 0x03);
+    CHECK_EQ(pdu[1], 4);
+    CHECK_EQ(decode_uint16_be(pdu + 2), 0x3344);
+    CHECK_EQ(decode_uint16_be(pdu + 4), 0x1122);
+
+    /* the input registers are the same tag at another address. */
+    pdu = request(1, (const uint8_t[]){0x04, 0x00, 0x66, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x04);
+    CHECK_EQ(decode_uint16_be(pdu + 2), 0x3344);
+
+    pdu = request(1, (const uint8_t[]){0x06, 0x00, 0x07, 0xAB, 0xCD}, 5);
+    CHECK_EQ(resp_len, MODBUS_MBAP_HEADER_SIZE + 5);
+    CHECK_EQ(pdu[0], 0x06);
+    CHECK_EQ(decode_uint16_be(pdu + 1), 7);
+    CHECK_EQ(decode_uint16_be(pdu + 3), 0xABCD);
+
+    pdu = request(1, (const uint8_t[]){0x10, 0x00, 0x00, 0x00, 0x02, 0x04, 0x00, 0x01, 0x00, 0x02}, 10);
+    CHECK_EQ(pdu[0], 0x10);
+    CHECK_EQ(decode_uint16_be(pdu + 3), 2);
+
+    CHECK_EQ(tag_read(regs, device.tag_image, 0, value, 4), STATUS_OK);
+    CHECK_EQ(decode_uint32_le(value), 0x00020001);
+    CHECK_EQ(tag_read(regs, device.tag_image, 12, value, 4), STATUS_OK);
+    CHECK_EQ(decode_uint32_le(value), 0xABCD0000);
+
+    /* one past the end of the tag. */
+    pdu = request(1, (const uint8_t[]){0x03, 0x00, 0x07, 0x00, 0x02}, 5);
+    CHECK_EQ(pdu[0], 0x83);
+    CHECK_EQ(pdu[1], 0x02);
+
+    /* the input register range does not start at zero. */
+    pdu = request(1, (const uint8_t[]){0x04, 0x00, 0x00, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[1], 0x02);
+
+    /* holding registers only, input registers cannot be written. */
+    pdu = request(1, (const uint8_t[]){0x06, 0x00, 0x64, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x86);
+    CHECK_EQ(pdu[1], 0x02);
+
+    pdu = request(1, (const uint8_t[]){0x03, 0x00, 0x00, 0x00, 0x00}, 5);
+    CHECK_EQ(pdu[1], 0x03);
+
+    pdu = request(1, (const uint8_t[]){0x03, 0x00, 0x00, 0x00, 0x7E}, 5);
+    CHECK_EQ(pdu[1], 0x03);
+
+    /* the byte count has to match the quantity. */
+    pdu = request(1, (const uint8_t[]){0x10, 0x00, 0x00, 0x00, 0x02, 0x02, 0x00, 0x01}, 8);
+    CHECK_EQ(pdu[0], 0x90);
+    CHECK_EQ(pdu[1], 0x03);
+}
+
+
+static void test_coils(void)
+{
+    uint8_t value[8] = {0};
+    const uint8_t *pdu = NULL;
+
+    pdu = request(1, (const uint8_t[]){0x05, 0x00, 0x0D, 0xFF, 0x00}, 5);
+    CHECK_EQ(pdu[0], 0x05);
+    CHECK_EQ(decode_uint16_be(pdu + 3), 0xFF00);
+
+    /* coils 15-24 from 0b10_1100_1101, straddling a byte. */
+    pdu = request(1, (const uint8_t[]){0x0F, 0x00, 0x0F, 0x00, 0x0A, 0x02, 0xCD, 0x02}, 8);
+    CHECK_EQ(pdu[0], 0x0F);
+    CHECK_EQ(decode_uint16_be(pdu + 3), 10);
+
+    CHECK_EQ(tag_read(coils, device.tag_image, 0, value, 4), STATUS_OK);
+    CHECK_EQ(decode_uint32_le(value), (1u << 3) | (0x2CDu << 5));
+
+    /* coils 13-24 read back as 1, 0 and then the ten written. */
+    pdu = request(1, (const uint8_t[]){0x01, 0x00, 0x0D, 0x00, 0x0C}, 5);
+    CHECK_EQ(pdu[0], 0x01);
+    CHECK_EQ(pdu[1], 2);
+    CHECK_EQ(pdu[2], 0x35);
+    CHECK_EQ(pdu[3], 0x0B);
+
+    /* any other value for a single coil is refused. */
+    pdu = request(1, (const uint8_t[]){0x05, 0x00, 0x0D, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x85);
+    CHECK_EQ(pdu[1], 0x03);
+
+    /* 40 coils from address 10, so 49 is the last. */
+    pdu = request(1, (const uint8_t[]){0x01, 0x00, 0x31, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x01);
+    pdu = request(1, (const uint8_t[]){0x01, 0x00, 0x31, 0x00, 0x02}, 5);
+    CHECK_EQ(pdu[1], 0x02);
+
+    /* nothing is mapped as discrete inputs. */
+    pdu = request(1, (const uint8_t[]){0x02, 0x00, 0x0A, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x82);
+    CHECK_EQ(pdu[1], 0x02);
+}
+
+
+static void test_units(void)
+{
+    const uint8_t *pdu = NULL;
+
+    /* units 0 and 255 are the first device. */
+    pdu = request(0, (const uint8_t[]){0x03, 0x00, 0x00, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x03);
+    pdu = request(255, (const uint8_t[]){0x03, 0x00, 0x00, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x03);
+
+    pdu = request(2, (const uint8_t[]){0x03, 0x00, 0x00, 0x00, 0x01}, 5);
+    CHECK_EQ(pdu[0], 0x83);
+    CHECK_EQ(pdu[1], 0x0B);
+
+    pdu = request(1, (const uint8_t[]){0x07}, 1);
+    CHECK_EQ(pdu[0], 0x87);
+    CHECK_EQ(pdu[1], 0x01);
+}
+
+
+
+int main(void)
+{
+    debug_set_level(DEBUG_NONE);
+
+    test_map_parse();
+    test_frame_length();
+
+    setup();
+
+    test_malformed();
+    test_registers();
+    test_coils();
+    test_units();
+
+    teardown();
+
+    return UNIT_TEST_RESULT();
+}
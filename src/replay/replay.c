@@ -0,0 +1,1206 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef IS_WINDOWS
+    #include <sys/socket.h>
+#endif
+
+#include "eip/eip.h"
+#include "eip/eip_cm.h"
+#include "replay/replay.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/file_map.h"
+#include "util/proactor_net.h"
+#include "util/time_utils.h"
+
+
+#define REPLAY_TICK_MS (1)
+#define REPLAY_MAX_INTERFACES (16)
+#define REPLAY_STREAM_SIZE (EIP_MAX_PACKET_SIZE * 2)
+
+#define PCAP_MAGIC_US (0xA1B2C3D4)
+#define PCAP_MAGIC_NS (0xA1B23C4D)
+#define PCAPNG_BLOCK_SHB (0x0A0D0D0A)
+#define PCAPNG_BLOCK_IDB (0x00000001)
+#define PCAPNG_BLOCK_EPB (0x00000006)
+#define PCAPNG_BYTE_ORDER_MAGIC (0x1A2B3C4D)
+#define PCAPNG_OPT_IF_TSRESOL (9)
+
+#define LINKTYPE_ETHERNET (1)
+#define LINKTYPE_RAW (101)
+#define LINKTYPE_LINUX_SLL (113)
+#define LINKTYPE_IPV4 (228)
+
+#define ETHERTYPE_IPV4 (0x0800)
+#define ETHERTYPE_VLAN (0x8100)
+#define IP_PROTO_TCP (6)
+#define TCP_FLAG_SYN (0x02)
+
+#define CM_FORWARD_OPEN_REPLY (0x80 | EIP_CM_SRV_FORWARD_OPEN)
+#define CM_LARGE_FORWARD_OPEN_REPLY (0x80 | EIP_CM_SRV_LARGE_FORWARD_OPEN)
+
+
+
+/*
+ * Loading.  The capture is read in file order and each direction of each
+ * session is reassembled just well enough to cut it into EIP frames:
+ * retransmitted bytes are skipped and a gap throws away the partial frame.
+ */
+
+struct replay_interface_t {
+    uint16_t link_type;
+    uint64_t units_per_sec;
+};
+
+
+/* one direction of a session being loaded. */
+struct replay_stream_t {
+    bool have_seq;
+    uint32_t next_seq;
+    int64_t start_ns;
+    size_t len;
+    uint8_t data[REPLAY_STREAM_SIZE];
+};
+
+
+struct replay_flow_t {
+    struct replay_stream_t to_server;
+    struct replay_stream_t to_client;
+
+    /* the next request that still needs its recorded reply. */
+    uint32_t next_reply;
+};
+
+
+struct replay_loader_t {
+    struct replay_t *replay;
+    uint16_t server_port;
+
+    bool swapped;
+    uint32_t num_interfaces;
+    struct replay_interface_t interfaces[REPLAY_MAX_INTERFACES];
+
+    uint32_t flow_capacity;
+    struct replay_flow_t **flows;
+};
+
+
+static uint16_t get_u16(const struct replay_loader_t *loader, const uint8_t *p)
+{
+    return (loader->swapped ? decode_uint16_be(p) : decode_uint16_le(p));
+}
+
+
+static uint32_t get_u32(const struct replay_loader_t *loader, const uint8_t *p)
+{
+    if(loader->swapped) {
+        return ((uint32_t)decode_uint16_be(p) << 16) | decode_uint16_be(p + 2);
+    }
+
+    return decode_uint32_le(p);
+}
+
+
+static uint32_t get_u32_be(const uint8_t *p)
+{
+    return ((uint32_t)decode_uint16_be(p) << 16) | decode_uint16_be(p + 2);
+}
+
+
+static int64_t ticks_to_ns(uint64_t ticks, uint64_t units_per_sec)
+{
+    if(units_per_sec == 1000000000) {
+        return (int64_t)ticks;
+    }
+
+    return (int64_t)((ticks / units_per_sec) * 1000000000 + ((ticks % units_per_sec) * 1000000000) / units_per_sec);
+}
+
+
+/* requests that never get a reply. */
+static bool expects_reply(const uint8_t *req)
+{
+    return decode_uint16_le(req) != EIP_CMD_UNREGISTER_SESSION;
+}
+
+
+static struct replay_session_t *find_session(struct replay_loader_t *loader, uint32_t client_ip, uint16_t client_port, uint32_t server_ip, uint16_t server_port, bool create, struct replay_flow_t **flow)
+{
+    struct replay_t *replay = loader->replay;
+    struct replay_session_t *session = NULL;
+
+    for(uint32_t i = replay->num_sessions; i > 0; i--) {
+        session = replay->sessions[i - 1];
+
+        if(session->client_ip == client_ip && session->client_port == client_port && session->server_ip == server_ip && session->server_port == server_port) {
+            *flow = loader->flows[i - 1];
+            return session;
+        }
+    }
+
+    if(!create) {
+        return NULL;
+    }
+
+    if(replay->num_sessions >= replay->session_capacity) {
+        uint32_t capacity = (replay->session_capacity ? replay->session_capacity * 2 : 16);
+        struct replay_session_t **sessions = realloc(replay->sessions, capacity * sizeof(*sessions));
+        struct replay_flow_t **flows = NULL;
+
+        if(!sessions) {
+            return NULL;
+        }
+
+        replay->sessions = sessions;
+
+        if(!(flows = realloc(loader->flows, capacity * sizeof(*flows)))) {
+            return NULL;
+        }
+
+        loader->flows = flows;
+        replay->session_capacity = capacity;
+    }
+
+    if(!(session = calloc(1, sizeof(*session)))) {
+        return NULL;
+    }
+
+    if(!(*flow = calloc(1, sizeof(**flow)))) {
+        free(session);
+        return NULL;
+    }
+
+    session->replay = replay;
+    session->index = replay->num_sessions;
+    session->client_ip = client_ip;
+    session->client_port = client_port;
+    session->server_ip = server_ip;
+    session->server_port = server_port;
+
+    replay->sessions[replay->num_sessions] = session;
+    loader->flows[replay->num_sessions] = *flow;
+    replay->num_sessions++;
+
+    return session;
+}
+
+
+static uint8_t *copy_frame(const uint8_t *data, size_t len)
+{
+    uint8_t *copy = malloc(len);
+
+    if(copy) {
+        memcpy(copy, data, len);
+    }
+
+    return copy;
+}
+
+
+static status_t add_request(struct replay_session_t *session, const uint8_t *data, size_t len, int64_t time_ns)
+{
+    struct replay_frame_t *frame = NULL;
+
+    if(session->num_frames >= session->frame_capacity) {
+        uint32_t capacity = (session->frame_capacity ? session->frame_capacity * 2 : 64);
+        struct replay_frame_t *frames = realloc(session->frames, capacity * sizeof(*frames));
+
+        if(!frames) {
+            return STATUS_NO_RESOURCE;
+        }
+
+        session->frames = frames;
+        session->frame_capacity = capacity;
+    }
+
+    frame = &(session->frames[session->num_frames]);
+    memset(frame, 0, sizeof(*frame));
+
+    if(!(frame->req = copy_frame(data, len))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    frame->req_len = (uint32_t)len;
+    frame->time_ns = time_ns;
+
+    session->num_frames++;
+    session->replay->num_frames++;
+
+    return STATUS_OK;
+}
+
+
+static status_t add_reply(struct replay_session_t *session, struct replay_flow_t *flow, const uint8_t *data, size_t len)
+{
+    struct replay_frame_t *frame = NULL;
+
+    while(flow->next_reply < session->num_frames && !expects_reply(session->frames[flow->next_reply].req)) {
+        flow->next_reply++;
+    }
+
+    if(flow->next_reply >= session->num_frames) {
+        /* a reply to a request we did not see. */
+        return STATUS_OK;
+    }
+
+    frame = &(session->frames[flow->next_reply++]);
+
+    if(!(frame->resp = copy_frame(data, len))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    frame->resp_len = (uint32_t)len;
+
+    return STATUS_OK;
+}
+
+
+/* append a segment to one direction and hand out every whole frame in it. */
+static status_t add_segment(struct replay_session_t *session, struct replay_flow_t *flow, bool to_server, uint32_t seq, const uint8_t *data, size_t len, int64_t time_ns)
+{
+    status_t rc = STATUS_OK;
+    struct replay_stream_t *stream = (to_server ? &(flow->to_server) : &(flow->to_client));
+
+    if(!stream->have_seq) {
+        stream->have_seq = true;
+        stream->next_seq = seq;
+    }
+
+    /* retransmission or overlap. */
+    if((int32_t)(seq - stream->next_seq) < 0) {
+        uint32_t overlap = stream->next_seq - seq;
+
+        if(overlap >= len) {
+            return STATUS_OK;
+        }
+
+        data += overlap;
+        len -= overlap;
+    } else if(seq != stream->next_seq) {
+        detail("Gap of %u bytes in session %u, dropping a partial frame.", seq - stream->next_seq, session->index);
+        stream->len = 0;
+    }
+
+    stream->next_seq = seq + (uint32_t)len;
+
+    if(stream->len == 0) {
+        stream->start_ns = time_ns;
+    }
+
+    if(len > REPLAY_STREAM_SIZE - stream->len) {
+        warn("Session %u has more unframed data than any EIP frame, resetting the stream!", session->index);
+        stream->len = 0;
+        return STATUS_OK;
+    }
+
+    memcpy(stream->data + stream->len, data, len);
+    stream->len += len;
+
+    while(stream->len >= EIP_ENCAP_HEADER_SIZE) {
+        size_t frame_len = EIP_ENCAP_HEADER_SIZE + decode_uint16_le(stream->data + 2);
+
+        if(frame_len > EIP_MAX_PACKET_SIZE) {
+            warn("Frame of %zu bytes in session %u is too large, resetting the stream!", frame_len, session->index);
+            stream->len = 0;
+            break;
+        }
+
+        if(frame_len > stream->len) {
+            break;
+        }
+
+        if(to_server) {
+            rc = add_request(session, stream->data, frame_len, stream->start_ns);
+        } else {
+            rc = add_reply(session, flow, stream->data, frame_len);
+        }
+
+        if(rc != STATUS_OK) {
+            return rc;
+        }
+
+        memmove(stream->data, stream->data + frame_len, stream->len - frame_len);
+        stream->len -= frame_len;
+        stream->start_ns = time_ns;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* pull the TCP payload out of a captured IPv4 packet. */
+static status_t add_ip_packet(struct replay_loader_t *loader, const uint8_t *ip, size_t len, int64_t time_ns)
+{
+    size_t ip_header_len = 0;
+    size_t ip_len = 0;
+    size_t tcp_header_len = 0;
+    const uint8_t *tcp = NULL;
+    uint32_t src_ip = 0;
+    uint32_t dst_ip = 0;
+    uint16_t src_port = 0;
+    uint16_t dst_port = 0;
+    uint32_t seq = 0;
+    struct replay_session_t *session = NULL;
+    struct replay_flow_t *flow = NULL;
+    bool to_server = false;
+
+    if(len < 20 || (ip[0] >> 4) != 4 || ip[9] != IP_PROTO_TCP) {
+        return STATUS_OK;
+    }
+
+    /* fragments are rare enough on EIP links to just skip. */
+    if(decode_uint16_be(ip + 6) & 0x3FFF) {
+        return STATUS_OK;
+    }
+
+    ip_header_len = (size_t)(ip[0] & 0x0F) * 4;
+    ip_len = decode_uint16_be(ip + 2);
+
+    /* TSO captures can have a zero total length. */
+    if(ip_len == 0 || ip_len > len) {
+        ip_len = len;
+    }
+
+    if(ip_header_len < 20 || ip_len < ip_header_len + 20) {
+        return STATUS_OK;
+    }
+
+    tcp = ip + ip_header_len;
+    tcp_header_len = (size_t)(tcp[12] >> 4) * 4;
+
+    if(tcp_header_len < 20 || ip_len < ip_header_len + tcp_header_len) {
+        return STATUS_OK;
+    }
+
+    memcpy(&src_ip, ip + 12, 4);
+    memcpy(&dst_ip, ip + 16, 4);
+    memcpy(&src_port, tcp, 2);
+    memcpy(&dst_port, tcp + 2, 2);
+    seq = get_u32_be(tcp + 4);
+
+    if(decode_uint16_be(tcp + 2) == loader->server_port) {
+        to_server = true;
+        session = find_session(loader, src_ip, src_port, dst_ip, dst_port, true, &flow);
+    } else if(decode_uint16_be(tcp) == loader->server_port) {
+        session = find_session(loader, dst_ip, dst_port, src_ip, src_port, false, &flow);
+    } else {
+        return STATUS_OK;
+    }
+
+    if(!session) {
+        return (to_server ? STATUS_NO_RESOURCE : STATUS_OK);
+    }
+
+    /* the SYN takes up a sequence number. */
+    if(tcp[13] & TCP_FLAG_SYN) {
+        struct replay_stream_t *stream = (to_server ? &(flow->to_server) : &(flow->to_client));
+
+        stream->have_seq = true;
+        stream->next_seq = seq + 1;
+        stream->len = 0;
+
+        return STATUS_OK;
+    }
+
+    if(ip_len == ip_header_len + tcp_header_len) {
+        return STATUS_OK;
+    }
+
+    return add_segment(session, flow, to_server, seq, tcp + tcp_header_len, ip_len - ip_header_len - tcp_header_len, time_ns);
+}
+
+
+static status_t add_link_packet(struct replay_loader_t *loader, uint16_t link_type, const uint8_t *data, size_t len, int64_t time_ns)
+{
+    size_t offset = 0;
+    uint16_t ether_type = 0;
+
+    switch(link_type) {
+        case LINKTYPE_ETHERNET:
+            if(len < 14) {
+                return STATUS_OK;
+            }
+
+            ether_type = decode_uint16_be(data + 12);
+            offset = 14;
+
+            if(ether_type == ETHERTYPE_VLAN && len >= 18) {
+                ether_type = decode_uint16_be(data + 16);
+                offset = 18;
+            }
+
+            break;
+
+        case LINKTYPE_LINUX_SLL:
+            if(len < 16) {
+                return STATUS_OK;
+            }
+
+            ether_type = decode_uint16_be(data + 14);
+            offset = 16;
+            break;
+
+        case LINKTYPE_RAW:
+        case LINKTYPE_IPV4:
+            ether_type = ETHERTYPE_IPV4;
+            break;
+
+        default:
+            return STATUS_OK;
+    }
+
+    if(ether_type != ETHERTYPE_IPV4) {
+        return STATUS_OK;
+    }
+
+    return add_ip_packet(loader, data + offset, len - offset, time_ns);
+}
+
+
+static status_t load_pcap(struct replay_loader_t *loader, const uint8_t *data, size_t size)
+{
+    status_t rc = STATUS_OK;
+    uint32_t magic = decode_uint32_le(data);
+    uint64_t units_per_sec = 1000000;
+    uint16_t link_type = 0;
+    size_t offset = 24;
+
+    loader->swapped = (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS);
+    magic = get_u32(loader, data);
+    units_per_sec = (magic == PCAP_MAGIC_NS ? 1000000000 : 1000000);
+    link_type = (uint16_t)get_u32(loader, data + 20);
+
+    while(rc == STATUS_OK && offset + 16 <= size) {
+        int64_t time_ns = (int64_t)get_u32(loader, data + offset) * 1000000000 + ticks_to_ns(get_u32(loader, data + offset + 4), units_per_sec);
+        uint32_t cap_len = get_u32(loader, data + offset + 8);
+
+        offset += 16;
+
+        if(cap_len > size - offset) {
+            warn("Capture is truncated!");
+            break;
+        }
+
+        rc = add_link_packet(loader, link_type, data + offset, cap_len, time_ns);
+        offset += cap_len;
+    }
+
+    return rc;
+}
+
+
+static void add_interface(struct replay_loader_t *loader, const uint8_t *block, uint32_t block_len)
+{
+    struct replay_interface_t *iface = NULL;
+    size_t offset = 16;
+
+    if(loader->num_interfaces >= REPLAY_MAX_INTERFACES || block_len < 20) {
+        warn("Too many or bad interface blocks, ignoring one!");
+        return;
+    }
+
+    iface = &(loader->interfaces[loader->num_interfaces++]);
+    iface->link_type = get_u16(loader, block + 8);
+    iface->units_per_sec = 1000000;
+
+    while(offset + 4 <= (size_t)block_len - 4) {
+        uint16_t code = get_u16(loader, block + offset);
+        uint16_t opt_len = get_u16(loader, block + offset + 2);
+
+        if(code == 0) {
+            break;
+        }
+
+        if(code == PCAPNG_OPT_IF_TSRESOL && opt_len >= 1) {
+            uint8_t resol = block[offset + 4];
+
+            iface->units_per_sec = 1;
+
+            for(uint8_t i = 0; i < (resol & 0x7F) && i < 63; i++) {
+                iface->units_per_sec *= ((resol & 0x80) ? 2 : 10);
+            }
+        }
+
+        offset += 4 + (((size_t)opt_len + 3) & ~(size_t)3);
+    }
+}
+
+
+static status_t load_pcapng(struct replay_loader_t *loader, const uint8_t *data, size_t size)
+{
+    status_t rc = STATUS_OK;
+    size_t offset = 0;
+
+    while(rc == STATUS_OK && offset + 12 <= size) {
+        const uint8_t *block = data + offset;
+        uint32_t block_type = decode_uint32_le(block);
+        uint32_t block_len = 0;
+
+        /* each section sets the byte order and starts the interface list over. */
+        if(block_type == PCAPNG_BLOCK_SHB) {
+            loader->swapped = (decode_uint32_le(block + 8) != PCAPNG_BYTE_ORDER_MAGIC);
+            loader->num_interfaces = 0;
+        }
+
+        block_type = get_u32(loader, block);
+        block_len = get_u32(loader, block + 4);
+
+        if(block_len < 12 || block_len > size - offset) {
+            warn("Capture is truncated or corrupt at offset %zu!", offset);
+            break;
+        }
+
+        if(block_type == PCAPNG_BLOCK_IDB) {
+            add_interface(loader, block, block_len);
+        } else if(block_type == PCAPNG_BLOCK_EPB && block_len >= 32) {
+            uint32_t iface_id = get_u32(loader, block + 8);
+            uint64_t ticks = ((uint64_t)get_u32(loader, block + 12) << 32) | get_u32(loader, block + 16);
+            uint32_t cap_len = get_u32(loader, block + 20);
+
+            if(iface_id < loader->num_interfaces && cap_len <= block_len - 32) {
+                struct replay_interface_t *iface = &(loader->interfaces[iface_id]);
+
+                rc = add_link_packet(loader, iface->link_type, block + 28, cap_len, ticks_to_ns(ticks, iface->units_per_sec));
+            }
+        }
+
+        offset += block_len;
+    }
+
+    return rc;
+}
+
+
+struct replay_t *replay_load(const char *path, uint16_t server_port)
+{
+    status_t rc = STATUS_OK;
+    struct file_map_t map = {0};
+    struct replay_loader_t loader = {0};
+    struct replay_t *replay = NULL;
+    int64_t first_ns = INT64_MAX;
+
+    info("Starting.");
+
+    do {
+        if(!path) {
+            warn("Called with a NULL path!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(!(replay = calloc(1, sizeof(*replay)))) {
+            warn("Unable to allocate replay state!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if((rc = file_map_open(&map, path)) != STATUS_OK) {
+            warn("Unable to open capture %s!", path);
+            break;
+        }
+
+        if(map.size < 24) {
+            warn("Capture %s is too short!", path);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        loader.replay = replay;
+        loader.server_port = server_port;
+
+        if(decode_uint32_le(map.data) == PCAPNG_BLOCK_SHB) {
+            rc = load_pcapng(&loader, map.data, map.size);
+        } else {
+            uint32_t magic = decode_uint32_le(map.data);
+            uint32_t swapped_magic = get_u32_be(map.data);
+
+            if(magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS && swapped_magic != PCAP_MAGIC_US && swapped_magic != PCAP_MAGIC_NS) {
+                warn("%s is neither a pcapng nor a pcap file!", path);
+                rc = STATUS_BAD_INPUT;
+                break;
+            }
+
+            rc = load_pcap(&loader, map.data, map.size);
+        }
+
+        if(rc != STATUS_OK) {
+            warn("Error %s loading capture %s!", status_to_str(rc), path);
+            break;
+        }
+    } while(0);
+
+    file_map_close(&map);
+
+    for(uint32_t i = 0; i < (replay ? replay->num_sessions : 0); i++) {
+        free(loader.flows[i]);
+    }
+
+    free(loader.flows);
+
+    if(rc != STATUS_OK) {
+        replay_dispose(replay);
+        info("Done with status %s.", status_to_str(rc));
+        return NULL;
+    }
+
+    /* request times count from the first request of the whole capture. */
+    for(uint32_t i = 0; i < replay->num_sessions; i++) {
+        if(replay->sessions[i]->num_frames && replay->sessions[i]->frames[0].time_ns < first_ns) {
+            first_ns = replay->sessions[i]->frames[0].time_ns;
+        }
+    }
+
+    for(uint32_t i = 0; i < replay->num_sessions; i++) {
+        struct replay_session_t *session = replay->sessions[i];
+
+        for(uint32_t f = 0; f < session->num_frames; f++) {
+            session->frames[f].time_ns -= first_ns;
+        }
+
+        /* nothing to send, nothing to wait for. */
+        if(session->num_frames == 0) {
+            session->done = true;
+            replay->num_done++;
+        }
+    }
+
+    info("Loaded %u sessions with %llu requests from %s.", replay->num_sessions, (unsigned long long)replay->num_frames, path);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return replay;
+}
+
+
+void replay_dispose(struct replay_t *replay)
+{
+    if(!replay) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < replay->num_sessions; i++) {
+        struct replay_session_t *session = replay->sessions[i];
+
+        for(uint32_t f = 0; f < session->num_frames; f++) {
+            free(session->frames[f].req);
+            free(session->frames[f].resp);
+        }
+
+        free(session->frames);
+        free(session);
+    }
+
+    free(replay->sessions);
+    free(replay);
+}
+
+
+
+/*
+ * Replaying.  Everything runs on one proactor loop on the calling thread.
+ * The loop tick starts sessions and sends requests that have come due, a
+ * reply sends the next request straight away if it is already due.
+ */
+
+static void pump_session(struct replay_session_t *session, int64_t now_ns);
+
+
+/* find a CPF item in a SendRRData or SendUnitData frame.  Returns the offset of its data or zero. */
+static size_t find_item(const uint8_t *frame, size_t len, uint16_t item_type, uint16_t *item_len)
+{
+    uint16_t command = decode_uint16_le(frame);
+    size_t offset = EIP_ENCAP_HEADER_SIZE + 4 + 2;
+    uint16_t item_count = 0;
+
+    if((command != EIP_CMD_SEND_RR_DATA && command != EIP_CMD_SEND_UNIT_DATA) || len < offset + 2) {
+        return 0;
+    }
+
+    item_count = decode_uint16_le(frame + offset);
+    offset += 2;
+
+    for(uint16_t i = 0; i < item_count && offset + 4 <= len; i++) {
+        uint16_t type = decode_uint16_le(frame + offset);
+        uint16_t size = decode_uint16_le(frame + offset + 2);
+
+        offset += 4;
+
+        if(type == item_type && offset + size <= len) {
+            *item_len = size;
+            return offset;
+        }
+
+        offset += size;
+    }
+
+    return 0;
+}
+
+
+/* the offset of the connection IDs in a successful Forward Open reply, zero if it is not one. */
+static size_t forward_open_ids(const uint8_t *frame, size_t len)
+{
+    uint16_t item_len = 0;
+    size_t offset = find_item(frame, len, CPF_ITEM_UNCONNECTED_DATA, &item_len);
+
+    if(!offset || item_len < 12) {
+        return 0;
+    }
+
+    if((frame[offset] != CM_FORWARD_OPEN_REPLY && frame[offset] != CM_LARGE_FORWARD_OPEN_REPLY) || frame[offset + 2] != 0) {
+        return 0;
+    }
+
+    return offset + 4;
+}
+
+
+/* put the live session handle and connection IDs into a recorded request. */
+static void rewrite_request(struct replay_session_t *session, uint8_t *req, size_t len)
+{
+    uint16_t item_len = 0;
+    size_t offset = 0;
+
+    /* without a recorded reply any handle the client used gets replaced. */
+    if(session->live_session && (decode_uint32_le(req + 4) == session->recorded_session || !session->recorded_session)) {
+        encode_uint32_le(req + 4, session->live_session);
+    }
+
+    if(session->num_conn_ids && (offset = find_item(req, len, CPF_ITEM_CONNECTED_ADDRESS, &item_len)) && item_len == 4) {
+        uint32_t conn_id = decode_uint32_le(req + offset);
+
+        for(uint32_t i = 0; i < session->num_conn_ids; i++) {
+            if(session->recorded_conn_ids[i] == conn_id) {
+                encode_uint32_le(req + offset, session->live_conn_ids[i]);
+                break;
+            }
+        }
+    }
+}
+
+
+/* learn what the simulator picked that later requests have to carry. */
+static void learn_from_reply(struct replay_session_t *session, const struct replay_frame_t *frame, const uint8_t *live, size_t live_len)
+{
+    size_t recorded_ids = 0;
+    size_t live_ids = 0;
+
+    if(decode_uint16_le(live) == EIP_CMD_REGISTER_SESSION) {
+        session->live_session = decode_uint32_le(live + 4);
+        session->recorded_session = (frame->resp ? decode_uint32_le(frame->resp + 4) : 0);
+        return;
+    }
+
+    if(!frame->resp || session->num_conn_ids >= REPLAY_MAX_CONN_IDS) {
+        return;
+    }
+
+    recorded_ids = forward_open_ids(frame->resp, frame->resp_len);
+    live_ids = forward_open_ids(live, live_len);
+
+    /* the O->T ID is the one the client puts on its connected requests. */
+    if(recorded_ids && live_ids) {
+        session->recorded_conn_ids[session->num_conn_ids] = decode_uint32_le(frame->resp + recorded_ids);
+        session->live_conn_ids[session->num_conn_ids] = decode_uint32_le(live + live_ids);
+        session->num_conn_ids++;
+    }
+}
+
+
+/* the first byte that differs, ignoring the session handle and connection IDs.  -1 if they match. */
+static int64_t compare_reply(const struct replay_frame_t *frame, const uint8_t *live, size_t live_len)
+{
+    size_t recorded_ids = forward_open_ids(frame->resp, frame->resp_len);
+    size_t live_ids = forward_open_ids(live, live_len);
+    size_t len = (live_len < frame->resp_len ? live_len : frame->resp_len);
+
+    for(size_t i = 0; i < len; i++) {
+        if(i >= 4 && i < 8) {
+            continue;
+        }
+
+        if(recorded_ids && recorded_ids == live_ids && i >= recorded_ids && i < recorded_ids + 8) {
+            continue;
+        }
+
+        if(live[i] != frame->resp[i]) {
+            return (int64_t)i;
+        }
+    }
+
+    return (live_len == frame->resp_len ? -1 : (int64_t)len);
+}
+
+
+static void finish_session(struct replay_session_t *session)
+{
+    struct replay_t *replay = session->replay;
+
+    if(session->done) {
+        return;
+    }
+
+    session->done = true;
+    replay->num_done++;
+
+    if(session->socket) {
+        proactor_net_socket_close(session->socket);
+        session->socket = NULL;
+    }
+
+    if(replay->num_done >= replay->num_sessions) {
+        replay->end_ns = util_clock_ns();
+        proactor_net_stop(replay->proactor);
+    }
+}
+
+
+static void handle_reply(struct replay_session_t *session, const uint8_t *live, size_t live_len, int64_t now_ns)
+{
+    struct replay_t *replay = session->replay;
+    struct replay_frame_t *frame = &(session->frames[session->next_frame]);
+    int64_t diff_offset = 0;
+
+    histogram_record(&(replay->latency), (uint64_t)(now_ns - session->sent_ns));
+    replay->replies++;
+
+    /* the handle and IDs can still be good even if something else differs. */
+    learn_from_reply(session, frame, live, live_len);
+
+    if(!frame->resp) {
+        replay->replies_unrecorded++;
+    } else if((diff_offset = compare_reply(frame, live, live_len)) < 0) {
+        replay->replies_matched++;
+    } else {
+        replay->replies_different++;
+
+        if(replay->num_diffs < REPLAY_MAX_DIFFS) {
+            struct replay_diff_t *diff = &(replay->diffs[replay->num_diffs++]);
+
+            diff->session = session->index;
+            diff->frame = session->next_frame;
+            diff->offset = (uint32_t)diff_offset;
+            diff->recorded_len = frame->resp_len;
+            diff->live_len = (uint32_t)live_len;
+        }
+    }
+
+    session->waiting = false;
+    session->next_frame++;
+}
+
+
+static status_t start_receive(struct replay_session_t *session)
+{
+    session->rx_buf.data = session->rx_data + session->rx_len;
+    session->rx_buf.data_length = sizeof(session->rx_data) - session->rx_len;
+
+    return proactor_net_start_receive(session->socket, &(session->rx_buf));
+}
+
+
+static status_t on_receive(struct proactor_socket_t *socket, struct sockaddr *remote_addr, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct replay_session_t *session = (struct replay_session_t *)sock_data;
+    int64_t now_ns = util_clock_now_ns();
+
+    if(status != STATUS_OK) {
+        warn("Error %s receiving in session %u!", status_to_str(status), session->index);
+        session->replay->errors++;
+        finish_session(session);
+        return status;
+    }
+
+    session->rx_len += buffer->data_length;
+
+    while(session->rx_len >= EIP_ENCAP_HEADER_SIZE) {
+        size_t frame_len = EIP_ENCAP_HEADER_SIZE + decode_uint16_le(session->rx_data + 2);
+
+        if(frame_len > sizeof(session->rx_data)) {
+            warn("Reply of %zu bytes in session %u is too large!", frame_len, session->index);
+            session->replay->errors++;
+            finish_session(session);
+            return STATUS_OK;
+        }
+
+        if(frame_len > session->rx_len) {
+            break;
+        }
+
+        if(session->waiting) {
+            handle_reply(session, session->rx_data, frame_len, now_ns);
+        } else {
+            warn("Unexpected reply in session %u!", session->index);
+            session->replay->errors++;
+        }
+
+        memmove(session->rx_data, session->rx_data + frame_len, session->rx_len - frame_len);
+        session->rx_len -= frame_len;
+    }
+
+    if(start_receive(session) != STATUS_OK) {
+        session->replay->errors++;
+        finish_session(session);
+        return STATUS_OK;
+    }
+
+    pump_session(session, now_ns);
+
+    return STATUS_OK;
+}
+
+
+static status_t on_sent(struct proactor_socket_t *socket, proactor_buf_t *buffer, status_t status, void *sock_data, void *app_data)
+{
+    struct replay_session_t *session = (struct replay_session_t *)sock_data;
+
+    session->sending = false;
+
+    if(status != STATUS_OK) {
+        warn("Error %s sending in session %u!", status_to_str(status), session->index);
+        session->replay->errors++;
+        finish_session(session);
+        return status;
+    }
+
+    pump_session(session, util_clock_now_ns());
+
+    return STATUS_OK;
+}
+
+
+static status_t on_close(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data)
+{
+    struct replay_session_t *session = (struct replay_session_t *)sock_data;
+
+    /* the server closing after the last request is normal. */
+    if(!session->done && session->next_frame < session->num_frames) {
+        warn("Session %u closed by the server after %u of %u requests!", session->index, session->next_frame, session->num_frames);
+        session->replay->errors++;
+    }
+
+    proactor_net_socket_close(socket);
+    session->socket = NULL;
+
+    finish_session(session);
+
+    return STATUS_OK;
+}
+
+
+static status_t start_session(struct replay_session_t *session)
+{
+    struct replay_t *replay = session->replay;
+    status_t rc = STATUS_OK;
+
+    session->started = true;
+
+    rc = proactor_net_socket_open(replay->proactor, &(session->socket), PROACTOR_SOCK_TCP_CLIENT, replay->address, replay->port, session, replay);
+    if(rc != STATUS_OK) {
+        warn("Error %s connecting session %u to %s:%u!", status_to_str(rc), session->index, replay->address, replay->port);
+        session->socket = NULL;
+        return rc;
+    }
+
+    proactor_net_socket_set_receive_callback(session->socket, on_receive);
+    proactor_net_socket_set_sent_callback(session->socket, on_sent);
+    proactor_net_socket_set_close_callback(session->socket, on_close);
+
+    return start_receive(session);
+}
+
+
+static bool frame_due(struct replay_session_t *session, int64_t now_ns)
+{
+    struct replay_t *replay = session->replay;
+
+    if(replay->speed <= 0.0) {
+        return true;
+    }
+
+    return now_ns - replay->start_ns >= (int64_t)((double)session->frames[session->next_frame].time_ns / replay->speed);
+}
+
+
+/* start the session and send its next request if it is due. */
+static void pump_session(struct replay_session_t *session, int64_t now_ns)
+{
+    struct replay_t *replay = session->replay;
+    struct replay_frame_t *frame = NULL;
+
+    while(!session->done && !session->waiting && !session->sending) {
+        if(session->next_frame >= session->num_frames) {
+            finish_session(session);
+            return;
+        }
+
+        if(!frame_due(session, now_ns)) {
+            return;
+        }
+
+        if(!session->started && start_session(session) != STATUS_OK) {
+            replay->errors++;
+            finish_session(session);
+            return;
+        }
+
+        frame = &(session->frames[session->next_frame]);
+
+        memcpy(session->tx_data, frame->req, frame->req_len);
+        rewrite_request(session, session->tx_data, frame->req_len);
+
+        session->tx_buf.data = session->tx_data;
+        session->tx_buf.data_length = frame->req_len;
+        session->sent_ns = now_ns;
+        session->sending = true;
+
+        if(proactor_net_start_send(session->socket, &(session->tx_buf)) != STATUS_OK) {
+            replay->errors++;
+            finish_session(session);
+            return;
+        }
+
+        replay->requests_sent++;
+
+        if(expects_reply(frame->req)) {
+            session->waiting = true;
+        } else {
+            session->next_frame++;
+        }
+    }
+}
+
+
+static status_t on_proactor_event(struct proactor_t *proactor, proactor_event_t event, status_t status, void *app_data)
+{
+    struct replay_t *replay = (struct replay_t *)app_data;
+    int64_t now_ns = 0;
+
+    if(event != PROACTOR_EVENT_TICK && event != PROACTOR_EVENT_TIMEOUT) {
+        return STATUS_OK;
+    }
+
+    now_ns = util_clock_now_ns();
+
+    for(uint32_t i = 0; i < replay->num_sessions; i++) {
+        pump_session(replay->sessions[i], now_ns);
+    }
+
+    return STATUS_OK;
+}
+
+
+status_t replay_run(struct replay_t *replay, const char *address, uint16_t port, double speed)
+{
+    status_t rc = STATUS_OK;
+
+    info("Starting.");
+
+    do {
+        if(!replay || !address) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        replay->address = address;
+        replay->port = port;
+        replay->speed = speed;
+
+        if(replay->num_done >= replay->num_sessions) {
+            info("Nothing to replay.");
+            break;
+        }
+
+        if(!(replay->proactor = proactor_net_create(on_proactor_event, NULL, replay, REPLAY_TICK_MS))) {
+            warn("Unable to create the proactor!");
+            rc = STATUS_SETUP_FAILURE;
+            break;
+        }
+
+        replay->start_ns = util_clock_ns();
+
+        proactor_net_run(replay->proactor);
+
+        if(!replay->end_ns) {
+            replay->end_ns = util_clock_ns();
+        }
+
+        rc = proactor_net_get_status(replay->proactor);
+
+        proactor_net_dispose(replay->proactor);
+        replay->proactor = NULL;
+    } while(0);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+void replay_report(struct replay_t *replay, FILE *out)
+{
+    double seconds = 0.0;
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+
+    if(!replay || !out) {
+        return;
+    }
+
+    seconds = (double)(replay->end_ns - replay->start_ns) / 1000000000.0;
+
+    fprintf(out, "Replayed %u sessions, %llu of %llu requests in %.3f s", replay->num_sessions, (unsigned long long)replay->requests_sent, (unsigned long long)replay->num_frames, seconds);
+
+    if(replay->speed > 0.0) {
+        fprintf(out, " at %gx.\n", replay->speed);
+    } else {
+        fprintf(out, " as fast as possible.\n");
+    }
+
+    if(seconds > 0.0) {
+        fprintf(out, "Throughput: %.1f requests/s.\n", (double)replay->requests_sent / seconds);
+    }
+
+    fprintf(out, "Replies: %llu, matched %llu, different %llu, not recorded %llu.  Errors: %llu.\n",
+            (unsigned long long)replay->replies,
+            (unsigned long long)replay->replies_matched,
+            (unsigned long long)replay->replies_different,
+            (unsigned long long)replay->replies_unrecorded,
+            (unsigned long long)replay->errors);
+
+    fprintf(out, "Latency (us): min %.1f", (double)replay->latency.min / 1000.0);
+
+    for(size_t i = 0; i < sizeof(percentiles)/sizeof(percentiles[0]); i++) {
+        fprintf(out, ", p%g %.1f", percentiles[i], (double)histogram_percentile(&(replay->latency), percentiles[i]) / 1000.0);
+    }
+
+    fprintf(out, ", max %.1f, mean %.1f.\n", (double)replay->latency.max / 1000.0, histogram_mean(&(replay->latency)) / 1000.0);
+
+    for(uint32_t i = 0; i < replay->num_diffs; i++) {
+        struct replay_diff_t *diff = &(replay->diffs[i]);
+
+        fprintf(out, "  session %u request %u: first difference at byte %u, recorded %u bytes, live %u bytes.\n",
+                diff->session, diff->frame, diff->offset, diff->recorded_len, diff->live_len);
+    }
+
+    if(replay->replies_different > replay->num_diffs) {
+        fprintf(out, "  ... and %llu more.\n", (unsigned long long)(replay->replies_different - replay->num_diffs));
+    }
+}
@@ -0,0 +1,143 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "eip/eip.h"
+#include "util/buf.h"
+#include "util/histogram.h"
+#include "util/status.h"
+
+
+/*
+ * Replay of recorded EIP client sessions.
+ *
+ * A pcapng capture is split into TCP sessions to the EIP port and each
+ * session into request frames and the replies recorded for them.  Every
+ * session is replayed on its own client socket.  Requests keep their
+ * recorded spacing divided by the speed, or go out as soon as the previous
+ * reply is in when the speed is zero, but never before that reply.  The
+ * session handle and connection IDs from live replies are put into later
+ * requests.  Live replies are compared with the recorded ones, ignoring
+ * the fields the simulator picks itself.
+ */
+
+#define REPLAY_MAX_CONN_IDS (8)
+#define REPLAY_MAX_DIFFS (16)
+
+
+struct proactor_t;
+struct proactor_socket_t;
+struct replay_t;
+
+
+struct replay_frame_t {
+    /* when the request was seen, relative to the first request in the capture. */
+    int64_t time_ns;
+
+    uint8_t *req;
+    uint32_t req_len;
+
+    /* the recorded reply, NULL if none was captured. */
+    uint8_t *resp;
+    uint32_t resp_len;
+};
+
+
+struct replay_session_t {
+    struct replay_t *replay;
+    uint32_t index;
+
+    /* the recorded tuple, network byte order. */
+    uint32_t client_ip;
+    uint32_t server_ip;
+    uint16_t client_port;
+    uint16_t server_port;
+
+    uint32_t num_frames;
+    uint32_t frame_capacity;
+    struct replay_frame_t *frames;
+
+    /* live state. */
+    struct proactor_socket_t *socket;
+    bool started;
+    bool done;
+    bool sending;
+    bool waiting;
+    uint32_t next_frame;
+    int64_t sent_ns;
+
+    uint32_t recorded_session;
+    uint32_t live_session;
+    uint32_t num_conn_ids;
+    uint32_t recorded_conn_ids[REPLAY_MAX_CONN_IDS];
+    uint32_t live_conn_ids[REPLAY_MAX_CONN_IDS];
+
+    size_t rx_len;
+    proactor_buf_t rx_buf;
+    proactor_buf_t tx_buf;
+    uint8_t rx_data[EIP_MAX_PACKET_SIZE];
+    uint8_t tx_data[EIP_MAX_PACKET_SIZE];
+};
+
+
+/* a reply that did not match, by session and frame index. */
+struct replay_diff_t {
+    uint32_t session;
+    uint32_t frame;
+    uint32_t offset;
+    uint32_t recorded_len;
+    uint32_t live_len;
+};
+
+
+struct replay_t {
+    uint32_t num_sessions;
+    uint32_t session_capacity;
+    struct replay_session_t **sessions;
+    uint64_t num_frames;
+
+    /* set by replay_run(). */
+    const char *address;
+    uint16_t port;
+    double speed;
+    struct proactor_t *proactor;
+    int64_t start_ns;
+    int64_t end_ns;
+    uint32_t num_done;
+
+    struct histogram_t latency;
+    uint64_t requests_sent;
+    uint64_t replies;
+    uint64_t replies_matched;
+    uint64_t replies_different;
+    uint64_t replies_unrecorded;
+    uint64_t errors;
+
+    uint32_t num_diffs;
+    struct replay_diff_t diffs[REPLAY_MAX_DIFFS];
+};
+
+
+extern struct replay_t *replay_load(const char *path, uint16_t server_port);
+extern void replay_dispose(struct replay_t *replay);
+
+extern status_t replay_run(struct replay_t *replay, const char *address, uint16_t port, double speed);
+extern void replay_report(struct replay_t *replay, FILE *out);
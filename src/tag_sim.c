@@ -0,0 +1,847 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device/device.h"
+#include "device/device_host.h"
+#include "eip/eip.h"
+#include "eip/eip_capture.h"
+#include "io/io_sched.h"
+#include "metrics/metrics.h"
+#include "modbus/modbus.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "tags/tag_import.h"
+#include "tags/tag_snapshot.h"
+#include "tags/value_gen.h"
+#include "util/debug.h"
+#include "util/shims.h"
+#include "util/status.h"
+#include "util/time_utils.h"
+
+
+#define MAX_TAG_SPECS (256)
+#define MAX_DEVICE_SPECS (64)
+
+
+struct tag_spec_t {
+    char name[128];
+    uint16_t type;
+    uint32_t elem_count;
+
+    bool has_gen;
+    struct value_gen_config_t gen;
+};
+
+
+struct device_spec_t {
+    uint32_t count;
+    uint32_t address[4];
+    bool any_address;
+    uint16_t port;
+};
+
+
+static struct device_host_t *host = NULL;
+
+static struct tag_spec_t tag_specs[MAX_TAG_SPECS];
+static uint32_t num_tag_specs = 0;
+
+static struct device_spec_t device_specs[MAX_DEVICE_SPECS];
+static uint32_t num_device_specs = 0;
+
+static uint32_t num_loops = 1;
+static int64_t slow_callback_ns = 0;
+static uint32_t slots_per_chassis = 0;
+static bool use_tsc = false;
+static int64_t virtual_start_ns = 0;
+
+static bool io_enabled = false;
+static struct io_sched_config_t io_config;
+static char io_xdp_ifname[32];
+
+static bool modbus_enabled = false;
+static char modbus_address[32] = "0.0.0.0";
+static uint16_t modbus_port = MODBUS_DEFAULT_PORT;
+static struct modbus_map_t modbus_map;
+
+static bool metrics_enabled = false;
+static char metrics_address[32] = "0.0.0.0";
+static uint16_t metrics_port = 0;
+static const char *metrics_socket_path = NULL;
+
+static const char *capture_path = NULL;
+
+static const char *import_path = NULL;
+static uint32_t import_workers = 4;
+
+static const char *snapshot_path = NULL;
+static const char *save_snapshot_path = NULL;
+static uint32_t snapshot_interval_s = 0;
+static struct tag_snapshot_t *snapshot = NULL;
+
+static volatile sig_atomic_t snapshot_requested = 0;
+static volatile bool stopping = false;
+
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tag_sim [options]\n"
+                    "  --debug=[<subsystem>:]<level>      Debug level 0 (none) to 4 (flood), for everything or\n"
+                    "                                     one of proactor, eip, cip, tags or io.\n"
+                    "  --debug-peer=<ipv4>[:<level>]      Log connections from this client at <level>\n"
+                    "                                     (default 4) whatever the other levels are.\n"
+                    "  --loops=<n>                        Number of proactor loop threads.\n"
+                    "  --slow-callback=<us>               Warn about any callback that holds up a loop for at\n"
+                    "                                     least <us> microseconds.\n"
+                    "  --clock=monotonic|tsc              Time source for timers and measurements.  tsc reads\n"
+                    "                                     the calibrated CPU counter where it is invariant.\n"
+                    "  --virtual-time[=<seconds>]         Run on a virtual clock starting at <seconds> (default 1)\n"
+                    "                                     that jumps to the next timer whenever every loop is\n"
+                    "                                     idle.  For faster than real time test runs.\n"
+                    "  --device=<address>[:<port>]        Add one simulated device.\n"
+                    "  --devices=<n>@<address>[:<port>]   Add n devices.  A specific IPv4 address is\n"
+                    "                                     incremented per device (use IP aliases),\n"
+                    "                                     0.0.0.0 keeps the address and increments the port.\n"
+                    "  --chassis=<slots>                  Put each run of <slots> devices in one chassis,\n"
+                    "                                     reachable from each other through backplane\n"
+                    "                                     port 1 with Unconnected Send or Forward Open.\n"
+                    "  --tag=<name>:<type>[:<count>]      Define a tag on every device, e.g. --tag=Counts:DINT:100\n"
+                    "  --tag=<name>:<type>=<generator>    Define a read only scalar tag whose value is generated\n"
+                    "                                     when read, one of sine(<min>,<max>,<period_ms>),\n"
+                    "                                     ramp(<min>,<max>,<period_ms>),\n"
+                    "                                     counter(<min>,<max>,<increment>,<interval_ms>),\n"
+                    "                                     walk(<min>,<max>,<step>,<interval_ms>[,<seed>]) or\n"
+                    "                                     step(<interval_ms>,<value>,...).\n"
+                    "  --import=<path>                    Define the tags from an L5X or tag CSV export\n"
+                    "                                     instead of --tag options.\n"
+                    "  --import-workers=<n>               Threads used to parse the import (default 4).\n"
+                    "  --snapshot=<path>                  Map the tag database and values from a snapshot.\n"
+                    "  --save-snapshot=<path>             Write a snapshot of the first device at startup.\n"
+                    "  --snapshot-interval=<seconds>      Rewrite the snapshot periodically while running.\n"
+                    "                                     SIGUSR1 also triggers a rewrite.\n"
+                    "  --io                               Accept class 1 I/O connections, producing on UDP 2222.\n"
+                    "  --io-tick-us=<n>                   I/O scheduler resolution in microseconds (default 250).\n"
+                    "  --io-cpu=<n>                       Run the I/O thread at high priority pinned to CPU n.\n"
+                    "  --io-xdp=<interface>[:<queue>]     Send I/O through AF_XDP on the interface where it is\n"
+                    "                                     available, the UDP socket otherwise.\n"
+                    "  --capture=<file>                   Write EIP/TCP traffic to a pcapng file.\n"
+                    "  --capture-device=<id>              Only capture traffic for this device.\n"
+                    "  --capture-peer=<ipv4>              Only capture traffic from this client.\n"
+                    "  --capture-service=<hex>            Only capture requests and replies with this CIP\n"
+                    "                                     service code.  The filters can be repeated.\n"
+                    "  --modbus[=<address>[:<port>]]      Serve Modbus/TCP (default port 502).  Unit n is the\n"
+                    "                                     n'th device, units 0 and 255 are the first.\n"
+                    "  --modbus-map=<table>:<start>=<tag> Back a range of co (coils), di (discrete inputs),\n"
+                    "                                     ir (input registers) or hr (holding registers)\n"
+                    "                                     starting at a zero based address with a tag,\n"
+                    "                                     e.g. --modbus-map=hr:0=Counts\n"
+                    "  --metrics[=<address>[:<port>]]     Serve Prometheus metrics over HTTP (default port 9464).\n"
+                    "  --metrics-socket=<path>            Dump the same metrics to anything that connects to\n"
+                    "                                     this UNIX socket.\n");
+}
+
+
+static void handle_signal(int sig)
+{
+    (void)sig;
+
+    if(host) {
+        device_host_stop(host);
+    }
+}
+
+
+#ifdef SIGUSR1
+static void handle_snapshot_signal(int sig)
+{
+    (void)sig;
+
+    snapshot_requested = 1;
+}
+#endif
+
+
+
+static bool parse_device_spec(const char *spec, uint32_t count)
+{
+    struct device_spec_t *dev = NULL;
+    unsigned int a = 0, b = 0, c = 0, d = 0, port = EIP_DEFAULT_PORT;
+    int fields = 0;
+
+    if(num_device_specs >= MAX_DEVICE_SPECS) {
+        fprintf(stderr, "Too many device options!\n");
+        return false;
+    }
+
+    fields = sscanf(spec, "%u.%u.%u.%u:%u", &a, &b, &c, &d, &port);
+    if(fields < 4 || a > 255 || b > 255 || c > 255 || d > 255 || port == 0 || port > 65535) {
+        fprintf(stderr, "Unable to parse device address \"%s\"!\n", spec);
+        return false;
+    }
+
+    dev = &(device_specs[num_device_specs++]);
+
+    dev->count = count;
+    dev->address[0] = a;
+    dev->address[1] = b;
+    dev->address[2] = c;
+    dev->address[3] = d;
+    dev->any_address = (a == 0 && b == 0 && c == 0 && d == 0);
+    dev->port = (uint16_t)port;
+
+    return true;
+}
+
+
+static bool parse_tag_spec(const char *spec)
+{
+    struct tag_spec_t *tag = NULL;
+    const char *type_start = strchr(spec, ':');
+    const char *gen_start = strchr(spec, '=');
+    const char *count_start = NULL;
+    size_t name_len = 0;
+    size_t type_len = 0;
+
+    if(num_tag_specs >= MAX_TAG_SPECS) {
+        fprintf(stderr, "Too many tag options!\n");
+        return false;
+    }
+
+    if(!type_start || (gen_start && gen_start < type_start)) {
+        fprintf(stderr, "Tag \"%s\" needs a type!\n", spec);
+        return false;
+    }
+
+    name_len = (size_t)(type_start - spec);
+    type_start++;
+
+    if((count_start = strchr(type_start, ':')) && gen_start && count_start > gen_start) {
+        count_start = NULL;
+    }
+
+    type_len = (count_start ? (size_t)(count_start - type_start) : (gen_start ? (size_t)(gen_start - type_start) : strlen(type_start)));
+
+    tag = &(tag_specs[num_tag_specs]);
+
+    if(name_len == 0 || name_len >= sizeof(tag->name)) {
+        fprintf(stderr, "Bad tag name in \"%s\"!\n", spec);
+        return false;
+    }
+
+    memcpy(tag->name, spec, name_len);
+    tag->name[name_len] = 0;
+
+    if(!(tag->type = tag_type_from_name(type_start, type_len))) {
+        fprintf(stderr, "Unknown type in tag \"%s\"!\n", spec);
+        return false;
+    }
+
+    tag->elem_count = (count_start ? (uint32_t)strtoul(count_start + 1, NULL, 10) : 1);
+    if(tag->elem_count == 0) {
+        fprintf(stderr, "Bad element count in tag \"%s\"!\n", spec);
+        return false;
+    }
+
+    tag->has_gen = (gen_start != NULL);
+
+    if(tag->has_gen) {
+        if(tag->elem_count != 1) {
+            fprintf(stderr, "Only scalar tags can have a generator, not \"%s\"!\n", spec);
+            return false;
+        }
+
+        if(value_gen_parse(gen_start + 1, &(tag->gen)) != STATUS_OK) {
+            fprintf(stderr, "Bad generator in tag \"%s\"!\n", spec);
+            return false;
+        }
+
+        /* snapshots keep the value the tag had when they were written. */
+        tag->gen.materialize = true;
+    }
+
+    num_tag_specs++;
+
+    return true;
+}
+
+
+/* "<level>" sets every subsystem, "<subsystem>:<level>" just that one. */
+static bool parse_debug_spec(const char *spec)
+{
+    const char *colon = strchr(spec, ':');
+    debug_subsys_t subsys = DEBUG_NUM_SUBSYS;
+
+    if(!colon) {
+        debug_set_level((debug_level_t)atoi(spec));
+        return true;
+    }
+
+    if((subsys = debug_subsys_from_name(spec, (size_t)(colon - spec))) == DEBUG_NUM_SUBSYS) {
+        fprintf(stderr, "Unknown debug subsystem in \"%s\"!\n", spec);
+        return false;
+    }
+
+    debug_set_subsys_level(subsys, (debug_level_t)atoi(colon + 1));
+
+    return true;
+}
+
+
+/* "a.b.c.d[:n]" to a network order address.  The optional number goes in suffix. */
+static bool parse_ipv4(const char *spec, uint32_t *ip_addr, unsigned int *suffix)
+{
+    unsigned int octets[4] = {0};
+    uint8_t addr[4] = {0};
+    int fields = sscanf(spec, "%u.%u.%u.%u:%u", &octets[0], &octets[1], &octets[2], &octets[3], suffix);
+
+    if(fields < 4 || octets[0] > 255 || octets[1] > 255 || octets[2] > 255 || octets[3] > 255) {
+        fprintf(stderr, "Unable to parse address \"%s\"!\n", spec);
+        return false;
+    }
+
+    /* keep it in network byte order like the connections do. */
+    for(int i = 0; i < 4; i++) {
+        addr[i] = (uint8_t)octets[i];
+    }
+
+    memcpy(ip_addr, addr, sizeof(*ip_addr));
+
+    return true;
+}
+
+
+static bool parse_debug_peer(const char *spec)
+{
+    uint32_t ip_addr = 0;
+    unsigned int level = DEBUG_FLOOD;
+
+    if(!parse_ipv4(spec, &ip_addr, &level)) {
+        return false;
+    }
+
+    return (debug_add_peer(ip_addr, (debug_level_t)level) == STATUS_OK);
+}
+
+
+static bool parse_capture_filter(const char *arg)
+{
+    if(strncmp(arg, "--capture-device=", 17) == 0) {
+        return (eip_capture_add_device_filter((uint32_t)strtoul(arg + 17, NULL, 10)) == STATUS_OK);
+    }
+
+    if(strncmp(arg, "--capture-peer=", 15) == 0) {
+        uint32_t ip_addr = 0;
+        unsigned int unused = 0;
+
+        return parse_ipv4(arg + 15, &ip_addr, &unused) && eip_capture_add_peer_filter(ip_addr) == STATUS_OK;
+    }
+
+    if(strncmp(arg, "--capture-service=", 18) == 0) {
+        unsigned long service = strtoul(arg + 18, NULL, 16);
+
+        if(service == 0 || service > 0xFF) {
+            fprintf(stderr, "Bad CIP service code in \"%s\"!\n", arg);
+            return false;
+        }
+
+        return (eip_capture_add_service_filter((uint8_t)service) == STATUS_OK);
+    }
+
+    fprintf(stderr, "Unknown capture option \"%s\"!\n", arg);
+
+    return false;
+}
+
+
+static bool parse_args(int argc, const char **argv)
+{
+    io_sched_config_init(&io_config);
+
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if(strncmp(arg, "--debug=", 8) == 0) {
+            if(!parse_debug_spec(arg + 8)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--debug-peer=", 13) == 0) {
+            if(!parse_debug_peer(arg + 13)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--loops=", 8) == 0) {
+            num_loops = (uint32_t)strtoul(arg + 8, NULL, 10);
+        } else if(strncmp(arg, "--slow-callback=", 16) == 0) {
+            slow_callback_ns = (int64_t)strtoll(arg + 16, NULL, 10) * 1000;
+
+            if(slow_callback_ns <= 0) {
+                fprintf(stderr, "The slow callback threshold must be at least 1us!\n");
+                return false;
+            }
+        } else if(strncmp(arg, "--clock=", 8) == 0) {
+            if(strcmp(arg + 8, "tsc") == 0) {
+                use_tsc = true;
+            } else if(strcmp(arg + 8, "monotonic") == 0) {
+                use_tsc = false;
+            } else {
+                fprintf(stderr, "Unknown clock \"%s\"!\n", arg + 8);
+                return false;
+            }
+        } else if(strcmp(arg, "--virtual-time") == 0) {
+            virtual_start_ns = 1000000000LL;
+        } else if(strncmp(arg, "--virtual-time=", 15) == 0) {
+            virtual_start_ns = (int64_t)(strtod(arg + 15, NULL) * 1000000000.0);
+
+            if(virtual_start_ns <= 0) {
+                fprintf(stderr, "Virtual time must start after zero!\n");
+                return false;
+            }
+        } else if(strncmp(arg, "--device=", 9) == 0) {
+            if(!parse_device_spec(arg + 9, 1)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--devices=", 10) == 0) {
+            char *at = NULL;
+            uint32_t count = (uint32_t)strtoul(arg + 10, &at, 10);
+
+            if(count == 0 || !at || *at != '@' || !parse_device_spec(at + 1, count)) {
+                fprintf(stderr, "Unable to parse \"%s\"!\n", arg);
+                return false;
+            }
+        } else if(strncmp(arg, "--chassis=", 10) == 0) {
+            slots_per_chassis = (uint32_t)strtoul(arg + 10, NULL, 10);
+        } else if(strncmp(arg, "--import=", 9) == 0) {
+            import_path = arg + 9;
+        } else if(strncmp(arg, "--import-workers=", 17) == 0) {
+            import_workers = (uint32_t)strtoul(arg + 17, NULL, 10);
+        } else if(strncmp(arg, "--snapshot=", 11) == 0) {
+            snapshot_path = arg + 11;
+        } else if(strncmp(arg, "--save-snapshot=", 16) == 0) {
+            save_snapshot_path = arg + 16;
+        } else if(strncmp(arg, "--snapshot-interval=", 20) == 0) {
+            snapshot_interval_s = (uint32_t)strtoul(arg + 20, NULL, 10);
+        } else if(strcmp(arg, "--io") == 0) {
+            io_enabled = true;
+        } else if(strncmp(arg, "--io-tick-us=", 13) == 0) {
+            io_enabled = true;
+            io_config.tick_ns = (int64_t)strtoul(arg + 13, NULL, 10) * 1000;
+        } else if(strncmp(arg, "--io-cpu=", 9) == 0) {
+            io_enabled = true;
+            io_config.cpu = atoi(arg + 9);
+        } else if(strncmp(arg, "--io-xdp=", 9) == 0) {
+            const char *colon = strchr(arg + 9, ':');
+            size_t name_len = (colon ? (size_t)(colon - (arg + 9)) : strlen(arg + 9));
+
+            if(name_len == 0 || name_len >= sizeof(io_xdp_ifname)) {
+                fprintf(stderr, "Bad interface in \"%s\"!\n", arg);
+                return false;
+            }
+
+            memcpy(io_xdp_ifname, arg + 9, name_len);
+            io_xdp_ifname[name_len] = 0;
+
+            io_enabled = true;
+            io_config.xdp_ifname = io_xdp_ifname;
+            io_config.xdp_queue = (colon ? (uint32_t)strtoul(colon + 1, NULL, 10) : 0);
+        } else if(strncmp(arg, "--capture=", 10) == 0) {
+            capture_path = arg + 10;
+        } else if(strncmp(arg, "--capture-", 10) == 0) {
+            if(!parse_capture_filter(arg)) {
+                return false;
+            }
+        } else if(strcmp(arg, "--modbus") == 0) {
+            modbus_enabled = true;
+        } else if(strncmp(arg, "--modbus=", 9) == 0) {
+            const char *colon = strchr(arg + 9, ':');
+            size_t addr_len = (colon ? (size_t)(colon - (arg + 9)) : strlen(arg + 9));
+            unsigned long port = (colon ? strtoul(colon + 1, NULL, 10) : MODBUS_DEFAULT_PORT);
+
+            if(addr_len == 0 || addr_len >= sizeof(modbus_address) || port == 0 || port > 65535) {
+                fprintf(stderr, "Unable to parse \"%s\"!\n", arg);
+                return false;
+            }
+
+            memcpy(modbus_address, arg + 9, addr_len);
+            modbus_address[addr_len] = 0;
+
+            modbus_enabled = true;
+            modbus_port = (uint16_t)port;
+        } else if(strcmp(arg, "--metrics") == 0) {
+            metrics_enabled = true;
+            metrics_port = METRICS_DEFAULT_PORT;
+        } else if(strncmp(arg, "--metrics=", 10) == 0) {
+            const char *colon = strchr(arg + 10, ':');
+            size_t addr_len = (colon ? (size_t)(colon - (arg + 10)) : strlen(arg + 10));
+            unsigned long port = (colon ? strtoul(colon + 1, NULL, 10) : METRICS_DEFAULT_PORT);
+
+            if(addr_len == 0 || addr_len >= sizeof(metrics_address) || port == 0 || port > 65535) {
+                fprintf(stderr, "Unable to parse \"%s\"!\n", arg);
+                return false;
+            }
+
+            memcpy(metrics_address, arg + 10, addr_len);
+            metrics_address[addr_len] = 0;
+
+            metrics_enabled = true;
+            metrics_port = (uint16_t)port;
+        } else if(strncmp(arg, "--metrics-socket=", 17) == 0) {
+            metrics_socket_path = arg + 17;
+            metrics_enabled = true;
+        } else if(strncmp(arg, "--modbus-map=", 13) == 0) {
+            if(modbus_map_add(&modbus_map, arg + 13) != STATUS_OK) {
+                fprintf(stderr, "Unable to parse \"%s\"!\n", arg);
+                return false;
+            }
+
+            modbus_enabled = true;
+        } else if(strncmp(arg, "--tag=", 6) == 0) {
+            if(!parse_tag_spec(arg + 6)) {
+                return false;
+            }
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", arg);
+            return false;
+        }
+    }
+
+    if(num_device_specs == 0) {
+        /* one device on the standard port. */
+        parse_device_spec("0.0.0.0", 1);
+    }
+
+    return true;
+}
+
+
+
+static struct tag_db_t *build_tag_db(void)
+{
+    struct tag_db_t *db = tag_db_create(num_tag_specs);
+
+    if(!db) {
+        return NULL;
+    }
+
+    /* every generator starts from the same moment, so the devices agree. */
+    int64_t epoch_ns = util_clock_ns();
+
+    for(uint32_t i = 0; i < num_tag_specs; i++) {
+        struct tag_t *tag = tag_create(tag_specs[i].name, tag_specs[i].type, tag_specs[i].elem_count);
+        struct value_gen_t *gen = NULL;
+
+        if(tag && tag_specs[i].has_gen) {
+            if(!(gen = value_gen_create(&(tag_specs[i].gen), epoch_ns)) || tag_set_generator(tag, gen) != STATUS_OK) {
+                value_gen_dispose(gen);
+                tag_dispose(tag);
+                tag = NULL;
+            }
+        }
+
+        if(!tag || tag_db_add(db, tag) != STATUS_OK) {
+            tag_dispose(tag);
+            tag_db_dispose(db);
+            return NULL;
+        }
+    }
+
+    return db;
+}
+
+
+static status_t add_devices_from_specs(struct tag_db_t *db, struct tag_image_template_t *tmpl)
+{
+    status_t rc = STATUS_OK;
+    uint32_t device_id = 0;
+
+    for(uint32_t s = 0; s < num_device_specs; s++) {
+        struct device_spec_t *spec = &(device_specs[s]);
+        uint32_t ip = (spec->address[0] << 24) | (spec->address[1] << 16) | (spec->address[2] << 8) | spec->address[3];
+
+        for(uint32_t i = 0; i < spec->count; i++) {
+            struct device_t *device = NULL;
+            char address[32] = {0};
+            uint32_t dev_ip = (spec->any_address ? ip : ip + i);
+            uint32_t dev_port = (spec->any_address ? spec->port + i : spec->port);
+
+            if(dev_port > 65535) {
+                warn("Ran out of ports after %u devices!", device_id);
+                return STATUS_OUT_OF_BOUNDS;
+            }
+
+            snprintf(address, sizeof(address), "%u.%u.%u.%u", (dev_ip >> 24) & 0xFF, (dev_ip >> 16) & 0xFF, (dev_ip >> 8) & 0xFF, dev_ip & 0xFF);
+
+            if(!(device = device_create(device_id, NULL, db, tmpl))) {
+                return STATUS_NO_RESOURCE;
+            }
+
+            if((rc = device_host_add_device(host, device, address, (uint16_t)dev_port)) != STATUS_OK) {
+                device_dispose(device);
+                return rc;
+            }
+
+            device_id++;
+        }
+    }
+
+    return STATUS_OK;
+}
+
+
+
+/*
+ * Every device runs the same program, so they all share one tag database
+ * and one template image.  Devices only pay for the blocks they write.
+ */
+static status_t add_devices(void)
+{
+    status_t rc = STATUS_OK;
+    struct tag_db_t *db = NULL;
+    struct tag_image_t *initial = NULL;
+    struct tag_image_template_t *tmpl = NULL;
+
+    if(snapshot_path) {
+        int64_t start = util_time_mono_ns();
+
+        if((snapshot = tag_snapshot_open(snapshot_path))) {
+            info("Mapped snapshot %s in %lld us.", snapshot_path, (long long)((util_time_mono_ns() - start) / 1000));
+
+            /* the snapshot keeps its own references until it is closed. */
+            return add_devices_from_specs(snapshot->tag_db, snapshot->tmpl);
+        }
+
+        warn("Unable to use snapshot %s, building tags from the command line.", snapshot_path);
+    }
+
+    if(import_path) {
+        if(num_tag_specs) {
+            warn("Ignoring --tag options, the tags come from %s.", import_path);
+        }
+
+        if((rc = tag_import_file(import_path, import_workers, &db, &tmpl)) != STATUS_OK) {
+            warn("Unable to import tags from %s!", import_path);
+            return rc;
+        }
+
+        tag_db_freeze(db);
+
+        rc = add_devices_from_specs(db, tmpl);
+
+        tag_image_template_release(tmpl);
+        tag_db_dispose(db);
+
+        return rc;
+    }
+
+    if(!(db = build_tag_db())) {
+        warn("Unable to build tag database!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    /* initial values would be written into this image before it is frozen. */
+    if(!(initial = tag_image_create(NULL, db->data_size)) || !(tmpl = tag_image_to_template(initial))) {
+        warn("Unable to build template image!");
+        tag_image_dispose(initial);
+        tag_db_dispose(db);
+        return STATUS_NO_RESOURCE;
+    }
+
+    tag_image_dispose(initial);
+
+    tag_db_freeze(db);
+
+    rc = add_devices_from_specs(db, tmpl);
+
+    /* the devices hold their own references now. */
+    tag_image_template_release(tmpl);
+    tag_db_dispose(db);
+
+    return rc;
+}
+
+
+
+
+
+static void print_io_report(void)
+{
+    struct io_jitter_stats_t stats = {0};
+
+    if(!host->io) {
+        return;
+    }
+
+    io_sched_get_stats(host->io, &stats);
+
+    fprintf(stderr, "I/O: %llu packets sent, %llu late, %llu intervals missed, mean lateness %.1f us, max %.1f us.\n",
+            (unsigned long long)stats.num_sent, (unsigned long long)stats.num_late, (unsigned long long)stats.num_missed,
+            (stats.num_sent ? (double)stats.sum_late_ns / (double)stats.num_sent / 1000.0 : 0.0),
+            (double)stats.max_late_ns / 1000.0);
+}
+
+
+static void print_memory_report(void)
+{
+    struct device_host_memory_t mem = {0};
+
+    device_host_get_memory(host, &mem);
+
+    fprintf(stderr, "Tag memory for %u devices: %zu bytes shared, %zu bytes private, %zu bytes without sharing.\n",
+            mem.num_devices, mem.shared_bytes, mem.private_bytes, mem.unshared_bytes);
+}
+
+
+/*
+ * Snapshots are written from this thread.  Each block of the image is copied
+ * under the image lock, so the proactor loops keep serving while it runs.
+ */
+static void *snapshot_thread_func(void *arg)
+{
+    int64_t last_write_ms = util_time_mono_ns() / 1000000;
+
+    (void)arg;
+
+    while(!stopping) {
+        int64_t now_ms = util_time_mono_ns() / 1000000;
+
+        util_sleep_ms(100);
+
+        if(snapshot_requested || (snapshot_interval_s && now_ms - last_write_ms >= (int64_t)snapshot_interval_s * 1000)) {
+            struct device_t *device = host->devices[0];
+
+            snapshot_requested = 0;
+            last_write_ms = now_ms;
+
+            tag_snapshot_write(save_snapshot_path, device->tag_db, device->tag_image);
+        }
+    }
+
+    return NULL;
+}
+
+
+int main(int argc, const char **argv)
+{
+    status_t rc = STATUS_OK;
+    thread_t snapshot_thread;
+    bool snapshot_thread_running = false;
+
+    if(!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    /* the clock must be settled before any thread reads it. */
+    if(use_tsc && util_clock_use_tsc(true) != STATUS_OK) {
+        fprintf(stderr, "The TSC is not usable here, using CLOCK_MONOTONIC.\n");
+    }
+
+    if(virtual_start_ns > 0 && util_vclock_enable(virtual_start_ns) != STATUS_OK) {
+        fprintf(stderr, "Unable to enable virtual time!\n");
+        return 1;
+    }
+
+    if(!(host = device_host_create(num_loops))) {
+        fprintf(stderr, "Unable to create the device host!\n");
+        return 1;
+    }
+
+    if((rc = device_host_set_chassis(host, slots_per_chassis)) != STATUS_OK) {
+        fprintf(stderr, "Unable to use %u slot chassis, error %s!\n", slots_per_chassis, status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    if((rc = device_host_set_slow_callback(host, slow_callback_ns)) != STATUS_OK) {
+        fprintf(stderr, "Unable to set the slow callback threshold, error %s!\n", status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    if(io_enabled && (rc = device_host_enable_io(host, &io_config)) != STATUS_OK) {
+        fprintf(stderr, "Unable to set up class 1 I/O, error %s!\n", status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    if(modbus_enabled && (rc = device_host_enable_modbus(host, modbus_address, modbus_port, &modbus_map)) != STATUS_OK) {
+        fprintf(stderr, "Unable to set up Modbus/TCP, error %s!\n", status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    if(metrics_enabled && (rc = device_host_enable_metrics(host, metrics_address, metrics_port, metrics_socket_path)) != STATUS_OK) {
+        fprintf(stderr, "Unable to set up metrics, error %s!\n", status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    if((rc = add_devices()) != STATUS_OK) {
+        fprintf(stderr, "Unable to set up devices, error %s!\n", status_to_str(rc));
+        device_host_dispose(host);
+        return 1;
+    }
+
+    print_memory_report();
+
+    if(save_snapshot_path && host->num_devices > 0) {
+        struct device_t *device = host->devices[0];
+
+        if(tag_snapshot_write(save_snapshot_path, device->tag_db, device->tag_image) != STATUS_OK) {
+            fprintf(stderr, "Unable to write snapshot %s!\n", save_snapshot_path);
+        }
+
+        snapshot_thread_running = THREAD_CREATE(snapshot_thread, snapshot_thread_func, NULL);
+    }
+
+    if(capture_path && eip_capture_start(capture_path) != STATUS_OK) {
+        fprintf(stderr, "Unable to capture to %s!\n", capture_path);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+#ifdef SIGUSR1
+    signal(SIGUSR1, handle_snapshot_signal);
+#endif
+
+    rc = device_host_run(host);
+
+    stopping = true;
+
+    /* the loops are done, nothing else will be captured. */
+    eip_capture_stop();
+
+    if(snapshot_thread_running) {
+        THREAD_JOIN(snapshot_thread);
+    }
+
+    print_memory_report();
+    print_io_report();
+
+    device_host_dispose(host);
+    host = NULL;
+
+    /* only after every device using the mapping is gone. */
+    tag_snapshot_close(snapshot);
+
+    return (rc == STATUS_OK ? 0 : 1);
+}
@@ -0,0 +1,204 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench/bench.h"
+#include "util/debug.h"
+#include "util/status.h"
+
+
+#define MAX_BASELINE_LINE (512)
+
+
+static struct bench_options_t options;
+static bench_format_t format = BENCH_FORMAT_TEXT;
+static const char *filter = NULL;
+static const char *output_path = NULL;
+static const char *baseline_path = NULL;
+static bool list_only = false;
+
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tag_sim_bench [options]\n"
+                    "  --filter=<text>                    Only run benchmarks whose name contains the text.\n"
+                    "  --list                             List the benchmarks and exit.\n"
+                    "  --samples=<n>                      Timed samples per benchmark, the median is reported (default 15).\n"
+                    "  --min-sample-ms=<ms>               Shortest time one sample may take (default 10).\n"
+                    "  --warmup-ms=<ms>                   Time to run before sampling (default 200).\n"
+                    "  --format=text|csv|json             Report format (default text).\n"
+                    "  --output=<file>                    Write the report to a file instead of stdout.\n"
+                    "  --baseline=<file>                  CSV report of an earlier run to show the change against.\n"
+                    "  --debug=[<subsystem>:]<level>      Debug level 0 (none) to 4 (flood).\n");
+}
+
+
+static bool parse_args(int argc, const char **argv)
+{
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if(strncmp(arg, "--debug=", 8) == 0) {
+            const char *colon = strchr(arg + 8, ':');
+
+            if(!colon) {
+                debug_set_level((debug_level_t)atoi(arg + 8));
+            } else {
+                debug_set_subsys_level(debug_subsys_from_name(arg + 8, (size_t)(colon - (arg + 8))), (debug_level_t)atoi(colon + 1));
+            }
+        } else if(strncmp(arg, "--filter=", 9) == 0) {
+            filter = arg + 9;
+        } else if(strcmp(arg, "--list") == 0) {
+            list_only = true;
+        } else if(strncmp(arg, "--samples=", 10) == 0) {
+            options.num_samples = (uint32_t)strtoul(arg + 10, NULL, 10);
+
+            if(options.num_samples == 0 || options.num_samples > BENCH_MAX_SAMPLES) {
+                fprintf(stderr, "Samples must be between 1 and %d!\n", BENCH_MAX_SAMPLES);
+                return false;
+            }
+        } else if(strncmp(arg, "--min-sample-ms=", 16) == 0) {
+            options.min_sample_ns = (int64_t)(strtod(arg + 16, NULL) * 1000000.0);
+
+            if(options.min_sample_ns <= 0) {
+                fprintf(stderr, "Minimum sample time must be positive!\n");
+                return false;
+            }
+        } else if(strncmp(arg, "--warmup-ms=", 12) == 0) {
+            options.warmup_ns = (int64_t)(strtod(arg + 12, NULL) * 1000000.0);
+        } else if(strncmp(arg, "--format=", 9) == 0) {
+            if(strcmp(arg + 9, "text") == 0) {
+                format = BENCH_FORMAT_TEXT;
+            } else if(strcmp(arg + 9, "csv") == 0) {
+                format = BENCH_FORMAT_CSV;
+            } else if(strcmp(arg + 9, "json") == 0) {
+                format = BENCH_FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Unknown report format \"%s\"!\n", arg + 9);
+                return false;
+            }
+        } else if(strncmp(arg, "--output=", 9) == 0) {
+            output_path = arg + 9;
+        } else if(strncmp(arg, "--baseline=", 11) == 0) {
+            baseline_path = arg + 11;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", arg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* find the ns/op of a benchmark in an earlier CSV report, zero if it is not there. */
+static double baseline_ns_per_op(const char *name)
+{
+    FILE *in = NULL;
+    char line[MAX_BASELINE_LINE];
+    size_t name_len = strlen(name);
+    double ns_per_op = 0.0;
+
+    if(!baseline_path || !(in = fopen(baseline_path, "r"))) {
+        return 0.0;
+    }
+
+    while(fgets(line, sizeof(line), in)) {
+        /* name,iters_per_sample,samples,ns_per_op,... */
+        if(strncmp(line, name, name_len) == 0 && line[name_len] == ',') {
+            const char *field = line + name_len;
+
+            for(int i = 0; i < 2 && field; i++) {
+                field = strchr(field + 1, ',');
+            }
+
+            if(field) {
+                ns_per_op = strtod(field + 1, NULL);
+            }
+
+            break;
+        }
+    }
+
+    fclose(in);
+
+    return ns_per_op;
+}
+
+
+int main(int argc, const char **argv)
+{
+    status_t rc = STATUS_OK;
+    FILE *out = stdout;
+    bool first = true;
+
+    bench_options_init(&options);
+
+    if(!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    if(list_only) {
+        for(size_t i = 0; i < bench_num_cases; i++) {
+            printf("%-24s %s\n", bench_cases[i].name, bench_cases[i].description);
+        }
+
+        return 0;
+    }
+
+    if(output_path && !(out = fopen(output_path, "w"))) {
+        fprintf(stderr, "Unable to open %s for the report!\n", output_path);
+        return 1;
+    }
+
+    bench_report_header(out, format);
+
+    for(size_t i = 0; i < bench_num_cases; i++) {
+        struct bench_result_t result;
+        status_t bench_rc = STATUS_OK;
+
+        if(filter && !strstr(bench_cases[i].name, filter)) {
+            continue;
+        }
+
+        if((bench_rc = bench_run(&(bench_cases[i]), &options, &result)) != STATUS_OK) {
+            fprintf(stderr, "Benchmark %s failed with error %s!\n", bench_cases[i].name, status_to_str(bench_rc));
+            rc = bench_rc;
+            continue;
+        }
+
+        result.baseline_ns_per_op = baseline_ns_per_op(result.name);
+
+        bench_report_result(out, format, &result, first);
+        first = false;
+
+        fflush(out);
+    }
+
+    bench_report_footer(out, format);
+
+    if(out != stdout) {
+        fclose(out);
+    }
+
+    return (rc == STATUS_OK ? 0 : 1);
+}
@@ -0,0 +1,246 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "load/load_gen.h"
+#include "util/debug.h"
+#include "util/status.h"
+#include "util/time_utils.h"
+
+
+static struct load_config_t config;
+static load_format_t format = LOAD_FORMAT_TEXT;
+static const char *output_path = NULL;
+static bool use_tsc = false;
+
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tag_sim_load [options]\n"
+                    "  --target=<address>[:<port>]        Where to send load (default 127.0.0.1:44818).\n"
+                    "  --sessions=<n>                     Client sessions to open (default 10).\n"
+                    "  --loops=<n>                        Event loops, one thread each, to spread them over (default 1).\n"
+                    "  --rate=<n>                         Total requests per second over all sessions (default 1000).\n"
+                    "  --duration=<s>                     Seconds to measure (default 10).\n"
+                    "  --warmup=<s>                       Seconds of load before measuring starts (default 2).\n"
+                    "  --mix=<op>:<weight>,...            Weighted mix of read, write, msp and frag (default read:1).\n"
+                    "  --tag=<name>                       Scalar DINT tag for reads, writes and MSP (default TestDINT).\n"
+                    "  --array-tag=<name>:<elems>         Array read by frag, larger than one reply (default TestBigArray:1000).\n"
+                    "  --msp=<n>                          Reads packed into each Multiple Service Packet (default 10).\n"
+                    "  --connected                        Open a class 3 connection per session and use it.\n"
+                    "  --format=text|csv|json             Report format (default text).\n"
+                    "  --output=<file>                    Write the report to a file instead of stdout.\n"
+                    "  --clock=monotonic|tsc              Time source for scheduling and latency (default monotonic).\n"
+                    "  --debug=[<subsystem>:]<level>      Debug level 0 (none) to 4 (flood).\n"
+                    "\n"
+                    "Requests are sent on a fixed schedule whether or not earlier ones have been answered and\n"
+                    "latency is measured from when each request was due, so a slow server cannot hide its stalls.\n");
+}
+
+
+static bool parse_target(const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    size_t addr_len = (colon ? (size_t)(colon - spec) : strlen(spec));
+
+    if(addr_len == 0 || addr_len >= sizeof(config.address)) {
+        fprintf(stderr, "Bad target address in \"%s\"!\n", spec);
+        return false;
+    }
+
+    memcpy(config.address, spec, addr_len);
+    config.address[addr_len] = 0;
+
+    if(colon) {
+        unsigned long port = strtoul(colon + 1, NULL, 10);
+
+        if(port == 0 || port > 65535) {
+            fprintf(stderr, "Bad target port in \"%s\"!\n", spec);
+            return false;
+        }
+
+        config.port = (uint16_t)port;
+    }
+
+    return true;
+}
+
+
+static bool parse_array_tag(const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    size_t name_len = (colon ? (size_t)(colon - spec) : strlen(spec));
+
+    if(name_len == 0 || name_len >= sizeof(config.array_name)) {
+        fprintf(stderr, "Bad array tag name in \"%s\"!\n", spec);
+        return false;
+    }
+
+    memcpy(config.array_name, spec, name_len);
+    config.array_name[name_len] = 0;
+
+    if(colon) {
+        unsigned long elems = strtoul(colon + 1, NULL, 10);
+
+        if(elems == 0 || elems > 65535) {
+            fprintf(stderr, "Bad element count in \"%s\"!\n", spec);
+            return false;
+        }
+
+        config.array_elems = (uint16_t)elems;
+    }
+
+    return true;
+}
+
+
+static bool parse_args(int argc, const char **argv)
+{
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if(strncmp(arg, "--debug=", 8) == 0) {
+            const char *colon = strchr(arg + 8, ':');
+
+            if(!colon) {
+                debug_set_level((debug_level_t)atoi(arg + 8));
+            } else {
+                debug_set_subsys_level(debug_subsys_from_name(arg + 8, (size_t)(colon - (arg + 8))), (debug_level_t)atoi(colon + 1));
+            }
+        } else if(strncmp(arg, "--target=", 9) == 0) {
+            if(!parse_target(arg + 9)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--sessions=", 11) == 0) {
+            config.num_sessions = (uint32_t)strtoul(arg + 11, NULL, 10);
+        } else if(strncmp(arg, "--loops=", 8) == 0) {
+            config.num_loops = (uint32_t)strtoul(arg + 8, NULL, 10);
+        } else if(strncmp(arg, "--rate=", 7) == 0) {
+            config.rate = strtod(arg + 7, NULL);
+        } else if(strncmp(arg, "--duration=", 11) == 0) {
+            config.duration_s = strtod(arg + 11, NULL);
+        } else if(strncmp(arg, "--warmup=", 9) == 0) {
+            config.warmup_s = strtod(arg + 9, NULL);
+
+            if(config.warmup_s < 0.0) {
+                fprintf(stderr, "Warm up cannot be negative!\n");
+                return false;
+            }
+        } else if(strncmp(arg, "--mix=", 6) == 0) {
+            if(load_config_set_mix(&config, arg + 6) != STATUS_OK) {
+                fprintf(stderr, "Bad request mix \"%s\"!\n", arg + 6);
+                return false;
+            }
+        } else if(strncmp(arg, "--tag=", 6) == 0) {
+            if(strlen(arg + 6) == 0 || strlen(arg + 6) >= sizeof(config.tag_name)) {
+                fprintf(stderr, "Bad tag name \"%s\"!\n", arg + 6);
+                return false;
+            }
+
+            snprintf(config.tag_name, sizeof(config.tag_name), "%s", arg + 6);
+        } else if(strncmp(arg, "--array-tag=", 12) == 0) {
+            if(!parse_array_tag(arg + 12)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--msp=", 6) == 0) {
+            config.msp_count = (uint32_t)strtoul(arg + 6, NULL, 10);
+        } else if(strcmp(arg, "--connected") == 0) {
+            config.connected = true;
+        } else if(strncmp(arg, "--format=", 9) == 0) {
+            if(strcmp(arg + 9, "text") == 0) {
+                format = LOAD_FORMAT_TEXT;
+            } else if(strcmp(arg + 9, "csv") == 0) {
+                format = LOAD_FORMAT_CSV;
+            } else if(strcmp(arg + 9, "json") == 0) {
+                format = LOAD_FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Unknown report format \"%s\"!\n", arg + 9);
+                return false;
+            }
+        } else if(strncmp(arg, "--output=", 9) == 0) {
+            output_path = arg + 9;
+        } else if(strncmp(arg, "--clock=", 8) == 0) {
+            if(strcmp(arg + 8, "tsc") == 0) {
+                use_tsc = true;
+            } else if(strcmp(arg + 8, "monotonic") == 0) {
+                use_tsc = false;
+            } else {
+                fprintf(stderr, "Unknown clock \"%s\"!\n", arg + 8);
+                return false;
+            }
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", arg);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+int main(int argc, const char **argv)
+{
+    status_t rc = STATUS_OK;
+    struct load_gen_t *gen = NULL;
+    FILE *out = stdout;
+
+    load_config_init(&config);
+
+    if(!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    if(use_tsc && util_clock_use_tsc(true) != STATUS_OK) {
+        fprintf(stderr, "The TSC is not usable here, using CLOCK_MONOTONIC.\n");
+    }
+
+    if(output_path && !(out = fopen(output_path, "w"))) {
+        fprintf(stderr, "Unable to open %s for the report!\n", output_path);
+        return 1;
+    }
+
+    if(!(gen = load_gen_create(&config))) {
+        fprintf(stderr, "Unable to set up the load generator!\n");
+
+        if(out != stdout) {
+            fclose(out);
+        }
+
+        return 1;
+    }
+
+    rc = load_gen_run(gen);
+
+    load_gen_report(gen, out, format);
+
+    if(rc == STATUS_OK && gen->totals.session_failures) {
+        rc = STATUS_EXTERNAL_FAILURE;
+    }
+
+    if(out != stdout) {
+        fclose(out);
+    }
+
+    load_gen_dispose(gen);
+
+    return (rc == STATUS_OK ? 0 : 1);
+}
@@ -0,0 +1,144 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eip/eip.h"
+#include "replay/replay.h"
+#include "util/debug.h"
+#include "util/status.h"
+
+
+static const char *capture_path = NULL;
+static char target_address[48] = "127.0.0.1";
+static uint16_t target_port = EIP_DEFAULT_PORT;
+static uint16_t capture_port = EIP_DEFAULT_PORT;
+static double speed = 1.0;
+
+
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tag_sim_replay [options] <capture>\n"
+                    "  <capture>                          A pcapng or pcap file, e.g. from tag_sim --capture.\n"
+                    "  --target=<address>[:<port>]        Where to replay to (default 127.0.0.1:44818).\n"
+                    "  --capture-port=<port>              The server port of the recorded sessions (default 44818).\n"
+                    "  --speed=<x>                        Replay at x times the recorded pace, 0 for as fast\n"
+                    "                                     as the replies come back (default 1).\n"
+                    "  --debug=[<subsystem>:]<level>      Debug level 0 (none) to 4 (flood).\n");
+}
+
+
+static bool parse_target(const char *spec)
+{
+    const char *colon = strrchr(spec, ':');
+    size_t addr_len = (colon ? (size_t)(colon - spec) : strlen(spec));
+
+    if(addr_len == 0 || addr_len >= sizeof(target_address)) {
+        fprintf(stderr, "Bad target address in \"%s\"!\n", spec);
+        return false;
+    }
+
+    memcpy(target_address, spec, addr_len);
+    target_address[addr_len] = 0;
+
+    if(colon) {
+        unsigned long port = strtoul(colon + 1, NULL, 10);
+
+        if(port == 0 || port > 65535) {
+            fprintf(stderr, "Bad target port in \"%s\"!\n", spec);
+            return false;
+        }
+
+        target_port = (uint16_t)port;
+    }
+
+    return true;
+}
+
+
+static bool parse_args(int argc, const char **argv)
+{
+    for(int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if(strncmp(arg, "--debug=", 8) == 0) {
+            const char *colon = strchr(arg + 8, ':');
+
+            if(!colon) {
+                debug_set_level((debug_level_t)atoi(arg + 8));
+            } else {
+                debug_set_subsys_level(debug_subsys_from_name(arg + 8, (size_t)(colon - (arg + 8))), (debug_level_t)atoi(colon + 1));
+            }
+        } else if(strncmp(arg, "--target=", 9) == 0) {
+            if(!parse_target(arg + 9)) {
+                return false;
+            }
+        } else if(strncmp(arg, "--capture-port=", 15) == 0) {
+            capture_port = (uint16_t)strtoul(arg + 15, NULL, 10);
+        } else if(strncmp(arg, "--speed=", 8) == 0) {
+            speed = strtod(arg + 8, NULL);
+
+            if(speed < 0.0) {
+                fprintf(stderr, "Speed cannot be negative!\n");
+                return false;
+            }
+        } else if(arg[0] != '-' && !capture_path) {
+            capture_path = arg;
+        } else {
+            fprintf(stderr, "Unknown option \"%s\"!\n", arg);
+            return false;
+        }
+    }
+
+    if(!capture_path) {
+        fprintf(stderr, "No capture file given!\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+int main(int argc, const char **argv)
+{
+    status_t rc = STATUS_OK;
+    struct replay_t *replay = NULL;
+
+    if(!parse_args(argc, argv)) {
+        usage();
+        return 1;
+    }
+
+    if(!(replay = replay_load(capture_path, capture_port))) {
+        fprintf(stderr, "Unable to load capture %s!\n", capture_path);
+        return 1;
+    }
+
+    rc = replay_run(replay, target_address, target_port, speed);
+
+    replay_report(replay, stdout);
+
+    if(rc == STATUS_OK && replay->errors) {
+        rc = STATUS_EXTERNAL_FAILURE;
+    }
+
+    replay_dispose(replay);
+
+    return (rc == STATUS_OK ? 0 : 1);
+}
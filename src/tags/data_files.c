@@ -0,0 +1,153 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdlib.h>
+
+#include "tags/data_files.h"
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "util/debug.h"
+
+
+
+/* the table slot, tag type and file letter of each file type. */
+static const struct {
+    uint8_t file_type;
+    uint16_t tag_type;
+    char letter;
+} file_types[DATA_FILE_NUM_TYPES] = {
+    { DATA_FILE_TYPE_STATUS, TAG_TYPE_INT, 'S' },
+    { DATA_FILE_TYPE_BIT, TAG_TYPE_INT, 'B' },
+    { DATA_FILE_TYPE_INTEGER, TAG_TYPE_INT, 'N' },
+    { DATA_FILE_TYPE_FLOAT, TAG_TYPE_REAL, 'F' },
+    { DATA_FILE_TYPE_LONG, TAG_TYPE_DINT, 'L' },
+};
+
+
+static int type_slot(uint8_t file_type)
+{
+    switch(file_type) {
+        case DATA_FILE_TYPE_STATUS: return 0; break;
+        case DATA_FILE_TYPE_BIT: return 1; break;
+        case DATA_FILE_TYPE_INTEGER: return 2; break;
+        case DATA_FILE_TYPE_FLOAT: return 3; break;
+        case DATA_FILE_TYPE_LONG: return 4; break;
+        default: return -1; break;
+    }
+}
+
+
+uint16_t data_file_elem_size(uint8_t file_type)
+{
+    int slot = type_slot(file_type);
+
+    return (slot < 0 ? 0 : (uint16_t)tag_type_size(file_types[slot].tag_type));
+}
+
+
+/* "N7" is slot 2 file 7.  Returns -1 if the name is not a file name. */
+static int parse_file_name(const char *name, uint32_t *file_num)
+{
+    uint32_t num = 0;
+    int slot = -1;
+    const char *p = name + 1;
+
+    for(int i = 0; i < DATA_FILE_NUM_TYPES; i++) {
+        if(name[0] == file_types[i].letter || name[0] == file_types[i].letter + ('a' - 'A')) {
+            slot = i;
+            break;
+        }
+    }
+
+    if(slot < 0 || *p < '0' || *p > '9') {
+        return -1;
+    }
+
+    while(*p >= '0' && *p <= '9' && num < DATA_FILE_MAX_FILES) {
+        num = (num * 10) + (uint32_t)(*p - '0');
+        p++;
+    }
+
+    if(*p || num >= DATA_FILE_MAX_FILES) {
+        return -1;
+    }
+
+    *file_num = num;
+
+    return slot;
+}
+
+
+struct data_files_t *data_files_create(struct tag_db_t *db)
+{
+    struct data_files_t *files = NULL;
+
+    if(!db) {
+        warn("Called with a NULL tag database pointer!");
+        return NULL;
+    }
+
+    if(!(files = calloc(1, sizeof(*files)))) {
+        warn("Unable to allocate data file table!");
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < db->num_tags; i++) {
+        struct tag_t *tag = db->tags[i];
+        uint32_t file_num = 0;
+        int slot = parse_file_name(tag->name, &file_num);
+
+        if(slot < 0) {
+            continue;
+        }
+
+        if(tag->type != file_types[slot].tag_type) {
+            detail("Tag %s is not a %c file, its type is %04x.", tag->name, file_types[slot].letter, tag->type);
+            continue;
+        }
+
+        files->files[slot][file_num] = tag;
+        files->num_files++;
+    }
+
+    if(files->num_files) {
+        info("Mapped %u tags to data files.", files->num_files);
+    }
+
+    return files;
+}
+
+
+void data_files_dispose(struct data_files_t *files)
+{
+    if(files) {
+        free(files);
+    }
+}
+
+
+struct tag_t *data_files_get(struct data_files_t *files, uint8_t file_type, uint32_t file_num)
+{
+    int slot = type_slot(file_type);
+
+    if(!files || slot < 0 || file_num >= DATA_FILE_MAX_FILES) {
+        return NULL;
+    }
+
+    return files->files[slot][file_num];
+}
@@ -0,0 +1,64 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+
+/*
+ * PLC-5/SLC style data files for PCCC clients.
+ *
+ * A tag whose name is a file letter and number, like N7 or F8, and whose
+ * type matches the letter is data file 7 or 8 of that type.  This is the
+ * same convention Logix uses to map PLC/SLC messages onto tags.  The values
+ * stay in the tag, so a file reads and writes the same storage as the tag
+ * does over CIP.
+ *
+ * Files are kept in a table indexed by type and file number, so resolving
+ * an address like N7:10 is two array lookups and no string handling.
+ */
+
+typedef enum {
+    DATA_FILE_TYPE_STATUS = 0x84,
+    DATA_FILE_TYPE_BIT = 0x85,
+    DATA_FILE_TYPE_INTEGER = 0x89,
+    DATA_FILE_TYPE_FLOAT = 0x8A,
+    DATA_FILE_TYPE_LONG = 0x91,
+} data_file_type_t;
+
+/* S, B, N, F and L. */
+#define DATA_FILE_NUM_TYPES (5)
+
+/* SLC file numbers are 0 to 255. */
+#define DATA_FILE_MAX_FILES (256)
+
+
+struct tag_t;
+struct tag_db_t;
+
+struct data_files_t {
+    uint32_t num_files;
+
+    /* by type slot then file number, NULL where there is no such file. */
+    struct tag_t *files[DATA_FILE_NUM_TYPES][DATA_FILE_MAX_FILES];
+};
+
+
+extern struct data_files_t *data_files_create(struct tag_db_t *db);
+extern void data_files_dispose(struct data_files_t *files);
+
+extern struct tag_t *data_files_get(struct data_files_t *files, uint8_t file_type, uint32_t file_num);
+extern uint16_t data_file_elem_size(uint8_t file_type);
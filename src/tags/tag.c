@@ -0,0 +1,260 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_image.h"
+#include "tags/udt.h"
+#include "tags/value_gen.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+
+
+
+size_t tag_type_size(uint16_t type)
+{
+    switch(type) {
+        case TAG_TYPE_BOOL: return 1; break;
+        case TAG_TYPE_SINT: return 1; break;
+        case TAG_TYPE_USINT: return 1; break;
+        case TAG_TYPE_INT: return 2; break;
+        case TAG_TYPE_UINT: return 2; break;
+        case TAG_TYPE_DINT: return 4; break;
+        case TAG_TYPE_UDINT: return 4; break;
+        case TAG_TYPE_DWORD: return 4; break;
+        case TAG_TYPE_REAL: return 4; break;
+        case TAG_TYPE_LINT: return 8; break;
+        case TAG_TYPE_ULINT: return 8; break;
+        case TAG_TYPE_LREAL: return 8; break;
+        default: return 0; break;
+    }
+}
+
+
+
+/* map a Logix type name like "DINT" to its type code, zero if unknown. */
+uint16_t tag_type_from_name(const char *name, size_t name_len)
+{
+    static const struct {
+        const char *name;
+        uint16_t type;
+    } types[] = {
+        { "BOOL", TAG_TYPE_BOOL },
+        { "SINT", TAG_TYPE_SINT },
+        { "INT", TAG_TYPE_INT },
+        { "DINT", TAG_TYPE_DINT },
+        { "LINT", TAG_TYPE_LINT },
+        { "USINT", TAG_TYPE_USINT },
+        { "UINT", TAG_TYPE_UINT },
+        { "UDINT", TAG_TYPE_UDINT },
+        { "ULINT", TAG_TYPE_ULINT },
+        { "REAL", TAG_TYPE_REAL },
+        { "LREAL", TAG_TYPE_LREAL },
+        { "DWORD", TAG_TYPE_DWORD },
+    };
+
+    if(!name) {
+        return 0;
+    }
+
+    for(size_t i = 0; i < sizeof(types)/sizeof(types[0]); i++) {
+        size_t j = 0;
+
+        for(j = 0; j < name_len && types[i].name[j]; j++) {
+            if(types[i].name[j] != toupper((unsigned char)name[j])) {
+                break;
+            }
+        }
+
+        if(j == name_len && types[i].name[j] == 0) {
+            return types[i].type;
+        }
+    }
+
+    return 0;
+}
+
+
+
+static struct tag_t *alloc_tag(const char *name, uint16_t type, size_t elem_size, uint32_t elem_count)
+{
+    struct tag_t *tag = NULL;
+    size_t name_len = 0;
+
+    if(elem_count == 0) {
+        elem_count = 1;
+    }
+
+    name_len = strlen(name);
+
+    /* the tag and its name are one allocation.  The value lives in a tag image. */
+    if(!(tag = calloc(1, sizeof(*tag) + name_len + 1))) {
+        warn("Unable to allocate memory for tag %s!", name);
+        return NULL;
+    }
+
+    tag->type = type;
+    tag->elem_size = (uint16_t)elem_size;
+    tag->elem_count = elem_count;
+    tag->data_size = (uint32_t)(elem_size * elem_count);
+    tag->name = (const char *)(tag + 1);
+
+    memcpy((char *)tag->name, name, name_len + 1);
+
+    return tag;
+}
+
+
+/* BOOL arrays are packed into DWORDs, a lone BOOL keeps a byte of its own. */
+struct tag_t *tag_create(const char *name, uint16_t type, uint32_t elem_count)
+{
+    size_t elem_size = tag_type_size(type);
+    struct tag_t *tag = NULL;
+
+    if(!name) {
+        warn("Called with a NULL name pointer!");
+        return NULL;
+    }
+
+    if(elem_size == 0) {
+        warn("Unsupported tag type %04x for tag %s!", type, name);
+        return NULL;
+    }
+
+    if(type == TAG_TYPE_BOOL && elem_count > 1) {
+        if((tag = alloc_tag(name, TAG_TYPE_DWORD, 4, (elem_count + 31) / 32))) {
+            tag->bit_count = elem_count;
+        }
+
+        return tag;
+    }
+
+    return alloc_tag(name, type, elem_size, elem_count);
+}
+
+
+struct tag_t *tag_create_struct(const char *name, struct udt_t *udt, uint32_t elem_count)
+{
+    struct tag_t *tag = NULL;
+
+    if(!name || !udt) {
+        warn("Called with NULL pointer(s)!");
+        return NULL;
+    }
+
+    if(!udt->resolved || udt->size == 0 || udt->size > UINT16_MAX) {
+        warn("Structure %s has not been laid out or is too large for tag %s!", udt->name, name);
+        return NULL;
+    }
+
+    if((tag = alloc_tag(name, TAG_TYPE_STRUCT, udt->size, elem_count))) {
+        tag->udt = udt;
+    }
+
+    return tag;
+}
+
+
+void tag_dispose(struct tag_t *tag)
+{
+    if(!tag) {
+        return;
+    }
+
+    value_gen_dispose(tag->gen);
+
+    free(tag);
+}
+
+
+
+status_t tag_set_generator(struct tag_t *tag, struct value_gen_t *gen)
+{
+    if(!tag) {
+        warn("Called with a NULL tag pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(gen && tag->elem_count != 1) {
+        warn("Generators can only drive scalar tags, %s has %u elements!", tag->name, tag->elem_count);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    value_gen_dispose(tag->gen);
+    tag->gen = gen;
+
+    return STATUS_OK;
+}
+
+
+
+status_t tag_read(struct tag_t *tag, struct tag_image_t *image, uint32_t offset, uint8_t *out, uint32_t length)
+{
+    status_t rc = STATUS_OK;
+
+    if(!tag || !image || !out) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(offset > tag->data_size || length > tag->data_size - offset) {
+        warn("Read of %u bytes at offset %u is outside of tag %s!", length, offset, tag->name);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    if(tag->gen) {
+        /* evaluate the generator now, at read time.  The tag image is never touched. */
+        uint8_t value[sizeof(uint64_t)] = {0};
+
+        rc = value_gen_encode(tag->gen, util_clock_now_ns(), tag->type, value, sizeof(value));
+        if(rc != STATUS_OK) {
+            warn("Error %s evaluating generator for tag %s!", status_to_str(rc), tag->name);
+            return rc;
+        }
+
+        memcpy(out, value + offset, length);
+
+        return STATUS_OK;
+    }
+
+    return tag_image_read(image, (size_t)tag->data_offset + offset, out, length);
+}
+
+
+
+status_t tag_write(struct tag_t *tag, struct tag_image_t *image, uint32_t offset, const uint8_t *in, uint32_t length)
+{
+    if(!tag || !image || !in) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(tag->gen) {
+        warn("Tag %s is driven by a generator and cannot be written!", tag->name);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(offset > tag->data_size || length > tag->data_size - offset) {
+        warn("Write of %u bytes at offset %u is outside of tag %s!", length, offset, tag->name);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    return tag_image_write(image, (size_t)tag->data_offset + offset, in, length);
+}
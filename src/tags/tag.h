@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/* CIP elementary data type codes as used by Logix. */
+typedef enum {
+    TAG_TYPE_BOOL = 0x00C1,
+    TAG_TYPE_SINT = 0x00C2,
+    TAG_TYPE_INT = 0x00C3,
+    TAG_TYPE_DINT = 0x00C4,
+    TAG_TYPE_LINT = 0x00C5,
+    TAG_TYPE_USINT = 0x00C6,
+    TAG_TYPE_UINT = 0x00C7,
+    TAG_TYPE_UDINT = 0x00C8,
+    TAG_TYPE_ULINT = 0x00C9,
+    TAG_TYPE_REAL = 0x00CA,
+    TAG_TYPE_LREAL = 0x00CB,
+
+    /* 32-bit bit string, how packed BOOL arrays are stored and sent. */
+    TAG_TYPE_DWORD = 0x00D3,
+
+    /* structures.  On the wire this is followed by the template handle. */
+    TAG_TYPE_STRUCT = 0x02A0,
+} tag_type_t;
+
+#define TAG_MAX_DIMS (3)
+
+
+struct tag_image_t;
+struct udt_t;
+struct value_gen_t;
+
+struct tag_t {
+    const char *name;
+    uint32_t name_hash;
+
+    /* assigned by the tag database, starting at 1. */
+    uint32_t instance_id;
+
+    uint16_t type;
+    uint16_t elem_size;
+    uint32_t elem_count;
+
+    /* array dimensions, num_dims is zero for a scalar. */
+    uint8_t num_dims;
+    uint32_t dims[TAG_MAX_DIMS];
+
+    /*
+     * BOOL arrays are packed 32 to a DWORD like Logix does.  For those the
+     * type is TAG_TYPE_DWORD, elem_count counts words and bit_count is the
+     * declared number of BOOLs.  Zero for everything else.
+     */
+    uint32_t bit_count;
+
+    /* the structure definition of TAG_TYPE_STRUCT tags. */
+    struct udt_t *udt;
+
+    /* where the value lives in each device's tag image. */
+    uint32_t data_offset;
+    uint32_t data_size;
+
+    /* if set, the value is computed when read rather than stored. */
+    struct value_gen_t *gen;
+};
+
+
+extern size_t tag_type_size(uint16_t type);
+extern uint16_t tag_type_from_name(const char *name, size_t name_len);
+
+extern struct tag_t *tag_create(const char *name, uint16_t type, uint32_t elem_count);
+extern struct tag_t *tag_create_struct(const char *name, struct udt_t *udt, uint32_t elem_count);
+extern void tag_dispose(struct tag_t *tag);
+
+extern status_t tag_set_generator(struct tag_t *tag, struct value_gen_t *gen);
+
+extern status_t tag_read(struct tag_t *tag, struct tag_image_t *image, uint32_t offset, uint8_t *out, uint32_t length);
+extern status_t tag_write(struct tag_t *tag, struct tag_image_t *image, uint32_t offset, const uint8_t *in, uint32_t length);
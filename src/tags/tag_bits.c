@@ -0,0 +1,265 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_bits.h"
+#include "tags/tag_image.h"
+#include "util/debug.h"
+#include "util/shims.h"
+
+
+
+/* new = (old | or) & and, one aligned word, lock free. */
+static status_t modify_word(struct tag_image_t *image, size_t word_offset, uint32_t or_bits, uint32_t and_bits)
+{
+    uint32_t *word = tag_image_word(image, word_offset);
+    uint32_t old_value = 0;
+
+    if(!word) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    do {
+        old_value = ATOMIC_LOAD_U32(word);
+    } while(!ATOMIC_CAS_U32(word, old_value, (old_value | or_bits) & and_bits));
+
+    return STATUS_OK;
+}
+
+
+/*
+ * Apply byte masks starting at any image offset.  The masks are folded into
+ * whole word masks; bytes outside the range get an OR of 0 and an AND of
+ * 0xFF so neighbouring values are untouched.
+ */
+static status_t modify_range(struct tag_image_t *image, size_t offset, const uint8_t *or_mask, const uint8_t *and_mask, size_t len)
+{
+    status_t rc = STATUS_OK;
+    size_t word_offset = offset & ~(size_t)3;
+    size_t end = offset + len;
+
+    for(; word_offset < end && rc == STATUS_OK; word_offset += 4) {
+        uint32_t or_bits = 0;
+        uint32_t and_bits = 0xFFFFFFFFu;
+
+        for(size_t b = 0; b < 4; b++) {
+            size_t pos = word_offset + b;
+
+            if(pos >= offset && pos < end) {
+                or_bits |= (uint32_t)or_mask[pos - offset] << (8 * b);
+                and_bits &= ~((uint32_t)(uint8_t)~and_mask[pos - offset] << (8 * b));
+            }
+        }
+
+        rc = modify_word(image, word_offset, or_bits, and_bits);
+    }
+
+    return rc;
+}
+
+
+
+/* where bit N of an element lives.  Packed BOOL arrays count bits across the whole array. */
+static status_t locate_bit(struct tag_t *tag, uint32_t elem_index, uint32_t bit, size_t *byte_offset, uint32_t *bit_in_byte)
+{
+    if(tag->bit_count) {
+        if(bit >= tag->bit_count) {
+            return STATUS_OUT_OF_BOUNDS;
+        }
+
+        *byte_offset = bit / 8;
+    } else {
+        if(elem_index >= tag->elem_count || bit >= (uint32_t)tag->elem_size * 8 || tag->type == TAG_TYPE_REAL || tag->type == TAG_TYPE_LREAL || tag->udt) {
+            return STATUS_OUT_OF_BOUNDS;
+        }
+
+        *byte_offset = ((size_t)elem_index * tag->elem_size) + (bit / 8);
+    }
+
+    *bit_in_byte = bit % 8;
+
+    return STATUS_OK;
+}
+
+
+status_t tag_bits_read(struct tag_t *tag, struct tag_image_t *image, uint32_t elem_index, uint32_t bit, bool *value)
+{
+    status_t rc = STATUS_OK;
+    size_t byte_offset = 0;
+    uint32_t bit_in_byte = 0;
+    uint8_t byte = 0;
+
+    if(!tag || !image || !value) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if((rc = locate_bit(tag, elem_index, bit, &byte_offset, &bit_in_byte)) != STATUS_OK) {
+        return rc;
+    }
+
+    /* through tag_read so generated tags give their current value, it checks the offset too. */
+    if(tag->gen) {
+        if((rc = tag_read(tag, image, (uint32_t)byte_offset, &byte, 1)) != STATUS_OK) {
+            return rc;
+        }
+    } else if((rc = tag_image_read(image, tag->data_offset + byte_offset, &byte, 1)) != STATUS_OK) {
+        return rc;
+    }
+
+    *value = ((byte >> bit_in_byte) & 1) != 0;
+
+    return STATUS_OK;
+}
+
+
+status_t tag_bits_write(struct tag_t *tag, struct tag_image_t *image, uint32_t elem_index, uint32_t bit, bool value)
+{
+    status_t rc = STATUS_OK;
+    size_t byte_offset = 0;
+    uint32_t bit_in_byte = 0;
+    uint8_t or_mask = 0;
+    uint8_t and_mask = 0xFF;
+
+    if(!tag || !image) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(tag->gen) {
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if((rc = locate_bit(tag, elem_index, bit, &byte_offset, &bit_in_byte)) != STATUS_OK) {
+        return rc;
+    }
+
+    if(value) {
+        or_mask = (uint8_t)(1u << bit_in_byte);
+    } else {
+        and_mask = (uint8_t)~(1u << bit_in_byte);
+    }
+
+    return modify_range(image, tag->data_offset + byte_offset, &or_mask, &and_mask, 1);
+}
+
+
+/* Read-Modify-Write, service 0x4E.  Bits set in or_mask are set, bits clear in and_mask are cleared. */
+status_t tag_bits_modify(struct tag_t *tag, struct tag_image_t *image, uint32_t byte_offset, const uint8_t *or_mask, const uint8_t *and_mask, size_t mask_len)
+{
+    if(!tag || !image || !or_mask || !and_mask) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(tag->gen) {
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(byte_offset > tag->data_size || mask_len > tag->data_size - byte_offset) {
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    return modify_range(image, (size_t)tag->data_offset + byte_offset, or_mask, and_mask, mask_len);
+}
+
+
+
+static inline uint64_t load64(const uint8_t *p, size_t avail)
+{
+    uint64_t v = 0;
+
+    if(avail >= 8) {
+        memcpy(&v, p, 8);
+    } else {
+        memcpy(&v, p, avail);
+    }
+
+    return v;
+}
+
+
+/* copy num_bits starting at first_bit of src to the start of dst, packed LSB first. */
+void tag_bits_extract(const uint8_t *src, uint32_t first_bit, uint32_t num_bits, uint8_t *dst)
+{
+    const uint8_t *p = src + (first_bit / 8);
+    uint32_t shift = first_bit % 8;
+    size_t src_bytes = (shift + num_bits + 7) / 8;
+    uint32_t done = 0;
+
+    while(done < num_bits) {
+        uint32_t chunk = num_bits - done;
+        size_t offset = done / 8;
+        uint64_t v = 0;
+
+        /* 56 bits per step keeps the shifted source inside one 64-bit load. */
+        if(chunk > 56) {
+            chunk = 56;
+        }
+
+        v = load64(p + offset, src_bytes - offset) >> shift;
+
+        if(chunk < 64) {
+            v &= ((uint64_t)1 << chunk) - 1;
+        }
+
+        for(uint32_t b = 0; b < (chunk + 7) / 8; b++) {
+            dst[offset + b] = (uint8_t)(v >> (8 * b));
+        }
+
+        done += chunk;
+    }
+}
+
+
+/* the reverse, write num_bits from the start of src into dst at first_bit. */
+void tag_bits_deposit(uint8_t *dst, uint32_t first_bit, uint32_t num_bits, const uint8_t *src)
+{
+    uint32_t done = 0;
+
+    while(done < num_bits) {
+        uint32_t bit = first_bit + done;
+        uint32_t chunk = num_bits - done;
+        uint32_t shift = bit % 8;
+        uint8_t *p = dst + (bit / 8);
+        uint64_t mask = 0;
+        uint64_t v = 0;
+        uint64_t cur = 0;
+        size_t bytes = 0;
+
+        if(chunk > 56 - shift) {
+            chunk = 56 - shift;
+        }
+
+        /* done is a multiple of 8 after the first chunk when first_bit is aligned. */
+        for(uint32_t b = 0; b < chunk; b++) {
+            v |= (uint64_t)((src[(done + b) / 8] >> ((done + b) % 8)) & 1) << b;
+        }
+
+        mask = (((uint64_t)1 << chunk) - 1) << shift;
+        bytes = (shift + chunk + 7) / 8;
+
+        memcpy(&cur, p, bytes);
+        cur = (cur & ~mask) | ((v << shift) & mask);
+        memcpy(p, &cur, bytes);
+
+        done += chunk;
+    }
+}
@@ -0,0 +1,48 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/*
+ * Bit level access to tag values.
+ *
+ * Single bit writes and masked writes (Read-Modify-Write) are done as
+ * compare-and-swap loops on the aligned 32-bit words of a device's image.
+ * They never take the image mutex once the block is private, so clients
+ * hammering bits in the same tag do not queue up behind each other.  Each
+ * word is updated atomically, a mask spanning several words is not.
+ *
+ * The range helpers move runs of bits a 64-bit word at a time.
+ *
+ * Image words are little endian, as are the hosts we run on.
+ */
+
+struct tag_t;
+struct tag_image_t;
+
+
+extern status_t tag_bits_read(struct tag_t *tag, struct tag_image_t *image, uint32_t elem_index, uint32_t bit, bool *value);
+extern status_t tag_bits_write(struct tag_t *tag, struct tag_image_t *image, uint32_t elem_index, uint32_t bit, bool value);
+extern status_t tag_bits_modify(struct tag_t *tag, struct tag_image_t *image, uint32_t byte_offset, const uint8_t *or_mask, const uint8_t *and_mask, size_t mask_len);
+
+extern void tag_bits_extract(const uint8_t *src, uint32_t first_bit, uint32_t num_bits, uint8_t *dst);
+extern void tag_bits_deposit(uint8_t *dst, uint32_t first_bit, uint32_t num_bits, const uint8_t *src);
@@ -0,0 +1,245 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_bits.h"
+#include "tags/tag_image.h"
+#include "tags/value_gen.h"
+#include "util/debug.h"
+#include "util/time_utils.h"
+#include "util/unit_test.h"
+
+
+#define BUF_SIZE (32)
+
+/* tags are put part way into the image so offsets are not all zero. */
+#define TAG_OFFSET (12)
+#define IMAGE_SIZE (256)
+
+
+
+static bool get_bit(const uint8_t *buf, uint32_t bit)
+{
+    return ((buf[bit / 8] >> (bit % 8)) & 1) != 0;
+}
+
+
+static void set_bit(uint8_t *buf, uint32_t bit, bool value)
+{
+    if(value) {
+        buf[bit / 8] |= (uint8_t)(1u << (bit % 8));
+    } else {
+        buf[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+    }
+}
+
+
+/* every start bit and length against a bit at a time copy, including runs longer than one 56-bit step. */
+static void test_extract_deposit(void)
+{
+    uint8_t src[BUF_SIZE];
+    uint8_t dst[BUF_SIZE];
+    uint8_t expected[BUF_SIZE];
+
+    srand(1234);
+
+    for(uint32_t i = 0; i < BUF_SIZE; i++) {
+        src[i] = (uint8_t)rand();
+    }
+
+    for(uint32_t first_bit = 0; first_bit < 20; first_bit++) {
+        for(uint32_t num_bits = 0; first_bit + num_bits <= (BUF_SIZE - 8) * 8; num_bits += (num_bits < 70 ? 1 : 13)) {
+            memset(dst, 0xEE, sizeof(dst));
+            memset(expected, 0xEE, sizeof(expected));
+
+            for(uint32_t b = 0; b < num_bits; b++) {
+                set_bit(expected, b, get_bit(src, first_bit + b));
+            }
+
+            tag_bits_extract(src, first_bit, num_bits, dst);
+
+            /* the last partial byte is zero filled above num_bits. */
+            for(uint32_t b = num_bits; b < ((num_bits + 7) / 8) * 8; b++) {
+                set_bit(expected, b, false);
+            }
+
+            CHECK(memcmp(dst, expected, sizeof(dst)) == 0);
+
+            memset(dst, 0x55, sizeof(dst));
+            memset(expected, 0x55, sizeof(expected));
+
+            for(uint32_t b = 0; b < num_bits; b++) {
+                set_bit(expected, first_bit + b, get_bit(src, b));
+            }
+
+            tag_bits_deposit(dst, first_bit, num_bits, src);
+
+            CHECK(memcmp(dst, expected, sizeof(dst)) == 0);
+        }
+    }
+}
+
+
+static struct tag_t *make_tag(const char *name, uint16_t type, uint32_t elem_count)
+{
+    struct tag_t *tag = tag_create(name, type, elem_count);
+
+    if(tag) {
+        tag->data_offset = TAG_OFFSET;
+    }
+
+    return tag;
+}
+
+
+static void test_bool_array(void)
+{
+    struct tag_t *tag = make_tag("Bools", TAG_TYPE_BOOL, 100);
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    uint8_t buf[16] = {0};
+    bool value = false;
+
+    CHECK(tag && image);
+    CHECK_EQ(tag->bit_count, 100);
+
+    CHECK_EQ(tag_bits_write(tag, image, 0, 99, true), STATUS_OK);
+    CHECK_EQ(tag_bits_write(tag, image, 0, 33, true), STATUS_OK);
+    CHECK_EQ(tag_bits_write(tag, image, 0, 100, true), STATUS_OUT_OF_BOUNDS);
+
+    CHECK_EQ(tag_bits_read(tag, image, 0, 99, &value), STATUS_OK);
+    CHECK(value);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 98, &value), STATUS_OK);
+    CHECK(!value);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 100, &value), STATUS_OUT_OF_BOUNDS);
+
+    /* bits count across the words, 33 is bit 1 of the second DWORD. */
+    CHECK_EQ(tag_image_read(image, TAG_OFFSET, buf, sizeof(buf)), STATUS_OK);
+    CHECK_EQ(buf[4], 0x02);
+    CHECK_EQ(buf[12], 0x08);
+
+    CHECK_EQ(tag_bits_write(tag, image, 0, 99, false), STATUS_OK);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 99, &value), STATUS_OK);
+    CHECK(!value);
+
+    tag_image_dispose(image);
+    tag_dispose(tag);
+}
+
+
+static void test_scalar_bits(void)
+{
+    struct tag_t *dint = make_tag("Dint", TAG_TYPE_DINT, 4);
+    struct tag_t *real = make_tag("Real", TAG_TYPE_REAL, 1);
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    uint8_t buf[4] = {0};
+    bool value = false;
+
+    CHECK_EQ(tag_bits_write(dint, image, 2, 31, true), STATUS_OK);
+    CHECK_EQ(tag_bits_write(dint, image, 2, 32, true), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(tag_bits_write(dint, image, 4, 0, true), STATUS_OUT_OF_BOUNDS);
+
+    CHECK_EQ(tag_image_read(image, TAG_OFFSET + 8, buf, 4), STATUS_OK);
+    CHECK_EQ(buf[3], 0x80);
+
+    CHECK_EQ(tag_bits_read(dint, image, 2, 31, &value), STATUS_OK);
+    CHECK(value);
+
+    /* no bit access to floating point values. */
+    CHECK_EQ(tag_bits_read(real, image, 0, 0, &value), STATUS_OUT_OF_BOUNDS);
+
+    tag_image_dispose(image);
+    tag_dispose(dint);
+    tag_dispose(real);
+}
+
+
+/* masks at an odd offset span two words, the bytes around them must not move. */
+static void test_modify(void)
+{
+    struct tag_t *tag = make_tag("Sints", TAG_TYPE_SINT, 16);
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    uint8_t init[16];
+    uint8_t buf[16];
+    uint8_t or_mask[3] = {0x01, 0xF0, 0x00};
+    uint8_t and_mask[3] = {0xFF, 0xFF, 0x0F};
+
+    for(uint32_t i = 0; i < sizeof(init); i++) {
+        init[i] = (uint8_t)(0xA0 + i);
+    }
+
+    CHECK_EQ(tag_image_write(image, TAG_OFFSET, init, sizeof(init)), STATUS_OK);
+
+    CHECK_EQ(tag_bits_modify(tag, image, 3, or_mask, and_mask, sizeof(or_mask)), STATUS_OK);
+
+    CHECK_EQ(tag_image_read(image, TAG_OFFSET, buf, sizeof(buf)), STATUS_OK);
+    CHECK_EQ(buf[2], init[2]);
+    CHECK_EQ(buf[3], init[3] | 0x01);
+    CHECK_EQ(buf[4], init[4] | 0xF0);
+    CHECK_EQ(buf[5], init[5] & 0x0F);
+    CHECK_EQ(buf[6], init[6]);
+
+    CHECK_EQ(tag_bits_modify(tag, image, 14, or_mask, and_mask, sizeof(or_mask)), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(tag_bits_modify(tag, image, 13, or_mask, and_mask, sizeof(or_mask)), STATUS_OK);
+
+    tag_image_dispose(image);
+    tag_dispose(tag);
+}
+
+
+/* generated values are read a byte at a time at the bit's own offset and cannot be written. */
+static void test_generated(void)
+{
+    struct tag_t *tag = make_tag("Gen", TAG_TYPE_DINT, 1);
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    struct value_gen_config_t config = {0};
+    uint8_t mask = 0xFF;
+    bool value = false;
+
+    CHECK_EQ(value_gen_parse("step(1000,16777472)", &config), STATUS_OK);
+    CHECK_EQ(tag_set_generator(tag, value_gen_create(&config, util_clock_ns())), STATUS_OK);
+
+    /* 0x01000100, bits 8 and 24. */
+    CHECK_EQ(tag_bits_read(tag, image, 0, 8, &value), STATUS_OK);
+    CHECK(value);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 24, &value), STATUS_OK);
+    CHECK(value);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 25, &value), STATUS_OK);
+    CHECK(!value);
+    CHECK_EQ(tag_bits_read(tag, image, 0, 0, &value), STATUS_OK);
+    CHECK(!value);
+
+    CHECK_EQ(tag_bits_write(tag, image, 0, 0, true), STATUS_NOT_ALLOWED);
+    CHECK_EQ(tag_bits_modify(tag, image, 0, &mask, &mask, 1), STATUS_NOT_ALLOWED);
+
+    tag_image_dispose(image);
+    tag_dispose(tag);
+}
+
+
+
+int main(void)
+{
+    debug_set_level(DEBUG_NONE);
+
+    test_extract_deposit();
+    test_bool_array();
+    test_scalar_bits();
+    test_modify();
+    test_generated();
+
+    return UNIT_TEST_RESULT();
+}
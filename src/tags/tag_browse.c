@@ -0,0 +1,325 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_browse.h"
+#include "tags/tag_db.h"
+#include "tags/udt.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+/* symbol attributes */
+#define ATTR_NAME (1)
+#define ATTR_TYPE (2)
+#define ATTR_ELEM_SIZE (7)
+#define ATTR_DIMS (8)
+
+/* the type word counts dimensions in bits 13 and 14. */
+#define SYMBOL_TYPE_DIMS_SHIFT (13)
+
+#define BROWSE_MIN_CAPACITY (4096)
+
+
+const uint16_t tag_browse_common_attrs[TAG_BROWSE_NUM_COMMON_ATTRS] = { ATTR_NAME, ATTR_TYPE, ATTR_ELEM_SIZE, ATTR_DIMS };
+
+
+
+struct tag_browse_t *tag_browse_create(void)
+{
+    struct tag_browse_t *browse = NULL;
+
+    if(!(browse = calloc(1, sizeof(*browse)))) {
+        warn("Unable to allocate browse cache!");
+        return NULL;
+    }
+
+    MUTEX_INIT(browse->mutex);
+
+    return browse;
+}
+
+
+void tag_browse_dispose(struct tag_browse_t *browse)
+{
+    if(!browse) {
+        return;
+    }
+
+    MUTEX_DESTROY(browse->mutex);
+
+    free(browse->offsets);
+    free(browse->data);
+    free(browse);
+}
+
+
+
+/* packed BOOL arrays show up as the DWORD arrays they are stored as. */
+uint16_t tag_browse_symbol_type(const struct tag_t *tag)
+{
+    uint16_t type = 0;
+    uint32_t num_dims = tag->num_dims;
+
+    if(num_dims == 0 && tag->elem_count > 1) {
+        num_dims = 1;
+    }
+
+    if(tag->udt) {
+        type = (uint16_t)(UDT_TYPE_STRUCT_FLAG | (tag->udt->instance_id & UDT_TYPE_INSTANCE_MASK));
+    } else {
+        type = tag->type;
+    }
+
+    return (uint16_t)(type | (num_dims << SYMBOL_TYPE_DIMS_SHIFT));
+}
+
+
+static void encode_dims(const struct tag_t *tag, uint8_t *out)
+{
+    uint32_t dims[TAG_MAX_DIMS] = {0};
+
+    if(tag->bit_count) {
+        dims[0] = tag->elem_count;
+    } else if(tag->num_dims) {
+        memcpy(dims, tag->dims, sizeof(dims));
+    } else if(tag->elem_count > 1) {
+        dims[0] = tag->elem_count;
+    }
+
+    for(int i = 0; i < TAG_MAX_DIMS; i++) {
+        encode_uint32_le(out + (4 * i), dims[i]);
+    }
+}
+
+
+/* one instance: its ID, then the attributes in the order they were asked for. */
+status_t tag_browse_encode_entry(const struct tag_t *tag, const uint16_t *attrs, uint16_t num_attrs, uint8_t *out, size_t capacity, size_t *out_len)
+{
+    size_t len = 4;
+    size_t name_len = strlen(tag->name);
+
+    for(uint16_t i = 0; i < num_attrs; i++) {
+        switch(attrs[i]) {
+            case ATTR_NAME: len += 2 + name_len; break;
+            case ATTR_TYPE: len += 2; break;
+            case ATTR_ELEM_SIZE: len += 2; break;
+            case ATTR_DIMS: len += 4 * TAG_MAX_DIMS; break;
+            default: return STATUS_NOT_SUPPORTED; break;
+        }
+    }
+
+    if(len > capacity) {
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    encode_uint32_le(out, tag->instance_id);
+    out += 4;
+
+    for(uint16_t i = 0; i < num_attrs; i++) {
+        switch(attrs[i]) {
+            case ATTR_NAME:
+                encode_uint16_le(out, (uint16_t)name_len);
+                memcpy(out + 2, tag->name, name_len);
+                out += 2 + name_len;
+                break;
+
+            case ATTR_TYPE:
+                encode_uint16_le(out, tag_browse_symbol_type(tag));
+                out += 2;
+                break;
+
+            case ATTR_ELEM_SIZE:
+                encode_uint16_le(out, tag->elem_size);
+                out += 2;
+                break;
+
+            case ATTR_DIMS:
+                encode_dims(tag, out);
+                out += 4 * TAG_MAX_DIMS;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    *out_len = len;
+
+    return STATUS_OK;
+}
+
+
+
+/* encode whatever tags were added since the last time.  Called with the lock held. */
+static status_t encode_new_tags(struct tag_browse_t *browse, struct tag_db_t *db)
+{
+    status_t rc = STATUS_OK;
+    uint32_t *new_offsets = NULL;
+
+    if(browse->num_encoded >= db->num_tags) {
+        return STATUS_OK;
+    }
+
+    if(!(new_offsets = realloc(browse->offsets, ((size_t)db->num_tags + 1) * sizeof(*new_offsets)))) {
+        warn("Unable to grow browse offsets!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    browse->offsets = new_offsets;
+
+    for(uint32_t i = browse->num_encoded; i < db->num_tags; i++) {
+        size_t len = 0;
+
+        browse->offsets[i] = (uint32_t)browse->size;
+
+        while((rc = tag_browse_encode_entry(db->tags[i], tag_browse_common_attrs, TAG_BROWSE_NUM_COMMON_ATTRS,
+                                            browse->data + browse->size, browse->capacity - browse->size, &len)) == STATUS_OUT_OF_BOUNDS) {
+            size_t new_capacity = (browse->capacity ? browse->capacity * 2 : BROWSE_MIN_CAPACITY);
+            uint8_t *new_data = NULL;
+
+            if(!(new_data = realloc(browse->data, new_capacity))) {
+                warn("Unable to grow browse cache!");
+                return STATUS_NO_RESOURCE;
+            }
+
+            browse->data = new_data;
+            browse->capacity = new_capacity;
+        }
+
+        if(rc != STATUS_OK) {
+            return rc;
+        }
+
+        browse->size += len;
+        browse->num_encoded = i + 1;
+        browse->offsets[browse->num_encoded] = (uint32_t)browse->size;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* bring the cache up to date with the database, called when it is frozen. */
+status_t tag_browse_update(struct tag_db_t *db)
+{
+    status_t rc = STATUS_OK;
+    struct tag_browse_t *browse = NULL;
+
+    if(!db || !(browse = db->browse)) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(ATOMIC_LOAD_U32(&browse->complete)) {
+        return STATUS_OK;
+    }
+
+    MUTEX_LOCK(browse->mutex);
+
+    if((rc = encode_new_tags(browse, db)) == STATUS_OK && db->frozen) {
+        ATOMIC_CAS_U32(&browse->complete, 0, 1);
+    }
+
+    MUTEX_UNLOCK(browse->mutex);
+
+    if(rc == STATUS_OK) {
+        detail("Browse cache holds %u tags in %zu bytes.", browse->num_encoded, browse->size);
+    }
+
+    return rc;
+}
+
+
+/* the last entry that still fits, entries [first, end) span offsets[end] - offsets[first] bytes. */
+static uint32_t find_page_end(const uint32_t *offsets, uint32_t first, uint32_t num_entries, size_t capacity)
+{
+    uint32_t lo = first;
+    uint32_t hi = num_entries;
+
+    while(lo < hi) {
+        uint32_t mid = lo + ((hi - lo + 1) / 2);
+
+        if(offsets[mid] - offsets[first] <= capacity) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    return lo;
+}
+
+
+static void copy_page(struct tag_browse_t *browse, uint32_t first, uint8_t *out, size_t capacity, size_t *out_len, bool *more)
+{
+    uint32_t end = first;
+
+    if(first < browse->num_encoded) {
+        end = find_page_end(browse->offsets, first, browse->num_encoded, capacity);
+    }
+
+    *out_len = 0;
+
+    if(end > first) {
+        *out_len = browse->offsets[end] - browse->offsets[first];
+        memcpy(out, browse->data + browse->offsets[first], *out_len);
+    }
+
+    *more = (end < browse->num_encoded);
+}
+
+
+/*
+ * Copy as many entries as fit, starting at start_instance.  Instance zero
+ * is where clients start and means the first tag.  more is set if the
+ * client needs to ask again from the instance after the last one returned.
+ */
+status_t tag_browse_page(struct tag_db_t *db, uint32_t start_instance, uint8_t *out, size_t capacity, size_t *out_len, bool *more)
+{
+    status_t rc = STATUS_OK;
+    struct tag_browse_t *browse = NULL;
+    uint32_t first = (start_instance ? start_instance - 1 : 0);
+
+    if(!db || !(browse = db->browse) || !out || !out_len || !more) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(ATOMIC_LOAD_U32(&browse->complete)) {
+        copy_page(browse, first, out, capacity, out_len, more);
+        return STATUS_OK;
+    }
+
+    MUTEX_LOCK(browse->mutex);
+
+    if((rc = encode_new_tags(browse, db)) == STATUS_OK) {
+        if(db->frozen) {
+            ATOMIC_CAS_U32(&browse->complete, 0, 1);
+        }
+
+        copy_page(browse, first, out, capacity, out_len, more);
+    }
+
+    MUTEX_UNLOCK(browse->mutex);
+
+    return rc;
+}
@@ -0,0 +1,70 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Symbol object browse replies, Get Instance Attribute List on class 0x6B.
+ *
+ * Each tag's entry for the usual attribute list (name, type, element size
+ * and dimensions) is encoded once, back to back in instance ID order, with
+ * the offset of every entry alongside.  A page is then the offset of the
+ * starting instance and one memcpy of the entries that fit.
+ *
+ * Instance IDs are only ever appended, so a tag added to the database never
+ * changes what was already encoded.  The next browse encodes the new tail
+ * and nothing else.  Once the database is frozen and fully encoded, pages
+ * are served without taking the lock.
+ */
+
+#define TAG_BROWSE_NUM_COMMON_ATTRS (4)
+
+extern const uint16_t tag_browse_common_attrs[TAG_BROWSE_NUM_COMMON_ATTRS];
+
+
+struct tag_t;
+struct tag_db_t;
+
+struct tag_browse_t {
+    mutex_t mutex;
+
+    /* set once a frozen database is fully encoded. */
+    uint32_t complete;
+
+    uint32_t num_encoded;
+    uint32_t *offsets;
+
+    size_t size;
+    size_t capacity;
+    uint8_t *data;
+};
+
+
+extern struct tag_browse_t *tag_browse_create(void);
+extern void tag_browse_dispose(struct tag_browse_t *browse);
+
+extern status_t tag_browse_update(struct tag_db_t *db);
+extern status_t tag_browse_page(struct tag_db_t *db, uint32_t start_instance, uint8_t *out, size_t capacity, size_t *out_len, bool *more);
+
+extern uint16_t tag_browse_symbol_type(const struct tag_t *tag);
+extern status_t tag_browse_encode_entry(const struct tag_t *tag, const uint16_t *attrs, uint16_t num_attrs, uint8_t *out, size_t capacity, size_t *out_len);
@@ -0,0 +1,365 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/data_files.h"
+#include "tags/tag.h"
+#include "tags/tag_browse.h"
+#include "tags/tag_db.h"
+#include "tags/value_gen.h"
+#include "util/debug.h"
+
+
+#define TAG_DB_MIN_CAPACITY (16)
+
+
+
+static inline char to_lower(char c)
+{
+    return ((c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c);
+}
+
+
+/* FNV-1a over the lower cased name.  Logix tag names are not case sensitive. */
+uint32_t tag_db_name_hash(const char *name, size_t name_len)
+{
+    uint32_t hash = 2166136261u;
+
+    for(size_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)to_lower(name[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+static size_t tag_alignment(const struct tag_t *tag)
+{
+    if(tag->udt) {
+        return tag->udt->alignment;
+    }
+
+    return (tag->elem_size >= 8 ? 8 : (tag->elem_size >= 4 ? 4 : (tag->elem_size >= 2 ? 2 : 1)));
+}
+
+
+static bool name_matches(const struct tag_t *tag, const char *name, size_t name_len)
+{
+    for(size_t i = 0; i < name_len; i++) {
+        if(tag->name[i] == 0 || to_lower(tag->name[i]) != to_lower(name[i])) {
+            return false;
+        }
+    }
+
+    return (tag->name[name_len] == 0);
+}
+
+
+
+struct tag_db_t *tag_db_create(uint32_t size_hint)
+{
+    struct tag_db_t *db = NULL;
+    uint32_t capacity = TAG_DB_MIN_CAPACITY;
+
+    while(capacity < size_hint) {
+        capacity *= 2;
+    }
+
+    if(!(db = calloc(1, sizeof(*db)))) {
+        warn("Unable to allocate tag database!");
+        return NULL;
+    }
+
+    db->refcount = 1;
+    db->capacity = capacity;
+    db->num_slots = capacity * 2;
+
+    db->tags = calloc(db->capacity, sizeof(*db->tags));
+    db->slots = calloc(db->num_slots, sizeof(*db->slots));
+    db->browse = tag_browse_create();
+
+    if(!db->tags || !db->slots || !db->browse) {
+        warn("Unable to allocate tag database index!");
+        tag_db_dispose(db);
+        return NULL;
+    }
+
+    return db;
+}
+
+
+/*
+ * Build a frozen database over tags that were laid out elsewhere, such as a
+ * snapshot.  The database takes ownership of the tag block but only borrows
+ * the hash slots, which must outlive it.
+ */
+struct tag_db_t *tag_db_create_bulk(struct tag_t *tag_block, uint32_t num_tags, uint32_t *slots, uint32_t num_slots, size_t data_size)
+{
+    struct tag_db_t *db = NULL;
+
+    if(!tag_block || !slots) {
+        warn("Called with NULL pointer(s)!");
+        return NULL;
+    }
+
+    if(num_slots == 0 || (num_slots & (num_slots - 1)) != 0 || num_slots <= num_tags) {
+        warn("Hash slot count %u must be a power of two larger than the tag count %u!", num_slots, num_tags);
+        return NULL;
+    }
+
+    if(!(db = calloc(1, sizeof(*db)))) {
+        warn("Unable to allocate tag database!");
+        return NULL;
+    }
+
+    db->tags = calloc(num_tags + 1, sizeof(*db->tags));
+    db->browse = tag_browse_create();
+
+    if(!db->tags || !db->browse) {
+        warn("Unable to allocate tag database index!");
+        free(db->tags);
+        tag_browse_dispose(db->browse);
+        free(db);
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < num_tags; i++) {
+        db->tags[i] = &(tag_block[i]);
+    }
+
+    db->refcount = 1;
+    db->data_size = data_size;
+    db->num_tags = num_tags;
+    db->capacity = num_tags;
+    db->num_slots = num_slots;
+    db->slots = slots;
+    db->frozen = true;
+    db->tag_block = tag_block;
+    db->borrowed_slots = true;
+
+    /* cheap enough to do now, unlike the browse pages. */
+    db->files = data_files_create(db);
+
+    return db;
+}
+
+
+struct tag_db_t *tag_db_ref(struct tag_db_t *db)
+{
+    if(db) {
+        db->refcount++;
+    }
+
+    return db;
+}
+
+
+void tag_db_dispose(struct tag_db_t *db)
+{
+    if(!db) {
+        return;
+    }
+
+    if(db->refcount > 1) {
+        db->refcount--;
+        return;
+    }
+
+    if(db->tags) {
+        for(uint32_t i = 0; i < db->num_tags; i++) {
+            if(db->tag_block) {
+                value_gen_dispose(db->tags[i]->gen);
+            } else {
+                tag_dispose(db->tags[i]);
+            }
+        }
+
+        free(db->tags);
+    }
+
+    if(db->tag_block) {
+        free(db->tag_block);
+    }
+
+    if(db->slots && !db->borrowed_slots) {
+        free(db->slots);
+    }
+
+    udt_registry_dispose(db->udts);
+    tag_browse_dispose(db->browse);
+    data_files_dispose(db->files);
+
+    free(db);
+}
+
+
+
+static void insert_slot(uint32_t *slots, uint32_t num_slots, uint32_t hash, uint32_t index)
+{
+    uint32_t mask = num_slots - 1;
+
+    for(uint32_t slot = hash & mask; ; slot = (slot + 1) & mask) {
+        if(!slots[slot]) {
+            slots[slot] = index + 1;
+            return;
+        }
+    }
+}
+
+
+/* double the capacity, the slot table stays at twice the capacity. */
+static status_t grow(struct tag_db_t *db)
+{
+    uint32_t new_capacity = db->capacity * 2;
+    struct tag_t **new_tags = NULL;
+    uint32_t *new_slots = NULL;
+
+    detail("Growing tag database from %u to %u tags.", db->capacity, new_capacity);
+
+    /* get both allocations before changing anything, so a failure leaves the database as it was. */
+    if(!(new_slots = calloc(new_capacity * 2, sizeof(*new_slots)))) {
+        warn("Unable to grow tag database hash table!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(!(new_tags = realloc(db->tags, new_capacity * sizeof(*new_tags)))) {
+        warn("Unable to grow tag database!");
+        free(new_slots);
+        return STATUS_NO_RESOURCE;
+    }
+
+    db->tags = new_tags;
+
+    for(uint32_t i = 0; i < db->num_tags; i++) {
+        insert_slot(new_slots, new_capacity * 2, db->tags[i]->name_hash, i);
+    }
+
+    free(db->slots);
+
+    db->slots = new_slots;
+    db->num_slots = new_capacity * 2;
+    db->capacity = new_capacity;
+
+    return STATUS_OK;
+}
+
+
+status_t tag_db_add(struct tag_db_t *db, struct tag_t *tag)
+{
+    status_t rc = STATUS_OK;
+    size_t name_len = 0;
+
+    if(!db || !tag) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(db->frozen) {
+        warn("Tag database is frozen, cannot add tag %s!", tag->name);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    name_len = strlen(tag->name);
+
+    if(tag_db_find(db, tag->name, name_len)) {
+        warn("Tag %s already exists!", tag->name);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(db->num_tags >= db->capacity) {
+        if((rc = grow(db)) != STATUS_OK) {
+            return rc;
+        }
+    }
+
+    tag->name_hash = tag_db_name_hash(tag->name, name_len);
+    /* instance IDs only grow, so the browse pages already encoded stay valid. */
+    tag->instance_id = db->num_tags + 1;
+
+    /* lay the value out in the image at its natural alignment. */
+    db->data_size = (db->data_size + (tag_alignment(tag) - 1)) & ~(tag_alignment(tag) - 1);
+    tag->data_offset = (uint32_t)db->data_size;
+    db->data_size += tag->data_size;
+
+    db->tags[db->num_tags] = tag;
+    insert_slot(db->slots, db->num_slots, tag->name_hash, db->num_tags);
+
+    db->num_tags++;
+
+    return STATUS_OK;
+}
+
+
+
+/*
+ * Browse pages are encoded here rather than on the first browse.  Bulk built
+ * databases are already frozen and encode on first use instead, so opening a
+ * snapshot stays cheap.
+ */
+void tag_db_freeze(struct tag_db_t *db)
+{
+    if(db) {
+        db->frozen = true;
+
+        if(tag_browse_update(db) != STATUS_OK) {
+            warn("Unable to pre-encode browse pages, they will be built on first use.");
+        }
+
+        if(!db->files) {
+            db->files = data_files_create(db);
+        }
+    }
+}
+
+
+
+struct tag_t *tag_db_find(struct tag_db_t *db, const char *name, size_t name_len)
+{
+    uint32_t hash = 0;
+    uint32_t mask = 0;
+
+    if(!db || !name) {
+        return NULL;
+    }
+
+    hash = tag_db_name_hash(name, name_len);
+    mask = db->num_slots - 1;
+
+    for(uint32_t slot = hash & mask; db->slots[slot]; slot = (slot + 1) & mask) {
+        struct tag_t *tag = db->tags[db->slots[slot] - 1];
+
+        if(tag->name_hash == hash && name_matches(tag, name, name_len)) {
+            return tag;
+        }
+    }
+
+    return NULL;
+}
+
+
+struct tag_t *tag_db_get_instance(struct tag_db_t *db, uint32_t instance_id)
+{
+    if(!db || instance_id == 0 || instance_id > db->num_tags) {
+        return NULL;
+    }
+
+    return db->tags[instance_id - 1];
+}
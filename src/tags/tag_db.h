@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tags/data_files.h"
+#include "tags/tag.h"
+#include "tags/tag_browse.h"
+#include "tags/udt.h"
+#include "util/status.h"
+
+
+/*
+ * The tag database for one simulated controller.
+ *
+ * Tags are kept in an array indexed by instance ID (Symbol object instance
+ * IDs start at 1) and in an open addressed hash table keyed by the case
+ * insensitive tag name.  Lookups by either are O(1).
+ *
+ * The database only describes the tags and where their values sit in a tag
+ * image.  The values themselves live in each device's tag_image_t, so
+ * devices running the same program share one database.
+ */
+
+struct tag_db_t {
+    /* only changed while devices are being created or disposed. */
+    uint32_t refcount;
+
+    /* the size of the tag image this database lays out. */
+    size_t data_size;
+
+    uint32_t num_tags;
+    uint32_t capacity;
+    struct tag_t **tags;
+
+    /* hash slots hold the array index plus one, zero is empty. */
+    uint32_t num_slots;
+    uint32_t *slots;
+
+    /* no tags can be added once frozen. */
+    bool frozen;
+
+    /* the structure definitions used by the tags, owned by the database. */
+    struct udt_registry_t *udts;
+
+    /* pre-encoded Symbol object browse pages. */
+    struct tag_browse_t *browse;
+
+    /* the tags PCCC clients see as data files, built when the database is frozen. */
+    struct data_files_t *files;
+
+    /* bulk built databases allocate all tags at once and may borrow the slots. */
+    struct tag_t *tag_block;
+    bool borrowed_slots;
+};
+
+
+extern struct tag_db_t *tag_db_create(uint32_t size_hint);
+extern struct tag_db_t *tag_db_create_bulk(struct tag_t *tag_block, uint32_t num_tags, uint32_t *slots, uint32_t num_slots, size_t data_size);
+extern struct tag_db_t *tag_db_ref(struct tag_db_t *db);
+extern void tag_db_dispose(struct tag_db_t *db);
+
+extern status_t tag_db_add(struct tag_db_t *db, struct tag_t *tag);
+extern void tag_db_freeze(struct tag_db_t *db);
+
+extern struct tag_t *tag_db_find(struct tag_db_t *db, const char *name, size_t name_len);
+extern struct tag_t *tag_db_get_instance(struct tag_db_t *db, uint32_t instance_id);
+
+extern uint32_t tag_db_name_hash(const char *name, size_t name_len);
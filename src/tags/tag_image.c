@@ -0,0 +1,370 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag_image.h"
+#include "util/debug.h"
+
+
+
+struct tag_image_template_t *tag_image_template_create(const uint8_t *data, size_t size)
+{
+    struct tag_image_template_t *tmpl = NULL;
+
+    if(!(tmpl = calloc(1, sizeof(*tmpl)))) {
+        warn("Unable to allocate image template!");
+        return NULL;
+    }
+
+    tmpl->refcount = 1;
+    tmpl->size = size;
+
+    /* no data means an all zero template, which costs nothing to share. */
+    if(data && size) {
+        if(!(tmpl->data = malloc(size))) {
+            warn("Unable to allocate %zu bytes for image template!", size);
+            free(tmpl);
+            return NULL;
+        }
+
+        memcpy(tmpl->data, data, size);
+    }
+
+    return tmpl;
+}
+
+
+/*
+ * Use data owned by someone else as the template without copying it.  Pages
+ * of a mapped file are then only read in when a device first touches them.
+ */
+struct tag_image_template_t *tag_image_template_wrap(const uint8_t *data, size_t size)
+{
+    struct tag_image_template_t *tmpl = NULL;
+
+    if(!(tmpl = calloc(1, sizeof(*tmpl)))) {
+        warn("Unable to allocate image template!");
+        return NULL;
+    }
+
+    tmpl->refcount = 1;
+    tmpl->size = size;
+    tmpl->data = (uint8_t *)data;
+    tmpl->borrowed = true;
+
+    return tmpl;
+}
+
+
+struct tag_image_template_t *tag_image_template_ref(struct tag_image_template_t *tmpl)
+{
+    if(tmpl) {
+        tmpl->refcount++;
+    }
+
+    return tmpl;
+}
+
+
+void tag_image_template_release(struct tag_image_template_t *tmpl)
+{
+    if(!tmpl) {
+        return;
+    }
+
+    if(--tmpl->refcount > 0) {
+        return;
+    }
+
+    if(tmpl->data && !tmpl->borrowed) {
+        free(tmpl->data);
+    }
+
+    free(tmpl);
+}
+
+
+
+
+struct tag_image_t *tag_image_create(struct tag_image_template_t *tmpl, size_t size)
+{
+    struct tag_image_t *image = NULL;
+
+    if(tmpl && tmpl->size != size) {
+        warn("Template size %zu does not match image size %zu!", tmpl->size, size);
+        return NULL;
+    }
+
+    if(!(image = calloc(1, sizeof(*image)))) {
+        warn("Unable to allocate tag image!");
+        return NULL;
+    }
+
+    image->size = size;
+    image->num_blocks = (uint32_t)((size + (TAG_IMAGE_BLOCK_SIZE - 1)) / TAG_IMAGE_BLOCK_SIZE);
+
+    if(image->num_blocks && !(image->blocks = calloc(image->num_blocks, sizeof(*image->blocks)))) {
+        warn("Unable to allocate block table for tag image!");
+        free(image);
+        return NULL;
+    }
+
+    image->tmpl = tag_image_template_ref(tmpl);
+
+    MUTEX_INIT(image->mutex);
+
+    return image;
+}
+
+
+void tag_image_dispose(struct tag_image_t *image)
+{
+    if(!image) {
+        return;
+    }
+
+    if(image->blocks) {
+        for(uint32_t i = 0; i < image->num_blocks; i++) {
+            if(image->blocks[i]) {
+                free(image->blocks[i]);
+            }
+        }
+
+        free(image->blocks);
+    }
+
+    tag_image_template_release(image->tmpl);
+
+    MUTEX_DESTROY(image->mutex);
+
+    free(image);
+}
+
+
+
+/* flatten the current contents of an image into a new template. */
+struct tag_image_template_t *tag_image_to_template(struct tag_image_t *image)
+{
+    struct tag_image_template_t *tmpl = NULL;
+    uint8_t *data = NULL;
+
+    if(!image) {
+        warn("Called with a NULL image pointer!");
+        return NULL;
+    }
+
+    /* an image nobody wrote to is all zero and so is its template. */
+    if(image->num_private_blocks == 0 && (!image->tmpl || !image->tmpl->data)) {
+        return tag_image_template_create(NULL, image->size);
+    }
+
+    if(!(data = malloc(image->size))) {
+        warn("Unable to allocate %zu bytes to flatten tag image!", image->size);
+        return NULL;
+    }
+
+    tag_image_read(image, 0, data, image->size);
+
+    tmpl = tag_image_template_create(data, image->size);
+
+    free(data);
+
+    return tmpl;
+}
+
+
+
+static inline const uint8_t *block_source(struct tag_image_t *image, uint32_t block)
+{
+    if(image->blocks[block]) {
+        return image->blocks[block];
+    }
+
+    if(image->tmpl && image->tmpl->data) {
+        return image->tmpl->data + ((size_t)block * TAG_IMAGE_BLOCK_SIZE);
+    }
+
+    return NULL;
+}
+
+
+status_t tag_image_read(struct tag_image_t *image, size_t offset, uint8_t *out, size_t length)
+{
+    if(!image || !out) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(offset > image->size || length > image->size - offset) {
+        warn("Read of %zu bytes at offset %zu is outside the image!", length, offset);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    MUTEX_LOCK(image->mutex);
+
+    while(length > 0) {
+        uint32_t block = (uint32_t)(offset / TAG_IMAGE_BLOCK_SIZE);
+        size_t block_offset = offset % TAG_IMAGE_BLOCK_SIZE;
+        size_t chunk = TAG_IMAGE_BLOCK_SIZE - block_offset;
+        const uint8_t *src = block_source(image, block);
+
+        if(chunk > length) {
+            chunk = length;
+        }
+
+        if(src) {
+            memcpy(out, src + block_offset, chunk);
+        } else {
+            memset(out, 0, chunk);
+        }
+
+        out += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    MUTEX_UNLOCK(image->mutex);
+
+    return STATUS_OK;
+}
+
+
+/* first write to a block, make a private copy.  Called with the mutex held. */
+static status_t make_private(struct tag_image_t *image, uint32_t block)
+{
+    const uint8_t *src = block_source(image, block);
+    size_t src_len = image->size - ((size_t)block * TAG_IMAGE_BLOCK_SIZE);
+    uint8_t *data = NULL;
+
+    if(!(data = malloc(TAG_IMAGE_BLOCK_SIZE))) {
+        warn("Unable to allocate private image block!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    if(src_len > TAG_IMAGE_BLOCK_SIZE) {
+        src_len = TAG_IMAGE_BLOCK_SIZE;
+    }
+
+    if(src) {
+        memcpy(data, src, src_len);
+        memset(data + src_len, 0, TAG_IMAGE_BLOCK_SIZE - src_len);
+    } else {
+        memset(data, 0, TAG_IMAGE_BLOCK_SIZE);
+    }
+
+    /* lock free word users look at the block pointer without the mutex. */
+    ATOMIC_STORE_PTR(&(image->blocks[block]), data);
+    image->num_private_blocks++;
+
+    return STATUS_OK;
+}
+
+
+status_t tag_image_write(struct tag_image_t *image, size_t offset, const uint8_t *in, size_t length)
+{
+    status_t rc = STATUS_OK;
+
+    if(!image || !in) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(offset > image->size || length > image->size - offset) {
+        warn("Write of %zu bytes at offset %zu is outside the image!", length, offset);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    MUTEX_LOCK(image->mutex);
+
+    while(length > 0) {
+        uint32_t block = (uint32_t)(offset / TAG_IMAGE_BLOCK_SIZE);
+        size_t block_offset = offset % TAG_IMAGE_BLOCK_SIZE;
+        size_t chunk = TAG_IMAGE_BLOCK_SIZE - block_offset;
+
+        if(chunk > length) {
+            chunk = length;
+        }
+
+        if(!image->blocks[block] && (rc = make_private(image, block)) != STATUS_OK) {
+            break;
+        }
+
+        memcpy(image->blocks[block] + block_offset, in, chunk);
+
+        in += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+
+    MUTEX_UNLOCK(image->mutex);
+
+    return rc;
+}
+
+
+
+/*
+ * A stable pointer to the private copy of an aligned 32-bit word, for lock
+ * free atomic updates.  Private blocks are never moved or freed while the
+ * image lives, so only the first touch of a block takes the mutex.
+ */
+uint32_t *tag_image_word(struct tag_image_t *image, size_t offset)
+{
+    uint32_t block = 0;
+    uint8_t *data = NULL;
+
+    if(!image || (offset & 3) != 0 || offset >= image->size) {
+        return NULL;
+    }
+
+    block = (uint32_t)(offset / TAG_IMAGE_BLOCK_SIZE);
+
+    if(!(data = ATOMIC_LOAD_PTR(&(image->blocks[block])))) {
+        MUTEX_LOCK(image->mutex);
+
+        if(image->blocks[block] || make_private(image, block) == STATUS_OK) {
+            data = image->blocks[block];
+        }
+
+        MUTEX_UNLOCK(image->mutex);
+
+        if(!data) {
+            return NULL;
+        }
+    }
+
+    return (uint32_t *)(void *)(data + (offset % TAG_IMAGE_BLOCK_SIZE));
+}
+
+
+
+void tag_image_get_stats(struct tag_image_t *image, struct tag_image_stats_t *stats)
+{
+    if(!image || !stats) {
+        return;
+    }
+
+    MUTEX_LOCK(image->mutex);
+
+    stats->private_bytes = (size_t)image->num_private_blocks * TAG_IMAGE_BLOCK_SIZE;
+    stats->shared_bytes = ((size_t)(image->num_blocks - image->num_private_blocks)) * TAG_IMAGE_BLOCK_SIZE;
+
+    MUTEX_UNLOCK(image->mutex);
+}
@@ -0,0 +1,88 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/shims.h"
+#include "util/status.h"
+
+
+/*
+ * Tag value images with block granular copy-on-write.
+ *
+ * Devices running the same program share one read-only template image.
+ * Each device has its own tag_image_t that reads through to the template
+ * until a block is written, at which point only that block is copied.
+ * Memory then grows with what each device changes, not with the number of
+ * devices.
+ *
+ * An image without a template reads as zeros and allocates blocks on first
+ * write.
+ */
+
+#define TAG_IMAGE_BLOCK_SIZE (4096)
+
+
+struct tag_image_template_t {
+    /* only changed while devices are being created or disposed. */
+    uint32_t refcount;
+
+    size_t size;
+    uint8_t *data;
+
+    /* the data belongs to someone else, like a mapped snapshot, and is not freed. */
+    bool borrowed;
+};
+
+
+struct tag_image_t {
+    mutex_t mutex;
+
+    struct tag_image_template_t *tmpl;
+
+    size_t size;
+    uint32_t num_blocks;
+    uint32_t num_private_blocks;
+
+    /* NULL entries read through to the template. */
+    uint8_t **blocks;
+};
+
+
+struct tag_image_stats_t {
+    size_t shared_bytes;
+    size_t private_bytes;
+};
+
+
+extern struct tag_image_template_t *tag_image_template_create(const uint8_t *data, size_t size);
+extern struct tag_image_template_t *tag_image_template_wrap(const uint8_t *data, size_t size);
+extern struct tag_image_template_t *tag_image_template_ref(struct tag_image_template_t *tmpl);
+extern void tag_image_template_release(struct tag_image_template_t *tmpl);
+
+extern struct tag_image_t *tag_image_create(struct tag_image_template_t *tmpl, size_t size);
+extern void tag_image_dispose(struct tag_image_t *image);
+
+extern struct tag_image_template_t *tag_image_to_template(struct tag_image_t *image);
+
+extern status_t tag_image_read(struct tag_image_t *image, size_t offset, uint8_t *out, size_t length);
+extern status_t tag_image_write(struct tag_image_t *image, size_t offset, const uint8_t *in, size_t length);
+extern uint32_t *tag_image_word(struct tag_image_t *image, size_t offset);
+
+extern void tag_image_get_stats(struct tag_image_t *image, struct tag_image_stats_t *stats);
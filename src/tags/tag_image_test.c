@@ -0,0 +1,190 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag_image.h"
+#include "util/debug.h"
+#include "util/unit_test.h"
+
+
+/* two and a half blocks, so the last one is short. */
+#define IMAGE_SIZE ((TAG_IMAGE_BLOCK_SIZE * 2) + (TAG_IMAGE_BLOCK_SIZE / 2))
+
+
+
+static void test_zero_image(void)
+{
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    struct tag_image_stats_t stats = {0};
+    uint8_t buf[16];
+
+    CHECK(image != NULL);
+
+    memset(buf, 0xAA, sizeof(buf));
+    CHECK_EQ(tag_image_read(image, TAG_IMAGE_BLOCK_SIZE - 8, buf, sizeof(buf)), STATUS_OK);
+
+    for(size_t i = 0; i < sizeof(buf); i++) {
+        CHECK_EQ(buf[i], 0);
+    }
+
+    tag_image_get_stats(image, &stats);
+    CHECK_EQ(stats.private_bytes, 0);
+
+    tag_image_dispose(image);
+}
+
+
+static void test_copy_on_write(void)
+{
+    uint8_t *data = malloc(IMAGE_SIZE);
+    struct tag_image_template_t *tmpl = NULL;
+    struct tag_image_t *a = NULL;
+    struct tag_image_t *b = NULL;
+    struct tag_image_stats_t stats = {0};
+    uint8_t patch[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t buf[8];
+
+    for(size_t i = 0; i < IMAGE_SIZE; i++) {
+        data[i] = (uint8_t)(i * 7);
+    }
+
+    tmpl = tag_image_template_create(data, IMAGE_SIZE);
+    CHECK(tmpl != NULL);
+
+    a = tag_image_create(tmpl, IMAGE_SIZE);
+    b = tag_image_create(tmpl, IMAGE_SIZE);
+    CHECK(a && b);
+    CHECK_EQ(tmpl->refcount, 3);
+
+    /* straddle the first block boundary, both blocks go private. */
+    CHECK_EQ(tag_image_write(a, TAG_IMAGE_BLOCK_SIZE - 4, patch, sizeof(patch)), STATUS_OK);
+
+    tag_image_get_stats(a, &stats);
+    CHECK_EQ(stats.private_bytes, 2 * TAG_IMAGE_BLOCK_SIZE);
+    CHECK_EQ(stats.shared_bytes, TAG_IMAGE_BLOCK_SIZE);
+
+    CHECK_EQ(tag_image_read(a, TAG_IMAGE_BLOCK_SIZE - 4, buf, sizeof(buf)), STATUS_OK);
+    CHECK(memcmp(buf, patch, sizeof(buf)) == 0);
+
+    /* the rest of a copied block keeps the template's bytes. */
+    CHECK_EQ(tag_image_read(a, 10, buf, 1), STATUS_OK);
+    CHECK_EQ(buf[0], data[10]);
+
+    /* the other device and the template do not see the write. */
+    CHECK_EQ(tag_image_read(b, TAG_IMAGE_BLOCK_SIZE - 4, buf, sizeof(buf)), STATUS_OK);
+    CHECK(memcmp(buf, data + TAG_IMAGE_BLOCK_SIZE - 4, sizeof(buf)) == 0);
+    CHECK(memcmp(tmpl->data + TAG_IMAGE_BLOCK_SIZE - 4, data + TAG_IMAGE_BLOCK_SIZE - 4, sizeof(buf)) == 0);
+
+    tag_image_get_stats(b, &stats);
+    CHECK_EQ(stats.private_bytes, 0);
+
+    /* the short last block copies only what the template has. */
+    CHECK_EQ(tag_image_write(b, IMAGE_SIZE - 1, patch, 1), STATUS_OK);
+    CHECK_EQ(tag_image_read(b, IMAGE_SIZE - 2, buf, 2), STATUS_OK);
+    CHECK_EQ(buf[0], data[IMAGE_SIZE - 2]);
+    CHECK_EQ(buf[1], patch[0]);
+
+    tag_image_dispose(a);
+    tag_image_dispose(b);
+    CHECK_EQ(tmpl->refcount, 1);
+
+    tag_image_template_release(tmpl);
+    free(data);
+}
+
+
+static void test_bounds(void)
+{
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    uint8_t buf[4] = {0};
+
+    CHECK_EQ(tag_image_read(image, IMAGE_SIZE - 2, buf, 4), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(tag_image_write(image, IMAGE_SIZE + 1, buf, 0), STATUS_OUT_OF_BOUNDS);
+    CHECK_EQ(tag_image_read(image, IMAGE_SIZE, buf, 0), STATUS_OK);
+
+    /* a template of the wrong size is refused. */
+    struct tag_image_template_t *tmpl = tag_image_template_create(NULL, 16);
+    CHECK(tag_image_create(tmpl, 32) == NULL);
+    tag_image_template_release(tmpl);
+
+    tag_image_dispose(image);
+}
+
+
+static void test_word(void)
+{
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    struct tag_image_stats_t stats = {0};
+    uint32_t *word = NULL;
+    uint8_t buf[4];
+
+    CHECK(tag_image_word(image, 2) == NULL);
+    CHECK(tag_image_word(image, IMAGE_SIZE) == NULL);
+
+    word = tag_image_word(image, TAG_IMAGE_BLOCK_SIZE + 4);
+    CHECK(word != NULL);
+
+    *word = 0x04030201;
+
+    CHECK_EQ(tag_image_read(image, TAG_IMAGE_BLOCK_SIZE + 4, buf, 4), STATUS_OK);
+    CHECK_EQ(buf[0], 1);
+    CHECK_EQ(buf[3], 4);
+
+    /* the pointer is stable, asking again gives the same word. */
+    CHECK(tag_image_word(image, TAG_IMAGE_BLOCK_SIZE + 4) == word);
+
+    tag_image_get_stats(image, &stats);
+    CHECK_EQ(stats.private_bytes, TAG_IMAGE_BLOCK_SIZE);
+
+    tag_image_dispose(image);
+}
+
+
+static void test_to_template(void)
+{
+    struct tag_image_t *image = tag_image_create(NULL, IMAGE_SIZE);
+    struct tag_image_template_t *tmpl = NULL;
+    uint8_t value = 0x5A;
+
+    tmpl = tag_image_to_template(image);
+    CHECK(tmpl != NULL && tmpl->data == NULL);
+    tag_image_template_release(tmpl);
+
+    CHECK_EQ(tag_image_write(image, 100, &value, 1), STATUS_OK);
+
+    tmpl = tag_image_to_template(image);
+    CHECK(tmpl != NULL && tmpl->data != NULL);
+    CHECK_EQ(tmpl->data[100], 0x5A);
+    CHECK_EQ(tmpl->data[101], 0);
+    tag_image_template_release(tmpl);
+
+    tag_image_dispose(image);
+}
+
+
+
+int main(void)
+{
+    debug_set_level(DEBUG_NONE);
+
+    test_zero_image();
+    test_copy_on_write();
+    test_bounds();
+    test_word();
+    test_to_template();
+
+    return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,1099 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "tags/tag_import.h"
+#include "tags/udt.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/file_map.h"
+#include "util/shims.h"
+#include "util/time_utils.h"
+
+
+#define IMPORT_MAX_NAME_LEN (128)
+#define IMPORT_MAX_TOKEN_LEN (64)
+#define IMPORT_MIN_ITEMS (256)
+#define IMPORT_CSV_MAX_FIELDS (8)
+
+
+/* one parsed tag and where its initial value sits in the worker's value buffer. */
+struct import_item_t {
+    struct tag_t *tag;
+    bool added;
+    size_t value_offset;
+    size_t value_len;
+};
+
+
+struct import_program_t {
+    const char *start;
+    const char *end;
+    const char *name;
+    size_t name_len;
+};
+
+
+struct import_t {
+    const char *data;
+    const char *data_end;
+    bool is_csv;
+
+    /* read only once the workers start. */
+    struct udt_registry_t *udts;
+
+    uint32_t num_programs;
+    uint32_t programs_capacity;
+    struct import_program_t *programs;
+};
+
+
+struct import_worker_t {
+    struct import_t *imp;
+
+    /* this worker parses the tags that start in [start, end). */
+    const char *start;
+    const char *end;
+
+    thread_t thread;
+    bool started;
+    status_t rc;
+
+    uint32_t num_items;
+    uint32_t items_capacity;
+    struct import_item_t *items;
+
+    uint8_t *values;
+    size_t values_len;
+    size_t values_capacity;
+
+    uint32_t num_skipped;
+};
+
+
+
+/*
+ * Scanning helpers.  The mapping is not NUL terminated so everything is
+ * bounded by an end pointer.
+ */
+
+static const char *find(const char *p, const char *end, const char *needle)
+{
+    size_t len = strlen(needle);
+
+    while(p && p + len <= end) {
+        const char *c = memchr(p, needle[0], (size_t)(end - p) - len + 1);
+
+        if(!c) {
+            return NULL;
+        }
+
+        if(memcmp(c, needle, len) == 0) {
+            return c;
+        }
+
+        p = c + 1;
+    }
+
+    return NULL;
+}
+
+
+/* find attr="..." in an element start tag, skipping over other attribute values. */
+static bool get_attr(const char *elem, const char *elem_end, const char *attr, const char **value, size_t *value_len)
+{
+    size_t attr_len = strlen(attr);
+
+    for(const char *p = elem + 1; p < elem_end; p++) {
+        if(*p == '"') {
+            const char *q = memchr(p + 1, '"', (size_t)(elem_end - p - 1));
+
+            if(!q) {
+                return false;
+            }
+
+            p = q;
+            continue;
+        }
+
+        if(isspace((unsigned char)p[-1]) && p + attr_len + 2 <= elem_end && memcmp(p, attr, attr_len) == 0 && p[attr_len] == '=' && p[attr_len + 1] == '"') {
+            const char *start = p + attr_len + 2;
+            const char *q = memchr(start, '"', (size_t)(elem_end - start));
+
+            if(!q) {
+                return false;
+            }
+
+            *value = start;
+            *value_len = (size_t)(q - start);
+
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static bool copy_attr(const char *elem, const char *elem_end, const char *attr, char *out, size_t out_size)
+{
+    const char *value = NULL;
+    size_t value_len = 0;
+
+    if(!get_attr(elem, elem_end, attr, &value, &value_len) || value_len >= out_size) {
+        return false;
+    }
+
+    memcpy(out, value, value_len);
+    out[value_len] = 0;
+
+    return true;
+}
+
+
+static bool attr_equals(const char *elem, const char *elem_end, const char *attr, const char *expected)
+{
+    const char *value = NULL;
+    size_t value_len = 0;
+
+    return (get_attr(elem, elem_end, attr, &value, &value_len) && value_len == strlen(expected) && memcmp(value, expected, value_len) == 0);
+}
+
+
+/* dimensions are written "10", "2 3" or "2,3".  Zero or empty means a scalar. */
+static uint8_t parse_dims(const char *s, size_t len, uint32_t *dims)
+{
+    uint8_t num_dims = 0;
+    size_t i = 0;
+
+    while(i < len && num_dims < TAG_MAX_DIMS) {
+        uint32_t dim = 0;
+        bool have_digits = false;
+
+        while(i < len && !isdigit((unsigned char)s[i])) {
+            i++;
+        }
+
+        while(i < len && isdigit((unsigned char)s[i])) {
+            dim = (dim * 10) + (uint32_t)(s[i] - '0');
+            have_digits = true;
+            i++;
+        }
+
+        if(have_digits && dim > 0) {
+            dims[num_dims++] = dim;
+        }
+    }
+
+    return num_dims;
+}
+
+
+static uint32_t dims_count(const uint32_t *dims, uint8_t num_dims)
+{
+    uint64_t count = 1;
+
+    for(uint8_t i = 0; i < num_dims; i++) {
+        count *= dims[i];
+    }
+
+    return (count > UINT32_MAX ? 0 : (uint32_t)count);
+}
+
+
+
+/*
+ * L5K values.  Numbers are decimal or Logix radix notation (16#00FF, 2#0101)
+ * with optional underscores, arrays are bracketed and comma separated.
+ */
+
+static inline bool is_value_separator(char c)
+{
+    return (c == '[' || c == ']' || c == ',' || isspace((unsigned char)c));
+}
+
+
+static bool next_token(const char **p, const char *end, char *tok)
+{
+    const char *s = *p;
+    size_t len = 0;
+
+    while(s < end && is_value_separator(*s)) {
+        s++;
+    }
+
+    while(s < end && !is_value_separator(*s)) {
+        if(len + 1 < IMPORT_MAX_TOKEN_LEN) {
+            tok[len++] = *s;
+        }
+
+        s++;
+    }
+
+    tok[len] = 0;
+    *p = s;
+
+    return (len > 0);
+}
+
+
+static int64_t token_to_int(const char *tok)
+{
+    const char *hash = strchr(tok, '#');
+    bool negative = (tok[0] == '-');
+    uint64_t value = 0;
+    int radix = 10;
+
+    if(!hash) {
+        return strtoll(tok, NULL, 10);
+    }
+
+    radix = atoi(negative ? tok + 1 : tok);
+    if(radix != 2 && radix != 8 && radix != 10 && radix != 16) {
+        return 0;
+    }
+
+    for(const char *c = hash + 1; *c; c++) {
+        int digit = 0;
+
+        if(*c == '_') {
+            continue;
+        }
+
+        if(isdigit((unsigned char)*c)) {
+            digit = *c - '0';
+        } else if(isxdigit((unsigned char)*c)) {
+            digit = toupper((unsigned char)*c) - 'A' + 10;
+        } else {
+            break;
+        }
+
+        if(digit >= radix) {
+            break;
+        }
+
+        value = (value * (uint64_t)radix) + (uint64_t)digit;
+    }
+
+    return (negative ? -(int64_t)value : (int64_t)value);
+}
+
+
+static void encode_element(uint16_t type, uint8_t *out, const char *tok)
+{
+    switch(type) {
+        case TAG_TYPE_REAL: {
+                float f = (float)strtod(tok, NULL);
+                uint32_t bits = 0;
+
+                memcpy(&bits, &f, sizeof(bits));
+                encode_uint32_le(out, bits);
+            }
+            break;
+
+        case TAG_TYPE_LREAL: {
+                double d = strtod(tok, NULL);
+                uint64_t bits = 0;
+
+                memcpy(&bits, &d, sizeof(bits));
+                encode_uint64_le(out, bits);
+            }
+            break;
+
+        case TAG_TYPE_BOOL: out[0] = (token_to_int(tok) != 0 ? 1 : 0); break;
+
+        default:
+            switch(tag_type_size(type)) {
+                case 1: out[0] = (uint8_t)token_to_int(tok); break;
+                case 2: encode_uint16_le(out, (uint16_t)token_to_int(tok)); break;
+                case 4: encode_uint32_le(out, (uint32_t)token_to_int(tok)); break;
+                case 8: encode_uint64_le(out, (uint64_t)token_to_int(tok)); break;
+                default: break;
+            }
+            break;
+    }
+}
+
+
+/* decode L5K data into the tag's storage layout.  Missing values stay zero. */
+static void parse_l5k_values(const struct tag_t *tag, const char *p, const char *end, uint8_t *out)
+{
+    char tok[IMPORT_MAX_TOKEN_LEN];
+    uint32_t index = 0;
+
+    /* packed BOOL arrays are exported as whole words too, so this is the same loop. */
+    while(index < tag->elem_count && next_token(&p, end, tok)) {
+        encode_element(tag->type, out + ((size_t)index * tag->elem_size), tok);
+        index++;
+    }
+}
+
+
+
+/*
+ * Worker output
+ */
+
+/* the worker owns the tag from here on, even if this fails. */
+static status_t add_item(struct import_worker_t *w, struct tag_t *tag, size_t value_len, uint8_t **value)
+{
+    struct import_item_t *item = NULL;
+
+    if(w->num_items >= w->items_capacity) {
+        uint32_t new_capacity = (w->items_capacity ? w->items_capacity * 2 : IMPORT_MIN_ITEMS);
+        struct import_item_t *new_items = realloc(w->items, new_capacity * sizeof(*new_items));
+
+        if(!new_items) {
+            warn("Unable to grow import tag list!");
+            tag_dispose(tag);
+            return STATUS_NO_RESOURCE;
+        }
+
+        w->items = new_items;
+        w->items_capacity = new_capacity;
+    }
+
+    if(value_len && w->values_len + value_len > w->values_capacity) {
+        size_t new_capacity = (w->values_capacity ? w->values_capacity * 2 : 4096);
+        uint8_t *new_values = NULL;
+
+        while(new_capacity < w->values_len + value_len) {
+            new_capacity *= 2;
+        }
+
+        if(!(new_values = realloc(w->values, new_capacity))) {
+            warn("Unable to grow import value buffer!");
+            tag_dispose(tag);
+            return STATUS_NO_RESOURCE;
+        }
+
+        w->values = new_values;
+        w->values_capacity = new_capacity;
+    }
+
+    item = &(w->items[w->num_items++]);
+    item->tag = tag;
+    item->added = false;
+    item->value_offset = w->values_len;
+    item->value_len = value_len;
+
+    if(value_len) {
+        memset(w->values + w->values_len, 0, value_len);
+        *value = w->values + w->values_len;
+        w->values_len += value_len;
+    }
+
+    return STATUS_OK;
+}
+
+
+static struct tag_t *make_tag(struct import_t *imp, const char *name, const char *type_name, size_t type_len, const uint32_t *dims, uint8_t num_dims)
+{
+    struct tag_t *tag = NULL;
+    uint16_t type = tag_type_from_name(type_name, type_len);
+    uint32_t elem_count = dims_count(dims, num_dims);
+
+    if(elem_count == 0) {
+        return NULL;
+    }
+
+    if(type) {
+        tag = tag_create(name, type, elem_count);
+    } else {
+        struct udt_t *udt = udt_registry_find(imp->udts, type_name, type_len);
+
+        if(!udt) {
+            detail("Skipping tag %s of unknown type %.*s.", name, (int)type_len, type_name);
+            return NULL;
+        }
+
+        tag = tag_create_struct(name, udt, elem_count);
+    }
+
+    if(tag) {
+        tag->num_dims = num_dims;
+        memcpy(tag->dims, dims, sizeof(tag->dims));
+    }
+
+    return tag;
+}
+
+
+
+/*
+ * L5X
+ */
+
+static const struct import_program_t *find_program(struct import_t *imp, const char *pos)
+{
+    uint32_t lo = 0;
+    uint32_t hi = imp->num_programs;
+
+    /* the last program starting before pos. */
+    while(lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if(imp->programs[mid].start <= pos) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if(lo == 0 || pos >= imp->programs[lo - 1].end) {
+        return NULL;
+    }
+
+    return &(imp->programs[lo - 1]);
+}
+
+
+static status_t parse_l5x_tag(struct import_worker_t *w, const char *elem, const char **next)
+{
+    struct import_t *imp = w->imp;
+    const char *gt = memchr(elem, '>', (size_t)(imp->data_end - elem));
+    const char *body_end = NULL;
+    const struct import_program_t *program = NULL;
+    const char *tag_name = NULL;
+    const char *type_name = NULL;
+    const char *dims_str = "";
+    size_t tag_name_len = 0;
+    size_t type_len = 0;
+    size_t dims_len = 0;
+    char name[IMPORT_MAX_NAME_LEN];
+    uint32_t dims[TAG_MAX_DIMS] = {0};
+    uint8_t num_dims = 0;
+    struct tag_t *tag = NULL;
+    uint8_t *value = NULL;
+    status_t rc = STATUS_OK;
+
+    if(!gt) {
+        *next = imp->data_end;
+        return STATUS_BAD_INPUT;
+    }
+
+    if(gt[-1] == '/') {
+        body_end = gt;
+        *next = gt + 1;
+    } else {
+        if(!(body_end = find(gt, imp->data_end, "</Tag>"))) {
+            *next = imp->data_end;
+            return STATUS_BAD_INPUT;
+        }
+
+        *next = body_end + 6;
+    }
+
+    if(!get_attr(elem, gt, "Name", &tag_name, &tag_name_len) || !get_attr(elem, gt, "DataType", &type_name, &type_len)) {
+        /* aliases have no data type of their own. */
+        w->num_skipped++;
+        return STATUS_OK;
+    }
+
+    if(attr_equals(elem, gt, "TagType", "Alias")) {
+        w->num_skipped++;
+        return STATUS_OK;
+    }
+
+    if(get_attr(elem, gt, "Dimensions", &dims_str, &dims_len)) {
+        num_dims = parse_dims(dims_str, dims_len, dims);
+    }
+
+    if((program = find_program(imp, elem))) {
+        snprintf(name, sizeof(name), "Program:%.*s.%.*s", (int)program->name_len, program->name, (int)tag_name_len, tag_name);
+    } else {
+        snprintf(name, sizeof(name), "%.*s", (int)tag_name_len, tag_name);
+    }
+
+    if(!(tag = make_tag(imp, name, type_name, type_len, dims, num_dims))) {
+        w->num_skipped++;
+        return STATUS_OK;
+    }
+
+    /* only elementary values are decoded, structures start out zeroed. */
+    if(tag->udt) {
+        return add_item(w, tag, 0, NULL);
+    }
+
+    if((rc = add_item(w, tag, tag->data_size, &value)) != STATUS_OK) {
+        return rc;
+    }
+
+    for(const char *data = find(gt, body_end, "<Data "); data; data = find(data + 1, body_end, "<Data ")) {
+        const char *data_gt = memchr(data, '>', (size_t)(body_end - data));
+        const char *cdata = NULL;
+        const char *cdata_end = NULL;
+
+        if(!data_gt || !attr_equals(data, data_gt, "Format", "L5K")) {
+            continue;
+        }
+
+        if((cdata = find(data_gt, body_end, "<![CDATA[")) && (cdata_end = find(cdata, body_end, "]]>"))) {
+            parse_l5k_values(tag, cdata + 9, cdata_end, value);
+        }
+
+        break;
+    }
+
+    return STATUS_OK;
+}
+
+
+static status_t parse_l5x_chunk(struct import_worker_t *w)
+{
+    status_t rc = STATUS_OK;
+    const char *p = w->start;
+
+    /* a tag that starts in this chunk is ours even if it ends in the next one. */
+    while(rc == STATUS_OK && (p = find(p, w->end, "<Tag "))) {
+        rc = parse_l5x_tag(w, p, &p);
+    }
+
+    return rc;
+}
+
+
+static status_t parse_l5x_types(struct import_t *imp)
+{
+    status_t rc = STATUS_OK;
+    const char *section = find(imp->data, imp->data_end, "<DataTypes>");
+    const char *section_end = (section ? find(section, imp->data_end, "</DataTypes>") : NULL);
+
+    if(!section || !section_end) {
+        return STATUS_OK;
+    }
+
+    for(const char *dt = find(section, section_end, "<DataType "); dt && rc == STATUS_OK; ) {
+        const char *gt = memchr(dt, '>', (size_t)(section_end - dt));
+        const char *dt_end = NULL;
+        char name[UDT_MAX_NAME_LEN + 1];
+        struct udt_t *udt = NULL;
+
+        if(!gt || !copy_attr(dt, gt, "Name", name, sizeof(name))) {
+            warn("Malformed DataType definition!");
+            return STATUS_BAD_INPUT;
+        }
+
+        if(gt[-1] == '/' || !(dt_end = find(gt, section_end, "</DataType>"))) {
+            dt = find(gt, section_end, "<DataType ");
+            continue;
+        }
+
+        if(!(udt = udt_create(name, strlen(name)))) {
+            return STATUS_NO_RESOURCE;
+        }
+
+        for(const char *m = find(gt, dt_end, "<Member "); m && rc == STATUS_OK; m = find(m + 1, dt_end, "<Member ")) {
+            const char *m_gt = memchr(m, '>', (size_t)(dt_end - m));
+            char member_name[UDT_MAX_NAME_LEN + 1];
+            char member_type[UDT_MAX_NAME_LEN + 1];
+            char target[UDT_MAX_NAME_LEN + 1];
+            char bit_number[16] = "0";
+            const char *dim_str = "";
+            size_t dim_len = 0;
+            uint32_t dims[TAG_MAX_DIMS] = {0};
+            bool is_bit = false;
+
+            if(!m_gt || !copy_attr(m, m_gt, "Name", member_name, sizeof(member_name)) || !copy_attr(m, m_gt, "DataType", member_type, sizeof(member_type))) {
+                warn("Malformed member in DataType %s!", name);
+                rc = STATUS_BAD_INPUT;
+                break;
+            }
+
+            get_attr(m, m_gt, "Dimension", &dim_str, &dim_len);
+            is_bit = (strcmp(member_type, "BIT") == 0);
+
+            if(is_bit && !copy_attr(m, m_gt, "Target", target, sizeof(target))) {
+                warn("BIT member %s of DataType %s has no target!", member_name, name);
+                rc = STATUS_BAD_INPUT;
+                break;
+            }
+
+            copy_attr(m, m_gt, "BitNumber", bit_number, sizeof(bit_number));
+
+            rc = udt_add_member(udt, member_name, member_type,
+                                (parse_dims(dim_str, dim_len, dims) ? dims[0] : 0),
+                                attr_equals(m, m_gt, "Hidden", "true"),
+                                (is_bit ? target : NULL),
+                                (int32_t)atoi(bit_number));
+        }
+
+        if(rc == STATUS_OK) {
+            rc = udt_registry_add(imp->udts, udt);
+        }
+
+        if(rc != STATUS_OK) {
+            udt_dispose(udt);
+            break;
+        }
+
+        dt = find(dt_end, section_end, "<DataType ");
+    }
+
+    return rc;
+}
+
+
+static status_t collect_l5x_programs(struct import_t *imp)
+{
+    for(const char *p = find(imp->data, imp->data_end, "<Program "); p; ) {
+        const char *gt = memchr(p, '>', (size_t)(imp->data_end - p));
+        struct import_program_t *program = NULL;
+
+        if(!gt) {
+            return STATUS_BAD_INPUT;
+        }
+
+        if(imp->num_programs >= imp->programs_capacity) {
+            uint32_t new_capacity = (imp->programs_capacity ? imp->programs_capacity * 2 : 16);
+            struct import_program_t *new_programs = realloc(imp->programs, new_capacity * sizeof(*new_programs));
+
+            if(!new_programs) {
+                warn("Unable to grow program list!");
+                return STATUS_NO_RESOURCE;
+            }
+
+            imp->programs = new_programs;
+            imp->programs_capacity = new_capacity;
+        }
+
+        program = &(imp->programs[imp->num_programs]);
+
+        if(!get_attr(p, gt, "Name", &program->name, &program->name_len)) {
+            warn("Program without a name!");
+            return STATUS_BAD_INPUT;
+        }
+
+        program->start = p;
+        program->end = find(gt, imp->data_end, "</Program>");
+
+        if(!program->end || gt[-1] == '/') {
+            program->end = gt;
+        }
+
+        imp->num_programs++;
+
+        p = find(program->end, imp->data_end, "<Program ");
+    }
+
+    return STATUS_OK;
+}
+
+
+
+/*
+ * CSV
+ *
+ *   TYPE,SCOPE,NAME,DESCRIPTION,DATATYPE,SPECIFIER,ATTRIBUTES
+ *   TAG,,Counts,"","DINT[100]","","(RadixDecimal)"
+ *   TAG,MainProgram,Step,"","INT","",""
+ */
+
+struct csv_field_t {
+    const char *data;
+    size_t len;
+};
+
+
+static uint32_t split_csv(const char *line, const char *line_end, struct csv_field_t *fields)
+{
+    uint32_t num_fields = 0;
+    const char *p = line;
+
+    while(p <= line_end && num_fields < IMPORT_CSV_MAX_FIELDS) {
+        struct csv_field_t *field = &(fields[num_fields++]);
+
+        if(p < line_end && *p == '"') {
+            const char *q = p + 1;
+
+            /* doubled quotes are kept as is, tag names and types never have them. */
+            while(q < line_end && !(q[0] == '"' && (q + 1 >= line_end || q[1] != '"'))) {
+                q += (q[0] == '"' ? 2 : 1);
+            }
+
+            field->data = p + 1;
+            field->len = (size_t)(q - p - 1);
+            p = (q < line_end ? q + 1 : line_end);
+        } else {
+            const char *comma = memchr(p, ',', (size_t)(line_end - p));
+
+            field->data = p;
+            field->len = (size_t)((comma ? comma : line_end) - p);
+            p = (comma ? comma : line_end);
+        }
+
+        if(p >= line_end) {
+            break;
+        }
+
+        p++;
+    }
+
+    return num_fields;
+}
+
+
+static status_t parse_csv_line(struct import_worker_t *w, const char *line, const char *line_end)
+{
+    struct csv_field_t fields[IMPORT_CSV_MAX_FIELDS] = {{0}};
+    uint32_t num_fields = split_csv(line, line_end, fields);
+    const char *bracket = NULL;
+    char name[IMPORT_MAX_NAME_LEN];
+    uint32_t dims[TAG_MAX_DIMS] = {0};
+    uint8_t num_dims = 0;
+    size_t type_len = 0;
+    struct tag_t *tag = NULL;
+
+    if(num_fields < 5 || fields[0].len != 3 || memcmp(fields[0].data, "TAG", 3) != 0) {
+        /* remarks, headers, aliases and comments. */
+        return STATUS_OK;
+    }
+
+    type_len = fields[4].len;
+
+    if((bracket = memchr(fields[4].data, '[', fields[4].len))) {
+        type_len = (size_t)(bracket - fields[4].data);
+        num_dims = parse_dims(bracket, fields[4].len - type_len, dims);
+    }
+
+    if(fields[1].len) {
+        snprintf(name, sizeof(name), "Program:%.*s.%.*s", (int)fields[1].len, fields[1].data, (int)fields[2].len, fields[2].data);
+    } else {
+        snprintf(name, sizeof(name), "%.*s", (int)fields[2].len, fields[2].data);
+    }
+
+    if(!(tag = make_tag(w->imp, name, fields[4].data, type_len, dims, num_dims))) {
+        w->num_skipped++;
+        return STATUS_OK;
+    }
+
+    return add_item(w, tag, 0, NULL);
+}
+
+
+static status_t parse_csv_chunk(struct import_worker_t *w)
+{
+    status_t rc = STATUS_OK;
+    const char *p = w->start;
+
+    while(rc == STATUS_OK && p < w->end) {
+        const char *nl = memchr(p, '\n', (size_t)(w->end - p));
+        const char *line_end = (nl ? nl : w->end);
+
+        if(line_end > p && line_end[-1] == '\r') {
+            line_end--;
+        }
+
+        rc = parse_csv_line(w, p, line_end);
+
+        p = (nl ? nl + 1 : w->end);
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * Driving the workers
+ */
+
+static void *import_thread_func(void *arg)
+{
+    struct import_worker_t *w = (struct import_worker_t *)arg;
+
+    w->rc = (w->imp->is_csv ? parse_csv_chunk(w) : parse_l5x_chunk(w));
+
+    return NULL;
+}
+
+
+/* move a split point forward to the start of the next tag. */
+static const char *snap_to_boundary(struct import_t *imp, const char *p)
+{
+    const char *boundary = NULL;
+
+    if(imp->is_csv) {
+        boundary = memchr(p, '\n', (size_t)(imp->data_end - p));
+        boundary = (boundary ? boundary + 1 : NULL);
+    } else {
+        boundary = find(p, imp->data_end, "<Tag ");
+    }
+
+    return (boundary ? boundary : imp->data_end);
+}
+
+
+static status_t run_workers(struct import_t *imp, const char *start, struct import_worker_t *workers, uint32_t num_workers)
+{
+    status_t rc = STATUS_OK;
+    size_t chunk = (size_t)(imp->data_end - start) / num_workers;
+    const char *p = start;
+
+    for(uint32_t i = 0; i < num_workers; i++) {
+        workers[i].imp = imp;
+        workers[i].start = p;
+        workers[i].end = (i + 1 == num_workers ? imp->data_end : snap_to_boundary(imp, start + ((i + 1) * chunk)));
+
+        if(workers[i].end < p) {
+            workers[i].end = p;
+        }
+
+        p = workers[i].end;
+    }
+
+    /* the last chunk is parsed on this thread. */
+    for(uint32_t i = 0; i + 1 < num_workers; i++) {
+        if(!(workers[i].started = THREAD_CREATE(workers[i].thread, import_thread_func, &(workers[i])))) {
+            warn("Unable to start import worker %u, parsing its chunk inline.", i);
+            import_thread_func(&(workers[i]));
+        }
+    }
+
+    import_thread_func(&(workers[num_workers - 1]));
+
+    for(uint32_t i = 0; i < num_workers; i++) {
+        if(workers[i].started) {
+            THREAD_JOIN(workers[i].thread);
+        }
+
+        if(workers[i].rc != STATUS_OK && rc == STATUS_OK) {
+            rc = workers[i].rc;
+        }
+    }
+
+    return rc;
+}
+
+
+/* add the tags in file order, then write the initial values into a fresh image. */
+static status_t build_results(struct import_t *imp, struct import_worker_t *workers, uint32_t num_workers, struct tag_db_t **db_out, struct tag_image_template_t **tmpl_out, uint32_t *num_skipped)
+{
+    status_t rc = STATUS_OK;
+    uint32_t total = 0;
+    struct tag_db_t *db = NULL;
+    struct tag_image_t *image = NULL;
+
+    for(uint32_t i = 0; i < num_workers; i++) {
+        total += workers[i].num_items;
+    }
+
+    /* sized once, the index never grows or rehashes. */
+    if(!(db = tag_db_create(total))) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    db->udts = imp->udts;
+    imp->udts = NULL;
+
+    for(uint32_t i = 0; i < num_workers; i++) {
+        for(uint32_t j = 0; j < workers[i].num_items; j++) {
+            struct import_item_t *item = &(workers[i].items[j]);
+
+            if(tag_db_add(db, item->tag) == STATUS_OK) {
+                item->added = true;
+            } else {
+                tag_dispose(item->tag);
+                item->tag = NULL;
+                (*num_skipped)++;
+            }
+        }
+    }
+
+    if(!(image = tag_image_create(NULL, db->data_size))) {
+        tag_db_dispose(db);
+        return STATUS_NO_RESOURCE;
+    }
+
+    for(uint32_t i = 0; i < num_workers && rc == STATUS_OK; i++) {
+        for(uint32_t j = 0; j < workers[i].num_items && rc == STATUS_OK; j++) {
+            struct import_item_t *item = &(workers[i].items[j]);
+            const uint8_t *value = workers[i].values + item->value_offset;
+            bool all_zero = true;
+
+            if(!item->tag) {
+                continue;
+            }
+
+            for(size_t k = 0; k < item->value_len && all_zero; k++) {
+                all_zero = (value[k] == 0);
+            }
+
+            /* the image starts out zeroed. */
+            if(!all_zero) {
+                rc = tag_image_write(image, item->tag->data_offset, value, item->value_len);
+            }
+        }
+    }
+
+    if(rc == STATUS_OK && !(*tmpl_out = tag_image_to_template(image))) {
+        rc = STATUS_NO_RESOURCE;
+    }
+
+    tag_image_dispose(image);
+
+    if(rc != STATUS_OK) {
+        tag_db_dispose(db);
+        return rc;
+    }
+
+    *db_out = db;
+
+    return STATUS_OK;
+}
+
+
+static void dispose_workers(struct import_worker_t *workers, uint32_t num_workers)
+{
+    for(uint32_t i = 0; i < num_workers; i++) {
+        for(uint32_t j = 0; j < workers[i].num_items; j++) {
+            if(!workers[i].items[j].added) {
+                tag_dispose(workers[i].items[j].tag);
+            }
+        }
+
+        free(workers[i].items);
+        free(workers[i].values);
+    }
+
+    free(workers);
+}
+
+
+static bool looks_like_csv(const char *path, const char *data, size_t size)
+{
+    size_t path_len = strlen(path);
+
+    if(path_len > 4 && (strcmp(path + path_len - 4, ".csv") == 0 || strcmp(path + path_len - 4, ".CSV") == 0)) {
+        return true;
+    }
+
+    /* skip a UTF-8 byte order mark and whitespace, XML starts with '<'. */
+    for(size_t i = 0; i < size; i++) {
+        if(!isspace((unsigned char)data[i]) && (unsigned char)data[i] < 0x80) {
+            return (data[i] != '<');
+        }
+    }
+
+    return false;
+}
+
+
+
+status_t tag_import_file(const char *path, uint32_t num_workers, struct tag_db_t **db, struct tag_image_template_t **tmpl)
+{
+    status_t rc = STATUS_OK;
+    struct file_map_t map = {0};
+    struct import_t imp = {0};
+    struct import_worker_t *workers = NULL;
+    const char *start = NULL;
+    uint32_t num_skipped = 0;
+    int64_t start_ns = util_time_mono_ns();
+
+    info("Starting.");
+
+    do {
+        if(!path || !db || !tmpl) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        *db = NULL;
+        *tmpl = NULL;
+
+        if(num_workers == 0) {
+            num_workers = 1;
+        } else if(num_workers > TAG_IMPORT_MAX_WORKERS) {
+            num_workers = TAG_IMPORT_MAX_WORKERS;
+        }
+
+        if((rc = file_map_open(&map, path)) != STATUS_OK) {
+            break;
+        }
+
+        imp.data = (const char *)map.data;
+        imp.data_end = imp.data + map.size;
+        imp.is_csv = looks_like_csv(path, imp.data, map.size);
+
+        if(!(imp.udts = udt_registry_create())) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(imp.is_csv) {
+            start = imp.data;
+        } else {
+            if((rc = parse_l5x_types(&imp)) != STATUS_OK || (rc = collect_l5x_programs(&imp)) != STATUS_OK) {
+                warn("Error %s parsing the structure of %s!", status_to_str(rc), path);
+                break;
+            }
+
+            start = snap_to_boundary(&imp, imp.data);
+        }
+
+        /* structures are laid out once, before any worker needs them. */
+        if((rc = udt_registry_add_builtins(imp.udts)) != STATUS_OK || (rc = udt_registry_resolve(imp.udts)) != STATUS_OK) {
+            break;
+        }
+
+        /* small files are not worth the threads. */
+        if((size_t)(imp.data_end - start) < (size_t)num_workers * 65536) {
+            num_workers = (uint32_t)((size_t)(imp.data_end - start) / 65536) + 1;
+        }
+
+        if(!(workers = calloc(num_workers, sizeof(*workers)))) {
+            warn("Unable to allocate import workers!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if((rc = run_workers(&imp, start, workers, num_workers)) != STATUS_OK) {
+            warn("Error %s parsing tags in %s!", status_to_str(rc), path);
+            break;
+        }
+
+        for(uint32_t i = 0; i < num_workers; i++) {
+            num_skipped += workers[i].num_skipped;
+        }
+
+        if((rc = build_results(&imp, workers, num_workers, db, tmpl, &num_skipped)) != STATUS_OK) {
+            break;
+        }
+
+        info("Imported %u tags and %u structures from %s with %u workers in %lld ms, skipped %u.",
+             (*db)->num_tags, (*db)->udts->num_udts, path, num_workers,
+             (long long)((util_time_mono_ns() - start_ns) / 1000000), num_skipped);
+    } while(0);
+
+    dispose_workers(workers, (workers ? num_workers : 0));
+    udt_registry_dispose(imp.udts);
+    free(imp.programs);
+    file_map_close(&map);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
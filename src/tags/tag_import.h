@@ -0,0 +1,43 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "util/status.h"
+
+
+/*
+ * Import tag definitions from Logix L5X project exports and RSLogix tag CSV
+ * exports.
+ *
+ * The file is mapped, never read into a buffer.  Structure definitions are
+ * parsed and laid out once up front and then shared read only.  The tag
+ * section is cut into one chunk per worker thread on tag boundaries and the
+ * chunks are parsed in parallel.  The results are stitched together in file
+ * order into a database sized for all of the tags at once, and the L5K
+ * initial values of elementary tags are written into a template image.
+ *
+ * Alias tags and tags of unknown types (such as Add-On Instructions) are
+ * skipped and counted.
+ */
+
+#define TAG_IMPORT_MAX_WORKERS (64)
+
+
+extern status_t tag_import_file(const char *path, uint32_t num_workers, struct tag_db_t **db, struct tag_image_template_t **tmpl);
@@ -0,0 +1,780 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef IS_WINDOWS
+    #include <windows.h>
+#else
+    #include <unistd.h>
+#endif
+
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "tags/tag_snapshot.h"
+#include "tags/udt.h"
+#include "tags/value_gen.h"
+#include "util/buf.h"
+#include "util/debug.h"
+#include "util/file_map.h"
+#include "util/time_utils.h"
+
+
+/*
+ * File layout, all little endian:
+ *
+ *   header       magic, version, counts and a section table
+ *   index        one fixed size entry per tag in instance ID order
+ *   slots        the name hash table, array index plus one, zero is empty
+ *   types        one descriptor per type used by the tags
+ *   names        NUL terminated tag names
+ *   templates    structure definitions, laid out again when loaded
+ *   values       the value arena, page aligned so it can be mapped directly
+ */
+
+#define SNAPSHOT_MAGIC "TSIMSNAP"
+#define SNAPSHOT_MAGIC_SIZE (8)
+#define SNAPSHOT_PAGE_SIZE (4096)
+
+#define SNAPSHOT_HEADER_SIZE (128)
+#define SNAPSHOT_INDEX_ENTRY_SIZE (48)
+#define SNAPSHOT_TYPE_ENTRY_SIZE (8)
+
+typedef enum {
+    SECTION_INDEX = 0,
+    SECTION_SLOTS,
+    SECTION_TYPES,
+    SECTION_NAMES,
+    SECTION_VALUES,
+    SECTION_TEMPLATES,
+
+    SECTION_COUNT,
+} snapshot_section_t;
+
+/* header field offsets */
+#define HDR_MAGIC (0)
+#define HDR_VERSION (8)
+#define HDR_HEADER_SIZE (12)
+#define HDR_NUM_TAGS (16)
+#define HDR_NUM_SLOTS (20)
+#define HDR_NUM_TYPES (24)
+#define HDR_NUM_SECTIONS (28)
+#define HDR_SECTIONS (32)      /* offset and size, 8 bytes each, per section */
+
+/* index entry field offsets */
+#define IDX_NAME_OFFSET (0)
+#define IDX_NAME_HASH (4)
+#define IDX_TYPE (8)
+#define IDX_ELEM_SIZE (10)
+#define IDX_ELEM_COUNT (12)
+#define IDX_DATA_OFFSET (16)
+#define IDX_DATA_SIZE (20)
+#define IDX_TEMPLATE (24)      /* structure instance ID, zero for elementary tags */
+#define IDX_NUM_DIMS (28)
+#define IDX_DIMS (32)          /* TAG_MAX_DIMS dimensions, 4 bytes each */
+#define IDX_BIT_COUNT (44)     /* BOOLs in a packed BOOL array */
+
+
+struct section_t {
+    uint64_t offset;
+    uint64_t size;
+};
+
+
+static inline uint64_t align_up(uint64_t value, uint64_t align)
+{
+    return (value + (align - 1)) & ~(align - 1);
+}
+
+
+
+
+/*
+ * Writing
+ */
+
+static status_t write_bytes(FILE *f, const void *data, size_t len)
+{
+    if(len && fwrite(data, 1, len, f) != len) {
+        warn("Error writing snapshot file!");
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    return STATUS_OK;
+}
+
+
+static status_t write_padding(FILE *f, uint64_t from, uint64_t to)
+{
+    static const uint8_t zeros[SNAPSHOT_PAGE_SIZE] = {0};
+
+    while(from < to) {
+        size_t chunk = (size_t)((to - from) > sizeof(zeros) ? sizeof(zeros) : (to - from));
+
+        if(write_bytes(f, zeros, chunk) != STATUS_OK) {
+            return STATUS_EXTERNAL_FAILURE;
+        }
+
+        from += chunk;
+    }
+
+    return STATUS_OK;
+}
+
+
+static uint32_t collect_types(struct tag_db_t *db, uint16_t *types, uint32_t max_types)
+{
+    uint32_t num_types = 0;
+
+    for(uint32_t i = 0; i < db->num_tags; i++) {
+        uint32_t t = 0;
+
+        for(t = 0; t < num_types; t++) {
+            if(types[t] == db->tags[i]->type) {
+                break;
+            }
+        }
+
+        if(t == num_types && num_types < max_types) {
+            types[num_types++] = db->tags[i]->type;
+        }
+    }
+
+    return num_types;
+}
+
+
+static uint8_t *put_string(uint8_t *p, const char *str)
+{
+    size_t len = (str ? strlen(str) : 0);
+
+    encode_uint16_le(p, (uint16_t)len);
+
+    if(len) {
+        memcpy(p + 2, str, len);
+    }
+
+    return p + 2 + len;
+}
+
+
+/*
+ * Structure definitions are stored as declared, in registry order so the
+ * instance IDs in the index stay valid.  They are small, so the section is
+ * built in memory.
+ *
+ *   u32 count, then per structure:  string name, u32 member count, then
+ *   per member:  string name, string type, string host, u32 elements,
+ *   i32 bit number, u8 hidden.  Strings are a u16 length and the bytes.
+ */
+static status_t encode_templates(struct udt_registry_t *reg, uint8_t **buf, size_t *buf_len)
+{
+    size_t len = 4;
+    uint8_t *p = NULL;
+    uint32_t num_udts = (reg ? reg->num_udts : 0);
+
+    for(uint32_t i = 0; i < num_udts; i++) {
+        struct udt_t *udt = reg->udts[i];
+
+        len += 2 + strlen(udt->name) + 4;
+
+        for(uint32_t m = 0; m < udt->num_members; m++) {
+            struct udt_member_t *member = &(udt->members[m]);
+
+            len += 2 + strlen(member->name) + 2 + strlen(member->type_name) + 2 + (member->host_name ? strlen(member->host_name) : 0) + 4 + 4 + 1;
+        }
+    }
+
+    if(!(*buf = calloc(1, len))) {
+        warn("Unable to allocate snapshot template buffer!");
+        return STATUS_NO_RESOURCE;
+    }
+
+    p = *buf;
+    encode_uint32_le(p, num_udts);
+    p += 4;
+
+    for(uint32_t i = 0; i < num_udts; i++) {
+        struct udt_t *udt = reg->udts[i];
+
+        p = put_string(p, udt->name);
+        encode_uint32_le(p, udt->num_members);
+        p += 4;
+
+        for(uint32_t m = 0; m < udt->num_members; m++) {
+            struct udt_member_t *member = &(udt->members[m]);
+
+            p = put_string(p, member->name);
+            p = put_string(p, member->type_name);
+            p = put_string(p, member->host_name);
+            encode_uint32_le(p, member->elem_count);
+            encode_uint32_le(p + 4, (uint32_t)member->bit_number);
+            p[8] = (member->hidden ? 1 : 0);
+            p += 9;
+        }
+    }
+
+    *buf_len = len;
+
+    return STATUS_OK;
+}
+
+
+/* generated values only exist when read, so put the ones marked for it into the copy being saved. */
+static void put_generated_values(struct tag_db_t *db, size_t offset, uint8_t *buf, size_t chunk, int64_t now_ns)
+{
+    for(uint32_t i = 0; i < db->num_tags; i++) {
+        struct tag_t *tag = db->tags[i];
+        uint8_t value[sizeof(uint64_t)] = {0};
+        size_t start = tag->data_offset;
+        size_t end = start + tag->data_size;
+
+        if(!tag->gen || !tag->gen->config.materialize || end <= offset || start >= offset + chunk) {
+            continue;
+        }
+
+        if(tag->data_size > sizeof(value) || value_gen_encode(tag->gen, now_ns, tag->type, value, sizeof(value)) != STATUS_OK) {
+            continue;
+        }
+
+        /* a value could straddle two blocks, copy just the part in this one. */
+        for(size_t b = (start > offset ? start : offset); b < end && b < offset + chunk; b++) {
+            buf[b - offset] = value[b - start];
+        }
+    }
+}
+
+
+static status_t write_snapshot_file(FILE *f, struct tag_db_t *db, struct tag_image_t *image)
+{
+    status_t rc = STATUS_OK;
+    uint8_t header[SNAPSHOT_HEADER_SIZE] = {0};
+    struct section_t sections[SECTION_COUNT] = {{0}};
+    uint16_t types[256] = {0};
+    uint32_t num_types = collect_types(db, types, 256);
+    uint64_t names_size = 0;
+    uint64_t pos = 0;
+    uint8_t *buf = NULL;
+    uint8_t *templates = NULL;
+    size_t templates_size = 0;
+
+    for(uint32_t i = 0; i < db->num_tags; i++) {
+        names_size += strlen(db->tags[i]->name) + 1;
+    }
+
+    if((rc = encode_templates(db->udts, &templates, &templates_size)) != STATUS_OK) {
+        return rc;
+    }
+
+    sections[SECTION_INDEX].offset = SNAPSHOT_HEADER_SIZE;
+    sections[SECTION_INDEX].size = (uint64_t)db->num_tags * SNAPSHOT_INDEX_ENTRY_SIZE;
+    sections[SECTION_SLOTS].offset = align_up(sections[SECTION_INDEX].offset + sections[SECTION_INDEX].size, 8);
+    sections[SECTION_SLOTS].size = (uint64_t)db->num_slots * sizeof(uint32_t);
+    sections[SECTION_TYPES].offset = align_up(sections[SECTION_SLOTS].offset + sections[SECTION_SLOTS].size, 8);
+    sections[SECTION_TYPES].size = (uint64_t)num_types * SNAPSHOT_TYPE_ENTRY_SIZE;
+    sections[SECTION_NAMES].offset = align_up(sections[SECTION_TYPES].offset + sections[SECTION_TYPES].size, 8);
+    sections[SECTION_NAMES].size = names_size;
+    sections[SECTION_TEMPLATES].offset = align_up(sections[SECTION_NAMES].offset + sections[SECTION_NAMES].size, 8);
+    sections[SECTION_TEMPLATES].size = templates_size;
+    sections[SECTION_VALUES].offset = align_up(sections[SECTION_TEMPLATES].offset + sections[SECTION_TEMPLATES].size, SNAPSHOT_PAGE_SIZE);
+    sections[SECTION_VALUES].size = db->data_size;
+
+    /* header */
+    memcpy(header + HDR_MAGIC, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+    encode_uint32_le(header + HDR_VERSION, TAG_SNAPSHOT_VERSION);
+    encode_uint32_le(header + HDR_HEADER_SIZE, SNAPSHOT_HEADER_SIZE);
+    encode_uint32_le(header + HDR_NUM_TAGS, db->num_tags);
+    encode_uint32_le(header + HDR_NUM_SLOTS, db->num_slots);
+    encode_uint32_le(header + HDR_NUM_TYPES, num_types);
+    encode_uint32_le(header + HDR_NUM_SECTIONS, SECTION_COUNT);
+
+    for(int s = 0; s < SECTION_COUNT; s++) {
+        encode_uint64_le(header + HDR_SECTIONS + (16 * s), sections[s].offset);
+        encode_uint64_le(header + HDR_SECTIONS + (16 * s) + 8, sections[s].size);
+    }
+
+    if((rc = write_bytes(f, header, sizeof(header))) != STATUS_OK) {
+        free(templates);
+        return rc;
+    }
+
+    pos = SNAPSHOT_HEADER_SIZE;
+
+    /* index */
+    {
+        uint32_t name_offset = 0;
+
+        for(uint32_t i = 0; i < db->num_tags && rc == STATUS_OK; i++) {
+            struct tag_t *tag = db->tags[i];
+            uint8_t entry[SNAPSHOT_INDEX_ENTRY_SIZE] = {0};
+
+            encode_uint32_le(entry + IDX_NAME_OFFSET, name_offset);
+            encode_uint32_le(entry + IDX_NAME_HASH, tag->name_hash);
+            encode_uint16_le(entry + IDX_TYPE, tag->type);
+            encode_uint16_le(entry + IDX_ELEM_SIZE, tag->elem_size);
+            encode_uint32_le(entry + IDX_ELEM_COUNT, tag->elem_count);
+            encode_uint32_le(entry + IDX_DATA_OFFSET, tag->data_offset);
+            encode_uint32_le(entry + IDX_DATA_SIZE, tag->data_size);
+            encode_uint32_le(entry + IDX_TEMPLATE, (tag->udt ? tag->udt->instance_id : 0));
+            encode_uint32_le(entry + IDX_NUM_DIMS, tag->num_dims);
+            encode_uint32_le(entry + IDX_BIT_COUNT, tag->bit_count);
+
+            for(int d = 0; d < TAG_MAX_DIMS; d++) {
+                encode_uint32_le(entry + IDX_DIMS + (4 * d), tag->dims[d]);
+            }
+
+            rc = write_bytes(f, entry, sizeof(entry));
+
+            name_offset += (uint32_t)strlen(tag->name) + 1;
+        }
+
+        pos += sections[SECTION_INDEX].size;
+    }
+
+    /* slots */
+    if(rc == STATUS_OK && (rc = write_padding(f, pos, sections[SECTION_SLOTS].offset)) == STATUS_OK) {
+        for(uint32_t i = 0; i < db->num_slots && rc == STATUS_OK; i++) {
+            uint8_t slot[4];
+
+            encode_uint32_le(slot, db->slots[i]);
+            rc = write_bytes(f, slot, sizeof(slot));
+        }
+
+        pos = sections[SECTION_SLOTS].offset + sections[SECTION_SLOTS].size;
+    }
+
+    /* types */
+    if(rc == STATUS_OK && (rc = write_padding(f, pos, sections[SECTION_TYPES].offset)) == STATUS_OK) {
+        for(uint32_t i = 0; i < num_types && rc == STATUS_OK; i++) {
+            uint8_t entry[SNAPSHOT_TYPE_ENTRY_SIZE] = {0};
+
+            encode_uint16_le(entry, types[i]);
+            encode_uint16_le(entry + 2, (uint16_t)tag_type_size(types[i]));
+            rc = write_bytes(f, entry, sizeof(entry));
+        }
+
+        pos = sections[SECTION_TYPES].offset + sections[SECTION_TYPES].size;
+    }
+
+    /* names */
+    if(rc == STATUS_OK && (rc = write_padding(f, pos, sections[SECTION_NAMES].offset)) == STATUS_OK) {
+        for(uint32_t i = 0; i < db->num_tags && rc == STATUS_OK; i++) {
+            rc = write_bytes(f, db->tags[i]->name, strlen(db->tags[i]->name) + 1);
+        }
+
+        pos = sections[SECTION_NAMES].offset + sections[SECTION_NAMES].size;
+    }
+
+    /* templates */
+    if(rc == STATUS_OK && (rc = write_padding(f, pos, sections[SECTION_TEMPLATES].offset)) == STATUS_OK) {
+        rc = write_bytes(f, templates, templates_size);
+
+        pos = sections[SECTION_TEMPLATES].offset + sections[SECTION_TEMPLATES].size;
+    }
+
+    free(templates);
+
+    /* values, copied a block at a time so the owning loop is only held up briefly. */
+    if(rc == STATUS_OK && (rc = write_padding(f, pos, sections[SECTION_VALUES].offset)) == STATUS_OK) {
+        int64_t now_ns = util_clock_ns();
+
+        if(!(buf = malloc(TAG_IMAGE_BLOCK_SIZE))) {
+            warn("Unable to allocate snapshot copy buffer!");
+            return STATUS_NO_RESOURCE;
+        }
+
+        for(size_t offset = 0; offset < db->data_size && rc == STATUS_OK; offset += TAG_IMAGE_BLOCK_SIZE) {
+            size_t chunk = db->data_size - offset;
+
+            if(chunk > TAG_IMAGE_BLOCK_SIZE) {
+                chunk = TAG_IMAGE_BLOCK_SIZE;
+            }
+
+            if((rc = tag_image_read(image, offset, buf, chunk)) == STATUS_OK) {
+                put_generated_values(db, offset, buf, chunk, now_ns);
+                rc = write_bytes(f, buf, chunk);
+            }
+        }
+
+        free(buf);
+    }
+
+    return rc;
+}
+
+
+status_t tag_snapshot_write(const char *path, struct tag_db_t *db, struct tag_image_t *image)
+{
+    status_t rc = STATUS_OK;
+    char tmp_path[1024] = {0};
+    FILE *f = NULL;
+
+    info("Starting.");
+
+    do {
+        if(!path || !db || !image) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(image->size != db->data_size) {
+            warn("Image size %zu does not match tag database size %zu!", image->size, db->data_size);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        if((size_t)snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= sizeof(tmp_path)) {
+            warn("Snapshot path is too long!");
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        if(!(f = fopen(tmp_path, "wb"))) {
+            warn("Unable to open %s for writing!", tmp_path);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        rc = write_snapshot_file(f, db, image);
+
+        if(fflush(f) != 0) {
+            rc = STATUS_EXTERNAL_FAILURE;
+        }
+
+#ifndef IS_WINDOWS
+        if(rc == STATUS_OK && fsync(fileno(f)) != 0) {
+            warn("Unable to sync snapshot file!");
+            rc = STATUS_EXTERNAL_FAILURE;
+        }
+#endif
+
+        fclose(f);
+
+        if(rc != STATUS_OK) {
+            remove(tmp_path);
+            break;
+        }
+
+        /* atomically replace the old snapshot.  Existing mappings keep the old file. */
+#ifdef IS_WINDOWS
+        if(!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING)) {
+#else
+        if(rename(tmp_path, path) != 0) {
+#endif
+            warn("Unable to rename %s to %s!", tmp_path, path);
+            remove(tmp_path);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        detail("Wrote snapshot of %u tags and %zu value bytes to %s.", db->num_tags, db->data_size, path);
+    } while(0);
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
+}
+
+
+
+
+/*
+ * Reading
+ */
+
+static bool get_string(const uint8_t **p, const uint8_t *end, char *out, size_t out_size)
+{
+    size_t len = 0;
+
+    if(*p + 2 > end) {
+        return false;
+    }
+
+    len = decode_uint16_le(*p);
+
+    if(len >= out_size || *p + 2 + len > end) {
+        return false;
+    }
+
+    memcpy(out, *p + 2, len);
+    out[len] = 0;
+    *p += 2 + len;
+
+    return true;
+}
+
+
+static status_t decode_templates(const uint8_t *p, size_t len, struct udt_registry_t **reg_out)
+{
+    status_t rc = STATUS_OK;
+    const uint8_t *end = p + len;
+    struct udt_registry_t *reg = NULL;
+    uint32_t num_udts = 0;
+
+    if(len < 4) {
+        return STATUS_BAD_INPUT;
+    }
+
+    if(!(reg = udt_registry_create())) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    num_udts = decode_uint32_le(p);
+    p += 4;
+
+    for(uint32_t i = 0; i < num_udts && rc == STATUS_OK; i++) {
+        char name[UDT_MAX_NAME_LEN + 1];
+        struct udt_t *udt = NULL;
+        uint32_t num_members = 0;
+
+        if(!get_string(&p, end, name, sizeof(name)) || p + 4 > end) {
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        num_members = decode_uint32_le(p);
+        p += 4;
+
+        if(!(udt = udt_create(name, strlen(name)))) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        for(uint32_t m = 0; m < num_members && rc == STATUS_OK; m++) {
+            char member_name[UDT_MAX_NAME_LEN + 1];
+            char type_name[UDT_MAX_NAME_LEN + 1];
+            char host_name[UDT_MAX_NAME_LEN + 1];
+
+            if(!get_string(&p, end, member_name, sizeof(member_name))
+               || !get_string(&p, end, type_name, sizeof(type_name))
+               || !get_string(&p, end, host_name, sizeof(host_name))
+               || p + 9 > end) {
+                rc = STATUS_BAD_INPUT;
+                break;
+            }
+
+            rc = udt_add_member(udt, member_name, type_name, decode_uint32_le(p), (p[8] != 0), (host_name[0] ? host_name : NULL), (int32_t)decode_uint32_le(p + 4));
+            p += 9;
+        }
+
+        if(rc == STATUS_OK) {
+            rc = udt_registry_add(reg, udt);
+        }
+
+        if(rc != STATUS_OK) {
+            udt_dispose(udt);
+        }
+    }
+
+    if(rc == STATUS_OK) {
+        rc = udt_registry_resolve(reg);
+    }
+
+    if(rc != STATUS_OK) {
+        warn("Snapshot structure definitions are corrupt!");
+        udt_registry_dispose(reg);
+        return rc;
+    }
+
+    *reg_out = reg;
+
+    return STATUS_OK;
+}
+
+
+static status_t build_from_map(struct tag_snapshot_t *snapshot)
+{
+    const uint8_t *base = (const uint8_t *)snapshot->map.data;
+    struct section_t sections[SECTION_COUNT] = {{0}};
+    uint32_t num_tags = 0;
+    uint32_t num_slots = 0;
+    struct tag_t *tag_block = NULL;
+    struct udt_registry_t *udts = NULL;
+    status_t rc = STATUS_OK;
+
+    if(snapshot->map.size < SNAPSHOT_HEADER_SIZE || memcmp(base + HDR_MAGIC, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+        warn("File is not a tag snapshot!");
+        return STATUS_BAD_INPUT;
+    }
+
+    if(decode_uint32_le(base + HDR_VERSION) != TAG_SNAPSHOT_VERSION) {
+        warn("Unsupported snapshot version %u!", decode_uint32_le(base + HDR_VERSION));
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if(decode_uint32_le(base + HDR_NUM_SECTIONS) < SECTION_COUNT) {
+        warn("Snapshot is missing sections!");
+        return STATUS_BAD_INPUT;
+    }
+
+    num_tags = decode_uint32_le(base + HDR_NUM_TAGS);
+    num_slots = decode_uint32_le(base + HDR_NUM_SLOTS);
+
+    for(int s = 0; s < SECTION_COUNT; s++) {
+        sections[s].offset = decode_uint64_le(base + HDR_SECTIONS + (16 * s));
+        sections[s].size = decode_uint64_le(base + HDR_SECTIONS + (16 * s) + 8);
+
+        if(sections[s].offset > snapshot->map.size || sections[s].size > snapshot->map.size - sections[s].offset) {
+            warn("Snapshot section %d is outside the file!", s);
+            return STATUS_BAD_INPUT;
+        }
+    }
+
+    if(sections[SECTION_INDEX].size != (uint64_t)num_tags * SNAPSHOT_INDEX_ENTRY_SIZE
+       || sections[SECTION_SLOTS].size != (uint64_t)num_slots * sizeof(uint32_t)
+       || (sections[SECTION_SLOTS].offset % sizeof(uint32_t)) != 0
+       || (sections[SECTION_VALUES].offset % SNAPSHOT_PAGE_SIZE) != 0) {
+        warn("Snapshot section sizes do not match the header!");
+        return STATUS_BAD_INPUT;
+    }
+
+    /* structures are laid out again rather than trusting stored offsets. */
+    if((rc = decode_templates(base + sections[SECTION_TEMPLATES].offset, (size_t)sections[SECTION_TEMPLATES].size, &udts)) != STATUS_OK) {
+        return rc;
+    }
+
+    if(!(tag_block = calloc(num_tags + 1, sizeof(*tag_block)))) {
+        warn("Unable to allocate %u tags!", num_tags);
+        udt_registry_dispose(udts);
+        return STATUS_NO_RESOURCE;
+    }
+
+    /* one pass over the index.  Names and values are left where they are. */
+    for(uint32_t i = 0; i < num_tags; i++) {
+        const uint8_t *entry = base + sections[SECTION_INDEX].offset + ((size_t)i * SNAPSHOT_INDEX_ENTRY_SIZE);
+        struct tag_t *tag = &(tag_block[i]);
+        uint32_t name_offset = decode_uint32_le(entry + IDX_NAME_OFFSET);
+
+        tag->name_hash = decode_uint32_le(entry + IDX_NAME_HASH);
+        tag->instance_id = i + 1;
+        tag->type = decode_uint16_le(entry + IDX_TYPE);
+        tag->elem_size = decode_uint16_le(entry + IDX_ELEM_SIZE);
+        tag->elem_count = decode_uint32_le(entry + IDX_ELEM_COUNT);
+        tag->data_offset = decode_uint32_le(entry + IDX_DATA_OFFSET);
+        tag->data_size = decode_uint32_le(entry + IDX_DATA_SIZE);
+        tag->num_dims = (uint8_t)decode_uint32_le(entry + IDX_NUM_DIMS);
+        tag->bit_count = decode_uint32_le(entry + IDX_BIT_COUNT);
+
+        for(int d = 0; d < TAG_MAX_DIMS; d++) {
+            tag->dims[d] = decode_uint32_le(entry + IDX_DIMS + (4 * d));
+        }
+
+        if(tag->type == TAG_TYPE_STRUCT) {
+            tag->udt = udt_registry_get_instance(udts, decode_uint32_le(entry + IDX_TEMPLATE));
+        }
+
+        if(name_offset >= sections[SECTION_NAMES].size
+           || tag->num_dims > TAG_MAX_DIMS
+           || (tag->type == TAG_TYPE_STRUCT && (!tag->udt || tag->udt->size != tag->elem_size))
+           || (uint64_t)tag->data_offset + tag->data_size > sections[SECTION_VALUES].size) {
+            warn("Snapshot index entry %u is corrupt!", i);
+            free(tag_block);
+            udt_registry_dispose(udts);
+            return STATUS_BAD_INPUT;
+        }
+
+        tag->name = (const char *)(base + sections[SECTION_NAMES].offset + name_offset);
+    }
+
+    /* the names section must end in a NUL so no name can run off the end. */
+    if(num_tags && base[sections[SECTION_NAMES].offset + sections[SECTION_NAMES].size - 1] != 0) {
+        warn("Snapshot names are not terminated!");
+        free(tag_block);
+        udt_registry_dispose(udts);
+        return STATUS_BAD_INPUT;
+    }
+
+    /* slots are used in place.  The snapshot is little endian as are the hosts we run on. */
+    snapshot->tag_db = tag_db_create_bulk(tag_block, num_tags, (uint32_t *)(base + sections[SECTION_SLOTS].offset), num_slots, (size_t)sections[SECTION_VALUES].size);
+    if(!snapshot->tag_db) {
+        free(tag_block);
+        udt_registry_dispose(udts);
+        return STATUS_BAD_INPUT;
+    }
+
+    snapshot->tag_db->udts = udts;
+
+    snapshot->tmpl = tag_image_template_wrap(base + sections[SECTION_VALUES].offset, (size_t)sections[SECTION_VALUES].size);
+    if(!snapshot->tmpl) {
+        return STATUS_NO_RESOURCE;
+    }
+
+    return STATUS_OK;
+}
+
+
+struct tag_snapshot_t *tag_snapshot_open(const char *path)
+{
+    status_t rc = STATUS_OK;
+    struct tag_snapshot_t *snapshot = NULL;
+
+    info("Starting.");
+
+    do {
+        if(!path) {
+            warn("Called with a NULL path!");
+            rc = STATUS_NULL_PTR;
+            break;
+        }
+
+        if(!(snapshot = calloc(1, sizeof(*snapshot)))) {
+            warn("Unable to allocate snapshot!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if((rc = file_map_open(&(snapshot->map), path)) != STATUS_OK) {
+            break;
+        }
+
+        if((rc = build_from_map(snapshot)) != STATUS_OK) {
+            warn("Error %s loading snapshot %s!", status_to_str(rc), path);
+            break;
+        }
+
+        detail("Mapped snapshot %s with %u tags.", path, snapshot->tag_db->num_tags);
+    } while(0);
+
+    if(rc != STATUS_OK && snapshot) {
+        tag_snapshot_close(snapshot);
+        snapshot = NULL;
+    }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return snapshot;
+}
+
+
+void tag_snapshot_close(struct tag_snapshot_t *snapshot)
+{
+    if(!snapshot) {
+        return;
+    }
+
+    tag_db_dispose(snapshot->tag_db);
+    tag_image_template_release(snapshot->tmpl);
+
+    file_map_close(&(snapshot->map));
+
+    free(snapshot);
+}
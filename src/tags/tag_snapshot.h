@@ -0,0 +1,57 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tags/tag_db.h"
+#include "tags/tag_image.h"
+#include "util/file_map.h"
+#include "util/status.h"
+
+
+/*
+ * Binary tag database snapshots.
+ *
+ * A snapshot holds the tag index, the name hash table, the type descriptors,
+ * the structure definitions and the value arena in one file.  Opening one maps the file and builds the
+ * database and a template image directly over the mapping, so nothing is
+ * parsed and value pages are only read in when a device touches them.
+ *
+ * Snapshots are written to a temporary file and renamed into place.  Any
+ * process or device still using the old mapping keeps the old file, so a
+ * snapshot can be rewritten while the proactor loops keep running.
+ *
+ * The mapping must stay open until every device using the database or the
+ * template has been disposed.
+ */
+
+#define TAG_SNAPSHOT_VERSION (2)
+
+
+struct tag_snapshot_t {
+    struct file_map_t map;
+
+    struct tag_db_t *tag_db;
+    struct tag_image_template_t *tmpl;
+};
+
+
+extern status_t tag_snapshot_write(const char *path, struct tag_db_t *db, struct tag_image_t *image);
+
+extern struct tag_snapshot_t *tag_snapshot_open(const char *path);
+extern void tag_snapshot_close(struct tag_snapshot_t *snapshot);
@@ -0,0 +1,624 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/tag_db.h"
+#include "tags/udt.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+#define UDT_MIN_MEMBERS (8)
+#define UDT_MIN_REGISTRY (16)
+
+
+static inline char to_lower(char c)
+{
+    return ((c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c);
+}
+
+
+static bool name_matches(const char *a, const char *b, size_t b_len)
+{
+    for(size_t i = 0; i < b_len; i++) {
+        if(a[i] == 0 || to_lower(a[i]) != to_lower(b[i])) {
+            return false;
+        }
+    }
+
+    return (a[b_len] == 0);
+}
+
+
+static char *copy_name(const char *name, size_t name_len)
+{
+    char *copy = malloc(name_len + 1);
+
+    if(copy) {
+        memcpy(copy, name, name_len);
+        copy[name_len] = 0;
+    }
+
+    return copy;
+}
+
+
+static inline uint32_t align_up(uint32_t value, uint32_t align)
+{
+    return (value + (align - 1)) & ~(align - 1);
+}
+
+
+
+struct udt_t *udt_create(const char *name, size_t name_len)
+{
+    struct udt_t *udt = NULL;
+
+    if(!name || name_len == 0) {
+        warn("Called with a NULL or empty name!");
+        return NULL;
+    }
+
+    if(!(udt = calloc(1, sizeof(*udt)))) {
+        warn("Unable to allocate structure definition!");
+        return NULL;
+    }
+
+    if(!(udt->name = copy_name(name, name_len))) {
+        warn("Unable to allocate structure name!");
+        free(udt);
+        return NULL;
+    }
+
+    udt->name_hash = tag_db_name_hash(name, name_len);
+
+    return udt;
+}
+
+
+void udt_dispose(struct udt_t *udt)
+{
+    if(!udt) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < udt->num_members; i++) {
+        free(udt->members[i].name);
+        free(udt->members[i].type_name);
+        free(udt->members[i].host_name);
+    }
+
+    free(udt->members);
+    free(udt->definition);
+    free(udt->name);
+    free(udt);
+}
+
+
+
+status_t udt_add_member(struct udt_t *udt, const char *name, const char *type_name, uint32_t elem_count, bool hidden, const char *host_name, int32_t bit_number)
+{
+    struct udt_member_t *member = NULL;
+
+    if(!udt || !name || !type_name) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(udt->resolved) {
+        warn("Structure %s is already laid out, cannot add member %s!", udt->name, name);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(udt->num_members >= udt->capacity) {
+        uint32_t new_capacity = (udt->capacity ? udt->capacity * 2 : UDT_MIN_MEMBERS);
+        struct udt_member_t *new_members = realloc(udt->members, new_capacity * sizeof(*new_members));
+
+        if(!new_members) {
+            warn("Unable to grow member list of structure %s!", udt->name);
+            return STATUS_NO_RESOURCE;
+        }
+
+        udt->members = new_members;
+        udt->capacity = new_capacity;
+    }
+
+    member = &(udt->members[udt->num_members]);
+    memset(member, 0, sizeof(*member));
+
+    member->name = copy_name(name, strlen(name));
+    member->type_name = copy_name(type_name, strlen(type_name));
+    member->host_name = (host_name ? copy_name(host_name, strlen(host_name)) : NULL);
+    member->elem_count = elem_count;
+    member->hidden = hidden;
+    member->bit_number = (host_name ? bit_number : -1);
+
+    if(!member->name || !member->type_name || (host_name && !member->host_name)) {
+        warn("Unable to allocate member %s of structure %s!", name, udt->name);
+        free(member->name);
+        free(member->type_name);
+        free(member->host_name);
+        return STATUS_NO_RESOURCE;
+    }
+
+    udt->num_members++;
+
+    return STATUS_OK;
+}
+
+
+struct udt_member_t *udt_find_member(struct udt_t *udt, const char *name, size_t name_len)
+{
+    if(!udt || !name) {
+        return NULL;
+    }
+
+    for(uint32_t i = 0; i < udt->num_members; i++) {
+        if(name_matches(udt->members[i].name, name, name_len)) {
+            return &(udt->members[i]);
+        }
+    }
+
+    return NULL;
+}
+
+
+
+struct udt_registry_t *udt_registry_create(void)
+{
+    struct udt_registry_t *reg = NULL;
+
+    if(!(reg = calloc(1, sizeof(*reg)))) {
+        warn("Unable to allocate structure registry!");
+        return NULL;
+    }
+
+    return reg;
+}
+
+
+void udt_registry_dispose(struct udt_registry_t *reg)
+{
+    if(!reg) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < reg->num_udts; i++) {
+        udt_dispose(reg->udts[i]);
+    }
+
+    free(reg->udts);
+    free(reg);
+}
+
+
+status_t udt_registry_add(struct udt_registry_t *reg, struct udt_t *udt)
+{
+    if(!reg || !udt) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(udt_registry_find(reg, udt->name, strlen(udt->name))) {
+        warn("Structure %s is already defined!", udt->name);
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(reg->num_udts >= reg->capacity) {
+        uint32_t new_capacity = (reg->capacity ? reg->capacity * 2 : UDT_MIN_REGISTRY);
+        struct udt_t **new_udts = realloc(reg->udts, new_capacity * sizeof(*new_udts));
+
+        if(!new_udts) {
+            warn("Unable to grow structure registry!");
+            return STATUS_NO_RESOURCE;
+        }
+
+        reg->udts = new_udts;
+        reg->capacity = new_capacity;
+    }
+
+    reg->udts[reg->num_udts] = udt;
+    reg->num_udts++;
+    udt->instance_id = reg->num_udts;
+
+    return STATUS_OK;
+}
+
+
+struct udt_t *udt_registry_get_instance(struct udt_registry_t *reg, uint32_t instance_id)
+{
+    if(!reg || instance_id == 0 || instance_id > reg->num_udts) {
+        return NULL;
+    }
+
+    return reg->udts[instance_id - 1];
+}
+
+
+struct udt_t *udt_registry_find(struct udt_registry_t *reg, const char *name, size_t name_len)
+{
+    uint32_t hash = 0;
+
+    if(!reg || !name) {
+        return NULL;
+    }
+
+    hash = tag_db_name_hash(name, name_len);
+
+    for(uint32_t i = 0; i < reg->num_udts; i++) {
+        if(reg->udts[i]->name_hash == hash && name_matches(reg->udts[i]->name, name, name_len)) {
+            return reg->udts[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+
+/*
+ * The predefined Logix structures that show up in almost every program.  The
+ * status bits of the timer, counter and control structures live in a hidden
+ * DINT at the start.
+ */
+status_t udt_registry_add_builtins(struct udt_registry_t *reg)
+{
+    static const struct {
+        const char *udt;
+        const char *name;
+        const char *type_name;
+        uint32_t elem_count;
+        bool hidden;
+        const char *host_name;
+        int32_t bit_number;
+    } members[] = {
+        { "STRING", "LEN", "DINT", 0, false, NULL, -1 },
+        { "STRING", "DATA", "SINT", 82, false, NULL, -1 },
+
+        { "TIMER", "CTL", "DINT", 0, true, NULL, -1 },
+        { "TIMER", "PRE", "DINT", 0, false, NULL, -1 },
+        { "TIMER", "ACC", "DINT", 0, false, NULL, -1 },
+        { "TIMER", "EN", "BIT", 0, false, "CTL", 31 },
+        { "TIMER", "TT", "BIT", 0, false, "CTL", 30 },
+        { "TIMER", "DN", "BIT", 0, false, "CTL", 29 },
+
+        { "COUNTER", "CTL", "DINT", 0, true, NULL, -1 },
+        { "COUNTER", "PRE", "DINT", 0, false, NULL, -1 },
+        { "COUNTER", "ACC", "DINT", 0, false, NULL, -1 },
+        { "COUNTER", "CU", "BIT", 0, false, "CTL", 31 },
+        { "COUNTER", "CD", "BIT", 0, false, "CTL", 30 },
+        { "COUNTER", "DN", "BIT", 0, false, "CTL", 29 },
+        { "COUNTER", "OV", "BIT", 0, false, "CTL", 28 },
+        { "COUNTER", "UN", "BIT", 0, false, "CTL", 27 },
+
+        { "CONTROL", "CTL", "DINT", 0, true, NULL, -1 },
+        { "CONTROL", "LEN", "DINT", 0, false, NULL, -1 },
+        { "CONTROL", "POS", "DINT", 0, false, NULL, -1 },
+        { "CONTROL", "EN", "BIT", 0, false, "CTL", 31 },
+        { "CONTROL", "EU", "BIT", 0, false, "CTL", 30 },
+        { "CONTROL", "DN", "BIT", 0, false, "CTL", 29 },
+        { "CONTROL", "EM", "BIT", 0, false, "CTL", 28 },
+        { "CONTROL", "ER", "BIT", 0, false, "CTL", 27 },
+        { "CONTROL", "UL", "BIT", 0, false, "CTL", 26 },
+        { "CONTROL", "IN", "BIT", 0, false, "CTL", 25 },
+        { "CONTROL", "FD", "BIT", 0, false, "CTL", 24 },
+    };
+
+    status_t rc = STATUS_OK;
+    struct udt_t *udt = NULL;
+
+    if(!reg) {
+        warn("Called with a NULL registry pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    for(size_t i = 0; i < sizeof(members)/sizeof(members[0]) && rc == STATUS_OK; i++) {
+        if(!udt || strcmp(udt->name, members[i].udt) != 0) {
+            /* a program may define its own version, keep that one. */
+            if(udt_registry_find(reg, members[i].udt, strlen(members[i].udt))) {
+                udt = NULL;
+
+                while(i + 1 < sizeof(members)/sizeof(members[0]) && strcmp(members[i + 1].udt, members[i].udt) == 0) {
+                    i++;
+                }
+
+                continue;
+            }
+
+            if(!(udt = udt_create(members[i].udt, strlen(members[i].udt)))) {
+                return STATUS_NO_RESOURCE;
+            }
+
+            if((rc = udt_registry_add(reg, udt)) != STATUS_OK) {
+                udt_dispose(udt);
+                return rc;
+            }
+        }
+
+        rc = udt_add_member(udt, members[i].name, members[i].type_name, members[i].elem_count, members[i].hidden, members[i].host_name, members[i].bit_number);
+    }
+
+    return rc;
+}
+
+
+
+static status_t resolve_udt(struct udt_registry_t *reg, struct udt_t *udt);
+
+
+uint16_t udt_member_template_type(const struct udt_member_t *member)
+{
+    if(!member) {
+        return 0;
+    }
+
+    if(member->host_name) {
+        return TAG_TYPE_BOOL;
+    }
+
+    if(member->type == TAG_TYPE_BOOL && member->elem_count) {
+        return UDT_TYPE_ARRAY_FLAG | UDT_TYPE_DWORD;
+    }
+
+    if(member->udt) {
+        return (uint16_t)(UDT_TYPE_STRUCT_FLAG | (member->udt->instance_id & UDT_TYPE_INSTANCE_MASK) | (member->elem_count ? UDT_TYPE_ARRAY_FLAG : 0));
+    }
+
+    return (uint16_t)(member->type | (member->elem_count ? UDT_TYPE_ARRAY_FLAG : 0));
+}
+
+
+static uint16_t member_template_info(const struct udt_member_t *member)
+{
+    if(member->host_name) {
+        return (uint16_t)member->bit_number;
+    }
+
+    if(member->type == TAG_TYPE_BOOL && member->elem_count) {
+        return (uint16_t)((member->elem_count + 31) / 32);
+    }
+
+    return (uint16_t)member->elem_count;
+}
+
+
+/* CRC-16/CCITT.  It only runs when a structure is resolved. */
+static uint16_t crc16_update(uint16_t crc, const uint8_t *data, size_t len)
+{
+    for(size_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+
+        for(int bit = 0; bit < 8; bit++) {
+            crc = (uint16_t)((crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1));
+        }
+    }
+
+    return crc;
+}
+
+
+/*
+ * Encode the template definition as Read Template returns it: an 8 byte
+ * entry per member (info, type, offset), then the structure name and the
+ * member names, all NUL terminated.  Clients read (words * 4) - 23 bytes, so
+ * the buffer is zero padded to exactly that.
+ */
+static status_t build_template(struct udt_t *udt)
+{
+    size_t names_len = strlen(udt->name) + 1;
+    size_t len = 0;
+    uint8_t *p = NULL;
+    uint16_t crc = 0xFFFF;
+
+    for(uint32_t i = 0; i < udt->num_members; i++) {
+        names_len += strlen(udt->members[i].name) + 1;
+    }
+
+    len = ((size_t)udt->num_members * 8) + names_len;
+
+    udt->definition_words = (uint32_t)((len + 23 + 3) / 4);
+    udt->definition_len = (udt->definition_words * 4) - 23;
+
+    if(!(udt->definition = calloc(1, udt->definition_len))) {
+        warn("Unable to allocate template for structure %s!", udt->name);
+        return STATUS_NO_RESOURCE;
+    }
+
+    p = udt->definition;
+
+    for(uint32_t i = 0; i < udt->num_members; i++) {
+        struct udt_member_t *member = &(udt->members[i]);
+
+        encode_uint16_le(p, member_template_info(member));
+        encode_uint16_le(p + 2, udt_member_template_type(member));
+        encode_uint32_le(p + 4, member->offset);
+
+        /* nested structures are keyed by their handle, not their instance ID. */
+        if(member->udt) {
+            uint8_t nested[2];
+
+            encode_uint16_le(nested, member->udt->handle);
+            crc = crc16_update(crc, nested, sizeof(nested));
+        }
+
+        p += 8;
+    }
+
+    memcpy(p, udt->name, strlen(udt->name) + 1);
+    p += strlen(udt->name) + 1;
+
+    for(uint32_t i = 0; i < udt->num_members; i++) {
+        memcpy(p, udt->members[i].name, strlen(udt->members[i].name) + 1);
+        p += strlen(udt->members[i].name) + 1;
+    }
+
+    udt->handle = crc16_update(crc, udt->definition, len);
+
+    /* Get Attribute List for attributes 4, 5, 2 and 1 is asked for before every template read. */
+    p = udt->attr_response;
+
+    encode_uint16_le(p, 4);
+    encode_uint16_le(p + 2, 4);
+    encode_uint16_le(p + 4, 0);
+    encode_uint32_le(p + 6, udt->definition_words);
+    encode_uint16_le(p + 10, 5);
+    encode_uint16_le(p + 12, 0);
+    encode_uint32_le(p + 14, udt->size);
+    encode_uint16_le(p + 18, 2);
+    encode_uint16_le(p + 20, 0);
+    encode_uint16_le(p + 22, (uint16_t)udt->num_members);
+    encode_uint16_le(p + 24, 1);
+    encode_uint16_le(p + 26, 0);
+    encode_uint16_le(p + 28, udt->handle);
+
+    return STATUS_OK;
+}
+
+
+static status_t resolve_member(struct udt_registry_t *reg, struct udt_t *udt, struct udt_member_t *member, uint32_t *size, uint32_t *align)
+{
+    status_t rc = STATUS_OK;
+    uint16_t type = 0;
+
+    if(member->host_name) {
+        /* bits take no space, they alias a bit of an earlier host member. */
+        struct udt_member_t *host = udt_find_member(udt, member->host_name, strlen(member->host_name));
+
+        if(!host || host >= member || host->host_name || host->elem_count || tag_type_size(host->type) * 8 <= (size_t)member->bit_number || member->bit_number < 0) {
+            warn("Member %s of %s has an invalid host %s bit %d!", member->name, udt->name, member->host_name, member->bit_number);
+            return STATUS_BAD_INPUT;
+        }
+
+        member->type = TAG_TYPE_BOOL;
+        member->offset = host->offset;
+        *size = 0;
+        *align = 1;
+
+        return STATUS_OK;
+    }
+
+    type = tag_type_from_name(member->type_name, strlen(member->type_name));
+
+    if(type == TAG_TYPE_BOOL && member->elem_count) {
+        /* BOOL arrays are packed into whole DINTs. */
+        member->type = TAG_TYPE_BOOL;
+        *size = ((member->elem_count + 31) / 32) * 4;
+        *align = 4;
+    } else if(type) {
+        uint32_t elem_size = (uint32_t)tag_type_size(type);
+
+        member->type = type;
+        *size = elem_size * (member->elem_count ? member->elem_count : 1);
+        *align = elem_size;
+    } else {
+        struct udt_t *nested = udt_registry_find(reg, member->type_name, strlen(member->type_name));
+
+        if(!nested) {
+            warn("Member %s of %s has unknown type %s!", member->name, udt->name, member->type_name);
+            return STATUS_NOT_FOUND;
+        }
+
+        if((rc = resolve_udt(reg, nested)) != STATUS_OK) {
+            return rc;
+        }
+
+        member->type = TAG_TYPE_STRUCT;
+        member->udt = nested;
+        *size = nested->size * (member->elem_count ? member->elem_count : 1);
+        *align = nested->alignment;
+    }
+
+    return STATUS_OK;
+}
+
+
+static status_t resolve_udt(struct udt_registry_t *reg, struct udt_t *udt)
+{
+    status_t rc = STATUS_OK;
+    uint32_t offset = 0;
+    uint32_t alignment = 4;
+
+    if(udt->resolved) {
+        return STATUS_OK;
+    }
+
+    if(udt->resolving) {
+        warn("Structure %s contains itself!", udt->name);
+        return STATUS_BAD_INPUT;
+    }
+
+    udt->resolving = true;
+
+    for(uint32_t i = 0; i < udt->num_members && rc == STATUS_OK; i++) {
+        struct udt_member_t *member = &(udt->members[i]);
+        uint32_t size = 0;
+        uint32_t align = 1;
+
+        if((rc = resolve_member(reg, udt, member, &size, &align)) != STATUS_OK) {
+            break;
+        }
+
+        if(!member->host_name) {
+            offset = align_up(offset, align);
+            member->offset = offset;
+            offset += size;
+        }
+
+        if(align > alignment) {
+            alignment = align;
+        }
+    }
+
+    udt->resolving = false;
+
+    if(rc == STATUS_OK) {
+        udt->alignment = alignment;
+        udt->size = align_up(offset, alignment);
+
+        if((rc = build_template(udt)) == STATUS_OK) {
+            udt->resolved = true;
+
+            detail("Structure %s is %u bytes with %u members, handle %04x.", udt->name, udt->size, udt->num_members, udt->handle);
+        }
+    }
+
+    return rc;
+}
+
+
+/* lay out every structure once.  Nested structures are laid out first. */
+status_t udt_registry_resolve(struct udt_registry_t *reg)
+{
+    status_t rc = STATUS_OK;
+
+    if(!reg) {
+        warn("Called with a NULL registry pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    for(uint32_t i = 0; i < reg->num_udts && rc == STATUS_OK; i++) {
+        if((rc = resolve_udt(reg, reg->udts[i])) != STATUS_OK) {
+            warn("Error %s laying out structure %s!", status_to_str(rc), reg->udts[i]->name);
+        }
+    }
+
+    return rc;
+}
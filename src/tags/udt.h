@@ -0,0 +1,140 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/*
+ * User defined (and predefined) structure types.
+ *
+ * A structure is defined by its members in declaration order.  Once every
+ * structure in a registry is known, udt_registry_resolve() lays all of them
+ * out once using the Logix rules:
+ *
+ *   - each member sits at its natural alignment, nested structures at theirs,
+ *   - BOOL members (BIT in L5X) take no space of their own but name a bit in
+ *     a hidden host SINT or DINT member,
+ *   - BOOL arrays are stored as DINT arrays, 32 bits per word,
+ *   - a structure is at least 4 byte aligned and padded to its alignment.
+ *
+ * Tag values are stored in exactly this layout, so reading or writing a
+ * structure instance is a flat copy.
+ *
+ * Resolving also builds what the Template object (class 0x6C) serves: the
+ * encoded member table and names, the structure handle (a CRC over the
+ * definition, including the handles of nested structures) and the encoded
+ * reply to the attribute request clients send before reading a template.
+ *
+ * Resolved structures are read only and shared by every tag and every device
+ * that uses them.
+ */
+
+#define UDT_MAX_NAME_LEN (40)
+
+/* template member type flags. */
+#define UDT_TYPE_ARRAY_FLAG (0x2000)
+#define UDT_TYPE_STRUCT_FLAG (0x8000)
+#define UDT_TYPE_INSTANCE_MASK (0x0FFF)
+
+/* BOOL arrays are described as arrays of DWORD bit strings. */
+#define UDT_TYPE_DWORD (0x00D3)
+
+/* the reply to Get Attribute List for attributes 4, 5, 2 and 1, in that order. */
+#define UDT_ATTR_RESPONSE_SIZE (2 + 8 + 8 + 6 + 6)
+
+
+struct udt_t;
+
+struct udt_member_t {
+    char *name;
+
+    /* the type name as written in the definition, resolved to type/udt below. */
+    char *type_name;
+
+    /* an elementary type code, or TAG_TYPE_STRUCT with udt set. */
+    uint16_t type;
+    struct udt_t *udt;
+
+    /* zero for a scalar member. */
+    uint32_t elem_count;
+
+    /* byte offset in the structure. */
+    uint32_t offset;
+
+    /* for BOOL members, the bit number in the host member, otherwise -1. */
+    int32_t bit_number;
+    char *host_name;
+
+    bool hidden;
+};
+
+
+struct udt_t {
+    char *name;
+    uint32_t name_hash;
+
+    uint32_t num_members;
+    uint32_t capacity;
+    struct udt_member_t *members;
+
+    /* filled in by udt_registry_resolve(). */
+    bool resolved;
+    uint32_t size;
+    uint32_t alignment;
+
+    /* position in the registry, used as the template instance ID. */
+    uint32_t instance_id;
+
+    /* the template, built when the structure is resolved. */
+    uint16_t handle;
+    uint32_t definition_words;
+    uint32_t definition_len;
+    uint8_t *definition;
+    uint8_t attr_response[UDT_ATTR_RESPONSE_SIZE];
+
+    /* set while resolving to catch recursive definitions. */
+    bool resolving;
+};
+
+
+struct udt_registry_t {
+    uint32_t num_udts;
+    uint32_t capacity;
+    struct udt_t **udts;
+};
+
+
+extern struct udt_t *udt_create(const char *name, size_t name_len);
+extern void udt_dispose(struct udt_t *udt);
+
+extern status_t udt_add_member(struct udt_t *udt, const char *name, const char *type_name, uint32_t elem_count, bool hidden, const char *host_name, int32_t bit_number);
+extern struct udt_member_t *udt_find_member(struct udt_t *udt, const char *name, size_t name_len);
+
+extern struct udt_registry_t *udt_registry_create(void);
+extern void udt_registry_dispose(struct udt_registry_t *reg);
+
+extern status_t udt_registry_add(struct udt_registry_t *reg, struct udt_t *udt);
+extern status_t udt_registry_add_builtins(struct udt_registry_t *reg);
+extern struct udt_t *udt_registry_find(struct udt_registry_t *reg, const char *name, size_t name_len);
+extern status_t udt_registry_resolve(struct udt_registry_t *reg);
+extern struct udt_t *udt_registry_get_instance(struct udt_registry_t *reg, uint32_t instance_id);
+
+extern uint16_t udt_member_template_type(const struct udt_member_t *member);
@@ -0,0 +1,398 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_TAGS)
+
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tags/tag.h"
+#include "tags/value_gen.h"
+#include "util/buf.h"
+#include "util/debug.h"
+
+
+#ifndef M_PI
+    #define M_PI (3.14159265358979323846)
+#endif
+
+/* the random walk repeats after this many intervals. */
+#define RANDOM_WALK_HORIZON ((int64_t)1 << 31)
+
+
+
+struct value_gen_t *value_gen_create(const struct value_gen_config_t *config, int64_t epoch_ns)
+{
+    struct value_gen_t *gen = NULL;
+
+    if(!config) {
+        warn("Called with a NULL config pointer!");
+        return NULL;
+    }
+
+    if(config->period_ms <= 0) {
+        warn("Generator period must be greater than zero!");
+        return NULL;
+    }
+
+    if(config->type == VALUE_GEN_STEP && (config->num_steps == 0 || config->num_steps > VALUE_GEN_MAX_STEPS)) {
+        warn("Step generator needs between 1 and %d steps!", VALUE_GEN_MAX_STEPS);
+        return NULL;
+    }
+
+    if(!(gen = calloc(1, sizeof(*gen)))) {
+        warn("Unable to allocate value generator!");
+        return NULL;
+    }
+
+    gen->config = *config;
+    gen->epoch_ns = epoch_ns;
+
+    return gen;
+}
+
+
+void value_gen_dispose(struct value_gen_t *gen)
+{
+    if(gen) {
+        free(gen);
+    }
+}
+
+
+
+/*
+ * Parse a generator from text like "sine(0,100,60000)".  The arguments are
+ *
+ *   sine(<min>,<max>,<period_ms>)
+ *   ramp(<min>,<max>,<period_ms>)
+ *   counter(<min>,<max>,<increment>,<interval_ms>)
+ *   walk(<min>,<max>,<step>,<interval_ms>[,<seed>])
+ *   step(<interval_ms>,<value>[,<value>...])
+ */
+status_t value_gen_parse(const char *spec, struct value_gen_config_t *config)
+{
+    static const struct {
+        const char *name;
+        value_gen_type_t type;
+        uint32_t min_args;
+        uint32_t max_args;
+    } kinds[] = {
+        { "sine", VALUE_GEN_SINE, 3, 3 },
+        { "ramp", VALUE_GEN_RAMP, 3, 3 },
+        { "counter", VALUE_GEN_COUNTER, 4, 4 },
+        { "walk", VALUE_GEN_RANDOM_WALK, 4, 5 },
+        { "step", VALUE_GEN_STEP, 2, 1 + VALUE_GEN_MAX_STEPS },
+    };
+    double args[1 + VALUE_GEN_MAX_STEPS] = {0};
+    uint32_t num_args = 0;
+    const char *open = NULL;
+    const char *p = NULL;
+    size_t name_len = 0;
+    size_t k = 0;
+
+    if(!spec || !config) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(!(open = strchr(spec, '('))) {
+        return STATUS_BAD_INPUT;
+    }
+
+    name_len = (size_t)(open - spec);
+
+    for(k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+        if(strlen(kinds[k].name) == name_len && strncmp(kinds[k].name, spec, name_len) == 0) {
+            break;
+        }
+    }
+
+    if(k == sizeof(kinds) / sizeof(kinds[0])) {
+        return STATUS_NOT_RECOGNIZED;
+    }
+
+    for(p = open + 1; ; p++) {
+        char *end = NULL;
+
+        if(num_args >= kinds[k].max_args) {
+            return STATUS_BAD_INPUT;
+        }
+
+        args[num_args++] = strtod(p, &end);
+
+        if(end == p) {
+            return STATUS_BAD_INPUT;
+        }
+
+        p = end;
+
+        if(*p == ')') {
+            break;
+        }
+
+        if(*p != ',') {
+            return STATUS_BAD_INPUT;
+        }
+    }
+
+    if(p[1] != 0 || num_args < kinds[k].min_args) {
+        return STATUS_BAD_INPUT;
+    }
+
+    memset(config, 0, sizeof(*config));
+    config->type = kinds[k].type;
+
+    if(config->type == VALUE_GEN_STEP) {
+        config->period_ms = (int64_t)args[0];
+        config->num_steps = num_args - 1;
+        memcpy(config->steps, args + 1, config->num_steps * sizeof(double));
+    } else {
+        config->min = args[0];
+        config->max = args[1];
+
+        if(num_args == 3) {
+            config->period_ms = (int64_t)args[2];
+        } else {
+            config->increment = args[2];
+            config->period_ms = (int64_t)args[3];
+            config->seed = (num_args > 4 ? (uint64_t)args[4] : 0);
+        }
+    }
+
+    return (config->period_ms > 0 ? STATUS_OK : STATUS_BAD_INPUT);
+}
+
+
+
+/*
+ * splitmix64.  Good enough mixing to key the random walk nodes.
+ */
+static inline uint64_t mix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+
+/* a standard normal sample that depends only on the seed and key. */
+static double gauss(uint64_t seed, int64_t key)
+{
+    uint64_t h1 = mix64(seed ^ (uint64_t)key);
+    uint64_t h2 = mix64(h1);
+
+    /* 53 bits into (0, 1] */
+    double u1 = ((double)(h1 >> 11) + 1.0) / 9007199254740992.0;
+    double u2 = (double)(h2 >> 11) / 9007199254740992.0;
+
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+
+/*
+ * Evaluate a random walk at step n without visiting the steps before it.
+ *
+ * The walk is built top down as a Brownian bridge over the horizon.  Each
+ * dyadic midpoint gets a deterministic offset keyed by its position, so
+ * descending to any step is at most 31 levels of work no matter how long the
+ * tag sat unread.
+ */
+static double random_walk_at(uint64_t seed, int64_t n)
+{
+    int64_t a = 0;
+    int64_t b = RANDOM_WALK_HORIZON;
+    double wa = 0.0;
+    double wb = sqrt((double)RANDOM_WALK_HORIZON) * gauss(seed, b);
+
+    n = n % RANDOM_WALK_HORIZON;
+
+    while(n != a && n != b) {
+        int64_t m = a + (b - a) / 2;
+        double wm = ((wa + wb) / 2.0) + (sqrt((double)(b - a)) / 2.0) * gauss(seed, m);
+
+        if(n < m) {
+            b = m;
+            wb = wm;
+        } else {
+            a = m;
+            wa = wm;
+        }
+    }
+
+    return (n == a ? wa : wb);
+}
+
+
+/* fold a value back into [min, max] by reflecting at the edges. */
+static double reflect(double value, double min, double max)
+{
+    double range = max - min;
+    double x = 0.0;
+
+    if(range <= 0.0) {
+        return min;
+    }
+
+    x = fmod(value - min, 2.0 * range);
+    if(x < 0.0) {
+        x += 2.0 * range;
+    }
+
+    if(x > range) {
+        x = (2.0 * range) - x;
+    }
+
+    return min + x;
+}
+
+
+double value_gen_eval(const struct value_gen_t *gen, int64_t now_ns)
+{
+    const struct value_gen_config_t *cfg = NULL;
+    double elapsed_ms = 0.0;
+    int64_t intervals = 0;
+    double value = 0.0;
+
+    if(!gen) {
+        return 0.0;
+    }
+
+    cfg = &(gen->config);
+
+    if(now_ns > gen->epoch_ns) {
+        elapsed_ms = (double)(now_ns - gen->epoch_ns) / 1000000.0;
+    }
+
+    intervals = (int64_t)(elapsed_ms / (double)cfg->period_ms);
+
+    switch(cfg->type) {
+        case VALUE_GEN_SINE: {
+                double mid = (cfg->max + cfg->min) / 2.0;
+                double amplitude = (cfg->max - cfg->min) / 2.0;
+
+                value = mid + amplitude * sin(2.0 * M_PI * (elapsed_ms / (double)cfg->period_ms));
+            }
+            break;
+
+        case VALUE_GEN_RAMP: {
+                double phase = fmod(elapsed_ms, (double)cfg->period_ms) / (double)cfg->period_ms;
+
+                value = cfg->min + (cfg->max - cfg->min) * phase;
+            }
+            break;
+
+        case VALUE_GEN_COUNTER:
+            value = (double)intervals * cfg->increment;
+
+            if(cfg->max > cfg->min) {
+                value = fmod(value, cfg->max - cfg->min);
+            }
+
+            value += cfg->min;
+            break;
+
+        case VALUE_GEN_RANDOM_WALK:
+            value = (cfg->max + cfg->min) / 2.0 + cfg->increment * random_walk_at(cfg->seed, intervals);
+            value = reflect(value, cfg->min, cfg->max);
+            break;
+
+        case VALUE_GEN_STEP:
+            value = cfg->steps[(uint64_t)intervals % cfg->num_steps];
+            break;
+
+        default:
+            value = 0.0;
+            break;
+    }
+
+    return value;
+}
+
+
+
+static int64_t clamp_int(double value, int64_t min, int64_t max)
+{
+    if(value <= (double)min) {
+        return min;
+    }
+
+    if(value >= (double)max) {
+        return max;
+    }
+
+    return (int64_t)llround(value);
+}
+
+
+status_t value_gen_encode(const struct value_gen_t *gen, int64_t now_ns, uint16_t tag_type, uint8_t *out, size_t out_len)
+{
+    double value = 0.0;
+    size_t size = tag_type_size(tag_type);
+
+    if(!gen || !out) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(size == 0) {
+        warn("Generators only drive elementary types, not type %04x!", tag_type);
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    if(out_len < size) {
+        warn("Output buffer too small, need %zu bytes but have %zu!", size, out_len);
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    value = value_gen_eval(gen, now_ns);
+
+    switch(tag_type) {
+        case TAG_TYPE_BOOL: out[0] = (value != 0.0 ? 1 : 0); break;
+        case TAG_TYPE_SINT: out[0] = (uint8_t)(int8_t)clamp_int(value, INT8_MIN, INT8_MAX); break;
+        case TAG_TYPE_USINT: out[0] = (uint8_t)clamp_int(value, 0, UINT8_MAX); break;
+        case TAG_TYPE_INT: encode_uint16_le(out, (uint16_t)(int16_t)clamp_int(value, INT16_MIN, INT16_MAX)); break;
+        case TAG_TYPE_UINT: encode_uint16_le(out, (uint16_t)clamp_int(value, 0, UINT16_MAX)); break;
+        case TAG_TYPE_DINT: encode_uint32_le(out, (uint32_t)(int32_t)clamp_int(value, INT32_MIN, INT32_MAX)); break;
+        case TAG_TYPE_UDINT: encode_uint32_le(out, (uint32_t)clamp_int(value, 0, UINT32_MAX)); break;
+        case TAG_TYPE_DWORD: encode_uint32_le(out, (uint32_t)clamp_int(value, 0, UINT32_MAX)); break;
+        case TAG_TYPE_LINT: encode_uint64_le(out, (uint64_t)clamp_int(value, INT64_MIN, INT64_MAX)); break;
+        case TAG_TYPE_ULINT: encode_uint64_le(out, (uint64_t)clamp_int(value, 0, INT64_MAX)); break;
+
+        case TAG_TYPE_REAL: {
+                float f = (float)value;
+                uint32_t bits = 0;
+
+                memcpy(&bits, &f, sizeof(bits));
+                encode_uint32_le(out, bits);
+            }
+            break;
+
+        case TAG_TYPE_LREAL: {
+                uint64_t bits = 0;
+
+                memcpy(&bits, &value, sizeof(bits));
+                encode_uint64_le(out, bits);
+            }
+            break;
+
+        default:
+            return STATUS_NOT_SUPPORTED;
+    }
+
+    return STATUS_OK;
+}
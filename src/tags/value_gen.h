@@ -0,0 +1,90 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util/status.h"
+
+
+/*
+ * Value generators make simulated tags look alive.
+ *
+ * A generator is never "run".  Its value is a pure function of the
+ * configuration and the monotonic time at which a client reads the tag.
+ * Nothing happens on a tick, so a PLC with 100k generated tags that nobody
+ * polls costs nothing at all.
+ */
+
+
+typedef enum {
+    VALUE_GEN_NONE,
+    VALUE_GEN_SINE,
+    VALUE_GEN_RAMP,
+    VALUE_GEN_COUNTER,
+    VALUE_GEN_RANDOM_WALK,
+    VALUE_GEN_STEP,
+} value_gen_type_t;
+
+
+#define VALUE_GEN_MAX_STEPS (16)
+
+
+struct value_gen_config_t {
+    value_gen_type_t type;
+
+    /*
+     * save the generated value in snapshots of the tag values.  Reads never
+     * write it into the tag image, that would give every device a private
+     * copy of the image block the tag lives in.
+     */
+    bool materialize;
+
+    /* the output range.  Sine and ramp span it, counters and random walks wrap/reflect in it. */
+    double min;
+    double max;
+
+    /* sine and ramp period, or the interval between counter/random walk/step changes. */
+    int64_t period_ms;
+
+    /* counter increment or random walk step size (standard deviation per interval). */
+    double increment;
+
+    /* random walk seed. */
+    uint64_t seed;
+
+    /* step sequence values. */
+    uint32_t num_steps;
+    double steps[VALUE_GEN_MAX_STEPS];
+};
+
+
+struct value_gen_t {
+    struct value_gen_config_t config;
+
+    /* all generators measure elapsed time from here. */
+    int64_t epoch_ns;
+};
+
+
+extern status_t value_gen_parse(const char *spec, struct value_gen_config_t *config);
+
+extern struct value_gen_t *value_gen_create(const struct value_gen_config_t *config, int64_t epoch_ns);
+extern void value_gen_dispose(struct value_gen_t *gen);
+
+extern double value_gen_eval(const struct value_gen_t *gen, int64_t now_ns);
+extern status_t value_gen_encode(const struct value_gen_t *gen, int64_t now_ns, uint16_t tag_type, uint8_t *out, size_t out_len);
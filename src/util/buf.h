@@ -54,6 +54,16 @@ static inline uint16_t decode_uint16_le(const uint8_t *buf) {
     return (uint16_t)buf[0] | ((uint16_t)buf[1] << 8);
 }
 
+// Modbus is big endian on the wire
+static inline void encode_uint16_be(uint8_t *buf, uint16_t value) {
+    buf[0] = (uint8_t)((value >> 8) & 0xFF);
+    buf[1] = (uint8_t)(value & 0xFF);
+}
+
+static inline uint16_t decode_uint16_be(const uint8_t *buf) {
+    return ((uint16_t)buf[0] << 8) | (uint16_t)buf[1];
+}
+
 static inline void encode_uint32_le(uint8_t *buf, uint32_t value) {
     buf[0] = (uint8_t)(value & 0xFF);
     buf[1] = (uint8_t)((value >> 8) & 0xFF);
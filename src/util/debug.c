@@ -17,76 +17,787 @@
 #include <stdlib.h>
 #include <time.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include "debug.h"
+#include "shims.h"
 #include "time_utils.h"
 
 
 /*
  * Logging routines.
+ *
+ * Logging does not format or write anything on the calling thread.  Each
+ * thread gets its own ring of records the first time it logs.  A record is
+ * the format pointer, the arguments pulled off the va_list by walking the
+ * format, copies of any strings and a timestamp.  Only the logging thread
+ * writes to its ring and only the logger thread reads from it, so a record
+ * costs a handful of stores and one release store of the head index.
+ *
+ * The logger thread merges the rings in timestamp order, formats each
+ * record into one line and writes the line whole.  When a ring is full the
+ * record is dropped and counted, and the count is reported in the log.
+ *
+ * The logger thread starts with the first message and is drained and
+ * stopped at exit.  Without it, or after it stops, messages are formatted
+ * and written on the calling thread, still a line at a time.
  */
 
-static volatile debug_level_t debug_level = DEBUG_WARN;
+#define LOG_RING_SIZE (1024)
+#define LOG_MAX_ARGS (12)
+#define LOG_STRING_SPACE (128)
+#define LOG_LINE_SIZE (1024)
+#define LOG_SPEC_SIZE (32)
+#define LOG_IDLE_WAIT_MS (10)
 
+#define LOGGER_OFF (0)
+#define LOGGER_RUNNING (1)
+#define LOGGER_STOPPED (2)
 
-void debug_set_level(debug_level_t level)
+
+typedef union {
+    int64_t i;
+    uint64_t u;
+    double d;
+    const void *p;
+} log_arg_t;
+
+
+struct log_record_t {
+    int64_t time_ns;
+    const char *func;
+    const char *templ;
+    int line;
+    debug_level_t level;
+    uint32_t num_args;
+    uint32_t strings_len;
+    log_arg_t args[LOG_MAX_ARGS];
+
+    /* %s arguments are copied here, the argument holds the offset. */
+    char strings[LOG_STRING_SPACE];
+};
+
+
+struct log_ring_t {
+    struct log_ring_t *next;
+
+    /* written by the owning thread. */
+    uint32_t head;
+    uint32_t dropped;
+
+    /* written by the logger thread. */
+    uint32_t tail;
+    uint32_t reported;
+
+    struct log_record_t records[LOG_RING_SIZE];
+};
+
+
+volatile uint8_t debug_subsys_levels[DEBUG_NUM_SUBSYS] = { DEBUG_WARN, DEBUG_WARN, DEBUG_WARN, DEBUG_WARN, DEBUG_WARN, DEBUG_WARN };
+THREAD_LOCAL uint8_t debug_conn_level = DEBUG_NONE;
+
+#define DEBUG_MAX_PEERS (16)
+
+static struct {
+    uint32_t ip_addr;
+    debug_level_t level;
+} peers[DEBUG_MAX_PEERS];
+static volatile uint32_t num_peers = 0;
+
+static struct log_ring_t *rings = NULL;
+static THREAD_LOCAL struct log_ring_t *thread_ring = NULL;
+
+static uint32_t logger_state = LOGGER_OFF;
+static volatile bool logger_stop = false;
+static thread_t logger_thread;
+
+
+static debug_level_t clamp_level(debug_level_t level)
 {
     /* clamp level to sane values */
     if(level < DEBUG_WARN) {
-        debug_level = DEBUG_WARN;
+        return DEBUG_WARN;
     } else if(level > DEBUG_FLOOD) {
-        debug_level = DEBUG_FLOOD;
-    } else {
-        debug_level = level;
+        return DEBUG_FLOOD;
+    }
+
+    return level;
+}
+
+
+void debug_set_level(debug_level_t level)
+{
+    level = clamp_level(level);
+
+    for(int i = 0; i < DEBUG_NUM_SUBSYS; i++) {
+        debug_subsys_levels[i] = (uint8_t)level;
     }
 }
 
 debug_level_t debug_get_level(void)
 {
-    return debug_level;
+    return (debug_level_t)debug_subsys_levels[DEBUG_SUBSYS_GENERAL];
+}
+
+
+void debug_set_subsys_level(debug_subsys_t subsys, debug_level_t level)
+{
+    if((int)subsys < 0 || subsys >= DEBUG_NUM_SUBSYS) {
+        warn("Unknown debug subsystem %d!", (int)subsys);
+        return;
+    }
+
+    debug_subsys_levels[subsys] = (uint8_t)clamp_level(level);
+}
+
+
+/* map a name like "eip" to its subsystem, DEBUG_NUM_SUBSYS if unknown. */
+debug_subsys_t debug_subsys_from_name(const char *name, size_t name_len)
+{
+    static const char *names[DEBUG_NUM_SUBSYS] = { "general", "proactor", "eip", "cip", "tags", "io" };
+
+    if(!name) {
+        return DEBUG_NUM_SUBSYS;
+    }
+
+    for(int i = 0; i < DEBUG_NUM_SUBSYS; i++) {
+        if(strlen(names[i]) == name_len && strncmp(names[i], name, name_len) == 0) {
+            return (debug_subsys_t)i;
+        }
+    }
+
+    return DEBUG_NUM_SUBSYS;
+}
+
+
+/*
+ * Peers are added while the command line is parsed, before any connection
+ * threads look them up, so the table itself needs no lock.
+ */
+status_t debug_add_peer(uint32_t ip_addr, debug_level_t level)
+{
+    if(num_peers >= DEBUG_MAX_PEERS) {
+        warn("Only %d peers can be traced!", DEBUG_MAX_PEERS);
+        return STATUS_NO_RESOURCE;
+    }
+
+    peers[num_peers].ip_addr = ip_addr;
+    peers[num_peers].level = clamp_level(level);
+    num_peers++;
+
+    return STATUS_OK;
+}
+
+
+/* the level to log a connection from this peer at, DEBUG_NONE if not traced. */
+debug_level_t debug_get_peer_level(uint32_t ip_addr)
+{
+    for(uint32_t i = 0; i < num_peers; i++) {
+        if(peers[i].ip_addr == ip_addr) {
+            return peers[i].level;
+        }
+    }
+
+    return DEBUG_NONE;
+}
+
+
+static const char *level_prefix(debug_level_t level)
+{
+    switch(level) {
+        case DEBUG_WARN: return "WARN"; break;
+        case DEBUG_INFO: return "INFO"; break;
+        case DEBUG_DETAIL: return "DETAIL"; break;
+        case DEBUG_FLOOD: return "FLOOD"; break;
+        case DEBUG_ERROR: return "ERROR"; break;
+        default: return "UNKNOWN"; break;
+    }
+}
+
+
+
+/*
+ * One printf conversion, as far as we need to know it.  Width and
+ * precision given as '*' take an int argument each.
+ */
+struct log_conv_t {
+    const char *start;
+    const char *end;
+    bool star_width;
+    bool star_precision;
+    bool has_precision;
+    int precision;
+    char length;
+    char conv;
+};
+
+
+/* parse the conversion starting at the '%' in p.  Returns false at the end of the format. */
+static bool parse_conv(const char *p, struct log_conv_t *conv)
+{
+    memset(conv, 0, sizeof(*conv));
+
+    conv->start = p++;
+
+    while(*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0') {
+        p++;
+    }
+
+    if(*p == '*') {
+        conv->star_width = true;
+        p++;
+    } else {
+        while(*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if(*p == '.') {
+        conv->has_precision = true;
+        p++;
+
+        if(*p == '*') {
+            conv->star_precision = true;
+            p++;
+        } else {
+            while(*p >= '0' && *p <= '9') {
+                conv->precision = (conv->precision * 10) + (*p - '0');
+                p++;
+            }
+        }
+    }
+
+    /* hh and ll are folded to h and l, the value is kept in 64 bits either way. */
+    switch(*p) {
+        case 'h':
+        case 'l':
+            conv->length = *p++;
+            if(*p == conv->length) {
+                conv->length = (char)(conv->length == 'h' ? 'H' : 'q');
+                p++;
+            }
+            break;
+
+        case 'z':
+        case 'j':
+        case 't':
+        case 'L':
+            conv->length = *p++;
+            break;
+
+        default:
+            break;
+    }
+
+    if(!*p) {
+        return false;
+    }
+
+    conv->conv = *p;
+    conv->end = p + 1;
+
+    return true;
+}
+
+
+static int64_t pull_signed(char length, va_list *va)
+{
+    switch(length) {
+        case 'H': return (signed char)va_arg(*va, int);
+        case 'h': return (short)va_arg(*va, int);
+        case 'l': return va_arg(*va, long);
+        case 'q': return va_arg(*va, long long);
+        case 'z': return (int64_t)va_arg(*va, size_t);
+        case 'j': return va_arg(*va, intmax_t);
+        case 't': return va_arg(*va, ptrdiff_t);
+        default: return va_arg(*va, int);
+    }
+}
+
+
+static uint64_t pull_unsigned(char length, va_list *va)
+{
+    switch(length) {
+        case 'H': return (unsigned char)va_arg(*va, unsigned int);
+        case 'h': return (unsigned short)va_arg(*va, unsigned int);
+        case 'l': return va_arg(*va, unsigned long);
+        case 'q': return va_arg(*va, unsigned long long);
+        case 'z': return va_arg(*va, size_t);
+        case 'j': return (uint64_t)va_arg(*va, uintmax_t);
+        case 't': return (uint64_t)va_arg(*va, ptrdiff_t);
+        default: return va_arg(*va, unsigned int);
+    }
+}
+
+
+/* pull the arguments the format asks for into the record.  False if they do not fit. */
+static bool capture_args(struct log_record_t *rec, const char *templ, va_list *va)
+{
+    struct log_conv_t conv;
+
+    rec->num_args = 0;
+    rec->strings_len = 0;
+
+    for(const char *p = templ; *p; p++) {
+        int precision = -1;
+
+        if(*p != '%') {
+            continue;
+        }
+
+        if(p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        if(!parse_conv(p, &conv)) {
+            break;
+        }
+
+        p = conv.end - 1;
+
+        if(rec->num_args + (conv.star_width ? 1 : 0) + (conv.star_precision ? 1 : 0) + 1 > LOG_MAX_ARGS) {
+            return false;
+        }
+
+        if(conv.star_width) {
+            rec->args[rec->num_args++].i = va_arg(*va, int);
+        }
+
+        if(conv.star_precision) {
+            precision = va_arg(*va, int);
+            rec->args[rec->num_args++].i = precision;
+        } else if(conv.has_precision) {
+            precision = conv.precision;
+        }
+
+        switch(conv.conv) {
+            case 'd':
+            case 'i':
+                rec->args[rec->num_args++].i = pull_signed(conv.length, va);
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+            case 'c':
+                rec->args[rec->num_args++].u = pull_unsigned(conv.length, va);
+                break;
+
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                rec->args[rec->num_args++].d = (conv.length == 'L' ? (double)va_arg(*va, long double) : va_arg(*va, double));
+                break;
+
+            case 'p':
+                rec->args[rec->num_args++].p = va_arg(*va, void *);
+                break;
+
+            case 's': {
+                    const char *str = va_arg(*va, const char *);
+                    size_t len = 0;
+                    size_t room = LOG_STRING_SPACE - rec->strings_len;
+
+                    if(!str) {
+                        str = "(null)";
+                    }
+
+                    /* the string may be a name that is not terminated, never read past the precision. */
+                    len = (precision >= 0 ? strnlen(str, (size_t)precision) : strnlen(str, room));
+
+                    if(len + 1 > room) {
+                        if(room == 0) {
+                            return false;
+                        }
+
+                        len = room - 1;
+                    }
+
+                    memcpy(rec->strings + rec->strings_len, str, len);
+                    rec->strings[rec->strings_len + len] = 0;
+
+                    rec->args[rec->num_args++].u = rec->strings_len;
+                    rec->strings_len += (uint32_t)len + 1;
+                }
+                break;
+
+            default:
+                /* %n and anything we do not know could not be formatted later. */
+                return false;
+        }
+    }
+
+    return true;
 }
 
+
+/* add formatted text at *len, always leaving the line terminated. */
+static void line_append(char *line, size_t *len, const char *fmt, ...)
+{
+    va_list va;
+    int n = 0;
+
+    if(*len >= LOG_LINE_SIZE - 1) {
+        return;
+    }
+
+    va_start(va, fmt);
+    n = vsnprintf(line + *len, LOG_LINE_SIZE - *len, fmt, va);
+    va_end(va);
+
+    if(n > 0) {
+        *len += (size_t)n;
+
+        if(*len > LOG_LINE_SIZE - 1) {
+            *len = LOG_LINE_SIZE - 1;
+        }
+    }
+}
+
+
+/*
+ * Rebuild the message from the record.  Each conversion is printed on its
+ * own with a '*' replaced by the captured value and the length modifier
+ * swapped for one that matches how the value was stored.
+ */
+static size_t format_record(const struct log_record_t *rec, char *line)
+{
+    struct log_conv_t conv;
+    uint32_t arg = 0;
+    size_t len = 0;
+    const char *p = rec->templ;
+
+    line_append(line, &len, "%s %s:%d ", level_prefix(rec->level), rec->func, rec->line);
+
+    while(*p) {
+        const char *lit = p;
+        char spec[LOG_SPEC_SIZE];
+        size_t spec_len = 0;
+
+        while(*p && (*p != '%' || p[1] == '%')) {
+            p += (*p == '%' ? 2 : 1);
+        }
+
+        if(p > lit) {
+            /* literal text, "%%" included, goes through printf to collapse the escapes. */
+            char text[LOG_LINE_SIZE];
+            size_t text_len = (size_t)(p - lit);
+
+            if(text_len >= sizeof(text)) {
+                text_len = sizeof(text) - 1;
+            }
+
+            memcpy(text, lit, text_len);
+            text[text_len] = 0;
+
+            line_append(line, &len, text);
+        }
+
+        if(!*p || !parse_conv(p, &conv)) {
+            break;
+        }
+
+        p = conv.end;
+
+        /* copy the flags, width and precision, up to the length modifier. */
+        for(const char *q = conv.start; q < conv.end - 1 && spec_len < sizeof(spec) - 8; q++) {
+            if(*q == 'h' || *q == 'l' || *q == 'z' || *q == 'j' || *q == 't' || *q == 'L') {
+                break;
+            }
+
+            if(*q == '*') {
+                spec_len += (size_t)snprintf(spec + spec_len, sizeof(spec) - spec_len, "%d", (int)rec->args[arg++].i);
+            } else {
+                spec[spec_len++] = *q;
+            }
+        }
+
+        spec[spec_len] = 0;
+
+        switch(conv.conv) {
+            case 'd':
+            case 'i':
+                strcat(spec, "lld");
+                spec[strlen(spec) - 1] = conv.conv;
+                line_append(line, &len, spec, (long long)rec->args[arg++].i);
+                break;
+
+            case 'u':
+            case 'x':
+            case 'X':
+            case 'o':
+                strcat(spec, "ll?");
+                spec[strlen(spec) - 1] = conv.conv;
+                line_append(line, &len, spec, (unsigned long long)rec->args[arg++].u);
+                break;
+
+            case 'c':
+                strcat(spec, "c");
+                line_append(line, &len, spec, (int)rec->args[arg++].u);
+                break;
+
+            case 's':
+                strcat(spec, "s");
+                line_append(line, &len, spec, rec->strings + rec->args[arg++].u);
+                break;
+
+            case 'p':
+                strcat(spec, "p");
+                line_append(line, &len, spec, rec->args[arg++].p);
+                break;
+
+            default:
+                spec[spec_len] = conv.conv;
+                spec[spec_len + 1] = 0;
+                line_append(line, &len, spec, rec->args[arg++].d);
+                break;
+        }
+    }
+
+    line[len++] = '\n';
+
+    return len;
+}
+
+
+/* format and write on the calling thread, for when there is no ring to use. */
+static void write_now(const char *func, int line, debug_level_t level, const char *templ, va_list va)
+{
+    char buf[LOG_LINE_SIZE + 1];
+    size_t len = 0;
+    int n = 0;
+
+    line_append(buf, &len, "%s %s:%d ", level_prefix(level), func, line);
+
+    n = vsnprintf(buf + len, LOG_LINE_SIZE - len, templ, va);
+    if(n > 0) {
+        len += (size_t)n;
+
+        if(len > LOG_LINE_SIZE - 1) {
+            len = LOG_LINE_SIZE - 1;
+        }
+    }
+
+    buf[len++] = '\n';
+
+    fwrite(buf, 1, len, stderr);
+}
+
+
+
+/* the oldest published record across all the rings. */
+static struct log_ring_t *oldest_ring(void)
+{
+    struct log_ring_t *oldest = NULL;
+    int64_t oldest_time = 0;
+
+    for(struct log_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+        uint32_t tail = ring->tail;
+
+        if(ATOMIC_LOAD_U32(&ring->head) != tail) {
+            const struct log_record_t *rec = &(ring->records[tail % LOG_RING_SIZE]);
+
+            if(!oldest || rec->time_ns < oldest_time) {
+                oldest = ring;
+                oldest_time = rec->time_ns;
+            }
+        }
+    }
+
+    return oldest;
+}
+
+
+static void report_drops(void)
+{
+    for(struct log_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+        uint32_t dropped = ATOMIC_LOAD_U32(&ring->dropped);
+
+        if(dropped != ring->reported) {
+            fprintf(stderr, "WARN debug_impl: %u log messages dropped, a thread's log ring was full!\n", dropped - ring->reported);
+            ring->reported = dropped;
+        }
+    }
+}
+
+
+static void *logger_thread_func(void *arg)
+{
+    char line[LOG_LINE_SIZE + 1];
+
+    (void)arg;
+
+    for(;;) {
+        struct log_ring_t *ring = NULL;
+        bool stopping = logger_stop;
+
+        while((ring = oldest_ring())) {
+            size_t len = format_record(&(ring->records[ring->tail % LOG_RING_SIZE]), line);
+
+            ATOMIC_STORE_U32(&ring->tail, ring->tail + 1);
+
+            fwrite(line, 1, len, stderr);
+        }
+
+        report_drops();
+        fflush(stderr);
+
+        /* everything published before the stop was seen has been written. */
+        if(stopping) {
+            break;
+        }
+
+        util_sleep_ms(LOG_IDLE_WAIT_MS);
+    }
+
+    return NULL;
+}
+
+
+static void logger_shutdown(void)
+{
+    if(ATOMIC_CAS_U32(&logger_state, LOGGER_RUNNING, LOGGER_STOPPED)) {
+        logger_stop = true;
+        THREAD_JOIN(logger_thread);
+    }
+}
+
+
+/* the calling thread's ring, made and linked in on first use.  NULL if logging has to be synchronous. */
+static struct log_ring_t *get_ring(void)
+{
+    struct log_ring_t *ring = thread_ring;
+    struct log_ring_t *head = NULL;
+
+    if(ring) {
+        return ring;
+    }
+
+    if(ATOMIC_CAS_U32(&logger_state, LOGGER_OFF, LOGGER_RUNNING)) {
+        if(!THREAD_CREATE(logger_thread, logger_thread_func, NULL)) {
+            ATOMIC_STORE_U32(&logger_state, LOGGER_STOPPED);
+            return NULL;
+        }
+
+        atexit(logger_shutdown);
+    }
+
+    if(ATOMIC_LOAD_U32(&logger_state) != LOGGER_RUNNING || !(ring = calloc(1, sizeof(*ring)))) {
+        return NULL;
+    }
+
+    do {
+        head = ATOMIC_LOAD_PTR(&rings);
+        ring->next = head;
+    } while(!ATOMIC_CAS_PTR(&rings, head, ring));
+
+    thread_ring = ring;
+
+    return ring;
+}
+
+
 void debug_impl(const char *func, int line, debug_level_t level, const char *templ, ...)
 {
     va_list va;
-    const char *prefix = NULL;
+    struct log_ring_t *ring = NULL;
+    struct log_record_t *rec = NULL;
+    uint32_t head = 0;
+    bool captured = false;
 
-    switch(level) {
-        case DEBUG_WARN: prefix = "WARN"; break;
-        case DEBUG_INFO: prefix = "INFO"; break;
-        case DEBUG_DETAIL: prefix = "DETAIL"; break;
-        case DEBUG_FLOOD: prefix = "FLOOD"; break;
-        case DEBUG_ERROR: prefix = "ERROR"; break;
-        default: prefix = "UNKNOWN"; break;
+    /* errors are followed by exit(), write them straight away. */
+    if(level == DEBUG_ERROR || ATOMIC_LOAD_U32(&logger_state) == LOGGER_STOPPED || !(ring = get_ring())) {
+        va_start(va, templ);
+        write_now(func, line, level, templ, va);
+        va_end(va);
+        return;
     }
 
-    if(level <= debug_level || level == DEBUG_ERROR) {
-        /* print it out. */
-        fprintf(stderr, "%s %s:%d ", prefix, func, line);
+    head = ring->head;
+
+    if(head - ATOMIC_LOAD_U32(&ring->tail) >= LOG_RING_SIZE) {
+        ATOMIC_STORE_U32(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+
+    rec = &(ring->records[head % LOG_RING_SIZE]);
+
+    rec->time_ns = util_clock_ns();
+    rec->func = func;
+    rec->line = line;
+    rec->level = level;
+    rec->templ = templ;
+
+    va_start(va, templ);
+    captured = capture_args(rec, templ, &va);
+    va_end(va);
+
+    if(!captured) {
+        /* too many arguments or a conversion we cannot replay. */
         va_start(va, templ);
-        vfprintf(stderr, templ, va);
+        write_now(func, line, level, templ, va);
         va_end(va);
-        fprintf(stderr,"\n");
+        return;
+    }
+
+    ATOMIC_STORE_U32(&ring->head, head + 1);
+}
+
+
+uint64_t debug_get_dropped(void)
+{
+    uint64_t dropped = 0;
+
+    for(struct log_ring_t *ring = ATOMIC_LOAD_PTR(&rings); ring; ring = ring->next) {
+        dropped += ATOMIC_LOAD_U32(&ring->dropped);
     }
+
+    return dropped;
 }
 
 
 
-#define ROW_BUF_SIZE (300)
 #define COLUMNS (size_t)(16)
+#define ROW_BUF_SIZE (20 + (COLUMNS * 3))
 
 
+/* decimal, zero padded to at least four digits. */
+static size_t put_offset(char *buf, size_t offset)
+{
+    char digits[20];
+    size_t num_digits = 0;
+    size_t len = 0;
+
+    do {
+        digits[num_digits++] = (char)('0' + (offset % 10));
+        offset /= 10;
+    } while(offset || num_digits < 4);
+
+    while(num_digits) {
+        buf[len++] = digits[--num_digits];
+    }
+
+    return len;
+}
+
+
+/* hex rows of 16 bytes, each row a single log record at the given level. */
 void debug_dump_ptr(debug_level_t level, uint8_t *start_buf, uint8_t *end_buf)
 {
+    static const char hex_digits[] = "0123456789abcdef";
     intptr_t data_len = 0;
-    size_t max_row = 0;
-    size_t row = 0;
-    size_t column = 0;
-    uint8_t *cur_buf = start_buf;
+    size_t offset = 0;
     char row_buf[ROW_BUF_SIZE + 1] = {0};
 
-    if(level <= debug_level) {
+    if(!debug_enabled(level)) {
         return;
     }
 
@@ -102,21 +813,19 @@ void debug_dump_ptr(debug_level_t level, uint8_t *start_buf, uint8_t *end_buf)
         return;
     }
 
-    /* determine the number of rows we will need to print. */
-    max_row = ((size_t)data_len + (COLUMNS - 1))/COLUMNS;
+    for(offset = 0; offset < (size_t)data_len; offset += COLUMNS) {
+        size_t row_len = put_offset(row_buf, offset);
 
-    for(row = 0; row < max_row; row++) {
-        size_t offset = (row * COLUMNS);
-        size_t row_offset = 0;
+        for(size_t column = 0; column < COLUMNS && offset + column < (size_t)data_len; column++) {
+            uint8_t byte = start_buf[offset + column];
 
-        /* print the prefix and address */
-        row_offset = (size_t)snprintf(&row_buf[0], sizeof(row_buf),"%04zu", offset);
-
-        for(column = 0; column < COLUMNS && ptr_before(cur_buf, end_buf) && row_offset < (int)sizeof(row_buf); cur_buf++, offset++, column++) {
-            row_offset += (size_t)snprintf(&row_buf[row_offset], ROW_BUF_SIZE - row_offset, " %02x", *cur_buf);
+            row_buf[row_len++] = ' ';
+            row_buf[row_len++] = hex_digits[byte >> 4];
+            row_buf[row_len++] = hex_digits[byte & 0x0F];
         }
 
-        /* output it, finally */
-        fprintf(stderr,"%s\n", row_buf);
+        row_buf[row_len] = 0;
+
+        debug_impl(__func__, __LINE__, level, "%s", row_buf);
     }
 }
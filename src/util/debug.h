@@ -15,8 +15,12 @@
 
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include "util/shims.h"
+#include "util/status.h"
+
 typedef enum {
     DEBUG_NONE,
     DEBUG_WARN,
@@ -27,21 +31,67 @@ typedef enum {
     DEBUG_ERROR = 1000,
 } debug_level_t;
 
+/*
+ * Messages more verbose than this are compiled out, arguments and all.  Set
+ * it with -DDEBUG_BUILD_LEVEL=<n> (the DEBUG_BUILD_LEVEL CMake cache entry).
+ */
+#ifndef DEBUG_BUILD_LEVEL
+    #define DEBUG_BUILD_LEVEL (DEBUG_FLOOD)
+#endif
+
+/*
+ * Each subsystem has its own runtime level.  A source file picks its
+ * subsystem by defining DEBUG_SUBSYS before its first include.
+ */
+typedef enum {
+    DEBUG_SUBSYS_GENERAL,
+    DEBUG_SUBSYS_PROACTOR,
+    DEBUG_SUBSYS_EIP,
+    DEBUG_SUBSYS_CIP,
+    DEBUG_SUBSYS_TAGS,
+    DEBUG_SUBSYS_IO,
+
+    DEBUG_NUM_SUBSYS
+} debug_subsys_t;
+
+#ifndef DEBUG_SUBSYS
+    #define DEBUG_SUBSYS (DEBUG_SUBSYS_GENERAL)
+#endif
+
+/* only read through the macros below. */
+extern volatile uint8_t debug_subsys_levels[DEBUG_NUM_SUBSYS];
+extern THREAD_LOCAL uint8_t debug_conn_level;
+
 /* debug helpers */
 extern void debug_set_level(debug_level_t level);
 extern debug_level_t debug_get_level(void);
+extern void debug_set_subsys_level(debug_subsys_t subsys, debug_level_t level);
+extern debug_subsys_t debug_subsys_from_name(const char *name, size_t name_len);
+
+/*
+ * Per connection tracing.  Connections from a traced peer log at the peer's
+ * level while their traffic is being handled, whatever the subsystem levels.
+ */
+extern status_t debug_add_peer(uint32_t ip_addr, debug_level_t level);
+extern debug_level_t debug_get_peer_level(uint32_t ip_addr);
+#define debug_conn_begin(LEVEL) do { debug_conn_level = (uint8_t)(LEVEL); } while(0)
+#define debug_conn_end() do { debug_conn_level = DEBUG_NONE; } while(0)
 
 extern void debug_impl(const char *func, int line, debug_level_t level, const char *templ, ...);
+extern uint64_t debug_get_dropped(void);
+
+#define debug_enabled(LEVEL) ((LEVEL) <= DEBUG_BUILD_LEVEL && ((LEVEL) <= debug_subsys_levels[DEBUG_SUBSYS] || (LEVEL) <= debug_conn_level))
+#define debug_log(LEVEL, ...) do { if(debug_enabled(LEVEL)) { debug_impl(__func__, __LINE__, (LEVEL), __VA_ARGS__); } } while(0)
 
 #define assert_error(COND, ...) do { if(!(COND)) { debug_impl(__func__, __LINE__, DEBUG_ERROR, __VA_ARGS__); exit(1); } } while(0)
-#define warn(...) debug_impl(__func__, __LINE__, DEBUG_WARN, __VA_ARGS__)
-#define info(...) debug_impl(__func__, __LINE__, DEBUG_INFO, __VA_ARGS__)
-#define detail(...) debug_impl(__func__, __LINE__, DEBUG_DETAIL, __VA_ARGS__)
-#define flood(...) debug_impl(__func__, __LINE__, DEBUG_FLOOD, __VA_ARGS__)
-
-#define warn_do if(debug_get_level() <= (DEBUG_WARN))
-#define info_do if(debug_get_level() <= (DEBUG_INFO))
-#define detail_do if(debug_get_level() <= (DEBUG_DETAIL))
-#define flood_do if(debug_get_level() <= (DEBUG_FLOOD))
+#define warn(...) debug_log(DEBUG_WARN, __VA_ARGS__)
+#define info(...) debug_log(DEBUG_INFO, __VA_ARGS__)
+#define detail(...) debug_log(DEBUG_DETAIL, __VA_ARGS__)
+#define flood(...) debug_log(DEBUG_FLOOD, __VA_ARGS__)
+
+#define warn_do if(debug_enabled(DEBUG_WARN))
+#define info_do if(debug_enabled(DEBUG_INFO))
+#define detail_do if(debug_enabled(DEBUG_DETAIL))
+#define flood_do if(debug_enabled(DEBUG_FLOOD))
 
 extern void debug_dump_ptr(debug_level_t level, uint8_t *start, uint8_t *end);
@@ -0,0 +1,148 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <string.h>
+
+#ifdef IS_WINDOWS
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include "debug.h"
+#include "file_map.h"
+
+
+
+#ifdef IS_WINDOWS
+
+status_t file_map_open(struct file_map_t *map, const char *path)
+{
+    LARGE_INTEGER size;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+
+    if(!map || !path) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    memset(map, 0, sizeof(*map));
+
+    file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) {
+        warn("Unable to open %s!", path);
+        return STATUS_NOT_FOUND;
+    }
+
+    if(!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        warn("File %s is empty!", path);
+        CloseHandle(file);
+        return STATUS_BAD_INPUT;
+    }
+
+    if(!(mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL))) {
+        warn("Unable to create file mapping for %s!", path);
+        CloseHandle(file);
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    if(!(map->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0))) {
+        warn("Unable to map %s!", path);
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    map->file_handle = file;
+    map->mapping_handle = mapping;
+    map->size = (size_t)size.QuadPart;
+
+    return STATUS_OK;
+}
+
+
+void file_map_close(struct file_map_t *map)
+{
+    if(!map || !map->data) {
+        return;
+    }
+
+    UnmapViewOfFile(map->data);
+    CloseHandle((HANDLE)map->mapping_handle);
+    CloseHandle((HANDLE)map->file_handle);
+
+    memset(map, 0, sizeof(*map));
+}
+
+#else
+
+status_t file_map_open(struct file_map_t *map, const char *path)
+{
+    struct stat st;
+    void *data = NULL;
+    int fd = -1;
+
+    if(!map || !path) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    memset(map, 0, sizeof(*map));
+
+    if((fd = open(path, O_RDONLY)) < 0) {
+        warn("Unable to open %s!", path);
+        return STATUS_NOT_FOUND;
+    }
+
+    if(fstat(fd, &st) != 0 || st.st_size == 0) {
+        warn("File %s is empty or unreadable!", path);
+        close(fd);
+        return STATUS_BAD_INPUT;
+    }
+
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    /* the mapping keeps the file alive. */
+    close(fd);
+
+    if(data == MAP_FAILED) {
+        warn("Unable to map %s!", path);
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    map->data = data;
+    map->size = (size_t)st.st_size;
+
+    return STATUS_OK;
+}
+
+
+void file_map_close(struct file_map_t *map)
+{
+    if(!map || !map->data) {
+        return;
+    }
+
+    munmap((void *)map->data, map->size);
+
+    memset(map, 0, sizeof(*map));
+}
+
+#endif
@@ -0,0 +1,36 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stddef.h>
+
+#include "status.h"
+
+
+/* a read-only mapping of a whole file. */
+struct file_map_t {
+    const void *data;
+    size_t size;
+
+#ifdef IS_WINDOWS
+    void *file_handle;
+    void *mapping_handle;
+#endif
+};
+
+
+extern status_t file_map_open(struct file_map_t *map, const char *path);
+extern void file_map_close(struct file_map_t *map);
@@ -0,0 +1,154 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <string.h>
+
+#include "util/histogram.h"
+
+
+
+void histogram_reset(struct histogram_t *hist)
+{
+    if(hist) {
+        memset(hist, 0, sizeof(*hist));
+    }
+}
+
+
+void histogram_merge(struct histogram_t *dest, const struct histogram_t *src)
+{
+    if(!dest || !src || !src->count) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+
+    if(!dest->count || src->min < dest->min) {
+        dest->min = src->min;
+    }
+
+    if(src->max > dest->max) {
+        dest->max = src->max;
+    }
+
+    dest->count += src->count;
+    dest->sum += src->sum;
+}
+
+
+/* copy a histogram that its owning thread may still be recording into. */
+void histogram_snapshot(struct histogram_t *dest, const struct histogram_t *src)
+{
+    if(!dest || !src) {
+        return;
+    }
+
+    for(uint32_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        dest->buckets[i] = ATOMIC_LOAD_U64_RELAXED(&(src->buckets[i]));
+    }
+
+    dest->count = ATOMIC_LOAD_U64_RELAXED(&(src->count));
+    dest->min = ATOMIC_LOAD_U64_RELAXED(&(src->min));
+    dest->max = ATOMIC_LOAD_U64_RELAXED(&(src->max));
+    dest->sum = ATOMIC_LOAD_U64_RELAXED(&(src->sum));
+}
+
+
+/* the largest value that lands in a bucket. */
+static uint64_t bucket_top(uint32_t bucket)
+{
+    uint32_t range = bucket / HISTOGRAM_SUB_BUCKETS;
+    uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    int shift = 0;
+
+    if(range == 0) {
+        return bucket;
+    }
+
+    shift = (int)range - 1;
+
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+
+/* the value at or below which the given percentage of the samples fall. */
+uint64_t histogram_percentile(const struct histogram_t *hist, double percentile)
+{
+    uint64_t target = 0;
+    uint64_t seen = 0;
+
+    if(!hist || !hist->count) {
+        return 0;
+    }
+
+    if(percentile >= 100.0) {
+        return hist->max;
+    }
+
+    target = (uint64_t)((percentile / 100.0) * (double)hist->count + 0.5);
+    if(target == 0) {
+        target = 1;
+    }
+
+    for(uint32_t i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+        seen += hist->buckets[i];
+
+        if(seen >= target) {
+            uint64_t top = bucket_top(i);
+
+            /* never report past what was actually recorded. */
+            return (top > hist->max ? hist->max : (top < hist->min ? hist->min : top));
+        }
+    }
+
+    return hist->max;
+}
+
+
+/*
+ * The samples in buckets that lie wholly at or below value.  Close enough
+ * for cumulative bucket counts at boundaries of the caller's choosing.
+ */
+uint64_t histogram_count_below(const struct histogram_t *hist, uint64_t value)
+{
+    uint64_t count = 0;
+
+    if(!hist || !hist->count) {
+        return 0;
+    }
+
+    if(value >= hist->max) {
+        return hist->count;
+    }
+
+    for(uint32_t i = 0; i < HISTOGRAM_NUM_BUCKETS && bucket_top(i) <= value; i++) {
+        count += hist->buckets[i];
+    }
+
+    return count;
+}
+
+
+double histogram_mean(const struct histogram_t *hist)
+{
+    if(!hist || !hist->count) {
+        return 0.0;
+    }
+
+    return (double)hist->sum / (double)hist->count;
+}
@@ -0,0 +1,87 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include "util/shims.h"
+
+
+/*
+ * Log-linear histogram, in the style of HdrHistogram.
+ *
+ * Values below 32 get a bucket each.  Above that every power of two range
+ * is split into 32 buckets, so a recorded value is known to within about 3%
+ * over the whole 64-bit range.  Recording is a bit scan and an increment.
+ * A histogram belongs to one thread; merge them to combine results.
+ * Recording uses relaxed atomic stores, so another thread can safely take
+ * a snapshot while it is being written.  Such a snapshot may be a sample
+ * or two out of step between its fields.
+ */
+
+#define HISTOGRAM_SUB_BITS (5)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_NUM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+
+struct histogram_t {
+    uint64_t count;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    uint64_t buckets[HISTOGRAM_NUM_BUCKETS];
+};
+
+
+static inline uint32_t histogram_bucket(uint64_t value)
+{
+    int msb = 0;
+
+    if(value < HISTOGRAM_SUB_BUCKETS) {
+        return (uint32_t)value;
+    }
+
+    msb = HIGHEST_BIT_U64(value);
+
+    return (uint32_t)((msb - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS) + (uint32_t)((value >> (msb - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+
+static inline void histogram_record(struct histogram_t *hist, uint64_t value)
+{
+    uint64_t *bucket = &(hist->buckets[histogram_bucket(value)]);
+
+    ATOMIC_STORE_U64_RELAXED(bucket, ATOMIC_LOAD_U64_RELAXED(bucket) + 1);
+
+    if(!hist->count || value < hist->min) {
+        ATOMIC_STORE_U64_RELAXED(&(hist->min), value);
+    }
+
+    if(value > hist->max) {
+        ATOMIC_STORE_U64_RELAXED(&(hist->max), value);
+    }
+
+    ATOMIC_STORE_U64_RELAXED(&(hist->count), hist->count + 1);
+    ATOMIC_STORE_U64_RELAXED(&(hist->sum), hist->sum + value);
+}
+
+
+extern void histogram_reset(struct histogram_t *hist);
+extern void histogram_merge(struct histogram_t *dest, const struct histogram_t *src);
+extern void histogram_snapshot(struct histogram_t *dest, const struct histogram_t *src);
+extern uint64_t histogram_percentile(const struct histogram_t *hist, double percentile);
+extern uint64_t histogram_count_below(const struct histogram_t *hist, uint64_t value);
+extern double histogram_mean(const struct histogram_t *hist);
@@ -0,0 +1,169 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/debug.h"
+#include "util/histogram.h"
+#include "util/unit_test.h"
+
+
+/* histograms are too big for the stack of every test. */
+static struct histogram_t hist;
+static struct histogram_t other;
+
+
+
+static void test_bucket(void)
+{
+    uint32_t last = 0;
+
+    for(uint64_t v = 0; v < HISTOGRAM_SUB_BUCKETS; v++) {
+        CHECK_EQ(histogram_bucket(v), v);
+    }
+
+    /* the first split range starts right after the linear buckets. */
+    CHECK_EQ(histogram_bucket(32), 32);
+    CHECK_EQ(histogram_bucket(63), 63);
+    CHECK_EQ(histogram_bucket(64), 64);
+    CHECK_EQ(histogram_bucket(65), 64);
+    CHECK_EQ(histogram_bucket(66), 65);
+    CHECK_EQ(histogram_bucket(UINT64_MAX), HISTOGRAM_NUM_BUCKETS - 1);
+
+    /* never goes backwards and never skips a bucket. */
+    for(uint64_t v = 1; v < (1u << 20); v++) {
+        uint32_t bucket = histogram_bucket(v);
+
+        CHECK(bucket == last || bucket == last + 1);
+        last = bucket;
+    }
+
+    for(int shift = 20; shift < 64; shift++) {
+        uint64_t v = (uint64_t)1 << shift;
+
+        CHECK_EQ(histogram_bucket(v - 1) + 1, histogram_bucket(v));
+    }
+}
+
+
+/*
+ * A low percentile of one value and a much larger one is the top of the
+ * first value's bucket, which has to be in the same bucket and within
+ * about 3% of it.
+ */
+static void test_bucket_top(void)
+{
+    for(uint64_t v = 1; v < ((uint64_t)1 << 62); v = v * 3 + 1) {
+        uint64_t top = 0;
+
+        histogram_reset(&hist);
+        histogram_record(&hist, v);
+        histogram_record(&hist, UINT64_MAX);
+
+        top = histogram_percentile(&hist, 10.0);
+
+        CHECK(top >= v);
+        CHECK_EQ(histogram_bucket(top), histogram_bucket(v));
+        CHECK_EQ(histogram_bucket(top + 1), histogram_bucket(v) + 1);
+        CHECK((top - v) <= v / HISTOGRAM_SUB_BUCKETS);
+    }
+}
+
+
+static void test_percentile(void)
+{
+    histogram_reset(&hist);
+
+    CHECK_EQ(histogram_percentile(&hist, 50.0), 0);
+    CHECK(histogram_mean(&hist) == 0.0);
+    CHECK_EQ(histogram_count_below(&hist, 100), 0);
+
+    for(uint64_t v = 1; v <= 1000; v++) {
+        histogram_record(&hist, v);
+    }
+
+    CHECK_EQ(hist.count, 1000);
+    CHECK_EQ(hist.min, 1);
+    CHECK_EQ(hist.max, 1000);
+    CHECK_EQ(hist.sum, 500500);
+    CHECK(histogram_mean(&hist) == 500.5);
+
+    /* a percentile is reported as the top of the bucket it lands in. */
+    CHECK_EQ(histogram_percentile(&hist, 50.0), 503);
+    CHECK_EQ(histogram_percentile(&hist, 99.0), 991);
+    CHECK_EQ(histogram_percentile(&hist, 100.0), 1000);
+    CHECK_EQ(histogram_percentile(&hist, 0.0), 1);
+
+    /* the top bucket runs past what was recorded. */
+    CHECK_EQ(histogram_percentile(&hist, 99.99), 1000);
+
+    CHECK_EQ(histogram_count_below(&hist, 0), 0);
+    CHECK_EQ(histogram_count_below(&hist, 31), 31);
+    CHECK_EQ(histogram_count_below(&hist, 63), 63);
+
+    /* 64 shares a bucket with 65, so it is not wholly below. */
+    CHECK_EQ(histogram_count_below(&hist, 64), 63);
+    CHECK_EQ(histogram_count_below(&hist, 65), 65);
+    CHECK_EQ(histogram_count_below(&hist, 1000), 1000);
+}
+
+
+static void test_merge(void)
+{
+    histogram_reset(&hist);
+    histogram_reset(&other);
+
+    histogram_record(&hist, 10);
+    histogram_record(&other, 5);
+    histogram_record(&other, 5000);
+
+    histogram_merge(&other, &hist);
+
+    /* an empty source changes nothing, not even the minimum. */
+    histogram_reset(&hist);
+    histogram_merge(&other, &hist);
+
+    CHECK_EQ(other.count, 3);
+    CHECK_EQ(other.min, 5);
+    CHECK_EQ(other.max, 5000);
+    CHECK_EQ(other.sum, 5015);
+    CHECK_EQ(other.buckets[10], 1);
+
+    /* an empty destination takes the source's minimum. */
+    histogram_merge(&hist, &other);
+    CHECK_EQ(hist.min, 5);
+    CHECK_EQ(hist.count, 3);
+
+    histogram_snapshot(&hist, &other);
+    CHECK(memcmp(&hist, &other, sizeof(hist)) == 0);
+
+    histogram_reset(&hist);
+    CHECK_EQ(hist.count, 0);
+    CHECK_EQ(hist.buckets[10], 0);
+}
+
+
+
+int main(void)
+{
+    debug_set_level(DEBUG_NONE);
+
+    test_bucket();
+    test_bucket_top();
+    test_percentile();
+    test_merge();
+
+    return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,197 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "pool.h"
+#include "shims.h"
+
+
+struct pool_chunk_t {
+    struct pool_chunk_t *next;
+};
+
+
+struct pool_free_block_t {
+    struct pool_free_block_t *next;
+};
+
+
+struct pool_t {
+    mutex_t mutex;
+
+    size_t block_size;
+    uint32_t blocks_per_chunk;
+    uint32_t blocks_in_use;
+
+    struct pool_chunk_t *chunks;
+    struct pool_free_block_t *free_list;
+};
+
+
+/* keep every block aligned for any type we might put in it. */
+#define POOL_ALIGN (sizeof(uint64_t) * 2)
+#define POOL_ROUND_UP(n) (((n) + (POOL_ALIGN - 1)) & ~(POOL_ALIGN - 1))
+
+
+
+struct pool_t *pool_create(size_t block_size, uint32_t blocks_per_chunk)
+{
+    struct pool_t *pool = NULL;
+
+    if(block_size == 0 || blocks_per_chunk == 0) {
+        warn("Block size and blocks per chunk must be greater than zero!");
+        return NULL;
+    }
+
+    if(!(pool = calloc(1, sizeof(*pool)))) {
+        warn("Unable to allocate pool!");
+        return NULL;
+    }
+
+    if(block_size < sizeof(struct pool_free_block_t)) {
+        block_size = sizeof(struct pool_free_block_t);
+    }
+
+    pool->block_size = POOL_ROUND_UP(block_size);
+    pool->blocks_per_chunk = blocks_per_chunk;
+
+    MUTEX_INIT(pool->mutex);
+
+    return pool;
+}
+
+
+void pool_dispose(struct pool_t *pool)
+{
+    if(!pool) {
+        return;
+    }
+
+    if(pool->blocks_in_use) {
+        warn("Disposing pool with %u blocks still in use!", pool->blocks_in_use);
+    }
+
+    for(struct pool_chunk_t *chunk = pool->chunks; chunk; ) {
+        struct pool_chunk_t *next = chunk->next;
+
+        free(chunk);
+
+        chunk = next;
+    }
+
+    MUTEX_DESTROY(pool->mutex);
+
+    free(pool);
+}
+
+
+
+/* must be called with the mutex held. */
+static int pool_grow(struct pool_t *pool)
+{
+    struct pool_chunk_t *chunk = NULL;
+    uint8_t *block = NULL;
+
+    detail("Growing pool by %u blocks of %zu bytes.", pool->blocks_per_chunk, pool->block_size);
+
+    if(!(chunk = malloc(POOL_ROUND_UP(sizeof(*chunk)) + (pool->block_size * pool->blocks_per_chunk)))) {
+        warn("Unable to allocate new pool chunk!");
+        return 0;
+    }
+
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    block = (uint8_t *)chunk + POOL_ROUND_UP(sizeof(*chunk));
+
+    for(uint32_t i = 0; i < pool->blocks_per_chunk; i++, block += pool->block_size) {
+        struct pool_free_block_t *free_block = (struct pool_free_block_t *)block;
+
+        free_block->next = pool->free_list;
+        pool->free_list = free_block;
+    }
+
+    return 1;
+}
+
+
+void *pool_alloc(struct pool_t *pool)
+{
+    struct pool_free_block_t *block = NULL;
+
+    if(!pool) {
+        warn("Called with a NULL pool pointer!");
+        return NULL;
+    }
+
+    MUTEX_LOCK(pool->mutex);
+
+    if(pool->free_list || pool_grow(pool)) {
+        block = pool->free_list;
+        pool->free_list = block->next;
+        pool->blocks_in_use++;
+    }
+
+    MUTEX_UNLOCK(pool->mutex);
+
+    if(block) {
+        memset(block, 0, pool->block_size);
+    }
+
+    return block;
+}
+
+
+void pool_free(struct pool_t *pool, void *block)
+{
+    struct pool_free_block_t *free_block = (struct pool_free_block_t *)block;
+
+    if(!pool || !block) {
+        return;
+    }
+
+    MUTEX_LOCK(pool->mutex);
+
+    free_block->next = pool->free_list;
+    pool->free_list = free_block;
+    pool->blocks_in_use--;
+
+    MUTEX_UNLOCK(pool->mutex);
+}
+
+
+
+size_t pool_block_size(struct pool_t *pool)
+{
+    return (pool ? pool->block_size : 0);
+}
+
+
+uint32_t pool_blocks_in_use(struct pool_t *pool)
+{
+    uint32_t count = 0;
+
+    if(pool) {
+        MUTEX_LOCK(pool->mutex);
+        count = pool->blocks_in_use;
+        MUTEX_UNLOCK(pool->mutex);
+    }
+
+    return count;
+}
@@ -0,0 +1,40 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/*
+ * A simple fixed size block pool.
+ *
+ * Blocks are carved out of larger chunks and recycled through a free list,
+ * so per-connection state can be shared by all devices in a process instead
+ * of being reserved up front by each one.  The pool is safe to use from any
+ * proactor thread.
+ */
+
+struct pool_t;
+
+extern struct pool_t *pool_create(size_t block_size, uint32_t blocks_per_chunk);
+extern void pool_dispose(struct pool_t *pool);
+
+extern void *pool_alloc(struct pool_t *pool);
+extern void pool_free(struct pool_t *pool, void *block);
+
+extern size_t pool_block_size(struct pool_t *pool);
+extern uint32_t pool_blocks_in_use(struct pool_t *pool);
@@ -19,6 +19,7 @@
 #include <stdint.h>
 
 #include "buf.h"
+#include "histogram.h"
 #include "status.h"
 
 
@@ -52,7 +53,7 @@ typedef enum {
 
 
 /* forward declaration.  Implementation is hidden. */
-struct proactor_t proactor_t;
+struct proactor_t;
 struct proactor_socket_t;
 
 
@@ -70,6 +71,41 @@ extern void proactor_net_stop(struct proactor_t *proactor);
 extern void proactor_net_wake(struct proactor_t *proactor);
 
 
+/* the kinds of callback a loop makes, for timing them. */
+typedef enum {
+    PROACTOR_CALLBACK_ACCEPT,
+    PROACTOR_CALLBACK_RECEIVE,
+    PROACTOR_CALLBACK_SENT,
+    PROACTOR_CALLBACK_TICK,
+    PROACTOR_NUM_CALLBACKS
+} proactor_callback_t;
+
+
+/*
+ * Written only by the loop's own thread, so other threads may see them a
+ * little behind.  All times are in nanoseconds.  timer_lag_ns is how long
+ * after its deadline each tick actually ran.
+ *
+ * wait_ns and callback_ns are measured on the real clock, even under
+ * virtual time.  timer_lag_ns is measured on the clock that the deadlines
+ * are scheduled on.  Under virtual time it is in virtual nanoseconds.
+ */
+struct proactor_stats_t {
+    uint64_t iterations;
+    uint64_t slow_callbacks;
+
+    struct histogram_t wait_ns;
+    struct histogram_t callback_ns[PROACTOR_NUM_CALLBACKS];
+    struct histogram_t timer_lag_ns;
+};
+
+extern status_t proactor_net_get_stats(struct proactor_t *proactor, struct proactor_stats_t *stats);
+extern const char *proactor_net_callback_name(proactor_callback_t callback);
+
+/* warn about any callback that holds the loop at least this long, zero turns it off. */
+extern status_t proactor_net_set_slow_callback_ns(struct proactor_t *proactor, int64_t threshold_ns);
+
+
 
 /*
  * The following are functions that deal with individual sockets.  The actual
@@ -81,9 +117,22 @@ extern void proactor_net_wake(struct proactor_t *proactor);
 /* define a simple buffer struct for passing buffers back and forth across the API boundary. */
 
 
+/*
+ * An empty address listens on all interfaces.  Client sockets connect before
+ * this returns.  Sockets accepted by a listener start out with its sock_data
+ * and app_data, and every callback on a socket gets that socket's data.
+ *
+ * Closing does not call the close callback.  That is only called when the
+ * peer closes or the connection fails, and for sockets still open when the
+ * proactor is disposed.  No callbacks are made on a socket after it is
+ * closed, and a socket may be closed from inside any of its own callbacks.
+ */
 extern status_t proactor_net_socket_open(struct proactor_t *proactor, struct proactor_socket_t **socket, proactor_socket_type_t socket_type, const char *address, uint16_t port, void *sock_data, void *app_data);
 extern status_t proactor_net_socket_close(struct proactor_socket_t *socket);
 
+/* set or replace the socket data, used to attach per-connection state to accepted sockets. */
+extern status_t proactor_net_socket_set_data(struct proactor_socket_t *socket, void *sock_data);
+
 
 typedef status_t (*on_accept_cb_func_t)(struct proactor_socket_t *listener_socket, struct proactor_socket_t *client_socket, status_t status, void *sock_data, void *app_data);
 typedef status_t (*on_close_cb_func_t)(struct proactor_socket_t *socket, status_t status, void *sock_data, void *app_data);
@@ -98,6 +147,12 @@ extern status_t proactor_net_socket_set_receive_callback(struct proactor_socket_
 extern status_t proactor_net_socket_set_sent_callback(struct proactor_socket_t *socket, on_sent_cb_func_t sent_cb);
 extern status_t proactor_net_socket_set_tick_callback(struct proactor_socket_t *socket, on_tick_cb_func_t tick_cb);
 
+/*
+ * One request of each kind may be pending on a socket.  A receive completes
+ * with a single read of up to data_length bytes into buf and sets data_length
+ * to what was read.  A send completes when all of buf has gone.  A timer
+ * calls the tick callback on every proactor tick until the socket closes.
+ */
 extern status_t proactor_net_start_accept(struct proactor_socket_t *listener_socket);
 extern status_t proactor_net_start_receive(struct proactor_socket_t *socket, proactor_buf_t *buf);
 extern status_t proactor_net_start_send(struct proactor_socket_t *socket, proactor_buf_t *buf);
@@ -12,301 +12,1084 @@
  *                                                                         *
  ***************************************************************************/
 
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_PROACTOR)
 
-#include "proactor_net.h"
+
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
 #include <errno.h>
 
-#define BUFFER_SIZE 8192
-#define MAX_EVENTS 64
-
-typedef struct {
-    char *data;
-    size_t length;
-    size_t offset;
-    void *user_data;
-} SendRequest;
-
-static int epoll_fd;
-static int server_socket = -1;
-static int client_socket = -1;
-static int wakeup_fds[2];
-static int stop = 0;
-static on_receive_cb_func_t receive_callback = NULL;
-static on_send_complete_cb_func_t send_complete_callback = NULL;
-static on_accept_cb_func_t accept_callback = NULL;
-static void *receive_callback_user_data = NULL;
-static void *send_complete_callback_user_data = NULL;
-static void *accept_callback_user_data = NULL;
-static SendRequest *current_send_request = NULL;
-
-// Helper function for error handling
-void handle_error(const char *msg) {
-    perror(msg);
-    exit(EXIT_FAILURE);
-}
+#include "debug.h"
+#include "shims.h"
+#include "status.h"
+#include "time_utils.h"
+
+#include "proactor_net.h"
+
+
+
+#define NUM_EVENTS (64)
+
+
+struct proactor_t {
+    /* implementation-specific data */
+    int epoll_fd;
+    int wakeup_fds[2];
+
+    /* implementation-independent data */
+    struct timespec tick_time_spec;
+    int vclock_id;
+    uint32_t stop;
+    status_t status;
+
+    proactor_event_cb_t event_cb;
+    void *app_data;
+
+    struct proactor_stats_t stats;
+    int64_t slow_callback_ns;
+
+    /* closed sockets stay on the list until the end of the loop iteration. */
+    struct proactor_socket_t *sockets;
+    bool have_closed_sockets;
+};
+
+
+
+struct proactor_socket_t {
+    struct proactor_socket_t *next;
+
+    SOCKET sock;
+    proactor_socket_type_t socket_type;
+    status_t status;
+    struct sockaddr remote_addr;
+
+    struct proactor_t *proactor;
+
+    /* the events currently registered with epoll. */
+    uint32_t armed_events;
+
+    bool closed;
+    bool accepting;
+    bool timer_running;
+
+    proactor_buf_t *rx_buffer;
+    proactor_buf_t *tx_buffer;
+    size_t tx_offset;
+
+    on_accept_cb_func_t accept_cb;
+    on_close_cb_func_t close_cb;
+    on_receive_cb_func_t receive_cb;
+    on_sent_cb_func_t sent_cb;
+    on_tick_cb_func_t tick_cb;
 
-// Initialize the epoll system
-int proactor_tcp_epoll_init() {
-    epoll_fd = epoll_create1(0);
-    if (epoll_fd == -1) {
-        handle_error("epoll_create1");
+    void *sock_data;
+    void *app_data;
+};
+
+
+
+static status_t set_nonblocking(SOCKET sock);
+static status_t update_events(struct proactor_socket_t *socket);
+static struct proactor_socket_t *add_socket(struct proactor_t *proactor, SOCKET sock, proactor_socket_type_t socket_type, void *sock_data, void *app_data);
+static void free_closed_sockets(struct proactor_t *proactor);
+static void process_accept_ready(struct proactor_t *proactor, struct proactor_socket_t *listener);
+static void process_read_ready(struct proactor_t *proactor, struct proactor_socket_t *sock);
+static void process_write_ready(struct proactor_t *proactor, struct proactor_socket_t *sock);
+static void process_hangup(struct proactor_t *proactor, struct proactor_socket_t *sock, status_t status);
+
+
+
+
+/* time one callback from start_ns on the real clock, and complain if it held up the loop. */
+static void record_callback(struct proactor_t *proactor, proactor_callback_t callback, struct proactor_socket_t *sock, int64_t start_ns)
+{
+    int64_t elapsed_ns = util_clock_real_ns() - start_ns;
+
+    if(elapsed_ns < 0) {
+        elapsed_ns = 0;
     }
 
-    if (pipe(wakeup_fds) == -1) {
-        handle_error("pipe");
+    histogram_record(&(proactor->stats.callback_ns[callback]), (uint64_t)elapsed_ns);
+
+    if(proactor->slow_callback_ns > 0 && elapsed_ns >= proactor->slow_callback_ns) {
+        ATOMIC_STORE_U64_RELAXED(&(proactor->stats.slow_callbacks), proactor->stats.slow_callbacks + 1);
+
+        if(sock) {
+            warn("Slow %s callback on socket %d took %lld us!", proactor_net_callback_name(callback), (int)sock->sock, (long long)(elapsed_ns / 1000));
+        } else {
+            warn("Slow %s callback on the proactor took %lld us!", proactor_net_callback_name(callback), (long long)(elapsed_ns / 1000));
+        }
     }
+}
+
+
+/* virtual time moved, look at the sockets and timers again. */
+static void vclock_wake(void *arg)
+{
+    proactor_net_wake((struct proactor_t *)arg);
+}
+
+
+struct proactor_t *proactor_net_create(proactor_event_cb_t event_cb, void *sock_data, void *app_data, uint64_t tick_period_ms)
+{
+    status_t rc = STATUS_OK;
+    struct proactor_t *proactor = NULL;
+
+    info("Starting.");
+
+    do {
+        struct timespec ts = {0};
+        struct epoll_event ev = {0};
+
+        detail("Allocating memory for new proactor.");
+
+        if(!(proactor = calloc(1, sizeof(*proactor)))) {
+            warn("Unable to allocate proactor data!");
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        proactor->epoll_fd = -1;
+        proactor->wakeup_fds[0] = INVALID_SOCKET;
+        proactor->wakeup_fds[1] = INVALID_SOCKET;
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = wakeup_fds[0];
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fds[0], &ev) == -1) {
-        handle_error("epoll_ctl");
+        /* join now so virtual time waits for this loop even before it starts running. */
+        proactor->vclock_id = util_vclock_join(vclock_wake, proactor);
+
+        ts.tv_sec = tick_period_ms / 1000;
+        ts.tv_nsec = (tick_period_ms % 1000) * 1000000;
+
+        proactor->tick_time_spec = ts;
+        proactor->stop = 0;
+        proactor->event_cb = event_cb;
+        proactor->app_data = app_data;
+
+        detail("Opening epoll file descriptor.");
+
+        if((proactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+            warn("Unable to open epoll file descriptor, error %d!", errno);
+            rc = STATUS_INTERNAL_FAILURE;
+            break;
+        }
+
+        detail("Opening wake pipe.");
+
+        if(pipe(proactor->wakeup_fds) == -1) {
+            warn("Unable to open wake pipe, error %d!", errno);
+            proactor->wakeup_fds[0] = INVALID_SOCKET;
+            proactor->wakeup_fds[1] = INVALID_SOCKET;
+            rc = STATUS_INTERNAL_FAILURE;
+            break;
+        }
+
+        /* a burst of wakes must not block the waker, and one read drains them all. */
+        if(set_nonblocking(proactor->wakeup_fds[0]) != STATUS_OK || set_nonblocking(proactor->wakeup_fds[1]) != STATUS_OK) {
+            rc = STATUS_INTERNAL_FAILURE;
+            break;
+        }
+
+        detail("Setting up event watching for the wake pipe.");
+
+        /* the wake pipe is the only registration without a socket. */
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+
+        if(epoll_ctl(proactor->epoll_fd, EPOLL_CTL_ADD, proactor->wakeup_fds[0], &ev) == -1) {
+            warn("Unable to watch the wake pipe, error %d!", errno);
+            rc = STATUS_INTERNAL_FAILURE;
+            break;
+        }
+    } while(0);
+
+    if(proactor) {
+        proactor->status = rc;
     }
 
-    return 0;
+    return proactor;
 }
 
-// Cleanup the epoll system
-void proactor_tcp_epoll_cleanup() {
-    if (server_socket != -1) {
-        close(server_socket);
+
+/*
+ * Clean up all resources.  Sockets that are still open get their close
+ * callback first so that the application can release its state.
+ */
+void proactor_net_dispose(struct proactor_t *proactor)
+{
+    info("Starting.");
+
+    if(!proactor) {
+        warn("Called with a NULL proactor pointer!");
+        return;
     }
-    if (client_socket != -1) {
-        close(client_socket);
+
+    proactor_net_stop(proactor);
+
+    /* a loop that never ran still holds virtual time back. */
+    util_vclock_leave(proactor->vclock_id);
+    proactor->vclock_id = -1;
+
+    /* call the dispose callback to let the app know that we are closing down. */
+    if(proactor->event_cb) {
+        proactor->event_cb(proactor, PROACTOR_EVENT_DISPOSE, proactor->status, proactor->app_data);
     }
-    if (wakeup_fds[0] != -1) {
-        close(wakeup_fds[0]);
-        close(wakeup_fds[1]);
+
+    /* the close callbacks may close other sockets, which only marks them. */
+    for(struct proactor_socket_t *cur = proactor->sockets; cur; cur = cur->next) {
+        if(!cur->closed && cur->close_cb) {
+            cur->close_cb(cur, STATUS_TERMINATE, cur->sock_data, cur->app_data);
+        }
+
+        if(!cur->closed) {
+            proactor_net_socket_close(cur);
+        }
+    }
+
+    free_closed_sockets(proactor);
+
+    if(proactor->wakeup_fds[0] != INVALID_SOCKET) {
+        close(proactor->wakeup_fds[0]);
+        close(proactor->wakeup_fds[1]);
     }
-    close(epoll_fd);
 
-    // Free any remaining send request
-    if (current_send_request) {
-        free(current_send_request->data);
-        free(current_send_request);
+    if(proactor->epoll_fd != -1) {
+        close(proactor->epoll_fd);
     }
+
+    free(proactor);
+
+    info("Done.");
 }
 
-// Start listening server
-int proactor_tcp_epoll_start_server(uint16_t port) {
-    struct sockaddr_in server_addr;
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        handle_error("socket");
+
+
+status_t proactor_net_get_status(struct proactor_t *proactor)
+{
+    status_t rc = STATUS_OK;
+
+    if(proactor) {
+        rc = proactor->status;
+    } else {
+        rc = STATUS_NULL_PTR;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = INADDR_ANY;
+    return rc;
+}
+
+
+
+
+
+
 
-    if (bind(server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        handle_error("bind");
+void proactor_net_run(struct proactor_t *proactor)
+{
+    if(!proactor) {
+        warn("Called with a NULL proactor pointer!");
+        return;
     }
 
-    if (listen(server_socket, SOMAXCONN) == -1) {
-        handle_error("listen");
+    if(proactor->status != STATUS_OK) {
+        warn("Proactor failed setup with status %s, not running!", status_to_str(proactor->status));
+        return;
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN;
-    ev.data.fd = server_socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &ev) == -1) {
-        handle_error("epoll_ctl");
+    struct epoll_event events[NUM_EVENTS];
+
+    /*
+     * Under virtual time the tick is a deadline on the virtual clock rather
+     * than the epoll_wait() timeout.  The loop only waits in epoll_wait()
+     * while its idle report is current, and then only until it is woken.
+     */
+    int vclock_id = proactor->vclock_id;
+    int64_t tick_ns = ((int64_t)proactor->tick_time_spec.tv_sec * 1000000000LL) + proactor->tick_time_spec.tv_nsec;
+    int64_t next_tick_ns = util_clock_update() + tick_ns;
+    bool vclock_idle = false;
+
+    while(!ATOMIC_LOAD_U32(&(proactor->stop))) {
+        int timeout_ms = -1;
+        int64_t vclock_activity = util_vclock_activity();
+        int64_t wait_start_ns = util_clock_real_ns();
+        int64_t callback_start_ns = 0;
+        int num_socket_events = 0;
+        bool woken = false;
+        bool tick_due = false;
+
+        if(vclock_id >= 0) {
+            timeout_ms = (vclock_idle ? VCLOCK_POLL_MS : 0);
+        } else if(tick_ns > 0) {
+            /* only wait out what is left of the tick, rounded up so we do not spin on the last millisecond. */
+            int64_t remaining_ns = next_tick_ns - util_clock_ns();
+
+            if(remaining_ns < 0) {
+                remaining_ns = 0;
+            }
+
+            timeout_ms = (int)((remaining_ns + 999999LL) / 1000000LL);
+        }
+
+        /* Get the events */
+        int num_triggered_events = epoll_wait(proactor->epoll_fd, events, NUM_EVENTS, timeout_ms);
+
+        /* one clock read per iteration, every callback below sees the same "now". */
+        util_clock_update();
+
+        ATOMIC_STORE_U64_RELAXED(&(proactor->stats.iterations), proactor->stats.iterations + 1);
+        histogram_record(&(proactor->stats.wait_ns), (uint64_t)(util_clock_real_ns() - wait_start_ns));
+
+        if(num_triggered_events == -1) {
+            if(errno != EINTR) {
+                warn("Error %d waiting for events, stopping!", errno);
+                proactor->status = STATUS_INTERNAL_FAILURE;
+                break;
+            }
+
+            num_triggered_events = 0;
+        }
+
+        for(int i = 0; i < num_triggered_events; i++) {
+            struct proactor_socket_t *socket = (struct proactor_socket_t *)(events[i].data.ptr);
+            uint32_t triggered = events[i].events;
+
+            if(!socket) {
+                char buf[64];
+
+                detail("Proactor woken up.");
+
+                /* drain the pipe so that we do not trigger again. */
+                while(read(proactor->wakeup_fds[0], buf, sizeof(buf)) > 0) { }
+
+                woken = true;
+                continue;
+            }
+
+            /* an earlier callback in this batch may have closed it. */
+            if(socket->closed) {
+                continue;
+            }
+
+            num_socket_events++;
+
+            if(socket->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
+                if(triggered & EPOLLIN) {
+                    process_accept_ready(proactor, socket);
+                }
+
+                continue;
+            }
+
+            if((triggered & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && socket->tx_buffer) {
+                process_write_ready(proactor, socket);
+            }
+
+            if(!socket->closed && (triggered & (EPOLLIN | EPOLLERR | EPOLLHUP)) && socket->rx_buffer) {
+                process_read_ready(proactor, socket);
+            }
+
+            /* nothing is waiting for the error, and epoll will keep reporting it. */
+            if(!socket->closed && (triggered & (EPOLLERR | EPOLLHUP)) && !socket->rx_buffer && !socket->tx_buffer) {
+                process_hangup(proactor, socket, STATUS_EXTERNAL_FAILURE);
+            }
+        }
+
+        /* the timer fired if its deadline passed, note how late that was. */
+        if(tick_ns > 0 && util_clock_now_ns() >= next_tick_ns) {
+            histogram_record(&(proactor->stats.timer_lag_ns), (uint64_t)(util_clock_now_ns() - next_tick_ns));
+            next_tick_ns = util_clock_now_ns() + tick_ns;
+
+            tick_due = true;
+        }
+
+        /* a wake is for the application, it does not keep virtual time from moving. */
+        if(tick_due || num_socket_events > 0 || woken) {
+            /* call the tick CB on the proactor instance. */
+            if(proactor->event_cb) {
+                callback_start_ns = util_clock_real_ns();
+                proactor->event_cb(proactor, PROACTOR_EVENT_TICK, STATUS_OK, proactor->app_data);
+                record_callback(proactor, PROACTOR_CALLBACK_TICK, NULL, callback_start_ns);
+            }
+        }
+
+        if(tick_due) {
+            /* call the tick CB on all the sockets with a running timer. */
+            for(struct proactor_socket_t *sock = proactor->sockets; sock; sock = sock->next) {
+                if(!sock->closed && sock->timer_running && sock->tick_cb) {
+                    callback_start_ns = util_clock_real_ns();
+                    sock->tick_cb(sock, STATUS_OK, sock->sock_data, sock->app_data);
+                    record_callback(proactor, PROACTOR_CALLBACK_TICK, sock, callback_start_ns);
+                }
+            }
+        }
+
+        /* nothing can refer to a closed socket after the callbacks above. */
+        if(proactor->have_closed_sockets) {
+            free_closed_sockets(proactor);
+        }
+
+        /* anything sent above is already with the kernel, so peers will see it when they look again. */
+        if(vclock_id >= 0) {
+            if(tick_due || num_socket_events > 0) {
+                util_vclock_busy();
+                vclock_idle = false;
+            } else {
+                vclock_idle = util_vclock_idle(vclock_id, vclock_activity, (tick_ns > 0 ? next_tick_ns : INT64_MAX));
+            }
+        }
     }
 
-    return 0;
+    util_vclock_leave(vclock_id);
+    proactor->vclock_id = -1;
 }
 
-// Connect to the server
-int proactor_tcp_epoll_connect(const char *address, uint16_t port) {
-    struct sockaddr_in server_addr;
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket == -1) {
-        handle_error("socket");
+
+
+
+status_t proactor_net_get_stats(struct proactor_t *proactor, struct proactor_stats_t *stats)
+{
+    if(!proactor || !stats) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
     }
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, address, &server_addr.sin_addr);
+    /* the loop may be recording while this copies. */
+    stats->iterations = ATOMIC_LOAD_U64_RELAXED(&(proactor->stats.iterations));
+    stats->slow_callbacks = ATOMIC_LOAD_U64_RELAXED(&(proactor->stats.slow_callbacks));
+
+    histogram_snapshot(&(stats->wait_ns), &(proactor->stats.wait_ns));
+    histogram_snapshot(&(stats->timer_lag_ns), &(proactor->stats.timer_lag_ns));
 
-    if (connect(client_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-        handle_error("connect");
+    for(int i = 0; i < PROACTOR_NUM_CALLBACKS; i++) {
+        histogram_snapshot(&(stats->callback_ns[i]), &(proactor->stats.callback_ns[i]));
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT;
-    ev.data.fd = client_socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
-        handle_error("epoll_ctl");
+    return STATUS_OK;
+}
+
+
+
+const char *proactor_net_callback_name(proactor_callback_t callback)
+{
+    switch(callback) {
+        case PROACTOR_CALLBACK_ACCEPT: return "accept"; break;
+        case PROACTOR_CALLBACK_RECEIVE: return "receive"; break;
+        case PROACTOR_CALLBACK_SENT: return "sent"; break;
+        case PROACTOR_CALLBACK_TICK: return "tick"; break;
+        default: return "unknown"; break;
     }
+}
+
 
-    return 0;
+
+status_t proactor_net_set_slow_callback_ns(struct proactor_t *proactor, int64_t threshold_ns)
+{
+    if(!proactor) {
+        warn("Called with a NULL proactor pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(threshold_ns < 0) {
+        warn("The slow callback threshold cannot be negative!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    proactor->slow_callback_ns = threshold_ns;
+
+    return STATUS_OK;
 }
 
-// Handle data from the server
-static void handle_data_event(int fd) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-    if (bytes_read <= 0) {
-        if (bytes_read < 0) {
-            perror("read");
-        }
-        close(fd);
-
-        // Remove the client socket from the epoll monitoring
-        struct epoll_event ev;
-        ev.events = EPOLLIN | EPOLLOUT;
-        ev.data.fd = fd;
-        if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev) == -1) {
-            handle_error("epoll_ctl");
-        }
-        return;
+
+
+
+/* safe from any thread. */
+void proactor_net_stop(struct proactor_t *proactor)
+{
+    if(proactor) {
+        ATOMIC_STORE_U32(&(proactor->stop), 1);
+        proactor_net_wake(proactor);
     }
+}
+
 
-    if (receive_callback) {
-        receive_callback(fd, buffer, bytes_read, receive_callback_user_data);
+
+/* safe from any thread. */
+void proactor_net_wake(struct proactor_t *proactor)
+{
+    if(proactor && proactor->wakeup_fds[1] != INVALID_SOCKET) {
+        char buf = 1;
+
+        /* a full pipe already has a wake pending. */
+        if(write(proactor->wakeup_fds[1], &buf, 1) == -1 && errno != EAGAIN) {
+            warn("Unable to write to wake pipe, error %d!", errno);
+        }
     }
 }
 
-// Handle write readiness
-static void handle_write_event(int fd) {
-    if (current_send_request) {
-        ssize_t bytes_sent = write(fd, current_send_request->data + current_send_request->offset,
-                                   current_send_request->length - current_send_request->offset);
-        if (bytes_sent < 0) {
-            perror("write");
-            return;
+
+
+
+
+
+/*
+ * Sockets.  All of these must be called on the thread running the proactor,
+ * or before it starts running.
+ */
+
+status_t proactor_net_socket_open(struct proactor_t *proactor, struct proactor_socket_t **socket_ptr, proactor_socket_type_t socket_type, const char *address, uint16_t port, void *sock_data, void *app_data)
+{
+    status_t rc = STATUS_OK;
+    SOCKET sock = INVALID_SOCKET;
+    struct sockaddr_in addr;
+
+    info("Starting.");
+
+    do {
+        int one = 1;
+
+        if(!proactor || !socket_ptr) {
+            warn("Called with NULL pointer(s)!");
+            rc = STATUS_NULL_PTR;
+            break;
         }
 
-        current_send_request->offset += bytes_sent;
-        if (current_send_request->offset >= current_send_request->length) {
-            // Send completed
-            if (send_complete_callback) {
-                send_complete_callback(fd, send_complete_callback_user_data);
+        *socket_ptr = NULL;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+
+        if(!address || address[0] == 0) {
+            /* nothing was passed for the address, so listen on them all. */
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        } else if(inet_pton(AF_INET, address, &(addr.sin_addr)) != 1) {
+            warn("Unable to parse IPv4 address \"%s\"!", address);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        sock = socket(AF_INET, (socket_type == PROACTOR_SOCK_UDP ? SOCK_DGRAM : SOCK_STREAM) | SOCK_CLOEXEC, 0);
+        if(sock == INVALID_SOCKET) {
+            warn("Unable to open socket, error %d!", errno);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        if(socket_type == PROACTOR_SOCK_TCP_LISTENER || socket_type == PROACTOR_SOCK_UDP) {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                warn("Unable to bind to %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
             }
 
-            free(current_send_request->data);
-            free(current_send_request);
-            current_send_request = NULL;
+            if(socket_type == PROACTOR_SOCK_TCP_LISTENER && listen(sock, SOMAXCONN) == -1) {
+                warn("Unable to listen on %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
+            }
+        } else if(socket_type == PROACTOR_SOCK_TCP_CLIENT) {
+            /* the connect blocks, the socket only goes non-blocking once it is up. */
+            if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                warn("Unable to connect to %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
+            }
+
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        } else {
+            warn("Unsupported socket type %d!", (int)socket_type);
+            rc = STATUS_NOT_SUPPORTED;
+            break;
+        }
+
+        if((rc = set_nonblocking(sock)) != STATUS_OK) {
+            break;
+        }
+
+        if(!(*socket_ptr = add_socket(proactor, sock, socket_type, sock_data, app_data))) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(socket_type == PROACTOR_SOCK_TCP_CLIENT) {
+            memcpy(&((*socket_ptr)->remote_addr), &addr, sizeof(addr));
         }
+    } while(0);
+
+    if(rc != STATUS_OK && sock != INVALID_SOCKET) {
+        close(sock);
     }
+
+    info("Done with status %s.", status_to_str(rc));
+
+    return rc;
 }
 
-// Handle accept event
-static void handle_accept_event(int fd) {
-    int client_socket = accept(fd, NULL, NULL);
-    if (client_socket == -1) {
-        perror("accept");
-        return;
+
+
+/*
+ * Closing does not call the close callback, that is only for closes the
+ * application did not ask for.  The handle must not be used afterward, but
+ * the memory lives until the current loop iteration ends.
+ */
+status_t proactor_net_socket_close(struct proactor_socket_t *socket)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
     }
 
-    if (accept_callback) {
-        accept_callback(fd, client_socket, accept_callback_user_data);
+    if(socket->closed) {
+        return STATUS_OK;
     }
 
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLOUT;
-    ev.data.fd = client_socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
-        handle_error("epoll_ctl");
+    detail("Closing socket %d.", (int)socket->sock);
+
+    socket->closed = true;
+    socket->rx_buffer = NULL;
+    socket->tx_buffer = NULL;
+    socket->proactor->have_closed_sockets = true;
+
+    /* closing the descriptor also removes it from the epoll set. */
+    close(socket->sock);
+    socket->sock = INVALID_SOCKET;
+
+    return STATUS_OK;
+}
+
+
+
+status_t proactor_net_socket_set_data(struct proactor_socket_t *socket, void *sock_data)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
     }
+
+    socket->sock_data = sock_data;
+
+    return STATUS_OK;
 }
 
-// Wake up the proactor run loop
-void proactor_tcp_epoll_wake() {
-    char buf = 1;
-    if (write(wakeup_fds[1], &buf, 1) == -1) {
-        handle_error("write");
+
+
+status_t proactor_net_socket_set_accept_callback(struct proactor_socket_t *listener_socket, on_accept_cb_func_t accept_cb)
+{
+    if(!listener_socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
     }
+
+    if(listener_socket->socket_type != PROACTOR_SOCK_TCP_LISTENER) {
+        warn("Only listener sockets accept connections!");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    listener_socket->accept_cb = accept_cb;
+
+    return STATUS_OK;
 }
 
-// Run the epoll event loop
-void proactor_tcp_epoll_run() {
-    struct epoll_event events[MAX_EVENTS];
 
-    while (!stop) {
-        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
-        if (n == -1) {
-            if (errno == EINTR) {
-                // Interrupted by signal, continue
-                continue;
-            }
-            handle_error("epoll_wait");
-        }
 
-        for (int i = 0; i < n; i++) {
-            if (events[i].data.fd == wakeup_fds[0]) {
-                // Handle wake-up event
-                char buf;
-                read(wakeup_fds[0], &buf, 1);
-            } else if (events[i].data.fd == server_socket) {
-                // Handle accept event
-                handle_accept_event(events[i].data.fd);
-            } else if (events[i].events & EPOLLIN) {
-                // Handle data event
-                handle_data_event(events[i].data.fd);
-            } else if (events[i].events & EPOLLOUT) {
-                // Handle write event
-                handle_write_event(events[i].data.fd);
-            }
-        }
+status_t proactor_net_socket_set_close_callback(struct proactor_socket_t *socket, on_close_cb_func_t close_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
     }
+
+    socket->close_cb = close_cb;
+
+    return STATUS_OK;
 }
 
-// Stop the epoll event loop
-void proactor_tcp_epoll_stop() {
-    stop = 1;
-    proactor_tcp_epoll_wake(); // Ensure the loop is woken up
+
+
+status_t proactor_net_socket_set_receive_callback(struct proactor_socket_t *socket, on_receive_cb_func_t receive_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->receive_cb = receive_cb;
+
+    return STATUS_OK;
 }
 
-// Set callbacks
-void proactor_tcp_epoll_set_receive_callback(on_receive_cb_func_t callback, void *user_data) {
-    receive_callback = callback;
-    receive_callback_user_data = user_data;
+
+
+status_t proactor_net_socket_set_sent_callback(struct proactor_socket_t *socket, on_sent_cb_func_t sent_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->sent_cb = sent_cb;
+
+    return STATUS_OK;
 }
 
-void proactor_tcp_epoll_set_send_complete_callback(on_send_complete_cb_func_t callback, void *user_data) {
-    send_complete_callback = callback;
-    send_complete_callback_user_data = user_data;
+
+
+status_t proactor_net_socket_set_tick_callback(struct proactor_socket_t *socket, on_tick_cb_func_t tick_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->tick_cb = tick_cb;
+
+    return STATUS_OK;
 }
 
-void proactor_tcp_epoll_set_accept_callback(on_accept_cb_func_t callback, void *user_data) {
-    accept_callback = callback;
-    accept_callback_user_data = user_data;
+
+
+status_t proactor_net_start_accept(struct proactor_socket_t *listener_socket)
+{
+    if(!listener_socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(listener_socket->closed || listener_socket->socket_type != PROACTOR_SOCK_TCP_LISTENER || !listener_socket->accept_cb) {
+        warn("Socket is not an open listener with an accept callback!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    listener_socket->accepting = true;
+
+    return update_events(listener_socket);
 }
 
-// Send data
-int proactor_tcp_epoll_send(int socket, const char *data, size_t length) {
-    if (current_send_request) {
-        // There is already a send request in progress
-        return -1;
+
+
+/* one read of up to buf->data_length bytes.  The callback gets buf back with the length read. */
+status_t proactor_net_start_receive(struct proactor_socket_t *socket, proactor_buf_t *buf)
+{
+    if(!socket || !buf) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
     }
 
-    current_send_request = (SendRequest*)malloc(sizeof(SendRequest));
-    if (!current_send_request) {
-        handle_error("malloc");
+    if(socket->closed || socket->socket_type == PROACTOR_SOCK_TCP_LISTENER || !socket->receive_cb) {
+        warn("Socket is not an open connection with a receive callback!");
+        return STATUS_NOT_ALLOWED;
     }
 
-    current_send_request->data = (char*)malloc(length);
-    if (!current_send_request->data) {
-        handle_error("malloc");
+    if(socket->rx_buffer) {
+        warn("Socket %d already has a receive pending!", (int)socket->sock);
+        return STATUS_BUSY;
     }
-    memcpy(current_send_request->data, data, length);
-    current_send_request->length = length;
-    current_send_request->offset = 0;
 
-    struct epoll_event ev;
-    ev.events = EPOLLOUT;
-    ev.data.fd = socket;
-    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &ev) == -1) {
-        handle_error("epoll_ctl");
+    socket->rx_buffer = buf;
+
+    return update_events(socket);
+}
+
+
+
+/* the whole buffer goes out before the sent callback is called. */
+status_t proactor_net_start_send(struct proactor_socket_t *socket, proactor_buf_t *buf)
+{
+    if(!socket || !buf) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
     }
 
-    return 0;
+    if(socket->closed || socket->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
+        warn("Socket is not an open connection!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(socket->tx_buffer) {
+        warn("Socket %d already has a send pending!", (int)socket->sock);
+        return STATUS_BUSY;
+    }
+
+    socket->tx_buffer = buf;
+    socket->tx_offset = 0;
+
+    return update_events(socket);
+}
+
+
+
+/* call the socket's tick callback on every proactor tick until the socket closes. */
+status_t proactor_net_start_timer(struct proactor_socket_t *socket)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(socket->closed || !socket->tick_cb) {
+        warn("Socket is not open or has no tick callback!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    socket->timer_running = true;
+
+    return STATUS_OK;
+}
+
+
+
+
+
+
+
+/*
+ * Helpers
+ */
+
+
+static status_t set_nonblocking(SOCKET sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        warn("Unable to make file descriptor %d non-blocking, error %d!", (int)sock, errno);
+        return STATUS_INTERNAL_FAILURE;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* level triggered, so only ask for what has a request pending. */
+static status_t update_events(struct proactor_socket_t *socket)
+{
+    struct epoll_event ev = {0};
+
+    ev.events = ((socket->accepting || socket->rx_buffer) ? EPOLLIN : 0) | (socket->tx_buffer ? EPOLLOUT : 0);
+    ev.data.ptr = socket;
+
+    if(ev.events == socket->armed_events) {
+        return STATUS_OK;
+    }
+
+    if(epoll_ctl(socket->proactor->epoll_fd, EPOLL_CTL_MOD, socket->sock, &ev) == -1) {
+        warn("Unable to update events for socket %d, error %d!", (int)socket->sock, errno);
+        return STATUS_INTERNAL_FAILURE;
+    }
+
+    socket->armed_events = ev.events;
+
+    return STATUS_OK;
+}
+
+
+static struct proactor_socket_t *add_socket(struct proactor_t *proactor, SOCKET sock, proactor_socket_type_t socket_type, void *sock_data, void *app_data)
+{
+    struct proactor_socket_t *socket = NULL;
+    struct epoll_event ev = {0};
+
+    if(!(socket = calloc(1, sizeof(*socket)))) {
+        warn("Unable to allocate new socket struct instance!");
+        return NULL;
+    }
+
+    socket->sock = sock;
+    socket->socket_type = socket_type;
+    socket->status = STATUS_OK;
+    socket->proactor = proactor;
+    socket->sock_data = sock_data;
+    socket->app_data = app_data;
+
+    /* registered with no events, hangups and errors still come through. */
+    ev.events = 0;
+    ev.data.ptr = socket;
+
+    if(epoll_ctl(proactor->epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+        warn("Unable to add socket %d to the epoll set, error %d!", (int)sock, errno);
+        free(socket);
+        return NULL;
+    }
+
+    socket->next = proactor->sockets;
+    proactor->sockets = socket;
+
+    return socket;
+}
+
+
+static void free_closed_sockets(struct proactor_t *proactor)
+{
+    struct proactor_socket_t **walker = &(proactor->sockets);
+
+    while(*walker) {
+        struct proactor_socket_t *socket = *walker;
+
+        if(socket->closed) {
+            *walker = socket->next;
+            free(socket);
+        } else {
+            walker = &(socket->next);
+        }
+    }
+
+    proactor->have_closed_sockets = false;
+}
+
+
+/* take every waiting connection.  The accept callback owns the new socket. */
+static void process_accept_ready(struct proactor_t *proactor, struct proactor_socket_t *listener)
+{
+    while(!listener->closed) {
+        struct sockaddr client_addr = {0};
+        socklen_t addr_len = sizeof(client_addr);
+        struct proactor_socket_t *client = NULL;
+        status_t rc = STATUS_OK;
+        int64_t callback_start_ns = 0;
+        int one = 1;
+        SOCKET sock = accept4(listener->sock, &client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+        if(sock == INVALID_SOCKET) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                break;
+            }
+
+            warn("Error %d calling accept() on listening socket!", errno);
+            rc = STATUS_EXTERNAL_FAILURE;
+        } else {
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            /* accepted sockets start out with the listener's data. */
+            if((client = add_socket(proactor, sock, PROACTOR_SOCK_TCP_CLIENT, listener->sock_data, listener->app_data))) {
+                client->remote_addr = client_addr;
+            } else {
+                close(sock);
+                rc = STATUS_NO_RESOURCE;
+            }
+        }
+
+        callback_start_ns = util_clock_real_ns();
+        listener->accept_cb(listener, client, rc, listener->sock_data, listener->app_data);
+        record_callback(proactor, PROACTOR_CALLBACK_ACCEPT, listener, callback_start_ns);
+
+        /* do not spin on a persistent failure such as running out of descriptors. */
+        if(rc != STATUS_OK) {
+            break;
+        }
+    }
+}
+
+
+
+static void process_read_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+{
+    proactor_buf_t *buffer = sock->rx_buffer;
+    socklen_t addr_len = sizeof(sock->remote_addr);
+    int64_t callback_start_ns = 0;
+    ssize_t read_rc = 0;
+
+    if(sock->socket_type == PROACTOR_SOCK_UDP) {
+        read_rc = recvfrom(sock->sock, buffer->data, buffer->data_length, 0, &(sock->remote_addr), &addr_len);
+    } else {
+        read_rc = recv(sock->sock, buffer->data, buffer->data_length, 0);
+    }
+
+    if(read_rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    if(read_rc <= 0) {
+        /* zero is the peer closing, anything else is an error. */
+        process_hangup(proactor, sock, (read_rc == 0 ? STATUS_TERMINATE : STATUS_EXTERNAL_FAILURE));
+        return;
+    }
+
+    /* the callback usually starts the next receive, so clear this one first. */
+    sock->rx_buffer = NULL;
+    buffer->data_length = (size_t)read_rc;
+
+    callback_start_ns = util_clock_real_ns();
+    sock->receive_cb(sock, &(sock->remote_addr), buffer, STATUS_OK, sock->sock_data, sock->app_data);
+    record_callback(proactor, PROACTOR_CALLBACK_RECEIVE, sock, callback_start_ns);
+
+    if(!sock->closed) {
+        update_events(sock);
+    }
+}
+
+
+
+static void process_write_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+{
+    proactor_buf_t *buffer = sock->tx_buffer;
+    status_t rc = STATUS_OK;
+    int64_t callback_start_ns = 0;
+
+    while(sock->tx_offset < buffer->data_length) {
+        ssize_t write_rc = 0;
+
+        if(sock->socket_type == PROACTOR_SOCK_UDP) {
+            write_rc = sendto(sock->sock, (uint8_t *)buffer->data + sock->tx_offset, buffer->data_length - sock->tx_offset, MSG_NOSIGNAL, &(sock->remote_addr), sizeof(sock->remote_addr));
+        } else {
+            write_rc = send(sock->sock, (uint8_t *)buffer->data + sock->tx_offset, buffer->data_length - sock->tx_offset, MSG_NOSIGNAL);
+        }
+
+        if(write_rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* try again when there is room. */
+                return;
+            }
+
+            if(errno == EINTR) {
+                continue;
+            }
+
+            detail("Error %d sending on socket %d.", errno, (int)sock->sock);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        sock->tx_offset += (size_t)write_rc;
+    }
+
+    sock->tx_buffer = NULL;
+    sock->tx_offset = 0;
+
+    if(sock->sent_cb) {
+        callback_start_ns = util_clock_real_ns();
+        sock->sent_cb(sock, buffer, rc, sock->sock_data, sock->app_data);
+        record_callback(proactor, PROACTOR_CALLBACK_SENT, sock, callback_start_ns);
+    }
+
+    if(!sock->closed) {
+        update_events(sock);
+    }
+}
+
+
+
+/* the peer went away.  Let the application clean up, or clean up ourselves if it cannot. */
+static void process_hangup(struct proactor_t *proactor, struct proactor_socket_t *sock, status_t status)
+{
+    detail("Socket %d closed with status %s.", (int)sock->sock, status_to_str(status));
+
+    sock->rx_buffer = NULL;
+    sock->tx_buffer = NULL;
+    sock->status = status;
+
+    if(sock->close_cb) {
+        sock->close_cb(sock, status, sock->sock_data, sock->app_data);
+    }
+
+    if(!sock->closed) {
+        proactor_net_socket_close(sock);
+    }
 }
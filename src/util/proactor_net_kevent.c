@@ -12,6 +12,8 @@
  *                                                                         *
  ***************************************************************************/
 
+#define DEBUG_SUBSYS (DEBUG_SUBSYS_PROACTOR)
+
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -19,13 +21,18 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/event.h>
 #include <errno.h>
 
 #include "debug.h"
+#include "shims.h"
 #include "status.h"
+#include "time_utils.h"
 
 #include "proactor_net.h"
 
@@ -34,19 +41,11 @@
 #define NUM_EVENTS (32)
 
 
-typedef enum {
-    REQUEST_TYPE_ACCEPT,
-    REQUEST_TYPE_READ,
-    REQUEST_TYPE_WRITE,
-    REQUEST_TYPE_TIMER,
-} proactor_request_type_t;
-
+/* BSD has no MSG_NOSIGNAL, SO_NOSIGPIPE is set on each socket instead. */
+#ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL (0)
+#endif
 
-typedef enum {
-    SOCKET_TYPE_TCP_ACCEPT,
-    SOCKET_TYPE_TCP_CLIENT,
-    SOCKET_TYPE_UDP,
-} proactor_socket_type_t;
 
 struct proactor_t {
     /* implementation-specific data */
@@ -55,13 +54,19 @@ struct proactor_t {
 
     /* implementation-independent data */
     struct timespec tick_time_spec;
-    bool stop;
+    int vclock_id;
+    uint32_t stop;
     status_t status;
 
     proactor_event_cb_t event_cb;
     void *app_data;
 
+    struct proactor_stats_t stats;
+    int64_t slow_callback_ns;
+
+    /* closed sockets stay on the list until the end of the loop iteration. */
     struct proactor_socket_t *sockets;
+    bool have_closed_sockets;
 };
 
 
@@ -76,7 +81,17 @@ struct proactor_socket_t {
 
     struct proactor_t *proactor;
 
-    proactor_buf_t *buffer;
+    /* the filters currently enabled in the kernel queue. */
+    bool read_enabled;
+    bool write_enabled;
+
+    bool closed;
+    bool accepting;
+    bool timer_running;
+
+    proactor_buf_t *rx_buffer;
+    proactor_buf_t *tx_buffer;
+    size_t tx_offset;
 
     on_accept_cb_func_t accept_cb;
     on_close_cb_func_t close_cb;
@@ -85,12 +100,54 @@ struct proactor_socket_t {
     on_tick_cb_func_t tick_cb;
 
     void *sock_data;
+    void *app_data;
 };
 
 
 
+static status_t set_nonblocking(SOCKET sock);
+static status_t update_events(struct proactor_socket_t *socket);
+static struct proactor_socket_t *add_socket(struct proactor_t *proactor, SOCKET sock, proactor_socket_type_t socket_type, void *sock_data, void *app_data);
+static void free_closed_sockets(struct proactor_t *proactor);
+static void process_accept_ready(struct proactor_t *proactor, struct proactor_socket_t *listener);
+static void process_read_ready(struct proactor_t *proactor, struct proactor_socket_t *sock);
+static void process_write_ready(struct proactor_t *proactor, struct proactor_socket_t *sock);
+static void process_hangup(struct proactor_t *proactor, struct proactor_socket_t *sock, status_t status);
+
+
+
+
+
 
 
+/* time one callback from start_ns on the real clock, and complain if it held up the loop. */
+static void record_callback(struct proactor_t *proactor, proactor_callback_t callback, struct proactor_socket_t *sock, int64_t start_ns)
+{
+    int64_t elapsed_ns = util_clock_real_ns() - start_ns;
+
+    if(elapsed_ns < 0) {
+        elapsed_ns = 0;
+    }
+
+    histogram_record(&(proactor->stats.callback_ns[callback]), (uint64_t)elapsed_ns);
+
+    if(proactor->slow_callback_ns > 0 && elapsed_ns >= proactor->slow_callback_ns) {
+        ATOMIC_STORE_U64_RELAXED(&(proactor->stats.slow_callbacks), proactor->stats.slow_callbacks + 1);
+
+        if(sock) {
+            warn("Slow %s callback on socket %d took %lld us!", proactor_net_callback_name(callback), (int)sock->sock, (long long)(elapsed_ns / 1000));
+        } else {
+            warn("Slow %s callback on the proactor took %lld us!", proactor_net_callback_name(callback), (long long)(elapsed_ns / 1000));
+        }
+    }
+}
+
+
+/* virtual time moved, look at the sockets and timers again. */
+static void vclock_wake(void *arg)
+{
+    proactor_net_wake((struct proactor_t *)arg);
+}
 
 
 struct proactor_t *proactor_net_create(proactor_event_cb_t event_cb, void *sock_data, void *app_data, uint64_t tick_period_ms)
@@ -116,11 +173,14 @@ struct proactor_t *proactor_net_create(proactor_event_cb_t event_cb, void *sock_
         proactor->wakeup_fds[0] = INVALID_SOCKET;
         proactor->wakeup_fds[1] = INVALID_SOCKET;
 
+        /* join now so virtual time waits for this loop even before it starts running. */
+        proactor->vclock_id = util_vclock_join(vclock_wake, proactor);
+
         ts.tv_sec = tick_period_ms / 1000;
         ts.tv_nsec = (tick_period_ms % 1000) * 1000000;
 
         proactor->tick_time_spec = ts;
-        proactor->stop = false;
+        proactor->stop = 0;
         proactor->event_cb = event_cb;
         proactor->app_data = app_data;
 
@@ -142,6 +202,12 @@ struct proactor_t *proactor_net_create(proactor_event_cb_t event_cb, void *sock_
             break;
         }
 
+        /* a burst of wakes must not block the waker, and one read drains them all. */
+        if(set_nonblocking(proactor->wakeup_fds[0]) != STATUS_OK || set_nonblocking(proactor->wakeup_fds[1]) != STATUS_OK) {
+            rc = STATUS_INTERNAL_FAILURE;
+            break;
+        }
+
         detail("Setting up event watching for the wake pipe.");
 
         EV_SET(&ev, proactor->wakeup_fds[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
@@ -161,7 +227,10 @@ struct proactor_t *proactor_net_create(proactor_event_cb_t event_cb, void *sock_
 }
 
 
-/* Clean up all resources.  */
+/*
+ * Clean up all resources.  Sockets that are still open get their close
+ * callback first so that the application can release its state.
+ */
 void proactor_net_dispose(struct proactor_t *proactor)
 {
     info("Starting.");
@@ -173,27 +242,28 @@ void proactor_net_dispose(struct proactor_t *proactor)
 
     proactor_net_stop(proactor);
 
+    /* a loop that never ran still holds virtual time back. */
+    util_vclock_leave(proactor->vclock_id);
+    proactor->vclock_id = -1;
+
     /* call the dispose callback to let the app know that we are closing down. */
     if(proactor->event_cb) {
         proactor->event_cb(proactor, PROACTOR_EVENT_DISPOSE, proactor->status, proactor->app_data);
     }
 
-    /* clean up all the sockets */
-    for(struct proactor_socket_t *cur = proactor->sockets; cur; ) {
-        struct proactor_socket_t *next = cur->next;
-
-        if(cur->close_cb) {
-            cur->close_cb(socket_to_handle(cur->sock), cur->status, cur->sock_data);
+    /* the close callbacks may close other sockets, which only marks them. */
+    for(struct proactor_socket_t *cur = proactor->sockets; cur; cur = cur->next) {
+        if(!cur->closed && cur->close_cb) {
+            cur->close_cb(cur, STATUS_TERMINATE, cur->sock_data, cur->app_data);
         }
 
-        /* close the socket */
-        close(cur->sock);
-
-        free(cur);
-
-        cur = next;
+        if(!cur->closed) {
+            proactor_net_socket_close(cur);
+        }
     }
 
+    free_closed_sockets(proactor);
+
     if (proactor->wakeup_fds[0] != INVALID_SOCKET) {
         close(proactor->wakeup_fds[0]);
         close(proactor->wakeup_fds[1]);
@@ -201,6 +271,8 @@ void proactor_net_dispose(struct proactor_t *proactor)
 
     close(proactor->kq);
 
+    free(proactor);
+
     info("Done.");
 }
 
@@ -234,88 +306,229 @@ void proactor_net_run(struct proactor_t *proactor)
 
     struct kevent events[NUM_EVENTS];
 
-    while (!proactor->stop) {
+    /*
+     * Under virtual time the tick is a deadline on the virtual clock rather
+     * than the kevent() timeout.  The loop only waits in kevent() while its
+     * idle report is current, and then only until it is woken.
+     */
+    int vclock_id = proactor->vclock_id;
+    int64_t tick_ns = ((int64_t)proactor->tick_time_spec.tv_sec * 1000000000LL) + proactor->tick_time_spec.tv_nsec;
+    int64_t next_tick_ns = util_clock_update() + tick_ns;
+    bool vclock_idle = false;
+
+    while (!ATOMIC_LOAD_U32(&(proactor->stop))) {
+        struct timespec *timeout = NULL;
+        struct timespec wait_timeout = {0};
+        int64_t vclock_activity = util_vclock_activity();
+        int64_t wait_start_ns = util_clock_real_ns();
+        int64_t wait_ns = 0;
+        int64_t callback_start_ns = 0;
+        int num_socket_events = 0;
+        bool woken = false;
+        bool tick_due = false;
+
+        if(vclock_id >= 0) {
+            wait_timeout.tv_nsec = (vclock_idle ? (long)VCLOCK_POLL_MS * 1000000L : 0);
+            timeout = &wait_timeout;
+        } else if(tick_ns > 0) {
+            /* only wait out what is left of the tick, or busy loops would keep pushing it back. */
+            int64_t remaining_ns = next_tick_ns - util_clock_ns();
+
+            if(remaining_ns < 0) {
+                remaining_ns = 0;
+            }
+
+            wait_timeout.tv_sec = (time_t)(remaining_ns / 1000000000LL);
+            wait_timeout.tv_nsec = (long)(remaining_ns % 1000000000LL);
+            timeout = &wait_timeout;
+        }
+
         /* Get the events */
-        int num_triggered_events = kevent(proactor->kq, NULL, 0, events, NUM_EVENTS, &(proactor->tick_time_spec));
-        if (num_triggered_events == -1) {
-            if (errno == EINTR) {
-                warn("kevent() call interrupted by signal!");
+        int num_triggered_events = kevent(proactor->kq, NULL, 0, events, NUM_EVENTS, timeout);
 
-                /* Can this interruption actually happen? */
-                continue;
+        /* one clock read per iteration, every callback below sees the same "now". */
+        util_clock_update();
+
+        /* the cached time is virtual under virtual time, so the wait needs a real one. */
+        wait_ns = (vclock_id >= 0 ? util_clock_real_ns() : util_clock_now_ns()) - wait_start_ns;
+
+        ATOMIC_STORE_U64_RELAXED(&(proactor->stats.iterations), proactor->stats.iterations + 1);
+        histogram_record(&(proactor->stats.wait_ns), (uint64_t)(wait_ns > 0 ? wait_ns : 0));
+
+        if(num_triggered_events == -1) {
+            if(errno != EINTR) {
+                warn("Error %d waiting for events, stopping!", errno);
+                proactor->status = STATUS_INTERNAL_FAILURE;
+                break;
             }
+
+            num_triggered_events = 0;
         }
 
         for (int i = 0; i < num_triggered_events; i++) {
             struct proactor_socket_t *socket = (struct proactor_socket_t *)(events[i].udata);
 
-            if(events[i].ident == proactor->wakeup_fds[0]) {
-                char buf;
+            if(events[i].ident == (uintptr_t)proactor->wakeup_fds[0]) {
+                char buf[64];
 
                 detail("Proactor woken up.");
 
                 /* we need to clear the pipe so that we do not triggered READ again. */
-                read(proactor->wakeup_fds[0], &buf, 1);
+                while(read(proactor->wakeup_fds[0], buf, sizeof(buf)) > 0) { }
 
-            } else {
-                if (events[i].filter == EVFILT_READ) {
-                    /* call the right callback depending on the type of the socket. */
-                    if(socket) {
-                        if(socket->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
-                            /* do accept */
-                            /* FIXME - should check result! */
-                            process_accept_ready(proactor, socket);
-                        } else if(socket->socket_type == PROACTOR_SOCK_TCP_CLIENT || socket->socket_type == PROACTOR_SOCK_UDP) {
-                            process_read_ready(proactor, socket);
-                        } else {
-                            warn("Unknown socket type %d!", socket->socket_type);
-                        }
-                    } /* else FIXME - what should we do here? */
-                }
+                woken = true;
+                continue;
+            }
+
+            /* an earlier callback in this batch may have closed it. */
+            if(!socket || socket->closed) {
+                continue;
+            }
+
+            num_socket_events++;
 
-                if (events[i].filter == EVFILT_WRITE) {
-                    /* the socket is writable */
+            if (events[i].filter == EVFILT_READ) {
+                if(socket->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
+                    process_accept_ready(proactor, socket);
+                } else if(socket->rx_buffer) {
+                    process_read_ready(proactor, socket);
+                }
+            } else if (events[i].filter == EVFILT_WRITE) {
+                /* the socket is writable, or EV_EOF says it never will be again. */
+                if(socket->tx_buffer) {
                     process_write_ready(proactor, socket);
                 }
+            }
+        }
+
+        /* the timer fired if its deadline passed, note how late that was. */
+        if(tick_ns > 0 && util_clock_now_ns() >= next_tick_ns) {
+            histogram_record(&(proactor->stats.timer_lag_ns), (uint64_t)(util_clock_now_ns() - next_tick_ns));
+            next_tick_ns = util_clock_now_ns() + tick_ns;
+
+            tick_due = true;
+        }
+
+        /* a wake is for the application, it does not keep virtual time from moving. */
+        if(tick_due || num_socket_events > 0 || woken) {
+            /* call the tick CB on the proactor instance. */
+            if(proactor->event_cb) {
+                callback_start_ns = util_clock_real_ns();
+                proactor->event_cb(proactor, PROACTOR_EVENT_TICK, STATUS_OK, proactor->app_data);
+                record_callback(proactor, PROACTOR_CALLBACK_TICK, NULL, callback_start_ns);
+            }
+        }
 
-                /* else?  FIXME - how to handle other filters? */
+        if(tick_due) {
+            /* call the tick CB on all the sockets with a running timer. */
+            for(struct proactor_socket_t *sock = proactor->sockets; sock; sock = sock->next) {
+                if(!sock->closed && sock->timer_running && sock->tick_cb) {
+                    callback_start_ns = util_clock_real_ns();
+                    sock->tick_cb(sock, STATUS_OK, sock->sock_data, sock->app_data);
+                    record_callback(proactor, PROACTOR_CALLBACK_TICK, sock, callback_start_ns);
+                }
             }
         }
 
-        /* call the tick CB on the proactor instance. */
-        if(proactor->event_cb) {
-            proactor->event_cb(proactor, PROACTOR_EVENT_TICK, STATUS_OK, proactor->app_data);
+        /* nothing can refer to a closed socket after the callbacks above. */
+        if(proactor->have_closed_sockets) {
+            free_closed_sockets(proactor);
         }
 
-        /* call the tick CB on all the sockets. */
-        for(struct proactor_socket_t *sock; sock; sock = sock->next) {
-            if(sock->tick_cb) {
-                sock->tick_cb(sock, STATUS_OK, sock->sock_data, proactor->app_data);
+        /* anything sent above is already with the kernel, so peers will see it when they look again. */
+        if(vclock_id >= 0) {
+            if(tick_due || num_socket_events > 0) {
+                util_vclock_busy();
+                vclock_idle = false;
+            } else {
+                vclock_idle = util_vclock_idle(vclock_id, vclock_activity, (tick_ns > 0 ? next_tick_ns : INT64_MAX));
             }
         }
     }
+
+    util_vclock_leave(vclock_id);
+    proactor->vclock_id = -1;
+}
+
+
+
+
+status_t proactor_net_get_stats(struct proactor_t *proactor, struct proactor_stats_t *stats)
+{
+    if(!proactor || !stats) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    /* the loop may be recording while this copies. */
+    stats->iterations = ATOMIC_LOAD_U64_RELAXED(&(proactor->stats.iterations));
+    stats->slow_callbacks = ATOMIC_LOAD_U64_RELAXED(&(proactor->stats.slow_callbacks));
+
+    histogram_snapshot(&(stats->wait_ns), &(proactor->stats.wait_ns));
+    histogram_snapshot(&(stats->timer_lag_ns), &(proactor->stats.timer_lag_ns));
+
+    for(int i = 0; i < PROACTOR_NUM_CALLBACKS; i++) {
+        histogram_snapshot(&(stats->callback_ns[i]), &(proactor->stats.callback_ns[i]));
+    }
+
+    return STATUS_OK;
 }
 
 
 
+const char *proactor_net_callback_name(proactor_callback_t callback)
+{
+    switch(callback) {
+        case PROACTOR_CALLBACK_ACCEPT: return "accept"; break;
+        case PROACTOR_CALLBACK_RECEIVE: return "receive"; break;
+        case PROACTOR_CALLBACK_SENT: return "sent"; break;
+        case PROACTOR_CALLBACK_TICK: return "tick"; break;
+        default: return "unknown"; break;
+    }
+}
 
+
+
+status_t proactor_net_set_slow_callback_ns(struct proactor_t *proactor, int64_t threshold_ns)
+{
+    if(!proactor) {
+        warn("Called with a NULL proactor pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(threshold_ns < 0) {
+        warn("The slow callback threshold cannot be negative!");
+        return STATUS_OUT_OF_BOUNDS;
+    }
+
+    proactor->slow_callback_ns = threshold_ns;
+
+    return STATUS_OK;
+}
+
+
+
+
+/* safe from any thread. */
 void proactor_net_stop(struct proactor_t *proactor)
 {
     if(proactor) {
-        proactor->stop = true;
+        ATOMIC_STORE_U32(&(proactor->stop), 1);
         proactor_net_wake(proactor);
     }
 }
 
 
 
+/* safe from any thread. */
 void proactor_net_wake(struct proactor_t *proactor)
 {
-    if(proactor) {
+    if(proactor && proactor->wakeup_fds[1] != INVALID_SOCKET) {
         char buf = 1;
-        if (write(proactor->wakeup_fds[1], &buf, 1) == -1) {
+
+        /* a full pipe already has a wake pending. */
+        if (write(proactor->wakeup_fds[1], &buf, 1) == -1 && errno != EAGAIN) {
             warn("Unable to write to wake pipe!");
-            /* FIXME - what should we do with errors? */
         }
     }
 }
@@ -325,48 +538,97 @@ void proactor_net_wake(struct proactor_t *proactor)
 
 
 
-status_t process_accept_ready(struct proactor_t *proactor, struct proactor_socket_t *server_sock)
+/*
+ * Sockets.  All of these must be called on the thread running the proactor,
+ * or before it starts running.
+ */
+
+status_t proactor_net_socket_open(struct proactor_t *proactor, struct proactor_socket_t **socket_ptr, proactor_socket_type_t socket_type, const char *address, uint16_t port, void *sock_data, void *app_data)
 {
     status_t rc = STATUS_OK;
+    SOCKET sock = INVALID_SOCKET;
+    struct sockaddr_in addr;
 
     info("Starting.");
 
     do {
-        struct proactor_socket_t *client = NULL;
-        struct sockaddr client_addr = {0};
+        int one = 1;
 
-        if(!server_sock->accept_cb) {
-            warn("No callback on listener socket!");
+        if(!proactor || !socket_ptr) {
+            warn("Called with NULL pointer(s)!");
             rc = STATUS_NULL_PTR;
             break;
         }
 
-        /* allocate a new socket struct */
-        client = (struct proactor_socket_t *)calloc(1, sizeof(*client));
-        if(!client) {
-            warn("Unable to allocate new socket struct instance!");
-            rc = STATUS_NO_RESOURCE;
+        *socket_ptr = NULL;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+
+        if(!address || address[0] == 0) {
+            /* nothing was passed for the address, so listen on them all. */
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        } else if(inet_pton(AF_INET, address, &(addr.sin_addr)) != 1) {
+            warn("Unable to parse IPv4 address \"%s\"!", address);
+            rc = STATUS_BAD_INPUT;
+            break;
+        }
+
+        sock = socket(AF_INET, (socket_type == PROACTOR_SOCK_UDP ? SOCK_DGRAM : SOCK_STREAM), 0);
+        if(sock == INVALID_SOCKET) {
+            warn("Unable to open socket, error %d!", errno);
+            rc = STATUS_EXTERNAL_FAILURE;
             break;
         }
 
-        client->socket_type = SOCKET_TYPE_TCP_CLIENT;
+        if(socket_type == PROACTOR_SOCK_TCP_LISTENER || socket_type == PROACTOR_SOCK_UDP) {
+            setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+            if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                warn("Unable to bind to %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
+            }
 
-        /* get the new connection file descriptor */
-        client->sock = accept(server_sock->sock, &client_addr, sizeof(client_addr));
+            if(socket_type == PROACTOR_SOCK_TCP_LISTENER && listen(sock, SOMAXCONN) == -1) {
+                warn("Unable to listen on %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
+            }
+        } else if(socket_type == PROACTOR_SOCK_TCP_CLIENT) {
+            /* the connect blocks, the socket only goes non-blocking once it is up. */
+            if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+                warn("Unable to connect to %s:%u, error %d!", (address ? address : ""), port, errno);
+                rc = STATUS_EXTERNAL_FAILURE;
+                break;
+            }
 
-        /* accept returns a positive, non-zero number for success and a negative number for failure. */
-        if(client->sock > 0) {
-            client->remote_addr = client_addr;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
         } else {
-            warn("Error calling accept() on listening socket!");
-            rc = STATUS_INTERNAL_FAILURE;
-            /* we do _NOT_ break here as we want to fall through to the line below. */
+            warn("Unsupported socket type %d!", (int)socket_type);
+            rc = STATUS_NOT_SUPPORTED;
+            break;
+        }
+
+        if((rc = set_nonblocking(sock)) != STATUS_OK) {
+            break;
         }
 
-        /* call the callback */
-        server_sock->accept_cb(server_sock, client, rc, server_sock->sock_data, proactor->app_data);
+        if(!(*socket_ptr = add_socket(proactor, sock, socket_type, sock_data, app_data))) {
+            rc = STATUS_NO_RESOURCE;
+            break;
+        }
+
+        if(socket_type == PROACTOR_SOCK_TCP_CLIENT) {
+            memcpy(&((*socket_ptr)->remote_addr), &addr, sizeof(addr));
+        }
     } while(0);
 
+    if(rc != STATUS_OK && sock != INVALID_SOCKET) {
+        close(sock);
+    }
+
     info("Done with status %s.", status_to_str(rc));
 
     return rc;
@@ -374,507 +636,481 @@ status_t process_accept_ready(struct proactor_t *proactor, struct proactor_socke
 
 
 
-status_t process_read_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+/*
+ * Closing does not call the close callback, that is only for closes the
+ * application did not ask for.  The handle must not be used afterward, but
+ * the memory lives until the current loop iteration ends.
+ */
+status_t proactor_net_socket_close(struct proactor_socket_t *socket)
 {
-    status_t rc = STATUS_OK;
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
 
-    info("Starting.");
+    if(socket->closed) {
+        return STATUS_OK;
+    }
 
-    do {
-        socklen_t addr_len = sizeof(sock->remote_addr);
-        ssize_t read_rc = 0;
+    detail("Closing socket %d.", (int)socket->sock);
 
-        if(!sock->receive_cb) {
-            warn("No read callback on socket!");
-            rc = STATUS_NULL_PTR;
-            break;
-        }
+    socket->closed = true;
+    socket->rx_buffer = NULL;
+    socket->tx_buffer = NULL;
+    socket->proactor->have_closed_sockets = true;
 
-        read_rc = recvfrom(sock->sock, sock->buffer->data, sock->buffer->data_length, 0, &(sock->remote_addr), &addr_len);
+    /* closing the descriptor also removes its filters from the kernel queue. */
+    close(socket->sock);
+    socket->sock = INVALID_SOCKET;
 
-        if(read_rc > 0) {
-            /* we got data! */
-            sock->buffer->data_length = read_rc;
+    return STATUS_OK;
+}
 
-            if(sock->receive_cb) {
-                sock->receive_cb(sock, &(sock->remote_addr), &(sock->buffer), rc, sock->sock_data, proactor->app_data);
-            }
-        } else if(read_rc == 0) {
-            /* socket closed? */
-            if(sock->close_cb) {
-                sock->close_cb(sock, rc, sock->sock_data, proactor->app_data);
-            }
-        } else {
-            /* read_rc < 0 */
-        }
-    } while(0);
 
-    info("Done with status %s.", status_to_str(rc));
 
-    return rc;
+status_t proactor_net_socket_set_data(struct proactor_socket_t *socket, void *sock_data)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->sock_data = sock_data;
+
+    return STATUS_OK;
 }
 
 
 
+status_t proactor_net_socket_set_accept_callback(struct proactor_socket_t *listener_socket, on_accept_cb_func_t accept_cb)
+{
+    if(!listener_socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(listener_socket->socket_type != PROACTOR_SOCK_TCP_LISTENER) {
+        warn("Only listener sockets accept connections!");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    listener_socket->accept_cb = accept_cb;
+
+    return STATUS_OK;
+}
+
+
 
-status_t process_write_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+status_t proactor_net_socket_set_close_callback(struct proactor_socket_t *socket, on_close_cb_func_t close_cb)
 {
-    status_t rc = STATUS_OK;
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->close_cb = close_cb;
+
+    return STATUS_OK;
+}
+
+
 
+status_t proactor_net_socket_set_receive_callback(struct proactor_socket_t *socket, on_receive_cb_func_t receive_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
 
+    socket->receive_cb = receive_cb;
 
+    return STATUS_OK;
 }
 
 
-// void proactor_net_run(proactor_t *proactor)
-// {
-//     if(!proactor) {
-//         warn("Called with null proactor pointer!");
-//         return;
-//     }
-
-
-//     while(!proactor->stop) {
-//         struct kevent events[NUM_EVENTS];
-//         int kevent_rc = 0;
-
-//         kevent_rc = kevent(proactor->kq, NULL, 0, events, NUM_EVENTS, &(proactor->tick_time_spec));
-//         if(kevent_rc < 0) {
-//             warn("System error getting events!");
-//             proactor->status = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         if(kevent_rc == 0) {
-//             /* timeout */
-//             if(proactor->event_cb) {
-//                 proactor->event_cb(proactor, PROACTOR_EVENT_TIMEOUT, proactor->status, proactor->app_data);
-//             }
-
-//             continue;
-//         }
-
-//         /* kevent_rc is > 0 so we got some events */
-//         for(int i=0; i < kevent_rc; i++) {
-//             if (events[i].ident == proactor->wakeup_fds[0]) {
-
-
-//                 /* read the wakeup socket to clear the data. */
-//                 char tmp;
-//                 read(proactor->wakeup_fds[0], &tmp, sizeof(tmp));
-
-//                 if(proactor->event_cb) {
-//                     proactor->event_cb(proactor, PROACTOR_EVENT_WAKE, proactor->app_data);
-//                 }
-//             } else {
-//                 /* this is a read or write event */
-//                 int event = events[i].filter;
-//                 struct proactor_socket_t *sock = (struct proactor_socket_t *)(events[i].udata);
-
-//                 if(event == EVFILT_READ) {
-//                     if(sock->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
-//                         process_accept_ready(proactor, sock);
-//                     } else {
-//                         process_read_ready(proactor, sock);
-//                     }
-//                 } else if(event == EVFILT_WRITE) {
-//                     process_write_ready(proactor, sock);
-//                 }
-//             }
-//         }
-//     }
-// }
-
-
-// void proactor_net_stop(proactor_t *proactor);
-
-// void proactor_net_wake(proactor_t *proactor);
-
-
-/* start up a listening socket and wait for clients to connect. */
-// status_t proactor_net_start_server(proactor_t *proactor, const char *address, uint16_t port)
-// {
-//     status_t rc = STATUS_OK;
-//     struct accept_context_t *accept_context = NULL;
-
-//     info("Starting.");
-
-//     do {
-//         struct sockaddr_in server_addr;
-//         struct kevent ev;
-
-//         if(!proactor) {
-//             warn("Called with a null proactor pointer!");
-//             rc = STATUS_NULL_PTR;
-//             break;
-//         }
-
-//         /* allocate a new accept context object */
-//         if(!(accept_context = calloc(1, sizeof(*accept_context)))) {
-//             warn("Unable to allocate accept context!");
-//             rc = STATUS_NO_RESOURCE;
-//             break;
-//         }
-
-//         accept_context->server_socket = INVALID_SOCKET;
-//         accept_context->base.context_type = CONTEXT_ACCEPT;
-//         accept_context->accept_cb = accept_cb;
-//         accept_context->app_data = app_data;
-
-//         /* clear the server address struct */
-//         memset(&server_addr, 0, sizeof(server_addr));
-
-//         /* create a new listening socket. */
-//         if((accept_context->server_socket = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         /* start configuring the address and port info for the server socket */
-//         server_addr.sin_family = AF_INET;
-//         server_addr.sin_port = htons(port);
-
-//         /* set up the address */
-//         if(!address || strlen(address) == 0) {
-//             /* nothing was passed for the local address, so chose them all */
-//             server_addr.sin_addr.s_addr = INADDR_ANY;
-//         } else {
-//             /* FIXME - check results! what if address is a host name? */
-//             inet_pton(AF_INET, address, &server_addr.sin_addr);
-//         }
-
-//         if (bind(accept_context->server_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         if (listen(accept_context->server_socket, SOMAXCONN) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         EV_SET(&ev, accept_context->server_socket, EVFILT_READ, EV_ADD, 0, 0, accept_context);
-//         if (kevent(proactor->kq, &ev, 1, NULL, 0, NULL) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         /*
-//          * link the context up in the proactor object.
-//          * Do this last so that we do not need to unlink it from the proactor
-//          * if something has gone wrong.
-//          */
-//         accept_context->base.next = proactor->contexts;
-//         proactor->contexts = accept_context;
-//     } while(0);
-
-//     /* clean up if we need to. */
-//     if(rc != STATUS_OK) {
-//         warn("Error %s while attempting to set up a new server socket.", status_to_str(rc));
-
-//         if(accept_context) {
-//             /* if there is a callback, call it with the failure. */
-//             if(accept_context->accept_cb) {
-//                 /* FIXME - should we pass rc or STATUS_TERMINATE here? */
-//                 accept_cb(accept_context->server_socket, INVALID_SOCKET, rc, app_data);
-//             }
-
-//             if(accept_context->server_socket != INVALID_SOCKET) {
-//                 close(accept_context->server_socket);
-//             }
-
-//             free(accept_context);
-//         }
-//     }
-
-//     info("Done with status %s.", status_to_str);
-
-//     return rc;
-// }
-
-
-
-// struct client_context_t {
-//     struct base_context_t base;
-
-//     SOCKET client_sock;
-
-//     on_receive_cb_func_t receive_cb;
-//     on_send_complete_cb_func_t sent_cb;
-//     void *app_data;
-// };
-
-
-/* client connection */
-// status_t proactor_net_connect(struct proactor_t *proactor, const char *address, uint16_t port, on_receive_cb_func_t receive_cb, on_send_complete_cb_func_t sent_cb, void *app_data)
-// {
-//     status_t rc = STATUS_OK;
-//     struct client_context_t *client_context = NULL;
-
-//     info("Starting.");
-
-//     do {
-//         struct sockaddr_in server_addr;
-//         struct kevent ev[2];
-
-//         if(!proactor) {
-//             warn("Called with a null proactor pointer!");
-//             rc = STATUS_NULL_PTR;
-//             break;
-//         }
-
-//         /* allocate a new accept context object */
-//         if(!(client_context = calloc(1, sizeof(*client_context)))) {
-//             warn("Unable to allocate accept context!");
-//             rc = STATUS_NO_RESOURCE;
-//             break;
-//         }
-
-//         client_context->base.context_type = CONTEXT_CLIENT;
-//         client_context->receive_cb = receive_cb;
-//         client_context->sent_cb = sent_cb;
-//         client_context->app_data = app_data;
-
-//         /* clear the server address struct */
-//         memset(&server_addr, 0, sizeof(server_addr));
-
-//         /* create a new listening socket. */
-//         if((client_context->client_sock = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         /* start configuring the address and port info for the server socket */
-//         server_addr.sin_family = AF_INET;
-//         server_addr.sin_port = htons(port);
-
-//         /* set up the address */
-//         if(!address || strlen(address) == 0) {
-//             /* nothing was passed for the local address, so chose them all */
-//             server_addr.sin_addr.s_addr = INADDR_ANY;
-//         } else {
-//             /* FIXME - check results! what if address is a host name? */
-//             inet_pton(AF_INET, address, &server_addr.sin_addr);
-//         }
-
-//         /* connect up to the remote system. */
-//         if(connect(client_context->client_sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         EV_SET(&ev[0], client_context->client_sock, EVFILT_READ, EV_ADD, 0, 0, client_context);
-//         EV_SET(&ev[1], client_context->client_sock, EVFILT_WRITE, EV_ADD, 0, 0, client_context);
-//         if(kevent(proactor->kq, ev, 2, NULL, 0, NULL) == -1) {
-//             /* FIXME - handle errno errors */
-//             warn("Unable to open server socket!");
-//             rc = STATUS_INTERNAL_FAILURE;
-//             break;
-//         }
-
-//         /*
-//          * link the context up in the proactor object.
-//          * Do this last so that we do not need to unlink it from the proactor
-//          * if something has gone wrong.
-//          */
-//         client_context->base.next = proactor->contexts;
-//         proactor->contexts = client_context;
-//     } while(0);
-
-//     /* clean up if we need to. */
-//     if(rc != STATUS_OK) {
-//         warn("Error %s while attempting to set up a new server socket.", status_to_str(rc));
-
-//         if(client_context) {
-//             /* FIXME - which callback should we call?. */
-//             if(client_context->sent_cb) {
-//                 /* FIXME - should we pass rc or STATUS_TERMINATE here? */
-//                 sent_cb(client_context->client_sock, rc, app_data);
-//             }
-
-//             if(client_context->client_sock && client_context->client_sock != INVALID_SOCKET) {
-//                 close(client_context->client_sock);
-//             }
-
-//             free(client_context);
-//         }
-//     }
-
-//     return 0;
-// }
-
-// Handle data from the server
-static void handle_data_event(int fd) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_read = read(fd, buffer, sizeof(buffer));
-    if (bytes_read <= 0) {
-        if (bytes_read < 0) {
-            perror("read");
-        }
-        close(fd);
 
-        // Remove the client socket from the kevent monitoring
-        struct kevent ev;
-        EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
-        EV_SET(&ev, fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
-        if (kevent(kq, &ev, 2, NULL, 0, NULL) == -1) {
-            handle_error("kevent");
-        }
-        return;
+status_t proactor_net_socket_set_sent_callback(struct proactor_socket_t *socket, on_sent_cb_func_t sent_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->sent_cb = sent_cb;
+
+    return STATUS_OK;
+}
+
+
+
+status_t proactor_net_socket_set_tick_callback(struct proactor_socket_t *socket, on_tick_cb_func_t tick_cb)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    socket->tick_cb = tick_cb;
+
+    return STATUS_OK;
+}
+
+
+
+status_t proactor_net_start_accept(struct proactor_socket_t *listener_socket)
+{
+    if(!listener_socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(listener_socket->closed || listener_socket->socket_type != PROACTOR_SOCK_TCP_LISTENER || !listener_socket->accept_cb) {
+        warn("Socket is not an open listener with an accept callback!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    listener_socket->accepting = true;
+
+    return update_events(listener_socket);
+}
+
+
+
+/* one read of up to buf->data_length bytes.  The callback gets buf back with the length read. */
+status_t proactor_net_start_receive(struct proactor_socket_t *socket, proactor_buf_t *buf)
+{
+    if(!socket || !buf) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(socket->closed || socket->socket_type == PROACTOR_SOCK_TCP_LISTENER || !socket->receive_cb) {
+        warn("Socket is not an open connection with a receive callback!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(socket->rx_buffer) {
+        warn("Socket %d already has a receive pending!", (int)socket->sock);
+        return STATUS_BUSY;
+    }
+
+    socket->rx_buffer = buf;
+
+    return update_events(socket);
+}
+
+
+
+/* the whole buffer goes out before the sent callback is called. */
+status_t proactor_net_start_send(struct proactor_socket_t *socket, proactor_buf_t *buf)
+{
+    if(!socket || !buf) {
+        warn("Called with NULL pointer(s)!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(socket->closed || socket->socket_type == PROACTOR_SOCK_TCP_LISTENER) {
+        warn("Socket is not an open connection!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(socket->tx_buffer) {
+        warn("Socket %d already has a send pending!", (int)socket->sock);
+        return STATUS_BUSY;
+    }
+
+    socket->tx_buffer = buf;
+    socket->tx_offset = 0;
+
+    return update_events(socket);
+}
+
+
+
+/* call the socket's tick callback on every proactor tick until the socket closes. */
+status_t proactor_net_start_timer(struct proactor_socket_t *socket)
+{
+    if(!socket) {
+        warn("Called with a NULL socket pointer!");
+        return STATUS_NULL_PTR;
+    }
+
+    if(socket->closed || !socket->tick_cb) {
+        warn("Socket is not open or has no tick callback!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    socket->timer_running = true;
+
+    return STATUS_OK;
+}
+
+
+
+
+
+
+/*
+ * Helpers
+ */
+
+
+static status_t set_nonblocking(SOCKET sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        warn("Unable to make file descriptor %d non-blocking, error %d!", (int)sock, errno);
+        return STATUS_INTERNAL_FAILURE;
+    }
+
+    return STATUS_OK;
+}
+
+
+/* only enable the filters that have a request pending. */
+static status_t update_events(struct proactor_socket_t *socket)
+{
+    struct kevent changes[2];
+    int num_changes = 0;
+    bool want_read = (socket->accepting || socket->rx_buffer);
+    bool want_write = (socket->tx_buffer != NULL);
+
+    if(want_read != socket->read_enabled) {
+        EV_SET(&changes[num_changes], socket->sock, EVFILT_READ, (want_read ? EV_ENABLE : EV_DISABLE), 0, 0, socket);
+        num_changes++;
+    }
+
+    if(want_write != socket->write_enabled) {
+        EV_SET(&changes[num_changes], socket->sock, EVFILT_WRITE, (want_write ? EV_ENABLE : EV_DISABLE), 0, 0, socket);
+        num_changes++;
+    }
+
+    if(num_changes == 0) {
+        return STATUS_OK;
+    }
+
+    if(kevent(socket->proactor->kq, changes, num_changes, NULL, 0, NULL) == -1) {
+        warn("Unable to update filters for socket %d, error %d!", (int)socket->sock, errno);
+        return STATUS_INTERNAL_FAILURE;
+    }
+
+    socket->read_enabled = want_read;
+    socket->write_enabled = want_write;
+
+    return STATUS_OK;
+}
+
+
+static struct proactor_socket_t *add_socket(struct proactor_t *proactor, SOCKET sock, proactor_socket_type_t socket_type, void *sock_data, void *app_data)
+{
+    struct proactor_socket_t *socket = NULL;
+    struct kevent changes[2];
+
+    if(!(socket = calloc(1, sizeof(*socket)))) {
+        warn("Unable to allocate new socket struct instance!");
+        return NULL;
+    }
+
+    socket->sock = sock;
+    socket->socket_type = socket_type;
+    socket->status = STATUS_OK;
+    socket->proactor = proactor;
+    socket->sock_data = sock_data;
+    socket->app_data = app_data;
+
+#ifdef SO_NOSIGPIPE
+    {
+        int one = 1;
+
+        setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
     }
+#endif
 
-    if (receive_callback) {
-        receive_callback(fd, buffer, bytes_read, receive_callback_user_data);
+    /* both filters start out disabled, update_events() turns them on as requests come in. */
+    EV_SET(&changes[0], sock, EVFILT_READ, EV_ADD | EV_DISABLE, 0, 0, socket);
+    EV_SET(&changes[1], sock, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, socket);
+
+    if(kevent(proactor->kq, changes, (socket_type == PROACTOR_SOCK_TCP_LISTENER ? 1 : 2), NULL, 0, NULL) == -1) {
+        warn("Unable to add socket %d to the kernel queue, error %d!", (int)sock, errno);
+        free(socket);
+        return NULL;
     }
+
+    socket->next = proactor->sockets;
+    proactor->sockets = socket;
+
+    return socket;
 }
 
-// Handle write readiness
-static void handle_write_event(int fd) {
-    if (current_send_request) {
-        ssize_t bytes_sent = write(fd, current_send_request->data + current_send_request->offset,
-                                   current_send_request->length - current_send_request->offset);
-        if (bytes_sent < 0) {
-            perror("write");
-            return;
+
+static void free_closed_sockets(struct proactor_t *proactor)
+{
+    struct proactor_socket_t **walker = &(proactor->sockets);
+
+    while(*walker) {
+        struct proactor_socket_t *socket = *walker;
+
+        if(socket->closed) {
+            *walker = socket->next;
+            free(socket);
+        } else {
+            walker = &(socket->next);
         }
+    }
+
+    proactor->have_closed_sockets = false;
+}
+
+
+/* take every waiting connection.  The accept callback owns the new socket. */
+static void process_accept_ready(struct proactor_t *proactor, struct proactor_socket_t *listener)
+{
+    while(!listener->closed) {
+        struct sockaddr client_addr = {0};
+        socklen_t addr_len = sizeof(client_addr);
+        struct proactor_socket_t *client = NULL;
+        status_t rc = STATUS_OK;
+        int64_t callback_start_ns = 0;
+        int one = 1;
+        SOCKET sock = accept(listener->sock, &client_addr, &addr_len);
+
+        if(sock == INVALID_SOCKET) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+                break;
+            }
+
+            warn("Error %d calling accept() on listening socket!", errno);
+            rc = STATUS_EXTERNAL_FAILURE;
+        } else if(set_nonblocking(sock) != STATUS_OK) {
+            close(sock);
+            rc = STATUS_INTERNAL_FAILURE;
+        } else {
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
-        current_send_request->offset += bytes_sent;
-        if (current_send_request->offset >= current_send_request->length) {
-            // Send completed
-            if (send_complete_callback) {
-                send_complete_callback(fd, send_complete_callback_user_data);
+            /* accepted sockets start out with the listener's data. */
+            if((client = add_socket(proactor, sock, PROACTOR_SOCK_TCP_CLIENT, listener->sock_data, listener->app_data))) {
+                client->remote_addr = client_addr;
+            } else {
+                close(sock);
+                rc = STATUS_NO_RESOURCE;
             }
+        }
+
+        callback_start_ns = util_clock_real_ns();
+        listener->accept_cb(listener, client, rc, listener->sock_data, listener->app_data);
+        record_callback(proactor, PROACTOR_CALLBACK_ACCEPT, listener, callback_start_ns);
 
-            free(current_send_request->data);
-            free(current_send_request);
-            current_send_request = NULL;
+        /* do not spin on a persistent failure such as running out of descriptors. */
+        if(rc != STATUS_OK) {
+            break;
         }
     }
 }
 
-// // Handle accept event
-// static void handle_accept_event(int fd) {
-//     int client_socket = accept(fd, NULL, NULL);
-//     if (client_socket == -1) {
-//         perror("accept");
-//         return;
-//     }
-
-//     if (accept_callback) {
-//         accept_callback(fd, client_socket, accept_callback_user_data);
-//     }
-
-//     struct kevent ev;
-//     EV_SET(&ev, client_socket, EVFILT_READ, EV_ADD, 0, 0, NULL);
-//     EV_SET(&ev, client_socket, EVFILT_WRITE, EV_ADD, 0, 0, NULL); // Monitor for write readiness
-//     if (kevent(kq, &ev, 2, NULL, 0, NULL) == -1) {
-//         handle_error("kevent");
-//     }
-// }
-
-// // Wake up the proactor run loop
-// void proactor_net_wake() {
-//     char buf = 1;
-//     if (write(proactor->wakeup_fds[1], &buf, 1) == -1) {
-//         handle_error("write");
-//     }
-// }
-
-// // Run the kevent event loop
-// void proactor_net_run() {
-//     struct kevent events[EVENT_SIZE];
-
-//     while (!stop) {
-//         int num_triggered_events = kevent(kq, NULL, 0, events, EVENT_SIZE, NULL);
-//         if (num_triggered_events == -1) {
-//             if (errno == EINTR) {
-//                 // Interrupted by signal, continue
-//                 continue;
-//             }
-//             handle_error("kevent");
-//         }
-
-//         for (int i = 0; i < num_triggered_events; i++) {
-//             if (events[i].ident == proactor->wakeup_fds[0]) {
-//                 // Handle wake-up event
-//                 char buf;
-//                 read(proactor->wakeup_fds[0], &buf, 1);
-//             } else if (events[i].ident == server_socket) {
-//                 // Handle accept event
-//                 handle_accept_event(events[i].ident);
-//             } else if (events[i].ident == client_socket) {
-//                 if (events[i].filter == EVFILT_READ) {
-//                     // Handle data event
-//                     handle_data_event(events[i].ident);
-//                 }
-//                 if (events[i].filter == EVFILT_WRITE) {
-//                     // Handle write event
-//                     handle_write_event(events[i].ident);
-//                 }
-//             }
-//         }
-//     }
-// }
-
-// Stop the kevent event loop
-// void proactor_net_stop() {
-//     stop = 1;
-//     proactor_net_wake(); // Ensure the loop is woken up
-// }
-
-// Set callbacks
-void proactor_net_set_receive_callback(on_receive_cb_func_t callback, void *user_data) {
-    receive_callback = callback;
-    receive_callback_user_data = user_data;
-}
 
-void proactor_net_set_send_complete_callback(on_send_complete_cb_func_t callback, void *user_data) {
-    send_complete_callback = callback;
-    send_complete_callback_user_data = user_data;
-}
 
-void proactor_net_set_accept_callback(on_accept_cb_func_t callback, void *user_data) {
-    accept_callback = callback;
-    accept_callback_user_data = user_data;
+static void process_read_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+{
+    proactor_buf_t *buffer = sock->rx_buffer;
+    socklen_t addr_len = sizeof(sock->remote_addr);
+    int64_t callback_start_ns = 0;
+    ssize_t read_rc = 0;
+
+    if(sock->socket_type == PROACTOR_SOCK_UDP) {
+        read_rc = recvfrom(sock->sock, buffer->data, buffer->data_length, 0, &(sock->remote_addr), &addr_len);
+    } else {
+        read_rc = recv(sock->sock, buffer->data, buffer->data_length, 0);
+    }
+
+    if(read_rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+
+    if(read_rc <= 0) {
+        /* zero is the peer closing, anything else is an error. */
+        process_hangup(proactor, sock, (read_rc == 0 ? STATUS_TERMINATE : STATUS_EXTERNAL_FAILURE));
+        return;
+    }
+
+    /* the callback usually starts the next receive, so clear this one first. */
+    sock->rx_buffer = NULL;
+    buffer->data_length = (size_t)read_rc;
+
+    callback_start_ns = util_clock_real_ns();
+    sock->receive_cb(sock, &(sock->remote_addr), buffer, STATUS_OK, sock->sock_data, sock->app_data);
+    record_callback(proactor, PROACTOR_CALLBACK_RECEIVE, sock, callback_start_ns);
+
+    if(!sock->closed) {
+        update_events(sock);
+    }
 }
 
-// Send data
-int proactor_net_send(int socket, const char *data, size_t length) {
-    if (current_send_request) {
-        // There is already a send request in progress
-        return -1;
+
+
+static void process_write_ready(struct proactor_t *proactor, struct proactor_socket_t *sock)
+{
+    proactor_buf_t *buffer = sock->tx_buffer;
+    status_t rc = STATUS_OK;
+    int64_t callback_start_ns = 0;
+
+    while(sock->tx_offset < buffer->data_length) {
+        ssize_t write_rc = 0;
+
+        if(sock->socket_type == PROACTOR_SOCK_UDP) {
+            write_rc = sendto(sock->sock, (uint8_t *)buffer->data + sock->tx_offset, buffer->data_length - sock->tx_offset, MSG_NOSIGNAL, &(sock->remote_addr), sizeof(sock->remote_addr));
+        } else {
+            write_rc = send(sock->sock, (uint8_t *)buffer->data + sock->tx_offset, buffer->data_length - sock->tx_offset, MSG_NOSIGNAL);
+        }
+
+        if(write_rc < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* try again when there is room. */
+                return;
+            }
+
+            if(errno == EINTR) {
+                continue;
+            }
+
+            detail("Error %d sending on socket %d.", errno, (int)sock->sock);
+            rc = STATUS_EXTERNAL_FAILURE;
+            break;
+        }
+
+        sock->tx_offset += (size_t)write_rc;
     }
 
-    current_send_request = (send_request_t*)malloc(sizeof(send_request_t));
-    if (!current_send_request) {
-        handle_error("malloc");
+    sock->tx_buffer = NULL;
+    sock->tx_offset = 0;
+
+    if(sock->sent_cb) {
+        callback_start_ns = util_clock_real_ns();
+        sock->sent_cb(sock, buffer, rc, sock->sock_data, sock->app_data);
+        record_callback(proactor, PROACTOR_CALLBACK_SENT, sock, callback_start_ns);
     }
 
-    current_send_request->data = (char*)malloc(length);
-    if (!current_send_request->data) {
-        handle_error("malloc");
+    if(!sock->closed) {
+        update_events(sock);
     }
-    memcpy(current_send_request->data, data, length);
-    current_send_request->length = length;
-    current_send_request->offset = 0;
+}
+
 
-    struct kevent ev;
-    EV_SET(&ev, socket, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
-    if (kevent(kq, &ev, 1, NULL, 0, NULL) == -1) {
-        handle_error("kevent");
+
+/* the peer went away.  Let the application clean up, or clean up ourselves if it cannot. */
+static void process_hangup(struct proactor_t *proactor, struct proactor_socket_t *sock, status_t status)
+{
+    detail("Socket %d closed with status %s.", (int)sock->sock, status_to_str(status));
+
+    sock->rx_buffer = NULL;
+    sock->tx_buffer = NULL;
+    sock->status = status;
+
+    if(sock->close_cb) {
+        sock->close_cb(sock, status, sock->sock_data, sock->app_data);
     }
 
-    return 0;
+    if(!sock->closed) {
+        proactor_net_socket_close(sock);
+    }
 }
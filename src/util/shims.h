@@ -15,6 +15,7 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "status.h"
 
@@ -34,6 +35,26 @@
     #define atomic_compare_exchange_strong(ptr, expected, desired) \
         (InterlockedCompareExchange(ptr, desired, *expected) == *expected ? 1 : 0)
 
+    /* compare and swap on a plain 32-bit word, true if it was swapped. */
+    #define ATOMIC_CAS_U32(ptr, expected, desired) \
+        (InterlockedCompareExchange((volatile LONG *)(ptr), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+    #define ATOMIC_LOAD_U32(ptr) ((uint32_t)InterlockedOr((volatile LONG *)(ptr), 0))
+    #define ATOMIC_STORE_U32(ptr, value) InterlockedExchange((volatile LONG *)(ptr), (LONG)(value))
+    #define ATOMIC_LOAD_PTR(ptr) (*(void * volatile *)(ptr))
+    #define ATOMIC_STORE_PTR(ptr, value) InterlockedExchangePointer((PVOID volatile *)(ptr), (value))
+    #define ATOMIC_CAS_PTR(ptr, expected, desired) \
+        (InterlockedCompareExchangePointer((PVOID volatile *)(ptr), (PVOID)(desired), (PVOID)(expected)) == (PVOID)(expected))
+
+    #define THREAD_LOCAL __declspec(thread)
+
+    /* index of the highest set bit, the value must not be zero. */
+    static inline int highest_bit_u64(uint64_t value) { unsigned long index = 0; _BitScanReverse64(&index, value); return (int)index; }
+    #define HIGHEST_BIT_U64(value) highest_bit_u64(value)
+
+    /* the CPU time stamp counter, zero where there is none. */
+    #define CPU_CYCLES() ((uint64_t)__rdtsc())
+    #define HAVE_CPU_CYCLES (1)
+
     /* basic mutex functions */
     typedef CRITICAL_SECTION mutex_t;
     #define MUTEX_INIT(mutex) InitializeCriticalSection(&mutex)
@@ -41,6 +62,21 @@
     #define MUTEX_UNLOCK(mutex) LeaveCriticalSection(&mutex)
     #define MUTEX_DESTROY(mutex) DeleteCriticalSection(&mutex)
 
+    /* condition variables, always used with a mutex_t. */
+    typedef CONDITION_VARIABLE cond_t;
+    #define COND_INIT(cond) InitializeConditionVariable(&cond)
+    #define COND_WAIT_MS(cond, mutex, ms) SleepConditionVariableCS(&cond, &mutex, (DWORD)(ms))
+    #define COND_BROADCAST(cond) WakeAllConditionVariable(&cond)
+    #define COND_DESTROY(cond) do { } while(0)
+
+    #define ATOMIC_LOAD_I64(ptr) ((int64_t)InterlockedCompareExchange64((volatile LONG64 *)(ptr), 0, 0))
+    #define ATOMIC_STORE_I64(ptr, value) InterlockedExchange64((volatile LONG64 *)(ptr), (LONG64)(value))
+    #define ATOMIC_ADD_I64(ptr, value) ((int64_t)InterlockedAdd64((volatile LONG64 *)(ptr), (LONG64)(value)))
+
+    /* no ordering, for single-writer counters that other threads only read. */
+    #define ATOMIC_LOAD_U64_RELAXED(ptr) ((uint64_t)__iso_volatile_load64((const volatile __int64 *)(ptr)))
+    #define ATOMIC_STORE_U64_RELAXED(ptr, value) __iso_volatile_store64((volatile __int64 *)(ptr), (__int64)(value))
+
     /* basic thread functions */
     typedef HANDLE thread_t;
     #define THREAD_CREATE(thread, func, arg) \
@@ -52,6 +88,7 @@
 
     #include <stdatomic.h>
     #include <pthread.h>
+    #include <time.h>
 
     /* basic atomic functions */
     typedef atomic_int atomic_int_t;
@@ -63,6 +100,29 @@
     #define atomic_compare_exchange_strong(ptr, expected, desired) \
         atomic_compare_exchange_strong_explicit(ptr, expected, desired, memory_order_seq_cst, memory_order_seq_cst)
 
+    /* compare and swap on a plain 32-bit word, true if it was swapped. */
+    #define ATOMIC_CAS_U32(ptr, expected, desired) \
+        __sync_bool_compare_and_swap((uint32_t *)(ptr), (uint32_t)(expected), (uint32_t)(desired))
+    #define ATOMIC_LOAD_U32(ptr) __atomic_load_n((uint32_t *)(ptr), __ATOMIC_SEQ_CST)
+    #define ATOMIC_STORE_U32(ptr, value) __atomic_store_n((uint32_t *)(ptr), (uint32_t)(value), __ATOMIC_RELEASE)
+    #define ATOMIC_LOAD_PTR(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+    #define ATOMIC_STORE_PTR(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+    #define ATOMIC_CAS_PTR(ptr, expected, desired) __sync_bool_compare_and_swap((ptr), (expected), (desired))
+
+    #define THREAD_LOCAL _Thread_local
+
+    /* index of the highest set bit, the value must not be zero. */
+    #define HIGHEST_BIT_U64(value) (63 - __builtin_clzll((unsigned long long)(value)))
+
+    /* the CPU time stamp counter, zero where there is none. */
+    #if defined(__x86_64__) || defined(__i386__)
+        #define CPU_CYCLES() ((uint64_t)__builtin_ia32_rdtsc())
+        #define HAVE_CPU_CYCLES (1)
+    #else
+        #define CPU_CYCLES() ((uint64_t)0)
+        #define HAVE_CPU_CYCLES (0)
+    #endif
+
     /* basic mutex functions */
     typedef pthread_mutex_t mutex_t;
     #define MUTEX_INIT(mutex) pthread_mutex_init(&mutex, NULL)
@@ -70,6 +130,38 @@
     #define MUTEX_UNLOCK(mutex) pthread_mutex_unlock(&mutex)
     #define MUTEX_DESTROY(mutex) pthread_mutex_destroy(&mutex)
 
+    /* condition variables, always used with a mutex_t. */
+    typedef pthread_cond_t cond_t;
+    #define COND_INIT(cond) pthread_cond_init(&cond, NULL)
+    #define COND_WAIT_MS(cond, mutex, ms) cond_wait_ms(&cond, &mutex, (ms))
+    #define COND_BROADCAST(cond) pthread_cond_broadcast(&cond)
+    #define COND_DESTROY(cond) pthread_cond_destroy(&cond)
+
+    static inline int cond_wait_ms(pthread_cond_t *cond, pthread_mutex_t *mutex, int ms)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        ts.tv_sec += ms / 1000;
+        ts.tv_nsec += (long)(ms % 1000) * 1000000L;
+
+        if(ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+
+        return pthread_cond_timedwait(cond, mutex, &ts);
+    }
+
+    #define ATOMIC_LOAD_I64(ptr) __atomic_load_n((int64_t *)(ptr), __ATOMIC_ACQUIRE)
+    #define ATOMIC_STORE_I64(ptr, value) __atomic_store_n((int64_t *)(ptr), (int64_t)(value), __ATOMIC_RELEASE)
+    #define ATOMIC_ADD_I64(ptr, value) __atomic_add_fetch((int64_t *)(ptr), (int64_t)(value), __ATOMIC_SEQ_CST)
+
+    /* no ordering, for single-writer counters that other threads only read. */
+    #define ATOMIC_LOAD_U64_RELAXED(ptr) __atomic_load_n((const uint64_t *)(ptr), __ATOMIC_RELAXED)
+    #define ATOMIC_STORE_U64_RELAXED(ptr, value) __atomic_store_n((uint64_t *)(ptr), (uint64_t)(value), __ATOMIC_RELAXED)
+
     /* basic thread functions */
     typedef pthread_t thread_t;
     #define THREAD_CREATE(thread, func, arg) (pthread_create(&thread, NULL, func, arg) == 0)
@@ -40,8 +40,21 @@
     #include <errno.h>
 #endif
 
+#include "debug.h"
 #include "time_utils.h"
 
+/* HAVE_CPU_CYCLES comes from shims.h. */
+#if HAVE_CPU_CYCLES && !defined(IS_WINDOWS)
+    #include <cpuid.h>
+#endif
+
+
+/* TSC deltas are scaled to ns as (delta * mult) >> shift. */
+#define TSC_SHIFT (24)
+
+/* how long to count TSC ticks against CLOCK_MONOTONIC when calibrating. */
+#define TSC_CALIBRATION_MS (50)
+
 
 /*
  * This contains the utilities used by the test harness.
@@ -108,3 +121,455 @@ int64_t util_time_ms(void)
 }
 
 #endif
+
+
+
+/*
+ * util_time_mono_ns
+ *
+ * Return monotonic time in nanoseconds.  This does not jump when the wall
+ * clock is set and is only useful for measuring elapsed time.
+ */
+
+#ifdef IS_WINDOWS
+int64_t util_time_mono_ns(void)
+{
+    static LARGE_INTEGER freq = {0};
+    LARGE_INTEGER count;
+
+    if(freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+
+    QueryPerformanceCounter(&count);
+
+    return (int64_t)((count.QuadPart / freq.QuadPart) * 1000000000) + (int64_t)(((count.QuadPart % freq.QuadPart) * 1000000000) / freq.QuadPart);
+}
+
+#else
+
+int64_t util_time_mono_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000000000) + (int64_t)ts.tv_nsec;
+}
+
+#endif
+
+
+
+
+/*
+ * The clock layer.
+ *
+ * The TSC rate is set once at start up, before any threads run.  Each
+ * thread keeps its own base point so no shared state is written on reads.
+ */
+
+THREAD_LOCAL int64_t util_clock_cached_ns = 0;
+
+static bool tsc_enabled = false;
+static uint64_t tsc_mult = 0;
+static uint64_t tsc_resync_cycles = 0;
+
+static THREAD_LOCAL uint64_t tsc_base = 0;
+static THREAD_LOCAL int64_t tsc_base_ns = 0;
+static THREAD_LOCAL int64_t tsc_last_ns = 0;
+static THREAD_LOCAL uint64_t tsc_thread_mult = 0;
+
+
+/*
+ * Start a new base point from CLOCK_MONOTONIC.  The interval since the last
+ * one is a far longer calibration than start up could afford, so the rate
+ * is refined from it as well.
+ */
+static int64_t tsc_resync(uint64_t delta)
+{
+    uint64_t now_cycles = CPU_CYCLES();
+    int64_t now_ns = util_time_mono_ns();
+
+    if(tsc_base != 0 && delta <= 2 * tsc_resync_cycles && now_ns > tsc_base_ns) {
+        tsc_thread_mult = ((uint64_t)(now_ns - tsc_base_ns) << TSC_SHIFT) / (now_cycles - tsc_base);
+    } else {
+        tsc_thread_mult = tsc_mult;
+    }
+
+    tsc_base = now_cycles;
+    tsc_base_ns = now_ns;
+
+    return now_ns;
+}
+
+
+/* virtual time, see util_vclock_enable(). */
+static bool vclock_enabled = false;
+static int64_t vclock_now_ns = 0;
+
+
+int64_t util_clock_ns(void)
+{
+    if(vclock_enabled) {
+        return ATOMIC_LOAD_I64(&vclock_now_ns);
+    }
+
+    return util_clock_real_ns();
+}
+
+
+int64_t util_clock_real_ns(void)
+{
+    uint64_t delta = 0;
+    int64_t ns = 0;
+
+    if(!tsc_enabled) {
+        return util_time_mono_ns();
+    }
+
+    delta = CPU_CYCLES() - tsc_base;
+
+    /* a TSC that went backwards after a CPU migration wraps to a huge delta and resyncs too. */
+    if(tsc_base == 0 || delta > tsc_resync_cycles) {
+        ns = tsc_resync(delta);
+    } else {
+        ns = tsc_base_ns + (int64_t)((delta * tsc_thread_mult) >> TSC_SHIFT);
+    }
+
+    /* never step backwards when resyncing to CLOCK_MONOTONIC. */
+    if(ns < tsc_last_ns) {
+        ns = tsc_last_ns;
+    }
+
+    tsc_last_ns = ns;
+
+    return ns;
+}
+
+
+/* only a TSC that ticks at a constant rate through sleep states can stand in for a clock. */
+static bool tsc_is_invariant(void)
+{
+#if HAVE_CPU_CYCLES && defined(IS_WINDOWS)
+    int regs[4] = {0};
+
+    __cpuid(regs, 0x80000000);
+
+    if((unsigned)regs[0] < 0x80000007) {
+        return false;
+    }
+
+    __cpuid(regs, 0x80000007);
+
+    return (regs[3] & (1 << 8)) != 0;
+#elif HAVE_CPU_CYCLES
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+
+    if(!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+
+    return (edx & (1 << 8)) != 0;
+#else
+    return false;
+#endif
+}
+
+
+status_t util_clock_use_tsc(bool enable)
+{
+    int64_t start_ns = 0;
+    int64_t end_ns = 0;
+    uint64_t start_cycles = 0;
+    uint64_t end_cycles = 0;
+    double hz = 0.0;
+
+    if(!enable) {
+        tsc_enabled = false;
+        return STATUS_OK;
+    }
+
+    if(!tsc_is_invariant()) {
+        warn("This CPU has no invariant TSC, staying on CLOCK_MONOTONIC!");
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    start_ns = util_time_mono_ns();
+    start_cycles = CPU_CYCLES();
+
+    /* spin rather than sleep, some hypervisors adjust the TSC across a halted CPU. */
+    do {
+        end_cycles = CPU_CYCLES();
+        end_ns = util_time_mono_ns();
+    } while(end_ns - start_ns < (int64_t)TSC_CALIBRATION_MS * 1000000);
+
+    hz = (double)(end_cycles - start_cycles) * 1000000000.0 / (double)(end_ns - start_ns);
+
+    if(hz < 100000000.0) {
+        warn("TSC rate of %.0f Hz is not believable, staying on CLOCK_MONOTONIC!", hz);
+        return STATUS_EXTERNAL_FAILURE;
+    }
+
+    tsc_mult = (uint64_t)((1000000000.0 * (double)((uint64_t)1 << TSC_SHIFT)) / hz);
+    tsc_resync_cycles = (uint64_t)hz;
+    tsc_enabled = true;
+
+    info("Using the TSC at %.3f MHz.", hz / 1000000.0);
+
+    return STATUS_OK;
+}
+
+
+bool util_clock_using_tsc(void)
+{
+    return tsc_enabled;
+}
+
+
+
+
+/*
+ * The virtual clock.
+ *
+ * Members are the threads that wait for deadlines: proactor loops and the
+ * I/O scheduler.  A member counts as idle while the activity count it
+ * reported against is still current.  When all of them are, the clock moves
+ * to the earliest deadline, the count is bumped so everyone looks again at
+ * the new time, and every member is woken.
+ */
+
+struct vclock_member_t {
+    bool active;
+    int64_t activity;
+    int64_t deadline_ns;
+    int64_t woken_activity;
+    util_vclock_wake_func_t wake;
+    void *wake_arg;
+};
+
+static mutex_t vclock_mutex;
+static cond_t vclock_cond;
+static int64_t vclock_activity = 1;
+static int vclock_num_waiting = 0;
+static struct vclock_member_t vclock_members[VCLOCK_MAX_MEMBERS];
+
+
+status_t util_vclock_enable(int64_t start_ns)
+{
+    if(vclock_enabled) {
+        warn("Virtual time is already enabled!");
+        return STATUS_NOT_ALLOWED;
+    }
+
+    if(start_ns <= 0) {
+        warn("Virtual time must start after zero!");
+        return STATUS_BAD_INPUT;
+    }
+
+    MUTEX_INIT(vclock_mutex);
+    COND_INIT(vclock_cond);
+
+    vclock_now_ns = start_ns;
+    vclock_enabled = true;
+
+    info("Using virtual time starting at %lld ns.", (long long)start_ns);
+
+    return STATUS_OK;
+}
+
+
+bool util_vclock_enabled(void)
+{
+    return vclock_enabled;
+}
+
+
+/* called with the mutex held. */
+static void vclock_try_advance(void)
+{
+    int64_t activity = ATOMIC_LOAD_I64(&vclock_activity);
+    int64_t next_ns = INT64_MAX;
+    int num_active = 0;
+    int num_stale = 0;
+
+    for(int i = 0; i < VCLOCK_MAX_MEMBERS; i++) {
+        struct vclock_member_t *member = &(vclock_members[i]);
+
+        if(!member->active) {
+            continue;
+        }
+
+        /*
+         * Somebody did something since this member last looked.  It may be
+         * blocked waiting, so wake it once to look again.
+         */
+        if(member->activity != activity) {
+            if(member->activity != 0 && member->woken_activity != activity) {
+                member->woken_activity = activity;
+
+                if(member->wake) {
+                    member->wake(member->wake_arg);
+                } else {
+                    COND_BROADCAST(vclock_cond);
+                }
+            }
+
+            num_stale++;
+            continue;
+        }
+
+        if(member->deadline_ns < next_ns) {
+            next_ns = member->deadline_ns;
+        }
+
+        num_active++;
+    }
+
+    /* nothing scheduled at all, or something is already due and about to run. */
+    if(num_stale > 0 || num_active == 0 || next_ns == INT64_MAX || next_ns <= ATOMIC_LOAD_I64(&vclock_now_ns)) {
+        return;
+    }
+
+    ATOMIC_STORE_I64(&vclock_now_ns, next_ns);
+    ATOMIC_ADD_I64(&vclock_activity, 1);
+
+    COND_BROADCAST(vclock_cond);
+
+    for(int i = 0; i < VCLOCK_MAX_MEMBERS; i++) {
+        struct vclock_member_t *member = &(vclock_members[i]);
+
+        if(member->active && member->wake) {
+            member->wake(member->wake_arg);
+        }
+    }
+}
+
+
+int util_vclock_join(util_vclock_wake_func_t wake, void *arg)
+{
+    int id = -1;
+
+    if(!vclock_enabled) {
+        return -1;
+    }
+
+    MUTEX_LOCK(vclock_mutex);
+
+    for(int i = 0; i < VCLOCK_MAX_MEMBERS; i++) {
+        if(!vclock_members[i].active) {
+            vclock_members[i].active = true;
+            vclock_members[i].activity = 0;
+            vclock_members[i].deadline_ns = INT64_MAX;
+            vclock_members[i].woken_activity = 0;
+            vclock_members[i].wake = wake;
+            vclock_members[i].wake_arg = arg;
+
+            id = i;
+            break;
+        }
+    }
+
+    MUTEX_UNLOCK(vclock_mutex);
+
+    if(id < 0) {
+        warn("No room for more than %d virtual time members!", VCLOCK_MAX_MEMBERS);
+    }
+
+    return id;
+}
+
+
+void util_vclock_leave(int id)
+{
+    if(!vclock_enabled || id < 0 || id >= VCLOCK_MAX_MEMBERS) {
+        return;
+    }
+
+    MUTEX_LOCK(vclock_mutex);
+
+    vclock_members[id].active = false;
+
+    /* the member that left may have been the last one holding time back. */
+    vclock_try_advance();
+
+    MUTEX_UNLOCK(vclock_mutex);
+}
+
+
+/* read this before looking for work, then report idle against it. */
+int64_t util_vclock_activity(void)
+{
+    return (vclock_enabled ? ATOMIC_LOAD_I64(&vclock_activity) : 0);
+}
+
+
+/* call after doing work, once any messages it sent have been handed to the kernel. */
+void util_vclock_busy(void)
+{
+    if(!vclock_enabled) {
+        return;
+    }
+
+    ATOMIC_ADD_I64(&vclock_activity, 1);
+
+    if(ATOMIC_LOAD_U32(&vclock_num_waiting) > 0) {
+        MUTEX_LOCK(vclock_mutex);
+        COND_BROADCAST(vclock_cond);
+        MUTEX_UNLOCK(vclock_mutex);
+    }
+}
+
+
+/*
+ * Report that member id found nothing to do and next needs to run at
+ * deadline_ns, INT64_MAX if never.  Returns false if there was activity
+ * since the count was read, in which case the member should look again
+ * without blocking.
+ */
+bool util_vclock_idle(int id, int64_t activity, int64_t deadline_ns)
+{
+    bool current = false;
+
+    if(!vclock_enabled || id < 0 || id >= VCLOCK_MAX_MEMBERS) {
+        return false;
+    }
+
+    MUTEX_LOCK(vclock_mutex);
+
+    vclock_members[id].activity = activity;
+    vclock_members[id].deadline_ns = deadline_ns;
+
+    current = (activity == ATOMIC_LOAD_I64(&vclock_activity));
+
+    if(current) {
+        vclock_try_advance();
+    }
+
+    MUTEX_UNLOCK(vclock_mutex);
+
+    return current;
+}
+
+
+/*
+ * Block until virtual time reaches deadline_ns, something else happens, or
+ * VCLOCK_POLL_MS pass in real time.  For members that do not have a proactor
+ * to wake.
+ */
+void util_vclock_wait(int64_t activity, int64_t deadline_ns)
+{
+    if(!vclock_enabled) {
+        return;
+    }
+
+    MUTEX_LOCK(vclock_mutex);
+
+    if(ATOMIC_LOAD_I64(&vclock_activity) == activity && ATOMIC_LOAD_I64(&vclock_now_ns) < deadline_ns) {
+        vclock_num_waiting++;
+        COND_WAIT_MS(vclock_cond, vclock_mutex, VCLOCK_POLL_MS);
+        vclock_num_waiting--;
+    }
+
+    MUTEX_UNLOCK(vclock_mutex);
+}
@@ -17,9 +17,89 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "shims.h"
+#include "status.h"
+
 extern int util_sleep_ms(int ms);
+
+/* wall clock time, only for stamping things with the time of day. */
 extern int64_t util_time_ms(void);
 
+/* CLOCK_MONOTONIC, or the nearest the platform has. */
+extern int64_t util_time_mono_ns(void);
+
+
+/*
+ * The clock everything that times, schedules or measures should use.
+ *
+ * util_clock_ns() reads the monotonic clock.  With the TSC enabled, it is
+ * read from the CPU time stamp counter instead, scaled by a calibrated rate
+ * and pulled back to CLOCK_MONOTONIC about once a second.
+ *
+ * util_clock_now_ns() is the time cached by the last util_clock_update() on
+ * this thread.  Proactor loops update it once per iteration, so callbacks
+ * can check as many deadlines as they like without reading a clock.
+ * Threads that do not run a loop must update it themselves.
+ *
+ * util_clock_real_ns() is the same clock, but it keeps running under virtual
+ * time.  Use it to measure how long work takes, not to schedule it.
+ */
+extern int64_t util_clock_ns(void);
+extern int64_t util_clock_real_ns(void);
+extern status_t util_clock_use_tsc(bool enable);
+extern bool util_clock_using_tsc(void);
+
+extern THREAD_LOCAL int64_t util_clock_cached_ns;
+
+static inline int64_t util_clock_update(void)
+{
+    util_clock_cached_ns = util_clock_ns();
+
+    return util_clock_cached_ns;
+}
+
+static inline int64_t util_clock_now_ns(void)
+{
+    return (util_clock_cached_ns ? util_clock_cached_ns : util_clock_update());
+}
+
+
+
+/*
+ * Virtual time.
+ *
+ * With virtual time enabled, util_clock_ns() stops following any real clock
+ * and returns a shared virtual time instead.  It only moves forward when
+ * every thread that joined is idle: each one reports the next deadline it
+ * cares about and the clock jumps straight to the earliest of them.
+ *
+ * A thread reports idle against the activity count it read before it last
+ * looked for work.  Anything that does work bumps the count with
+ * util_vclock_busy(), which voids every idle report made before it, so time
+ * cannot jump while a message is still on its way from one loop to another.
+ *
+ * Enable it before any threads start.
+ */
+#define VCLOCK_MAX_MEMBERS (64)
+
+/* the longest a member blocks in real time before looking again. */
+#define VCLOCK_POLL_MS (10)
+
+typedef void (*util_vclock_wake_func_t)(void *arg);
+
+extern status_t util_vclock_enable(int64_t start_ns);
+extern bool util_vclock_enabled(void);
+
+extern int util_vclock_join(util_vclock_wake_func_t wake, void *arg);
+extern void util_vclock_leave(int id);
+
+extern int64_t util_vclock_activity(void);
+extern void util_vclock_busy(void);
+extern bool util_vclock_idle(int id, int64_t activity, int64_t deadline_ns);
+extern void util_vclock_wait(int64_t activity, int64_t deadline_ns);
+
+
+
 static inline bool ptr_before(void *ptr, void *end) {
     if(ptr && end) {
         if((intptr_t)(ptr) < (intptr_t)(end)) {
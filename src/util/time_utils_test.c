@@ -0,0 +1,199 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/debug.h"
+#include "util/time_utils.h"
+#include "util/unit_test.h"
+
+
+/*
+ * Virtual time cannot be turned off once it is on, so the real clock is
+ * checked first and everything after runs under virtual time.  The members
+ * are all driven from this one thread, each report standing in for a loop
+ * that found nothing to do.
+ */
+
+#define START_NS (1000000000LL)
+
+static int wake_count[2];
+
+
+
+static void wake(void *arg)
+{
+    wake_count[(int)(intptr_t)arg]++;
+}
+
+
+static void test_real_clock(void)
+{
+    int64_t before = util_clock_ns();
+    int64_t after = util_clock_ns();
+
+    CHECK(!util_vclock_enabled());
+    CHECK(before > 0 && after >= before);
+
+    /* without virtual time there is nothing to join and nothing to report to. */
+    CHECK_EQ(util_vclock_join(NULL, NULL), -1);
+    CHECK_EQ(util_vclock_activity(), 0);
+    CHECK(!util_vclock_idle(0, 0, START_NS));
+}
+
+
+static void test_enable(void)
+{
+    CHECK_EQ(util_vclock_enable(0), STATUS_BAD_INPUT);
+    CHECK(!util_vclock_enabled());
+
+    CHECK_EQ(util_vclock_enable(START_NS), STATUS_OK);
+    CHECK(util_vclock_enabled());
+    CHECK_EQ(util_vclock_enable(START_NS), STATUS_NOT_ALLOWED);
+
+    CHECK_EQ(util_clock_ns(), START_NS);
+    CHECK_EQ(util_clock_update(), START_NS);
+    CHECK_EQ(util_clock_now_ns(), START_NS);
+
+    /* the real clock keeps going for the things that measure real time. */
+    CHECK(util_clock_real_ns() != START_NS);
+}
+
+
+/* time moves to the earliest deadline only once every member has reported against the current count. */
+static void test_advance(void)
+{
+    int a = util_vclock_join(wake, (void *)(intptr_t)0);
+    int b = util_vclock_join(wake, (void *)(intptr_t)1);
+    int64_t activity = 0;
+
+    CHECK(a >= 0 && b >= 0 && a != b);
+
+    activity = util_vclock_activity();
+
+    /* b has never reported, so it is not idle and there is nothing to wake it from. */
+    CHECK(util_vclock_idle(a, activity, START_NS + 5000));
+    CHECK_EQ(util_clock_ns(), START_NS);
+    CHECK_EQ(wake_count[1], 0);
+
+    CHECK(util_vclock_idle(b, activity, START_NS + 3000));
+    CHECK_EQ(util_clock_ns(), START_NS + 3000);
+    CHECK_EQ(wake_count[0], 1);
+    CHECK_EQ(wake_count[1], 1);
+
+    /* the jump bumped the count, so both reports are stale now. */
+    CHECK(util_vclock_activity() != activity);
+    activity = util_vclock_activity();
+
+    /* b is woken once to look again at the new count, however many times a reports. */
+    CHECK(util_vclock_idle(a, activity, START_NS + 5000));
+    CHECK(util_vclock_idle(a, activity, START_NS + 5000));
+    CHECK_EQ(wake_count[1], 2);
+    CHECK_EQ(util_clock_ns(), START_NS + 3000);
+
+    CHECK(util_vclock_idle(b, activity, START_NS + 4000));
+    CHECK_EQ(util_clock_ns(), START_NS + 4000);
+
+    util_vclock_leave(a);
+    util_vclock_leave(b);
+}
+
+
+/* work done after the count was read voids the report, so time cannot jump past it. */
+static void test_busy(void)
+{
+    int a = util_vclock_join(NULL, NULL);
+    int64_t now = util_clock_ns();
+    int64_t activity = util_vclock_activity();
+
+    util_vclock_busy();
+
+    CHECK(!util_vclock_idle(a, activity, now + 1000));
+    CHECK_EQ(util_clock_ns(), now);
+
+    /* looking again with the new count lets it go. */
+    CHECK(util_vclock_idle(a, util_vclock_activity(), now + 1000));
+    CHECK_EQ(util_clock_ns(), now + 1000);
+
+    /* a deadline already reached, or none at all, never moves the clock. */
+    CHECK(util_vclock_idle(a, util_vclock_activity(), now));
+    CHECK(util_vclock_idle(a, util_vclock_activity(), INT64_MAX));
+    CHECK_EQ(util_clock_ns(), now + 1000);
+
+    /* a wait that is already satisfied does not block. */
+    util_vclock_wait(util_vclock_activity(), now + 1000);
+    util_vclock_wait(activity, INT64_MAX);
+
+    util_vclock_leave(a);
+}
+
+
+/* the member that leaves may be the last one holding time back. */
+static void test_leave(void)
+{
+    int a = util_vclock_join(NULL, NULL);
+    int b = util_vclock_join(NULL, NULL);
+    int64_t now = util_clock_ns();
+
+    CHECK(util_vclock_idle(a, util_vclock_activity(), now + 2000));
+    CHECK_EQ(util_clock_ns(), now);
+
+    util_vclock_leave(b);
+    CHECK_EQ(util_clock_ns(), now + 2000);
+
+    /* ids outside the table cannot report. */
+    CHECK(!util_vclock_idle(-1, util_vclock_activity(), now));
+    CHECK(!util_vclock_idle(VCLOCK_MAX_MEMBERS, util_vclock_activity(), now));
+
+    util_vclock_leave(a);
+}
+
+
+static void test_full(void)
+{
+    int ids[VCLOCK_MAX_MEMBERS];
+
+    for(int i = 0; i < VCLOCK_MAX_MEMBERS; i++) {
+        ids[i] = util_vclock_join(NULL, NULL);
+        CHECK(ids[i] >= 0);
+    }
+
+    CHECK_EQ(util_vclock_join(NULL, NULL), -1);
+
+    for(int i = 0; i < VCLOCK_MAX_MEMBERS; i++) {
+        util_vclock_leave(ids[i]);
+    }
+
+    /* slots are reused. */
+    ids[0] = util_vclock_join(NULL, NULL);
+    CHECK(ids[0] >= 0);
+    util_vclock_leave(ids[0]);
+}
+
+
+
+int main(void)
+{
+    debug_set_level(DEBUG_NONE);
+
+    test_real_clock();
+    test_enable();
+    test_advance();
+    test_busy();
+    test_leave();
+    test_full();
+
+    return UNIT_TEST_RESULT();
+}
@@ -0,0 +1,47 @@
+/***************************************************************************
+ *   Copyright (C) 2024 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ * This software is available under the Mozilla Public License version 2.0 *
+ *                                                                         *
+ * MPL 2.0:                                                                *
+ *                                                                         *
+ *   This Source Code Form is subject to the terms of the Mozilla Public   *
+ *   License, v. 2.0. If a copy of the MPL was not distributed with this   *
+ *   file, You can obtain one at http://mozilla.org/MPL/2.0/.              *
+ *                                                                         *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdio.h>
+
+
+/*
+ * Checks for the *_test.c programs run by ctest.  Each test is one
+ * translation unit with its own main().  A failed check prints where it
+ * was and the test carries on, so one run shows every failure.
+ */
+
+static int unit_test_failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            unit_test_failures++; \
+        } \
+    } while(0)
+
+#define CHECK_EQ(actual, expected) \
+    do { \
+        long long check_actual_ = (long long)(actual); \
+        long long check_expected_ = (long long)(expected); \
+        if(check_actual_ != check_expected_) { \
+            fprintf(stderr, "%s:%d: check failed: %s is %lld, expected %lld\n", __FILE__, __LINE__, #actual, check_actual_, check_expected_); \
+            unit_test_failures++; \
+        } \
+    } while(0)
+
+#define UNIT_TEST_RESULT() \
+    (unit_test_failures ? (fprintf(stderr, "%d check(s) failed.\n", unit_test_failures), 1) : 0)